@@ -0,0 +1,219 @@
+/**
+ Microbenchmarks of the KPM and Lanczos compute kernels
+
+ The kernels are timed on synthetic Hamiltonians (graphene and a 3D cubic lattice) for
+ all scalar types, the CSR, ELL, value table ELL, 16-bit offset ELL, split complex ELL,
+ quantized ELL (bfloat16 and 8-bit values) and Hermitian half-storage formats and the single
+ vector vs. `MatrixX` batch overloads. Each kernel is repeated for at least `min_time` seconds
+ and the best time of a repetition is reported. The output has one JSON object per line, e.g.
+
+     {"kernel": "kpm_spmv", "model": "graphene", "format": "ELL", "scalar": "float",
+      "cols": 8, "rows": 40000, "nnz": 160000, "seconds": 1.2e-4, "nnz_per_second": 1.3e9}
+
+ Usage: kernel_benchmarks [min_time=0.2] [size_factor=1]
+ */
+#include "fixtures.hpp"
+
+#include "compute/kernel_polynomial.hpp"
+#include "compute/lanczos.hpp"
+#include "numeric/deltaellmatrix.hpp"
+#include "numeric/ellmatrix.hpp"
+#include "numeric/hermitianmatrix.hpp"
+#include "numeric/hybmatrix.hpp"
+#include "numeric/quantizedellmatrix.hpp"
+#include "numeric/splitellmatrix.hpp"
+#include "numeric/tableellmatrix.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+using namespace cpb;
+
+namespace {
+
+struct Options {
+    double min_time = 0.2; ///< minimum total run time of each benchmark in seconds
+    int size_factor = 1; ///< scales the size of the synthetic systems
+};
+
+template<class scalar_t> char const* scalar_name();
+template<> char const* scalar_name<float>() { return "float"; }
+template<> char const* scalar_name<std::complex<float>>() { return "cfloat"; }
+template<> char const* scalar_name<double>() { return "double"; }
+template<> char const* scalar_name<std::complex<double>>() { return "cdouble"; }
+
+template<class scalar_t>
+char const* format_name(SparseMatrixX<scalar_t> const&) { return "CSR"; }
+template<class scalar_t>
+char const* format_name(num::EllMatrix<scalar_t> const&) { return "ELL"; }
+template<class scalar_t>
+char const* format_name(num::HermitianMatrix<scalar_t> const&) { return "HERMITIAN"; }
+template<class scalar_t>
+char const* format_name(num::TableEllMatrix<scalar_t> const&) { return "ELL_TABLE"; }
+template<class scalar_t>
+char const* format_name(num::DeltaEllMatrix<scalar_t> const&) { return "ELL_DELTA"; }
+template<class scalar_t>
+char const* format_name(num::SplitEllMatrix<scalar_t> const&) { return "ELL_SPLIT"; }
+template<class scalar_t>
+char const* format_name(num::QuantizedEllMatrix<scalar_t> const& m) {
+    return m.precision == num::ValuePrecision::BF16 ? "ELL_BF16" : "ELL_INT8";
+}
+template<class scalar_t>
+char const* format_name(num::HybMatrix<scalar_t> const&) { return "HYB"; }
+
+/// Keep the compiler from removing the benchmarked computations
+template<class T>
+void do_not_optimize(T const& value) {
+    static volatile char sink;
+    sink = *reinterpret_cast<char const volatile*>(&value);
+}
+
+/// Return the best time of a single call to `f()` in seconds
+template<class F>
+double best_time(Options const& opt, F f) {
+    using Clock = std::chrono::high_resolution_clock;
+    auto best = std::numeric_limits<double>::max();
+    auto total = 0.0;
+    auto num_calls = 1;
+
+    while (total < opt.min_time) {
+        auto const start = Clock::now();
+        for (auto i = 0; i < num_calls; ++i) { f(); }
+        auto const elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+        best = std::min(best, elapsed / num_calls);
+        total += elapsed;
+        if (elapsed < 1e-3) { num_calls *= 2; } // amortize the clock overhead
+    }
+    return best;
+}
+
+struct Report {
+    std::string model;
+    idx_t rows;
+    idx_t nnz;
+
+    void operator()(char const* kernel, char const* format, char const* scalar,
+                    idx_t cols, double seconds) const {
+        auto const nnz_per_second = static_cast<double>(nnz * cols) / seconds;
+        std::cout << fmt::format("{{\"kernel\": \"{}\", \"model\": \"{}\", \"format\": \"{}\", "
+                                 "\"scalar\": \"{}\", \"cols\": {}, \"rows\": {}, \"nnz\": {}, "
+                                 "\"seconds\": {:.4e}, \"nnz_per_second\": {:.4e}}}\n",
+                                 kernel, model, format, scalar, cols, rows, nnz, seconds,
+                                 nnz_per_second);
+    }
+};
+
+/// `kpm_spmv` and `kpm_spmv_diagonal` for the single vector and batch overloads
+template<class Matrix>
+void kpm_kernels(Options const& opt, Report const& report, Matrix const& h2) {
+    using scalar_t = typename Matrix::Scalar;
+    constexpr auto batch_size = static_cast<idx_t>(simd::traits<scalar_t>::size);
+    auto const rows = h2.rows();
+    auto const format = format_name(h2);
+    auto const scalar = scalar_name<scalar_t>();
+
+    {
+        auto const x = VectorX<scalar_t>::Constant(rows, scalar_t{0.5f}).eval();
+        auto y = VectorX<scalar_t>::Zero(rows).eval();
+        auto const t = best_time(opt, [&]{
+            compute::kpm_spmv(0, rows, h2, x, y);
+            do_not_optimize(y[0]);
+        });
+        report("kpm_spmv", format, scalar, 1, t);
+
+        auto const t_diag = best_time(opt, [&]{
+            auto m2 = scalar_t{0}, m3 = scalar_t{0};
+            compute::kpm_spmv_diagonal(0, rows, h2, x, y, m2, m3);
+            do_not_optimize(m3);
+        });
+        report("kpm_spmv_diagonal", format, scalar, 1, t_diag);
+    }
+
+    {
+        auto const x = MatrixX<scalar_t>::Constant(rows, batch_size, scalar_t{0.5f}).eval();
+        auto y = MatrixX<scalar_t>::Zero(rows, batch_size).eval();
+        auto const t = best_time(opt, [&]{
+            compute::kpm_spmv(0, rows, h2, x, y);
+            do_not_optimize(y(0, 0));
+        });
+        report("kpm_spmv", format, scalar, batch_size, t);
+
+        auto const t_diag = best_time(opt, [&]{
+            auto m2 = simd::array<scalar_t>{{0}}, m3 = simd::array<scalar_t>{{0}};
+            compute::kpm_spmv_diagonal(0, rows, h2, x, y, m2, m3);
+            do_not_optimize(m3[0]);
+        });
+        report("kpm_spmv_diagonal", format, scalar, batch_size, t_diag);
+    }
+}
+
+/// `lanczos_spmv` (CSR only) and `lanczos_axpy`
+template<class scalar_t>
+void lanczos_kernels(Options const& opt, Report const& report,
+                     SparseMatrixX<scalar_t> const& h) {
+    using real_t = num::get_real_t<scalar_t>;
+    auto const rows = h.rows();
+    auto const scalar = scalar_name<scalar_t>();
+
+    auto const v1 = VectorX<scalar_t>::Constant(rows, scalar_t{0.5f}).eval();
+    auto v0 = VectorX<scalar_t>::Zero(rows).eval();
+    auto const t_spmv = best_time(opt, [&]{
+        do_not_optimize(compute::lanczos_spmv(real_t{0.5f}, h, v1, v0));
+    });
+    report("lanczos_spmv", "CSR", scalar, 1, t_spmv);
+
+    auto const t_axpy = best_time(opt, [&]{
+        do_not_optimize(compute::lanczos_axpy(real_t{1e-3f}, v1, v0));
+    });
+    auto const dense_report = Report{report.model, rows, /*nnz*/rows}; // no matrix involved
+    dense_report("lanczos_axpy", "dense", scalar, 1, t_axpy);
+}
+
+/// Scale the Hamiltonian so that the KPM vectors stay bounded over many repetitions
+SparseMatrixX<float> scaled(SparseMatrixX<float> h) {
+    auto values = Eigen::Map<ArrayXf>(h.valuePtr(), h.nonZeros());
+    values /= 2 * values.abs().maxCoeff() * static_cast<float>(sparse::max_nnz_per_row(h));
+    return h;
+}
+
+template<class scalar_t>
+void run_all(Options const& opt, Report const& report, SparseMatrixX<float> const& h2) {
+    auto const csr = SparseMatrixX<scalar_t>(h2.cast<scalar_t>());
+    kpm_kernels(opt, report, csr);
+    kpm_kernels(opt, report, num::csr_to_ell(csr));
+    kpm_kernels(opt, report, num::csr_to_hermitian(csr));
+    kpm_kernels(opt, report, num::csr_to_table_ell(csr)); // the pristine models always fit
+    kpm_kernels(opt, report, num::csr_to_delta_ell(csr));
+    if (num::is_complex<scalar_t>()) { kpm_kernels(opt, report, num::csr_to_split_ell(csr)); }
+    if (!num::is_complex<scalar_t>()) {
+        kpm_kernels(opt, report, num::csr_to_quantized_ell(csr, num::ValuePrecision::BF16));
+        kpm_kernels(opt, report, num::csr_to_quantized_ell(csr, num::ValuePrecision::INT8));
+    }
+    kpm_kernels(opt, report, num::csr_to_hyb(csr, num::row_length_percentile(csr, 0.95)));
+    lanczos_kernels(opt, report, csr);
+}
+
+void run_model(Options const& opt, std::string const& name, Model const& model) {
+    auto const h2 = scaled(ham::get_reference<float>(model.hamiltonian()));
+    auto const report = Report{name, h2.rows(), h2.nonZeros()};
+
+    run_all<float>(opt, report, h2);
+    run_all<std::complex<float>>(opt, report, h2);
+    run_all<double>(opt, report, h2);
+    run_all<std::complex<double>>(opt, report, h2);
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[]) {
+    auto opt = Options{};
+    if (argc > 1) { opt.min_time = std::atof(argv[1]); }
+    if (argc > 2) { opt.size_factor = std::max(std::atoi(argv[2]), 1); }
+
+    auto const n = opt.size_factor;
+    run_model(opt, "graphene", Model(graphene::monolayer(), Primitive(200 * n, 100)));
+    run_model(opt, "cubic", Model(lattice::cubic(), Primitive(40 * n, 40, 25)));
+    return 0;
+}
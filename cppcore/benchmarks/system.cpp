@@ -0,0 +1,262 @@
+/**
+ Benchmarks of the system and Hamiltonian build stages
+
+ Each stage of `Model::system()` and `Model::hamiltonian()` is timed separately for 2D,
+ 3D, multi-orbital, periodic and generator-based models at several sizes and thread counts:
+
+ - `foundation`: `Foundation` construction (for a shape, it includes `remove_dangling()`)
+ - `remove_dangling`: the same after a few sites are removed from the foundation
+ - `populate_system`: the system from the foundation
+ - `populate_system_shape`: the direct path from the shape without a `Foundation`
+ - `populate_boundaries`: the periodic boundary hoppings
+ - `remove_invalid`: compacting the system after a few sites are marked invalid
+ - `hamiltonian`: the first build, i.e. a new `BuildPattern` (or Bloch cache if periodic)
+ - `hamiltonian_rebuild`: the fast path which reuses the pattern of the previous build
+ - `hamiltonian_at_k`: completing a periodic Hamiltonian from the Bloch cache
+ - `model`: everything above (and the structure modifiers) via `Model::eval()`
+
+ Each stage is repeated for at least `min_time` seconds and the best time of a repetition is
+ reported. The untimed preparation of the input (e.g. a fresh copy of the system) is excluded.
+ The output has one JSON object per line, e.g.
+
+     {"stage": "populate_system", "model": "graphene", "size": 2, "threads": 4,
+      "sites": 61448, "hoppings": 91806, "seconds": 1.2e-3, "sites_per_second": 5.1e7}
+
+ Usage: system_benchmarks [min_time=0.2] [size_factor=1] [max_threads=all]
+ */
+#include "fixtures.hpp"
+
+#include "Model.hpp"
+#include "hamiltonian/Hamiltonian.hpp"
+#include "support/cppfuture.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <thread>
+using namespace cpb;
+
+namespace {
+
+struct Options {
+    double min_time = 0.2; ///< minimum total run time of each benchmark in seconds
+    int size_factor = 1; ///< scales the size of the models
+    int max_threads = 1; ///< the thread counts are the powers of 2 up to this number
+};
+
+/// Keep the compiler from removing the benchmarked computations
+template<class T>
+void do_not_optimize(T const& value) {
+    static volatile char sink;
+    sink = *reinterpret_cast<char const volatile*>(&value);
+}
+
+/// Return the best time of a single call to `f()` in seconds, `setup()` is called before
+/// each call of `f()` but it's not timed
+template<class Setup, class F>
+double best_time(Options const& opt, Setup setup, F f) {
+    using Clock = std::chrono::high_resolution_clock;
+    auto best = std::numeric_limits<double>::max();
+    auto total = 0.0;
+
+    while (total < opt.min_time) {
+        setup();
+        auto const start = Clock::now();
+        f();
+        auto const elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+        best = std::min(best, elapsed);
+        total += elapsed;
+    }
+    return best;
+}
+
+template<class F>
+double best_time(Options const& opt, F f) { return best_time(opt, []{}, f); }
+
+struct Report {
+    std::string model;
+    int size;
+    idx_t threads;
+    idx_t sites;
+    idx_t hoppings;
+
+    void operator()(char const* stage, double seconds) const {
+        auto const sites_per_second = static_cast<double>(sites) / seconds;
+        std::cout << fmt::format("{{\"stage\": \"{}\", \"model\": \"{}\", \"size\": {}, "
+                                 "\"threads\": {}, \"sites\": {}, \"hoppings\": {}, "
+                                 "\"seconds\": {:.4e}, \"sites_per_second\": {:.4e}}}\n",
+                                 stage, model, size, threads, sites, hoppings, seconds,
+                                 sites_per_second);
+    }
+};
+
+/// Every `n`-th element is `false`
+ArrayX<bool> holes(ArrayX<bool> states, idx_t n) {
+    for (auto i = idx_t{0}; i < states.size(); i += n) { states[i] = false; }
+    return states;
+}
+
+/// Long range hoppings between the two halves of the system, there are `num_sites / 2`
+cpb::HoppingGenerator long_range_hopping() {
+    return {"t_long", 0.1, [](System const& s) {
+        auto const half = static_cast<int>(s.num_sites() / 2);
+        auto const from = ArrayXi::LinSpaced(half, 0, half - 1).eval();
+        return HoppingGenerator::Result{from, (from + half).eval()};
+    }};
+}
+
+/// The `hamiltonian*` stages of the built system of the `model`
+template<class scalar_t>
+void hamiltonian_stages(Options const& opt, Report const& report, Model const& model,
+                        bool simple_build) {
+    auto const& system = *model.system();
+    auto const& lattice = model.get_lattice();
+    auto const modifiers = HamiltonianModifiers{};
+    auto const threads = report.threads;
+
+    if (!model.get_symmetry()) {
+        auto pattern = BuildPattern<scalar_t>();
+        report("hamiltonian", best_time(opt, [&]{ pattern = {}; }, [&]{
+            do_not_optimize(ham::make<scalar_t>(system, lattice, modifiers, simple_build,
+                                                pattern, threads));
+        }));
+        report("hamiltonian_rebuild", best_time(opt, [&]{
+            do_not_optimize(ham::make<scalar_t>(system, lattice, modifiers, simple_build,
+                                                pattern, threads));
+        }));
+    } else {
+        auto pattern = BuildPattern<scalar_t>();
+        report("hamiltonian", best_time(opt, [&]{ pattern = {}; }, [&]{
+            do_not_optimize(ham::make_bloch_cache<scalar_t>(system, lattice, modifiers,
+                                                            simple_build, pattern, threads));
+        }));
+        report("hamiltonian_rebuild", best_time(opt, [&]{
+            do_not_optimize(ham::make_bloch_cache<scalar_t>(system, lattice, modifiers,
+                                                            simple_build, pattern, threads));
+        }));
+        auto const cache = ham::make_bloch_cache<scalar_t>(system, lattice, modifiers,
+                                                           simple_build, pattern, threads);
+        report("hamiltonian_at_k", best_time(opt, [&]{
+            do_not_optimize(ham::make(*cache, Cartesian{0.1f, 0.2f, 0}));
+        }));
+    }
+}
+
+struct Case {
+    std::string name;
+    std::function<Model(int size)> make;
+    bool simple_build; ///< false if there are generators
+};
+
+void run_case(Options const& opt, Case const& c, int size, idx_t threads) {
+    auto model = c.make(size);
+    model.set_num_threads(threads);
+    auto const& built = *model.system();
+    auto const report = Report{c.name, size, threads, built.num_sites(),
+                               built.hopping_blocks.nnz()};
+
+    auto const& lattice = model.get_lattice();
+    auto const& shape = model.get_shape();
+    auto const& symmetry = model.get_symmetry();
+    auto const make_foundation = [&]{
+        return shape ? Foundation(lattice, shape, threads)
+                     : Foundation(lattice, model.get_primitive(), threads);
+    };
+
+    report("foundation", best_time(opt, [&]{ do_not_optimize(make_foundation().size()); }));
+
+    auto foundation = make_foundation();
+    auto const states = foundation.get_states();
+    auto const min_neighbors = std::max(lattice.get_min_neighbors(), 1);
+    report("remove_dangling", best_time(opt, [&]{ foundation.get_states() = holes(states, 16); },
+                                        [&]{ remove_dangling(foundation, min_neighbors); }));
+    foundation.get_states() = states;
+    if (symmetry) { symmetry.apply(foundation); }
+
+    auto const& sites = model.get_site_registry();
+    auto const& hoppings = model.get_hopping_registry();
+    auto system = std::unique_ptr<System>();
+    auto const fresh = [&]{ system = std14::make_unique<System>(sites, hoppings); };
+    report("populate_system", best_time(opt, fresh, [&]{
+        detail::populate_system(*system, foundation);
+    }));
+
+    if (shape && !symmetry) {
+        report("populate_system_shape", best_time(opt, fresh, [&]{
+            detail::populate_system(*system, lattice, shape, threads);
+        }));
+    }
+
+    if (symmetry) {
+        fresh();
+        detail::populate_system(*system, foundation);
+        auto const populated = *system;
+        report("populate_boundaries", best_time(opt, [&]{ *system = populated; }, [&]{
+            detail::populate_boundaries(*system, foundation, symmetry);
+        }));
+    }
+
+    {
+        auto invalid = built;
+        invalid.is_valid = holes(ArrayX<bool>::Constant(built.num_sites(), true), 16);
+        report("remove_invalid", best_time(opt, [&]{ *system = invalid; }, [&]{
+            detail::remove_invalid(*system, threads);
+        }));
+    }
+
+    if (model.is_complex()) {
+        hamiltonian_stages<std::complex<float>>(opt, report, model, c.simple_build);
+    } else {
+        hamiltonian_stages<float>(opt, report, model, c.simple_build);
+    }
+
+    report("model", best_time(opt, [&]{
+        auto m = c.make(size);
+        m.set_num_threads(threads);
+        do_not_optimize(m.eval().hamiltonian());
+    }));
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[]) {
+    auto opt = Options{};
+    opt.max_threads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    if (argc > 1) { opt.min_time = std::atof(argv[1]); }
+    if (argc > 2) { opt.size_factor = std::max(std::atoi(argv[2]), 1); }
+    if (argc > 3) { opt.max_threads = std::max(std::atoi(argv[3]), 1); }
+    auto const n = static_cast<float>(opt.size_factor);
+
+    auto const cases = std::vector<Case>{
+        {"graphene", [n](int s) {
+            return Model(graphene::monolayer(), shape::rectangle(20 * n * s, 20 * n * s));
+        }, true},
+        {"cubic", [n](int s) {
+            auto const k = static_cast<int>(12 * n * s);
+            return Model(lattice::cubic(), Primitive(k, k, k));
+        }, true},
+        {"multiorbital", [n](int s) {
+            auto const k = static_cast<int>(50 * n * s);
+            return Model(lattice::square_multiorbital(), Primitive(k, k));
+        }, true},
+        {"periodic", [n](int s) {
+            auto const k = static_cast<int>(100 * n * s);
+            return Model(graphene::monolayer(), Primitive(k, k), TranslationalSymmetry(1, 1));
+        }, true},
+        {"generator", [n](int s) {
+            return Model(graphene::monolayer(), shape::rectangle(20 * n * s, 20 * n * s),
+                         long_range_hopping());
+        }, false},
+    };
+
+    for (auto const& c : cases) {
+        for (auto const size : {1, 2, 4}) {
+            for (auto threads = 1; threads <= opt.max_threads; threads *= 2) {
+                run_case(opt, c, size, threads);
+            }
+        }
+    }
+    return 0;
+}
@@ -96,30 +96,6 @@ public:
     index_t const* indices() const { return thr::raw_pointer_cast(_indices.data()); }
 };
 
-/**
- Return the KPM r0 vector with all zeros except for the source index
- */
-template<class Matrix, class thr_scalar_t = typename Matrix::ThrustScalar>
-thr::device_vector<thr_scalar_t> make_r0(Matrix const& h2, int i) {
-    auto r0 = thr::device_vector<thr_scalar_t>(h2.rows(), thr_scalar_t{0});
-    r0[i] = thr_scalar_t{1};
-    return r0;
-}
-
-/**
- Return the KPM r1 vector which is equal to the Hamiltonian matrix column at the source index
- */
-template<class scalar_t, class thr_scalar_t = num::get_thrust_t<scalar_t>>
-thr::device_vector<thr_scalar_t> make_r1(num::EllConstRef<scalar_t> const& h2, int i) {
-    auto r1 = thr::host_vector<thr_scalar_t>(h2.rows, thr_scalar_t{0});
-    for (auto n = 0; n < h2.nnz_per_row; ++n) {
-        auto const col = h2.indices[i + n * h2.pitch];
-        auto const value = h2.data()[i + n * h2.pitch];
-        r1[col] = num::conjugate(value) * scalar_t{0.5};
-    }
-    return r1;
-}
-
 /**
  GPU function component of the KPM compute kernel for ELLPACK matrix
 
@@ -182,44 +158,18 @@ void kpm_kernel(int start, int end, EllMatrix<scalar_t> const& ell,
 }
 
 template<class scalar_t>
-thr::host_vector<scalar_t> 
-I<scalar_t>::calc_diag_moments0(num::EllConstRef<scalar_t> ellref, int i, int num_moments) {
-    auto const h2 = EllMatrix<scalar_t>(ellref);    
-    auto r0 = make_r0(h2, i);
-    auto r1 = make_r1(ellref, i);
-
+thr::host_vector<scalar_t>
+I<scalar_t>::calc_diag_moments(num::EllConstRef<scalar_t> ellref,
+                               thr::host_vector<scalar_t> const& host_r0,
+                               thr::host_vector<scalar_t> const& host_r1, int num_moments,
+                               std::vector<int> const& sizes) {
     using thr_scalar_t = num::get_thrust_t<scalar_t>;
-    auto const m0 = static_cast<thr_scalar_t>(r0[i]) * real_t{0.5};
-    auto const m1 = static_cast<thr_scalar_t>(r1[i]);
-
-    auto moments = thr::host_vector<scalar_t>(num_moments);
-    moments[0] = m0;
-    moments[1] = m1;
-    
-    auto const size = h2.rows();
-    assert(num_moments % 2 == 0);
-    for (auto n = 2; n <= num_moments / 2; ++n) {
-        cuda::kpm_kernel(0, size, h2, r1, r0);
-        r1.swap(r0);
-        
-        moments[2 * (n - 1)] = real_t{2} * (squared_norm(0, size, r0) - m0);       
-        moments[2 * (n - 1) + 1] = real_t{2} * dotc(0, size, r0, r1) - m1;
-    }
-    
-    return moments;
-}
+    auto const h2 = EllMatrix<scalar_t>(ellref);
+    auto r0 = thr::device_vector<thr_scalar_t>(host_r0.begin(), host_r0.end());
+    auto r1 = thr::device_vector<thr_scalar_t>(host_r1.begin(), host_r1.end());
 
-template<class scalar_t>
-thr::host_vector<scalar_t> 
-I<scalar_t>::calc_diag_moments1(num::EllConstRef<scalar_t> ellref, int i, int num_moments,
-                                kpm::OptimizedSizes const& sizes) {
-    auto const h2 = EllMatrix<scalar_t>(ellref);    
-    auto r0 = make_r0(h2, i);
-    auto r1 = make_r1(ellref, i);
-
-    using thr_scalar_t = num::get_thrust_t<scalar_t>;
-    auto const m0 = static_cast<thr_scalar_t>(r0[i]) * real_t{0.5};
-    auto const m1 = static_cast<thr_scalar_t>(r1[i]);
+    auto const m0 = squared_norm(0, h2.rows(), r0) * real_t{0.5};
+    auto const m1 = dotc(0, h2.rows(), r1, r0);
 
     auto moments = thr::host_vector<scalar_t>(num_moments);
     moments[0] = m0;
@@ -227,12 +177,14 @@ I<scalar_t>::calc_diag_moments1(num::EllConstRef<scalar_t> ellref, int i, int nu
 
     assert(num_moments % 2 == 0);
     for (auto n = 2; n <= num_moments / 2; ++n) {
-        auto const opt_size = sizes.optimal(n, num_moments);
-        cuda::kpm_kernel(0, opt_size, h2, r1, r0);
+        auto const size = sizes.empty() ? h2.rows() : sizes[n - 2];
+        auto const m2 = squared_norm(0, size, r1);
+        cuda::kpm_kernel(0, size, h2, r1, r0); // r0 = h2 * r1 - r0
+        auto const m3 = dotc(0, size, r0, r1);
         r1.swap(r0);
-        
-        moments[2 * (n - 1)] = real_t{2} * (squared_norm(0, opt_size, r0) - m0);       
-        moments[2 * (n - 1) + 1] = real_t{2} * dotc(0, opt_size, r0, r1) - m1;
+
+        moments[2 * (n - 1)] = real_t{2} * (m2 - m0);
+        moments[2 * (n - 1) + 1] = real_t{2} * m3 - m1;
     }
 
     return moments;
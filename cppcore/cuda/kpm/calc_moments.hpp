@@ -1,10 +1,10 @@
 #pragma once
-#include "kpm/OptimizedSizes.hpp"
-
 #include "detail/macros.hpp"
 #include "numeric/sparseref.hpp"
 #include "cuda/thrust.hpp"
 
+#include <vector>
+
 namespace cpb { namespace cuda {
 
 /**
@@ -22,20 +22,17 @@ class I {
     
 public:
     /**
-     Diagonal KPM moments -- reference implementation, no optimizations
-
-     Calculates moments for a single matrix element (i, i) on the main diagonal.
-     It's 1.5x to 2x times faster than the general version.
-     */
-    static thr::host_vector<scalar_t>
-        calc_diag_moments0(num::EllConstRef<scalar_t> ell, int i, int num_moments);
+     Diagonal KPM moments: `mu_n = <r0|Tn(H)|r0>`
 
-    /**
-     Diagonal KPM moments -- with reordering optimization (optimal system size for each iteration)
+     The starter `r0` and the following `r1 = h2 * r0 * 0.5` vectors are given in host memory.
+     If `sizes` is not empty, it contains the optimal system size for each iteration `n`
+     starting at `sizes[0]` for `n == 2` (reordering optimization, see `kpm::SliceMap`).
+     Otherwise, the full matrix is used for every iteration.
      */
     static thr::host_vector<scalar_t>
-        calc_diag_moments1(num::EllConstRef<scalar_t> ell, int i, int num_moments,
-                           kpm::OptimizedSizes const& sizes);
+        calc_diag_moments(num::EllConstRef<scalar_t> ell, thr::host_vector<scalar_t> const& r0,
+                          thr::host_vector<scalar_t> const& r1, int num_moments,
+                          std::vector<int> const& sizes);
 };
 
 CPB_EXTERN_TEMPLATE_CLASS(I)
@@ -0,0 +1,56 @@
+#pragma once
+#include "system/System.hpp"
+#include "hamiltonian/Hamiltonian.hpp"
+#include "numeric/mappedcsrmatrix.hpp"
+#include "support/variant.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace cpb {
+
+/**
+ Native binary container for a `System` and (optionally) its `Hamiltonian`
+
+ The file starts with a fixed header (magic, version, byte order) followed by sections which
+ are aligned to `binary::alignment` bytes and a table of named sections at the end:
+
+     site_registry, hopping_registry        names and energy matrices
+     positions.x, positions.y, positions.z  float[num_sites]
+     sublattices                            int32[3 * n]: alias ID, site count, orbital count
+     hoppings                               int64[2]: num_sites, num_families
+     hoppings.<family>                      COO pairs of int32 (row, col)
+     boundary.<n>.shift                     float[3]
+     boundary.<n>.hoppings.<family>         COO pairs of int32 (row, col)
+     hamiltonian                            int64[4]: scalar tag, rows, cols, nnz
+     hamiltonian.outer/inner/values         raw CSR arrays of the stored scalar type
+
+ Loading maps the file into memory (`mmap` on POSIX systems) and each section is copied
+ exactly once, straight into the final data structure.
+ */
+namespace binary {
+
+constexpr auto version = std::uint32_t{1};
+constexpr auto alignment = std::size_t{64};
+
+/// Contents loaded from a binary file: the Hamiltonian is empty if it wasn't saved
+struct Contents {
+    std::shared_ptr<System> system;
+    Hamiltonian hamiltonian;
+};
+
+/// Save the system and optionally the Hamiltonian (skipped if it's empty)
+void save(std::string const& filename, System const& system,
+          Hamiltonian const& hamiltonian = {});
+
+/// Load a file made by `save()`: throws `std::runtime_error` if it's not a valid container
+Contents load(std::string const& filename);
+
+/// Map the Hamiltonian of a file made by `save()` without loading it: the returned matrix
+/// reads the elements straight from the file (out-of-core), see `num::MappedCsrMatrix`.
+/// Throws `std::runtime_error` if the file doesn't contain a Hamiltonian.
+var::complex<num::MappedCsrMatrix> map_hamiltonian(std::string const& filename);
+
+} // namespace binary
+} // namespace cpb
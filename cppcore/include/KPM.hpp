@@ -1,8 +1,59 @@
 #pragma once
 #include "kpm/default/Compute.hpp"
+#include "kpm/CompactMap.hpp"
+
+#include <functional>
+#include <memory>
+#include <mutex>
 
 namespace cpb {
 
+namespace kpm {
+
+/// The unit cell neighbor pattern of a model which simply replicates the lattice `Primitive`.
+/// It's empty for shapes, symmetries or multi-orbital models. Any further deviations from
+/// translational invariance (e.g. modifiers) are detected by `OptimizedHamiltonian`.
+num::StencilPattern stencil_pattern(Model const& model);
+
+/// The BSR block size of a model: the greatest common divisor of the sublattice orbital
+/// counts. The orbitals of a site are consecutive so blocks never straddle two sites.
+idx_t bsr_block_size(Model const& model);
+
+/**
+ Memory predicted for a KPM calculation (in bytes), see `estimate_memory()`
+ */
+struct CalculationMemory {
+    MemoryEstimate model; ///< building the system and Hamiltonian
+    std::size_t matrix; ///< the optimized matrix, kept alongside the original Hamiltonian
+    std::size_t vectors; ///< the KPM vectors of all the concurrent jobs
+    std::size_t moments; ///< the collected moments
+
+    /// The system and Hamiltonian of the model stay alive during the calculation
+    std::size_t peak() const {
+        return std::max(model.peak(),
+                        model.system + model.hamiltonian + matrix + vectors + moments);
+    }
+};
+
+/// DOS curves with a name for each column, see `KPM::calc_sublattice_dos()`
+struct ProjectedDOS {
+    std::vector<std::string> names;
+    ArrayXXdCM data; ///< one column per name
+};
+
+/// Makes the model of disorder realization `n` of an ensemble, e.g. with a different seed
+/// of `builtin::anderson_disorder()`, see `KPM::ensemble_dos_moments()`
+using ModelFactory = std::function<Model(idx_t n)>;
+
+/// Predict the memory of a calculation of `num_moments` for each of `num_results` starting
+/// vectors (e.g. LDOS indices or random vectors) without building the model. The `dense`
+/// calculations (conductivity) keep all the Chebyshev vectors of a recursion instead of a few.
+/// `num_threads` is the number of concurrent jobs: -1 -> all cores.
+CalculationMemory estimate_memory(Model const& model, idx_t num_moments, idx_t num_results = 1,
+                                  bool dense = false, idx_t num_threads = -1);
+
+} // namespace kpm
+
 /**
  Kernel Polynomial Method calculation interface
  */
@@ -11,6 +62,8 @@ public:
     KPM(Model const& model, kpm::Compute const& compute = kpm::DefaultCompute{},
         kpm::Config const& config = {});
 
+    /// Must not be called while a calculation is running, unlike the calculations themselves
+    /// which may be called concurrently from several threads
     void set_model(Model const&);
     Model const& get_model() const { return model; }
     kpm::Core& get_core() { return core; }
@@ -21,31 +74,151 @@ public:
     ArrayXcd moments(idx_t num_moments, VectorXcd const& alpha, VectorXcd const& beta = {},
                      SparseMatrixXcd const& op = {}) const;
 
+    /// Moments for each pair of `alpha` and `beta` columns, see `kpm::Core::batch_moments()`
+    ArrayXXcd batch_moments(idx_t num_moments, MatrixXcd const& alpha,
+                            MatrixXcd const& beta = {}, SparseMatrixXcd const& op = {}) const;
+
     /// LDOS at the given position and sublattice for the energy range and broadening
     ArrayXXdCM calc_ldos(ArrayXd const& energy, double broadening, Cartesian position,
                          string_view sublattice = "", bool reduce = true) const;
-    /// LDOS for multiple positions determined by the given shape
+    /// The undamped moments of `calc_ldos()`: one column per orbital of the nearest site,
+    /// see `kpm::ExpansionMoments` for the reconstruction. The optional `checkpoint` is
+    /// for `extend_moments()`, see `kpm::Core::ldos_moments()`.
+    kpm::ExpansionMoments calc_ldos_moments(double broadening, Cartesian position,
+                                            string_view sublattice = "",
+                                            kpm::Checkpoint* checkpoint = nullptr) const;
+    /// LDOS for multiple positions determined by the given shape: one column per site. The
+    /// orbitals of multi-orbital sites are computed in the same batch and summed per site.
+    /// With `num_random > 0`, it's the stochastic estimate from that many random vectors,
+    /// see `kpm::Core::stochastic_ldos()`, which is much faster for large maps.
     ArrayXXdCM calc_spatial_ldos(ArrayXd const& energy, double broadening, Shape const& shape,
-                                 string_view sublattice = "") const;
+                                 string_view sublattice = "", idx_t num_random = 0) const;
+    /// Same as the exact `calc_spatial_ldos()` but only one site of each symmetry orbit is
+    /// computed and its LDOS is copied to the equivalent sites. The `operations` are rotation
+    /// or reflection matrices about the centroid of the system (empty: the candidates of
+    /// `planar_point_operations()`). Each one is used only if it maps every site onto a site
+    /// and leaves the Hamiltonian unchanged, so a field or disorder which breaks it is safe.
+    ArrayXXdCM calc_symmetric_spatial_ldos(ArrayXd const& energy, double broadening,
+                                           Shape const& shape,
+                                           std::vector<Eigen::Matrix3f> const& operations = {},
+                                           string_view sublattice = "") const;
+    /// Same as `calc_spatial_ldos()` but stored in reduced `precision`, see `kpm::CompactMap`.
+    /// The exact LDOS is compressed one chunk of sites at a time (`ldos_chunk_size`) as soon
+    /// as it's reconstructed. The stochastic estimate is compressed once it's complete.
+    kpm::CompactMap calc_compact_spatial_ldos(ArrayXd const& energy, double broadening,
+                                              Shape const& shape, kpm::MapPrecision precision,
+                                              string_view sublattice = "",
+                                              idx_t num_random = 0) const;
+
+    /// LDOS of every site, summed over its orbitals, from the probing vectors of sites more
+    /// than `distance` hoppings apart, see `kpm::Core::probing_ldos()`: one column per site
+    ArrayXXdCM calc_probing_ldos(ArrayXd const& energy, double broadening,
+                                 idx_t distance = 4) const;
 
-    /// DOS for the given energy range and broadening
-    ArrayXd calc_dos(ArrayXd const& energy, double broadening, idx_t num_random) const;
+    /// Local charge of every site, summed over its orbitals, for the Fermi-Dirac distribution
+    /// at the given chemical potential and temperature, see `kpm::Core::local_charge()`
+    ArrayXd calc_local_charge(double chemical_potential, double temperature, double broadening,
+                              idx_t num_random = 0) const;
+
+    /// DOS for the given energy range and broadening, see `kpm::Core::dos()`
+    ArrayXd calc_dos(ArrayXd const& energy, double broadening, idx_t num_random,
+                     double target_error = 0) const;
+    /// DOS projected onto sets of sites or orbitals from a single set of `num_random`
+    /// random vectors, see `kpm::Core::projected_dos()`: one column per mask. A mask of
+    /// `num_sites` selects whole sites (all of their orbitals) and a mask of
+    /// `hamiltonian_size` selects individual Hamiltonian indices.
+    ArrayXXdCM calc_projected_dos(ArrayXd const& energy, double broadening,
+                                  std::vector<ArrayX<bool>> const& masks,
+                                  idx_t num_random) const;
+    /// Same as `calc_projected_dos()` with one projection for each sublattice or, with
+    /// `orbitals`, for each orbital of each sublattice, named like "A" or "A[1]". They're
+    /// the Hamiltonian index ranges of `CompressedSublattices`.
+    kpm::ProjectedDOS calc_sublattice_dos(ArrayXd const& energy, double broadening,
+                                          idx_t num_random, bool orbitals = false) const;
+    /// The undamped moments of `calc_dos()`, see `kpm::ExpansionMoments`
+    kpm::ExpansionMoments calc_dos_moments(double broadening, idx_t num_random,
+                                           double target_error = 0,
+                                           kpm::Checkpoint* checkpoint = nullptr) const;
+    /// Error of the DOS moments of a lossy matrix format, see `kpm::Core::quantization_error()`
+    kpm::QuantizationError quantization_error(double broadening, idx_t num_random = 1) const;
+    /// DOS averaged over the Bloch Hamiltonians of a periodic model at all the `k_points`.
+    /// They're stacked into a single block-diagonal matrix which is computed in one KPM pass:
+    /// the energy bounds, the optimized matrix and the `num_random` vectors are shared
+    /// by all the k-points, i.e. each random vector samples every k-point.
+    ArrayXd calc_dos_k(ArrayXd const& energy, double broadening,
+                       std::vector<Cartesian> const& k_points, idx_t num_random) const;
+    /// Spectral function `A(k, E)` of plane waves on the site (orbital) positions, e.g. the
+    /// unfolded bands of a supercell: column `j` of the result is for `k_points[j]`
+    ArrayXXdCM calc_spectral_function(std::vector<Cartesian> const& k_points,
+                                      ArrayXd const& energy, double broadening) const;
+    /// Continue a DOS or LDOS calculation from its checkpoint, see `kpm::Core::extend_moments()`
+    kpm::ExpansionMoments extend_moments(kpm::ExpansionMoments const& moments,
+                                         kpm::Checkpoint& checkpoint, idx_t num_moments) const;
+
+    /// DOS moments averaged over `num_realizations` models made by the `factory` (disorder
+    /// averaging). The Hamiltonian of realization `n + 1` is built on a separate thread while
+    /// the moments of realization `n` are computed. All the realizations share the reordering
+    /// and optimized matrix structure (if the sparsity pattern doesn't change) and the energy
+    /// bounds: the scaling factors of this model widened by the relative `bounds_margin`.
+    /// Throws if the spectrum of a realization doesn't fit within those bounds.
+    kpm::ExpansionMoments ensemble_dos_moments(kpm::ModelFactory const& factory,
+                                               idx_t num_realizations, double broadening,
+                                               idx_t num_random,
+                                               double bounds_margin = 0.05) const;
 
     /// Green's function matrix element (row, col) for the given energy range
     ArrayXcd calc_greens(idx_t row, idx_t col, ArrayXd const& energy, double broadening) const;
     /// Multiple Green's matrix elements for a single `row` and multiple `cols`
     std::vector<ArrayXcd> calc_greens_vector(idx_t row, std::vector<idx_t> const& cols,
                                              ArrayXd const& energy, double broadening) const;
+    /// The undamped moments of `calc_greens_vector()`: one column per `col`
+    kpm::ExpansionMoments calc_greens_moments(idx_t row, std::vector<idx_t> const& cols,
+                                              double broadening) const;
+
+    /// Green's matrix block G_ij for all `rows` and `cols` in a single KPM pass:
+    /// element `[i](j, k)` of the result is `G(rows[i], cols[j], energy[k])`
+    std::vector<ArrayXXcd> calc_greens_block(std::vector<idx_t> const& rows,
+                                             std::vector<idx_t> const& cols,
+                                             ArrayXd const& energy, double broadening) const;
 
     /// Kubo-Bastin conductivity in `direction` ("xx", "xy", etc.)
     ArrayXd calc_conductivity(ArrayXd const& chemical_potential, double broadening,
                               double temperature, string_view direction, idx_t num_random,
                               idx_t num_points) const;
+    /// Several conductivity tensor components (e.g. {"xx", "xy", "yy"}) computed from
+    /// the same random vectors: the Chebyshev recursions are shared between all of them
+    std::vector<ArrayXd> calc_conductivity(ArrayXd const& chemical_potential, double broadening,
+                                           double temperature,
+                                           std::vector<std::string> const& directions,
+                                           idx_t num_random, idx_t num_points) const;
+
+    /// Kubo-Greenwood conductivity in a longitudinal `direction` ("xx", "yy" or "zz") at zero
+    /// temperature, evaluated directly at the `chemical_potential` values with linear memory
+    ArrayXd calc_kubo_greenwood(ArrayXd const& chemical_potential, double broadening,
+                                string_view direction, idx_t num_random) const;
+
+    /// Time evolution `exp(-i * H * t) * psi0` of the columns of `psi0` for each of the `times`
+    std::vector<MatrixXcd> propagate(MatrixXcd const& psi0, ArrayXd const& times) const;
 
 private:
+    /// Record the time of a completed calculation
+    void set_calculation_time(Chrono const& timer) const;
+    /// The LDOS of each of the `sites` (summed over its orbitals) passed to the `sink`
+    /// in chunks of whole sites, see `calc_spatial_ldos()`
+    void spatial_ldos(std::vector<idx_t> const& sites, ArrayXd const& energy,
+                      double broadening, idx_t num_random,
+                      kpm::Core::LdosSink const& sink) const;
+
+private:
+    /// Concurrent calculations share the `core`, see `kpm::Core`, and this timer
+    struct CalculationTimer {
+        std::mutex mutex;
+        Chrono last; ///< last calculation time
+    };
+
     Model model;
     mutable kpm::Core core;
-    mutable Chrono calculation_timer; ///< last calculation time
+    std::unique_ptr<CalculationTimer> calculation_timer;
 };
 
 } // namespace cpb
@@ -9,13 +9,39 @@
 #include "hamiltonian/HamiltonianModifiers.hpp"
 
 #include "utils/Chrono.hpp"
+#include "utils/Memory.hpp"
 #include "detail/sugar.hpp"
 
+#include <algorithm>
+#include <cstdint>
 #include <string>
 #include <vector>
 
 namespace cpb {
 
+/**
+ Memory predicted for building a `Model` (in bytes), see `Model::estimate_memory()`
+
+ The foundation is the bounding box of the shape, so the system numbers are upper bounds.
+ Site and hopping generators and leads are not included.
+ */
+struct MemoryEstimate {
+    idx_t num_sites; ///< sites of the foundation
+    idx_t hamiltonian_size; ///< rows of the Hamiltonian matrix
+    idx_t hamiltonian_nnz; ///< non-zeros of the Hamiltonian matrix
+    std::size_t scalar_size; ///< bytes per element of the Hamiltonian matrix
+    std::size_t foundation;
+    std::size_t system;
+    std::size_t hamiltonian;
+    std::size_t hamiltonian_build; ///< temporary buffers of the Hamiltonian assembly
+
+    /// The most memory which is alive at the same time: the foundation with the system,
+    /// or the system with the Hamiltonian and its build buffers
+    std::size_t peak() const {
+        return std::max(foundation + system, system + hamiltonian + hamiltonian_build);
+    }
+};
+
 class Model {
 public:
     Model(Lattice const& lattice);
@@ -42,6 +68,15 @@ public: // add parameters
     void add(HoppingGenerator const& g);
 
     void set_wave_vector(Cartesian const& k);
+    /// Threads used to build the system and Hamiltonian: -1 -> all cores [default]. Only large
+    /// systems are built concurrently and the Hamiltonian also requires thread-safe modifiers
+    /// (Python modifiers are not). Structure modifiers are always applied sequentially.
+    void set_num_threads(idx_t n) { num_threads = n; }
+    /// Save built systems in `directory` and load them from there instead of building again.
+    /// The files are named by `structure_hash()`. Functions can't be hashed, so `key` must
+    /// identify the shape's `contains` function and all structure modifier functions. An empty
+    /// `directory` disables the cache [default]. Models with leads are always built.
+    void set_system_cache(std::string directory, std::string key = "");
 
 public:
     /// Are any of the onsite or hopping energies given as matrices instead of scalars?
@@ -62,20 +97,42 @@ public: // get parameters
 public: // get properties
     std::shared_ptr<System const> const& system() const;
     Hamiltonian const& hamiltonian() const;
-    /// Return all leads
+    /// The Hamiltonian at wave vector `k` without changing the model: only the boundary
+    /// hoppings are rebuilt. Safe to call from multiple threads after `hamiltonian()`.
+    Hamiltonian hamiltonian_at(Cartesian const& k) const;
+    /// Return all leads: the Hamiltonians of the leads which haven't been built yet are
+    /// built now, concurrently if the modifiers are thread-safe
     Leads const& leads() const;
-    /// Return lead at index
-    Lead lead(size_t i) const { return leads()[i]; }
+    /// Return lead at index: only the Hamiltonian of this lead is built
+    Lead lead(size_t i) const;
+
+    /// A copy of this model without Hamiltonian modifiers which shares the built `System` (it's
+    /// built now if needed). Adding new Hamiltonian modifiers to the copy creates a different
+    /// Hamiltonian for the same structure. The system is never modified: adding a structure
+    /// parameter to the copy builds a new system only for the copy.
+    Model with_shared_system() const;
 
     /// The model properties listed above are usually evaluated lazily, only as needed.
     /// Calling this function will evaluate the entire model ahead of time. Always returns itself.
     Model const& eval() const;
+    /// Evaluate the system and the Hamiltonian like `eval()`, but not the leads: they are
+    /// built only once they are requested. Always returns itself.
+    Model const& eval_hamiltonian() const;
 
 public: // get information
     /// Report of the last build operation: system and Hamiltonian
     std::string report();
     double system_build_seconds() const { return system_build_time.elapsed_seconds(); }
     double hamiltonian_build_seconds() const { return hamiltonian_build_time.elapsed_seconds(); }
+    /// Memory held by the results of the last build and how much each one raised the peak
+    MemoryUsage foundation_memory_usage() const { return foundation_memory; }
+    MemoryUsage system_memory_usage() const { return system_memory; }
+    MemoryUsage hamiltonian_memory_usage() const { return hamiltonian_memory; }
+    /// Predict the memory needed to build the system and Hamiltonian without building them
+    MemoryEstimate estimate_memory() const;
+    /// Hash of the structural inputs: lattice, registries, primitive, shape vertices, symmetry,
+    /// the kinds of structure modifiers and the user key given to `set_system_cache()`
+    std::uint64_t structure_hash() const;
 
 public:
     void clear_structure_modifiers() { structure_modifiers.clear(); }
@@ -84,6 +141,8 @@ public:
 
 private:
     std::shared_ptr<System> make_system() const;
+    /// Load the system from the cache directory or build it and add it to the cache
+    std::shared_ptr<System> cached_system() const;
     Hamiltonian make_hamiltonian() const;
 
     /// Clear any existing structural data, implies clearing Hamiltonian
@@ -100,15 +159,23 @@ private:
     Shape shape;
     TranslationalSymmetry symmetry;
     Cartesian wave_vector = {0, 0, 0};
+    idx_t num_threads = -1;
+    std::string system_cache_directory;
+    std::string system_cache_key;
 
     std::vector<StructureModifier> structure_modifiers;
     HamiltonianModifiers hamiltonian_modifiers;
 
     mutable std::shared_ptr<System const> _system;
     mutable Hamiltonian _hamiltonian;
+    mutable var::complex<BlochCacheRC> _bloch_cache; ///< reused by `set_wave_vector()`
+    mutable var::complex<BuildPattern> _build_pattern; ///< reused until the structure changes
     mutable Leads _leads;
     mutable Chrono system_build_time;
     mutable Chrono hamiltonian_build_time;
+    mutable MemoryUsage foundation_memory = {};
+    mutable MemoryUsage system_memory = {};
+    mutable MemoryUsage hamiltonian_memory = {};
     mutable bool complex_override = false; ///< set if a modifier was found to (dynamically)
                                            ///< return complex output for real input data
 };
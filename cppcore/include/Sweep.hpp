@@ -0,0 +1,93 @@
+#pragma once
+#include "KPM.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace cpb {
+
+/// Values of the named parameters at one point of a sweep
+using SweepParameters = std::map<std::string, double>;
+
+/**
+ Points of a parameter sweep: one row of `points` per point and one column per parameter
+ */
+struct SweepGrid {
+    std::vector<std::string> names; ///< the parameter of each column of `points`
+    ArrayXXd points;
+
+    idx_t size() const { return points.rows(); }
+    /// The parameters of point `n`
+    SweepParameters at(idx_t n) const;
+};
+
+/// All the combinations of the `values` of each parameter (the cartesian product): the last
+/// parameter changes the fastest, like `itertools.product()` and a C-order `reshape()`
+SweepGrid make_sweep_grid(std::vector<std::string> const& names,
+                          std::vector<ArrayXd> const& values);
+
+/// Adds a Hamiltonian modifier to the `model` of a sweep point, made from its `parameters`
+struct SweepModifier {
+    std::function<void (Model& model, SweepParameters const& parameters)> apply;
+};
+
+namespace sweep {
+
+/// `builtin::onsite_expression()` with the sweep parameters as named constants next to the
+/// fixed `constants`. The expression is parsed for each point.
+SweepModifier onsite_expression(std::string const& expression,
+                                SweepParameters const& constants = {});
+/// `builtin::hopping_expression()` with the sweep parameters as named constants
+SweepModifier hopping_expression(std::string const& expression,
+                                 SweepParameters const& constants = {});
+/// `builtin::constant_magnetic_field()` with the magnitude given by the parameter `magnitude`
+SweepModifier constant_magnetic_field(std::string const& magnitude);
+/// `builtin::constant_electric_field()` along the unit vector `direction` with the
+/// magnitude [V/nm] given by the parameter `magnitude`
+SweepModifier constant_electric_field(std::string const& magnitude, Cartesian direction);
+/// `builtin::anderson_disorder()` with the width given by the parameter `width`
+SweepModifier anderson_disorder(std::string const& width, std::uint64_t seed = 0);
+/// `builtin::strained_hopping()` with the decay given by the parameter `beta`
+SweepModifier strained_hopping(std::string const& beta, double reference_length);
+
+} // namespace sweep
+
+/**
+ The KPM calculation of each point of a sweep
+ */
+struct SweepCalculation {
+    enum class Kind {
+        DOS, ///< stochastic DOS, see `KPM::calc_dos()`
+        LDOS ///< LDOS at a position summed over the orbitals, see `KPM::calc_ldos()`
+    };
+
+    Kind kind = Kind::DOS;
+    ArrayXd energy;
+    double broadening = 0;
+    idx_t num_random = 1; ///< only for the DOS
+    Cartesian position = Cartesian::Zero(); ///< only for the LDOS
+    std::string sublattice; ///< only for the LDOS: empty -> the nearest site of any sublattice
+    kpm::Config config; ///< the same for each point
+};
+
+/**
+ Build and compute every point of a parameter sweep natively, on a thread pool
+
+ Each point is a copy of `model` with the `modifiers` added for its parameters. The copies
+ share the system of `model` (built once, up front), so only the Hamiltonian is built for each
+ point, followed by the KPM `calculation`. The points are split among `num_threads` workers
+ (-1 -> all cores): with fewer points than threads, each point gets a share of the threads
+ for its Hamiltonian build and KPM compute. There are no per-point callbacks, unlike a Python
+ `parallel_for` which calls its producer with the GIL for every job. Python modifiers of the
+ `model` itself still work but they are serialized by the GIL.
+
+ Returns one column per point of the `grid` with one row per energy.
+ */
+ArrayXXdCM run_sweep(Model const& model, SweepGrid const& grid,
+                     std::vector<SweepModifier> const& modifiers,
+                     SweepCalculation const& calculation, idx_t num_threads = -1);
+
+} // namespace cpb
@@ -3,7 +3,9 @@
 
 #include <complex>
 
-namespace cpb { namespace compute { namespace detail {
+namespace cpb { namespace compute {
+CPB_ISA_NAMESPACE_BEGIN
+namespace detail {
 
 /**
  These functions are needed because std::complex<T> operator* does additional
@@ -40,4 +42,6 @@ real_t square(std::complex<real_t> a) {
     return a.real() * a.real() + a.imag() * a.imag();
 }
 
-}}} // namespace cpb::compute::detail
+} // namespace detail
+CPB_ISA_NAMESPACE_END
+}} // namespace cpb::compute
@@ -1,8 +1,10 @@
 #pragma once
 #include "numeric/dense.hpp"
+#include "detail/macros.hpp"
 #include <Eigen/Jacobi>
 
 namespace cpb { namespace compute {
+CPB_ISA_NAMESPACE_BEGIN
 
 namespace detail {
     template<class real_t>
@@ -89,4 +91,5 @@ inline ArrayX<scalar_t> tridiagonal_eigenvalues(const DenseBase<Derived>& alpha,
     return eigenvalues;
 }
 
+CPB_ISA_NAMESPACE_END
 }} // namespace cpb::compute
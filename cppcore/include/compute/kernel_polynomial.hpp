@@ -1,7 +1,18 @@
 #pragma once
 #include "numeric/dense.hpp"
 #include "numeric/sparse.hpp"
+#include "numeric/bsrmatrix.hpp"
+#include "numeric/deltaellmatrix.hpp"
 #include "numeric/ellmatrix.hpp"
+#include "numeric/hermitianmatrix.hpp"
+#include "numeric/hybmatrix.hpp"
+#include "numeric/mappedcsrmatrix.hpp"
+#include "numeric/multiellmatrix.hpp"
+#include "numeric/quantizedellmatrix.hpp"
+#include "numeric/sellmatrix.hpp"
+#include "numeric/splitellmatrix.hpp"
+#include "numeric/stencilmatrix.hpp"
+#include "numeric/tableellmatrix.hpp"
 #include "numeric/traits.hpp"
 
 #include "compute/detail.hpp"
@@ -9,6 +20,7 @@
 #include "support/simd.hpp"
 
 namespace cpb { namespace compute {
+CPB_ISA_NAMESPACE_BEGIN
 
 /**
  KPM-specialized sparse matrix-vector multiplication (CSR, off-diagonal)
@@ -119,12 +131,171 @@ void kpm_spmv(idx_t start, idx_t end, num::EllMatrix<scalar_t> const& matrix,
 
 #else // vectorized using SIMD intrinsics
 
+namespace detail {
+    /// The widest ELLPACK matrix which gets a kernel specialized for its `nnz_per_row`
+    constexpr auto max_fixed_ell_width = idx_t{16};
+
+    /// Call `f.template run<N>()` with `N == width` if `width` is in `[N, max_fixed_ell_width]`
+    template<idx_t N, class F> CPB_ALWAYS_INLINE
+    typename std::enable_if<(N > max_fixed_ell_width), bool>::type
+    with_fixed_width(idx_t, F const&) { return false; }
+
+    template<idx_t N, class F> CPB_ALWAYS_INLINE
+    typename std::enable_if<(N <= max_fixed_ell_width), bool>::type
+    with_fixed_width(idx_t width, F const& f) {
+        if (width == N) {
+            f.template run<N>();
+            return true;
+        }
+        return with_fixed_width<N + 1>(width, f);
+    }
+
+    /// A single row of `ell_spmv_fixed()`, for the peel and tail of the vectorized loop
+    template<idx_t N, bool diagonal, class scalar_t> CPB_ALWAYS_INLINE
+    void ell_row_fixed(idx_t row, scalar_t const* const* data, storage_idx_t const* const* idx,
+                       scalar_t const* px, scalar_t* py, scalar_t& m2, scalar_t& m3) {
+        auto r = -py[row];
+        for (auto n = idx_t{0}; n < N; ++n) {
+            r += mul(data[n][row], px[idx[n][row]]);
+        }
+        if (diagonal) {
+            m2 += square(px[row]);
+            m3 += mul(num::conjugate(r), px[row]);
+        }
+        py[row] = r;
+    }
+
+    /**
+     ELLPACK product for a compile-time `N == matrix.nnz_per_row`
+
+     The generic kernel makes one pass over `y` for each of the `nnz_per_row` columns. Here,
+     the inner loop has a constant trip count so it's fully unrolled: each row is accumulated
+     in a register and `y` is loaded and stored only once. With `diagonal == true`, the m2 and
+     m3 sums are fused into the same pass.
+     */
+    template<idx_t N, bool diagonal, class scalar_t> CPB_ALWAYS_INLINE
+    void ell_spmv_fixed(idx_t start, idx_t end, num::EllMatrix<scalar_t> const& matrix,
+                        VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                        scalar_t& m2, scalar_t& m3) {
+        using simd_register_t = simd::select_vector_t<scalar_t>;
+        static constexpr auto step = simd::traits<scalar_t>::size;
+
+        scalar_t const* data[N];
+        storage_idx_t const* idx[N];
+        for (auto n = idx_t{0}; n < N; ++n) {
+            data[n] = &matrix.data(0, n);
+            idx[n] = &matrix.indices(0, n);
+        }
+
+        auto const px = x.data();
+        auto const py = y.data();
+        auto const loop = simd::split_loop(py, start, end);
+        auto m2_vec = simd::make_float<simd_register_t>(0);
+        auto m3_vec = simd::make_float<simd_register_t>(0);
+
+        for (auto row = loop.start; row < loop.peel_end; ++row) {
+            ell_row_fixed<N, diagonal>(row, data, idx, px, py, m2, m3);
+        }
+        for (auto row = loop.peel_end; row < loop.vec_end; row += step) {
+            auto r = simd::neg(simd::load<simd_register_t>(py + row));
+            for (auto n = idx_t{0}; n < N; ++n) {
+                auto const a = simd::load<simd_register_t>(data[n] + row);
+                auto const b = simd::gather<simd_register_t>(px, idx[n] + row);
+                r = simd::madd_rc<scalar_t>(a, b, r);
+            }
+            if (diagonal) {
+                auto const r1 = simd::load<simd_register_t>(px + row);
+                m2_vec = m2_vec + r1 * r1;
+                m3_vec = simd::conjugate_madd_rc<scalar_t>(r, r1, m3_vec);
+            }
+            simd::store(py + row, r);
+        }
+        for (auto row = loop.vec_end; row < loop.end; ++row) {
+            ell_row_fixed<N, diagonal>(row, data, idx, px, py, m2, m3);
+        }
+
+        if (diagonal) {
+            m2 += simd::reduce_add(m2_vec);
+            m3 += simd::reduce_add_rc<scalar_t>(m3_vec);
+        }
+    }
+
+    template<idx_t N, bool diagonal, class scalar_t> CPB_ALWAYS_INLINE
+    void ell_spmv_fixed(idx_t start, idx_t end, num::EllMatrix<scalar_t> const& matrix,
+                        MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
+                        simd::array<scalar_t>& m2, simd::array<scalar_t>& m3) {
+        using simd_register_t = simd::select_vector_t<scalar_t>;
+        static constexpr auto step = simd::traits<scalar_t>::size;
+
+        scalar_t const* data[N];
+        storage_idx_t const* idx[N];
+        for (auto n = idx_t{0}; n < N; ++n) {
+            data[n] = &matrix.data(0, n);
+            idx[n] = &matrix.indices(0, n);
+        }
+
+        auto const px = x.data();
+        auto const py = y.data();
+        auto m2_vec = simd::make_float<simd_register_t>(0);
+        auto m3_vec = simd::make_float<simd_register_t>(0);
+
+        for (auto row = start; row < end; ++row) {
+            auto r = simd::neg(simd::load<simd_register_t>(py + row * step));
+            for (auto n = idx_t{0}; n < N; ++n) {
+                auto const a = simd::load_splat_rc<simd_register_t>(data[n] + row);
+                auto const b = simd::load<simd_register_t>(px + idx[n][row] * step);
+                r = simd::madd_rc<scalar_t>(a, b, r);
+            }
+            if (diagonal) {
+                auto const r1 = simd::load<simd_register_t>(px + row * step);
+                m2_vec = m2_vec + r1 * r1;
+                m3_vec = simd::conjugate_madd_rc<scalar_t>(r, r1, m3_vec);
+            }
+            simd::store(py + row * step, r);
+        }
+
+        if (diagonal) {
+            m2_vec = simd::reduce_imag<scalar_t>(m2_vec);
+            simd::store_u(m2.data(), simd::load_u<simd_register_t>(m2.data()) + m2_vec);
+            simd::store_u(m3.data(), simd::load_u<simd_register_t>(m3.data()) + m3_vec);
+        }
+    }
+
+    /// Binds the arguments of `ell_spmv_fixed()` for `with_fixed_width()`
+    template<bool diagonal, class scalar_t, class Vector, class Sum>
+    struct EllFixedSpmv {
+        idx_t start, end;
+        num::EllMatrix<scalar_t> const& matrix;
+        Vector const& x;
+        Vector& y;
+        Sum& m2;
+        Sum& m3;
+
+        template<idx_t N> CPB_ALWAYS_INLINE
+        void run() const { ell_spmv_fixed<N, diagonal>(start, end, matrix, x, y, m2, m3); }
+    };
+
+    /// Run the specialized kernel for `matrix.nnz_per_row`, if there is one
+    template<bool diagonal, class scalar_t, class Vector, class Sum> CPB_ALWAYS_INLINE
+    bool ell_spmv_fixed_width(idx_t start, idx_t end, num::EllMatrix<scalar_t> const& matrix,
+                              Vector const& x, Vector& y, Sum& m2, Sum& m3) {
+        using Spmv = EllFixedSpmv<diagonal, scalar_t, Vector, Sum>;
+        return with_fixed_width<1>(matrix.nnz_per_row, Spmv{start, end, matrix, x, y, m2, m3});
+    }
+} // namespace detail
+
 template<class scalar_t, idx_t skip_last_n = 0,
          idx_t step = simd::traits<scalar_t>::size> CPB_ALWAYS_INLINE
 simd::split_loop_t<step> kpm_spmv(idx_t start, idx_t end, num::EllMatrix<scalar_t> const& matrix,
                                   VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
     using simd_register_t = simd::select_vector_t<scalar_t>;
     auto const loop = simd::split_loop(y.data(), start, end);
+    if (skip_last_n == 0) {
+        auto unused = scalar_t{0};
+        if (detail::ell_spmv_fixed_width<false>(start, end, matrix, x, y, unused, unused)) {
+            return loop;
+        }
+    }
 
     auto const px0 = x.data();
     for (auto n = 0; n < matrix.nnz_per_row - skip_last_n; ++n) {
@@ -160,6 +331,13 @@ simd::split_loop_t<step> kpm_spmv(idx_t start, idx_t end, num::EllMatrix<scalar_
 template<class scalar_t, idx_t skip_last_n = 0> CPB_ALWAYS_INLINE
 void kpm_spmv(idx_t start, idx_t end, num::EllMatrix<scalar_t> const& matrix,
               MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y) {
+    if (skip_last_n == 0) {
+        auto unused = simd::array<scalar_t>{};
+        if (detail::ell_spmv_fixed_width<false>(start, end, matrix, x, y, unused, unused)) {
+            return;
+        }
+    }
+
     using simd_register_t = simd::select_vector_t<scalar_t>;
     static constexpr auto step = simd::traits<scalar_t>::size;
 
@@ -221,6 +399,8 @@ template<class scalar_t> CPB_ALWAYS_INLINE
 void kpm_spmv_diagonal(idx_t start, idx_t end, num::EllMatrix<scalar_t> const& matrix,
                        VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
                        scalar_t& m2, scalar_t& m3) {
+    if (detail::ell_spmv_fixed_width<true>(start, end, matrix, x, y, m2, m3)) { return; }
+
     // Call the regular compute function, but skip the last loop iteration.
     auto const loop = kpm_spmv<scalar_t, 1>(start, end, matrix, x, y);
 
@@ -288,6 +468,8 @@ template<class scalar_t> CPB_ALWAYS_INLINE
 void kpm_spmv_diagonal(idx_t start, idx_t end, num::EllMatrix<scalar_t> const& matrix,
                        MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
                        simd::array<scalar_t>& m2, simd::array<scalar_t>& m3) {
+    if (detail::ell_spmv_fixed_width<true>(start, end, matrix, x, y, m2, m3)) { return; }
+
     kpm_spmv<scalar_t, 1>(start, end, matrix, x, y);
 
     using simd_register_t = simd::select_vector_t<scalar_t>;
@@ -323,4 +505,1450 @@ void kpm_spmv_diagonal(idx_t start, idx_t end, num::EllMatrix<scalar_t> const& m
 }
 
 #endif // SIMDPP_USE_NULL
+
+namespace detail {
+    /// Compute a single SELL chunk one row at a time, skipping rows outside of `[start, end)`
+    template<class scalar_t> CPB_ALWAYS_INLINE
+    void sell_chunk_spmv(idx_t c, idx_t start, idx_t end, num::SellMatrix<scalar_t> const& matrix,
+                         VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+        auto const size = matrix.chunk_size;
+        auto const offset = static_cast<idx_t>(matrix.chunk_offsets[c]);
+        for (auto lane = 0; lane < size; ++lane) {
+            auto const row = matrix.row_indices[c * size + lane];
+            if (row < start || row >= end) { continue; }
+
+            auto r = scalar_t{0};
+            for (auto n = offset + lane; n < matrix.chunk_offsets[c + 1]; n += size) {
+                r += mul(matrix.data[n], x[matrix.indices[n]]);
+            }
+            y[row] = r - y[row];
+        }
+    }
+
+    template<class scalar_t> CPB_ALWAYS_INLINE
+    void sell_chunk_spmv(idx_t c, idx_t start, idx_t end, num::SellMatrix<scalar_t> const& matrix,
+                         VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                         scalar_t& m2, scalar_t& m3) {
+        auto const size = matrix.chunk_size;
+        auto const offset = static_cast<idx_t>(matrix.chunk_offsets[c]);
+        for (auto lane = 0; lane < size; ++lane) {
+            auto const row = matrix.row_indices[c * size + lane];
+            if (row < start || row >= end) { continue; }
+
+            auto r = scalar_t{0};
+            for (auto n = offset + lane; n < matrix.chunk_offsets[c + 1]; n += size) {
+                r += mul(matrix.data[n], x[matrix.indices[n]]);
+            }
+            auto const r1 = x[row];
+            auto const r2 = r - y[row];
+            m2 += square(r1);
+            m3 += mul(num::conjugate(r2), r1);
+            y[row] = r2;
+        }
+    }
+
+    template<class scalar_t> CPB_ALWAYS_INLINE
+    void sell_chunk_spmv(idx_t c, idx_t start, idx_t end, num::SellMatrix<scalar_t> const& matrix,
+                         MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y) {
+        using Row = Eigen::Matrix<scalar_t, 1, Eigen::Dynamic>;
+        auto tmp = Row(x.cols());
+        auto const size = matrix.chunk_size;
+        auto const offset = static_cast<idx_t>(matrix.chunk_offsets[c]);
+        for (auto lane = 0; lane < size; ++lane) {
+            auto const row = matrix.row_indices[c * size + lane];
+            if (row < start || row >= end) { continue; }
+
+            tmp.setZero();
+            for (auto n = offset + lane; n < matrix.chunk_offsets[c + 1]; n += size) {
+                tmp += matrix.data[n] * x.row(matrix.indices[n]);
+            }
+            y.row(row) = tmp - y.row(row);
+        }
+    }
+
+    template<class scalar_t> CPB_ALWAYS_INLINE
+    void sell_chunk_spmv(idx_t c, idx_t start, idx_t end, num::SellMatrix<scalar_t> const& matrix,
+                         MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
+                         simd::array<scalar_t>& m2, simd::array<scalar_t>& m3) {
+        sell_chunk_spmv(c, start, end, matrix, x, y);
+
+        auto const size = matrix.chunk_size;
+        for (auto lane = 0; lane < size; ++lane) {
+            auto const row = matrix.row_indices[c * size + lane];
+            if (row < start || row >= end) { continue; }
+
+            for (auto i = 0; i < x.cols(); ++i) {
+                m2[i] += square(x(row, i));
+                m3[i] += mul(num::conjugate(y(row, i)), x(row, i));
+            }
+        }
+    }
+} // namespace detail
+
+/**
+ KPM-specialized sparse matrix-vector multiplication (SELL-C-sigma, off-diagonal)
+
+ Equivalent to: y = matrix * x - y
+
+ Windows which are entirely inside `[start, end)` are computed chunk-wise. Only the
+ windows cut by the range limits (e.g. thread partitions which don't coincide with
+ slice borders) need to check individual rows.
+ */
+#if SIMDPP_USE_NULL // generic version
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::SellMatrix<scalar_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    auto const w = matrix.windows(start, end);
+    for (auto c = matrix.window_chunks[w.first]; c < matrix.window_chunks[w.second]; ++c) {
+        detail::sell_chunk_spmv(c, start, end, matrix, x, y);
+    }
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::SellMatrix<scalar_t> const& matrix,
+              MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y) {
+    auto const w = matrix.windows(start, end);
+    for (auto c = matrix.window_chunks[w.first]; c < matrix.window_chunks[w.second]; ++c) {
+        detail::sell_chunk_spmv(c, start, end, matrix, x, y);
+    }
+}
+
+#else // vectorized using SIMD intrinsics
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::SellMatrix<scalar_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    using simd_register_t = simd::select_vector_t<scalar_t>;
+    static constexpr auto step = static_cast<idx_t>(simd::traits<scalar_t>::size);
+    assert(matrix.chunk_size == step);
+
+    auto const px0 = x.data();
+    auto const py0 = y.data();
+    auto tmp = simd::array<scalar_t>();
+
+    auto const w = matrix.windows(start, end);
+    for (auto window = w.first; window < w.second; ++window) {
+        auto const is_inside = matrix.window_inside(window, start, end);
+        for (auto c = matrix.window_chunks[window]; c < matrix.window_chunks[window + 1]; ++c) {
+            if (!is_inside || !matrix.chunk_full(c)) {
+                detail::sell_chunk_spmv(c, start, end, matrix, x, y);
+                continue;
+            }
+
+            auto const rows = matrix.row_indices.data() + c * step;
+            auto data = matrix.data.data() + matrix.chunk_offsets[c];
+            auto idx = matrix.indices.data() + matrix.chunk_offsets[c];
+            auto const data_end = matrix.data.data() + matrix.chunk_offsets[c + 1];
+
+            auto r = simd::neg(simd::gather<simd_register_t>(py0, rows));
+            for (; data < data_end; data += step, idx += step) {
+                auto const a = simd::load<simd_register_t>(data);
+                auto const b = simd::gather<simd_register_t>(px0, idx);
+                r = simd::madd_rc<scalar_t>(a, b, r);
+            }
+
+            simd::store_u(tmp.data(), r);
+            for (auto lane = 0; lane < step; ++lane) {
+                py0[rows[lane]] = tmp[lane];
+            }
+        }
+    }
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::SellMatrix<scalar_t> const& matrix,
+              MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y) {
+    using simd_register_t = simd::select_vector_t<scalar_t>;
+    static constexpr auto step = simd::traits<scalar_t>::size;
+
+    auto const px0 = x.data();
+    auto const w = matrix.windows(start, end);
+    for (auto c = matrix.window_chunks[w.first]; c < matrix.window_chunks[w.second]; ++c) {
+        auto const size = matrix.chunk_size;
+        for (auto lane = 0; lane < size; ++lane) {
+            auto const row = matrix.row_indices[c * size + lane];
+            if (row < start || row >= end) { continue; }
+
+            auto data = matrix.data.data() + matrix.chunk_offsets[c] + lane;
+            auto idx = matrix.indices.data() + matrix.chunk_offsets[c] + lane;
+            auto const data_end = matrix.data.data() + matrix.chunk_offsets[c + 1];
+            auto const py = y.data() + row * step;
+
+            auto r = simd::neg(simd::load<simd_register_t>(py));
+            for (; data < data_end; data += size, idx += size) {
+                auto const a = simd::load_splat_rc<simd_register_t>(data);
+                auto const b = simd::load<simd_register_t>(px0 + *idx * step);
+                r = simd::madd_rc<scalar_t>(a, b, r);
+            }
+            simd::store(py, r);
+        }
+    }
+}
+
+#endif // SIMDPP_USE_NULL
+
+/**
+ KPM-specialized sparse matrix-vector multiplication (SELL-C-sigma, diagonal)
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+#if SIMDPP_USE_NULL // generic version
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::SellMatrix<scalar_t> const& matrix,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       scalar_t& m2, scalar_t& m3) {
+    auto const w = matrix.windows(start, end);
+    for (auto c = matrix.window_chunks[w.first]; c < matrix.window_chunks[w.second]; ++c) {
+        detail::sell_chunk_spmv(c, start, end, matrix, x, y, m2, m3);
+    }
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::SellMatrix<scalar_t> const& matrix,
+                       MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
+                       simd::array<scalar_t>& m2, simd::array<scalar_t>& m3) {
+    auto const w = matrix.windows(start, end);
+    for (auto c = matrix.window_chunks[w.first]; c < matrix.window_chunks[w.second]; ++c) {
+        detail::sell_chunk_spmv(c, start, end, matrix, x, y, m2, m3);
+    }
+}
+
+#else // vectorized using SIMD intrinsics
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::SellMatrix<scalar_t> const& matrix,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       scalar_t& m2, scalar_t& m3) {
+    // Same as the ELLPACK version: the m2 and m3 sums reuse `r2` which is still in a register
+    using simd_register_t = simd::select_vector_t<scalar_t>;
+    static constexpr auto step = static_cast<idx_t>(simd::traits<scalar_t>::size);
+    assert(matrix.chunk_size == step);
+
+    auto const px0 = x.data();
+    auto const py0 = y.data();
+    auto tmp = simd::array<scalar_t>();
+    auto m2_vec = simd::make_float<simd_register_t>(0);
+    auto m3_vec = simd::make_float<simd_register_t>(0);
+
+    auto const w = matrix.windows(start, end);
+    for (auto window = w.first; window < w.second; ++window) {
+        auto const is_inside = matrix.window_inside(window, start, end);
+        for (auto c = matrix.window_chunks[window]; c < matrix.window_chunks[window + 1]; ++c) {
+            if (!is_inside || !matrix.chunk_full(c)) {
+                detail::sell_chunk_spmv(c, start, end, matrix, x, y, m2, m3);
+                continue;
+            }
+
+            auto const rows = matrix.row_indices.data() + c * step;
+            auto data = matrix.data.data() + matrix.chunk_offsets[c];
+            auto idx = matrix.indices.data() + matrix.chunk_offsets[c];
+            auto const data_end = matrix.data.data() + matrix.chunk_offsets[c + 1];
+
+            auto r2 = simd::neg(simd::gather<simd_register_t>(py0, rows));
+            for (; data < data_end; data += step, idx += step) {
+                auto const a = simd::load<simd_register_t>(data);
+                auto const b = simd::gather<simd_register_t>(px0, idx);
+                r2 = simd::madd_rc<scalar_t>(a, b, r2);
+            }
+
+            auto const r1 = simd::gather<simd_register_t>(px0, rows);
+            m2_vec = m2_vec + r1 * r1;
+            m3_vec = simd::conjugate_madd_rc<scalar_t>(r2, r1, m3_vec);
+
+            simd::store_u(tmp.data(), r2);
+            for (auto lane = 0; lane < step; ++lane) {
+                py0[rows[lane]] = tmp[lane];
+            }
+        }
+    }
+
+    m2 += simd::reduce_add(m2_vec);
+    m3 += simd::reduce_add_rc<scalar_t>(m3_vec);
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::SellMatrix<scalar_t> const& matrix,
+                       MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
+                       simd::array<scalar_t>& m2, simd::array<scalar_t>& m3) {
+    using simd_register_t = simd::select_vector_t<scalar_t>;
+    static constexpr auto step = simd::traits<scalar_t>::size;
+
+    auto const px0 = x.data();
+    auto m2_vec = simd::make_float<simd_register_t>(0);
+    auto m3_vec = simd::make_float<simd_register_t>(0);
+
+    auto const w = matrix.windows(start, end);
+    for (auto c = matrix.window_chunks[w.first]; c < matrix.window_chunks[w.second]; ++c) {
+        auto const size = matrix.chunk_size;
+        for (auto lane = 0; lane < size; ++lane) {
+            auto const row = matrix.row_indices[c * size + lane];
+            if (row < start || row >= end) { continue; }
+
+            auto data = matrix.data.data() + matrix.chunk_offsets[c] + lane;
+            auto idx = matrix.indices.data() + matrix.chunk_offsets[c] + lane;
+            auto const data_end = matrix.data.data() + matrix.chunk_offsets[c + 1];
+            auto const py = y.data() + row * step;
+
+            auto r2 = simd::neg(simd::load<simd_register_t>(py));
+            for (; data < data_end; data += size, idx += size) {
+                auto const a = simd::load_splat_rc<simd_register_t>(data);
+                auto const b = simd::load<simd_register_t>(px0 + *idx * step);
+                r2 = simd::madd_rc<scalar_t>(a, b, r2);
+            }
+
+            auto const r1 = simd::load<simd_register_t>(px0 + row * step);
+            m2_vec = m2_vec + r1 * r1;
+            m3_vec = simd::conjugate_madd_rc<scalar_t>(r2, r1, m3_vec);
+
+            simd::store(py, r2);
+        }
+    }
+
+    m2_vec = simd::reduce_imag<scalar_t>(m2_vec);
+    simd::store_u(m2.data(), simd::load_u<simd_register_t>(m2.data()) + m2_vec);
+    simd::store_u(m3.data(), simd::load_u<simd_register_t>(m3.data()) + m3_vec);
+}
+
+#endif // SIMDPP_USE_NULL
+
+namespace detail {
+    /// Shared by the vector and batch (matrix) versions of the stencil kernels
+    template<class scalar_t, class Vector> CPB_ALWAYS_INLINE
+    void stencil_spmv(idx_t start, idx_t end, num::StencilMatrix<scalar_t> const& matrix,
+                      Vector const& x, Vector& y) {
+        auto const na = static_cast<idx_t>(matrix.size[0]);
+        auto const nb = static_cast<idx_t>(matrix.size[1]);
+        auto const nbc = nb * matrix.size[2];
+
+        for (auto line = start / na; line * na < end; ++line) {
+            auto const row0 = line * na;
+            auto const first = std::max(start - row0, idx_t{0});
+            auto const last = std::min(end - row0, na);
+            auto const sub = line / nbc;
+            auto const b = line % nbc % nb;
+            auto const c = line % nbc / nb;
+
+            y.middleRows(row0 + first, last - first) = -y.middleRows(row0 + first, last - first);
+            for (auto t = matrix.term_starts[sub]; t < matrix.term_starts[sub + 1]; ++t) {
+                auto const& term = matrix.terms[t];
+                if (b < term.lower[1] || b >= term.upper[1]
+                    || c < term.lower[2] || c >= term.upper[2]) { continue; }
+
+                auto const lo = std::max(first, static_cast<idx_t>(term.lower[0]));
+                auto const hi = std::min(last, static_cast<idx_t>(term.upper[0]));
+                if (lo >= hi) { continue; }
+
+                y.middleRows(row0 + lo, hi - lo) +=
+                    term.value * x.middleRows(row0 + lo + term.shift, hi - lo);
+            }
+        }
+    }
+} // namespace detail
+
+/**
+ KPM-specialized matrix-vector multiplication (matrix-free stencil, off-diagonal)
+
+ Equivalent to: y = matrix * x - y
+
+ The rows are processed in lines along the first lattice vector. Within a line, every
+ term of the stencil is a contiguous shifted `y += value * x` which is easy to vectorize.
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::StencilMatrix<scalar_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    detail::stencil_spmv(start, end, matrix, x, y);
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::StencilMatrix<scalar_t> const& matrix,
+              MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y) {
+    detail::stencil_spmv(start, end, matrix, x, y);
+}
+
+/**
+ KPM-specialized matrix-vector multiplication (matrix-free stencil, diagonal)
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::StencilMatrix<scalar_t> const& matrix,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       scalar_t& m2, scalar_t& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    auto const size = end - start;
+    m2 += x.segment(start, size).squaredNorm();
+    m3 += y.segment(start, size).dot(x.segment(start, size));
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::StencilMatrix<scalar_t> const& matrix,
+                       MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
+                       simd::array<scalar_t>& m2, simd::array<scalar_t>& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    auto const size = end - start;
+    auto const cols = x.cols();
+    for (auto i = 0; i < cols; ++i) {
+        m2[i] += x.col(i).segment(start, size).squaredNorm();
+        m3[i] += y.col(i).segment(start, size).dot(x.col(i).segment(start, size));
+    }
+}
+
+namespace detail {
+    /// Block row `i` of `y` is only partially inside `[start, end)` at the edges of the range
+    CPB_ALWAYS_INLINE std::pair<idx_t, idx_t> bsr_rows_in_range(idx_t i, idx_t b,
+                                                                 idx_t start, idx_t end) {
+        return {std::max(start - i * b, idx_t{0}), std::min(end - i * b, b)};
+    }
+
+    /// `B` is the compile-time block size which allows the dense blocks to be fully unrolled
+    template<int B, class scalar_t> CPB_ALWAYS_INLINE
+    void bsr_spmv(idx_t start, idx_t end, num::BsrMatrix<scalar_t> const& matrix,
+                  VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+        using Block = Eigen::Matrix<scalar_t, B, B, Eigen::RowMajor>;
+        using Segment = Eigen::Matrix<scalar_t, B, 1>;
+        auto const b = matrix.block_size;
+        auto const data = matrix.data.data();
+        auto const indices = matrix.block_indices.data();
+
+        auto acc = Segment::Zero(b).eval();
+        for (auto i = start / b; i * b < end; ++i) {
+            acc.setZero();
+            for (auto n = matrix.block_indptr[i]; n < matrix.block_indptr[i + 1]; ++n) {
+                acc.noalias() += Eigen::Map<Block const>(data + n * b * b, b, b)
+                                 * Eigen::Map<Segment const>(x.data() + indices[n] * b, b);
+            }
+
+            auto const range = bsr_rows_in_range(i, b, start, end);
+            auto const size = range.second - range.first;
+            y.segment(i * b + range.first, size) = acc.segment(range.first, size)
+                                                   - y.segment(i * b + range.first, size);
+        }
+    }
+
+    template<int B, class scalar_t> CPB_ALWAYS_INLINE
+    void bsr_spmv(idx_t start, idx_t end, num::BsrMatrix<scalar_t> const& matrix,
+                  MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y) {
+        using Block = Eigen::Matrix<scalar_t, B, B, Eigen::RowMajor>;
+        using Rows = Eigen::Matrix<scalar_t, B, Eigen::Dynamic, Eigen::RowMajor>;
+        auto const b = matrix.block_size;
+        auto const cols = x.cols();
+        auto const data = matrix.data.data();
+        auto const indices = matrix.block_indices.data();
+
+        auto acc = Rows::Zero(b, cols).eval();
+        for (auto i = start / b; i * b < end; ++i) {
+            acc.setZero();
+            for (auto n = matrix.block_indptr[i]; n < matrix.block_indptr[i + 1]; ++n) {
+                acc.noalias() += Eigen::Map<Block const>(data + n * b * b, b, b)
+                                 * Eigen::Map<Rows const>(x.data() + indices[n] * b * cols,
+                                                          b, cols);
+            }
+
+            auto const range = bsr_rows_in_range(i, b, start, end);
+            auto const size = range.second - range.first;
+            y.middleRows(i * b + range.first, size) = acc.middleRows(range.first, size)
+                                                      - y.middleRows(i * b + range.first, size);
+        }
+    }
+
+    /// Dispatch the common orbital counts to the unrolled kernels
+    template<class scalar_t, class Vector> CPB_ALWAYS_INLINE
+    void bsr_spmv(idx_t start, idx_t end, num::BsrMatrix<scalar_t> const& matrix,
+                  Vector const& x, Vector& y) {
+        switch (matrix.block_size) {
+            case 2: bsr_spmv<2>(start, end, matrix, x, y); break;
+            case 3: bsr_spmv<3>(start, end, matrix, x, y); break;
+            case 4: bsr_spmv<4>(start, end, matrix, x, y); break;
+            case 5: bsr_spmv<5>(start, end, matrix, x, y); break;
+            case 6: bsr_spmv<6>(start, end, matrix, x, y); break;
+            default: bsr_spmv<Eigen::Dynamic>(start, end, matrix, x, y); break;
+        }
+    }
+} // namespace detail
+
+/**
+ KPM-specialized matrix-vector multiplication (BSR, off-diagonal)
+
+ Equivalent to: y = matrix * x - y
+
+ The result of each block row is accumulated in registers before it's written to `y`.
+ Block rows at the edges of `[start, end)` are computed in full but only the rows
+ inside the range are written.
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::BsrMatrix<scalar_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    detail::bsr_spmv(start, end, matrix, x, y);
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::BsrMatrix<scalar_t> const& matrix,
+              MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y) {
+    detail::bsr_spmv(start, end, matrix, x, y);
+}
+
+/**
+ KPM-specialized matrix-vector multiplication (BSR, diagonal)
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::BsrMatrix<scalar_t> const& matrix,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       scalar_t& m2, scalar_t& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    auto const size = end - start;
+    m2 += x.segment(start, size).squaredNorm();
+    m3 += y.segment(start, size).dot(x.segment(start, size));
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::BsrMatrix<scalar_t> const& matrix,
+                       MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
+                       simd::array<scalar_t>& m2, simd::array<scalar_t>& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    auto const size = end - start;
+    auto const cols = x.cols();
+    for (auto i = 0; i < cols; ++i) {
+        m2[i] += x.col(i).segment(start, size).squaredNorm();
+        m3[i] += y.col(i).segment(start, size).dot(x.col(i).segment(start, size));
+    }
+}
+
+/**
+ KPM-specialized matrix-vector multiplication (Hermitian upper triangle, off-diagonal)
+
+ Equivalent to: y = matrix * x - y
+
+ Each stored element `H(k, j)` adds `H(k, j) * x[j]` to `y[k]` and `conj(H(k, j)) * x[k]`
+ to `y[j]`. Only the rows inside `[start, end)` are written so that concurrent calls with
+ disjoint ranges don't conflict: the rows before `start` which reach into the range are
+ read once more for their transposed contribution. Since the reordered matrix is banded,
+ this overlap is small compared to the range.
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::HermitianMatrix<scalar_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    auto const data = matrix.data.data();
+    auto const indices = matrix.indices.data();
+    auto const indptr = matrix.indptr.data();
+
+    y.segment(start, end - start) = -y.segment(start, end - start);
+    for (auto row = matrix.first_row_reaching(start); row < start; ++row) {
+        auto const x_row = x[row];
+        for (auto n = indptr[row + 1] - 1; n >= indptr[row] && indices[n] >= start; --n) {
+            if (indices[n] < end) {
+                y[indices[n]] += detail::mul(num::conjugate(data[n]), x_row);
+            }
+        }
+    }
+    for (auto row = start; row < end; ++row) {
+        auto const x_row = x[row];
+        auto r = scalar_t{0};
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            auto const col = indices[n];
+            r += detail::mul(data[n], x[col]);
+            if (col != row && col < end) {
+                y[col] += detail::mul(num::conjugate(data[n]), x_row);
+            }
+        }
+        y[row] += r;
+    }
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::HermitianMatrix<scalar_t> const& matrix,
+              MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y) {
+    auto const data = matrix.data.data();
+    auto const indices = matrix.indices.data();
+    auto const indptr = matrix.indptr.data();
+
+    using Row = Eigen::Matrix<scalar_t, 1, Eigen::Dynamic>;
+    auto tmp = Row(x.cols());
+    y.middleRows(start, end - start) = -y.middleRows(start, end - start);
+    for (auto row = matrix.first_row_reaching(start); row < start; ++row) {
+        for (auto n = indptr[row + 1] - 1; n >= indptr[row] && indices[n] >= start; --n) {
+            if (indices[n] < end) {
+                y.row(indices[n]) += num::conjugate(data[n]) * x.row(row);
+            }
+        }
+    }
+    for (auto row = start; row < end; ++row) {
+        tmp.setZero();
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            auto const col = indices[n];
+            tmp += data[n] * x.row(col);
+            if (col != row && col < end) {
+                y.row(col) += num::conjugate(data[n]) * x.row(row);
+            }
+        }
+        y.row(row) += tmp;
+    }
+}
+
+/**
+ KPM-specialized matrix-vector multiplication (Hermitian upper triangle, diagonal)
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::HermitianMatrix<scalar_t> const& matrix,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       scalar_t& m2, scalar_t& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    auto const size = end - start;
+    m2 += x.segment(start, size).squaredNorm();
+    m3 += y.segment(start, size).dot(x.segment(start, size));
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::HermitianMatrix<scalar_t> const& matrix,
+                       MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
+                       simd::array<scalar_t>& m2, simd::array<scalar_t>& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    auto const size = end - start;
+    auto const cols = x.cols();
+    for (auto i = 0; i < cols; ++i) {
+        m2[i] += x.col(i).segment(start, size).squaredNorm();
+        m3[i] += y.col(i).segment(start, size).dot(x.col(i).segment(start, size));
+    }
+}
+
+/**
+ KPM-specialized matrix-vector multiplication (value table ELLPACK, off-diagonal)
+
+ Equivalent to: y = matrix * x - y
+
+ The same as the generic ELLPACK kernel but the values are gathered from the small table
+ (which stays in L1 cache) using the 8-bit IDs. The escaped elements are added afterwards.
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::TableEllMatrix<scalar_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    auto const table = matrix.table.data();
+    auto const px = x.data();
+    auto const py = y.data();
+    for (auto row = start; row < end; ++row) {
+        py[row] = -py[row];
+    }
+
+    for (auto n = 0; n < matrix.nnz_per_row; ++n) {
+        auto const ids = &matrix.ids(0, n);
+        auto const indices = &matrix.indices(0, n);
+        for (auto row = start; row < end; ++row) {
+            py[row] += detail::mul(table[ids[row]], px[indices[row]]);
+        }
+    }
+
+    auto const& escaped = matrix.escaped;
+    auto const indptr = escaped.outerIndexPtr();
+    for (auto row = start; row < end; ++row) {
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            py[row] += detail::mul(escaped.valuePtr()[n], px[escaped.innerIndexPtr()[n]]);
+        }
+    }
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::TableEllMatrix<scalar_t> const& matrix,
+              MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y) {
+    auto const table = matrix.table.data();
+    for (auto row = start; row < end; ++row) {
+        y.row(row) = -y.row(row);
+    }
+
+    for (auto n = 0; n < matrix.nnz_per_row; ++n) {
+        auto const ids = &matrix.ids(0, n);
+        auto const indices = &matrix.indices(0, n);
+        for (auto row = start; row < end; ++row) {
+            y.row(row) += table[ids[row]] * x.row(indices[row]);
+        }
+    }
+
+    auto const& escaped = matrix.escaped;
+    auto const indptr = escaped.outerIndexPtr();
+    for (auto row = start; row < end; ++row) {
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            y.row(row) += escaped.valuePtr()[n] * x.row(escaped.innerIndexPtr()[n]);
+        }
+    }
+}
+
+/**
+ KPM-specialized matrix-vector multiplication (value table ELLPACK, diagonal)
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::TableEllMatrix<scalar_t> const& matrix,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       scalar_t& m2, scalar_t& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    auto const size = end - start;
+    m2 += x.segment(start, size).squaredNorm();
+    m3 += y.segment(start, size).dot(x.segment(start, size));
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::TableEllMatrix<scalar_t> const& matrix,
+                       MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
+                       simd::array<scalar_t>& m2, simd::array<scalar_t>& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    auto const size = end - start;
+    auto const cols = x.cols();
+    for (auto i = 0; i < cols; ++i) {
+        m2[i] += x.col(i).segment(start, size).squaredNorm();
+        m3[i] += y.col(i).segment(start, size).dot(x.col(i).segment(start, size));
+    }
+}
+
+namespace detail {
+    /// The elements which are too far from the diagonal for the 16-bit offsets
+    template<class scalar_t> CPB_ALWAYS_INLINE
+    void delta_ell_escaped(idx_t start, idx_t end, num::DeltaEllMatrix<scalar_t> const& matrix,
+                           VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+        auto const& escaped = matrix.escaped;
+        auto const indptr = escaped.outerIndexPtr();
+        for (auto row = start; row < end; ++row) {
+            for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                y[row] += mul(escaped.valuePtr()[n], x[escaped.innerIndexPtr()[n]]);
+            }
+        }
+    }
+} // namespace detail
+
+/**
+ KPM-specialized matrix-vector multiplication (ELLPACK with 16-bit offsets, off-diagonal)
+
+ Equivalent to: y = matrix * x - y
+
+ The column indices are decoded inline as `row + offset` before the gather.
+ */
+#if SIMDPP_USE_NULL // generic version
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::DeltaEllMatrix<scalar_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    for (auto row = start; row < end; ++row) {
+        y[row] = -y[row];
+    }
+
+    for (auto n = 0; n < matrix.nnz_per_row; ++n) {
+        for (auto row = start; row < end; ++row) {
+            auto const a = matrix.data(row, n);
+            auto const b = x[row + matrix.offsets(row, n)];
+            y[row] += detail::mul(a, b);
+        }
+    }
+    detail::delta_ell_escaped(start, end, matrix, x, y);
+}
+
+#else // vectorized using SIMD intrinsics
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::DeltaEllMatrix<scalar_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    using simd_register_t = simd::select_vector_t<scalar_t>;
+    static constexpr auto step = simd::traits<scalar_t>::size;
+    auto const loop = simd::split_loop(y.data(), start, end);
+
+    for (auto row = start; row < end; ++row) {
+        y[row] = -y[row];
+    }
+
+    auto const px0 = x.data();
+    alignas(simd::traits<scalar_t>::align_bytes) storage_idx_t idx[step];
+    for (auto n = 0; n < matrix.nnz_per_row; ++n) {
+        auto const data = &matrix.data(0, n);
+        auto const offsets = &matrix.offsets(0, n);
+        auto const py = y.data();
+
+        for (auto row = loop.start; row < loop.peel_end; ++row) {
+            py[row] += detail::mul(data[row], px0[row + offsets[row]]);
+        }
+        for (auto row = loop.peel_end; row < loop.vec_end; row += step) {
+            for (auto i = idx_t{0}; i < step; ++i) {
+                idx[i] = static_cast<storage_idx_t>(row + i + offsets[row + i]);
+            }
+            auto const a = simd::load<simd_register_t>(data + row);
+            auto const b = simd::gather<simd_register_t>(px0, idx);
+            auto const c = simd::load<simd_register_t>(py + row);
+            simd::store(py + row, simd::madd_rc<scalar_t>(a, b, c));
+        }
+        for (auto row = loop.vec_end; row < loop.end; ++row) {
+            py[row] += detail::mul(data[row], px0[row + offsets[row]]);
+        }
+    }
+    detail::delta_ell_escaped(start, end, matrix, x, y);
+}
+
+#endif // SIMDPP_USE_NULL
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::DeltaEllMatrix<scalar_t> const& matrix,
+              MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y) {
+    for (auto row = start; row < end; ++row) {
+        y.row(row) = -y.row(row);
+    }
+
+    for (auto n = 0; n < matrix.nnz_per_row; ++n) {
+        for (auto row = start; row < end; ++row) {
+            y.row(row) += matrix.data(row, n) * x.row(row + matrix.offsets(row, n));
+        }
+    }
+
+    auto const& escaped = matrix.escaped;
+    auto const indptr = escaped.outerIndexPtr();
+    for (auto row = start; row < end; ++row) {
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            y.row(row) += escaped.valuePtr()[n] * x.row(escaped.innerIndexPtr()[n]);
+        }
+    }
+}
+
+/**
+ KPM-specialized matrix-vector multiplication (ELLPACK with 16-bit offsets, diagonal)
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::DeltaEllMatrix<scalar_t> const& matrix,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       scalar_t& m2, scalar_t& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    auto const size = end - start;
+    m2 += x.segment(start, size).squaredNorm();
+    m3 += y.segment(start, size).dot(x.segment(start, size));
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::DeltaEllMatrix<scalar_t> const& matrix,
+                       MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
+                       simd::array<scalar_t>& m2, simd::array<scalar_t>& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    auto const size = end - start;
+    auto const cols = x.cols();
+    for (auto i = 0; i < cols; ++i) {
+        m2[i] += x.col(i).segment(start, size).squaredNorm();
+        m3[i] += y.col(i).segment(start, size).dot(x.col(i).segment(start, size));
+    }
+}
+
+namespace detail {
+    /// A single row of the split real/imaginary ELLPACK product
+    template<bool diagonal, class scalar_t> CPB_ALWAYS_INLINE
+    void split_ell_row(idx_t row, num::SplitEllMatrix<scalar_t> const& matrix,
+                       scalar_t const* px, scalar_t* py, scalar_t& m2, scalar_t& m3) {
+        auto r = -py[row];
+        for (auto n = idx_t{0}; n < matrix.nnz_per_row; ++n) {
+            r += mul(matrix.value(row, n), px[matrix.col(row, n)]);
+        }
+        if (diagonal) {
+            m2 += square(px[row]);
+            m3 += mul(num::conjugate(r), px[row]);
+        }
+        py[row] = r;
+    }
+
+    /// Generic version: one row at a time
+    template<bool diagonal, class scalar_t> CPB_ALWAYS_INLINE
+    void split_ell_spmv(idx_t start, idx_t end, num::SplitEllMatrix<scalar_t> const& matrix,
+                        VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                        scalar_t& m2, scalar_t& m3, std::false_type) {
+        for (auto row = start; row < end; ++row) {
+            split_ell_row<diagonal>(row, matrix, x.data(), y.data(), m2, m3);
+        }
+    }
+
+#if !SIMDPP_USE_NULL
+    /**
+     Vectorized complex version: `step` rows at a time, where `step` is the number of real
+     lanes of a register. Each block of `y` (and `x` for the diagonal sums) is deinterleaved
+     once on load and interleaved once on store: the products are only multiply-adds.
+     */
+    template<bool diagonal, class scalar_t> CPB_ALWAYS_INLINE
+    void split_ell_spmv(idx_t start, idx_t end, num::SplitEllMatrix<scalar_t> const& matrix,
+                        VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                        scalar_t& m2, scalar_t& m3, std::true_type) {
+        using real_t = num::get_real_t<scalar_t>;
+        using simd_register_t = simd::select_vector_t<real_t>;
+        static constexpr auto step = simd::traits<real_t>::size;
+
+        auto const px = x.data();
+        auto const py = y.data();
+        auto const px_parts = reinterpret_cast<real_t const*>(px);
+        auto const py_parts = reinterpret_cast<real_t*>(py);
+        // The planes, offsets and the twice as wide `x` and `y` line up every `step` rows
+        auto const loop = simd::split_loop(matrix.real.data(), start, end);
+        auto const zero = simd::make_float<simd_register_t>(0);
+        auto m2_vec = zero;
+        auto m3_real = zero;
+        auto m3_imag = zero;
+
+        for (auto row = loop.start; row < loop.peel_end; ++row) {
+            split_ell_row<diagonal>(row, matrix, px, py, m2, m3);
+        }
+        for (auto row = loop.peel_end; row < loop.vec_end; row += step) {
+            simd_register_t r_real, r_imag;
+            simd::load_packed2(r_real, r_imag, py_parts + 2 * row);
+            r_real = simd::neg(r_real);
+            r_imag = simd::neg(r_imag);
+            auto t_real = zero; // the `imag * imag` terms are subtracted at the end
+            for (auto n = idx_t{0}; n < matrix.nnz_per_row; ++n) {
+                auto const a_real = simd::load<simd_register_t>(&matrix.real(row, n));
+                auto const a_imag = simd::load<simd_register_t>(&matrix.imag(row, n));
+                auto const offsets = &matrix.offsets(row, n);
+                auto const b_real = simd::gather<simd_register_t>(px_parts, offsets);
+                auto const b_imag = simd::gather<simd_register_t>(px_parts + 1, offsets);
+                r_real = simd::madd_rc<real_t>(a_real, b_real, r_real);
+                t_real = simd::madd_rc<real_t>(a_imag, b_imag, t_real);
+                r_imag = simd::madd_rc<real_t>(a_real, b_imag, r_imag);
+                r_imag = simd::madd_rc<real_t>(a_imag, b_real, r_imag);
+            }
+            r_real = r_real - t_real;
+
+            if (diagonal) { // m3 += conj(r) * x
+                simd_register_t x_real, x_imag;
+                simd::load_packed2(x_real, x_imag, px_parts + 2 * row);
+                m2_vec = simd::madd_rc<real_t>(x_real, x_real, m2_vec);
+                m2_vec = simd::madd_rc<real_t>(x_imag, x_imag, m2_vec);
+                m3_real = simd::madd_rc<real_t>(r_real, x_real, m3_real);
+                m3_real = simd::madd_rc<real_t>(r_imag, x_imag, m3_real);
+                m3_imag = simd::madd_rc<real_t>(r_real, x_imag, m3_imag);
+                m3_imag = m3_imag - r_imag * x_real;
+            }
+            simd::store_packed2(py_parts + 2 * row, r_real, r_imag);
+        }
+        for (auto row = loop.vec_end; row < loop.end; ++row) {
+            split_ell_row<diagonal>(row, matrix, px, py, m2, m3);
+        }
+
+        if (diagonal) {
+            m2 += simd::reduce_add(m2_vec);
+            m3 += scalar_t{simd::reduce_add(m3_real), simd::reduce_add(m3_imag)};
+        }
+    }
+#endif // !SIMDPP_USE_NULL
+
+    /// The vectorized kernel is only needed for complex scalars: real values are already split
+    template<class scalar_t>
+    using use_split_simd = std::integral_constant<bool, !SIMDPP_USE_NULL
+                                                        && num::is_complex<scalar_t>()>;
+} // namespace detail
+
+/**
+ KPM-specialized matrix-vector multiplication (ELLPACK with split real/imaginary planes)
+
+ Equivalent to: y = matrix * x - y
+
+ The vectors keep the interleaved complex layout: the real and imaginary parts of `x` are
+ gathered into separate registers using the premultiplied offsets of the matrix.
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::SplitEllMatrix<scalar_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    auto unused = scalar_t{0};
+    detail::split_ell_spmv<false>(start, end, matrix, x, y, unused, unused,
+                                  detail::use_split_simd<scalar_t>{});
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::SplitEllMatrix<scalar_t> const& matrix,
+              MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y) {
+    for (auto row = start; row < end; ++row) {
+        y.row(row) = -y.row(row);
+    }
+
+    for (auto n = 0; n < matrix.nnz_per_row; ++n) {
+        for (auto row = start; row < end; ++row) {
+            y.row(row) += matrix.value(row, n) * x.row(matrix.col(row, n));
+        }
+    }
+}
+
+/**
+ KPM-specialized matrix-vector multiplication (ELLPACK with split real/imaginary planes,
+ diagonal)
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::SplitEllMatrix<scalar_t> const& matrix,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       scalar_t& m2, scalar_t& m3) {
+    detail::split_ell_spmv<true>(start, end, matrix, x, y, m2, m3,
+                                 detail::use_split_simd<scalar_t>{});
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::SplitEllMatrix<scalar_t> const& matrix,
+                       MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
+                       simd::array<scalar_t>& m2, simd::array<scalar_t>& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    auto const size = end - start;
+    auto const cols = x.cols();
+    for (auto i = 0; i < cols; ++i) {
+        m2[i] += x.col(i).segment(start, size).squaredNorm();
+        m3[i] += y.col(i).segment(start, size).dot(x.col(i).segment(start, size));
+    }
+}
+
+namespace detail {
+    /// The `bf16` values of one column of a `QuantizedEllMatrix`
+    template<class real_t>
+    struct Bf16Values {
+        std::uint16_t const* codes;
+
+        CPB_ALWAYS_INLINE real_t operator[](idx_t row) const {
+            return static_cast<real_t>(num::bf16_to_float(codes[row]));
+        }
+    };
+
+    /// The `int8` values of one column of a `QuantizedEllMatrix`
+    template<class real_t>
+    struct Int8Values {
+        std::int8_t const* codes;
+        real_t step;
+
+        CPB_ALWAYS_INLINE real_t operator[](idx_t row) const {
+            return step * static_cast<real_t>(codes[row]);
+        }
+    };
+
+#if SIMDPP_USE_NULL // generic version
+
+    /// One column of the quantized ELLPACK product: y[row] += value(row, n) * x[col(row, n)]
+    template<class scalar_t, class Values> CPB_ALWAYS_INLINE
+    void quantized_ell_column(idx_t start, idx_t end, Values const& values,
+                              storage_idx_t const* idx, scalar_t const* px, scalar_t* py) {
+        for (auto row = start; row < end; ++row) {
+            py[row] += mul(static_cast<scalar_t>(values[row]), px[idx[row]]);
+        }
+    }
+
+#else // vectorized using SIMD intrinsics
+
+    /// The codes of `step` rows are converted into an aligned buffer which is loaded as the
+    /// register of values: the narrow codes are the only matrix values read from memory
+    template<class scalar_t, class Values> CPB_ALWAYS_INLINE
+    void quantized_ell_column(idx_t start, idx_t end, Values const& values,
+                              storage_idx_t const* idx, scalar_t const* px, scalar_t* py) {
+        using simd_register_t = simd::select_vector_t<scalar_t>;
+        static constexpr auto step = simd::traits<scalar_t>::size;
+        auto const loop = simd::split_loop(py, start, end);
+
+        alignas(simd::traits<scalar_t>::align_bytes) scalar_t decoded[step];
+        for (auto row = loop.start; row < loop.peel_end; ++row) {
+            py[row] += mul(static_cast<scalar_t>(values[row]), px[idx[row]]);
+        }
+        for (auto row = loop.peel_end; row < loop.vec_end; row += step) {
+            for (auto i = idx_t{0}; i < step; ++i) {
+                decoded[i] = static_cast<scalar_t>(values[row + i]);
+            }
+            auto const a = simd::load<simd_register_t>(decoded);
+            auto const b = simd::gather<simd_register_t>(px, idx + row);
+            auto const c = simd::load<simd_register_t>(py + row);
+            simd::store(py + row, simd::madd_rc<scalar_t>(a, b, c));
+        }
+        for (auto row = loop.vec_end; row < loop.end; ++row) {
+            py[row] += mul(static_cast<scalar_t>(values[row]), px[idx[row]]);
+        }
+    }
+
+#endif // SIMDPP_USE_NULL
+} // namespace detail
+
+/**
+ KPM-specialized matrix-vector multiplication (ELLPACK with quantized values, off-diagonal)
+
+ Equivalent to: y = matrix * x - y
+
+ The `bf16` or `int8` codes are converted to `scalar_t` just before the multiplication.
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::QuantizedEllMatrix<scalar_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    using real_t = num::get_real_t<scalar_t>;
+    for (auto row = start; row < end; ++row) {
+        y[row] = -y[row];
+    }
+
+    auto const px = x.data();
+    auto const py = y.data();
+    for (auto n = 0; n < matrix.nnz_per_row; ++n) {
+        auto const idx = &matrix.indices(0, n);
+        if (matrix.precision == num::ValuePrecision::BF16) {
+            auto const values = detail::Bf16Values<real_t>{&matrix.bf16(0, n)};
+            detail::quantized_ell_column(start, end, values, idx, px, py);
+        } else {
+            auto const values = detail::Int8Values<real_t>{&matrix.int8(0, n), matrix.step};
+            detail::quantized_ell_column(start, end, values, idx, px, py);
+        }
+    }
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::QuantizedEllMatrix<scalar_t> const& matrix,
+              MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y) {
+    for (auto row = start; row < end; ++row) {
+        y.row(row) = -y.row(row);
+    }
+
+    for (auto n = 0; n < matrix.nnz_per_row; ++n) {
+        for (auto row = start; row < end; ++row) {
+            y.row(row) += matrix.value(row, n) * x.row(matrix.indices(row, n));
+        }
+    }
+}
+
+/**
+ KPM-specialized matrix-vector multiplication (ELLPACK with quantized values, diagonal)
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::QuantizedEllMatrix<scalar_t> const& matrix,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       scalar_t& m2, scalar_t& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    auto const size = end - start;
+    m2 += x.segment(start, size).squaredNorm();
+    m3 += y.segment(start, size).dot(x.segment(start, size));
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::QuantizedEllMatrix<scalar_t> const& matrix,
+                       MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
+                       simd::array<scalar_t>& m2, simd::array<scalar_t>& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    auto const size = end - start;
+    auto const cols = x.cols();
+    for (auto i = 0; i < cols; ++i) {
+        m2[i] += x.col(i).segment(start, size).squaredNorm();
+        m3[i] += y.col(i).segment(start, size).dot(x.col(i).segment(start, size));
+    }
+}
+
+namespace detail {
+    /// Generic version of the `MultiEllMatrix` product: one row and member at a time
+    template<bool diagonal, class scalar_t> CPB_ALWAYS_INLINE
+    void multi_ell_spmv(idx_t start, idx_t end, num::MultiEllMatrix<scalar_t> const& matrix,
+                        MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
+                        simd::array<scalar_t>& m2, simd::array<scalar_t>& m3, std::false_type) {
+        auto const lanes = matrix.num_lanes;
+        for (auto row = start; row < end; ++row) {
+            for (auto lane = idx_t{0}; lane < lanes; ++lane) {
+                y(row, lane) = -y(row, lane);
+            }
+            for (auto n = idx_t{0}; n < matrix.nnz_per_row; ++n) {
+                auto const col = matrix.indices(row, n);
+                auto const values = matrix.values(row, n);
+                for (auto lane = idx_t{0}; lane < lanes; ++lane) {
+                    y(row, lane) += mul(values[lane], x(col, lane));
+                }
+            }
+            if (diagonal) {
+                for (auto lane = idx_t{0}; lane < lanes; ++lane) {
+                    m2[lane] += square(x(row, lane));
+                    m3[lane] += mul(num::conjugate(y(row, lane)), x(row, lane));
+                }
+            }
+        }
+    }
+
+#if !SIMDPP_USE_NULL
+    /// Vectorized version for `num_lanes` equal to the SIMD width: the values of all the
+    /// members are loaded as one register and multiplied by the matching row of `x`
+    template<bool diagonal, class scalar_t> CPB_ALWAYS_INLINE
+    void multi_ell_spmv(idx_t start, idx_t end, num::MultiEllMatrix<scalar_t> const& matrix,
+                        MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
+                        simd::array<scalar_t>& m2, simd::array<scalar_t>& m3, std::true_type) {
+        using simd_register_t = simd::select_vector_t<scalar_t>;
+        static constexpr auto step = simd::traits<scalar_t>::size;
+
+        auto const px = x.data();
+        auto const py = y.data();
+        auto m2_vec = simd::make_float<simd_register_t>(0);
+        auto m3_vec = simd::make_float<simd_register_t>(0);
+
+        for (auto row = start; row < end; ++row) {
+            auto r = simd::neg(simd::load<simd_register_t>(py + row * step));
+            for (auto n = idx_t{0}; n < matrix.nnz_per_row; ++n) {
+                auto const a = simd::load<simd_register_t>(matrix.values(row, n));
+                auto const b = simd::load<simd_register_t>(px + matrix.indices(row, n) * step);
+                r = simd::madd_rc<scalar_t>(a, b, r);
+            }
+            if (diagonal) {
+                auto const r1 = simd::load<simd_register_t>(px + row * step);
+                m2_vec = m2_vec + r1 * r1;
+                m3_vec = simd::conjugate_madd_rc<scalar_t>(r, r1, m3_vec);
+            }
+            simd::store(py + row * step, r);
+        }
+
+        if (diagonal) {
+            m2_vec = simd::reduce_imag<scalar_t>(m2_vec);
+            simd::store_u(m2.data(), simd::load_u<simd_register_t>(m2.data()) + m2_vec);
+            simd::store_u(m3.data(), simd::load_u<simd_register_t>(m3.data()) + m3_vec);
+        }
+    }
+#endif // !SIMDPP_USE_NULL
+
+    template<bool diagonal, class scalar_t> CPB_ALWAYS_INLINE
+    void multi_ell_spmv(idx_t start, idx_t end, num::MultiEllMatrix<scalar_t> const& matrix,
+                        MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
+                        simd::array<scalar_t>& m2, simd::array<scalar_t>& m3) {
+#if SIMDPP_USE_NULL
+        multi_ell_spmv<diagonal>(start, end, matrix, x, y, m2, m3, std::false_type{});
+#else
+        if (matrix.num_lanes == static_cast<idx_t>(simd::traits<scalar_t>::size)) {
+            multi_ell_spmv<diagonal>(start, end, matrix, x, y, m2, m3, std::true_type{});
+        } else {
+            multi_ell_spmv<diagonal>(start, end, matrix, x, y, m2, m3, std::false_type{});
+        }
+#endif
+    }
+} // namespace detail
+
+/**
+ KPM-specialized matrix-vector multiplication (ELLPACK of several Hamiltonians)
+
+ Equivalent to: y.col(i) = member(i) * x.col(i) - y.col(i)
+
+ There's only a batch version: the columns of the vectors are the members, see `MultiEllMatrix`.
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::MultiEllMatrix<scalar_t> const& matrix,
+              MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y) {
+    auto unused = simd::array<scalar_t>{};
+    detail::multi_ell_spmv<false>(start, end, matrix, x, y, unused, unused);
+}
+
+/**
+ KPM-specialized matrix-vector multiplication (ELLPACK of several Hamiltonians, diagonal)
+
+ Equivalent to:
+   y.col(i) = member(i) * x.col(i) - y.col(i)
+   m2[i] = x.col(i)^2
+   m3[i] = dot(x.col(i), y.col(i))
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::MultiEllMatrix<scalar_t> const& matrix,
+                       MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
+                       simd::array<scalar_t>& m2, simd::array<scalar_t>& m3) {
+    detail::multi_ell_spmv<true>(start, end, matrix, x, y, m2, m3);
+}
+
+namespace detail {
+    /// Add the overflow elements of the HYB rows `[start, end)` to `y` and, if `m3 != nullptr`,
+    /// the resulting change of `m3 = dot(x, y)` (the ELL part has already been summed)
+    template<class scalar_t> CPB_ALWAYS_INLINE
+    void hyb_overflow(idx_t start, idx_t end, num::HybMatrix<scalar_t> const& matrix,
+                      VectorX<scalar_t> const& x, VectorX<scalar_t>& y, scalar_t* m3) {
+        auto const& overflow = matrix.overflow;
+        auto const indptr = overflow.outerIndexPtr();
+        auto const indices = overflow.innerIndexPtr();
+        auto const values = overflow.valuePtr();
+        for (auto row = start; row < end; ++row) {
+            if (indptr[row] == indptr[row + 1]) { continue; }
+
+            auto delta = scalar_t{0};
+            for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                delta += mul(values[n], x[indices[n]]);
+            }
+            y[row] += delta;
+            if (m3) { *m3 += mul(num::conjugate(delta), x[row]); }
+        }
+    }
+
+    template<class scalar_t> CPB_ALWAYS_INLINE
+    void hyb_overflow(idx_t start, idx_t end, num::HybMatrix<scalar_t> const& matrix,
+                      MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y, scalar_t* m3) {
+        auto const& overflow = matrix.overflow;
+        auto const indptr = overflow.outerIndexPtr();
+        auto const indices = overflow.innerIndexPtr();
+        auto const values = overflow.valuePtr();
+        auto const cols = x.cols();
+        for (auto row = start; row < end; ++row) {
+            if (indptr[row] == indptr[row + 1]) { continue; }
+
+            for (auto i = idx_t{0}; i < cols; ++i) {
+                auto delta = scalar_t{0};
+                for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                    delta += mul(values[n], x(indices[n], i));
+                }
+                y(row, i) += delta;
+                if (m3) { m3[i] += mul(num::conjugate(delta), x(row, i)); }
+            }
+        }
+    }
+} // namespace detail
+
+/**
+ KPM-specialized matrix-vector multiplication (HYB, off-diagonal)
+
+ Equivalent to: y = matrix * x - y
+
+ The ELL part uses the vectorized ELLPACK kernel and the few overflow elements are added
+ afterwards, one row at a time.
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::HybMatrix<scalar_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    kpm_spmv(start, end, matrix.ell, x, y);
+    detail::hyb_overflow(start, end, matrix, x, y, static_cast<scalar_t*>(nullptr));
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::HybMatrix<scalar_t> const& matrix,
+              MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y) {
+    kpm_spmv(start, end, matrix.ell, x, y);
+    detail::hyb_overflow(start, end, matrix, x, y, static_cast<scalar_t*>(nullptr));
+}
+
+/**
+ KPM-specialized matrix-vector multiplication (HYB, diagonal)
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+
+ The moments are summed by the fused ELLPACK kernel and then corrected for the overflow:
+ `m3` is linear in `y`, so only the overflow rows need to be read a second time.
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::HybMatrix<scalar_t> const& matrix,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       scalar_t& m2, scalar_t& m3) {
+    kpm_spmv_diagonal(start, end, matrix.ell, x, y, m2, m3);
+    detail::hyb_overflow(start, end, matrix, x, y, &m3);
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::HybMatrix<scalar_t> const& matrix,
+                       MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
+                       simd::array<scalar_t>& m2, simd::array<scalar_t>& m3) {
+    kpm_spmv_diagonal(start, end, matrix.ell, x, y, m2, m3);
+    detail::hyb_overflow(start, end, matrix, x, y, m3.data());
+}
+
+/**
+ KPM-specialized matrix-vector multiplication (memory-mapped CSR, off-diagonal)
+
+ Equivalent to: y = matrix * x - y
+
+ The rows are processed in blocks and the next block is prefetched from the file before
+ the current one is computed. The scaling `h2 = a * H - b` is applied to each row sum.
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::MappedCsrMatrix<scalar_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    auto const data = matrix.values;
+    auto const indices = matrix.indices;
+    auto const indptr = matrix.indptr;
+    auto const a = matrix.scale_a;
+    auto const b = matrix.scale_b;
+
+    auto const block_rows = idx_t{matrix.block_rows};
+    matrix.prefetch(start, std::min(start + block_rows, end));
+    for (auto block_start = start; block_start < end; block_start += block_rows) {
+        auto const block_end = std::min(block_start + block_rows, end);
+        matrix.prefetch(block_end, std::min(block_end + block_rows, end));
+
+        for (auto row = block_start; row < block_end; ++row) {
+            auto r = scalar_t{0};
+            for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                r += detail::mul(data[n], x[indices[n]]);
+            }
+            y[row] = a * r - b * x[row] - y[row];
+        }
+    }
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(idx_t start, idx_t end, num::MappedCsrMatrix<scalar_t> const& matrix,
+              MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y) {
+    auto const data = matrix.values;
+    auto const indices = matrix.indices;
+    auto const indptr = matrix.indptr;
+    auto const a = matrix.scale_a;
+    auto const b = matrix.scale_b;
+
+    using Row = Eigen::Matrix<scalar_t, 1, Eigen::Dynamic>;
+    auto tmp = Row(x.cols());
+    auto const block_rows = idx_t{matrix.block_rows};
+    matrix.prefetch(start, std::min(start + block_rows, end));
+    for (auto block_start = start; block_start < end; block_start += block_rows) {
+        auto const block_end = std::min(block_start + block_rows, end);
+        matrix.prefetch(block_end, std::min(block_end + block_rows, end));
+
+        for (auto row = block_start; row < block_end; ++row) {
+            tmp.setZero();
+            for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                tmp += data[n] * x.row(indices[n]);
+            }
+            y.row(row) = a * tmp - b * x.row(row) - y.row(row);
+        }
+    }
+}
+
+/**
+ KPM-specialized matrix-vector multiplication (memory-mapped CSR, diagonal)
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::MappedCsrMatrix<scalar_t> const& matrix,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       scalar_t& m2, scalar_t& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    auto const size = end - start;
+    m2 += x.segment(start, size).squaredNorm();
+    m3 += y.segment(start, size).dot(x.segment(start, size));
+}
+
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(idx_t start, idx_t end, num::MappedCsrMatrix<scalar_t> const& matrix,
+                       MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y,
+                       simd::array<scalar_t>& m2, simd::array<scalar_t>& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    auto const size = end - start;
+    auto const cols = x.cols();
+    for (auto i = 0; i < cols; ++i) {
+        m2[i] += x.col(i).segment(start, size).squaredNorm();
+        m3[i] += y.col(i).segment(start, size).dot(x.col(i).segment(start, size));
+    }
+}
+
+CPB_ISA_NAMESPACE_END
 }} // namespace cpb::compute
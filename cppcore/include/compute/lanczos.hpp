@@ -10,9 +10,121 @@
 #include "numeric/random.hpp"
 #include "compute/detail.hpp"
 #include "support/simd.hpp"
+#include "detail/thread.hpp"
+
+#include <Eigen/Eigenvalues>
+
+#include <functional>
+#include <memory>
+#include <vector>
 
 namespace cpb { namespace compute {
 
+struct LanczosBounds {
+    double min; ///< the lowest eigenvalue
+    double max; ///< the highest eigenvalue
+    int loops;  ///< number of iterations needed to converge
+};
+
+/// The tridiagonal matrix of a Lanczos recursion: `alpha` is the diagonal
+/// and `beta[n]` couples the Lanczos vectors `n` and `n + 1`
+struct LanczosCoefficients {
+    std::vector<double> alpha;
+    std::vector<double> beta;
+};
+
+/// Called every few Lanczos steps with the coefficients found so far: return true to stop
+using LanczosStop = std::function<bool (LanczosCoefficients const&)>;
+
+/**
+ Diagonal Green's function `G(E) = <i|(E + i*broadening - H)^-1|i>` as the continued fraction
+
+     G(z) = 1 / (z - alpha_0 - beta_0^2 / (z - alpha_1 - beta_1^2 / (...)))
+
+ of the Lanczos coefficients which start from the unit vector `|i>`. The remainder of the
+ truncated chain is replaced by a square-root terminator: the Green's function of a semi-infinite
+ chain with the mean coefficients of the last quarter of the steps. This gives a continuous band
+ instead of the false poles of the plain truncation.
+ */
+inline ArrayXcd continued_fraction(LanczosCoefficients const& c, ArrayXd const& energy,
+                                   double broadening) {
+    auto const n = c.alpha.size();
+    auto result = ArrayXcd::Zero(energy.size()).eval();
+    if (n == 0) { return result; }
+
+    auto const num_tail = std::max(n / 4, size_t{1});
+    auto a_inf = 0.0, b_inf = 0.0;
+    for (auto k = n - num_tail; k < n; ++k) {
+        a_inf += c.alpha[k];
+        b_inf += c.beta[k];
+    }
+    a_inf /= static_cast<double>(num_tail);
+    b_inf /= static_cast<double>(num_tail);
+
+    for (auto i = idx_t{0}; i < energy.size(); ++i) {
+        auto const z = std::complex<double>{energy[i], broadening};
+        auto const w = z - a_inf;
+        // The retarded branch: Im(g) <= 0
+        auto s = std::sqrt(w * w - 4 * b_inf * b_inf);
+        if ((w + s).imag() < 0) { s = -s; }
+        auto g = 2.0 / (w + s);
+
+        for (auto k = n; k-- > 0;) {
+            g = 1.0 / (z - c.alpha[k] - c.beta[k] * c.beta[k] * g);
+        }
+        result[i] = g;
+    }
+    return result;
+}
+
+/**
+ Contiguous row blocks for the threaded Lanczos steps
+
+ The block size is a multiple of `row_alignment` to keep the SIMD loops aligned and to avoid
+ false sharing. There's only one block (no threads) if the matrix has less than `min_rows`
+ rows per thread: the steps would be too short to be worth the synchronization.
+ */
+struct LanczosPartition {
+    static constexpr idx_t row_alignment = 64;
+
+    idx_t size;
+    idx_t block_size;
+    idx_t num_blocks;
+
+    LanczosPartition(idx_t size, idx_t num_threads, idx_t min_rows = 4096) : size(size) {
+        auto const max_blocks = std::max(size / min_rows, idx_t{1});
+        auto const n = std::max(std::min(num_threads, max_blocks), idx_t{1});
+        block_size = (size + n - 1) / n;
+        block_size = (block_size + row_alignment - 1) / row_alignment * row_alignment;
+        num_blocks = block_size > 0 ? (size + block_size - 1) / block_size : 1;
+    }
+
+    idx_t start(idx_t i) const { return std::min(i * block_size, size); }
+    idx_t end(idx_t i) const { return std::min((i + 1) * block_size, size); }
+};
+
+/**
+ Error bounds `|beta_m * s_m|` of the lowest and highest Ritz values of a Lanczos recursion
+
+ `s_m` is the last component of the eigenvector of the tridiagonal matrix (`alpha`, `beta`).
+ There's an eigenvalue of the original matrix within this distance of each Ritz value.
+ */
+template<class real_t>
+std::pair<double, double> ritz_residuals(std::vector<real_t> const& alpha,
+                                         std::vector<real_t> const& beta) {
+    auto const n = static_cast<idx_t>(alpha.size());
+    auto const a = eigen_cast<ArrayX>(alpha).template cast<double>().eval();
+    auto const b = eigen_cast<ArrayX>(beta).template cast<double>().eval();
+
+    auto solver = Eigen::SelfAdjointEigenSolver<MatrixXd>();
+    solver.computeFromTridiagonal(a.matrix(), b.head(n - 1).matrix(), Eigen::ComputeEigenvectors);
+    auto const& s = solver.eigenvectors(); // sorted by increasing eigenvalue
+    auto const b_last = std::abs(b[n - 1]);
+    return {b_last * std::abs(s(n - 1, 0)), b_last * std::abs(s(n - 1, n - 1))};
+}
+
+CPB_ISA_NAMESPACE_BEGIN
+
 /**
  Lanczos-specialized sparse matrix-vector multiplication + dot product
 
@@ -24,14 +136,14 @@ namespace cpb { namespace compute {
  */
 template<class scalar_t, class real_t = num::get_real_t<scalar_t>> CPB_ALWAYS_INLINE
 real_t lanczos_spmv(real_t b_prev, SparseMatrixX<scalar_t> const& matrix,
-                    VectorX<scalar_t> const& v1, VectorX<scalar_t>& v0) {
-    auto const size = matrix.rows();
+                    VectorX<scalar_t> const& v1, VectorX<scalar_t>& v0,
+                    idx_t start, idx_t end) {
     auto const data = matrix.valuePtr();
     auto const indices = matrix.innerIndexPtr();
     auto const indptr = matrix.outerIndexPtr();
 
     auto a = real_t{0};
-    for (auto row = 0; row < size; ++row) {
+    for (auto row = start; row < end; ++row) {
         auto tmp = scalar_t{0};
         for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
             tmp += detail::mul(data[n], v1[indices[n]]);
@@ -43,35 +155,47 @@ real_t lanczos_spmv(real_t b_prev, SparseMatrixX<scalar_t> const& matrix,
     return a;
 }
 
+template<class scalar_t, class real_t = num::get_real_t<scalar_t>> CPB_ALWAYS_INLINE
+real_t lanczos_spmv(real_t b_prev, SparseMatrixX<scalar_t> const& matrix,
+                    VectorX<scalar_t> const& v1, VectorX<scalar_t>& v0) {
+    return lanczos_spmv(b_prev, matrix, v1, v0, 0, matrix.rows());
+}
+
 /**
-  Lanczos-specialized a * x + y
+  Lanczos-specialized a * x + y for the rows `[start, end)`
 
   Equivalent to:
     v0 -= a * v1
-    b = norm(v0)
-    return b
+    return squared_norm(v0)
  */
 #if SIMDPP_USE_NULL // generic version
 template<class scalar_t, class real_t = num::get_real_t<scalar_t>> CPB_ALWAYS_INLINE
-real_t lanczos_axpy(real_t a, VectorX<scalar_t> const& v1, VectorX<scalar_t>& v0) {
-    auto const size = v0.size();
+real_t lanczos_axpy_norm2(real_t a, VectorX<scalar_t> const& v1, VectorX<scalar_t>& v0,
+                          idx_t start, idx_t end) {
     auto norm2 = real_t{0};
-    for (auto i = 0; i < size; ++i) {
+    for (auto i = start; i < end; ++i) {
         auto const l = v0[i] - a * v1[i];
         norm2 += detail::square(l);
         v0[i] = l;
     }
-    return std::sqrt(norm2);
+    return norm2;
 }
 #else // vectorized using SIMD intrinsics
 template<class scalar_t, class real_t = num::get_real_t<scalar_t>> CPB_ALWAYS_INLINE
-real_t lanczos_axpy(real_t a, VectorX<scalar_t> const& v1, VectorX<scalar_t>& v0) {
+real_t lanczos_axpy_norm2(real_t a, VectorX<scalar_t> const& v1, VectorX<scalar_t>& v0,
+                          idx_t start, idx_t end) {
     using simd_register_t = simd::select_vector_t<scalar_t>;
-    auto const loop = simd::split_loop(v0.data(), 0, v0.size());
-    assert(loop.peel_end == 0); // all eigen vectors are properly aligned when starting from 0
+    auto const loop = simd::split_loop(v0.data(), start, end);
+
+    auto norm2_remainder = real_t{0};
+    for (auto i = loop.start; i < loop.peel_end; ++i) {
+        auto const tmp = v0[i] - a * v1[i];
+        norm2_remainder += detail::square(tmp);
+        v0[i] = tmp;
+    }
 
     auto norm2_vec = simd::make_float<simd_register_t>(0);
-    for (auto i = idx_t{0}; i < loop.vec_end; i += loop.step) {
+    for (auto i = loop.peel_end; i < loop.vec_end; i += loop.step) {
         auto const r0 = simd::load<simd_register_t>(v0.data() + i);
         auto const r1 = simd::load<simd_register_t>(v1.data() + i);
         auto const tmp = simd_register_t{r0 - a * r1};
@@ -79,26 +203,104 @@ real_t lanczos_axpy(real_t a, VectorX<scalar_t> const& v1, VectorX<scalar_t>& v0
         simd::store(v0.data() + i, tmp);
     }
 
-    auto norm2_remainder = real_t{0};
     for (auto i = loop.vec_end; i < loop.end; ++i) {
         auto const tmp = v0[i] - a * v1[i];
         norm2_remainder += detail::square(tmp);
         v0[i] = tmp;
     }
 
-    return std::sqrt(simd::reduce_add(norm2_vec) + norm2_remainder);
+    return simd::reduce_add(norm2_vec) + norm2_remainder;
 }
 #endif // SIMDPP_USE_NULL
 
-struct LanczosBounds {
-    double min; ///< the lowest eigenvalue
-    double max; ///< the highest eigenvalue
-    int loops;  ///< number of iterations needed to converge
+/**
+  Lanczos-specialized a * x + y
+
+  Equivalent to:
+    v0 -= a * v1
+    b = norm(v0)
+    return b
+ */
+template<class scalar_t, class real_t = num::get_real_t<scalar_t>> CPB_ALWAYS_INLINE
+real_t lanczos_axpy(real_t a, VectorX<scalar_t> const& v1, VectorX<scalar_t>& v0) {
+    return std::sqrt(lanczos_axpy_norm2(a, v1, v0, 0, v0.size()));
+}
+
+/**
+ One step of the Lanczos recursion split into the row blocks of a `LanczosPartition`
+
+ Each step is two passes of the team: the matrix-vector product with the partial sums of
+ `alpha`, then the vector update with the partial sums of the norm (`beta`). The partial sums
+ are reduced in block order so the result doesn't depend on the thread scheduling.
+ A single block runs on the calling thread.
+ */
+template<class scalar_t>
+class LanczosStepper {
+    using real_t = num::get_real_t<scalar_t>;
+
+public:
+    LanczosStepper(SparseMatrixX<scalar_t> const& matrix, idx_t num_threads)
+        : matrix(matrix), partition(matrix.rows(), num_threads),
+          partial(static_cast<size_t>(partition.num_blocks)),
+          team(partition.num_blocks > 1 ? new ThreadTeam(partition.num_blocks) : nullptr) {}
+
+    /// Return `{alpha, beta}` and leave `v0 = (H * v1 - beta_prev * v0 - alpha * v1) / beta`
+    std::pair<real_t, real_t> operator()(real_t b_prev, VectorX<scalar_t> const& v1,
+                                         VectorX<scalar_t>& v0) {
+        if (!team) {
+            auto const a = lanczos_spmv(b_prev, matrix, v1, v0);
+            auto const b = lanczos_axpy(a, v1, v0);
+            v0 *= 1 / b;
+            return {a, b};
+        }
+
+        team->run([&](idx_t i) {
+            if (i >= partition.num_blocks) { return; }
+            partial[i] = lanczos_spmv(b_prev, matrix, v1, v0,
+                                      partition.start(i), partition.end(i));
+        });
+        auto const a = sum();
+
+        team->run([&](idx_t i) {
+            if (i >= partition.num_blocks) { return; }
+            partial[i] = lanczos_axpy_norm2(a, v1, v0, partition.start(i), partition.end(i));
+        });
+        auto const b = std::sqrt(sum());
+
+        team->run([&](idx_t i) {
+            if (i >= partition.num_blocks) { return; }
+            auto const start = partition.start(i);
+            v0.segment(start, partition.end(i) - start) *= 1 / b;
+        });
+        return {a, b};
+    }
+
+private:
+    real_t sum() const {
+        auto total = real_t{0};
+        for (auto x : partial) { total += x; }
+        return total;
+    }
+
+private:
+    SparseMatrixX<scalar_t> const& matrix;
+    LanczosPartition partition;
+    std::vector<real_t> partial;
+    std::unique_ptr<ThreadTeam> team;
 };
 
-/// Use the Lanczos algorithm to find the min and max eigenvalues at given precision (%)
+/**
+ Use the Lanczos algorithm to find the min and max eigenvalues at given precision (%)
+
+ The steps are split among `num_threads` if the matrix is large enough, see `LanczosStepper`.
+ With a `coarse_percent > precision_percent`, the recursion stops as soon as the extremes
+ change by less than `coarse_percent` of their value and their `ritz_residuals()` are also
+ within `coarse_percent` of the spectrum half-width. It's only refined up to the full
+ `precision_percent` when those coarse estimates are not reliable.
+ */
 template<class scalar_t>
-LanczosBounds minmax_eigenvalues(SparseMatrixX<scalar_t> const& matrix, double precision_percent) {
+LanczosBounds minmax_eigenvalues(SparseMatrixX<scalar_t> const& matrix, double precision_percent,
+                                 idx_t num_threads = 1, double coarse_percent = 0) {
     using real_t = num::get_real_t<scalar_t>;
     simd::scope_disable_denormals guard;
 
@@ -116,6 +318,8 @@ LanczosBounds minmax_eigenvalues(SparseMatrixX<scalar_t> const& matrix, double p
     auto previous_min = std::numeric_limits<real_t>::max();
     auto previous_max = std::numeric_limits<real_t>::lowest();
     auto const precision = static_cast<real_t>(precision_percent / 100);
+    auto const coarse = static_cast<real_t>(coarse_percent / 100);
+    auto step = LanczosStepper<scalar_t>(matrix, num_threads);
 
     constexpr auto loop_limit = 1000;
     // This may iterate up to matrix_size, but since only the extreme eigenvalues are required it
@@ -124,14 +328,11 @@ LanczosBounds minmax_eigenvalues(SparseMatrixX<scalar_t> const& matrix, double p
         // PART 1: Calculate tridiagonal matrix elements a and b
         // =====================================================
         auto const b_prev = !beta.empty() ? beta.back() : real_t{0};
-        auto const a = lanczos_spmv(b_prev, matrix, v1, v0);
-        auto const b = lanczos_axpy(a, v1, v0);
-
-        v0 *= 1 / b;
+        auto const ab = step(b_prev, v1, v0);
         v0.swap(v1);
 
-        alpha.push_back(a);
-        beta.push_back(b);
+        alpha.push_back(ab.first);
+        beta.push_back(ab.second);
 
         // PART 2: Check if the largest magnitude eigenvalues have converged
         // =================================================================
@@ -139,12 +340,19 @@ LanczosBounds minmax_eigenvalues(SparseMatrixX<scalar_t> const& matrix, double p
                                                                   eigen_cast<ArrayX>(beta));
         auto const min = eigenvalues.minCoeff();
         auto const max = eigenvalues.maxCoeff();
-        auto const is_converged_min = abs((previous_min - min) / min) < precision;
-        auto const is_converged_max = abs((previous_max - max) / max) < precision;
+        auto const change_min = abs((previous_min - min) / min);
+        auto const change_max = abs((previous_max - max) / max);
 
-        if (is_converged_min && is_converged_max) {
+        if (change_min < precision && change_max < precision) {
             return {min, max, i};
         }
+        if (coarse > precision && change_min < coarse && change_max < coarse) {
+            auto const residuals = ritz_residuals(alpha, beta);
+            auto const tolerance = coarse * 0.5 * (max - min);
+            if (residuals.first < tolerance && residuals.second < tolerance) {
+                return {min, max, i};
+            }
+        }
 
         previous_min = min;
         previous_max = max;
@@ -153,4 +361,45 @@ LanczosBounds minmax_eigenvalues(SparseMatrixX<scalar_t> const& matrix, double p
     throw std::runtime_error{"Lanczos algorithm did not converge for the min/max eigenvalues."};
 }
 
+/**
+ Lanczos recursion which starts from the unit vector of `index`, see `LanczosCoefficients`
+
+ It runs for `max_steps` unless the `stop` condition (checked every `check_interval` steps) is
+ met or the Krylov space is exhausted, i.e. `beta` vanishes and the continued fraction is exact.
+ */
+template<class scalar_t>
+LanczosCoefficients lanczos_coefficients(SparseMatrixX<scalar_t> const& matrix, idx_t index,
+                                         idx_t max_steps, LanczosStop const& stop,
+                                         idx_t check_interval = 16) {
+    using real_t = num::get_real_t<scalar_t>;
+    simd::scope_disable_denormals guard;
+    constexpr auto tolerance = 100 * std::numeric_limits<real_t>::epsilon();
+
+    auto v0 = VectorX<scalar_t>::Zero(matrix.rows()).eval();
+    auto v1 = VectorX<scalar_t>::Zero(matrix.rows()).eval();
+    v1[index] = scalar_t{1};
+
+    auto result = LanczosCoefficients();
+    auto const num_steps = std::min(max_steps, static_cast<idx_t>(matrix.rows()));
+    result.alpha.reserve(static_cast<size_t>(num_steps));
+    result.beta.reserve(static_cast<size_t>(num_steps));
+
+    auto b_prev = real_t{0};
+    for (auto i = idx_t{1}; i <= num_steps; ++i) {
+        auto const a = lanczos_spmv(b_prev, matrix, v1, v0);
+        auto const b = lanczos_axpy(a, v1, v0);
+        result.alpha.push_back(a);
+        result.beta.push_back(b);
+
+        if (b <= tolerance * (std::abs(a) + b_prev)) { break; } // invariant subspace
+        if (i % check_interval == 0 && stop && stop(result)) { break; }
+
+        v0 *= 1 / b;
+        v0.swap(v1);
+        b_prev = b;
+    }
+    return result;
+}
+
+CPB_ISA_NAMESPACE_END
 }} // namespace cpb::compute
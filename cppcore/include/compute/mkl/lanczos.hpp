@@ -1,8 +1,10 @@
 #pragma once
 #include "numeric/dense.hpp"
+#include "detail/macros.hpp"
 #include "compute/mkl/wrapper.hpp"
 
 namespace cpb { namespace compute {
+CPB_ISA_NAMESPACE_BEGIN
 
 template<class Derived, class scalar_t = typename Derived::Scalar>
 inline ArrayX<scalar_t> tridiagonal_eigenvalues(DenseBase<Derived> const& alpha,
@@ -20,4 +22,5 @@ inline ArrayX<scalar_t> tridiagonal_eigenvalues(DenseBase<Derived> const& alpha,
     return eigenvalues;
 }
 
+CPB_ISA_NAMESPACE_END
 }} // namespace cpb::compute
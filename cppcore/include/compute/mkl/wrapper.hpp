@@ -47,6 +47,26 @@ template<> struct csrgemv<double> { static constexpr auto call = mkl_cspblas_dcs
 template<> struct csrgemv<std::complex<float>> { static constexpr auto call = mkl_cspblas_ccsrgemv; };
 template<> struct csrgemv<std::complex<double>> { static constexpr auto call = mkl_cspblas_zcsrgemv; };
 
+/// Inspector-executor sparse handle of a CSR matrix
+template<class scalar_t> struct sparse_create_csr;
+template<> struct sparse_create_csr<float> { static constexpr auto call = mkl_sparse_s_create_csr; };
+template<> struct sparse_create_csr<double> { static constexpr auto call = mkl_sparse_d_create_csr; };
+template<> struct sparse_create_csr<std::complex<float>> { static constexpr auto call = mkl_sparse_c_create_csr; };
+template<> struct sparse_create_csr<std::complex<double>> { static constexpr auto call = mkl_sparse_z_create_csr; };
+
+/// Inspector-executor sparse matrix vector multiplication: y = alpha*A*x + beta*y
+template<class scalar_t> struct sparse_mv;
+template<> struct sparse_mv<float> { static constexpr auto call = mkl_sparse_s_mv; };
+template<> struct sparse_mv<double> { static constexpr auto call = mkl_sparse_d_mv; };
+template<> struct sparse_mv<std::complex<float>> { static constexpr auto call = mkl_sparse_c_mv; };
+template<> struct sparse_mv<std::complex<double>> { static constexpr auto call = mkl_sparse_z_mv; };
+
+/// Inspector-executor sparse matrix dense matrix multiplication: Y = alpha*A*X + beta*Y
+template<class scalar_t> struct sparse_mm;
+template<> struct sparse_mm<float> { static constexpr auto call = mkl_sparse_s_mm; };
+template<> struct sparse_mm<double> { static constexpr auto call = mkl_sparse_d_mm; };
+template<> struct sparse_mm<std::complex<float>> { static constexpr auto call = mkl_sparse_c_mm; };
+template<> struct sparse_mm<std::complex<double>> { static constexpr auto call = mkl_sparse_z_mm; };
 
 template<class scalar_t> struct feast_hcsrev;
 template<> struct feast_hcsrev<float> { static constexpr auto call = sfeast_scsrev; };
@@ -1,5 +1,6 @@
 #pragma once
 #include <cstddef>
+#include <cstdint>
 
 #ifdef CPB_USE_MKL
 #define EIGEN_USE_MKL_ALL
@@ -13,5 +14,9 @@
 
 namespace cpb {
     using idx_t = std::ptrdiff_t; // type for general indexing and interfaces
+#ifdef CPB_USE_64BIT_INDICES
+    using storage_idx_t = std::int64_t; // for sparse matrices beyond 2^31 non-zeros
+#else
     using storage_idx_t = int; // type used when storing indices in containers
+#endif
 }
@@ -36,3 +36,13 @@
 #else
 # define CPB_ALWAYS_INLINE inline
 #endif
+
+// Code which is compiled more than once for different instruction sets (see `PB_CPU_DISPATCH`)
+// is placed in an inline namespace named after each build so the copies don't collide
+#ifdef CPB_DISPATCH_ISA
+# define CPB_ISA_NAMESPACE_BEGIN inline namespace CPB_DISPATCH_ISA {
+# define CPB_ISA_NAMESPACE_END }
+#else
+# define CPB_ISA_NAMESPACE_BEGIN
+# define CPB_ISA_NAMESPACE_END
+#endif
@@ -1,8 +1,19 @@
 #pragma once
 #include <thread>
+#include <vector>
+#include <algorithm>
 #include <queue>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <exception>
+#include <functional>
 #include <condition_variable>
 
+#include "utils/Affinity.hpp"
+#include "utils/Metrics.hpp"
+#include "utils/ThreadBudget.hpp"
+
 namespace cpb { namespace detail {
 
 template<class T>
@@ -93,63 +104,302 @@ public:
     ~QueueGuard() { wq.remove_producer(); }
 };
 
-#ifdef CPB_USE_MKL
-# include <mkl.h>
+/**
+ Lock-free work-stealing deque of pointers (Chase-Lev)
+
+ Only the owner thread may `push()` and `pop()` at the bottom end (LIFO) while any other
+ thread may `steal()` the oldest element from the top. `pop()` and `steal()` return
+ `nullptr` if the deque is empty or if they lost the race for the last element.
+ The circular buffer grows as needed. The old buffers are kept until destruction since
+ a concurrent thief may still be reading from them.
+
+ Memory orderings follow Lê et al. "Correct and efficient work-stealing for weak memory
+ models" (PPoPP 2013).
+ */
+template<class T>
+class WorkStealingDeque {
+    static_assert(std::is_pointer<T>::value, "The elements must be pointers");
+
+    struct Buffer {
+        explicit Buffer(idx_t capacity)
+            : capacity(capacity), data(new std::atomic<T>[static_cast<size_t>(capacity)]) {}
+
+        T get(idx_t i) const { return data[i & (capacity - 1)].load(std::memory_order_relaxed); }
+        void put(idx_t i, T x) { data[i & (capacity - 1)].store(x, std::memory_order_relaxed); }
+
+        idx_t capacity; ///< always a power of 2
+        std::unique_ptr<std::atomic<T>[]> data;
+    };
 
-class MKLDisableThreading {
 public:
-    MKLDisableThreading(bool condition) : num_threads{mkl_get_max_threads()} {
-        if (condition)
-            mkl_set_num_threads(1);
+    explicit WorkStealingDeque(idx_t capacity = 64) {
+        buffers.emplace_back(new Buffer(capacity));
+        buffer.store(buffers.back().get(), std::memory_order_relaxed);
+    }
+
+    WorkStealingDeque(WorkStealingDeque const&) = delete;
+    WorkStealingDeque& operator=(WorkStealingDeque const&) = delete;
+
+    /// Owner only
+    void push(T x) {
+        auto const b = bottom.load(std::memory_order_relaxed);
+        auto const t = top.load(std::memory_order_acquire);
+        auto a = buffer.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1) {
+            a = grow(a, b, t);
+        }
+        a->put(b, x);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    /// Owner only
+    T pop() {
+        auto const b = bottom.load(std::memory_order_relaxed) - 1;
+        auto const a = buffer.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto t = top.load(std::memory_order_relaxed);
+
+        if (t > b) { // empty
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        auto x = a->get(b);
+        if (t == b) { // the last element: race against the thieves
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                             std::memory_order_relaxed)) {
+                x = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return x;
+    }
+
+    /// Any thread
+    T steal() {
+        auto t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto const b = bottom.load(std::memory_order_acquire);
+        if (t >= b) { return nullptr; }
+
+        auto const x = buffer.load(std::memory_order_acquire)->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return x;
+    }
+
+    /// Approximate number of elements -- exact only if there is no concurrent access
+    idx_t size() const {
+        auto const b = bottom.load(std::memory_order_relaxed);
+        auto const t = top.load(std::memory_order_relaxed);
+        return std::max(b - t, idx_t{0});
+    }
+
+private:
+    Buffer* grow(Buffer const* a, idx_t b, idx_t t) {
+        buffers.emplace_back(new Buffer(2 * a->capacity));
+        auto const new_buffer = buffers.back().get();
+        for (auto i = t; i < b; ++i) {
+            new_buffer->put(i, a->get(i));
+        }
+        buffer.store(new_buffer, std::memory_order_release);
+        return new_buffer;
     }
-    ~MKLDisableThreading() { mkl_set_num_threads(num_threads); }
 
 private:
-    int num_threads;
+    std::atomic<idx_t> top{0};
+    std::atomic<idx_t> bottom{0};
+    std::atomic<Buffer*> buffer{nullptr};
+    std::vector<std::unique_ptr<Buffer>> buffers; ///< owner only
 };
-#endif
 
 } // namespace detail
 
+/**
+ Work-stealing thread pool
+
+ Each worker has its own deque of jobs: it runs the newest job from its own end while idle
+ workers steal the oldest jobs from the other end without taking a lock. Jobs added from
+ outside of the pool are distributed round-robin into per-worker inboxes which are moved
+ in bulk into the deques, so there is no single queue for all the threads to contend on.
+ Jobs added by a job running on a worker go directly into that worker's deque.
+ The workers sleep only when there is nothing left to run or steal.
+ The workers may be pinned to CPU sets, e.g. one NUMA domain each (see `numa_domains()`).
+ Each worker gets an equal share of the `thread_budget()` of the thread which made the pool.
+ */
+class ThreadPool {
+    using Job = std::function<void()>;
+
+    struct Worker {
+        detail::WorkStealingDeque<Job*> deque;
+        std::mutex inbox_mutex;
+        std::vector<Job*> inbox;
+        std::thread thread;
+    };
+
+public:
+    /// Worker `i` is restricted to the CPUs `affinity[i % affinity.size()]` (if not empty)
+    explicit ThreadPool(idx_t num_threads, std::vector<CpuList> const& affinity = {}) {
+        auto const n = static_cast<size_t>(std::max(num_threads, idx_t{1}));
+        for (auto i = size_t{0}; i < n; ++i) {
+            workers.emplace_back(new Worker());
+        }
+        auto const budget = share_budget(static_cast<idx_t>(n));
+        metrics::pool_threads.add(static_cast<std::int64_t>(n));
+        for (auto i = size_t{0}; i < n; ++i) {
+            auto cpus = affinity.empty() ? CpuList{} : affinity[i % affinity.size()];
+            workers[i]->thread = std::thread([this, i, cpus, budget] {
+                ThreadBudgetScope scope(budget);
+                if (!cpus.empty()) { set_thread_affinity(cpus); }
+                work(i);
+            });
+        }
+    }
+
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    ~ThreadPool() { join(); }
+
+    template<class F>
+    void add(F&& f) {
+        auto job = std::unique_ptr<Job>(new Job(std::forward<F>(f)));
+        auto const& self = this_worker();
+        if (self.pool == this) {
+            workers[self.id]->deque.push(job.release());
+        } else {
+            auto const id = next_inbox.fetch_add(1, std::memory_order_relaxed) % workers.size();
+            std::lock_guard<std::mutex> lk(workers[id]->inbox_mutex);
+            workers[id]->inbox.push_back(job.release());
+        }
+
+        num_queued.fetch_add(1);
+        metrics::queued_tasks.add(1);
+        if (num_sleeping.load() > 0) {
+            { std::lock_guard<std::mutex> lk(sleep_mutex); }
+            sleep_cv.notify_one();
+        }
+    }
+
+    /// Wait for all the jobs to finish and stop the workers
+    void join() {
+        if (is_joined) { return; }
+
+        {
+            std::lock_guard<std::mutex> lk(sleep_mutex);
+            is_closed = true;
+        }
+        sleep_cv.notify_all();
+        for (auto& worker : workers) {
+            worker->thread.join();
+        }
+        metrics::pool_threads.sub(static_cast<std::int64_t>(workers.size()));
+        is_joined = true;
+    }
+
+private:
+    struct ThisWorker {
+        ThreadPool const* pool;
+        size_t id;
+    };
+
+    /// Identifies the pool and worker which owns the current thread (if any)
+    static ThisWorker& this_worker() {
+        static thread_local ThisWorker w = {nullptr, 0};
+        return w;
+    }
+
+    void work(size_t id) {
+        this_worker() = {this, id};
+        while (true) {
+            if (auto job = std::unique_ptr<Job>(find_job(id))) {
+                num_queued.fetch_sub(1);
+                metrics::queued_tasks.sub(1);
+                metrics::GaugeScope busy(metrics::active_threads);
+                (*job)();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lk(sleep_mutex);
+            num_sleeping.fetch_add(1);
+            sleep_cv.wait(lk, [&] { return num_queued.load() > 0 || is_closed; });
+            num_sleeping.fetch_sub(1);
+            if (is_closed && num_queued.load() == 0) { return; }
+        }
+    }
+
+    /// Own deque first, then own inbox and finally steal from the other workers
+    Job* find_job(size_t id) {
+        auto& self = *workers[id];
+        if (auto job = self.deque.pop()) { return job; }
+        if (auto job = take_inbox(self, self)) { return job; }
+
+        auto const n = workers.size();
+        for (auto i = size_t{1}; i < n; ++i) {
+            if (auto job = workers[(id + i) % n]->deque.steal()) { return job; }
+        }
+        for (auto i = size_t{1}; i < n; ++i) {
+            if (auto job = take_inbox(self, *workers[(id + i) % n], /*try_only*/true)) {
+                return job;
+            }
+        }
+        return nullptr;
+    }
+
+    /// Move the jobs from the inbox of `source` into the deque of `self` and pop one
+    static Job* take_inbox(Worker& self, Worker& source, bool try_only = false) {
+        auto jobs = std::vector<Job*>();
+        {
+            auto lk = std::unique_lock<std::mutex>(source.inbox_mutex, std::defer_lock);
+            if (try_only) {
+                if (!lk.try_lock()) { return nullptr; }
+            } else {
+                lk.lock();
+            }
+            jobs.swap(source.inbox);
+        }
+
+        // Reversed so that the jobs are popped in the order they were added
+        for (auto it = jobs.rbegin(); it != jobs.rend(); ++it) {
+            self.deque.push(*it);
+        }
+        return self.deque.pop();
+    }
+
+private:
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> next_inbox{0};
+    std::atomic<idx_t> num_queued{0}; ///< added but not yet taken by a worker
+    std::atomic<idx_t> num_sleeping{0};
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_cv;
+    bool is_closed = false;
+    bool is_joined = false;
+};
+
 template<class Produce, class Compute, class Retire>
 void parallel_for(size_t size, size_t num_threads, size_t queue_size,
                   Produce produce, Compute compute, Retire retire) {
-#ifdef CPB_USE_MKL
-    detail::MKLDisableThreading disable_mkl_internal_threading_if{num_threads > 1};
-#endif
-
     using Value = decltype(produce(size_t{}));
     struct Job {
         size_t id;
         Value value;
     };
 
-    detail::Queue<Job> work_queue{queue_size > 0 ? queue_size : num_threads};
-    detail::Queue<Job> retirement_queue{};
+    // At most `queue_size` produced jobs may be waiting for a free compute thread
+    auto const max_in_flight = (queue_size > 0 ? queue_size : num_threads) + num_threads;
+    auto num_in_flight = size_t{0};
+    std::mutex in_flight_mutex;
+    std::condition_variable in_flight_cv;
 
-    // This thread produces new jobs and adds them to the work queue
-    std::thread production_thread([&] {
-        detail::QueueGuard<Job> guard{work_queue};
-        for (auto id = size_t{0}; id < size; ++id) {
-            work_queue.push({id, produce(id)});
-        }
-    });
-
-    // Multiple compute threads consume the work queue
-    // and send the completed jobs to the retirement queue
-    auto work_threads = std::vector<std::thread>{num_threads};
-    for (auto& thread : work_threads) {
-        thread = std::thread([&] {
-            detail::QueueGuard<Job> guard{retirement_queue};
-            while (auto maybe_job = work_queue.pop()) {
-                auto job = maybe_job.get();
-                compute(job.value);
-                retirement_queue.push(std::move(job));
-            }
-        });
-    }
+    detail::Queue<Job> retirement_queue{};
 
     // This thread consumes the retirement queue
+    retirement_queue.add_producer();
     std::thread report_thread([&] {
         while (auto maybe_job = retirement_queue.pop()) {
             auto job = maybe_job.get();
@@ -157,47 +407,199 @@ void parallel_for(size_t size, size_t num_threads, size_t queue_size,
         }
     });
 
-    production_thread.join();
-    for (auto& thread : work_threads) {
-        thread.join();
+    // This thread produces new jobs and the pool computes them and sends
+    // the completed jobs to the retirement queue
+    {
+        ThreadPool pool(static_cast<idx_t>(num_threads));
+        for (auto id = size_t{0}; id < size; ++id) {
+            {
+                std::unique_lock<std::mutex> lk(in_flight_mutex);
+                in_flight_cv.wait(lk, [&] { return num_in_flight < max_in_flight; });
+                ++num_in_flight;
+            }
+            metrics::in_flight_jobs.add(1);
+
+            auto job = std::make_shared<Job>(Job{id, produce(id)});
+            pool.add([&, job] {
+                compute(job->value);
+                retirement_queue.push(std::move(*job));
+                {
+                    std::lock_guard<std::mutex> lk(in_flight_mutex);
+                    --num_in_flight;
+                }
+                metrics::in_flight_jobs.sub(1);
+                in_flight_cv.notify_one();
+            });
+        }
+        pool.join();
     }
+
+    retirement_queue.remove_producer();
     report_thread.join();
 }
 
-class ThreadPool {
-public:
-    ThreadPool(idx_t num_threads) : workers(static_cast<size_t>(num_threads)) {
-        queue.add_producer();
-        for (auto& thread : workers) {
-            thread = std::thread([&] {
-                while (auto maybe_job = queue.pop()) {
-                    maybe_job.get()();
+/**
+ Call `f(n)` for every `n` in `[0, size)` on a pool of `num_threads`
+
+ The jobs are independent and may run in any order. If any of them throw, the remaining
+ jobs are skipped and the first exception is rethrown on the calling thread.
+ With a single thread, the jobs simply run in order on the calling thread.
+ */
+template<class F>
+void parallel_for_each(size_t size, idx_t num_threads, F f) {
+    if (num_threads <= 1) {
+        for (auto n = size_t{0}; n < size; ++n) { f(n); }
+        return;
+    }
+
+    auto error = std::exception_ptr();
+    std::atomic<bool> has_failed{false};
+    std::mutex error_mutex;
+    {
+        ThreadPool pool(num_threads);
+        for (auto n = size_t{0}; n < size; ++n) {
+            pool.add([&, n] {
+                if (has_failed.load()) { return; }
+                try {
+                    f(n);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lk(error_mutex);
+                    if (!error) { error = std::current_exception(); }
+                    has_failed.store(true);
                 }
             });
         }
+        pool.join();
     }
+    if (error) { std::rethrow_exception(error); }
+}
 
-    ~ThreadPool() { join(); }
+/**
+ Stable in-place compaction of the index range `[0, size)`
+
+ Calls `move(from, to)` with `to < from` for the elements which `keep(i)` accepts and returns
+ the number of kept elements. There are no allocations besides the per-chunk counts: with
+ multiple threads, each chunk is compacted independently and the results are then shifted
+ down in order (which is only a copy of the kept elements).
+ */
+template<class Keep, class Move>
+idx_t parallel_compact(idx_t size, idx_t num_threads, Keep keep, Move move,
+                       idx_t min_chunk_size = 1 << 16) {
+    auto const num_chunks = std::max(std::min(num_threads, size / min_chunk_size), idx_t{1});
+    auto const chunk_size = size / num_chunks + (size % num_chunks != 0);
+    auto counts = std::vector<idx_t>(static_cast<size_t>(num_chunks));
+
+    parallel_for_each(counts.size(), num_threads, [&](size_t c) {
+        auto const first = static_cast<idx_t>(c) * chunk_size;
+        auto const last = std::min(first + chunk_size, size);
+        auto n = first;
+        for (auto i = first; i < last; ++i) {
+            if (!keep(i)) { continue; }
+            if (n != i) { move(i, n); }
+            ++n;
+        }
+        counts[c] = n - first;
+    });
 
-    template<class F>
-    void add(F&& f) {
-        queue.push(std::forward<F>(f));
+    auto n = counts[0];
+    for (auto c = idx_t{1}; c < num_chunks; ++c) {
+        auto const first = c * chunk_size;
+        for (auto i = first; i < first + counts[c]; ++i, ++n) {
+            if (n != i) { move(i, n); }
+        }
     }
+    return n;
+}
 
-    void join() {
-        if (is_joined) { return; }
+/**
+ Fork-join team of persistent threads
+
+ `run(f)` calls `f(thread_id)` once on every member of the team and returns after
+ all of them have finished. The calling thread takes part as `thread_id == 0`, so
+ a team of size 1 doesn't start any extra threads. Intended for fine-grained data
+ parallelism (e.g. row partitions of a single matrix-vector product) where the cost
+ of starting new threads or queueing jobs for every call would be too high.
+ The members share the `thread_budget()` of the thread which made the team.
+ */
+class ThreadTeam {
+public:
+    explicit ThreadTeam(idx_t num_threads)
+        : workers(static_cast<size_t>(std::max(num_threads, idx_t{1}) - 1)) {
+        auto const budget = share_budget(size());
+        for (auto i = size_t{0}; i < workers.size(); ++i) {
+            workers[i] = std::thread([this, i, budget] {
+                ThreadBudgetScope scope(budget);
+                work(static_cast<idx_t>(i) + 1);
+            });
+        }
+    }
 
-        queue.remove_producer();
+    ThreadTeam(ThreadTeam const&) = delete;
+    ThreadTeam& operator=(ThreadTeam const&) = delete;
+
+    ~ThreadTeam() {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            is_closed = true;
+            ++generation;
+        }
+        start_cv.notify_all();
         for (auto& thread : workers) {
             thread.join();
         }
-        is_joined = true;
+    }
+
+    /// Number of threads in the team, including the calling thread
+    idx_t size() const { return static_cast<idx_t>(workers.size()) + 1; }
+
+    /// Call `f(thread_id)` on all members of the team and wait for them to finish
+    template<class F>
+    void run(F&& f) {
+        if (workers.empty()) { return f(idx_t{0}); }
+
+        {
+            std::lock_guard<std::mutex> lk(m);
+            job = [&f](idx_t thread_id) { f(thread_id); };
+            num_running = workers.size();
+            ++generation;
+        }
+        start_cv.notify_all();
+
+        f(idx_t{0});
+
+        std::unique_lock<std::mutex> lk(m);
+        done_cv.wait(lk, [&] { return num_running == 0; });
+        job = nullptr;
+    }
+
+private:
+    void work(idx_t thread_id) {
+        auto seen_generation = size_t{0};
+        std::unique_lock<std::mutex> lk(m);
+        while (true) {
+            start_cv.wait(lk, [&] { return generation != seen_generation; });
+            seen_generation = generation;
+            if (is_closed) { return; }
+
+            lk.unlock();
+            job(thread_id);
+            lk.lock();
+
+            if (--num_running == 0) {
+                done_cv.notify_one();
+            }
+        }
     }
 
 private:
     std::vector<std::thread> workers;
-    detail::Queue<std::function<void()>> queue;
-    bool is_joined = false;
+    std::function<void(idx_t)> job;
+    std::mutex m;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    size_t generation = 0;
+    size_t num_running = 0;
+    bool is_closed = false;
 };
 
 } // namespace cpb
@@ -0,0 +1,53 @@
+#pragma once
+#include "hamiltonian/HamiltonianModifiers.hpp"
+#include "hamiltonian/Expression.hpp"
+#include "system/StructureModifiers.hpp"
+
+#include <cstdint>
+
+namespace cpb { namespace builtin {
+
+/**
+ Native implementations of common physical effects
+
+ These do the same job as the equivalent Python modifier functions, but they are evaluated
+ directly in C++ without any callbacks. They are all thread-safe so they don't prevent
+ the parallel Hamiltonian build. Multi-orbital models are supported: onsite terms are added
+ to every orbital (the diagonal of the onsite matrix) and hopping factors scale every element
+ of the hopping matrix. Lengths are in nanometers and energies in eV.
+ */
+
+/// Constant magnetic field [T] in the z-direction (Peierls substitution in the Landau gauge)
+HoppingModifier constant_magnetic_field(double magnitude);
+
+/// Constant electric field [V/nm] which adds the potential energy `field.dot(r)` to each site
+OnsiteModifier constant_electric_field(Cartesian field);
+
+/// Anderson disorder: random onsite energy uniformly distributed in `[-width/2, width/2)`
+///
+/// The value at each site is regenerated on demand by the counter-based Philox generator:
+/// it's a pure function of the `seed` and the system index of the site, so it doesn't change
+/// with the number of threads, the slice size or rebuilds. All the orbitals of a site are
+/// shifted by the same value.
+OnsiteModifier anderson_disorder(double width, std::uint64_t seed = 0);
+
+/// Remove each site with the given `probability` -- keyed by the `seed` and the foundation index
+/// of the site, like `anderson_disorder()`
+SiteStateModifier random_vacancies(double probability, std::uint64_t seed = 0,
+                                   int min_neighbors = 0);
+
+/// Scale each hopping with its length `l`: `t = t0 * exp(-beta * (l / reference_length - 1))`
+HoppingModifier strained_hopping(double beta, double reference_length);
+
+/// Add the value of an `Expression` of the site positions `x, y, z` to the onsite energy,
+/// e.g. a gate potential `"V * tanh(x / w)"` with `constants = {{"V", 0.1}, {"w", 5}}`.
+/// The label `sub_id` is the sublattice name. The expression is parsed right away.
+OnsiteModifier onsite_expression(std::string const& expression,
+                                 std::map<std::string, double> const& constants = {});
+
+/// Multiply the hopping energy by the value of an `Expression` of the positions of the two sites
+/// `x1, y1, z1, x2, y2, z2`. The label `hop_id` is the hopping family name.
+HoppingModifier hopping_expression(std::string const& expression,
+                                   std::map<std::string, double> const& constants = {});
+
+}} // namespace cpb::builtin
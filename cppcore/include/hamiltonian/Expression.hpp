@@ -0,0 +1,62 @@
+#pragma once
+#include "numeric/dense.hpp"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace cpb {
+
+/**
+ A real-valued formula which is parsed once and then evaluated on whole arrays
+
+ It's compiled into a postfix program over named variables (e.g. the site positions) which is
+ run on blocks of elements, so there are no per-element callbacks and no Python: evaluation is
+ thread-safe and it may be done concurrently with the same `Expression`.
+
+ The syntax is a small subset of Python/numpy:
+   numbers, `pi`, variables, parentheses, `+ - * /`, `**` or `^` (right-associative),
+   comparisons `< <= > >= == !=` (which give 1 or 0), one-argument functions
+   `exp log sqrt abs sin cos tan sinh cosh tanh`, two-argument `min max atan2 pow`
+   and `where(condition, a, b)`. A label is a name which isn't a number (e.g. the sublattice)
+   and it can only be compared with a quoted string: `sub_id == "A"` or `sub_id != 'B'`.
+ */
+class Expression {
+public:
+    /// `variables` and `labels` are the names of the arguments of `eval()`, in the same order,
+    /// and `constants` are named parameters. Throws `std::invalid_argument` with the position of
+    /// the first syntax error or unknown name.
+    Expression(std::string const& source, std::vector<std::string> const& variables,
+               std::vector<std::string> const& labels = {},
+               std::map<std::string, double> const& constants = {});
+
+    /// Evaluate `size` elements: `variables[i]` points to the values of variable `i`
+    ArrayXd eval(idx_t size, std::vector<float const*> const& variables,
+                 std::vector<std::string> const& labels = {}) const;
+
+    std::string const& source() const { return source_text; }
+
+private:
+    enum class Op {
+        constant, variable, label,
+        negate, add, subtract, multiply, divide, power,
+        less, less_equal, greater, greater_equal, equal, not_equal,
+        exp, log, sqrt, abs, sin, cos, tan, sinh, cosh, tanh,
+        min, max, atan2, where
+    };
+
+    struct Instruction {
+        Op op;
+        double value; ///< for `constant`, and `label`: 1 if equal or 0 if not equal
+        idx_t index; ///< for `variable` and `label`
+        std::string text; ///< for `label`: the name it's compared to
+    };
+
+    friend class ExpressionParser;
+
+    std::string source_text;
+    std::vector<Instruction> program; ///< postfix order
+    idx_t max_depth = 0; ///< of the evaluation stack
+};
+
+} // namespace cpb
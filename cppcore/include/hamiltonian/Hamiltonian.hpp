@@ -7,6 +7,11 @@
 #include "numeric/constant.hpp"
 
 #include "support/variant.hpp"
+#include "detail/thread.hpp"
+#include "utils/Trace.hpp"
+
+#include <algorithm>
+#include <numeric>
 
 namespace cpb {
 
@@ -43,6 +48,48 @@ public:
 template<class scalar_t>
 using SparseMatrixRC = std::shared_ptr<SparseMatrixX<scalar_t> const>;
 
+/**
+ The wave vector independent part of a periodic Hamiltonian
+
+ The main matrix already contains (zero) elements for all the boundary hoppings. The positions
+ of those elements in the CSR value array are saved for each boundary so that a new wave vector
+ only needs to add the boundary hoppings with new phases instead of rebuilding the entire
+ matrix and applying all the modifiers again.
+ */
+template<class scalar_t>
+struct BlochCache {
+    struct Boundary {
+        Cartesian shift;
+        std::vector<storage_idx_t> positions; ///< value index of `(i, j)` followed by `(j, i)`
+        std::vector<scalar_t> hoppings;
+    };
+
+    SparseMatrixX<scalar_t> matrix; ///< compressed, without the boundary hoppings
+    std::vector<Boundary> boundaries;
+};
+
+template<class scalar_t>
+using BlochCacheRC = std::shared_ptr<BlochCache<scalar_t> const>;
+
+/**
+ Sparsity pattern of the last Hamiltonian build
+
+ The modifiers pass the matrix elements in a deterministic order: `slots[n]` is the position
+ of the n-th element in the CSR value array. If the system didn't change, a new build (e.g.
+ a different field strength) only needs to write the new values into those slots instead of
+ inserting every element and compressing the matrix again. Each slot is checked against the
+ element's row and column so any change of the pattern falls back to a full build. Note that
+ zero values are skipped, so a value which becomes zero (or stops being zero) changes the pattern.
+
+ The matrix is reused in place if the last Hamiltonian isn't referenced anywhere else.
+ */
+template<class scalar_t>
+struct BuildPattern {
+    std::shared_ptr<SparseMatrixX<scalar_t>> matrix; ///< systems without periodic boundaries
+    BlochCacheRC<scalar_t> bloch_cache; ///< periodic systems
+    std::shared_ptr<std::vector<storage_idx_t> const> slots;
+};
+
 /**
  Stores a tight-binding Hamiltonian as a sparse matrix variant
  with real or complex scalar type and single or double precision.
@@ -51,9 +98,11 @@ class Hamiltonian {
 public:
     Hamiltonian() = default;
     template<class scalar_t>
-    Hamiltonian(std::shared_ptr<SparseMatrixX<scalar_t>> p) : variant_matrix(std::move(p)) {}
+    Hamiltonian(std::shared_ptr<SparseMatrixX<scalar_t>> p)
+        : variant_matrix(std::move(p)), view(std::make_shared<std::shared_ptr<void>>()) {}
     template<class scalar_t>
-    Hamiltonian(std::shared_ptr<SparseMatrixX<scalar_t> const> p) : variant_matrix(std::move(p)) {}
+    Hamiltonian(std::shared_ptr<SparseMatrixX<scalar_t> const> p)
+        : variant_matrix(std::move(p)), view(std::make_shared<std::shared_ptr<void>>()) {}
 
     var::complex<SparseMatrixRC> const& get_variant() const { return variant_matrix; }
 
@@ -64,16 +113,251 @@ public:
     idx_t non_zeros() const;
     idx_t rows() const;
     idx_t cols() const;
+    /// Bytes allocated by the CSR matrix: values, column indices and row offsets
+    std::size_t memory_usage() const;
+
+    /// Opaque slot where the bindings cache their view of the matrix, e.g. a scipy CSR matrix.
+    /// It's shared by all the copies of this Hamiltonian and dropped by `reset()`.
+    std::shared_ptr<void>& view_cache() const;
 
 private:
     var::complex<SparseMatrixRC> variant_matrix;
+    mutable std::shared_ptr<std::shared_ptr<void>> view;
 };
 
+/// Is the Hamiltonian unchanged when index `i` is relabeled as `permutation[i]` (a bijection)?
+/// The matrix elements may differ by `tolerance` relative to the largest one.
+bool is_invariant(Hamiltonian const& h, ArrayXi const& permutation, double tolerance = 1e-5);
+
 namespace detail {
 
+/// Row and column indices of matrix elements in the order in which they were built
+using ElementList = std::vector<std::pair<storage_idx_t, storage_idx_t>>;
+
+/// Smaller systems are always built on a single thread
+constexpr auto min_parallel_build_nnz = idx_t{100000};
+
+/**
+ Multithreaded version of `build_main()`
+
+ The modifiers are applied to independent slices of the system (see `Slice`) on a pool
+ of threads. Each slice sorts its elements into buckets by row range and then all the
+ row ranges are merged into CSR format concurrently. The buckets are merged in the
+ sequential slice order so the result (including the summation of duplicate elements)
+ and the order of `elements` are the same as with a single thread.
+ */
+template<class scalar_t>
+void build_main_parallel(SparseMatrixX<scalar_t>& matrix, System const& system,
+                         HamiltonianModifiers const& modifiers, idx_t num_threads,
+                         ElementList* elements) {
+    struct Element {
+        storage_idx_t row, col;
+        scalar_t value;
+    };
+    using Buckets = std::vector<std::vector<Element>>;
+
+    auto const size = system.hamiltonian_size();
+    auto const onsite_slices = modifiers.onsite_slices(system);
+    auto const hopping_slices = modifiers.hopping_slices(system);
+    auto const num_onsite = onsite_slices.size();
+    auto const num_slices = num_onsite + hopping_slices.size();
+
+    // Row range `r` is `[first_row(r), first_row(r + 1))`
+    auto const num_ranges = std::max(std::min(4 * num_threads, size), idx_t{1});
+    auto const range_of = [&](idx_t row) { return row * num_ranges / size; };
+    auto const first_row = [&](idx_t r) { return (r * size + num_ranges - 1) / num_ranges; };
+
+    auto buckets = std::vector<Buckets>(num_slices);
+    auto slice_elements = std::vector<ElementList>(elements ? num_slices : 0);
+    parallel_for_each(num_slices, num_threads, [&](size_t n) {
+        auto const span = trace::Span("hamiltonian_slice", "model");
+        auto& bucket = buckets[n];
+        bucket.resize(num_ranges);
+        auto add = [&](idx_t i, idx_t j, scalar_t value) {
+            auto const row = static_cast<storage_idx_t>(i);
+            auto const col = static_cast<storage_idx_t>(j);
+            bucket[range_of(i)].push_back({row, col, value});
+            if (elements) { slice_elements[n].emplace_back(row, col); }
+        };
+
+        if (n < num_onsite) {
+            modifiers.apply_to_onsite<scalar_t>(system, onsite_slices[n], add);
+        } else {
+            auto const& slice = hopping_slices[n - num_onsite];
+            modifiers.apply_to_hoppings<scalar_t>(system, slice, [&](idx_t i, idx_t j,
+                                                                     scalar_t hopping) {
+                add(i, j, hopping);
+                add(j, i, num::conjugate(hopping));
+            });
+        }
+    });
+
+    // Merge the row ranges: count, scatter by row, sort by column and sum duplicates
+    auto row_ends = std::vector<std::vector<storage_idx_t>>(num_ranges); // within the range
+    auto indices = std::vector<std::vector<storage_idx_t>>(num_ranges);
+    auto values = std::vector<std::vector<scalar_t>>(num_ranges);
+    parallel_for_each(static_cast<size_t>(num_ranges), num_threads, [&](size_t r) {
+        auto const row_start = first_row(r);
+        auto const num_rows = first_row(r + 1) - row_start;
+
+        auto offsets = std::vector<storage_idx_t>(num_rows + 1, 0);
+        for (auto const& bucket : buckets) {
+            for (auto const& e : bucket[r]) { ++offsets[e.row - row_start + 1]; }
+        }
+        std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+        auto entries = std::vector<std::pair<storage_idx_t, scalar_t>>(offsets.back());
+        auto cursor = offsets;
+        for (auto& bucket : buckets) {
+            for (auto const& e : bucket[r]) {
+                entries[cursor[e.row - row_start]++] = {e.col, e.value};
+            }
+            std::vector<Element>().swap(bucket[r]); // release the memory early
+        }
+
+        indices[r].reserve(entries.size());
+        values[r].reserve(entries.size());
+        row_ends[r].reserve(num_rows);
+        for (auto row = idx_t{0}; row < num_rows; ++row) {
+            auto const row_first = entries.begin() + offsets[row];
+            auto const row_last = entries.begin() + offsets[row + 1];
+            std::stable_sort(row_first, row_last, [](std::pair<storage_idx_t, scalar_t> const& a,
+                                                     std::pair<storage_idx_t, scalar_t> const& b) {
+                return a.first < b.first;
+            });
+
+            auto const row_begin = indices[r].size();
+            for (auto it = row_first; it != row_last; ++it) {
+                if (indices[r].size() > row_begin && indices[r].back() == it->first) {
+                    values[r].back() += it->second;
+                } else {
+                    indices[r].push_back(it->first);
+                    values[r].push_back(it->second);
+                }
+            }
+            row_ends[r].push_back(static_cast<storage_idx_t>(indices[r].size()));
+        }
+    });
+
+    auto range_starts = std::vector<storage_idx_t>(num_ranges + 1, 0);
+    for (auto r = idx_t{0}; r < num_ranges; ++r) {
+        range_starts[r + 1] = range_starts[r] + static_cast<storage_idx_t>(indices[r].size());
+    }
+
+    matrix.resize(size, size);
+    matrix.resizeNonZeros(range_starts.back());
+    matrix.outerIndexPtr()[0] = 0;
+    parallel_for_each(static_cast<size_t>(num_ranges), num_threads, [&](size_t r) {
+        auto const row_start = first_row(r);
+        for (auto row = size_t{0}; row < row_ends[r].size(); ++row) {
+            matrix.outerIndexPtr()[row_start + row + 1] = range_starts[r] + row_ends[r][row];
+        }
+        std::copy(indices[r].begin(), indices[r].end(),
+                  matrix.innerIndexPtr() + range_starts[r]);
+        std::copy(values[r].begin(), values[r].end(), matrix.valuePtr() + range_starts[r]);
+    });
+
+    if (elements) {
+        auto const total = std::accumulate(
+            slice_elements.begin(), slice_elements.end(), size_t{0},
+            [](size_t n, ElementList const& e) { return n + e.size(); }
+        );
+        elements->reserve(total);
+        for (auto const& e : slice_elements) {
+            elements->insert(elements->end(), e.begin(), e.end());
+        }
+    }
+}
+
+/// Upper bound of the number of elements in each row of the Hamiltonian of `system`: all the
+/// onsite and hopping terms before zero values are skipped and duplicates are summed
+ArrayXi max_row_nnz(System const& system, bool has_onsite);
+
+/**
+ Build the matrix directly in compressed (CSR) format in two passes
+
+ The first pass counts the non-zeros of each row from the structure of the system (no modifiers
+ are applied) and the second fills the elements into their preallocated rows. Finally, each row
+ is sorted by column and duplicates are summed in the order in which they were added (just like
+ `setFromTriplets()`, but without its temporary triplet list and second matrix). This handles
+ systems with arbitrary generated sites and hoppings at the memory cost of the final matrix.
+ */
+template<class scalar_t>
+void build_main_streaming(SparseMatrixX<scalar_t>& matrix, System const& system,
+                          HamiltonianModifiers const& modifiers, ElementList* elements) {
+    auto const size = system.hamiltonian_size();
+    auto const counts = max_row_nnz(system, !modifiers.onsite_slices(system).empty());
+
+    matrix.resize(size, size);
+    matrix.resizeNonZeros(counts.sum());
+    auto const outer = matrix.outerIndexPtr();
+    auto const inner = matrix.innerIndexPtr();
+    auto const values = matrix.valuePtr();
+
+    // `cursor[row]` is the next free position in the row
+    auto cursor = std::vector<storage_idx_t>(size);
+    outer[0] = 0;
+    for (auto row = idx_t{0}; row < size; ++row) {
+        cursor[row] = outer[row];
+        outer[row + 1] = outer[row] + counts[row];
+    }
+
+    auto add = [&](idx_t i, idx_t j, scalar_t value) {
+        auto& n = cursor[i];
+        inner[n] = static_cast<storage_idx_t>(j);
+        values[n] = value;
+        ++n;
+        if (elements) { elements->emplace_back(i, j); }
+    };
+    if (elements) { elements->reserve(static_cast<size_t>(counts.sum())); }
+
+    modifiers.apply_to_onsite<scalar_t>(system, add);
+    modifiers.apply_to_hoppings<scalar_t>(system, [&](idx_t i, idx_t j, scalar_t hopping) {
+        add(i, j, hopping);
+        add(j, i, num::conjugate(hopping));
+    });
+
+    // Sort the rows and sum the duplicates: the compacted rows only ever move to the left
+    auto row_buffer = std::vector<std::pair<storage_idx_t, scalar_t>>();
+    auto nnz = storage_idx_t{0};
+    for (auto row = idx_t{0}; row < size; ++row) {
+        row_buffer.clear();
+        for (auto n = outer[row]; n < cursor[row]; ++n) {
+            row_buffer.emplace_back(inner[n], values[n]);
+        }
+        std::stable_sort(row_buffer.begin(), row_buffer.end(),
+                         [](std::pair<storage_idx_t, scalar_t> const& a,
+                            std::pair<storage_idx_t, scalar_t> const& b) {
+                             return a.first < b.first;
+                         });
+
+        auto const row_start = nnz;
+        for (auto const& e : row_buffer) {
+            if (nnz > row_start && inner[nnz - 1] == e.first) {
+                values[nnz - 1] += e.second;
+            } else {
+                inner[nnz] = e.first;
+                values[nnz] = e.second;
+                ++nnz;
+            }
+        }
+        outer[row] = row_start;
+    }
+    outer[size] = nnz;
+    matrix.resizeNonZeros(nnz);
+}
+
+/// Optionally, the indices of all the elements are saved to `elements` (see `BuildPattern`).
+/// Multiple threads are used if all the modifiers are thread-safe and the system is large.
 template<class scalar_t>
 void build_main(SparseMatrixX<scalar_t>& matrix, System const& system, Lattice const& lattice,
-                HamiltonianModifiers const& modifiers, bool simple_build) {
+                HamiltonianModifiers const& modifiers, bool simple_build,
+                ElementList* elements = nullptr, idx_t num_threads = 1) {
+    if (num_threads > 1 && modifiers.all_thread_safe()
+        && system.hamiltonian_nnz() >= min_parallel_build_nnz) {
+        return build_main_parallel(matrix, system, modifiers, num_threads, elements);
+    }
+
     auto const size = system.hamiltonian_size();
     matrix.resize(size, size);
 
@@ -86,49 +370,209 @@ void build_main(SparseMatrixX<scalar_t>& matrix, System const& system, Lattice c
 
         modifiers.apply_to_onsite<scalar_t>(system, [&](idx_t i, idx_t j, scalar_t onsite) {
             matrix.insert(i, j) = onsite;
+            if (elements) { elements->emplace_back(i, j); }
         });
 
         modifiers.apply_to_hoppings<scalar_t>(system, [&](idx_t i, idx_t j, scalar_t hopping) {
             matrix.insert(i, j) = hopping;
             matrix.insert(j, i) = num::conjugate(hopping);
+            if (elements) {
+                elements->emplace_back(i, j);
+                elements->emplace_back(j, i);
+            }
         });
     } else {
-        // Slow path: Users can do anything with generators which makes the number of non-zeros
-        // per row difficult to count (possible but not worth it over building from triplets).
-        auto triplets = std::vector<Eigen::Triplet<scalar_t>>();
-        triplets.reserve(system.hamiltonian_nnz());
-
-        // Helper lambda which does a `idx_t` -> `storage_idx_t` cast for the indices.
-        auto to_triplet = [](idx_t i, idx_t j, scalar_t value) -> Eigen::Triplet<scalar_t> {
-            return {static_cast<storage_idx_t>(i), static_cast<storage_idx_t>(j), value};
-        };
+        // Generators were used: the number of non-zeros per row is counted from the system
+        build_main_streaming(matrix, system, modifiers, elements);
+    }
+}
 
-        modifiers.apply_to_onsite<scalar_t>(system, [&](idx_t i, idx_t j, scalar_t onsite) {
-            triplets.push_back(to_triplet(i, j, onsite));
-        });
+/// Index of element `(row, col)` in the value array of a compressed matrix
+template<class scalar_t>
+storage_idx_t value_position(SparseMatrixX<scalar_t> const& matrix, idx_t row, idx_t col) {
+    auto const indices = matrix.innerIndexPtr();
+    auto const first = indices + matrix.outerIndexPtr()[row];
+    auto const last = indices + matrix.outerIndexPtr()[row + 1];
+    return static_cast<storage_idx_t>(std::lower_bound(first, last, col) - indices);
+}
 
-        modifiers.apply_to_hoppings<scalar_t>(system, [&](idx_t i, idx_t j, scalar_t hopping) {
-            triplets.push_back(to_triplet(i, j, hopping));
-            triplets.push_back(to_triplet(j, i, num::conjugate(hopping)));
-        });
+/// Is `slot` the position of element `(row, col)` in the value array of a compressed matrix?
+template<class scalar_t>
+bool is_slot(SparseMatrixX<scalar_t> const& matrix, storage_idx_t slot, idx_t row, idx_t col) {
+    return slot >= matrix.outerIndexPtr()[row] && slot < matrix.outerIndexPtr()[row + 1]
+           && matrix.innerIndexPtr()[slot] == col;
+}
+
+/**
+ Add the `elements` to the values of the matrix (which is compressed first)
+
+ Inserting new elements one by one into a compressed matrix moves the rest of the arrays each
+ time. Instead, the sorted elements are added to their existing slots and, if some are not
+ part of the sparsity pattern yet, they are merged with the rows in a single pass.
+ */
+template<class scalar_t>
+void add_elements(SparseMatrixX<scalar_t>& matrix,
+                  std::vector<Eigen::Triplet<scalar_t>>& elements) {
+    using Element = Eigen::Triplet<scalar_t>;
+    matrix.makeCompressed();
+    if (elements.empty()) { return; }
+
+    std::sort(elements.begin(), elements.end(), [](Element const& a, Element const& b) {
+        return (a.row() != b.row()) ? a.row() < b.row() : a.col() < b.col();
+    });
+    // Sum the duplicates: several boundaries may connect the same pair of sites
+    auto last = elements.begin();
+    for (auto it = elements.begin() + 1; it != elements.end(); ++it) {
+        if (it->row() == last->row() && it->col() == last->col()) {
+            *last = Element(last->row(), last->col(), last->value() + it->value());
+        } else {
+            *++last = *it;
+        }
+    }
+    elements.erase(last + 1, elements.end());
+
+    auto const outer = matrix.outerIndexPtr();
+    auto const inner = matrix.innerIndexPtr();
+    auto const values = matrix.valuePtr();
+    auto const num_missing = std::count_if(elements.begin(), elements.end(),
+                                           [&](Element const& e) {
+        return !is_slot(matrix, value_position(matrix, e.row(), e.col()), e.row(), e.col());
+    });
+    if (num_missing == 0) {
+        for (auto const& e : elements) {
+            values[value_position(matrix, e.row(), e.col())] += e.value();
+        }
+        return;
+    }
 
-        matrix.setFromTriplets(triplets.begin(), triplets.end());
+    auto const rows = matrix.rows();
+    auto merged_outer = std::vector<storage_idx_t>(static_cast<size_t>(rows + 1));
+    auto merged_inner = std::vector<storage_idx_t>();
+    auto merged_values = std::vector<scalar_t>();
+    merged_inner.reserve(static_cast<size_t>(matrix.nonZeros() + num_missing));
+    merged_values.reserve(merged_inner.capacity());
+
+    auto e = elements.begin();
+    for (auto row = storage_idx_t{0}; row < rows; ++row) {
+        merged_outer[row] = static_cast<storage_idx_t>(merged_inner.size());
+        auto k = outer[row];
+        auto const end = outer[row + 1];
+        while (k < end || (e != elements.end() && e->row() == row)) {
+            auto const has_element = e != elements.end() && e->row() == row;
+            if (has_element && (k == end || e->col() < inner[k])) {
+                merged_inner.push_back(e->col());
+                merged_values.push_back(e->value());
+                ++e;
+            } else if (has_element && e->col() == inner[k]) {
+                merged_inner.push_back(inner[k]);
+                merged_values.push_back(values[k] + e->value());
+                ++k;
+                ++e;
+            } else {
+                merged_inner.push_back(inner[k]);
+                merged_values.push_back(values[k]);
+                ++k;
+            }
+        }
     }
+    merged_outer[rows] = static_cast<storage_idx_t>(merged_inner.size());
+
+    matrix.resizeNonZeros(static_cast<idx_t>(merged_inner.size()));
+    std::copy(merged_outer.begin(), merged_outer.end(), matrix.outerIndexPtr());
+    std::copy(merged_inner.begin(), merged_inner.end(), matrix.innerIndexPtr());
+    std::copy(merged_values.begin(), merged_values.end(), matrix.valuePtr());
 }
 
 template<class scalar_t>
 void build_periodic(SparseMatrixX<scalar_t>& matrix, System const& system,
                     HamiltonianModifiers const& modifiers, Cartesian k_vector) {
+    auto elements = std::vector<Eigen::Triplet<scalar_t>>();
     for (auto n = size_t{0}, size = system.boundaries.size(); n < size; ++n) {
         using constant::i1;
         auto const& d = system.boundaries[n].shift;
         auto const phase = num::force_cast<scalar_t>(exp(i1 * k_vector.dot(d)));
 
         modifiers.apply_to_hoppings<scalar_t>(system, n, [&](idx_t i, idx_t j, scalar_t hopping) {
-            matrix.coeffRef(i, j) += hopping * phase;
-            matrix.coeffRef(j, i) += num::conjugate(hopping * phase);
+            auto const row = static_cast<storage_idx_t>(i);
+            auto const col = static_cast<storage_idx_t>(j);
+            elements.emplace_back(row, col, hopping * phase);
+            elements.emplace_back(col, row, num::conjugate(hopping * phase));
+        });
+    }
+    add_elements(matrix, elements);
+}
+
+template<class scalar_t>
+std::shared_ptr<std::vector<storage_idx_t> const>
+find_slots(SparseMatrixX<scalar_t> const& matrix, ElementList const& elements) {
+    auto slots = std::make_shared<std::vector<storage_idx_t>>();
+    slots->reserve(elements.size());
+    for (auto const& e : elements) {
+        slots->push_back(value_position(matrix, e.first, e.second));
+    }
+    return slots;
+}
+
+/// Stops a value-only rebuild as soon as it's clear that the sparsity pattern has changed
+struct PatternMismatch {};
+
+/**
+ Rewrite the values of a matrix built by `build_main()` without changing its structure
+
+ Returns false if the elements don't match the `slots` of the last build: the matrix
+ values are invalid in that case and a full build is required.
+ */
+template<class scalar_t>
+bool rebuild_main(SparseMatrixX<scalar_t>& matrix, std::vector<storage_idx_t> const& slots,
+                  System const& system, HamiltonianModifiers const& modifiers) {
+    auto const values = matrix.valuePtr();
+    std::fill(values, values + matrix.nonZeros(), scalar_t{0});
+
+    auto n = size_t{0};
+    auto add = [&](idx_t i, idx_t j, scalar_t value) {
+        if (n >= slots.size() || !is_slot(matrix, slots[n], i, j)) { throw PatternMismatch(); }
+        values[slots[n++]] += value; // `+=` because the triplet build sums duplicates
+    };
+
+    try {
+        modifiers.apply_to_onsite<scalar_t>(system, [&](idx_t i, idx_t j, scalar_t onsite) {
+            add(i, j, onsite);
         });
+        modifiers.apply_to_hoppings<scalar_t>(system, [&](idx_t i, idx_t j, scalar_t hopping) {
+            add(i, j, hopping);
+            add(j, i, num::conjugate(hopping));
+        });
+    } catch (PatternMismatch const&) {
+        return false;
     }
+    return n == slots.size();
+}
+
+/// Recompute the boundary hoppings of a `BlochCache`: false if the positions don't match
+template<class scalar_t>
+bool rebuild_boundaries(BlochCache<scalar_t>& cache, System const& system,
+                        HamiltonianModifiers const& modifiers) {
+    if (cache.boundaries.size() != system.boundaries.size()) { return false; }
+
+    for (auto n = size_t{0}, size = cache.boundaries.size(); n < size; ++n) {
+        auto& boundary = cache.boundaries[n];
+        auto const& positions = boundary.positions;
+        boundary.hoppings.clear();
+        try {
+            modifiers.apply_to_hoppings<scalar_t>(system, n, [&](idx_t i, idx_t j, scalar_t h) {
+                auto const idx = 2 * boundary.hoppings.size();
+                if (idx >= positions.size() || !is_slot(cache.matrix, positions[idx], i, j)
+                    || !is_slot(cache.matrix, positions[idx + 1], j, i)) {
+                    throw PatternMismatch();
+                }
+                boundary.hoppings.push_back(h);
+            });
+        } catch (PatternMismatch const&) {
+            return false;
+        }
+        if (2 * boundary.hoppings.size() != positions.size()) { return false; }
+    }
+    return true;
 }
 
 /// Check that all the values in the matrix are finite
@@ -174,5 +618,109 @@ Hamiltonian make(System const& system, Lattice const& lattice,
     return matrix;
 }
 
+/// Build a Hamiltonian without periodic boundaries, reusing the `pattern` of the last build
+template<class scalar_t>
+Hamiltonian make(System const& system, Lattice const& lattice,
+                 HamiltonianModifiers const& modifiers, bool simple_build,
+                 BuildPattern<scalar_t>& pattern, idx_t num_threads = 1) {
+    if (pattern.matrix && pattern.slots) {
+        if (pattern.matrix.use_count() > 1) { // the last Hamiltonian is still in use elsewhere
+            pattern.matrix = std::make_shared<SparseMatrixX<scalar_t>>(*pattern.matrix);
+        }
+        if (detail::rebuild_main(*pattern.matrix, *pattern.slots, system, modifiers)) {
+            detail::throw_if_invalid(*pattern.matrix);
+            return pattern.matrix;
+        }
+    }
+
+    pattern.matrix = std::make_shared<SparseMatrixX<scalar_t>>();
+    auto elements = detail::ElementList();
+    detail::build_main(*pattern.matrix, system, lattice, modifiers, simple_build, &elements,
+                       num_threads);
+    pattern.matrix->makeCompressed();
+    pattern.slots = detail::find_slots(*pattern.matrix, elements);
+    detail::throw_if_invalid(*pattern.matrix);
+    return pattern.matrix;
+}
+
+/// Build the wave vector independent part of a periodic Hamiltonian, reusing the `pattern`
+/// of the last build if possible
+template<class scalar_t>
+BlochCacheRC<scalar_t> make_bloch_cache(System const& system, Lattice const& lattice,
+                                        HamiltonianModifiers const& modifiers, bool simple_build,
+                                        BuildPattern<scalar_t>& pattern, idx_t num_threads = 1) {
+    if (pattern.bloch_cache && pattern.slots) {
+        auto cache = std::make_shared<BlochCache<scalar_t>>(*pattern.bloch_cache);
+        if (detail::rebuild_main(cache->matrix, *pattern.slots, system, modifiers)
+            && detail::rebuild_boundaries(*cache, system, modifiers)) {
+            pattern.bloch_cache = cache;
+            return cache;
+        }
+    }
+
+    auto cache = std::make_shared<BlochCache<scalar_t>>();
+    auto& matrix = cache->matrix;
+    auto elements = detail::ElementList();
+    detail::build_main(matrix, system, lattice, modifiers, simple_build, &elements, num_threads);
+
+    // Make room for the boundary hoppings, but keep the indices until the matrix is compressed
+    auto pairs = std::vector<std::vector<std::pair<idx_t, idx_t>>>(system.boundaries.size());
+    auto elements = std::vector<Eigen::Triplet<scalar_t>>(); // zeros for the new elements
+    cache->boundaries.resize(system.boundaries.size());
+    for (auto n = size_t{0}, size = system.boundaries.size(); n < size; ++n) {
+        auto& boundary = cache->boundaries[n];
+        boundary.shift = system.boundaries[n].shift;
+
+        modifiers.apply_to_hoppings<scalar_t>(system, n, [&](idx_t i, idx_t j, scalar_t hopping) {
+            auto const row = static_cast<storage_idx_t>(i);
+            auto const col = static_cast<storage_idx_t>(j);
+            elements.emplace_back(row, col, scalar_t{0});
+            elements.emplace_back(col, row, scalar_t{0});
+            pairs[n].emplace_back(i, j);
+            boundary.hoppings.push_back(hopping);
+        });
+    }
+    add_elements(matrix, elements);
+
+    for (auto n = size_t{0}, size = pairs.size(); n < size; ++n) {
+        auto& positions = cache->boundaries[n].positions;
+        positions.reserve(2 * pairs[n].size());
+        for (auto const& p : pairs[n]) {
+            positions.push_back(detail::value_position(matrix, p.first, p.second));
+            positions.push_back(detail::value_position(matrix, p.second, p.first));
+        }
+    }
+    pattern.slots = detail::find_slots(matrix, elements);
+    pattern.bloch_cache = cache;
+    return cache;
+}
+
+template<class scalar_t>
+BlochCacheRC<scalar_t> make_bloch_cache(System const& system, Lattice const& lattice,
+                                        HamiltonianModifiers const& modifiers, bool simple_build) {
+    auto pattern = BuildPattern<scalar_t>();
+    return make_bloch_cache(system, lattice, modifiers, simple_build, pattern);
+}
+
+/// Complete a periodic Hamiltonian by adding the boundary hoppings for the given wave vector
+template<class scalar_t>
+Hamiltonian make(BlochCache<scalar_t> const& cache, Cartesian k_vector) {
+    auto matrix = std::make_shared<SparseMatrixX<scalar_t>>(cache.matrix);
+    auto const values = matrix->valuePtr();
+
+    for (auto const& boundary : cache.boundaries) {
+        using constant::i1;
+        auto const phase = num::force_cast<scalar_t>(exp(i1 * k_vector.dot(boundary.shift)));
+        for (auto n = size_t{0}, size = boundary.hoppings.size(); n < size; ++n) {
+            auto const value = boundary.hoppings[n] * phase;
+            values[boundary.positions[2 * n]] += value;
+            values[boundary.positions[2 * n + 1]] += num::conjugate(value);
+        }
+    }
+
+    detail::throw_if_invalid(*matrix);
+    return matrix;
+}
+
 } // namespace ham
 } // namespace cpb
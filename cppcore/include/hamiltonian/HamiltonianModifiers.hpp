@@ -6,6 +6,7 @@
 
 #include "detail/macros.hpp"
 #include "detail/algorithm.hpp"
+#include "detail/sugar.hpp"
 
 #include <vector>
 #include <memory>
@@ -31,17 +32,38 @@ class OnsiteModifier {
 public:
     using Function = std::function<void(ComplexArrayRef energy, CartesianArrayConstRef positions,
                                         string_view sublattice)>;
+    /// Also receives the system index of the first site: `first_site + n` is the index of site `n`
+    using IndexedFunction = std::function<void(ComplexArrayRef energy,
+                                               CartesianArrayConstRef positions,
+                                               string_view sublattice, idx_t first_site)>;
 
-    Function apply; ///< to be user-implemented
+    IndexedFunction apply; ///< to be user-implemented
     bool is_complex = false; ///< the modeled effect requires complex values
     bool is_double = false; ///< the modeled effect requires double precision
+    bool is_thread_safe = false; ///< `apply` may be called concurrently (not Python functions)
 
-    OnsiteModifier(Function const& apply, bool is_complex = false, bool is_double = false)
-        : apply(apply), is_complex(is_complex), is_double(is_double) {}
+    OnsiteModifier(Function const& apply, bool is_complex = false, bool is_double = false,
+                   bool is_thread_safe = false)
+        : OnsiteModifier(ignore_index(apply), is_complex, is_double, is_thread_safe) {}
+    OnsiteModifier(IndexedFunction const& apply, bool is_complex = false, bool is_double = false,
+                   bool is_thread_safe = false)
+        : apply(apply), is_complex(is_complex), is_double(is_double),
+          is_thread_safe(is_thread_safe) {}
 
     explicit operator bool() const { return static_cast<bool>(apply); }
+
+private:
+    static IndexedFunction ignore_index(Function const& f) {
+        if (!f) { return {}; }
+        return [f](ComplexArrayRef energy, CartesianArrayConstRef positions,
+                   string_view sublattice, idx_t) { f(energy, positions, sublattice); };
+    }
 };
 
+/// The row or column indices of consecutive `COO` hoppings, viewed in place (no copy)
+using CooIndexRef = Eigen::Map<ArrayX<storage_idx_t> const, 0, Eigen::InnerStride<2>>;
+static_assert(sizeof(COO) == 2 * sizeof(storage_idx_t), "COO indices must be interleaved");
+
 /**
  Modify the hopping energy, e.g. to apply a magnetic field
 */
@@ -49,20 +71,59 @@ class HoppingModifier {
 public:
     using Function = std::function<void(ComplexArrayRef energy, CartesianArrayConstRef pos1,
                                         CartesianArrayConstRef pos2, string_view hopping_family)>;
+    /// Receives the system indices of the sites instead of copies of their positions: hopping `n`
+    /// goes from `positions[rows[n]]` to `positions[cols[n]] - shift`. The `positions` are all
+    /// the sites of the system and `shift` is only nonzero for periodic boundaries.
+    using IndexedFunction = std::function<void(ComplexArrayRef energy, CooIndexRef rows,
+                                               CooIndexRef cols, CartesianArrayConstRef positions,
+                                               Cartesian shift, string_view hopping_family)>;
+
     Function apply; ///< to be user-implemented
+    IndexedFunction apply_indexed; ///< used instead of `apply` if it's set
     bool is_complex = false; ///< the modeled effect requires complex values
     bool is_double = false; ///< the modeled effect requires double precision
+    bool is_thread_safe = false; ///< `apply` may be called concurrently (not Python functions)
 
-    HoppingModifier(Function const& apply, bool is_complex = false, bool is_double = false)
-        : apply(apply), is_complex(is_complex), is_double(is_double) {}
+    HoppingModifier(Function const& apply, bool is_complex = false, bool is_double = false,
+                    bool is_thread_safe = false)
+        : apply(apply), is_complex(is_complex), is_double(is_double),
+          is_thread_safe(is_thread_safe) {}
+    HoppingModifier(IndexedFunction const& apply_indexed, bool is_complex = false,
+                    bool is_double = false, bool is_thread_safe = false)
+        : apply_indexed(apply_indexed), is_complex(is_complex), is_double(is_double),
+          is_thread_safe(is_thread_safe) {}
 
-    explicit operator bool() const { return static_cast<bool>(apply); }
+    explicit operator bool() const { return apply || apply_indexed; }
+
+    /// Indexed modifiers don't need position buffers so they are given larger slices
+    bool is_indexed() const { return static_cast<bool>(apply_indexed); }
 };
 
+/**
+ The slice `[start, start + size)` of the sites of a sublattice or the hoppings of a family
+
+ The modifiers are applied one slice at a time to limit the size of the buffers.
+ The slices are independent so they may also be computed concurrently.
+ */
+template<class Iterator>
+struct Slice {
+    Iterator it; ///< the sublattice or hopping family block
+    idx_t start;
+    idx_t size;
+};
+
+using OnsiteSlice = Slice<CompressedSublattices::It>;
+using HoppingSlice = Slice<HoppingBlocks::Iterator>;
+
 /**
  Container with some convenience functions
  */
 struct HamiltonianModifiers {
+    /// Number of elements passed to a modifier in one call (at most)
+    static constexpr auto max_slice_size = idx_t{100000};
+    /// The limit if all the hopping modifiers are indexed (see `hopping_slice_size()`)
+    static constexpr auto max_indexed_slice_size = idx_t{1} << 24;
+
     std::vector<OnsiteModifier> onsite;
     std::vector<HoppingModifier> hopping;
 
@@ -72,87 +133,130 @@ struct HamiltonianModifiers {
     /// Do any of the modifiers require double precision?
     bool any_double() const;
 
+    /// Can all of the modifiers be applied concurrently to different slices?
+    bool all_thread_safe() const;
+
+    /// The number of elements in a hopping slice: more than `max_slice_size` only if all the
+    /// hopping modifiers are indexed and some can't run concurrently (e.g. Python functions)
+    /// because then each call is expensive. It's limited by the currently available memory.
+    idx_t hopping_slice_size() const;
+
     /// Remove all modifiers
     void clear();
 
+    /// The slices which `apply_to_onsite()` goes through (none if all the energies are zero)
+    std::vector<OnsiteSlice> onsite_slices(System const& system) const;
+    /// The slices which `apply_to_hoppings()` goes through for the given system (or boundary)
+    std::vector<HoppingSlice> hopping_slices(System const& system,
+                                             HoppingBlocks const& hopping_blocks) const;
+    std::vector<HoppingSlice> hopping_slices(System const& system) const {
+        return hopping_slices(system, system.hopping_blocks);
+    }
+
     /// Apply onsite modifiers to the given system and pass results to function:
     ///     lambda(int i, scalar_t onsite)
     template<class scalar_t, class Fn>
-    void apply_to_onsite(System const& system, Fn lambda) const;
+    void apply_to_onsite(System const& system, Fn lambda) const {
+        for (auto const& slice : onsite_slices(system)) {
+            apply_to_onsite<scalar_t>(system, slice, lambda);
+        }
+    }
+
+    /// Apply onsite modifiers to a single slice of the system
+    template<class scalar_t, class Fn>
+    void apply_to_onsite(System const& system, OnsiteSlice const& slice, Fn lambda) const;
 
     /// Apply hopping modifiers to the given system (or boundary) and pass results to:
     ///     lambda(int i, int j, scalar_t hopping)
     template<class scalar_t, class Fn>
     void apply_to_hoppings(System const& system, Fn fn) const {
-        apply_to_hoppings_impl<scalar_t>(system, system, fn);
+        for (auto const& slice : hopping_slices(system)) {
+            apply_to_hoppings_impl<scalar_t>(system, system, slice, fn);
+        }
     };
 
     template<class scalar_t, class Fn>
     void apply_to_hoppings(System const& system, size_t boundary_index, Fn fn) const {
-        apply_to_hoppings_impl<scalar_t>(system, system.boundaries[boundary_index], fn);
+        auto const& boundary = system.boundaries[boundary_index];
+        for (auto const& slice : hopping_slices(system, boundary.hopping_blocks)) {
+            apply_to_hoppings_impl<scalar_t>(system, boundary, slice, fn);
+        }
     };
 
+    /// Apply hopping modifiers to a single slice of the system (not a boundary)
+    template<class scalar_t, class Fn>
+    void apply_to_hoppings(System const& system, HoppingSlice const& slice, Fn fn) const {
+        apply_to_hoppings_impl<scalar_t>(system, system, slice, fn);
+    };
+
+    /// Apply the modifiers with the real `scalar_t` to a small sample: at most `sample_size`
+    /// elements of each sublattice and hopping family (including the boundaries). Return
+    /// `true` if a modifier requested complex numbers by throwing `ComplexOverride`. This is
+    /// much cheaper than finding out in the middle of a full Hamiltonian build. A modifier
+    /// which returns complex values only for some distant elements won't be detected.
+    template<class scalar_t>
+    bool probe_complex(System const& system, idx_t sample_size = 64) const;
+
 private:
     template<class scalar_t, class SystemOrBoundary, class Fn>
     void apply_to_hoppings_impl(System const& system, SystemOrBoundary const& system_or_boundary,
-                                Fn lambda) const;
+                                HoppingSlice const& slice, Fn lambda) const;
 };
 
 namespace detail {
     inline Cartesian shifted(Cartesian pos, System const&) { return pos; }
     inline Cartesian shifted(Cartesian pos, System::Boundary const& b) { return pos - b.shift; }
+    inline Cartesian shift(System const&) { return Cartesian::Zero(); }
+    inline Cartesian shift(System::Boundary const& b) { return b.shift; }
 }
 
 template<class scalar_t, class Fn>
-void HamiltonianModifiers::apply_to_onsite(System const& system, Fn lambda) const {
-    auto const has_intrinsic_onsite = system.site_registry.has_nonzero_energy();
-    if (!has_intrinsic_onsite && onsite.empty()) {
-        return;
-    }
+void HamiltonianModifiers::apply_to_onsite(System const& system, OnsiteSlice const& slice,
+                                           Fn lambda) const {
+    auto const& sub = slice.it;
+    auto const nsites = slice.size;
+    auto const norb = sub.num_orbitals();
+    auto onsite_energy = ArrayX<scalar_t>::Zero(nsites * norb * norb).eval();
+
+    if (system.site_registry.has_nonzero_energy()) {
+        // Intrinsic lattice onsite energy -- just replicate the value at each site
+        auto const intrinsic_energy = num::force_cast<scalar_t>(
+            system.site_registry.energy(sub.id())
+        );
 
-    for (auto const& sub : system.compressed_sublattices) {
-        auto const nsites = sub.num_sites();
-        auto const norb = sub.num_orbitals();
-        auto onsite_energy = ArrayX<scalar_t>::Zero(nsites * norb * norb).eval();
-
-        if (has_intrinsic_onsite) {
-            // Intrinsic lattice onsite energy -- just replicate the value at each site
-            auto const intrinsic_energy = num::force_cast<scalar_t>(
-                system.site_registry.energy(sub.id())
-            );
-
-            auto start = idx_t{0};
-            for (auto const& value : intrinsic_energy) {
-                onsite_energy.segment(start, nsites).setConstant(value);
-                start += nsites;
-            }
+        auto start = idx_t{0};
+        for (auto const& value : intrinsic_energy) {
+            onsite_energy.segment(start, nsites).setConstant(value);
+            start += nsites;
         }
+    }
 
-        if (!onsite.empty()) {
-            // Apply all user-defined onsite modifier functions
-            auto onsite_ref = (norb == 1) ? arrayref(onsite_energy.data(), nsites)
-                                          : arrayref(onsite_energy.data(), norb, norb, nsites);
-            auto const position_ref = system.positions.segment(sub.sys_start(), nsites);
-            auto const sub_name = system.site_registry.name(sub.id());
+    if (!onsite.empty()) {
+        // Apply all user-defined onsite modifier functions
+        auto onsite_ref = (norb == 1) ? arrayref(onsite_energy.data(), nsites)
+                                      : arrayref(onsite_energy.data(), norb, norb, nsites);
+        auto const position_ref = system.positions.segment(sub.sys_start() + slice.start, nsites);
+        auto const sub_name = system.site_registry.name(sub.id());
 
-            for (auto const& modifier : onsite) {
-                modifier.apply(onsite_ref, position_ref, sub_name);
-            }
+        for (auto const& modifier : onsite) {
+            modifier.apply(onsite_ref, position_ref, sub_name, sub.sys_start() + slice.start);
         }
+    }
 
-        // Pass along each onsite value at the correct Hamiltonian row and column indices
-        auto const* data = onsite_energy.data();
-        for (auto i = idx_t{0}; i < norb; ++i) {
-            for (auto j = idx_t{0}; j < norb; ++j) {
-                for (auto idx = sub.ham_start(), end = sub.ham_end(); idx < end; idx += norb) {
-                    auto const value = *data++;
-                    if (value != scalar_t{0}) {
-                        lambda(i + idx, j + idx, value);
-                    }
+    // Pass along each onsite value at the correct Hamiltonian row and column indices
+    auto const* data = onsite_energy.data();
+    auto const ham_start = sub.ham_start() + slice.start * norb;
+    auto const ham_end = ham_start + nsites * norb;
+    for (auto i = idx_t{0}; i < norb; ++i) {
+        for (auto j = idx_t{0}; j < norb; ++j) {
+            for (auto idx = ham_start; idx < ham_end; idx += norb) {
+                auto const value = *data++;
+                if (value != scalar_t{0}) {
+                    lambda(i + idx, j + idx, value);
                 }
             }
         }
-    } // for (auto const& sub : system.compressed_sublattices)
+    }
 }
 
 /**
@@ -201,22 +305,21 @@ private:
  Applying modifiers to each hopping individually would be slow.
  Passing all the values in one call would require a lot of memory.
  Buffering the hoppings to balances performance and memory usage.
+ The size is set by the slice (see `HamiltonianModifiers::hopping_slices()`).
+ The positions are left empty if all the modifiers are indexed.
 */
 template<class scalar_t>
 struct HoppingBuffer {
-    static constexpr auto max_buffer_size = idx_t{100000};
-
     idx_t size; ///< number of elements in the buffer
     MatrixX<scalar_t> unit_hopping; ///< to be replicated `size` times
     ArrayX<scalar_t> hoppings; ///< actually a 3D array: `size` * `unit.rows()` * `unit.cols()`
     CartesianArray pos1; ///< hopping source position
     CartesianArray pos2; ///< hopping destination position
 
-    HoppingBuffer(MatrixXcd const& unit_hopping, idx_t block_size)
-        : size(std::min(max_buffer_size / unit_hopping.size(), block_size)),
-          unit_hopping(num::force_cast<scalar_t>(unit_hopping)),
+    HoppingBuffer(MatrixXcd const& unit_hopping, idx_t size, bool with_positions = true)
+        : size(size), unit_hopping(num::force_cast<scalar_t>(unit_hopping)),
           hoppings(size * unit_hopping.size()),
-          pos1(size), pos2(size) {}
+          pos1(with_positions ? size : 0), pos2(with_positions ? size : 0) {}
 
     /// Replicate each value from the `unit_hopping` matrix `num` times
     void reset_hoppings(idx_t num) {
@@ -239,53 +342,86 @@ struct HoppingBuffer {
 template<class scalar_t, class SystemOrBoundary, class Fn>
 void HamiltonianModifiers::apply_to_hoppings_impl(System const& system,
                                                   SystemOrBoundary const& system_or_boundary,
-                                                  Fn lambda) const {
+                                                  HoppingSlice const& slice, Fn lambda) const {
     auto const& hopping_registry = system.hopping_registry;
+    auto const& block = slice.it;
+    auto const first = block.coordinates().begin() + slice.start;
+    auto const coo_slice = make_range(first, first + slice.size);
 
     // Fast path: Modifiers don't need to be applied and the single-orbital model
     // allows direct mapping between sites and Hamiltonian matrix elements.
     if (hopping.empty() && !hopping_registry.has_multiple_orbitals()) {
-        for (auto const& block : system_or_boundary.hopping_blocks) {
-            auto const energy = num::force_cast<scalar_t>(
-                hopping_registry.energy(block.family_id())
-            );
-
-            auto const value = energy(0, 0); // single orbital
-            for (auto const& coo : block.coordinates()) {
-                lambda(coo.row, coo.col, value);
-            }
+        auto const energy = num::force_cast<scalar_t>(hopping_registry.energy(block.family_id()));
+        auto const value = energy(0, 0); // single orbital
+        for (auto const& coo : coo_slice) {
+            lambda(coo.row, coo.col, value);
         }
-
         return;
     }
 
     // Slow path: Apply modifiers and/or consider multiple orbitals which
     // require translating between site and Hamiltonian matrix indices.
-    for (auto const& block : system_or_boundary.hopping_blocks) {
-        if (block.size() == 0) { continue; }
-
-        auto const& hopping_energy = hopping_registry.energy(block.family_id());
-        auto const hopping_name = hopping_registry.name(block.family_id());
-        auto const index_translator = IndexTranslator(system, hopping_energy);
-
-        auto buffer = HoppingBuffer<scalar_t>(hopping_energy, block.size());
-        for (auto const coo_slice : sliced(block.coordinates(), buffer.size)) {
-            auto size = idx_t{0};
-            for (auto const& coo : coo_slice) {
-                buffer.pos1[size] = system.positions[coo.row];
-                buffer.pos2[size] = detail::shifted(system.positions[coo.col], system_or_boundary);
-                ++size;
-            }
+    auto const& hopping_energy = hopping_registry.energy(block.family_id());
+    auto const hopping_name = hopping_registry.name(block.family_id());
+    auto const index_translator = IndexTranslator(system, hopping_energy);
+
+    auto const needs_positions = [](HoppingModifier const& m) { return !m.is_indexed(); };
+    auto const with_positions = std::any_of(hopping.begin(), hopping.end(), needs_positions);
+    auto buffer = HoppingBuffer<scalar_t>(hopping_energy, slice.size, with_positions);
+    auto size = idx_t{0};
+    for (auto const& coo : coo_slice) {
+        if (with_positions) {
+            buffer.pos1[size] = system.positions[coo.row];
+            buffer.pos2[size] = detail::shifted(system.positions[coo.col], system_or_boundary);
+        }
+        ++size;
+    }
 
-            buffer.reset_hoppings(size);
-            for (auto const& modifier : hopping) {
-                modifier.apply(buffer.hoppings_ref(size), buffer.pos1.head(size),
-                               buffer.pos2.head(size), hopping_name);
-            }
+    buffer.reset_hoppings(size);
+    auto const rows = CooIndexRef(&first->row, size);
+    auto const cols = CooIndexRef(&first->col, size);
+    for (auto const& modifier : hopping) {
+        if (modifier.is_indexed()) {
+            modifier.apply_indexed(buffer.hoppings_ref(size), rows, cols, system.positions,
+                                   detail::shift(system_or_boundary), hopping_name);
+        } else {
+            modifier.apply(buffer.hoppings_ref(size), buffer.pos1.head(size),
+                           buffer.pos2.head(size), hopping_name);
+        }
+    }
+
+    index_translator.for_each(coo_slice, buffer.hoppings, lambda);
+}
 
-            index_translator.for_each(coo_slice, buffer.hoppings, lambda);
+template<class scalar_t>
+bool HamiltonianModifiers::probe_complex(System const& system, idx_t sample_size) const {
+    // Only the first slice of each sublattice or family, truncated to the `sample_size`
+    auto const head = [sample_size](HoppingSlice const& s) -> HoppingSlice {
+        return {s.it, 0, std::min(s.size, sample_size)};
+    };
+    auto const ignore = [](idx_t, idx_t, scalar_t) {};
+
+    try {
+        for (auto const& s : onsite.empty() ? std::vector<OnsiteSlice>() : onsite_slices(system)) {
+            if (s.start != 0) { continue; }
+            apply_to_onsite<scalar_t>(system, {s.it, 0, std::min(s.size, sample_size)}, ignore);
+        }
+        if (hopping.empty()) { return false; }
+
+        for (auto const& s : hopping_slices(system)) {
+            if (s.start != 0) { continue; }
+            apply_to_hoppings_impl<scalar_t>(system, system, head(s), ignore);
+        }
+        for (auto const& boundary : system.boundaries) {
+            for (auto const& s : hopping_slices(system, boundary.hopping_blocks)) {
+                if (s.start != 0) { continue; }
+                apply_to_hoppings_impl<scalar_t>(system, boundary, head(s), ignore);
+            }
         }
+    } catch (ComplexOverride const&) {
+        return true;
     }
+    return false;
 }
 
 } // namespace cpb
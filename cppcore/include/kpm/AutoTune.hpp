@@ -0,0 +1,32 @@
+#pragma once
+#include "kpm/Core.hpp"
+
+namespace cpb { namespace kpm {
+
+/// The fastest matrix format and moment algorithm found by `auto_tune()`
+struct TunedConfig {
+    MatrixFormat matrix_format;
+    bool interleaved;
+};
+
+/**
+ Time a few Chebyshev iterations of the actual Hamiltonian for each candidate `MatrixFormat`
+ and interleaved/non-interleaved moment algorithm and return the fastest combination
+
+ The result is cached per (matrix shape, max nnz per row, scalar type, host) where the host
+ is identified by the SIMD instruction set and the number of threads. A cache hit skips the
+ search. If `config.tuning_cache_file` is set, the results are also read from and appended
+ to that file so that they are shared between runs. `STENCIL` is only a candidate if
+ a `stencil` pattern is given and `BSR` only if the `block_size` is larger than 1.
+ The `optimal_size` setting is kept as configured.
+ */
+TunedConfig auto_tune(Hamiltonian const& h, Compute const& compute, Config const& config,
+                      Scale<> scale, num::StencilPattern const& stencil = {},
+                      idx_t block_size = 1);
+
+/// Number of entries in the process-wide tuning cache
+idx_t tuning_cache_size();
+/// Forget all the tuning results (the cache file is not modified)
+void clear_tuning_cache();
+
+}} // namespace cpb::kpm
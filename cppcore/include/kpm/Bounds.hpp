@@ -1,7 +1,10 @@
 #pragma once
 #include "hamiltonian/Hamiltonian.hpp"
+#include "kpm/Config.hpp"
 #include "utils/Chrono.hpp"
 
+#include <memory>
+
 namespace cpb { namespace kpm {
 
 /**
@@ -37,14 +40,34 @@ struct Scale {
 
  The bounds can be determined automatically using the Lanczos procedure,
  or set manually by the user. Also computes the KPM scaling factors a and b.
+
+ The cheaper `gershgorin()` bounds take a single pass over the matrix. The `warm()` bounds
+ of a modified Hamiltonian (e.g. a new disorder realization) are the Lanczos bounds of the
+ reference Hamiltonian widened by the size of the change, which is also a single pass.
 */
 class Bounds {
 public:
-    Bounds(Hamiltonian const& hamiltonian, double precision_percent)
-        : hamiltonian(hamiltonian), precision_percent(precision_percent) {}
+    /// A `warm()` start runs a new Lanczos procedure if the change is larger than this
+    /// fraction of the spectrum width -- otherwise the bounds would keep getting wider
+    static constexpr auto max_perturbation = 0.05;
+
+    /// The Lanczos steps use `num_threads` (`<= 0`: the `thread_budget()` of the thread which
+    /// computes the bounds). With `coarse_percent > precision_percent`, the procedure may stop
+    /// early at the coarse precision if the residuals show that it's reliable enough.
+    Bounds(Hamiltonian const& hamiltonian, double precision_percent, idx_t num_threads = -1,
+           double coarse_percent = 0)
+        : hamiltonian(hamiltonian), precision_percent(precision_percent),
+          num_threads(num_threads), coarse_percent(coarse_percent) {}
     /// Set the energy bounds manually, therefore skipping the Lanczos computation
     Bounds(double min_energy, double max_energy) : min(min_energy), max(max_energy) {}
 
+    /// Bounds from the Gershgorin circles widened by `padding_percent` of the width
+    static Bounds gershgorin(Hamiltonian const& hamiltonian, double padding_percent = 0);
+    /// Bounds of a new `hamiltonian` which reuse the Lanczos reference of these bounds
+    /// (if they have one): they are widened by `num::difference_norm()` of the Hamiltonians
+    /// and by `padding_percent` of the width. Computed lazily, like the Lanczos bounds.
+    Bounds warm(Hamiltonian const& hamiltonian, double padding_percent = 0) const;
+
     double min_energy() { compute_bounds(); return min; }
     double max_energy() { compute_bounds(); return max; }
     /// The KPM scaling factors a and b
@@ -54,18 +77,35 @@ public:
     ArrayXd linspaced(idx_t size) { return ArrayXd::LinSpaced(size, min_energy(), max_energy()); }
 
     std::string report(bool shortform = false) const;
+    /// Time taken by the Lanczos procedure
+    Chrono const& get_timer() const { return timer; }
 
 private:
     /// Compute the scaling factors using the Lanczos procedure
     void compute_bounds();
+    /// Widen the bounds by `padding_percent` of their width
+    void pad(double padding_percent);
 
 private:
+    /// The last Lanczos result, shared by all the `warm()` bounds which derive from it
+    struct Reference {
+        Hamiltonian hamiltonian;
+        double min;
+        double max;
+    };
+
     double min = .0; ///< the lowest eigenvalue
     double max = .0; ///< the highest eigenvalue
     int lanczos_loops = 0;  ///< number of iterations needed to converge the Lanczos procedure
+    BoundsMode mode = BoundsMode::Lanczos; ///< how the bounds were found
+    double perturbation = 0; ///< the distance to the `reference` bounds (`Warm` only)
 
     Hamiltonian hamiltonian;
-    double precision_percent;
+    double precision_percent = 0;
+    idx_t num_threads = -1;
+    double coarse_percent = 0;
+    double padding_percent = 0;
+    std::shared_ptr<Reference const> reference;
     Chrono timer;
 };
 
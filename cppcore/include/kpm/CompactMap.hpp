@@ -0,0 +1,44 @@
+#pragma once
+#include "numeric/dense.hpp"
+
+#include <cstdint>
+
+namespace cpb { namespace kpm {
+
+/// Storage of the values of a `CompactMap`
+enum class MapPrecision {
+    Single, ///< 4 bytes per value: about 7 significant digits
+    Fixed16 ///< 2 bytes per value, scaled per column
+};
+
+/**
+ Result map in reduced precision: one row per energy and one column per site
+
+ `Single` takes half the memory of an `ArrayXXdCM`. `Fixed16` takes a quarter: each column
+ is stored as 16-bit integers relative to its largest magnitude, `fixed(i, j) * scales[j]`,
+ so the error is below `1 / 32767` of the peak of the column (about 4 significant digits).
+ That's plenty for plotting and thresholding an LDOS map. The columns are written in chunks
+ with `set()`, e.g. straight from a chunked LDOS calculation (see `Config::ldos_chunk_size`),
+ so the whole map never exists in double precision.
+ */
+struct CompactMap {
+    MapPrecision precision = MapPrecision::Single;
+    ColMajorArrayXX<float> single; ///< the values if `precision == Single`
+    ColMajorArrayXX<std::int16_t> fixed; ///< the scaled values if `precision == Fixed16`
+    ArrayXf scales; ///< one per column of `fixed`
+
+    CompactMap() = default;
+    CompactMap(idx_t rows, idx_t cols, MapPrecision precision);
+
+    idx_t rows() const;
+    idx_t cols() const;
+
+    /// Store the columns `[first, first + block.cols())`
+    void set(idx_t first, ArrayXXdCM const& block);
+    /// All the values converted back to double precision
+    ArrayXXdCM decompressed() const;
+    /// Bytes taken by the values and the scales
+    size_t memory() const;
+};
+
+}} // namespace cpb::kpm
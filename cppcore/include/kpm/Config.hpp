@@ -1,10 +1,26 @@
 #pragma once
 #include "kpm/Kernel.hpp"
 
+#include <string>
+
 namespace cpb { namespace kpm {
 
-/// Sparse matrix format for the optimized Hamiltonian
-enum class MatrixFormat { CSR, ELL };
+/// Sparse matrix format for the optimized Hamiltonian. The matrix-free `STENCIL` applies
+/// only to pristine lattices: it falls back to `ELL` if translational invariance is broken.
+/// `ELL` is replaced by the hybrid `HYB` if a few long rows would dominate its padding.
+/// `ELL_SPLIT` stores complex values as separate real and imaginary planes (`ELL` if real).
+/// The lossy `ELL_BF16` and `ELL_INT8` store real values with 16 or 8 bits (`ELL` if complex).
+enum class MatrixFormat {
+    CSR, ELL, SELL, STENCIL, BSR, HERMITIAN, ELL_TABLE, ELL_DELTA, HYB, ELL_SPLIT,
+    ELL_BF16, ELL_INT8
+};
+
+/// How the energy bounds are estimated when they are not set by the user, see `Bounds`
+enum class BoundsMode {
+    Lanczos,    ///< the Lanczos procedure for every Hamiltonian
+    Gershgorin, ///< the Gershgorin circles: a single pass, never too narrow but often wider
+    Warm        ///< Lanczos once, then shifted by the size of the change of the Hamiltonian
+};
 
 /**
  Algorithm selection, see the corresponding functions in `calc_moments.hpp`
@@ -12,9 +28,38 @@ enum class MatrixFormat { CSR, ELL };
 struct AlgorithmConfig {
     bool optimal_size;
     bool interleaved;
+    /// Compute the off-diagonal moments of a single source index (e.g. a few Green's function
+    /// elements) from recursions which start at both the source and the destination indices:
+    /// `T_m T_n = (T_{m+n} + T_{|m-n|}) / 2` gives all the moments from only half of the
+    /// iterations. The source and destination vectors share the matrix traffic of each
+    /// iteration because they are propagated together as a SIMD batch.
+    bool product_identity;
+    /// Advance this many consecutive moments per pass over the matrix in the diagonal algorithms,
+    /// e.g. the stochastic DOS (0 or 1: disabled). The passes are a wavefront over the slices of
+    /// the reordered matrix: as long as a few slices fit in cache, the matrix and the vectors are
+    /// streamed from main memory once per pass instead of once per moment.
+    idx_t matrix_powers;
+    /// Compute the diagonal Green's function elements with a Lanczos recursion from the unit
+    /// starter and a continued fraction (see `compute::continued_fraction()`) instead of the
+    /// Chebyshev moments. It stops once the result at the requested energies has converged,
+    /// which usually takes far fewer matrix-vector products at small broadening. The
+    /// broadening is then a Lorentzian `E + i*broadening` rather than the damping kernel.
+    bool lanczos_greens;
+    /// Stop the recursion of an LDOS vector (or SIMD batch) early once its moments over a
+    /// trailing window of iterations are all below this fraction of `mu_0` (0: disabled),
+    /// e.g. in gapped or smooth regions of an LDOS map. The remaining moments are zero before
+    /// the damping. It doesn't apply to checkpointed calculations (`ldos_moments()`).
+    float convergence_tolerance;
+    /// Make the moments bit-for-bit reproducible for any number of threads: the results of
+    /// concurrent vectors are summed in the order of their starter index (the starter vector
+    /// with a given index is always the same) and the SIMD batches and the row blocks of the
+    /// reductions have a fixed size. It doesn't cover the adaptive stopping (`target_error`)
+    /// which may still decide after a different number of vectors: it depends on which ones
+    /// finished first.
+    bool deterministic;
 
     /// Does the Hamiltonian matrix need to be reordered?
-    bool reorder() const { return optimal_size || interleaved; }
+    bool reorder() const { return optimal_size || interleaved || matrix_powers > 1; }
 };
 
 /**
@@ -26,9 +71,61 @@ struct Config {
     Kernel kernel = jackson_kernel(); ///< produces the damping coefficients
 
     MatrixFormat matrix_format = MatrixFormat::ELL;
-    AlgorithmConfig algorithm = {/*optimal_size*/true, /*interleaved*/true};
+    /// Store the Hamiltonian and KPM vectors in single precision (halving memory traffic)
+    /// but accumulate the diagonal moment sums in double precision
+    bool mixed_precision = false;
+    AlgorithmConfig algorithm = {/*optimal_size*/true, /*interleaved*/true,
+                                 /*product_identity*/false, /*matrix_powers*/0,
+                                 /*lanczos_greens*/false, /*convergence_tolerance*/0.0f,
+                                 /*deterministic*/false};
 
     float lanczos_precision = 0.002f; ///< how precise should the min/max energy estimation be
+    /// Stop the min/max energy estimation at this looser precision (%) if the Lanczos residuals
+    /// show that the bounds are already within it (0: disabled). Up to 1% (the `Scale`
+    /// tolerance), the remaining error is covered by the margin of the KPM scaling.
+    float lanczos_coarse_precision = 0.0f;
+    /// How to find the energy bounds when `min_energy == max_energy`. `Warm` reruns the Lanczos
+    /// procedure only when a new Hamiltonian (`Core::set_hamiltonian()`) differs from the last
+    /// Lanczos reference by more than `Bounds::max_perturbation` of the spectrum width.
+    BoundsMode bounds_mode = BoundsMode::Lanczos;
+    /// Widen the `Gershgorin` and `Warm` bounds by this percentage of the spectrum width
+    float bounds_padding = 0.0f;
+    /// Reconstruct the DOS, LDOS and Green's function using an FFT on the Chebyshev nodes and
+    /// interpolation onto the energy points instead of evaluating every Chebyshev polynomial
+    bool fast_reconstruction = false;
+
+    /// The Kubo-Bastin moment matrix is computed in square blocks of this size (0: no blocking).
+    /// Peak memory drops from O(num_moments * size) to O(block_size * size) at the cost of
+    /// recomputing the right-hand Chebyshev vectors once for each block.
+    idx_t conductivity_block_size = 0;
+
+    /// The LDOS of more indices than this (e.g. `calc_spatial_ldos()`) is computed in chunks
+    /// (0: all at once). Each chunk is reconstructed into the result as soon as its moments are
+    /// done so the moments only take O(num_moments * chunk_size) memory instead of the whole
+    /// map. The chunks share the optimized Hamiltonian but they skip the `moment_cache_size`.
+    idx_t ldos_chunk_size = 1024;
+
+    /// Keep the undamped moments of this many recent LDOS, DOS or Green's function calculations
+    /// (0: disabled). Repeated calls with the same indices are served from the cache and
+    /// a smaller number of moments (larger broadening) is served by truncation.
+    idx_t moment_cache_size = 0;
+
+    /// Generate the random starter vectors (DOS, conductivity) with the counter-based Philox
+    /// generator instead of the sequential Mersenne Twister. Each vector is a function of only
+    /// its index: the threads make their own vectors without waiting on each other and
+    /// the vectors are identical for any number of threads or processes.
+    bool counter_based_random = false;
+
+    /// Keep this many previous reordered Hamiltonians (0: disabled). Calculations which return
+    /// to previously targeted indices (e.g. LDOS at many sites) don't need to reorder again.
+    idx_t reorder_cache_size = 0;
+
+    /// Time a few Chebyshev iterations for each `matrix_format` and `algorithm.interleaved`
+    /// candidate on the actual Hamiltonian and use the fastest (see `AutoTune.hpp`).
+    /// The choice is cached per matrix shape, scalar type and host.
+    bool auto_tune = false;
+    /// Also keep the auto-tuning results in this file to share them between runs (empty: none)
+    std::string tuning_cache_file;
 };
 
 }} // namespace cpb::kpm
@@ -4,12 +4,20 @@
 
 #include "kpm/Bounds.hpp"
 #include "kpm/Config.hpp"
+#include "kpm/ExpansionMoments.hpp"
 #include "kpm/OptimizedHamiltonian.hpp"
 #include "kpm/Starter.hpp"
 #include "kpm/Moments.hpp"
+#include "kpm/MomentCache.hpp"
 #include "kpm/Stats.hpp"
 
 #include "utils/Chrono.hpp"
+#include "utils/Memory.hpp"
+
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
 
 namespace cpb { namespace kpm {
 
@@ -26,6 +34,25 @@ public:
 
         virtual void moments(MomentsRef, Starter const&, AlgorithmConfig const&,
                              OptimizedHamiltonian const&) const = 0;
+
+        /// Number of CPU threads which may also be used for the reconstruction
+        virtual idx_t get_num_threads() const { return 1; }
+
+        /// Time breakdown of the last `moments()` call (empty if it's not recorded)
+        virtual ComputeProfile profile() const { return {}; }
+
+        /// Progress of the running `moments()` calls: it may be polled from any thread
+        virtual ComputeProgress progress() const { return {}; }
+
+        /// Diagonal moments `<i|Tn(H_k)|i>` of several Hamiltonians `H_k` which share one
+        /// sparsity pattern, see `Core::multi_ldos()`. The `members` are already scaled and
+        /// reordered like the `map`. Result `k` has one column per index `i` of `idx.src`.
+        virtual std::vector<BatchData> multi_moments(std::vector<VariantCSR> const& /*members*/,
+                                                     SliceMap const&, Indices const&, idx_t,
+                                                     AlgorithmConfig const&) const {
+            throw std::runtime_error("KPM: the compute implementation doesn't support "
+                                     "multiple Hamiltonians.");
+        }
     };
 
     template<class T>
@@ -41,17 +68,38 @@ private:
  Low-level KPM implementation
 
  No Model information (sublattice, positions, etc.), just the Hamiltonian matrix and indices.
+
+ The calculations are reentrant: they may be called concurrently from several threads. Each
+ call is a `Session` with its own stats which reads one of the shared optimized Hamiltonians.
+ Concurrent calls for the same target indices share the same optimized matrix and a new one
+ is only made for a call with different indices while all the others are in use. The stats,
+ `report()` and the `MomentCache` are shared: they describe the last completed calculation.
+ Only `set_hamiltonian()` must not overlap with any calculation.
  */
 class Core {
 public:
-    explicit Core(Hamiltonian const& h, Compute const& compute, Config const& config = {});
+    /// The `stencil` pattern is only needed for `MatrixFormat::STENCIL` and the `block_size`
+    /// (number of orbitals per site) only for `MatrixFormat::BSR`
+    explicit Core(Hamiltonian const& h, Compute const& compute, Config const& config = {},
+                  num::StencilPattern stencil = {}, idx_t block_size = 1);
+    /// Out-of-core calculations with a Hamiltonian which is streamed from a file for each
+    /// matrix-vector product, see `MappedCsrMatrix`. The configured matrix format, reordering
+    /// and auto-tuning don't apply. Without a configured energy range, the bounds are found
+    /// from the Gershgorin circles in a single pass over the file (instead of Lanczos). The
+    /// conductivity needs the Hamiltonian in memory. The `Compute` must be the default CPU one.
+    Core(MappedHamiltonian const& h, Compute const& compute, Config const& config = {});
 
-    void set_hamiltonian(Hamiltonian const& h) ;
+    /// If `h` has the same sparsity pattern as the current Hamiltonian (e.g. only the disorder
+    /// realization is different), the reordering and optimized matrix structure are reused
+    void set_hamiltonian(Hamiltonian const& h, num::StencilPattern stencil = {},
+                         idx_t block_size = 1);
     Config const& get_config() const { return config; }
-    Stats const& get_stats() const { return stats; }
+    Compute const& get_compute() const { return compute; }
+    /// Stats of the last completed calculation
+    Stats get_stats() const;
 
     /// The KPM scaling factors `a` and `b`
-    Scale<> scaling_factors() { return bounds.scaling_factors(); }
+    Scale<> scaling_factors();
 
     /// Information about what happened during the last calculation
     std::string report(bool shortform = false) const;
@@ -60,33 +108,229 @@ public:
     ArrayXcd moments(idx_t num_moments, VectorXcd const& alpha, VectorXcd const& beta,
                      SparseMatrixXcd const& op);
 
-    /// LDOS at the given Hamiltonian indices for the energy range and broadening
+    /// Same as `moments()` for each pair of `alpha` and `beta` columns: column `j` of the
+    /// result is `<beta_j|op Tn(H)|alpha_j>`. The vectors are computed in SIMD batches by
+    /// concurrent jobs. Without `beta` and `op`, the batches use the diagonal recursion
+    /// (`BatchDiagonalMoments`) which needs half as many matrix-vector products.
+    ArrayXXcd batch_moments(idx_t num_moments, MatrixXcd const& alpha, MatrixXcd const& beta,
+                            SparseMatrixXcd const& op);
+
+    /// LDOS at the given Hamiltonian indices for the energy range and broadening.
+    /// Many indices are computed in chunks to bound the memory, see `Config::ldos_chunk_size`.
     ArrayXXdCM ldos(std::vector<idx_t> const& idx, ArrayXd const& energy, double broadening);
-    /// DOS for the given energy range and broadening
-    ArrayXd dos(ArrayXd const& energy, double broadening, idx_t num_random);
+    /// Receives the columns `[first, first + chunk.cols())` of an LDOS map
+    using LdosSink = std::function<void (idx_t first, ArrayXXdCM const& chunk)>;
+    /// Same as `ldos()` but the result is passed to the `sink` in order, one reconstructed
+    /// chunk at a time, so that it can be stored (e.g. in a `CompactMap`) without ever
+    /// holding the whole map in double precision
+    void ldos(std::vector<idx_t> const& idx, ArrayXd const& energy, double broadening,
+              LdosSink const& sink);
+    /// The undamped moments of `ldos()`: one column per index, to be reconstructed later.
+    /// With a `checkpoint`, the final recursion state is saved to continue with more moments
+    /// later, see `extend_moments()`. The optimal size optimization is disabled in that case.
+    ExpansionMoments ldos_moments(std::vector<idx_t> const& idx, double broadening,
+                                  Checkpoint* checkpoint = nullptr);
+    /// Stochastic LDOS at the given Hamiltonian indices from `num_random` random vectors, see
+    /// `LocalMoments`: the cost doesn't depend on the number of indices, e.g. a full-system map
+    ArrayXXdCM stochastic_ldos(std::vector<idx_t> const& idx, ArrayXd const& energy,
+                               double broadening, idx_t num_random);
+    /// DOS projected onto each set of Hamiltonian indices, e.g. the orbitals of a sublattice:
+    /// column `j` is the sum of the stochastic LDOS over `projections[j]`. All the projections
+    /// share the same `num_random` recursions and only the local moments are split by
+    /// projection, so the cost doesn't depend on their number. Projections which partition
+    /// the system add up to `dos()` of the same vectors.
+    ArrayXXdCM projected_dos(std::vector<std::vector<idx_t>> const& projections,
+                             ArrayXd const& energy, double broadening, idx_t num_random);
+    /// Spectral function `A(k, E) = <k|delta(E - H)|k>` of the normalized plane waves on the
+    /// `positions` (one per Hamiltonian index): column `j` is for `k_points[j]`. All the plane
+    /// waves are made in place and computed in SIMD batches by concurrent jobs.
+    ArrayXXdCM spectral_function(CartesianArray const& positions,
+                                 std::vector<Cartesian> const& k_points, ArrayXd const& energy,
+                                 double broadening);
+    /// LDOS of the current Hamiltonian followed by each of the `others` at the given indices:
+    /// result `k` is like `ldos()` for Hamiltonian `k`. The others must have the same sparsity
+    /// pattern and scalar type (e.g. disorder realizations, field strengths or k-points). They
+    /// share the scaling factors which cover all of their spectra and they are computed together
+    /// in the SIMD lanes of a single recursion, see `MultiEllMatrix`. The configured matrix
+    /// format, auto-tuning, mixed precision and moment cache don't apply.
+    std::vector<ArrayXXdCM> multi_ldos(std::vector<Hamiltonian> const& others,
+                                       std::vector<idx_t> const& idx, ArrayXd const& energy,
+                                       double broadening);
+    /// LDOS at the given Hamiltonian indices from probing vectors: the indices are colored so
+    /// that any two within `distance` hoppings of each other (in the Hamiltonian's sparsity
+    /// pattern) get different colors and each color is a single starter, the sum of its unit
+    /// vectors. The moments up to `distance` are exact and the error of the higher ones comes
+    /// from the Green's function between sites of the same color, so it decays with the
+    /// `distance` for local Hamiltonians. The cost is one recursion per color, e.g. a few dozen
+    /// for the whole diagonal of a large lattice instead of one per index with `ldos()`.
+    ArrayXXdCM probing_ldos(std::vector<idx_t> const& idx, ArrayXd const& energy,
+                            double broadening, idx_t distance = 4);
+    /// Diagonal elements `<i|f(H)|i>` at the given Hamiltonian indices of the operator function
+    /// given by its Chebyshev `coefficients`, see `ChebyshevSeries`. There's one unit starter
+    /// per index or, with `num_random > 0`, the stochastic `LocalMoments` of all the indices.
+    ArrayXd density_matrix_diagonal(std::vector<idx_t> const& idx, ArrayXd const& coefficients,
+                                    idx_t num_random = 0);
+    /// Local charge `<i|f(H)|i>` for the Fermi-Dirac distribution `f` at the given chemical
+    /// potential and temperature, see `fermi_coefficients()`. The `broadening` sets the number
+    /// of moments like for `ldos()`: it's the energy resolution of the Fermi step.
+    ArrayXd local_charge(std::vector<idx_t> const& idx, double chemical_potential,
+                         double temperature, double broadening, idx_t num_random = 0);
+    /// DOS for the given energy range and broadening. With `target_error > 0`, the random
+    /// vectors stop once the estimated relative error is below the target: `num_random`
+    /// is the upper bound. The achieved error and vector count are recorded in the stats.
+    ArrayXd dos(ArrayXd const& energy, double broadening, idx_t num_random,
+                double target_error = 0);
+    /// The undamped moments of `dos()`: the mean of the random vectors in a single column.
+    /// A `checkpoint` is the same as for `ldos_moments()` and it requires `target_error == 0`.
+    ExpansionMoments dos_moments(double broadening, idx_t num_random, double target_error = 0,
+                                 Checkpoint* checkpoint = nullptr);
+    /// Continue the calculation which produced both the `moments` and the `checkpoint` up to
+    /// `num_moments` (rounded up like `round_num_moments()`): only the new moments are computed.
+    /// The `checkpoint` is updated so the result can be extended again.
+    ExpansionMoments extend_moments(ExpansionMoments const& moments, Checkpoint& checkpoint,
+                                    idx_t num_moments);
+    /// Compare the stochastic DOS moments of the configured matrix format with a full precision
+    /// `ELL` reference on the same `num_random` vectors, e.g. to check that the accuracy of the
+    /// lossy `ELL_BF16` or `ELL_INT8` is enough for the required `broadening`. A small sample
+    /// is enough: the error comes from the matrix, not from the random vectors.
+    QuantizationError quantization_error(double broadening, idx_t num_random = 1);
 
     /// Green's function matrix element (row, col) for the given energy range
     ArrayXcd greens(idx_t row, idx_t col, ArrayXd const& energy, double broadening);
-    /// Multiple Green's matrix elements for a single `row` and multiple `cols`
+    /// Multiple Green's matrix elements for a single `row` and multiple `cols`. A diagonal
+    /// element alone uses the Lanczos recursion if `AlgorithmConfig::lanczos_greens` is set.
     std::vector<ArrayXcd> greens_vector(idx_t row, std::vector<idx_t> const& cols,
                                         ArrayXd const& energy, double broadening);
+    /// The undamped moments of `greens_vector()`: one column per `col`. The Lanczos recursion
+    /// doesn't produce any moments so `AlgorithmConfig::lanczos_greens` doesn't apply here.
+    ExpansionMoments greens_moments(idx_t row, std::vector<idx_t> const& cols,
+                                    double broadening);
+
+    /// Green's matrix block for all the combinations of `rows` and `cols`, flattened in
+    /// row-major order (`i_row * cols.size() + i_col`). The Hamiltonian is optimized once
+    /// for all the indices and the rows are computed in parallel SIMD batches.
+    std::vector<ArrayXcd> greens_block(std::vector<idx_t> const& rows,
+                                       std::vector<idx_t> const& cols,
+                                       ArrayXd const& energy, double broadening);
 
     /// Kubo-Bastin conductivity in the directions defined by the `left` and `right` coordinates
     ArrayXcd conductivity(ArrayXf const& left_coords, ArrayXf const& right_coords,
                           ArrayXd const& chemical_potential, double broadening,
                           double temperature, idx_t num_random, idx_t num_points);
+    /// Conductivity tensor components from a single set of random vectors and Chebyshev
+    /// recursions: result `i` is for the `directions[i]` pair of indices into `coords`,
+    /// i.e. `coords[first]` on the left and `coords[second]` on the right
+    std::vector<ArrayXcd> conductivity(std::vector<ArrayXf> const& coords,
+                                       std::vector<std::pair<idx_t, idx_t>> const& directions,
+                                       ArrayXd const& chemical_potential, double broadening,
+                                       double temperature, idx_t num_random, idx_t num_points);
+
+    /// Kubo-Greenwood DC conductivity at each of the `chemical_potential` values (at zero
+    /// temperature) in the direction of the `coords`, in the same units as `conductivity()`.
+    /// Each random vector and its velocity product are projected onto the energies with
+    /// `delta(E - H)`, so the memory is linear in the system size and the number of energies
+    /// per pass (`Config::conductivity_block_size`), not in the number of moments.
+    ArrayXd kubo_greenwood(ArrayXf const& coords, ArrayXd const& chemical_potential,
+                           double broadening, idx_t num_random);
+
+    /// Time evolution `exp(-i * H * t) * psi0` for each of the `times` (with hbar = 1, i.e.
+    /// in units of hbar / energy). The columns of `psi0` are independent initial states.
+    std::vector<MatrixXcd> propagate(MatrixXcd const& psi0, ArrayXd const& times);
 
 private:
-    void timed_compute(MomentsRef, Starter const&, AlgorithmConfig const&);
+    /// An optimized Hamiltonian and the number of calculations which are reading it
+    struct Context {
+        /// A velocity operator of the conductivity and the coordinates which define it
+        struct Velocity {
+            ArrayXf coords;
+            VariantCSR op; ///< reordered like `oh`
+        };
+
+        OptimizedHamiltonian oh;
+        idx_t num_users = 0;
+        bool is_ready = true; ///< false while the only user is optimizing `oh` for its indices
+        /// Reused by consecutive conductivity calls until `oh` or the Hamiltonian changes
+        std::vector<Velocity> velocities;
+
+        explicit Context(OptimizedHamiltonian oh) : oh(std::move(oh)) {}
+    };
+
+    /// The state which is shared by concurrent calculations, guarded by the `mutex`
+    struct Shared {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<Context>> contexts;
+        MomentCache moment_cache;
+        Stats last_stats; ///< the stats of the last completed `Session`
+
+        explicit Shared(idx_t moment_cache_size) : moment_cache(moment_cache_size) {}
+    };
+
+    /// A single calculation: a read-only optimized Hamiltonian and its own stats which
+    /// become the `last_stats` when the session ends
+    class Session {
+    public:
+        Session(Shared& shared, Context* context) : shared(&shared), context(context) {}
+        Session(Session&& other) noexcept;
+        ~Session();
+
+        OptimizedHamiltonian const& oh() const { return context->oh; }
+        /// The velocity operator of `h` for the `coords` in the order of `oh()`: it's only
+        /// computed the first time, see `Context::velocities`
+        VariantCSR velocity(Hamiltonian const& h, ArrayXf const& coords);
+
+        Stats stats;
+
+    private:
+        Shared* shared;
+        Context* context; ///< may be null if the calculation doesn't use an optimized matrix
+        PeakMemoryMeter meter; ///< `Stats::peak_memory` of the whole session
+    };
+
+    /// Start a calculation with a Hamiltonian optimized for `idx`: an idle one is reused or,
+    /// if all of them are in use for other indices, a new one is made
+    Session begin(Indices const& idx, Scale<> scale);
+    /// Optimized Hamiltonian in the configured format -- or the auto-tuned one if enabled
+    OptimizedHamiltonian make_optimized(Hamiltonian const& h);
+    /// Same format as the first one without tuning again, for another concurrent `Context`
+    OptimizedHamiltonian new_optimized() const;
+    /// Number of rows of the in-memory or the out-of-core Hamiltonian
+    idx_t hamiltonian_size() const;
+
+    /// Compute the undamped moments of `ldos()` -- the returned session is still open
+    /// so that the reconstruction is recorded in its stats
+    Session compute_ldos(BatchDiagonalMoments& moments, std::vector<idx_t> const& idx,
+                         Scale<> scale);
+    /// `ldos()` in chunks of `Config::ldos_chunk_size` indices which are passed to the `sink`
+    /// as soon as they are reconstructed: a single optimized Hamiltonian for all of them
+    void chunked_ldos(std::vector<idx_t> const& idx, ArrayXd const& energy, Scale<> scale,
+                      idx_t num_moments, LdosSink const& sink);
+    /// Same as `compute_ldos()` for `dos()` with the random vectors collected by `accumulator`
+    Session compute_dos(BatchDiagonalMoments& moments, StochasticAccumulator const& accumulator,
+                        Scale<> scale, double target_error);
+
+    void timed_compute(Session&, MomentsRef, Starter const&, AlgorithmConfig const&);
+    /// Start the `moments.checkpoint` or continue it if it's not empty
+    void checkpointed_compute(Session&, BatchDiagonalMoments& moments, Indices const& idx,
+                              Scale<> scale, Starter const&, AlgorithmConfig const&);
+    /// Diagonal Green's function element from the Lanczos continued fraction,
+    /// see `AlgorithmConfig::lanczos_greens`
+    ArrayXcd lanczos_greens(idx_t index, ArrayXd const& energy, double broadening);
+    /// Try the `moment_cache` before computing -- the returned moments are not yet damped
+    template<class M>
+    void cached_compute(Session&, M& moments, MomentCache::Key key, Starter const&,
+                        AlgorithmConfig const&);
 
 private:
-    Hamiltonian hamiltonian;
+    Hamiltonian hamiltonian; ///< empty for out-of-core calculations
+    MappedHamiltonian mapped_hamiltonian; ///< used instead if `is_out_of_core`
+    bool is_out_of_core = false;
     Compute compute;
     Config config;
-    Stats stats;
+    num::StencilPattern stencil;
+    idx_t block_size;
 
-    Bounds bounds;
-    OptimizedHamiltonian optimized_hamiltonian;
+    Bounds bounds; ///< computed by the first `scaling_factors()` call, read-only afterwards
+    std::unique_ptr<Shared> shared;
 };
 
 }} // namespace cpb::kpm
@@ -0,0 +1,41 @@
+#pragma once
+#include "kpm/Bounds.hpp"
+#include "kpm/Kernel.hpp"
+
+namespace cpb { namespace kpm {
+
+/**
+ The undamped KPM moments of a finished calculation together with their scaling factors
+
+ The moment recursion is the expensive part of a KPM calculation while the damping and the
+ reconstruction are cheap. Keeping these moments, the same calculation can be reconstructed
+ for any energy range and `Kernel`, or for a wider broadening by truncating the moments,
+ without iterating over the Hamiltonian again. Column `j` of `data` holds the moments
+ of result `j`, e.g. one column per index for the LDOS or per `col` for the Green's function.
+ */
+struct ExpansionMoments {
+    Scale<> scale;
+    ArrayXXcd data; ///< `num_moments` rows and one column per result
+
+    ExpansionMoments() = default;
+    ExpansionMoments(Scale<> scale, ArrayXXcd data) : scale(scale), data(std::move(data)) {}
+
+    idx_t num_moments() const { return data.rows(); }
+    idx_t num_results() const { return data.cols(); }
+
+    /// Only the first `num_moments`: the lower resolution of a wider broadening
+    ExpansionMoments truncated(idx_t num_moments) const;
+    /// Truncated to the number of moments which the `kernel` needs for the `broadening`
+    /// -- or all of them if `broadening == 0`. Throws if there are not enough moments.
+    ExpansionMoments truncated(Kernel const& kernel, double broadening) const;
+
+    /// Damped with the `kernel` and reconstructed as a spectral density (DOS or LDOS):
+    /// one column per result, see `SpectralDensity`
+    ArrayXXdCM spectral_density(ArrayXd const& energy, Kernel const& kernel,
+                                double broadening = 0) const;
+    /// Damped with the `kernel` and reconstructed as a Green's function: one array per result
+    std::vector<ArrayXcd> greens(ArrayXd const& energy, Kernel const& kernel,
+                                 double broadening = 0) const;
+};
+
+}} // namespace cpb::kpm
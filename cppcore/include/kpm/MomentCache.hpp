@@ -0,0 +1,105 @@
+#pragma once
+#include "kpm/Moments.hpp"
+
+#include <list>
+
+namespace cpb { namespace kpm {
+
+/**
+ Least-recently-used cache of undamped KPM moments
+
+ Entries are keyed by the target indices, the scaling factors and the starter. A lookup for
+ `num_moments` is served by any matching entry with at least that many moments: the first
+ moments of a longer expansion are identical to those of a shorter one, so they're truncated.
+ The kernel damping depends on the number of moments so it must be applied after a lookup.
+ */
+class MomentCache {
+public:
+    struct Key {
+        Indices idx;
+        Scale<> scale;
+        idx_t num_random; ///< number of random starter vectors, 0 for unit starters at `idx`
+
+        friend bool operator==(Key const& l, Key const& r) {
+            return l.idx == r.idx && l.scale.a == r.scale.a && l.scale.b == r.scale.b
+                   && l.num_random == r.num_random;
+        }
+    };
+
+    /// The `data` types of the supported moment collections
+    using Data = var::variant<var::complex<ArrayX>, BatchData,
+                              var::complex<MultiUnitMoments::Data>>;
+
+    explicit MomentCache(idx_t capacity = 0) : capacity(capacity) {}
+
+    bool enabled() const { return capacity > 0; }
+    idx_t size() const { return static_cast<idx_t>(entries.size()); }
+    void clear() { entries.clear(); }
+
+    /// Copy the first `num_moments` of a matching entry into `data`. Return false on a miss.
+    template<class D>
+    bool find(Key const& key, idx_t num_moments, D& data);
+
+    /// Store `data` which contains `num_moments` undamped moments
+    template<class D>
+    void insert(Key key, idx_t num_moments, D const& data);
+
+private:
+    struct Entry {
+        Key key;
+        idx_t num_moments;
+        Data data;
+    };
+
+    std::list<Entry> entries; ///< most recently used first
+    idx_t capacity;
+};
+
+namespace detail {
+    /// Keep only the first `num_moments`
+    struct Truncate {
+        idx_t num_moments;
+
+        template<class scalar_t>
+        void operator()(ArrayX<scalar_t>& a) const { a = a.head(num_moments).eval(); }
+
+        template<class scalar_t>
+        void operator()(ArrayXX<scalar_t>& a) const { a = a.topRows(num_moments).eval(); }
+
+        template<class scalar_t>
+        void operator()(std::vector<ArrayX<scalar_t>>& v) const {
+            for (auto& a : v) { operator()(a); }
+        }
+    };
+} // namespace detail
+
+template<class D>
+bool MomentCache::find(Key const& key, idx_t num_moments, D& data) {
+    auto const it = std::find_if(entries.begin(), entries.end(), [&](Entry const& e) {
+        return e.data.template is<D>() && e.num_moments >= num_moments && e.key == key;
+    });
+    if (it == entries.end()) { return false; }
+
+    entries.splice(entries.begin(), entries, it);
+    data = it->data.template get<D>();
+    if (it->num_moments != num_moments) {
+        var::apply_visitor(detail::Truncate{num_moments}, data);
+    }
+    return true;
+}
+
+template<class D>
+void MomentCache::insert(Key key, idx_t num_moments, D const& data) {
+    if (!enabled()) { return; }
+
+    // A longer expansion makes any shorter entry with the same key redundant
+    entries.remove_if([&](Entry const& e) {
+        return e.data.template is<D>() && e.num_moments <= num_moments && e.key == key;
+    });
+    entries.push_front({std::move(key), num_moments, data});
+    if (size() > capacity) {
+        entries.pop_back();
+    }
+}
+
+}} // namespace cpb::kpm
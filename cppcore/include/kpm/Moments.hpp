@@ -1,12 +1,45 @@
 #pragma once
 #include "kpm/OptimizedHamiltonian.hpp"
 
+#include <algorithm>
 #include <mutex>
 
 namespace cpb { namespace kpm {
 
 using BatchData = var::complex<ArrayX, ArrayXX>;
 
+/**
+ The state of the diagonal Chebyshev recursion at the end of a calculation
+
+ After `N` moments, the vectors `r0 = T(N/2 - 1)(H)|r>` and `r1 = T(N/2)(H)|r>` are all that's
+ needed to continue the same calculation to more moments, see `calc_moments::basic()`. Each of
+ the `states` is one starter vector or SIMD batch (one column per vector) at `index` within the
+ starter sequence. The vectors are in the order of the optimized Hamiltonian, identified by its
+ `map` (the `SliceMap` data): a checkpoint is only valid for the same target indices, scaling
+ factors and matrix precision. The optimal size optimization leaves the vectors incomplete
+ so it's disabled for these calculations.
+ */
+struct Checkpoint {
+    struct State {
+        idx_t index;
+        var::complex<MatrixX> r0;
+        var::complex<MatrixX> r1;
+        var::complex<ArrayX> m0; ///< the first two moments of each vector,
+        var::complex<ArrayX> m1; ///< as collected by `DiagonalCollector::initial()`
+    };
+
+    Indices idx; ///< the target indices or `Indices::full_system()` for random starters
+    Scale<> scale;
+    idx_t num_moments = 0; ///< the number of moments computed so far
+    idx_t num_vectors = 0; ///< the number of starter vectors which went into the moments
+    std::vector<storage_idx_t> map;
+    std::vector<State> states;
+
+    bool empty() const { return states.empty(); }
+    /// Bytes held by the saved vectors
+    std::size_t memory_usage() const;
+};
+
 /**
  Collects moments in the form of simple expectation values:
  `mu_n = <r|Tn(H)|r>` where `bra == ket == r`. It's only
@@ -15,6 +48,9 @@ using BatchData = var::complex<ArrayX, ArrayXX>;
 struct DiagonalMoments {
     idx_t num_moments;
     var::complex<ArrayX> data;
+    /// Optional: save the final recursion state or, if it's not empty, continue from it.
+    /// Only the moments after `checkpoint->num_moments` are computed by a continuation.
+    Checkpoint* checkpoint = nullptr;
 
     DiagonalMoments(idx_t num_moments) : num_moments(num_moments) {}
 };
@@ -24,21 +60,49 @@ struct DiagonalMoments {
  */
 struct BatchDiagonalMoments {
     using Collect = std::function<void (BatchData&, BatchData const&, idx_t, idx_t)>;
+    using Stop = std::function<bool ()>;
 
     idx_t num_moments;
     idx_t num_vectors;
     Collect collect;
+    /// Optional: once this returns true, the compute implementation may skip the vectors
+    /// which haven't been started yet, i.e. `num_vectors` is only an upper bound
+    Stop stop;
     BatchData data;
+    /// Optional, see `DiagonalMoments::checkpoint`: there's one state per vector (or batch)
+    Checkpoint* checkpoint = nullptr;
+    /// Moments of the vectors which converged early and weren't computed, see
+    /// `AlgorithmConfig::convergence_tolerance`
+    idx_t skipped_moments = 0;
     std::unique_ptr<std::mutex> mutex = std14::make_unique<std::mutex>();
 
-    BatchDiagonalMoments(idx_t num_moments, idx_t num_vectors, Collect collect)
-        : num_moments(num_moments), num_vectors(num_vectors), collect(std::move(collect)) {}
+    BatchDiagonalMoments(idx_t num_moments, idx_t num_vectors, Collect collect, Stop stop = {})
+        : num_moments(num_moments), num_vectors(num_vectors), collect(std::move(collect)),
+          stop(std::move(stop)) {}
 
     /// `idx` is the index of the `new_data` within `data`
     void add(BatchData const& new_data, idx_t idx) {
         std::unique_lock<std::mutex> lk(*mutex);
         collect(data, new_data, idx, num_vectors);
     }
+
+    /// `count` vectors stopped with only `num_computed` moments
+    void skip(idx_t count, idx_t num_computed) {
+        std::unique_lock<std::mutex> lk(*mutex);
+        skipped_moments += count * (num_moments - num_computed);
+    }
+
+    /// Keep the final recursion state of a vector (or batch) in the `checkpoint`
+    void save(Checkpoint::State state) {
+        std::unique_lock<std::mutex> lk(*mutex);
+        checkpoint->states.push_back(std::move(state));
+    }
+
+    /// Can the remaining vectors be skipped?
+    bool is_stopped() const {
+        std::unique_lock<std::mutex> lk(*mutex);
+        return stop && stop();
+    }
 };
 
 /**
@@ -58,6 +122,24 @@ struct GenericMoments {
         : num_moments(num_moments), alpha(alpha), beta(beta), op(op) {}
 };
 
+/**
+ Same as `GenericMoments` for multiple pairs of vectors: the columns of `alpha` and `beta`.
+ Column `j` of `data` holds the moments `mu_n = <beta_j|op Tn(H)|alpha_j>`.
+ */
+struct BatchGenericMoments {
+    idx_t num_moments;
+    MatrixXcd const& alpha;
+    MatrixXcd const& beta;
+    SparseMatrixXcd const& op;
+    var::complex<ArrayXX> data;
+
+    BatchGenericMoments(idx_t num_moments, MatrixXcd const& alpha, MatrixXcd const& beta,
+                        SparseMatrixXcd const& op)
+        : num_moments(num_moments), alpha(alpha), beta(beta), op(op) {}
+
+    idx_t num_vectors() const { return alpha.cols(); }
+};
+
 /**
   Collects the computed moments in the form `mu_n = <l|Tn(H)|r>`
   where `l` is a unit vector with `l[i] = 1` and `i` is some
@@ -66,7 +148,9 @@ struct GenericMoments {
   index is used to form an `l` vector and collect a moment.
 
   The resulting `data` is a vector of vectors where each outer
-  index corresponds to an index from `idx`.
+  index corresponds to an index from `idx`. With multiple source
+  indices `idx.src`, each one is a separate `r` vector and the
+  outer index is `i_src * idx.dest.size() + i_dest`.
  */
 struct MultiUnitMoments {
     template<class scalar_t> using Data = std::vector<ArrayX<scalar_t>>;
@@ -93,6 +177,36 @@ struct DenseMatrixMoments {
         : num_moments(num_moments), op(std::move(op)) {}
 };
 
+/**
+ Stochastic estimate of the local moments `mu_n(i) = <i|Tn(H)|i>` of many Hamiltonian indices
+ at once: for random-phase vectors `r`, the expectation value of `conj(r_i) * (Tn(H) r)_i`
+ is `mu_n(i)`. A few full-system recursions give the LDOS of every index instead of one
+ recursion per index. `idx` are the optimized (reordered) indices and column `k` of `data`
+ is the sum over all the vectors for `idx[k]`, until it's divided by `normalize()`.
+
+ With `columns`, the local moments of `idx[k]` are added into column `columns[k]` instead,
+ e.g. the projection of the DOS onto a sublattice. An index may appear more than once.
+ */
+struct LocalMoments {
+    idx_t num_moments;
+    idx_t num_vectors;
+    std::vector<storage_idx_t> idx;
+    std::vector<storage_idx_t> columns; ///< empty: one column per index
+    idx_t num_columns;
+    var::complex<ArrayXX> data;
+
+    LocalMoments(idx_t num_moments, idx_t num_vectors, std::vector<storage_idx_t> idx)
+        : num_moments(num_moments), num_vectors(num_vectors), idx(std::move(idx)),
+          num_columns(static_cast<idx_t>(this->idx.size())) {}
+    LocalMoments(idx_t num_moments, idx_t num_vectors, std::vector<storage_idx_t> idx,
+                 std::vector<storage_idx_t> columns, idx_t num_columns)
+        : num_moments(num_moments), num_vectors(num_vectors), idx(std::move(idx)),
+          columns(std::move(columns)), num_columns(num_columns) {}
+
+    /// Divide the sum by the number of vectors to get the mean
+    void normalize();
+};
+
 /**
  Adds up moments for the stochastic KPM procedure
  */
@@ -103,6 +217,37 @@ private:
     idx_t count = 0; ///< keeps track of how many moments have been summed up so far
 };
 
+/**
+ Same as `BatchAccumulator` but the result is the running mean of the vectors added so far
+ (instead of the sum which is divided at the end) so the calculation may stop at any point.
+ The variance of the moments is tracked as well (Welford's algorithm) which gives the
+ relative error of the mean: `sqrt(sum_n w_n^2 var_n / count) / sqrt(sum_n w_n^2 mu_n^2)`.
+ The `weights` should be the kernel damping coefficients: the error then estimates
+ the L2 error of the reconstructed function (in the Chebyshev basis).
+
+ Copies share the same state: keep one to query the error after the calculation.
+ */
+class StochasticAccumulator {
+public:
+    /// The error estimate isn't trusted with fewer vectors
+    static constexpr idx_t min_vectors = 4;
+
+    StochasticAccumulator(double target_error, ArrayXd weights);
+
+    void operator()(BatchData& result, BatchData const& new_data, idx_t idx, idx_t num_vectors);
+
+    /// Number of vectors which have been added
+    idx_t count() const;
+    /// Estimated relative error of the mean moments (infinite with fewer than 2 vectors)
+    double relative_error() const;
+    /// Has the `target_error` been reached with at least `min_vectors`?
+    bool is_converged() const;
+
+private:
+    struct State;
+    std::shared_ptr<State> state;
+};
+
 /**
  Concatenate successive moment arrays
  */
@@ -115,15 +260,104 @@ private:
 
 struct MomentMultiplication {
     var::complex<MatrixX> data;
+    std::unique_ptr<std::mutex> mutex = std14::make_unique<std::mutex>();
 
     MomentMultiplication(idx_t num_moments, var::scalar_tag tag);
 
     void matrix_mul_add(DenseMatrixMoments const& a, DenseMatrixMoments const& b);
+    /// Thread-safe reduction of a partial result (same shape and scalar type as `data`)
+    void add(var::complex<MatrixX> const& partial);
     void normalize(idx_t total);
 };
 
+/**
+ Stochastic product of `DenseMatrixMoments` over `num_vectors` random starters:
+ `mu_nm = sum_r (Tn(H) op_l|r>) * adjoint(op_r Tm(H)|r>)`. The left operator is
+ applied to the starter vector and the right one at collection time. The starters
+ are independent so the compute implementation is free to process them concurrently
+ and reduce the partial products into `results`.
+
+ Several `products` of (left, right) operator pairs may be computed at once from the
+ same random starters, e.g. all the components of the conductivity tensor. The Chebyshev
+ recursions are shared: one for each distinct left operator and one on the right.
+
+ The operators must already be in the order of the optimized Hamiltonian, like the starter
+ vectors, see `velocity()`. An empty operator is the identity.
+ */
+struct BatchDenseMatrixMoments {
+    /// Indices into `ops_l` and `ops_r`
+    struct Product {
+        idx_t left;
+        idx_t right;
+    };
+
+    idx_t num_moments;
+    idx_t num_vectors;
+    std::vector<VariantCSR> ops_l; ///< distinct left operators
+    std::vector<VariantCSR> ops_r; ///< distinct right operators
+    std::vector<Product> products;
+    std::vector<MomentMultiplication> results; ///< one for each of the `products`
+    idx_t block_size; ///< limit the moment matrices to blocks of this many rows (0: no limit)
+
+    BatchDenseMatrixMoments(idx_t num_moments, idx_t num_vectors, VariantCSR op_l,
+                            VariantCSR op_r, var::scalar_tag tag, idx_t block_size = 0)
+        : BatchDenseMatrixMoments(num_moments, num_vectors, {std::move(op_l)},
+                                  {std::move(op_r)}, {{0, 0}}, tag, block_size) {}
+
+    BatchDenseMatrixMoments(idx_t num_moments, idx_t num_vectors,
+                            std::vector<VariantCSR> ops_l, std::vector<VariantCSR> ops_r,
+                            std::vector<Product> products, var::scalar_tag tag,
+                            idx_t block_size = 0)
+        : num_moments(num_moments), num_vectors(num_vectors), ops_l(std::move(ops_l)),
+          ops_r(std::move(ops_r)), products(std::move(products)), block_size(block_size) {
+        for (auto i = size_t{0}; i < this->products.size(); ++i) {
+            results.emplace_back(num_moments, tag);
+        }
+    }
+
+    /// Number of row blocks which are needed to cover all the moments
+    idx_t num_blocks() const {
+        if (block_size <= 0 || block_size >= num_moments) { return 1; }
+        return (num_moments + block_size - 1) / block_size;
+    }
+};
+
+/**
+ Stochastic Kubo-Greenwood trace `Tr[op delta(E_k - H) op delta(E_k - H)]` with the memory of
+ a few vectors per random starter `r`, instead of all the Chebyshev vectors of the Kubo-Bastin
+ `BatchDenseMatrixMoments`. Given the `coefficients` `c_nk` of `delta(E_k - H)`, the energy
+ projected states `|a_k> = sum_n c_nk Tn(H)|r>` and `|b_k> = sum_n c_nk Tn(H) op|r>` are summed
+ while the two recursions run and `data[k]` is the sum of `<b_k|op|a_k>` over all the vectors.
+ At most `energies_per_pass` projected states are kept at once (0: all of them) and more
+ energies repeat the recursions. The `op` is in the order of the optimized Hamiltonian.
+ */
+struct KuboGreenwoodMoments {
+    idx_t num_moments;
+    idx_t num_vectors;
+    VariantCSR op;
+    ArrayXXd coefficients; ///< `num_moments` x `num_energies`
+    idx_t energies_per_pass;
+    ArrayXcd data;
+
+    KuboGreenwoodMoments(idx_t num_vectors, VariantCSR op, ArrayXXd coefficients,
+                         idx_t energies_per_pass = 0)
+        : num_moments(coefficients.rows()), num_vectors(num_vectors), op(std::move(op)),
+          coefficients(std::move(coefficients)), energies_per_pass(energies_per_pass),
+          data(ArrayXcd::Zero(this->coefficients.cols())) {}
+
+    idx_t num_energies() const { return coefficients.cols(); }
+    /// Number of passes (pairs of recursions) over the energies for each vector
+    idx_t num_passes() const {
+        auto const per_pass = energies_per_pass > 0 ? energies_per_pass : num_energies();
+        return std::max((num_energies() + per_pass - 1) / std::max(per_pass, idx_t{1}),
+                        idx_t{1});
+    }
+};
+
 using MomentsRef = var::variant<DiagonalMoments*, BatchDiagonalMoments*, GenericMoments*,
-                                MultiUnitMoments*, DenseMatrixMoments*>;
+                                BatchGenericMoments*, MultiUnitMoments*, DenseMatrixMoments*,
+                                BatchDenseMatrixMoments*, LocalMoments*,
+                                KuboGreenwoodMoments*>;
 
 template<class M>
 void apply_damping(M& moments, Kernel const& kernel) {
@@ -144,7 +378,27 @@ ArrayXcd extract_data(M const& moments, idx_t num_moments) {
     return moments.data.match(ExtractData{num_moments});
 }
 
+struct ExtractBatchData {
+    idx_t num_moments;
+
+    template<class scalar_t>
+    ArrayXXcd operator()(ArrayXX<scalar_t> const& data) const {
+        return data.template cast<std::complex<double>>().topRows(num_moments);
+    }
+};
+
+inline ArrayXXcd extract_data(BatchGenericMoments const& moments, idx_t num_moments) {
+    return moments.data.match(ExtractBatchData{num_moments});
+}
+
+inline ArrayXXcd extract_data(BatchDiagonalMoments const& moments, idx_t num_moments) {
+    return moments.data.match(ExtractBatchData{num_moments});
+}
+
 /// Return the velocity operator for the direction given by the `alpha` position vector
 VariantCSR velocity(Hamiltonian const& hamiltonian, ArrayXf const& alpha);
+/// Same as above but in the row and column order of the optimized Hamiltonian `oh`
+VariantCSR velocity(Hamiltonian const& hamiltonian, ArrayXf const& alpha,
+                    OptimizedHamiltonian const& oh);
 
 }} // namespace cpb::kpm
@@ -5,12 +5,24 @@
 #include "kpm/Config.hpp"
 
 #include "numeric/sparse.hpp"
+#include "numeric/bsrmatrix.hpp"
+#include "numeric/deltaellmatrix.hpp"
 #include "numeric/ellmatrix.hpp"
+#include "numeric/hermitianmatrix.hpp"
+#include "numeric/hybmatrix.hpp"
+#include "numeric/mappedcsrmatrix.hpp"
+#include "numeric/quantizedellmatrix.hpp"
+#include "numeric/sellmatrix.hpp"
+#include "numeric/splitellmatrix.hpp"
+#include "numeric/stencilmatrix.hpp"
+#include "numeric/tableellmatrix.hpp"
 
 #include "support/variant.hpp"
 #include "utils/Chrono.hpp"
 #include "detail/macros.hpp"
 
+#include <list>
+
 namespace cpb { namespace kpm {
 
 /**
@@ -37,6 +49,10 @@ struct Indices {
         : Indices(eigen_cast<ArrayX>(source).cast<storage_idx_t>(),
                   eigen_cast<ArrayX>(destination).cast<storage_idx_t>()) {}
 
+    /// Full-system calculations (e.g. DOS, conductivity) which don't target any specific index
+    static Indices full_system() { return {-1, -1}; }
+    bool is_full_system() const { return src.size() == 1 && src[0] < 0; }
+
     /// Indicates a single element on the main diagonal
     bool is_diagonal() const {
         return src.size() == dest.size() && (src == dest).all();
@@ -84,6 +100,23 @@ public:
         return data[index(n, num_moments)];
     }
 
+    /// Optimal system size for the vectors of iteration `n` of a recursion which starts at
+    /// both the source and the destination indices, i.e. the `product_identity` algorithm.
+    /// The full vectors are needed to reconstruct the moments so the size never shrinks.
+    idx_t reach_size(idx_t n) const {
+        return data[std::min(last_index(), std::max(src_offset, dest_offset) + n)];
+    }
+
+    /// Number of leading vector elements which are ever read or written by a size-optimized
+    /// diagonal recursion of `num_moments` from unit vectors of the sources: the rows of the
+    /// largest `index()` (or of the first step, `reach_size(1)`) and the columns they reach
+    /// in the next slice. The elements beyond this may hold anything.
+    idx_t support_size(idx_t num_moments) const {
+        auto const mid = (num_moments - 1 + dest_offset - src_offset) / 2;
+        auto const max = std::max(mid + src_offset, std::max(src_offset, dest_offset) + 1);
+        return data[std::min(last_index(), max + 1)];
+    }
+
     /// Would calculating this number of moments ever do a full matrix-vector multiplication?
     bool uses_full_system(idx_t num_moments) const {
         return static_cast<idx_t>(data.size()) < num_moments / 2;
@@ -95,6 +128,9 @@ public:
     idx_t get_dest_offset() const { return dest_offset; }
 };
 
+/// Hamiltonian read directly from a memory-mapped file, see `binary::map_hamiltonian()`
+using MappedHamiltonian = var::complex<num::MappedCsrMatrix>;
+
 /**
  Stores a scaled Hamiltonian `(H - b)/a` which limits it to (-1, 1) boundaries required for KPM.
  In addition, three optimisations are applied (last two are optional, see `MatrixConfig`):
@@ -106,22 +142,87 @@ public:
  2) Reorder the elements so that target indices are placed at the start of the matrix.
     This produces a `SliceMap` which may be used to reduce calculation time by skipping
     sparse matrix-vector multiplication of zero values or by interleaving calculations
-    of neighboring slices.
+    of neighboring slices. Full-system calculations (`Indices::full_system()`) have no
+    target: they use a Cuthill-McKee ordering which starts at a pseudo-peripheral site.
+    This minimizes the bandwidth of the matrix so the gathered vector elements of nearby
+    rows are also close in memory (and it still gives slices for interleaving).
 
  3) Convert the sparse matrix into the ELLPACK format. The sparse matrix-vector
     multiplication algorithm for this format is much easier to vectorize compared
-    to the classic CSR format.
+    to the classic CSR format. The SELL-C-sigma format works the same way but pads
+    only small chunks of rows (sorted by length within slices) to a common length.
+    The `HermitianMatrix` format instead keeps only the upper triangle and reads
+    each off-diagonal element once for both halves. The `TableEllMatrix` replaces
+    the values with 8-bit IDs of a small value table if there are only a few distinct
+    values (a pristine lattice), otherwise it falls back to ELLPACK. The `DeltaEllMatrix`
+    stores 16-bit column offsets from the diagonal which are small after reordering.
+    The `SplitEllMatrix` keeps the real and imaginary parts of complex values in separate
+    planes so the vectorized complex products need no shuffles. The `QuantizedEllMatrix`
+    trades accuracy for bandwidth: real values are stored as 16-bit bfloat16 or 8-bit codes.
+    If ELLPACK would need more than twice as many elements as there are non-zeros, e.g.
+    because a few hub sites have many more hoppings than the rest, the `HybMatrix` is
+    used instead: it's only as wide as most rows and the longer rows overflow into CSR.
+
+ Pristine lattices may instead use a matrix-free `StencilMatrix` given the `StencilPattern`
+ of the unit cell. It's never reordered (the slices are not needed) and it only falls back
+ to a reordered ELLPACK matrix if the Hamiltonian doesn't match the translation invariant
+ pattern, e.g. due to modifiers or generators.
+
+ Multi-orbital models may use the block-sparse `BsrMatrix` with `block_size` equal to the
+ number of orbitals per site: the reordering then moves whole blocks of `block_size` rows
+ so that the orbitals of a site stay together. If the Hamiltonian can't be split into such
+ blocks, ELLPACK is used instead.
+
+ A Hamiltonian which doesn't fit into memory may be read from a binary file with a
+ `MappedHamiltonian` instead (see `binary::map_hamiltonian()`). Nothing is copied: the
+ `MappedCsrMatrix` streams the file for each matrix-vector product and applies the scaling
+ on the fly, so it's neither reordered nor converted to any other format.
+
+ The reordering and format conversion use `num_threads` for large matrices. Up to `cache_size`
+ previous optimizations are kept (least recently used are dropped first) so that returning
+ to previously targeted indices doesn't need to redo the work.
  */
 class OptimizedHamiltonian {
 public:
-    using VariantMatrix = var::complex<SparseMatrixX, num::EllMatrix>;
-
-    OptimizedHamiltonian(Hamiltonian const& h, MatrixFormat const& mf, bool reorder)
-        : original_h(h), slice_map(h.rows()), matrix_format(mf), is_reordered(reorder) {}
+    using VariantMatrix = var::complex<SparseMatrixX, num::EllMatrix, num::SellMatrix,
+                                       num::StencilMatrix, num::BsrMatrix, num::HermitianMatrix,
+                                       num::TableEllMatrix, num::DeltaEllMatrix,
+                                       num::HybMatrix, num::MappedCsrMatrix,
+                                       num::SplitEllMatrix, num::QuantizedEllMatrix>;
+
+    OptimizedHamiltonian(Hamiltonian const& h, MatrixFormat const& mf, bool reorder,
+                         bool mixed_precision = false, num::StencilPattern stencil = {},
+                         idx_t num_threads = 1, idx_t cache_size = 0, idx_t block_size = 1)
+        : original_h(h), slice_map(h.rows()), matrix_format(mf), is_reordered(reorder),
+          is_mixed_precision(mixed_precision), stencil_pattern(std::move(stencil)),
+          num_threads(num_threads), cache_size(cache_size), block_size(block_size) {}
+    /// Out-of-core Hamiltonian streamed from a file
+    OptimizedHamiltonian(MappedHamiltonian const& h, idx_t num_threads = 1);
 
     /// Create the optimized Hamiltonian targeting specific indices and scale factors
     void optimize_for(Indices const& idx, Scale<> scale);
 
+    /// Replace the original Hamiltonian with `h` if it has the same sparsity pattern, e.g.
+    /// a different disorder realization. The reordering and the structure of the optimized
+    /// matrix are kept: only the values are rewritten by the next `optimize_for()`.
+    /// Return false (and change nothing) if the pattern is different.
+    bool update_values(Hamiltonian const& h);
+
+    /// Is the matrix up to date and optimized for these target indices? Then `optimize_for(idx)`
+    /// has nothing to do and the optimized matrix is only read by the calculations.
+    bool is_optimized_for(Indices const& idx) const {
+        return original_idx == idx && !is_outdated;
+    }
+    /// Changes whenever `optimize_for()` rebuilds the matrix or rewrites its values. The numbers
+    /// are unique among all instances, so data derived from the matrix (e.g. the sparse handle
+    /// of `MklCompute`) can be cached until the revision changes.
+    idx_t revision() const { return matrix_revision; }
+
+    /// The position of index `i` of the original Hamiltonian in the reordered one
+    idx_t reordered_index(idx_t i) const {
+        return reorder_map.empty() ? i : reorder_map[static_cast<size_t>(i)];
+    }
+
     /// Apply new Hamiltonian index ordering to a container
     template<class Vector>
     void reorder(Vector& v) const {
@@ -135,6 +236,28 @@ public:
         v.swap(reordered_v);
     }
 
+    /// Apply new Hamiltonian index ordering to the rows of a dense matrix
+    template<class scalar_t>
+    void reorder_rows(MatrixX<scalar_t>& m) const {
+        if (reorder_map.empty()) { return; }
+        auto reordered_m = MatrixX<scalar_t>(m.rows(), m.cols());
+        for (auto i = idx_t{0}; i < m.rows(); ++i) {
+            reordered_m.row(reorder_map[i]) = m.row(i);
+        }
+        m.swap(reordered_m);
+    }
+
+    /// Restore the original Hamiltonian index ordering of the rows of a dense matrix
+    template<class scalar_t>
+    void restore_rows(MatrixX<scalar_t>& m) const {
+        if (reorder_map.empty()) { return; }
+        auto original_m = MatrixX<scalar_t>(m.rows(), m.cols());
+        for (auto i = idx_t{0}; i < m.rows(); ++i) {
+            original_m.row(i) = m.row(reorder_map[i]);
+        }
+        m.swap(original_m);
+    }
+
     template<class scalar_t>
     void reorder(SparseMatrixX<scalar_t>& matrix) const {
         if (reorder_map.empty()) { return; }
@@ -151,11 +274,21 @@ public:
         matrix.swap(reordered_matrix);
     }
 
-    idx_t size() const { return original_h.rows(); }
+    idx_t size() const;
+    /// Is the Hamiltonian streamed from a file instead of being kept in memory?
+    bool is_out_of_core() const { return is_mapped; }
+    /// The original Hamiltonian before scaling and reordering (empty if it's out-of-core)
+    Hamiltonian const& original() const { return original_h; }
     Indices const& idx() const { return optimized_idx; }
     SliceMap const& map() const { return slice_map; }
     VariantMatrix const& matrix() const { return optimized_matrix; }
     var::scalar_tag scalar_tag() const { return tag; }
+    /// Single precision matrix, but the moments should be accumulated in double precision
+    bool mixed_precision() const { return is_mixed_precision; }
+    /// Name of the format of the optimized matrix, e.g. "HYB" if it replaced `ELL`
+    char const* format_name() const;
+    /// Stored matrix elements (including any padding) per non-zero of the Hamiltonian
+    double padding() const;
 
 private:
     /// Just scale the Hamiltonian: H2 = (H - I*b) * (2/a)
@@ -164,6 +297,20 @@ private:
     /// Scale and reorder the Hamiltonian so that idx is at the start of the optimized matrix
     template<class scalar_t>
     void create_reordered(Indices const& idx, Scale<> scale);
+    /// Return the scaled Hamiltonian (used by `create_scaled()`)
+    template<class scalar_t>
+    SparseMatrixX<scalar_t> scaled_matrix(Scale<> scale) const;
+    /// Return the scaled Hamiltonian reordered according to the current `reorder_map`
+    template<class scalar_t>
+    SparseMatrixX<scalar_t> reordered_matrix(Scale<> scale) const;
+    /// Create a matrix-free operator for the scaled Hamiltonian, if it matches the stencil
+    template<class scalar_t>
+    bool create_stencil(Indices const& idx, Scale<> scale);
+    /// Keep the current optimization in the `cache` (if enabled) before making a new one.
+    /// Return true if the optimization for `idx` was found in the cache and restored.
+    bool swap_with_cache(Indices const& idx);
+    /// The number of rows in a block of the BSR format or 1 if it's not applicable
+    idx_t bsr_block_size() const;
     /// Get optimized indices which map to the given originals
     static Indices reorder_indices(Indices const& original_idx,
                                    std::vector<storage_idx_t> const& reorder_map);
@@ -176,9 +323,13 @@ private:
     size_t matrix_memory() const;
     /// Memory used by a single KPM vector
     size_t vector_memory() const;
+    /// Memory used by the original Hamiltonian (it's kept alongside the optimized matrix)
+    size_t original_memory() const { return is_mapped ? 0 : original_h.memory_usage(); }
 
 private:
     Hamiltonian original_h; ///< original unoptimized Hamiltonian
+    MappedHamiltonian mapped_h; ///< used instead of `original_h` if `is_mapped`
+    bool is_mapped = false;
     Indices original_idx; ///< original target indices for which the optimization was done
 
     VariantMatrix optimized_matrix; ///< reordered for faster compute
@@ -189,10 +340,31 @@ private:
 
     MatrixFormat matrix_format;
     bool is_reordered;
+    bool is_mixed_precision;
+    num::StencilPattern stencil_pattern; ///< empty if the matrix-free format is not applicable
+    idx_t num_threads;
+    bool is_outdated = false; ///< the values of `optimized_matrix` don't match `original_h`
+    idx_t matrix_revision = 0; ///< see `revision()`
     Chrono timer;
+    Chrono reorder_timer; ///< the scaling and reordering part of `timer`
+    Chrono convert_timer; ///< the matrix format conversion part of `timer`
+
+    /// Everything which depends on the target indices
+    struct Optimization {
+        Indices original_idx;
+        VariantMatrix optimized_matrix;
+        var::scalar_tag tag;
+        Indices optimized_idx;
+        SliceMap slice_map;
+        std::vector<storage_idx_t> reorder_map;
+    };
+    std::list<Optimization> cache; ///< most recently used first
+    idx_t cache_size;
+    idx_t block_size; ///< number of orbitals per site for `MatrixFormat::BSR`
 
     friend struct Stats;
     friend struct Optimize;
+    friend struct UpdateValues;
 };
 
 }} // namespace cpb::kpm
@@ -2,63 +2,167 @@
 #include "kpm/OptimizedHamiltonian.hpp"
 
 #include "numeric/dense.hpp"
+#include "numeric/multiellmatrix.hpp"
 #include "compute/detail.hpp"
 
 #include <mutex>
 
 namespace cpb { namespace kpm {
 
-/// Produce the r0 starter vector for the KPM procedure
+/// Pointer to `vector_size` elements of a starter vector
+template<class scalar_t> using StarterData = scalar_t*;
+
+/**
+ Produce the r0 starter vectors for the KPM procedure
+
+ `make` returns the vector with the given index in the starter sequence. If `is_concurrent`,
+ it may be called from multiple threads at the same time, e.g. for counter-based random
+ vectors. Otherwise, the vectors are made one at a time (in increasing order) under the lock.
+
+ The optional `fill` writes the same vector into existing memory instead of returning a new
+ one. It's only given by starters which can do this without allocating, so that a reused
+ buffer can be refilled by `make_r0()` at no cost. Otherwise, `make` is copied into it.
+
+ Unit vector starters also list their `unit_sources`: vector `i` is the unit vector of the
+ (reordered) index `unit_sources[i]`, or zero past the end. With this sparse support, the
+ size-optimized diagonal algorithms need only zero the part of the vectors which they touch,
+ see `make_unit_r0()` and `make_unit_r1()`.
+ */
 struct Starter {
-    using Make = std::function<var::complex<VectorX> (var::scalar_tag)>;
+    using Make = std::function<var::complex<VectorX> (var::scalar_tag, idx_t index)>;
+    using Fill = std::function<void (var::complex<StarterData> data, idx_t index)>;
 
     Make make;
     idx_t vector_size;
+    bool is_concurrent;
+    Fill fill;
+    ArrayXi unit_sources; ///< only for unit vector starters, see above
     mutable idx_t count = 0; ///< the number of vector this starter has produced
     std::unique_ptr<std::mutex> mutex = std14::make_unique<std::mutex>();
 
     void lock() const { mutex->lock(); }
     void unlock() const { mutex->unlock(); }
 
-    Starter(Make make, idx_t vector_size) : make(std::move(make)), vector_size(vector_size) {}
+    Starter(Make make, idx_t vector_size, bool is_concurrent = true, Fill fill = {})
+        : make(std::move(make)), vector_size(vector_size), is_concurrent(is_concurrent),
+          fill(std::move(fill)) {}
 };
 
 /// Starter vector equal to the constant `alpha` (`oh` is needed for reordering)
 Starter constant_starter(OptimizedHamiltonian const& oh, VectorXcd const& alpha);
 
+/// Starter vectors equal to the columns of `alpha`, followed by zero vectors
+Starter constant_starter(OptimizedHamiltonian const& oh, MatrixXcd const& alpha);
+
 /// Unit vector starter (`oh` encodes the unit index)
 Starter unit_starter(OptimizedHamiltonian const& oh);
 
-/// Starter vector for the stochastic KPM procedure (`oh` is needed for size and reordering)
-Starter random_starter(OptimizedHamiltonian const& oh, VariantCSR const& op = {});
+/// Unit vectors of only the sources `[first, first + count)` of `oh`, e.g. for a chunk of LDOS
+Starter unit_starter(OptimizedHamiltonian const& oh, idx_t first, idx_t count);
 
-/// Construct a concrete scalar type r0 vector based on a `Starter`
-template<class scalar_t>
-VectorX<scalar_t> make_r0(Starter const& starter, var::tag<VectorX<scalar_t>>, idx_t /*cols=1*/) {
-    ++starter.count;
-    return starter.make(var::tag<scalar_t>{}).template get<VectorX<scalar_t>>();
+/// Probing vectors: vector `k` is the sum of the unit vectors of the Hamiltonian indices
+/// `probes[k]`, followed by zero vectors (`oh` is needed for size and reordering)
+Starter probing_starter(OptimizedHamiltonian const& oh,
+                        std::vector<std::vector<idx_t>> const& probes);
+
+/// Plane waves `exp(i k.r) / sqrt(N)` on the `positions` (one per Hamiltonian index) for each
+/// of the `k_points`, followed by zero vectors. Real scalars can't hold the phase: they give
+/// two vectors per k-point, the cosine and the sine parts, see `plane_wave_vectors()`.
+Starter plane_wave_starter(OptimizedHamiltonian const& oh, CartesianArray const& positions,
+                           std::vector<Cartesian> const& k_points);
+/// Number of `plane_wave_starter()` vectors which are needed for `num_k_points`
+inline idx_t plane_wave_vectors(var::scalar_tag tag, idx_t num_k_points) {
+    return tag.match([](var::tag<float>) { return 2; }, [](var::tag<double>) { return 2; },
+                     [](var::tag<std::complex<float>>) { return 1; },
+                     [](var::tag<std::complex<double>>) { return 1; }) * num_k_points;
 }
 
-template<class scalar_t>
-MatrixX<scalar_t> make_r0(Starter const& starter, var::tag<MatrixX<scalar_t>>, idx_t cols) {
-    starter.count += cols;
-    auto r0 = MatrixX<scalar_t>(starter.vector_size, cols);
-    for (auto i = idx_t{0}; i < cols; ++i) {
-        r0.col(i) = starter.make(var::tag<scalar_t>{}).template get<VectorX<scalar_t>>();
+/// Starter vector for the stochastic KPM procedure (`oh` is needed for size and reordering).
+/// The `counter_based` random vectors are a function of only their index in the sequence.
+Starter random_starter(OptimizedHamiltonian const& oh, VariantCSR const& op = {},
+                       bool counter_based = false);
+
+namespace detail {
+    /// Write the starter vectors `first, first + 1, ...` into the columns of `r0`
+    template<class Vector>
+    void fill_vectors(Starter const& starter, Vector& r0, idx_t first) {
+        using scalar_t = typename Vector::Scalar;
+        for (auto i = idx_t{0}; i < r0.cols(); ++i) {
+            if (starter.fill) {
+                starter.fill(StarterData<scalar_t>{r0.col(i).data()}, first + i);
+            } else {
+                r0.col(i) = starter.make(var::tag<scalar_t>{}, first + i)
+                                   .template get<VectorX<scalar_t>>();
+            }
+        }
+    }
+} // namespace detail
+
+/// Fill the concrete scalar type r0 vector (or `cols` batch) with the next vectors of
+/// a `Starter`. The `index` of the first one within the starter sequence is returned.
+/// The memory of `r0` is reused if it already has the right size, so a buffer which is
+/// kept between calls is refilled without allocating (if the starter provides `fill`).
+/// This is thread safe: the lock is only held while making non-concurrent vectors.
+template<class Vector>
+void make_r0(Starter const& starter, Vector& r0, idx_t cols, idx_t& index) {
+    auto const num_vectors = (Vector::ColsAtCompileTime == 1) ? idx_t{1} : cols;
+    r0.resize(starter.vector_size, num_vectors);
+
+    auto lock = std::unique_lock<Starter const>(starter);
+    index = starter.count;
+    starter.count += num_vectors;
+    if (starter.is_concurrent) { lock.unlock(); }
+
+    detail::fill_vectors(starter, r0, index);
+}
+
+/// Same as `make_r0()` for a starter with `unit_sources`, but only the first `support` rows
+/// are zeroed, see `SliceMap::support_size()`: the rest of a reused buffer is left as is
+template<class Vector>
+void make_unit_r0(Starter const& starter, Vector& r0, idx_t cols, idx_t& index, idx_t support) {
+    auto const num_vectors = (Vector::ColsAtCompileTime == 1) ? idx_t{1} : cols;
+    r0.resize(starter.vector_size, num_vectors);
+
+    auto lock = std::unique_lock<Starter const>(starter);
+    index = starter.count;
+    starter.count += num_vectors;
+    if (starter.is_concurrent) { lock.unlock(); }
+
+    using scalar_t = typename Vector::Scalar;
+    r0.topRows(support).setZero();
+    for (auto i = idx_t{0}; i < num_vectors; ++i) {
+        if (index + i < starter.unit_sources.size()) {
+            r0(starter.unit_sources[index + i], i) = scalar_t{1};
+        }
     }
+}
+
+/// Construct a new r0 vector (or `cols` batch), see above
+template<class Vector>
+Vector make_r0(Starter const& starter, var::tag<Vector>, idx_t cols, idx_t& index) {
+    auto r0 = Vector();
+    make_r0(starter, r0, cols, index);
     return r0;
 }
 
-/// Return the vector following the starter: r1 = h2 * r0 * 0.5
+template<class Vector>
+Vector make_r0(Starter const& starter, var::tag<Vector> tag, idx_t cols) {
+    auto index = idx_t{0};
+    return make_r0(starter, tag, cols, index);
+}
+
+/// Write the vector following the starter into `r1`: r1 = h2 * r0 * 0.5
 /// -> multiply by 0.5 because h2 was pre-multiplied by 2
+/// The memory of `r1` (which must not alias `r0`) is reused if it has the right size.
 template<class scalar_t>
-VectorX<scalar_t> make_r1(SparseMatrixX<scalar_t> const& h2, VectorX<scalar_t> const& r0) {
+void make_r1(SparseMatrixX<scalar_t> const& h2, VectorX<scalar_t> const& r0,
+             VectorX<scalar_t>& r1) {
     auto const size = h2.rows();
     auto const data = h2.valuePtr();
     auto const indices = h2.innerIndexPtr();
     auto const indptr = h2.outerIndexPtr();
 
-    auto r1 = VectorX<scalar_t>(size);
+    r1.resize(size);
     for (auto row = 0; row < size; ++row) {
         auto tmp = scalar_t{0};
         for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
@@ -66,11 +170,11 @@ VectorX<scalar_t> make_r1(SparseMatrixX<scalar_t> const& h2, VectorX<scalar_t> c
         }
         r1[row] = tmp * scalar_t{0.5};
     }
-    return r1;
 }
 
 template<class scalar_t>
-MatrixX<scalar_t> make_r1(SparseMatrixX<scalar_t> const& h2, MatrixX<scalar_t> const& r0) {
+void make_r1(SparseMatrixX<scalar_t> const& h2, MatrixX<scalar_t> const& r0,
+             MatrixX<scalar_t>& r1) {
     auto const size = h2.rows();
     auto const data = h2.valuePtr();
     auto const indices = h2.innerIndexPtr();
@@ -78,7 +182,7 @@ MatrixX<scalar_t> make_r1(SparseMatrixX<scalar_t> const& h2, MatrixX<scalar_t> c
 
     using Row = Eigen::Matrix<scalar_t, 1, Eigen::Dynamic>;
     auto tmp = Row(r0.cols());
-    auto r1 = MatrixX<scalar_t>(r0.rows(), r0.cols());
+    r1.resize(r0.rows(), r0.cols());
 
     for (auto row = 0; row < size; ++row) {
         tmp.setZero();
@@ -87,13 +191,13 @@ MatrixX<scalar_t> make_r1(SparseMatrixX<scalar_t> const& h2, MatrixX<scalar_t> c
         }
         r1.row(row) = tmp * scalar_t{0.5};
     }
-    return r1;
 }
 
 template<class scalar_t>
-VectorX<scalar_t> make_r1(num::EllMatrix<scalar_t> const& h2, VectorX<scalar_t> const& r0) {
+void make_r1(num::EllMatrix<scalar_t> const& h2, VectorX<scalar_t> const& r0,
+             VectorX<scalar_t>& r1) {
     auto const size = h2.rows();
-    auto r1 = VectorX<scalar_t>::Zero(size).eval();
+    r1.setZero(size);
     for (auto n = 0; n < h2.nnz_per_row; ++n) {
         for (auto row = 0; row < size; ++row) {
             auto const a = h2.data(row, n);
@@ -101,19 +205,234 @@ VectorX<scalar_t> make_r1(num::EllMatrix<scalar_t> const& h2, VectorX<scalar_t>
             r1[row] += compute::detail::mul(a, b) * scalar_t{0.5};
         }
     }
-    return r1;
 }
 
 template<class scalar_t>
-MatrixX<scalar_t> make_r1(num::EllMatrix<scalar_t> const& h2, MatrixX<scalar_t> const& r0) {
+void make_r1(num::EllMatrix<scalar_t> const& h2, MatrixX<scalar_t> const& r0,
+             MatrixX<scalar_t>& r1) {
     auto const size = h2.rows();
-    auto r1 = MatrixX<scalar_t>::Zero(r0.rows(), r0.cols()).eval();
+    r1.setZero(r0.rows(), r0.cols());
     for (auto n = 0; n < h2.nnz_per_row; ++n) {
         for (auto row = 0; row < size; ++row) {
             auto const a = h2.data(row, n);
             r1.row(row) += a * r0.row(h2.indices(row, n)) * scalar_t{0.5};
         }
     }
+}
+
+template<class scalar_t>
+void make_r1(num::SellMatrix<scalar_t> const& h2, VectorX<scalar_t> const& r0,
+             VectorX<scalar_t>& r1) {
+    r1.setZero(h2.rows());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1[row] += compute::detail::mul(value, r0[col]) * scalar_t{0.5};
+    });
+}
+
+template<class scalar_t>
+void make_r1(num::SellMatrix<scalar_t> const& h2, MatrixX<scalar_t> const& r0,
+             MatrixX<scalar_t>& r1) {
+    r1.setZero(r0.rows(), r0.cols());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1.row(row) += value * r0.row(col) * scalar_t{0.5};
+    });
+}
+
+
+template<class scalar_t>
+void make_r1(num::StencilMatrix<scalar_t> const& h2, VectorX<scalar_t> const& r0,
+             VectorX<scalar_t>& r1) {
+    r1.setZero(h2.rows());
+    h2.for_each([&](idx_t row, idx_t col, scalar_t value) {
+        r1[row] += compute::detail::mul(value, r0[col]) * scalar_t{0.5};
+    });
+}
+
+template<class scalar_t>
+void make_r1(num::StencilMatrix<scalar_t> const& h2, MatrixX<scalar_t> const& r0,
+             MatrixX<scalar_t>& r1) {
+    r1.setZero(r0.rows(), r0.cols());
+    h2.for_each([&](idx_t row, idx_t col, scalar_t value) {
+        r1.row(row) += value * r0.row(col) * scalar_t{0.5};
+    });
+}
+
+template<class scalar_t>
+void make_r1(num::BsrMatrix<scalar_t> const& h2, VectorX<scalar_t> const& r0,
+             VectorX<scalar_t>& r1) {
+    r1.setZero(h2.rows());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1[row] += compute::detail::mul(value, r0[col]) * scalar_t{0.5};
+    });
+}
+
+template<class scalar_t>
+void make_r1(num::BsrMatrix<scalar_t> const& h2, MatrixX<scalar_t> const& r0,
+             MatrixX<scalar_t>& r1) {
+    r1.setZero(r0.rows(), r0.cols());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1.row(row) += value * r0.row(col) * scalar_t{0.5};
+    });
+}
+
+template<class scalar_t>
+void make_r1(num::HermitianMatrix<scalar_t> const& h2, VectorX<scalar_t> const& r0,
+             VectorX<scalar_t>& r1) {
+    r1.setZero(h2.rows());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1[row] += compute::detail::mul(value, r0[col]) * scalar_t{0.5};
+    });
+}
+
+template<class scalar_t>
+void make_r1(num::HermitianMatrix<scalar_t> const& h2, MatrixX<scalar_t> const& r0,
+             MatrixX<scalar_t>& r1) {
+    r1.setZero(r0.rows(), r0.cols());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1.row(row) += value * r0.row(col) * scalar_t{0.5};
+    });
+}
+
+template<class scalar_t>
+void make_r1(num::TableEllMatrix<scalar_t> const& h2, VectorX<scalar_t> const& r0,
+             VectorX<scalar_t>& r1) {
+    r1.setZero(h2.rows());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1[row] += compute::detail::mul(value, r0[col]) * scalar_t{0.5};
+    });
+}
+
+template<class scalar_t>
+void make_r1(num::TableEllMatrix<scalar_t> const& h2, MatrixX<scalar_t> const& r0,
+             MatrixX<scalar_t>& r1) {
+    r1.setZero(r0.rows(), r0.cols());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1.row(row) += value * r0.row(col) * scalar_t{0.5};
+    });
+}
+
+template<class scalar_t>
+void make_r1(num::DeltaEllMatrix<scalar_t> const& h2, VectorX<scalar_t> const& r0,
+             VectorX<scalar_t>& r1) {
+    r1.setZero(h2.rows());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1[row] += compute::detail::mul(value, r0[col]) * scalar_t{0.5};
+    });
+}
+
+template<class scalar_t>
+void make_r1(num::DeltaEllMatrix<scalar_t> const& h2, MatrixX<scalar_t> const& r0,
+             MatrixX<scalar_t>& r1) {
+    r1.setZero(r0.rows(), r0.cols());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1.row(row) += value * r0.row(col) * scalar_t{0.5};
+    });
+}
+
+template<class scalar_t>
+void make_r1(num::SplitEllMatrix<scalar_t> const& h2, VectorX<scalar_t> const& r0,
+             VectorX<scalar_t>& r1) {
+    r1.setZero(h2.rows());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1[row] += compute::detail::mul(value, r0[col]) * scalar_t{0.5};
+    });
+}
+
+template<class scalar_t>
+void make_r1(num::SplitEllMatrix<scalar_t> const& h2, MatrixX<scalar_t> const& r0,
+             MatrixX<scalar_t>& r1) {
+    r1.setZero(r0.rows(), r0.cols());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1.row(row) += value * r0.row(col) * scalar_t{0.5};
+    });
+}
+
+template<class scalar_t>
+void make_r1(num::QuantizedEllMatrix<scalar_t> const& h2, VectorX<scalar_t> const& r0,
+             VectorX<scalar_t>& r1) {
+    r1.setZero(h2.rows());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1[row] += compute::detail::mul(value, r0[col]) * scalar_t{0.5};
+    });
+}
+
+template<class scalar_t>
+void make_r1(num::QuantizedEllMatrix<scalar_t> const& h2, MatrixX<scalar_t> const& r0,
+             MatrixX<scalar_t>& r1) {
+    r1.setZero(r0.rows(), r0.cols());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1.row(row) += value * r0.row(col) * scalar_t{0.5};
+    });
+}
+
+/// Column `i` of the batch belongs to member `i` of the matrix: there's no single vector version
+template<class scalar_t>
+void make_r1(num::MultiEllMatrix<scalar_t> const& h2, MatrixX<scalar_t> const& r0,
+             MatrixX<scalar_t>& r1) {
+    r1.setZero(r0.rows(), r0.cols());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t const* values) {
+        for (auto lane = idx_t{0}; lane < r0.cols(); ++lane) {
+            r1(row, lane) += compute::detail::mul(values[lane], r0(col, lane)) * scalar_t{0.5};
+        }
+    });
+}
+
+template<class scalar_t>
+void make_r1(num::HybMatrix<scalar_t> const& h2, VectorX<scalar_t> const& r0,
+             VectorX<scalar_t>& r1) {
+    r1.setZero(h2.rows());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1[row] += compute::detail::mul(value, r0[col]) * scalar_t{0.5};
+    });
+}
+
+template<class scalar_t>
+void make_r1(num::HybMatrix<scalar_t> const& h2, MatrixX<scalar_t> const& r0,
+             MatrixX<scalar_t>& r1) {
+    r1.setZero(r0.rows(), r0.cols());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1.row(row) += value * r0.row(col) * scalar_t{0.5};
+    });
+}
+
+template<class scalar_t>
+void make_r1(num::MappedCsrMatrix<scalar_t> const& h2, VectorX<scalar_t> const& r0,
+             VectorX<scalar_t>& r1) {
+    r1.setZero(h2.rows());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1[row] += compute::detail::mul(value, r0[col]);
+    });
+    r1 = (h2.scale_a * r1 - h2.scale_b * r0) * scalar_t{0.5};
+}
+
+template<class scalar_t>
+void make_r1(num::MappedCsrMatrix<scalar_t> const& h2, MatrixX<scalar_t> const& r0,
+             MatrixX<scalar_t>& r1) {
+    r1.setZero(r0.rows(), r0.cols());
+    h2.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        r1.row(row) += value * r0.row(col);
+    });
+    r1 = (h2.scale_a * r1 - h2.scale_b * r0) * scalar_t{0.5};
+}
+
+/// The first step `r1 = h2 * r0 * 0.5` of the unit vectors of `make_unit_r0()`: their
+/// neighbors are all within the first `rows` (see `SliceMap::reach_size()`), so only those
+/// rows are multiplied by the KPM kernel `spmv`. The rest of the `support` is zeroed.
+template<class Matrix, class Vector, class SpMV>
+void make_unit_r1(Matrix const& h2, Vector const& r0, Vector& r1, idx_t rows, idx_t support,
+                  SpMV const& spmv) {
+    using scalar_t = typename Vector::Scalar;
+    r1.resize(r0.rows(), r0.cols());
+    r1.topRows(support).setZero();
+    spmv(0, rows, h2, r0, r1); // r1 = h2 * r0 - r1
+    r1.topRows(rows) *= scalar_t{0.5};
+}
+
+/// Return a new vector following the starter, see above
+template<class Matrix, class Vector>
+Vector make_r1(Matrix const& h2, Vector const& r0) {
+    auto r1 = Vector();
+    make_r1(h2, r0, r1);
     return r1;
 }
 
@@ -3,6 +3,9 @@
 #include "detail/config.hpp"
 #include "support/format.hpp"
 
+#include <string>
+#include <vector>
+
 namespace cpb { namespace kpm {
 
 inline std::string format_report(std::string msg, Chrono const& time, bool shortform) {
@@ -13,6 +16,43 @@ inline std::string format_report(std::string msg, Chrono const& time, bool short
 struct AlgorithmConfig;
 class OptimizedHamiltonian;
 
+/**
+ Breakdown of the time spent computing moments (in seconds, summed over all threads)
+
+ Recorded by the `Compute` implementation, see `Compute::Interface::profile()`.
+ */
+struct ComputeProfile {
+    double starter_time = 0; ///< making the r0 starter vectors
+    double spmv_time = 0; ///< matrix-vector products of the KPM iterations
+    double collect_time = 0; ///< collecting the moments from the KPM vectors
+    std::vector<double> thread_busy_time; ///< total working time of each worker thread
+};
+
+/**
+ Progress of the running moments calculations, see `Compute::Interface::progress()`
+
+ The units are the same as the `ProgressCallback` of the compute: vectors or jobs.
+ */
+struct ComputeProgress {
+    idx_t done = 0; ///< finished units since the calculation started
+    idx_t total = 0; ///< of all the calculations which are running concurrently
+    bool running = false; ///< `false` after the calculation is finished (but `done` remains)
+};
+
+/**
+ Error of the KPM moments of a lossy matrix format, see `Core::quantization_error()`
+
+ The moments `mu_n` are compared with the full precision reference `ref_n` and the
+ differences are relative to `ref_0`, the norm of the random vectors.
+ */
+struct QuantizationError {
+    std::string matrix_format; ///< the format which was compared, e.g. "ELL_INT8"
+    double max_error = 0; ///< max of |mu_n - ref_n| / |ref_0| over all the moments
+    double rms_error = 0; ///< root mean square of the same
+    idx_t num_moments = 0;
+    idx_t num_random = 0;
+};
+
 /**
  Stats of the KPM calculation
  */
@@ -25,15 +65,34 @@ struct Stats {
     size_t vec; ///< number of elements in a single KPM vector times the number of moments
     size_t opt_vec; ///< same as above, but with optimizations applied (if any)
     double multiplier = 1; ///< account for any repeated calculations
+    bool from_cache = false; ///< the moments were taken from the `MomentCache`
+    idx_t num_random = 0; ///< random vectors used by the last stochastic DOS calculation
+    double stochastic_error = 0; ///< estimated relative error of those DOS moments
+    /// LDOS moments which weren't computed because their vectors converged early, summed over
+    /// the vectors, see `AlgorithmConfig::convergence_tolerance`
+    idx_t skipped_moments = 0;
 
+    std::string matrix_format; ///< final format of the optimized matrix, e.g. "HYB" or "ELL"
+    double padding = 1; ///< stored matrix elements (including padding) per non-zero
     size_t matrix_memory; ///< memory used by the Hamiltonian matrix
     size_t vector_memory; ///< memory used by a single KPM vector
+    size_t hamiltonian_memory = 0; ///< the original matrix which is kept with the optimized one
+    size_t moments_memory = 0; ///< the moments collected by the calculation
+    size_t peak_memory = 0; ///< how much the calculation raised the peak memory of the process
 
-    Chrono hamiltonian_timer;
+    Chrono bounds_timer; ///< Lanczos procedure for the spectrum bounds (if not user-defined)
+    Chrono hamiltonian_timer; ///< total optimization time, i.e. reorder + format conversion
+    Chrono reorder_timer; ///< scaling and reordering of the Hamiltonian
+    Chrono convert_timer; ///< conversion of the optimized matrix to the final `MatrixFormat`
     Chrono moments_timer;
+    Chrono reconstruct_timer; ///< computing the final results from the damped moments
+    ComputeProfile profile; ///< breakdown of the `moments_timer`
 
     void reset(idx_t num_moments, OptimizedHamiltonian const& oh,
                AlgorithmConfig const& ac, idx_t multiplier = 1);
+    /// The Lanczos Green's function (see `AlgorithmConfig::lanczos_greens`) works on the
+    /// original CSR matrix: `num_moments` is the number of Lanczos steps
+    void reset_lanczos(idx_t num_steps, idx_t nnz, idx_t size, size_t scalar_size);
 
     /// Non-zero elements per second
     double eps() const;
@@ -41,6 +100,16 @@ struct Stats {
     /// Approximate number of executed mul + add operations per second
     double ops(bool is_diagonal, bool non_unit_vector) const;
 
+    /// Estimated memory traffic of one KPM iteration: the (size optimized) matrix is read once,
+    /// two vectors are read and one is written
+    double bytes_per_iteration() const;
+
+    /// Achieved memory bandwidth in bytes per second, see `bytes_per_iteration()`
+    double bandwidth() const;
+
+    /// Ratio of the mean and max busy time of the worker threads, 1 == perfect balance
+    double thread_balance() const;
+
     std::string report(bool shortform) const;
 };
 
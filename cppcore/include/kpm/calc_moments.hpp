@@ -1,6 +1,12 @@
 #pragma once
+#include "compute/kernel_polynomial.hpp"
+#include "detail/thread.hpp"
+
+#include <chrono>
+#include <vector>
 
 namespace cpb { namespace kpm { namespace calc_moments {
+CPB_ISA_NAMESPACE_BEGIN
 
 template<class...> struct void_type { using type = void; };
 template<class... Ts> using void_t = typename void_type<Ts...>::type;
@@ -17,10 +23,208 @@ using requires_diagonal = typename std::enable_if<is_diagonal<Collector>::value,
 template<class Collector>
 using requires_offdiagonal = typename std::enable_if<!is_diagonal<Collector>::value, int>::type;
 
+namespace detail {
+    /// The diagonal kernels compute `m2` and `m3` sums of the same scalar type as the vectors
+    template<class Vector> struct kernel_sums;
+    template<class scalar_t> struct kernel_sums<VectorX<scalar_t>> { using type = scalar_t; };
+    template<class scalar_t> struct kernel_sums<MatrixX<scalar_t>> {
+        using type = simd::array<scalar_t>;
+    };
+
+    template<class T, class U>
+    void accumulate(T& total, U const& part) { total += part; }
+
+    template<class T, class U, size_t N>
+    void accumulate(std::array<T, N>& total, std::array<U, N> const& part) {
+        for (auto i = size_t{0}; i < N; ++i) {
+            total[i] += part[i];
+        }
+    }
+
+    /// Number of rows summed at the vector precision before the partial sums
+    /// are added to higher precision moments (see `spmv_diagonal()`)
+    constexpr auto mixed_precision_rows = idx_t{4096};
+
+    template<class Matrix, class Vector, class Value>
+    void spmv_diagonal(idx_t start, idx_t end, Matrix const& h2, Vector const& x, Vector& y,
+                       Value& m2, Value& m3, std::true_type) {
+        compute::kpm_spmv_diagonal(start, end, h2, x, y, m2, m3);
+    }
+
+    template<class Matrix, class Vector, class Value>
+    void spmv_diagonal(idx_t start, idx_t end, Matrix const& h2, Vector const& x, Vector& y,
+                       Value& m2, Value& m3, std::false_type) {
+        using Sums = typename kernel_sums<Vector>::type;
+        for (auto block_start = start; block_start < end; block_start += mixed_precision_rows) {
+            auto const block_end = std::min(block_start + mixed_precision_rows, end);
+            auto partial_m2 = Sums{}, partial_m3 = Sums{};
+            compute::kpm_spmv_diagonal(block_start, block_end, h2, x, y, partial_m2, partial_m3);
+            accumulate(m2, partial_m2);
+            accumulate(m3, partial_m3);
+        }
+    }
+
+    /**
+     Diagonal kernel which also accepts `m2` and `m3` of higher precision than the vectors
+     (mixed precision). In that case, the kernel computes partial sums over blocks of rows
+     which are then accumulated at the higher precision.
+     */
+    template<class Matrix, class Vector, class Value>
+    void spmv_diagonal(idx_t start, idx_t end, Matrix const& h2, Vector const& x, Vector& y,
+                       Value& m2, Value& m3) {
+        using is_same_precision = std::is_same<Value, typename kernel_sums<Vector>::type>;
+        spmv_diagonal(start, end, h2, x, y, m2, m3, is_same_precision{});
+    }
+} // namespace detail
+
+/**
+ Execute the KPM kernels for a range of rows on the calling thread
+ */
+struct Serial {
+    template<class Matrix, class Vector>
+    void operator()(idx_t start, idx_t end, Matrix const& h2, Vector const& x, Vector& y) const {
+        compute::kpm_spmv(start, end, h2, x, y);
+    }
+
+    template<class Matrix, class Vector, class Value>
+    void operator()(idx_t start, idx_t end, Matrix const& h2, Vector const& x, Vector& y,
+                    Value& m2, Value& m3) const {
+        detail::spmv_diagonal(start, end, h2, x, y, m2, m3);
+    }
+};
+
+/**
+ Execute the KPM kernels for a range of rows split among the members of a `ThreadTeam`
+
+ Each thread gets one contiguous block of rows. The block size is a multiple of
+ `row_alignment` to keep the SIMD loops aligned and to avoid false sharing of the
+ result vector. Ranges with less than `min_rows` rows per thread are not worth
+ the synchronization overhead so they use fewer threads (or only the calling one).
+
+ The partial `m2` and `m3` sums of the diagonal kernel are reduced in thread order
+ which makes the result independent of thread scheduling. With `fixed_blocks`, the rows are
+ split into blocks of `min_rows` (rounded up to `row_alignment`) which the threads take in
+ turns, so the partial sums and the result are the same for any size of the team.
+ */
+class Parallel {
+public:
+    static constexpr idx_t row_alignment = 64;
+
+    explicit Parallel(ThreadTeam& team, idx_t min_rows = 4096, bool fixed_blocks = false)
+        : team(team), min_rows(min_rows), fixed_blocks(fixed_blocks) {}
+
+    template<class Matrix, class Vector>
+    void operator()(idx_t start, idx_t end, Matrix const& h2, Vector const& x, Vector& y) const {
+        auto const p = partition(start, end);
+        if (p.num_blocks <= 1) {
+            compute::kpm_spmv(start, end, h2, x, y);
+            return;
+        }
+
+        team.run([&](idx_t thread_id) {
+            for (auto i = thread_id; i < p.num_blocks; i += team.size()) {
+                compute::kpm_spmv(p.block_start(i), p.block_end(i), h2, x, y);
+            }
+        });
+    }
+
+    template<class Matrix, class Vector, class Value>
+    void operator()(idx_t start, idx_t end, Matrix const& h2, Vector const& x, Vector& y,
+                    Value& m2, Value& m3) const {
+        auto const p = partition(start, end);
+        if (p.num_blocks <= 1) {
+            detail::spmv_diagonal(start, end, h2, x, y, m2, m3);
+            return;
+        }
+
+        auto partial_m2 = std::vector<Value>(static_cast<size_t>(p.num_blocks), Value{});
+        auto partial_m3 = partial_m2;
+        team.run([&](idx_t thread_id) {
+            for (auto i = thread_id; i < p.num_blocks; i += team.size()) {
+                auto local_m2 = Value{}, local_m3 = Value{};
+                detail::spmv_diagonal(p.block_start(i), p.block_end(i),
+                                      h2, x, y, local_m2, local_m3);
+                partial_m2[i] = local_m2;
+                partial_m3[i] = local_m3;
+            }
+        });
+
+        for (auto i = idx_t{0}; i < p.num_blocks; ++i) {
+            detail::accumulate(m2, partial_m2[i]);
+            detail::accumulate(m3, partial_m3[i]);
+        }
+    }
+
+private:
+    struct Partition {
+        idx_t start;
+        idx_t end;
+        idx_t block_size;
+        idx_t num_blocks;
+
+        idx_t block_start(idx_t i) const { return std::min(start + i * block_size, end); }
+        idx_t block_end(idx_t i) const { return std::min(start + (i + 1) * block_size, end); }
+    };
+
+    Partition partition(idx_t start, idx_t end) const {
+        auto const size = end - start;
+        if (fixed_blocks) {
+            auto const block_size = (std::max(min_rows, idx_t{1}) + row_alignment - 1)
+                                    / row_alignment * row_alignment;
+            return {start, end, block_size, (size + block_size - 1) / block_size};
+        }
+
+        auto const max_blocks = std::max(size / std::max(min_rows, idx_t{1}), idx_t{1});
+        auto const num_threads = std::min(team.size(), max_blocks);
+
+        auto block_size = (size + num_threads - 1) / num_threads;
+        block_size = (block_size + row_alignment - 1) / row_alignment * row_alignment;
+        auto const num_blocks = block_size > 0 ? (size + block_size - 1) / block_size : 0;
+        return {start, end, block_size, num_blocks};
+    }
+
+private:
+    ThreadTeam& team;
+    idx_t min_rows;
+    bool fixed_blocks;
+};
+
+/**
+ Forward to another `SpMV` policy and accumulate the time spent in its kernels
+
+ The timing is done per call, i.e. once per KPM iteration: this is negligible
+ compared to the matrix-vector product itself.
+ */
+template<class SpMV>
+struct Timed {
+    using Clock = std::chrono::high_resolution_clock;
+
+    SpMV const& spmv;
+    Clock::duration& elapsed;
+
+    template<class... Args>
+    void operator()(Args&&... args) const {
+        auto const start = Clock::now();
+        spmv(std::forward<Args>(args)...);
+        elapsed += Clock::now() - start;
+    }
+};
+
+template<class SpMV>
+Timed<SpMV> timed(SpMV const& spmv, typename Timed<SpMV>::Clock::duration& elapsed) {
+    return {spmv, elapsed};
+}
+
 /************************************************************************\
  Diagonal KPM implementation: the left and right vectors are identical,
  i.e. `mu_n = <r|Tn(H)|r>` where `bra == ket == r`. It's 1.5x to 2x times
  faster than the general (off-diagonal) version.
+
+ All the implementations use `r0` and `r1` as their work space: the contents
+ are unspecified afterwards, but the memory can be reused for the next vector.
+ Without the size optimization, `r0` and `r1` end up as the last two vectors
+ of the recursion which may be continued by `basic()`, see `Checkpoint`.
+ The recursion stops early once the collector `is_converged()`, see `Convergence`.
 \************************************************************************/
 
 /**
@@ -31,22 +235,28 @@ using requires_offdiagonal = typename std::enable_if<!is_diagonal<Collector>::va
  are mapped by `SliceMap`. At each iteration, the computation is performed only
  for a subset of the total system which contains non-zero values. The speedup
  is about equal to the amount of removed work.
+
+ A recursion may be continued at iteration `first > 2` when `r0` and `r1` hold the
+ vectors of iterations `first - 2` and `first - 1`, i.e. the state after `2 * (first - 1)`
+ moments. Only the moments from `2 * (first - 1)` onward are collected.
  */
-template<class Collector, class Vector, class Matrix, requires_diagonal<Collector> = 1>
-void basic(Collector& collect, Vector r0, Vector r1, Matrix const& h2,
-           SliceMap const& map, bool opt_size) {
+template<class Collector, class Vector, class Matrix, class SpMV = Serial,
+         requires_diagonal<Collector> = 1>
+void basic(Collector& collect, Vector& r0, Vector& r1, Matrix const& h2,
+           SliceMap const& map, bool opt_size, SpMV const& spmv = {}, idx_t first = 2) {
     auto const num_moments = collect.size();
     assert(num_moments % 2 == 0);
 
     auto const zero = Collector::zero();
-    for (auto n = 2; n <= num_moments / 2; ++n) {
+    for (auto n = first; n <= num_moments / 2; ++n) {
         auto m2 = zero, m3 = zero;
         auto const size = opt_size ? map.optimal_size(n, num_moments) : h2.rows();
 
-        compute::kpm_spmv_diagonal(0, size, h2, r1, r0, m2, m3);
+        spmv(0, size, h2, r1, r0, m2, m3);
 
         collect(n, m2, m3);
         r1.swap(r0);
+        if (collect.is_converged()) { break; }
     }
 }
 
@@ -58,9 +268,10 @@ void basic(Collector& collect, Vector r0, Vector r1, Matrix const& h2,
  The two concurrent operations share some of the same data, thus promoting cache
  usage and reducing main memory bandwidth.
  */
-template<class Collector, class Vector, class Matrix, requires_diagonal<Collector> = 1>
-void interleaved(Collector& collect, Vector r0, Vector r1, Matrix const& h2,
-                 SliceMap const& map, bool opt_size) {
+template<class Collector, class Vector, class Matrix, class SpMV = Serial,
+         requires_diagonal<Collector> = 1>
+void interleaved(Collector& collect, Vector& r0, Vector& r1, Matrix const& h2,
+                 SliceMap const& map, bool opt_size, SpMV const& spmv = {}) {
     auto const num_moments = collect.size();
     assert((num_moments - 2) % 4 == 0);
 
@@ -76,8 +287,8 @@ void interleaved(Collector& collect, Vector r0, Vector r1, Matrix const& h2,
             auto const end0 = map[k];
             auto const end1 = (k == max1) ? map[max2] : start0;
 
-            compute::kpm_spmv_diagonal(start0, end0, h2, r1, r0, m2, m3);
-            compute::kpm_spmv_diagonal(start1, end1, h2, r0, r1, m4, m5);
+            spmv(start0, end0, h2, r1, r0, m2, m3);
+            spmv(start1, end1, h2, r0, r1, m4, m5);
 
             start1 = end1;
             start0 = end0;
@@ -85,6 +296,62 @@ void interleaved(Collector& collect, Vector r0, Vector r1, Matrix const& h2,
 
         collect(n, m2, m3);
         collect(n + 1, m4, m5);
+        if (collect.is_converged()) { break; }
+    }
+}
+
+/**
+ Matrix-powers implementation: advance `depth` consecutive moments per pass over the matrix
+
+ Requires a specially ordered matrix as input. Each pass is a wavefront over the slices of
+ the `SliceMap`: while moment `n` is computed on slice `k`, moment `n + j` is computed on
+ slice `k - j`. The slices are only coupled to their neighbors, so all the inputs of each
+ step are already final and the two vectors are still updated in place -- there are no halo
+ copies and no redundant work. When the `depth + 2` slices of the working set fit in cache,
+ the matrix and the vectors are read from main memory once per pass instead of once per
+ moment. The `interleaved` implementation is the special case `depth == 2`.
+ */
+template<class Collector, class Vector, class Matrix, class SpMV = Serial,
+         requires_diagonal<Collector> = 1>
+void matrix_powers(Collector& collect, Vector& r0, Vector& r1, Matrix const& h2,
+                   SliceMap const& map, bool opt_size, idx_t depth, SpMV const& spmv = {}) {
+    auto const num_moments = collect.size();
+    assert(num_moments % 2 == 0 && depth > 0);
+
+    auto const zero = Collector::zero();
+    auto m2 = std::vector<decltype(Collector::zero())>(static_cast<size_t>(depth), zero);
+    auto m3 = m2;
+    auto last = std::vector<idx_t>(static_cast<size_t>(depth)); // last slice of each step
+
+    for (auto n = idx_t{2}; n <= num_moments / 2; n += depth) {
+        auto const steps = std::min(depth, num_moments / 2 - n + 1);
+        auto end = idx_t{0};
+        for (auto j = idx_t{0}; j < steps; ++j) {
+            last[j] = opt_size ? map.index(n + j, num_moments) : map.last_index();
+            end = std::max(end, last[j] + j);
+            m2[j] = zero;
+            m3[j] = zero;
+        }
+
+        for (auto k = idx_t{0}; k <= end; ++k) {
+            for (auto j = idx_t{0}; j < steps; ++j) {
+                auto const s = k - j;
+                if (s < 0 || s > last[j]) { continue; }
+
+                auto const start = (s > 0) ? map[s - 1] : idx_t{0};
+                if (j % 2 == 0) {
+                    spmv(start, map[s], h2, r1, r0, m2[j], m3[j]);
+                } else {
+                    spmv(start, map[s], h2, r0, r1, m2[j], m3[j]);
+                }
+            }
+        }
+
+        for (auto j = idx_t{0}; j < steps; ++j) {
+            collect(n + j, m2[j], m3[j]);
+        }
+        if (steps % 2 != 0) { r1.swap(r0); }
+        if (collect.is_converged()) { break; }
     }
 }
 
@@ -99,14 +366,15 @@ void interleaved(Collector& collect, Vector r0, Vector r1, Matrix const& h2,
 
  See the diagonal version of this function for more information.
  */
-template<class Collector, class Vector, class Matrix, requires_offdiagonal<Collector> = 1>
-void basic(Collector& collect, Vector r0, Vector r1, Matrix const& h2,
-           SliceMap const& map, bool opt_size) {
+template<class Collector, class Vector, class Matrix, class SpMV = Serial,
+         requires_offdiagonal<Collector> = 1>
+void basic(Collector& collect, Vector& r0, Vector& r1, Matrix const& h2,
+           SliceMap const& map, bool opt_size, SpMV const& spmv = {}) {
     auto const num_moments = collect.size();
     for (auto n = idx_t{2}; n < num_moments; ++n) {
         auto const size = opt_size ? map.optimal_size(n, num_moments) : h2.rows();
 
-        compute::kpm_spmv(0, size, h2, r1, r0); // r0 = matrix * r1 - r0
+        spmv(0, size, h2, r1, r0); // r0 = matrix * r1 - r0
 
         r1.swap(r0);
         collect(n, r1);
@@ -118,9 +386,10 @@ void basic(Collector& collect, Vector r0, Vector r1, Matrix const& h2,
 
  See the diagonal version of this function for more information.
  */
-template<class C, class Vector, class Matrix, requires_offdiagonal<C> = 1>
-void interleaved(C& collect, Vector r0, Vector r1, Matrix const& h2,
-                 SliceMap const& map, bool opt_size) {
+template<class C, class Vector, class Matrix, class SpMV = Serial,
+         requires_offdiagonal<C> = 1>
+void interleaved(C& collect, Vector& r0, Vector& r1, Matrix const& h2,
+                 SliceMap const& map, bool opt_size, SpMV const& spmv = {}) {
     auto const num_moments = collect.size();
     assert(num_moments % 2 == 0);
 
@@ -133,8 +402,8 @@ void interleaved(C& collect, Vector r0, Vector r1, Matrix const& h2,
             auto const end0 = map[k];
             auto const end1 = (k == max1) ? map[max2] : start0;
 
-            compute::kpm_spmv(start0, end0, h2, r1, r0);
-            compute::kpm_spmv(start1, end1, h2, r0, r1);
+            spmv(start0, end0, h2, r1, r0);
+            spmv(start1, end1, h2, r0, r1);
 
             start1 = start0;
             start0 = end0;
@@ -145,4 +414,31 @@ void interleaved(C& collect, Vector r0, Vector r1, Matrix const& h2,
     }
 }
 
+/*****************************************************************************\
+ Off-diagonal KPM from the product identity `Tm(H) Tn(H) = (Tm+n(H) + T|m-n|(H)) / 2`:
+ the left vectors are propagated as additional columns of the batch next to the right
+ vector and the moments are reconstructed from their scalar products. Moments `2n - 1`
+ and `2n` follow from iteration `n`, i.e. half as many iterations as the `basic` version.
+\*****************************************************************************/
+
+/**
+ The `Vector` is a batch (`MatrixX`) with the right vector in column 0 and the left
+ vectors in the remaining columns (or padding). When `opt_size == true`, the size grows
+ with the reach of both the source and destination indices (see `SliceMap::reach_size()`).
+ */
+template<class Collector, class Vector, class Matrix, class SpMV = Serial>
+void product_identity(Collector& collect, Vector& r0, Vector& r1, Matrix const& h2,
+                      SliceMap const& map, bool opt_size, SpMV const& spmv = {}) {
+    auto const num_moments = collect.size();
+    for (auto n = idx_t{2}; 2 * n - 1 < num_moments; ++n) {
+        auto const size = opt_size ? map.reach_size(n) : h2.rows();
+
+        spmv(0, size, h2, r1, r0); // r0 = matrix * r1 - r0
+
+        r1.swap(r0);
+        collect(n, r0, r1, size);
+    }
+}
+
+CPB_ISA_NAMESPACE_END
 }}} // namespace cpb::kpm::calc_moments
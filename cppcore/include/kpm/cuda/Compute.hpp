@@ -0,0 +1,37 @@
+#pragma once
+#include "kpm/Core.hpp"
+#include "utils/ThreadBudget.hpp"
+
+namespace cpb { namespace kpm {
+
+/**
+ CUDA implementation for computing KPM moments, see `Core`
+
+ The moments are computed on the GPU using the ELLPACK Hamiltonian (`MatrixFormat::ELL`).
+ Only `DiagonalMoments` and `BatchDiagonalMoments` (LDOS, DOS and diagonal Green's function)
+ are supported, other calculations should use `DefaultCompute`. The reordering optimization
+ (`optimal_size`) is applied but the `interleaved` algorithm is a CPU cache optimization
+ which isn't used here.
+ */
+class CudaCompute : public Compute::Interface {
+public:
+    using ProgressCallback = std::function<void (idx_t delta, idx_t total)>;
+
+    /// The `num_threads` are only used by the CPU for the reconstruction of the results
+    CudaCompute(idx_t num_threads = -1, ProgressCallback progress_callback = {});
+
+    void moments(MomentsRef m, Starter const& s, AlgorithmConfig const& ac,
+                 OptimizedHamiltonian const& oh) const override;
+
+    idx_t get_num_threads() const override { return resolve_num_threads(num_threads); }
+
+    void progress_start(idx_t total) const;
+    void progress_update(idx_t delta, idx_t total) const;
+    void progress_finish(idx_t total) const;
+
+private:
+    idx_t num_threads;
+    ProgressCallback progress_callback;
+};
+
+}} // namespace cpb::kpm
@@ -1,29 +1,124 @@
 #pragma once
 #include "kpm/Core.hpp"
+#include "utils/Affinity.hpp"
+#include "utils/ThreadBudget.hpp"
+
+#include <chrono>
 
 namespace cpb { namespace kpm {
 
+namespace dispatch { struct Kernels; }
+
+/**
+ Alternative implementation of the CSR matrix-vector products of `DefaultCompute`
+
+ E.g. a vendor library, see `MklCompute`. A backend is made for one optimized Hamiltonian
+ and it only multiplies all of the rows at once: `y = h2 * x - y`. The products of fewer rows
+ (`optimal_size`), the resumed checkpoints and the other matrix formats use the built-in
+ kernels. The concrete type is a `SparseBackend<scalar_t>` for the scalar of the matrix.
+ */
+class SparseBackendBase {
+public:
+    virtual ~SparseBackendBase() = default;
+};
+
+template<class scalar_t>
+class SparseBackend : public SparseBackendBase {
+public:
+    /// A single vector
+    virtual void spmv(VectorX<scalar_t> const& x, VectorX<scalar_t>& y) const = 0;
+    /// A batch: one vector per column
+    virtual void spmv(MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y) const = 0;
+};
+
 /**
  Default CPU implementation for computing KPM moments, see `Core`
+
+ The SIMD kernels are selected when the object is created: with `PB_CPU_DISPATCH` they are built
+ for several instruction sets and the best one for the running CPU is used (see `dispatch.hpp`).
+ The work vectors and moment buffers are kept in per-thread pools (see `pool.hpp`), so after the
+ first job on a thread, the following starter vectors and batches are computed in place.
+
+ The workers only increment an atomic progress counter. While a calculation is running, a single
+ reporter thread samples the counter every `progress_interval` and passes the change to the
+ `ProgressCallback`, so a slow callback (e.g. a Python function which needs the GIL) never
+ holds up the workers. The counter may also be polled directly with `progress()`.
  */
 class DefaultCompute : public Compute::Interface {
 public:
+    /// Called with `delta = -1` at the start, the number of new finished units while running
+    /// and `delta = total` at the end of each calculation
     using ProgressCallback = std::function<void (idx_t delta, idx_t total)>;
+    /// How often the reporter thread calls the `ProgressCallback`
+    static constexpr std::chrono::milliseconds progress_interval{100};
+
+    /// Calls `progress_start()` and then `progress_finish()` at the end of the scope,
+    /// also if the calculation is interrupted by an exception
+    class ProgressScope {
+    public:
+        ProgressScope(DefaultCompute const& compute, idx_t total)
+            : compute(&compute), total(total) { compute.progress_start(total); }
+        ProgressScope(ProgressScope&& other) noexcept : compute(other.compute), total(other.total) {
+            other.compute = nullptr;
+        }
+        ~ProgressScope() { if (compute) { compute->progress_finish(total); } }
 
-    DefaultCompute(idx_t num_threads = -1, ProgressCallback progress_callback = {});
+    private:
+        DefaultCompute const* compute;
+        idx_t total;
+    };
+
+    /// With `num_threads <= 0`, each calculation uses the `thread_budget()` of the thread
+    /// which runs it, e.g. a share of the cores inside of a `parallel_for` job.
+    /// Worker thread `i` is restricted to the CPUs `affinity[i % affinity.size()]`.
+    /// With workers in more than one NUMA domain, each domain gets a local copy of the
+    /// optimized matrix for the multi-vector calculations (see `numa_affinity()`).
+    DefaultCompute(idx_t num_threads = -1, ProgressCallback progress_callback = {},
+                   std::vector<CpuList> affinity = {});
+
+    /// Spread the workers round-robin over all the NUMA domains of the machine
+    static std::vector<CpuList> numa_affinity() { return numa_domains(); }
 
     void moments(MomentsRef m, Starter const& s, AlgorithmConfig const& ac,
                  OptimizedHamiltonian const& oh) const override;
+    std::vector<BatchData> multi_moments(std::vector<VariantCSR> const& members,
+                                         SliceMap const& map, Indices const& idx,
+                                         idx_t num_moments,
+                                         AlgorithmConfig const& ac) const override;
 
-    idx_t get_num_threads() const { return num_threads; }
+    idx_t get_num_threads() const override { return resolve_num_threads(num_threads); }
+    std::vector<CpuList> const& get_affinity() const { return affinity; }
+    ComputeProfile profile() const override;
+    ComputeProgress progress() const override;
+    /// The instruction set of the selected kernels, e.g. "AVX2-256"
+    char const* instruction_set() const;
+    /// The backend for the CSR products of `oh`, if there is one (none by default)
+    virtual std::shared_ptr<SparseBackendBase const>
+    sparse_backend(OptimizedHamiltonian const& oh) const;
 
+    /// Start (or join) the reporter thread: there may be several concurrent calculations
     void progress_start(idx_t total) const;
+    /// Add finished units: lock-free, meant to be called by the workers
     void progress_update(idx_t delta, idx_t total) const;
+    /// Stop the reporter thread once all the calculations are finished
     void progress_finish(idx_t total) const;
+    ProgressScope progress_scope(idx_t total) const { return {*this, total}; }
+
+    /// Add the phase times (in seconds) of one vector or batch computed on the calling thread.
+    /// The job and its `num_moments` (summed over a batch) also go into the live `metrics`.
+    void profile_record(double starter_time, double spmv_time, double collect_time,
+                        idx_t num_moments = 0) const;
 
 private:
-    idx_t num_threads;
+    struct Profiler;
+    struct ProgressCounter;
+
+    idx_t num_threads; ///< as requested: resolved on each call of `get_num_threads()`
     ProgressCallback progress_callback;
+    std::vector<CpuList> affinity;
+    std::shared_ptr<Profiler> profiler;
+    std::shared_ptr<ProgressCounter> progress_counter; ///< shared by the copies
+    dispatch::Kernels const* kernels;
 };
 
 }} // namespace cpb::kpm
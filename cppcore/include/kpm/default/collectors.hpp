@@ -5,18 +5,52 @@
 #include "support/simd.hpp"
 
 namespace cpb { namespace kpm {
+CPB_ISA_NAMESPACE_BEGIN
 
-template<class scalar_t>
+/**
+ Early termination of a diagonal recursion, see `AlgorithmConfig::convergence_tolerance`
+
+ The recursion has converged once the moments of `window` consecutive iterations (pairs of
+ moments) are all below `tolerance` relative to `mu_0`. The remaining moments are zero.
+ */
+struct Convergence {
+    static constexpr idx_t window = 8;
+
+    double tolerance = 0; ///< 0: disabled
+    idx_t quiet = 0; ///< consecutive iterations below the tolerance so far
+    idx_t size = -1; ///< the number of computed moments, once converged
+
+    bool is_converged() const { return size >= 0; }
+
+    /// Record iteration `n` (moments `2n - 2` and `2n - 1`) given the largest magnitude of
+    /// its moments relative to `mu_0`. Returns true if the recursion has just converged.
+    bool update(idx_t n, double relative) {
+        if (tolerance <= 0 || is_converged()) { return false; }
+        quiet = (relative < tolerance) ? quiet + 1 : 0;
+        if (quiet < window) { return false; }
+        size = 2 * n;
+        return true;
+    }
+};
+
+/**
+ Collects the moments of the diagonal algorithm. The vectors are of type `scalar_t`,
+ but the moments may be accumulated at a higher precision `moment_t` (mixed precision).
+ */
+template<class scalar_t, class moment_t = scalar_t>
 class DiagonalCollector {
 public:
     using Vector = VectorX<scalar_t>;
     using VectorRef = Eigen::Ref<Vector>;
 
-    ArrayX<scalar_t> moments;
-    scalar_t m0;
-    scalar_t m1;
+    ArrayX<moment_t> moments;
+    moment_t m0;
+    moment_t m1;
+    Convergence convergence;
 
     DiagonalCollector(idx_t num_moments) : moments(num_moments) {}
+    /// Collect into an existing buffer -- its size is the number of moments
+    explicit DiagonalCollector(ArrayX<moment_t> buffer) : moments(std::move(buffer)) {}
 
     idx_t size() const { return moments.size(); }
 
@@ -24,29 +58,38 @@ public:
     void initial(VectorRef r0, VectorRef r1);
 
     /// Collect moments `n` and `n + 1` from the result vectors. Expects `n >= 2`.
-    void operator()(idx_t n, scalar_t m2, scalar_t m3);
+    void operator()(idx_t n, moment_t m2, moment_t m3);
+
+    /// Can the recursion stop early? See `Convergence`.
+    bool is_converged() const { return convergence.is_converged(); }
 
     /// Zero of the same scalar type as the moments
-    static constexpr scalar_t zero() { return scalar_t{0}; }
+    static constexpr moment_t zero() { return moment_t{0}; }
 };
 
-template<class scalar_t>
+template<class scalar_t, class moment_t = scalar_t>
 class BatchDiagonalCollector {
 public:
     using Vector = MatrixX<scalar_t>;
     using VectorRef = Eigen::Ref<Vector>;
+    /// One moment for each vector (column) in the batch
+    using Array = std::array<moment_t, simd::traits<scalar_t>::size>;
 
-    ArrayXX<scalar_t> moments;
-    simd::array<scalar_t> m0;
-    simd::array<scalar_t> m1;
+    ArrayXX<moment_t> moments;
+    Array m0;
+    Array m1;
+    Convergence convergence; ///< all the columns must converge
 
     BatchDiagonalCollector(idx_t num_moments, idx_t batch_size)
         : moments(num_moments, batch_size) {}
+    /// Collect into an existing `num_moments` x `batch_size` buffer
+    explicit BatchDiagonalCollector(ArrayXX<moment_t> buffer) : moments(std::move(buffer)) {}
 
     idx_t size() const { return moments.rows(); }
     void initial(VectorRef r0, VectorRef r1);
-    void operator()(idx_t n, simd::array<scalar_t> m2, simd::array<scalar_t> m3);
-    static constexpr simd::array<scalar_t> zero() { return {{0}}; }
+    void operator()(idx_t n, Array m2, Array m3);
+    bool is_converged() const { return convergence.is_converged(); }
+    static constexpr Array zero() { return {{0}}; }
 };
 
 
@@ -73,14 +116,20 @@ public:
     virtual void operator()(idx_t n, VectorRef r1) = 0;
 };
 
+/**
+ Moments `<beta|op|r_n>`
+
+ The operator is applied to `beta` only once, in double precision and in the original order
+ of the Hamiltonian: `beta = op^dagger * beta`. The result is converted to the Hamiltonian
+ scalar and reordered, so each moment is a single dot product like the moments without `op`.
+ */
 template<class scalar_t>
 class GenericCollector : public OffDiagonalCollector<scalar_t> {
     using VectorRef = typename OffDiagonalCollector<scalar_t>::VectorRef;
 
 public:
     ArrayX<scalar_t> moments;
-    VectorX<scalar_t> beta;
-    SparseMatrixX<scalar_t> op;
+    VectorX<scalar_t> beta; ///< with `op` already applied
 
     GenericCollector(idx_t num_moments, OptimizedHamiltonian const& oh, VectorXcd const& alpha_,
                      VectorXcd const& beta_, SparseMatrixXcd const& op_);
@@ -106,6 +155,133 @@ public:
     void operator()(idx_t n, VectorRef r1) override;
 };
 
+/**
+ Same as `OffDiagonalCollector` for a batch of independent starter vectors (the columns
+ of `Vector`) which are computed together using the SIMD kernels
+ */
+template<class scalar_t>
+class BatchOffDiagonalCollector {
+public:
+    using Vector = MatrixX<scalar_t>;
+    using VectorRef = Eigen::Ref<Vector>;
+
+    virtual ~BatchOffDiagonalCollector() = default;
+
+    virtual idx_t size() const = 0;
+    virtual void initial(VectorRef r0, VectorRef r1) = 0;
+    virtual void operator()(idx_t n, VectorRef r1) = 0;
+};
+
+/// The `beta` columns `[first, first + batch_size)` pair up with the starters in the batch.
+/// Like `GenericCollector`, the `op` is applied to them once in the constructor.
+template<class scalar_t>
+class BatchGenericCollector : public BatchOffDiagonalCollector<scalar_t> {
+    using VectorRef = typename BatchOffDiagonalCollector<scalar_t>::VectorRef;
+
+public:
+    ArrayXX<scalar_t> moments;
+    MatrixX<scalar_t> beta; ///< with `op` already applied
+
+    BatchGenericCollector(idx_t num_moments, OptimizedHamiltonian const& oh,
+                          MatrixXcd const& beta_, SparseMatrixXcd const& op_,
+                          idx_t first, idx_t batch_size);
+
+    idx_t size() const override { return moments.rows(); }
+    void initial(VectorRef r0, VectorRef r1) override;
+    void operator()(idx_t n, VectorRef r1) override;
+
+private:
+    template<class Vector>
+    void store(idx_t n, Vector const& v, num::get_real_t<scalar_t> factor);
+};
+
+/// Column `j` of `moments[i]` is collected from index `idx.dest[i]` of starter `j`
+template<class scalar_t>
+class BatchMultiUnitCollector : public BatchOffDiagonalCollector<scalar_t> {
+    using VectorRef = typename BatchOffDiagonalCollector<scalar_t>::VectorRef;
+
+public:
+    Indices const& idx;
+    std::vector<ArrayXX<scalar_t>> moments;
+
+    BatchMultiUnitCollector(idx_t num_moments, Indices const& idx, idx_t batch_size)
+        : idx(idx), moments(idx.dest.size(), ArrayXX<scalar_t>(num_moments, batch_size)) {}
+
+    idx_t size() const override { return moments[0].rows(); }
+    void initial(VectorRef r0, VectorRef r1) override;
+    void operator()(idx_t n, VectorRef r1) override;
+};
+
+/**
+ Adds the local moments `conj(r0_i) * (Tn(H) r0)_i` of a random starter `r0` at each of the
+ indices `idx` into `moments` (`num_moments` x `idx.size()`), see `LocalMoments`. The sum
+ is shared by successive starters, so the buffer is only allocated once. With `columns`,
+ index `k` is added into column `columns[k]` instead of `k`.
+ */
+template<class scalar_t>
+class LocalCollector : public OffDiagonalCollector<scalar_t> {
+    using VectorRef = typename OffDiagonalCollector<scalar_t>::VectorRef;
+
+public:
+    std::vector<storage_idx_t> const& idx;
+    std::vector<storage_idx_t> const& columns;
+    ArrayXX<scalar_t>& moments;
+    ArrayX<scalar_t> conj_r0; ///< the conjugate starter at `idx`
+
+    LocalCollector(std::vector<storage_idx_t> const& idx,
+                   std::vector<storage_idx_t> const& columns, ArrayXX<scalar_t>& moments)
+        : idx(idx), columns(columns), moments(moments) {}
+
+    idx_t size() const override { return moments.rows(); }
+    void initial(VectorRef r0, VectorRef r1) override;
+    void operator()(idx_t n, VectorRef r1) override;
+};
+
+/// Same as `LocalCollector` for a SIMD batch of starters: the first `num_used` columns are
+/// summed and the rest of the batch is padding
+template<class scalar_t>
+class BatchLocalCollector : public BatchOffDiagonalCollector<scalar_t> {
+    using VectorRef = typename BatchOffDiagonalCollector<scalar_t>::VectorRef;
+
+public:
+    std::vector<storage_idx_t> const& idx;
+    std::vector<storage_idx_t> const& columns;
+    ArrayXX<scalar_t>& moments;
+    idx_t num_used;
+    ArrayXX<scalar_t> conj_r0; ///< `idx.size()` x `num_used`
+
+    BatchLocalCollector(std::vector<storage_idx_t> const& idx,
+                        std::vector<storage_idx_t> const& columns, ArrayXX<scalar_t>& moments,
+                        idx_t num_used)
+        : idx(idx), columns(columns), moments(moments), num_used(num_used) {}
+
+    idx_t size() const override { return moments.rows(); }
+    void initial(VectorRef r0, VectorRef r1) override;
+    void operator()(idx_t n, VectorRef r1) override;
+};
+
+/**
+ Energy projected states `states[k] = sum_n coefficients(n, k) * Tn(H)|r0>` of a single
+ recursion, see `KuboGreenwoodMoments`. Only the `states` are kept, not the vectors.
+ */
+template<class scalar_t>
+class ProjectionCollector : public OffDiagonalCollector<scalar_t> {
+    using VectorRef = typename OffDiagonalCollector<scalar_t>::VectorRef;
+    using real_t = num::get_real_t<scalar_t>;
+
+public:
+    ArrayXX<real_t> coefficients; ///< `num_moments` x `states.size()`
+    std::vector<VectorX<scalar_t>> states;
+
+    ProjectionCollector(ArrayXXd const& coefficients, idx_t size)
+        : coefficients(coefficients.template cast<real_t>()),
+          states(static_cast<size_t>(coefficients.cols()), VectorX<scalar_t>(size)) {}
+
+    idx_t size() const override { return coefficients.rows(); }
+    void initial(VectorRef r0, VectorRef r1) override;
+    void operator()(idx_t n, VectorRef r1) override;
+};
+
 template<class scalar_t>
 class DenseMatrixCollector : public OffDiagonalCollector<scalar_t> {
     using VectorRef = typename OffDiagonalCollector<scalar_t>::VectorRef;
@@ -122,10 +298,115 @@ public:
     void operator()(idx_t n, VectorRef r1) override;
 };
 
+/**
+ Same as `DenseMatrixCollector` but only keeps `block_size` rows in memory. Each time
+ a block is filled (or the last moment is reached) the `process` callback is invoked
+ with the index of the first moment in the block and the number of valid rows.
+ */
+template<class scalar_t>
+class DenseMatrixBlockCollector : public OffDiagonalCollector<scalar_t> {
+    using VectorRef = typename OffDiagonalCollector<scalar_t>::VectorRef;
+
+public:
+    using Process = std::function<void (idx_t start, idx_t rows)>;
+
+    idx_t num_moments;
+    SparseMatrixX<scalar_t> op;
+    MatrixX<scalar_t> block;
+    Process process;
+
+    DenseMatrixBlockCollector(idx_t num_moments, idx_t block_size,
+                              OptimizedHamiltonian const& oh, VariantCSR const& op_);
+
+    idx_t size() const override { return num_moments; }
+    void initial(VectorRef r0, VectorRef r1) override;
+    void operator()(idx_t n, VectorRef r1) override;
+
+private:
+    template<class Vector>
+    void store(idx_t n, Vector const& v);
+};
+
+/**
+ Same as `DenseMatrixBlockCollector` (without an operator) for a SIMD batch of starters:
+ `blocks[j]` holds the vectors of column `j`. Only the first `num_used` columns are
+ stored, the rest of the batch is padding.
+ */
+template<class scalar_t>
+class BatchDenseMatrixBlockCollector : public BatchOffDiagonalCollector<scalar_t> {
+    using VectorRef = typename BatchOffDiagonalCollector<scalar_t>::VectorRef;
+
+public:
+    using Process = std::function<void (idx_t start, idx_t rows)>;
+
+    idx_t num_moments;
+    std::vector<MatrixX<scalar_t>> blocks;
+    Process process;
+
+    BatchDenseMatrixBlockCollector(idx_t num_moments, idx_t block_size, idx_t num_used,
+                                   OptimizedHamiltonian const& oh)
+        : num_moments(num_moments),
+          blocks(num_used, MatrixX<scalar_t>(std::min(block_size, num_moments), oh.size())) {}
+
+    idx_t size() const override { return num_moments; }
+    void initial(VectorRef r0, VectorRef r1) override;
+    void operator()(idx_t n, VectorRef r1) override;
+
+private:
+    template<class Vector>
+    void store(idx_t n, Vector const& v);
+};
+
+/**
+ Collects the off-diagonal moments `mu_n = <l|Tn(H)|r>` of the `product_identity` algorithm.
+ Column 0 of the batch is the right vector `r` and `columns[i]` is the column of the left
+ vector of `moments[i]` (possibly column 0 itself). After `n` iterations the columns hold
+ `Tn(H)|r>` and `Tn(H)|l>` so that `mu_2n = 2 <l|Tn Tn|r> - mu_0` and
+ `mu_2n-1 = 2 <l|Tn-1 Tn|r> - mu_1`.
+ */
+template<class scalar_t>
+class ProductIdentityCollector {
+public:
+    using Vector = MatrixX<scalar_t>;
+    using VectorRef = Eigen::Ref<Vector>;
+
+    std::vector<idx_t> columns;
+    std::vector<ArrayX<scalar_t>> moments;
+
+    ProductIdentityCollector(idx_t num_moments, std::vector<idx_t> columns)
+        : columns(std::move(columns)),
+          moments(this->columns.size(), ArrayX<scalar_t>(num_moments)),
+          m0(this->columns.size()), m1(this->columns.size()) {}
+
+    idx_t size() const { return moments[0].size(); }
+
+    /// Collect the first 3 moments from the starter vectors `r0` and `r1`
+    void initial(VectorRef r0, VectorRef r1);
+
+    /// Collect moments `2n - 1` and `2n` from the vectors of iterations `n - 1` (`r0`) and
+    /// `n` (`r1`). Only the first `rows` are non-zero. Expects `n >= 2`.
+    void operator()(idx_t n, VectorRef r0, VectorRef r1, idx_t rows);
+
+private:
+    std::vector<scalar_t> m0; ///< mu_0 of each left vector
+    std::vector<scalar_t> m1; ///< mu_1 of each left vector
+};
+
 CPB_EXTERN_TEMPLATE_CLASS(DiagonalCollector)
 CPB_EXTERN_TEMPLATE_CLASS(BatchDiagonalCollector)
+extern template class DiagonalCollector<float, double>;
+extern template class DiagonalCollector<std::complex<float>, std::complex<double>>;
+extern template class BatchDiagonalCollector<float, double>;
+extern template class BatchDiagonalCollector<std::complex<float>, std::complex<double>>;
 CPB_EXTERN_TEMPLATE_CLASS(GenericCollector)
 CPB_EXTERN_TEMPLATE_CLASS(MultiUnitCollector)
+CPB_EXTERN_TEMPLATE_CLASS(BatchGenericCollector)
+CPB_EXTERN_TEMPLATE_CLASS(BatchMultiUnitCollector)
+CPB_EXTERN_TEMPLATE_CLASS(ProjectionCollector)
 CPB_EXTERN_TEMPLATE_CLASS(DenseMatrixCollector)
+CPB_EXTERN_TEMPLATE_CLASS(DenseMatrixBlockCollector)
+CPB_EXTERN_TEMPLATE_CLASS(BatchDenseMatrixBlockCollector)
+CPB_EXTERN_TEMPLATE_CLASS(ProductIdentityCollector)
 
+CPB_ISA_NAMESPACE_END
 }} // namespace cpb::kpm
@@ -0,0 +1,40 @@
+#pragma once
+#include "kpm/Core.hpp"
+#include "compute/lanczos.hpp"
+
+#include <vector>
+
+namespace cpb { namespace kpm {
+
+class DefaultCompute;
+
+namespace dispatch {
+
+/**
+ One build of the instruction set specific kernels (see `src/kpm/default/kernels.cpp`)
+
+ With `PB_CPU_DISPATCH`, the kernels are compiled for several x86 instruction sets and the best
+ one which is supported by the running CPU is selected at runtime. Otherwise, there is a single
+ build for the target of the compiler flags, e.g. the local machine with `PB_NATIVE_SIMD`.
+ */
+struct Kernels {
+    char const* instruction_set; ///< see `simd::instruction_set()`
+    void (*moments)(MomentsRef m, Starter const& s, AlgorithmConfig const& ac,
+                    OptimizedHamiltonian const& oh, DefaultCompute const& compute);
+    std::vector<BatchData> (*multi_moments)(std::vector<VariantCSR> const& members,
+                                            SliceMap const& map, Indices const& idx,
+                                            idx_t num_moments, AlgorithmConfig const& ac,
+                                            DefaultCompute const& compute);
+    compute::LanczosBounds (*minmax_eigenvalues)(Hamiltonian const& h, double precision_percent,
+                                                 idx_t num_threads, double coarse_percent);
+    compute::LanczosCoefficients (*lanczos_coefficients)(Hamiltonian const& h, idx_t index,
+                                                         idx_t max_steps,
+                                                         compute::LanczosStop const& stop);
+};
+
+/// The builds which the running CPU can execute, from the most to the least advanced
+std::vector<Kernels const*> supported();
+/// The most advanced supported build -- the CPU is only checked on the first call
+Kernels const& best();
+
+}}} // namespace cpb::kpm::dispatch
@@ -0,0 +1,99 @@
+#pragma once
+#include "numeric/dense.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+#ifdef __linux__
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
+
+namespace cpb { namespace kpm { namespace pool {
+
+/**
+ Per-thread free lists of the dense work buffers of `DefaultCompute`
+
+ The KPM vectors and the moments of the collectors have the same shape for every starter
+ vector (or batch) of a calculation, so the ones which are released at the end of one job are
+ handed to the next job on the same thread instead of going back to the allocator. Each thread
+ keeps up to `max_free` buffers of each type and they are freed when the thread exits.
+
+ The alignment is Eigen's (`EIGEN_MAX_ALIGN_BYTES`, i.e. the SIMD register size). On Linux,
+ large buffers are also marked for transparent huge pages which cuts down the TLB misses and
+ the page faults on their first touch.
+ */
+
+/// Maximum number of free buffers of each type which are kept by each thread
+constexpr auto max_free = std::size_t{4};
+/// Buffers of at least this many bytes are backed by huge pages (if supported)
+constexpr auto huge_page_threshold = std::size_t{4} << 20;
+
+namespace detail {
+    template<class T>
+    std::vector<T>& free_list() {
+        thread_local std::vector<T> list;
+        return list;
+    }
+
+    inline idx_t& num_allocations() {
+        thread_local idx_t n = 0;
+        return n;
+    }
+
+    /// Ask the kernel to back the page-aligned part of a new buffer with huge pages
+    inline void advise_huge_pages(void* data, std::size_t bytes) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        if (bytes < huge_page_threshold) { return; }
+        auto const page = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+        auto const first = (reinterpret_cast<std::uintptr_t>(data) + page - 1) / page * page;
+        auto const last = (reinterpret_cast<std::uintptr_t>(data) + bytes) / page * page;
+        if (last > first) {
+            madvise(reinterpret_cast<void*>(first), last - first, MADV_HUGEPAGE);
+        }
+#else
+        (void)data; (void)bytes;
+#endif
+    }
+} // namespace detail
+
+/// A `rows` x `cols` buffer (the contents are unspecified) from the calling thread's free
+/// list. Memory is only allocated if there is no free buffer with the same number of elements.
+template<class T>
+T acquire(idx_t rows, idx_t cols) {
+    auto& list = detail::free_list<T>();
+    auto buffer = T();
+    if (!list.empty()) { // the most recently released buffers are the most likely in cache
+        auto it = std::find_if(list.rbegin(), list.rend(),
+                               [&](T const& b) { return b.size() == rows * cols; });
+        if (it == list.rend()) { it = list.rbegin(); }
+        buffer.swap(*it);
+        list.erase(std::next(it).base());
+    }
+
+    auto const previous_size = buffer.size();
+    buffer.resize(rows, cols);
+    if (buffer.size() != previous_size && buffer.size() != 0) {
+        ++detail::num_allocations();
+        detail::advise_huge_pages(buffer.data(), sizeof(typename T::Scalar)
+                                                 * static_cast<std::size_t>(buffer.size()));
+    }
+    return buffer;
+}
+
+/// Give the memory of `buffer` back to the calling thread's free list (if it's not full)
+template<class T>
+void release(T& buffer) {
+    auto& list = detail::free_list<T>();
+    if (buffer.size() == 0 || list.size() >= max_free) { return; }
+    if (list.capacity() < max_free) { list.reserve(max_free); }
+    list.emplace_back();
+    list.back().swap(buffer);
+}
+
+/// The number of buffers which `acquire()` had to allocate on the calling thread so far
+inline idx_t num_allocations() { return detail::num_allocations(); }
+
+}}} // namespace cpb::kpm::pool
@@ -0,0 +1,70 @@
+#pragma once
+#include "kpm/Core.hpp"
+
+#include <string>
+
+namespace cpb { namespace kpm {
+
+/**
+ Group of processes which share a distributed KPM calculation, e.g. MPI ranks
+
+ Every process in the group must make the same sequence of `allreduce_sum` calls.
+ */
+class Communicator {
+public:
+    virtual ~Communicator() = default;
+
+    /// Index of this process within the group: `0 <= rank < size`
+    virtual idx_t rank() const = 0;
+    /// Number of processes in the group
+    virtual idx_t size() const = 0;
+    /// Replace `data` with the element-wise sum of `data` over all processes
+    virtual void allreduce_sum(double* data, idx_t size) const = 0;
+};
+
+/**
+ Distribute the stochastic KPM calculations (DOS and conductivity) over a group of processes
+
+ Each process computes its share of the random vectors using a regular `local` compute
+ implementation (e.g. `DefaultCompute` with its own threads) and the partial results are
+ combined with `Communicator::allreduce_sum`. Process `rank` takes the vectors `rank`,
+ `rank + size`, `rank + 2 * size`, ... from the starter sequence. A sequential random
+ generator skips the other vectors (a counter-based one makes them directly) so the result
+ does not depend on the number of processes. Every other calculation is simply repeated
+ on all processes by the `local` compute.
+ */
+class DistributedCompute : public Compute::Interface {
+public:
+    DistributedCompute(Compute local, std::shared_ptr<Communicator const> communicator);
+
+    void moments(MomentsRef m, Starter const& s, AlgorithmConfig const& ac,
+                 OptimizedHamiltonian const& oh) const override;
+
+    idx_t get_num_threads() const override { return local->get_num_threads(); }
+    /// The progress of this process only
+    ComputeProgress progress() const override { return local->progress(); }
+
+    Communicator const& communicator() const { return *comm; }
+
+private:
+    Compute local;
+    std::shared_ptr<Communicator const> comm;
+};
+
+/**
+ Share a single copy of the Hamiltonian between all the processes of a node
+
+ Only the leader (rank 0 of the `node` group) builds the system and Hamiltonian of the `model`.
+ It saves them to `path`, which should be in node-local shared memory, e.g. `/dev/shm/...` is a
+ POSIX shared memory object on Linux. The other processes never build the model: they map the
+ file read-only, so the node holds one copy of the matrix however many processes it runs. The
+ file is removed once every process has mapped it and the memory is released with the last
+ mapping. All the processes of the `node` group must call this function.
+
+ The result is meant for the out-of-core `Core` constructor, which uses the mapping without
+ copying it (see `MappedHamiltonian`), e.g. with a `DistributedCompute` for the stochastic DOS.
+ */
+MappedHamiltonian share_hamiltonian(Model const& model, std::string const& path,
+                                    Communicator const& node);
+
+}} // namespace cpb::kpm
@@ -0,0 +1,78 @@
+#pragma once
+#include "kpm/distributed/Compute.hpp"
+#include "utils/ThreadBudget.hpp"
+
+#include <mutex>
+
+namespace cpb { namespace kpm {
+
+/**
+ Split each KPM recursion over a group of processes by domains of the Hamiltonian rows
+
+ Unlike `DistributedCompute` which gives whole random vectors to each process, every process
+ takes part in every vector: it owns one contiguous block of rows of the optimized matrix and
+ computes only those rows of each Chebyshev step. The blocks have about the same number of
+ non-zeros. The optimized matrix is ordered by a breadth-first traversal of the lattice (or it
+ keeps the order of the sites) so consecutive rows are neighbors in space: each block is a
+ spatial domain and only the rows at its surface are needed by the others (the halo).
+
+ The halo is found exactly from the sparsity pattern, so the result doesn't depend on the
+ shape of the domains, only the amount of communication does. Each step first computes the
+ owned halo rows. Then the calling thread exchanges them with the other processes (a single
+ `allreduce_sum` of the halo of all domains) while the other `num_threads - 1` threads compute
+ the interior rows. Finally, the partial `m2` and `m3` sums of the domains are added up. The
+ domains are split into fixed blocks of rows, so the result is the same for any number of
+ threads but the sum over the domains may differ in the last digits for different numbers
+ of processes.
+
+ All the processes need the same `OptimizedHamiltonian` (it's also used to find the halo)
+ and the same starter. Only the diagonal moments (`DiagonalMoments` and
+ `BatchDiagonalMoments`, i.e. the LDOS and the stochastic DOS) are supported without
+ checkpoints. The vectors are computed one at a time, without the size optimization and
+ the interleaved algorithm. Like any collective operation, the calls must be made in the
+ same order on all the processes and they must not overlap.
+ */
+class DomainCompute : public Compute::Interface {
+public:
+    DomainCompute(std::shared_ptr<Communicator const> communicator, idx_t num_threads = -1);
+
+    void moments(MomentsRef m, Starter const& s, AlgorithmConfig const& ac,
+                 OptimizedHamiltonian const& oh) const override;
+
+    idx_t get_num_threads() const override { return resolve_num_threads(num_threads); }
+
+    Communicator const& communicator() const { return *comm; }
+
+    /// The rows of the optimized matrix owned by this process and its halo
+    struct Domain {
+        idx_t start = 0; ///< first owned row
+        idx_t end = 0; ///< one past the last owned row
+        /// The rows needed by some other domain (of all the domains): the exchange buffer
+        std::vector<storage_idx_t> halo;
+        idx_t halo_start = 0; ///< the first entry of `halo` owned by this process
+        idx_t halo_end = 0; ///< one past the last one
+        /// Ranges of owned rows which contain halo rows or not: they are computed first
+        std::vector<std::pair<idx_t, idx_t>> surface;
+        std::vector<std::pair<idx_t, idx_t>> interior; ///< at most `block_rows` each
+    };
+
+    /// The interior rows are computed by the threads in blocks of this size
+    static constexpr idx_t block_rows = 4096;
+
+    /// The domain of this process for the current revision of the optimized Hamiltonian
+    std::shared_ptr<Domain const> domain(OptimizedHamiltonian const& oh) const;
+
+private:
+    std::shared_ptr<Communicator const> comm;
+    idx_t num_threads;
+
+    /// The domain is kept until the matrix is optimized again, shared by copies of the compute
+    struct Cache {
+        std::mutex mutex;
+        idx_t revision = -1;
+        std::shared_ptr<Domain const> domain;
+    };
+    std::shared_ptr<Cache> cache;
+};
+
+}} // namespace cpb::kpm
@@ -0,0 +1,30 @@
+#pragma once
+#include "kpm/distributed/Compute.hpp"
+
+#include <mpi.h>
+
+namespace cpb { namespace kpm {
+
+/**
+ MPI process group for `DistributedCompute`
+
+ MPI is initialized on first use unless this was already done by the caller (e.g. `mpi4py`).
+ In that case, the caller is also responsible for finalization.
+ */
+class MpiCommunicator : public Communicator {
+public:
+    explicit MpiCommunicator(MPI_Comm comm = MPI_COMM_WORLD);
+
+    /// The processes of `comm` which run on the same node (shared memory domain) as this one,
+    /// e.g. for `share_hamiltonian()`. The new MPI communicator lives until finalization.
+    static MpiCommunicator node(MPI_Comm comm = MPI_COMM_WORLD);
+
+    idx_t rank() const override;
+    idx_t size() const override;
+    void allreduce_sum(double* data, idx_t size) const override;
+
+private:
+    MPI_Comm comm;
+};
+
+}} // namespace cpb::kpm
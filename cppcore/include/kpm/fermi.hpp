@@ -0,0 +1,50 @@
+#pragma once
+#include "kpm/Bounds.hpp"
+#include "numeric/constant.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace cpb { namespace kpm {
+
+/**
+ Chebyshev expansion coefficients of the Fermi-Dirac distribution `f(H)`
+
+ With the scaled Hamiltonian `H = a * H' + b`:
+     f(H) = 1 / (1 + exp((H - mu) / (kb * T))) = sum_n( c_n * T_n(H') )
+ The coefficients are found by Chebyshev-Gauss quadrature on `8 * num_moments` nodes which
+ is exact up to the aliasing of the much higher orders. At zero temperature, `f` is a step.
+ The truncated series rings around `mu`: it's smoothed by the damping kernel of the moments.
+ */
+inline ArrayXd fermi_coefficients(Scale<> scale, double chemical_potential, double temperature,
+                                  idx_t num_moments) {
+    auto const kbt = constant::kb * temperature;
+    auto const fermi_dirac = [&](double energy) {
+        auto const e = energy - chemical_potential;
+        if (kbt > 0) { return 1 / (1 + std::exp(e / kbt)); }
+        else { return e < 0 ? 1.0 : (e > 0 ? 0.0 : 0.5); }
+    };
+
+    constexpr auto pi = 3.14159265358979323846;
+    auto const num_nodes = 8 * std::max(num_moments, idx_t{1});
+    auto c = ArrayXd::Zero(num_moments).eval();
+    for (auto k = idx_t{0}; k < num_nodes; ++k) {
+        auto const x = std::cos(pi * (k + 0.5) / static_cast<double>(num_nodes));
+        auto const f = fermi_dirac(scale.a * x + scale.b);
+
+        // T_n(x) by the recurrence: stable because |x| < 1
+        auto t0 = 1.0, t1 = x;
+        for (auto n = idx_t{0}; n < num_moments; ++n) {
+            c[n] += f * t0;
+            auto const t2 = 2 * x * t1 - t0;
+            t0 = t1;
+            t1 = t2;
+        }
+    }
+
+    c *= 2 / static_cast<double>(num_nodes);
+    if (num_moments > 0) { c[0] /= 2; }
+    return c;
+}
+
+}} // namespace cpb::kpm
@@ -0,0 +1,42 @@
+#pragma once
+#include "kpm/default/Compute.hpp"
+
+#include <mutex>
+
+namespace cpb { namespace kpm {
+
+/**
+ KPM moments with the CSR products done by MKL's inspector-executor sparse routines
+
+ The optimized Hamiltonian (`MatrixFormat::CSR`) gets an MKL sparse handle which is tuned once
+ by `mkl_sparse_optimize()` with hints for many repeated products. It's kept until the matrix
+ is optimized again (see `OptimizedHamiltonian::revision()`). Everything else is the same as
+ `DefaultCompute`: all the calculations are supported and each vector (or batch) uses MKL's
+ threading within its budget of `num_threads`. MKL only multiplies the full matrix, so the
+ `interleaved` and `matrix_powers` algorithms (which work on row slices) are turned off. With
+ `optimal_size`, the products of the first iterations still use the built-in kernels, and so
+ do the other matrix formats.
+ */
+class MklCompute : public DefaultCompute {
+public:
+    MklCompute(idx_t num_threads = -1, ProgressCallback progress_callback = {});
+
+    void moments(MomentsRef m, Starter const& s, AlgorithmConfig const& ac,
+                 OptimizedHamiltonian const& oh) const override;
+
+    std::shared_ptr<SparseBackendBase const>
+    sparse_backend(OptimizedHamiltonian const& oh) const override;
+
+private:
+    /// The handles of the most recent optimized matrices, shared by copies of the compute
+    struct Handles {
+        static constexpr auto max_size = size_t{4}; ///< e.g. concurrent `Core` sessions
+        using Entry = std::pair<idx_t, std::shared_ptr<SparseBackendBase const>>; ///< revision
+
+        std::mutex mutex;
+        std::vector<Entry> entries; ///< from the oldest to the newest
+    };
+    std::shared_ptr<Handles> handles;
+};
+
+}} // namespace cpb::kpm
@@ -0,0 +1,142 @@
+#pragma once
+#include "kpm/Bounds.hpp"
+#include "kpm/Starter.hpp"
+#include "kpm/calc_moments.hpp"
+#include "numeric/bessel.hpp"
+
+namespace cpb { namespace kpm {
+
+/**
+ Chebyshev expansion coefficients of the time evolution operator `exp(-i * H * t)`
+
+ With the scaled Hamiltonian `H = a * H' + b`:
+     exp(-i * H * t) = exp(-i * b * t) * sum_n( c_n * T_n(H') )
+ where `c_0 = J_0(a * t)` and `c_n = 2 * (-i)^n * J_n(a * t)`. The series converges
+ exponentially for `n > a * t` and it's truncated where the terms drop below `precision`.
+ */
+inline ArrayXcd propagation_coefficients(Scale<> scale, double time, double precision) {
+    auto const x = scale.a * time;
+    auto const ax = std::abs(x);
+    auto const n_max = static_cast<idx_t>(ax + 10 * std::cbrt(ax)) + 20;
+    auto const j = num::bessel_j(n_max, x);
+
+    auto num_terms = n_max + 1;
+    while (num_terms > 1 && std::abs(j[num_terms - 1]) < precision) { --num_terms; }
+
+    auto const phase = std::exp(std::complex<double>{0, -scale.b * time});
+    auto minus_i_n = std::complex<double>{1, 0};
+    auto c = ArrayXcd(num_terms);
+    for (auto n = idx_t{0}; n < num_terms; ++n) {
+        c[n] = (n == 0 ? 1.0 : 2.0) * minus_i_n * j[n] * phase;
+        minus_i_n *= std::complex<double>{0, -1};
+    }
+    return c;
+}
+
+namespace detail {
+    /// A real Hamiltonian propagates the real and imaginary parts of a state separately
+    /// because `T_n(H')` is also real: one state takes two columns of the batch
+    template<class scalar_t>
+    constexpr idx_t columns_per_state() { return num::is_complex<scalar_t>() ? 1 : 2; }
+
+    template<class real_t>
+    void pack_states(MatrixXcd const& psi, idx_t first, idx_t n, MatrixX<real_t>& batch) {
+        batch.setZero();
+        for (auto j = idx_t{0}; j < n; ++j) {
+            batch.col(2 * j) = psi.col(first + j).real().template cast<real_t>();
+            batch.col(2 * j + 1) = psi.col(first + j).imag().template cast<real_t>();
+        }
+    }
+
+    template<class real_t>
+    void pack_states(MatrixXcd const& psi, idx_t first, idx_t n,
+                     MatrixX<std::complex<real_t>>& batch) {
+        batch.setZero();
+        for (auto j = idx_t{0}; j < n; ++j) {
+            batch.col(j) = psi.col(first + j).template cast<std::complex<real_t>>();
+        }
+    }
+
+    /// result.col(first + j) += c * state j of the batch
+    template<class real_t>
+    void add_states(MatrixXcd& result, idx_t first, idx_t n, std::complex<double> c,
+                    MatrixX<real_t> const& batch) {
+        for (auto j = idx_t{0}; j < n; ++j) {
+            auto const ic = c * std::complex<double>{0, 1};
+            result.col(first + j) += c * batch.col(2 * j).template cast<double>()
+                                   + ic * batch.col(2 * j + 1).template cast<double>();
+        }
+    }
+
+    template<class real_t>
+    void add_states(MatrixXcd& result, idx_t first, idx_t n, std::complex<double> c,
+                    MatrixX<std::complex<real_t>> const& batch) {
+        for (auto j = idx_t{0}; j < n; ++j) {
+            result.col(first + j) += c * batch.col(j).template cast<std::complex<double>>();
+        }
+    }
+} // namespace detail
+
+/**
+ Time evolution of the columns of `psi0` (in the `h2` ordering) for all the times given by
+ their `coefficients` (see `propagation_coefficients()`) with a single Chebyshev recursion
+
+ The states are packed into SIMD-width batches of columns for the `MatrixX` KPM kernels.
+ Large matrices split the rows of each matrix-vector product among `num_threads`.
+ */
+struct Propagate {
+    MatrixXcd const& psi0;
+    std::vector<ArrayXcd> const& coefficients;
+    std::vector<MatrixXcd>& result;
+    idx_t num_threads;
+
+    template<class Matrix>
+    void operator()(Matrix const& h2) const {
+        constexpr auto min_rows_per_thread = idx_t{4096};
+        auto const max_threads = std::max(h2.rows() / min_rows_per_thread, idx_t{1});
+        auto const threads = std::min(num_threads, max_threads);
+        if (threads > 1) {
+            ThreadTeam team(threads);
+            run(h2, calc_moments::Parallel(team, min_rows_per_thread));
+        } else {
+            run(h2, calc_moments::Serial{});
+        }
+    }
+
+    template<class Matrix, class SpMV>
+    void run(Matrix const& h2, SpMV const& spmv) const {
+        using scalar_t = typename Matrix::Scalar;
+        constexpr auto batch_size = static_cast<idx_t>(simd::traits<scalar_t>::size);
+        constexpr auto states_per_batch = batch_size / detail::columns_per_state<scalar_t>();
+        simd::scope_disable_denormals guard;
+
+        auto num_terms = idx_t{0};
+        for (auto const& c : coefficients) { num_terms = std::max(num_terms, c.size()); }
+
+        auto const add = [&](idx_t n, idx_t first, idx_t num_states,
+                             MatrixX<scalar_t> const& tn) {
+            for (auto t = size_t{0}; t < coefficients.size(); ++t) {
+                if (n < coefficients[t].size()) {
+                    detail::add_states(result[t], first, num_states, coefficients[t][n], tn);
+                }
+            }
+        };
+
+        auto r0 = MatrixX<scalar_t>(h2.rows(), batch_size);
+        for (auto first = idx_t{0}; first < psi0.cols(); first += states_per_batch) {
+            auto const num_states = std::min(states_per_batch, psi0.cols() - first);
+            detail::pack_states(psi0, first, num_states, r0);
+            auto r1 = make_r1(h2, r0);
+            add(0, first, num_states, r0);
+            add(1, first, num_states, r1);
+
+            for (auto n = idx_t{2}; n < num_terms; ++n) {
+                spmv(0, h2.rows(), h2, r1, r0); // r0 = 2 * H' * r1 - r0
+                r0.swap(r1);
+                add(n, first, num_states, r1);
+            }
+        }
+    }
+};
+
+}} // namespace cpb::kpm
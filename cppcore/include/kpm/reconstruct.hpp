@@ -1,5 +1,7 @@
 #pragma once
 #include "kpm/Bounds.hpp"
+#include "numeric/fft.hpp"
+#include "detail/thread.hpp"
 
 namespace cpb { namespace kpm {
 
@@ -11,52 +13,247 @@ auto reconstruct(M const& moments, Args&&... args)
     return var::apply_visitor(F{std::forward<Args>(args)...}, moments.data);
 };
 
+namespace detail {
+    constexpr auto pi = 3.14159265358979323846; ///< `constant::pi` is single precision
+
+    /// Number of energies per block of Chebyshev polynomials in `SpectralDensity`
+    constexpr auto recurrence_block_size = idx_t{64};
+
+    /// Call `f(start, end)` for consecutive blocks of `size` elements split among the threads
+    template<class F>
+    void for_each_block(idx_t size, idx_t block_size, idx_t num_threads, F f) {
+        auto const num_blocks = (size + block_size - 1) / block_size;
+        ThreadTeam team(std::max(std::min(num_threads, num_blocks), idx_t{1}));
+        team.run([&](idx_t thread_id) {
+            for (auto b = thread_id; b < num_blocks; b += team.size()) {
+                f(b * block_size, std::min((b + 1) * block_size, size));
+            }
+        });
+    }
+} // namespace detail
+
 /// Reconstruct spectral density based on the given KPM moments
-///    f(E) = 2 / (a * pi * sqrt(1 - E^2)) * sum_n( moments * cos(n * acos(E)) )
+///    f(E) = 2 / (a * pi * sqrt(1 - E^2)) * sum_n( moments * T_n(E) )
+/// The Chebyshev polynomials `T_n(E) = cos(n * acos(E))` are computed (in double precision)
+/// with the recurrence `T_n+1 = 2E * T_n - T_n-1` for many energies at once: only SIMD
+/// multiply-adds instead of transcendental functions. Multiple columns of moments reuse
+/// blocks of polynomials in a matrix product and the blocks are split among `num_threads`.
 struct SpectralDensity {
     ArrayXd const& energy;
     Scale<> const& s;
+    idx_t num_threads; ///< may be omitted: single-threaded
 
     template<class scalar_t>
     ArrayXXdCM operator()(ArrayX<scalar_t> const& moments) const {
-        using real_t = num::get_real_t<scalar_t>;
+        auto const E = s(energy);
+        auto const real_moments = ArrayXd(moments.real().template cast<double>());
 
-        auto const scale = Scale<real_t>(s);
-        auto const scaled_energy = scale(energy.cast<real_t>());
-        auto const real_moments = ArrayX<real_t>(moments.real());
-        auto const ns = make_integer_range<real_t>(moments.size());
-        auto const k = real_t{2 / constant::pi} / scale.a;
+        auto sum = ArrayXd::Zero(E.size()).eval();
+        auto t0 = ArrayXd::Ones(E.size()).eval(); // T_n-1
+        auto t1 = E.eval(); // T_n
+        if (real_moments.size() > 0) { sum += real_moments[0]; }
+        for (auto n = idx_t{1}; n < real_moments.size(); ++n) {
+            sum += real_moments[n] * t1;
+            t0 = 2 * E * t1 - t0;
+            t0.swap(t1);
+        }
 
-        return transform<ArrayX>(scaled_energy, [&](real_t E) {
-            return k / sqrt(1 - E*E) * sum(real_moments * cos(ns * acos(E)));
-        }).template cast<double>();
+        auto const k = 2 / detail::pi / s.a;
+        return k / sqrt(1 - E*E) * sum;
     }
 
     template<class scalar_t>
     ArrayXXdCM operator()(ArrayXX<scalar_t> const& moments) const {
-        using real_t = num::get_real_t<scalar_t>;
         auto const num_moments = moments.rows();
+        auto const E = s(energy);
+        auto const real_moments = MatrixXd(moments.real().template cast<double>());
+        auto const k = 2 / detail::pi / s.a;
+
+        auto result = ArrayXXdCM(E.size(), moments.cols());
+        detail::for_each_block(E.size(), detail::recurrence_block_size, num_threads,
+                               [&](idx_t start, idx_t end) {
+            auto const size = end - start;
+            auto const block = E.segment(start, size);
+            // One column of `T_n` values per moment: contiguous in energy
+            auto ts = MatrixXd(size, num_moments);
+            if (num_moments > 0) { ts.col(0).setOnes(); }
+            if (num_moments > 1) { ts.col(1) = block.matrix(); }
+            for (auto n = idx_t{2}; n < num_moments; ++n) {
+                ts.col(n) = (2 * block * ts.col(n - 1).array() - ts.col(n - 2).array()).matrix();
+            }
+            auto const prefactor = (k / sqrt(1 - block * block)).eval();
+            result.middleRows(start, size) = (ts * real_moments).array().colwise() * prefactor;
+        });
+        return result;
+    }
+};
+
+/// Evaluate the operator function `f(H) = sum_n( c_n * T_n(H') )` given by its Chebyshev
+/// `coefficients` (e.g. `fermi_coefficients()`) for each column of diagonal moments:
+///     <i|f(H)|i> = c_0 * 2 * moments_0 + sum_n>0( c_n * moments_n )
+/// The factor 2 undoes the 1/2 which is already included in the zeroth moment.
+struct ChebyshevSeries {
+    ArrayXd const& coefficients;
+
+    template<class scalar_t>
+    ArrayXd operator()(ArrayX<scalar_t> const& moments) const {
+        return operator()(ArrayXX<scalar_t>(moments));
+    }
+
+    template<class scalar_t>
+    ArrayXd operator()(ArrayXX<scalar_t> const& moments) const {
+        auto const n = std::min(coefficients.size(), moments.rows());
+        auto c = coefficients.head(n).eval();
+        if (n > 0) { c[0] *= 2; }
+
+        auto const real_moments = ArrayXX<double>(
+            moments.topRows(n).real().template cast<double>()
+        );
+        return (real_moments.colwise() * c).colwise().sum().transpose();
+    }
+};
+
+/// Reconstruct Green's function based on the given KPM moments
+///     g(E) = -2*i / (a * sqrt(1 - E^2)) * sum_n( moments * exp(-i*n*acos(E)) )
+/// The phases are computed (in double precision) by repeated rotation for all the energies:
+/// `exp(-i*(n+1)*acos(E)) = exp(-i*n*acos(E)) * (E - i*sqrt(1 - E^2))`. Multiple moment
+/// vectors are split among `num_threads`.
+struct GreensFunction {
+    ArrayXd const& energy;
+    Scale<> const& s;
+    idx_t num_threads; ///< may be omitted: single-threaded
+
+    template<class scalar_t>
+    ArrayXcd operator()(ArrayX<scalar_t> const& moments) const {
+        using complex_t = std::complex<double>;
+        constexpr auto i1 = complex_t{0, 1};
+
+        auto const E = s(energy);
+        auto const sqrt_e = ArrayXcd(sqrt(1 - E*E).cast<complex_t>());
+        auto const rotation = (E.cast<complex_t>() - sqrt_e * i1).eval();
+        auto const cmoments = ArrayXcd(moments.template cast<complex_t>());
+
+        auto sum = ArrayXcd::Zero(E.size()).eval();
+        auto phase = ArrayXcd::Ones(E.size()).eval();
+        for (auto n = idx_t{0}; n < cmoments.size(); ++n) {
+            sum += cmoments[n] * phase;
+            phase *= rotation;
+        }
+
+        auto const k = -2.0 * i1 / s.a;
+        return sum / sqrt_e * k;
+    }
+
+    template<class scalar_t>
+    std::vector<ArrayXcd> operator()(std::vector<ArrayX<scalar_t>> const& moments_vector) const {
+        auto const size = static_cast<idx_t>(moments_vector.size());
+        auto results = std::vector<ArrayXcd>(moments_vector.size());
+        detail::for_each_block(size, 1, num_threads, [&](idx_t i, idx_t) {
+            auto const n = static_cast<size_t>(i);
+            results[n] = operator()(moments_vector[n]);
+        });
+        return results;
+    }
+};
+
+namespace detail {
+    /// Number of Chebyshev nodes `K` for the fast reconstruction of `num_moments`:
+    /// the oversampling keeps the cubic interpolation error around 1e-4 relative
+    inline idx_t fast_grid_size(idx_t num_moments) { return num::next_pow2(8 * num_moments); }
+
+    /// Evaluate `f_k = sum_n( moments * exp(sign * i*n*theta_k) )` at the `2K` angles
+    /// `theta_k = pi * (k + 1/2) / K` which cover a full period. For `cos(theta_k)`, the first
+    /// `K` points are the Chebyshev nodes and this is a DCT computed with a single FFT.
+    template<class real_t, class scalar_t>
+    ArrayX<std::complex<real_t>> chebyshev_grid(ArrayX<scalar_t> const& moments, idx_t K,
+                                                int sign) {
+        constexpr auto pi = 3.14159265358979323846;
+        auto grid = ArrayX<std::complex<real_t>>::Zero(2 * K).eval();
+        auto const step = sign * pi / static_cast<double>(2 * K);
+        for (auto n = idx_t{0}; n < moments.size(); ++n) {
+            auto const shift = std::polar(1.0, step * static_cast<double>(n));
+            grid[n] = static_cast<std::complex<real_t>>(moments[n]) *
+                      std::complex<real_t>(shift);
+        }
+        num::fft(grid, sign);
+        return grid;
+    }
+
+    /// Cubic interpolation of a periodic `chebyshev_grid` at the angles `acos(E)`.
+    /// The weights depend only on the energy so they are shared by all moment vectors.
+    template<class real_t>
+    class GridInterpolation {
+    public:
+        GridInterpolation(ArrayX<real_t> const& scaled_energy, idx_t K)
+            : size(2 * K), first(scaled_energy.size()), weights(4, scaled_energy.size()) {
+            auto const pi = real_t{constant::pi};
+            for (auto i = idx_t{0}; i < scaled_energy.size(); ++i) {
+                // Out of range energies are covered by the NaN of the `1 / sqrt(1 - E^2)` factor
+                auto const E = std::max(real_t{-1}, std::min(real_t{1}, scaled_energy[i]));
+                auto const t = std::acos(E) * static_cast<real_t>(K) / pi - real_t{0.5};
+                auto const k = std::floor(t);
+                auto const x = t - k;
+                first[i] = static_cast<idx_t>(k) - 1;
+                weights(0, i) = -x * (x - 1) * (x - 2) / 6;
+                weights(1, i) = (x + 1) * (x - 1) * (x - 2) / 2;
+                weights(2, i) = -(x + 1) * x * (x - 2) / 2;
+                weights(3, i) = (x + 1) * x * (x - 1) / 6;
+            }
+        }
+
+        template<class T>
+        T operator()(ArrayX<T> const& grid, idx_t i) const {
+            auto result = T{0};
+            for (auto j = idx_t{0}; j < 4; ++j) {
+                auto const k = (first[i] + j + size) % size; // periodic
+                result += weights(j, i) * grid[k];
+            }
+            return result;
+        }
+
+    private:
+        idx_t size;
+        ArrayX<idx_t> first; ///< grid index of the first interpolation point for each energy
+        ArrayXX<real_t> weights; ///< 4 Lagrange weights for each energy
+    };
+} // namespace detail
+
+/// Same result as `SpectralDensity` but the Chebyshev sum is computed with an FFT on the
+/// Chebyshev nodes and interpolated onto the energy points: O(N log N) instead of O(N * E)
+struct FastSpectralDensity {
+    ArrayXd const& energy;
+    Scale<> const& s;
+
+    template<class scalar_t>
+    ArrayXXdCM operator()(ArrayX<scalar_t> const& moments) const {
+        return operator()(ArrayXX<scalar_t>(moments));
+    }
+
+    template<class scalar_t>
+    ArrayXXdCM operator()(ArrayXX<scalar_t> const& moments) const {
+        using real_t = num::get_real_t<scalar_t>;
 
         auto const scale = Scale<real_t>(s);
         auto const scaled_energy = scale(energy.cast<real_t>());
-        auto const real_moments = ArrayXX<real_t>(moments.real());
-        auto const ns = make_integer_range<real_t>(num_moments);
+        auto const K = detail::fast_grid_size(moments.rows());
+        auto const interpolate = detail::GridInterpolation<real_t>(scaled_energy, K);
         auto const k = real_t{2 / constant::pi} / scale.a;
+        auto const prefactor = (k / sqrt(real_t{1} - scaled_energy * scaled_energy)).eval();
 
         auto result = ArrayXXdCM(scaled_energy.size(), moments.cols());
-        for (auto i = idx_t{0}; i < scaled_energy.size(); ++i) {
-            auto const E = scaled_energy[i];
-            auto const cos_n = cos(ns * acos(E)).eval();
-            auto const r = k / sqrt(1 - E*E) * (real_moments.colwise() * cos_n).colwise().sum();
-            result.row(i) = r.transpose().template cast<double>();
+        for (auto c = idx_t{0}; c < moments.cols(); ++c) {
+            auto const real_moments = ArrayX<real_t>(moments.col(c).real());
+            auto const grid = detail::chebyshev_grid<real_t>(real_moments, K, +1);
+            for (auto i = idx_t{0}; i < scaled_energy.size(); ++i) {
+                result(i, c) = static_cast<double>(prefactor[i] * interpolate(grid, i).real());
+            }
         }
         return result;
     }
 };
 
-/// Reconstruct Green's function based on the given KPM moments
-///     g(E) = -2*i / (a * sqrt(1 - E^2)) * sum_n( moments * exp(-i*n*acos(E)) )
-struct GreensFunction {
+/// Same result as `GreensFunction` but computed like `FastSpectralDensity`
+struct FastGreensFunction {
     ArrayXd const& energy;
     Scale<> const& s;
 
@@ -68,12 +265,18 @@ struct GreensFunction {
 
         auto const scale = Scale<real_t>(s);
         auto const scaled_energy = scale(energy.cast<real_t>());
-        auto const ns = make_integer_range<real_t>(moments.size());
+        auto const K = detail::fast_grid_size(moments.size());
+        auto const interpolate = detail::GridInterpolation<real_t>(scaled_energy, K);
+        auto const grid = detail::chebyshev_grid<real_t>(moments, K, -1);
         auto const k = -real_t{2} * i1 / scale.a;
 
-        return transform<ArrayX>(scaled_energy.eval(), [&](real_t E) {
-            return k / sqrt(1 - E*E) * sum(moments * exp(-i1 * ns * acos(E)));
-        }).template cast<std::complex<double>>();
+        auto result = ArrayXcd(scaled_energy.size());
+        for (auto i = idx_t{0}; i < scaled_energy.size(); ++i) {
+            auto const E = scaled_energy[i];
+            result[i] = static_cast<std::complex<double>>(k / sqrt(1 - E*E)
+                                                          * interpolate(grid, i));
+        }
+        return result;
     }
 
     template<class scalar_t>
@@ -84,43 +287,84 @@ struct GreensFunction {
     }
 };
 
+/// Chebyshev expansion of `delta(E - H)` with the same normalization as `SpectralDensity`:
+///     delta(E - H) = sum_n( c_n(E) * T_n(H') ),  c_n(E) = 2 g_n T_n(E') / (a pi sqrt(1 - E'^2))
+/// where `c_0` is halved and `g_n` are the kernel `damping` coefficients. Column `k` of the
+/// result (`damping.size()` x `energy.size()`) is for `energy[k]`.
+inline ArrayXXd delta_coefficients(ArrayXd const& energy, Scale<> const& s,
+                                   ArrayXd const& damping) {
+    auto const scaled_energy = s(energy);
+    auto result = ArrayXXd(damping.size(), energy.size());
+    for (auto k = idx_t{0}; k < energy.size(); ++k) {
+        auto const e = scaled_energy[k];
+        auto const prefix = 2 / (s.a * detail::pi * std::sqrt(1 - e * e));
+        auto t0 = 1.0, t1 = e; // T_n and T_n+1
+        for (auto n = idx_t{0}; n < damping.size(); ++n) {
+            result(n, k) = prefix * damping[n] * (n == 0 ? 0.5 * t0 : t0);
+            auto const t2 = 2 * e * t1 - t0;
+            t0 = t1;
+            t1 = t2;
+        }
+    }
+    return result;
+}
+
 /// Reconstruct the Kubo-Bastin formula for the conductivity:
 ///     sigma(mu, T) = 4 / a^2 * int_-1^1 fd(E) / (1 - E^2)^2 sum(momenta * gamma(E)) dE
 /// The resulting conductivity is in units of `e^2 / h * Omega` where Omega is the volume.
+///
+/// The gamma matrix is separable: `gamma_nm = T_n * a_m + conj(a_n) * T_m` where `T_n(E)` is
+/// a Chebyshev polynomial and `a_m(E) = (E - i*m*sqrt(1 - E^2)) * exp(i*m*acos(E))`. Therefore,
+/// `sum(momenta * gamma) = T^T * mu * a + a^H * mu * T` and a block of energy samples reduces
+/// to a single matrix product without any per-energy N x N temporaries.
 struct KuboBastin {
     ArrayXd const& chemical_pot;
     ArrayXd const& energy_samples;
     double temperature;
     Scale<> s;
+    idx_t num_threads; ///< energy blocks and chemical potentials are split among the threads
+
+    static constexpr auto block_size = idx_t{64}; ///< number of energy samples per product
 
     template<class scalar_t>
     ArrayXcd operator()(MatrixX<scalar_t> const& moments) const {
         using real_t = num::get_real_t<scalar_t>;
         using complex_t = num::get_complex_t<scalar_t>;
+        constexpr auto i1 = static_cast<complex_t>(constant::i1);
 
         auto const scale = Scale<real_t>(s);
         auto const inv_kbt_sc = static_cast<real_t>(scale.a / (constant::kb * temperature));
         auto const num_moments = moments.rows();
         auto const scaled_chemical_potential = scale(chemical_pot.cast<real_t>());
         auto const scaled_energy_samples = scale(energy_samples.cast<real_t>());
+        auto const num_samples = scaled_energy_samples.size();
+        auto const mu = moments.template cast<complex_t>().eval();
+        auto const ns = make_integer_range<real_t>(num_moments);
 
-        auto gamma = [&](real_t en) {
-            constexpr auto i1 = static_cast<complex_t>(constant::i1);
-
-            using Row = Eigen::Array<real_t, 1, Eigen::Dynamic>;
-            auto const ns = Row::LinSpaced(num_moments, 0, static_cast<real_t>(num_moments - 1));
-            auto const ns_2d = ns.replicate(num_moments, 1).eval();
-
-            auto const sqrt_n = en - i1 * ns_2d * sqrt(real_t{1} - en * en);
-            auto const exp_n = exp(i1 * acos(en) * ns_2d);
-            auto const t_m = cos(acos(en) * ns_2d.transpose());
+        auto sum_nm = ArrayX<complex_t>(num_samples);
+        auto sum_block = [&](idx_t start, idx_t end) {
+            auto const size = end - start;
+            auto vectors = MatrixX<complex_t>(num_moments, 2 * size); // [a | T]
+            for (auto p = idx_t{0}; p < size; ++p) {
+                auto const en = scaled_energy_samples[start + p];
+                auto const acos_en = acos(en);
+                auto const sqrt_en = sqrt(real_t{1} - en * en);
+                vectors.col(p) = ((en - i1 * ns * sqrt_en) * exp(i1 * acos_en * ns)).matrix();
+                vectors.col(size + p) = cos(acos_en * ns).template cast<complex_t>().matrix();
+            }
 
-            auto const g_p = MatrixX<complex_t>(sqrt_n * exp_n * t_m);
-            return (g_p + g_p.adjoint()).array().eval();
+            auto const products = (mu * vectors).eval(); // [mu * a | mu * T]
+            for (auto p = idx_t{0}; p < size; ++p) {
+                auto const en = scaled_energy_samples[start + p];
+                auto const k = real_t{1} / ((real_t{1} - en * en) * (real_t{1} - en * en));
+                auto const t_mu_a = vectors.col(size + p).cwiseProduct(products.col(p)).sum();
+                auto const a_mu_t = vectors.col(p).dot(products.col(size + p)); // conj(a)
+                sum_nm[start + p] = k * (t_mu_a + a_mu_t);
+            }
         };
 
         auto const coeff = (scaled_energy_samples.maxCoeff() - scaled_energy_samples.minCoeff())
-                           / static_cast<real_t>(2 * scaled_energy_samples.size());
+                           / static_cast<real_t>(2 * num_samples);
 
         auto integrate = [&](ArrayX<complex_t> const& func) {
             return coeff * (real_t{2} * func.sum() - func(0) - func(func.size() - 1));
@@ -130,15 +374,26 @@ struct KuboBastin {
             return real_t{1} / (real_t{1} + exp((scaled_energy_samples - mi) * inv_kbt_sc));
         };
 
-        auto sum_nm = transform<ArrayX>(scaled_energy_samples, [&](real_t en) {
-            auto const k = real_t{1} / ((real_t{1} - en * en) * (real_t{1} - en * en));
-            return k * sum(moments.array() * gamma(en));
-        });
-
         auto const prefix = scalar_t{4} / (scale.a * scale.a);
-        return transform<ArrayX>(scaled_chemical_potential, [&](real_t mu) {
-            return prefix * integrate(fermi_dirac(mu) * sum_nm);
-        }).template cast<std::complex<double>>();
+        auto const num_potentials = scaled_chemical_potential.size();
+        auto result = ArrayXcd(num_potentials);
+        auto const num_blocks = (num_samples + block_size - 1) / block_size;
+
+        ThreadTeam team(std::min(num_threads, num_blocks));
+        team.run([&](idx_t thread_id) {
+            for (auto b = thread_id; b < num_blocks; b += team.size()) {
+                sum_block(b * block_size, std::min((b + 1) * block_size, num_samples));
+            }
+        });
+        team.run([&](idx_t thread_id) {
+            for (auto i = thread_id; i < num_potentials; i += team.size()) {
+                auto const mu_i = scaled_chemical_potential[i];
+                result[i] = static_cast<std::complex<double>>(
+                    prefix * integrate(fermi_dirac(mu_i) * sum_nm)
+                );
+            }
+        });
+        return result;
     }
 };
 
@@ -26,18 +26,21 @@ public:
 
 /**
  Container for all leads of a model
+
+ The structure of each lead is made from the foundation of the main system, but the
+ Hamiltonian pairs are built lazily, only for the leads which are actually requested.
  */
 class Leads {
     std::vector<leads::Spec> specs;
     std::vector<leads::Structure> structures;
-    std::vector<leads::HamiltonianPair> hamiltonians;
+    std::vector<std::shared_ptr<leads::HamiltonianPair const>> hamiltonians; ///< null: not built
 
 public:
     /// The total number of leads
     int size() const { return static_cast<int>(specs.size()); }
 
-    /// Description of lead number `i`
-    Lead operator[](size_t i) const { return {specs.at(i), structures.at(i), hamiltonians.at(i)}; }
+    /// Description of lead number `i`: its Hamiltonian must already be built
+    Lead operator[](size_t i) const;
 
     /// Add a lead specified by `direction` and `shape`
     void add(int direction, Shape const& shape) { specs.emplace_back(direction, shape); }
@@ -48,9 +51,13 @@ public:
     /// Create the structure of each lead
     void make_structure(Foundation const& foundation);
 
-    /// Create a Hamiltonian pair for each lead
-    void make_hamiltonian(Lattice const& lattice, HamiltonianModifiers const& modifiers,
+    /// Create the Hamiltonian pair of lead `i`, unless it already exists
+    void make_hamiltonian(size_t i, Lattice const& lattice, HamiltonianModifiers const& modifiers,
                           bool is_double, bool is_complex);
+    /// Create the missing Hamiltonian pairs of all leads, concurrently on `num_threads` if
+    /// the modifiers are thread-safe
+    void make_hamiltonian(Lattice const& lattice, HamiltonianModifiers const& modifiers,
+                          bool is_double, bool is_complex, idx_t num_threads = 1);
 
     /// Clear any existing structural data, implies clearing Hamiltonian
     void clear_structure();
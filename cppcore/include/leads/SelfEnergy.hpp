@@ -0,0 +1,63 @@
+#pragma once
+#include "leads/Leads.hpp"
+#include "numeric/dense.hpp"
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace cpb { namespace leads {
+
+/**
+ Surface Green's functions and self-energies of semi-infinite leads
+
+ Each lead is a semi-infinite repetition of its unit cell `h0` where `h1` is the hopping from
+ every cell to the previous one, closer to the main system (see `leads::Structure`). The retarded
+ surface Green's function `g(E) = [(E + i*broadening) - h0 - h1^dagger g h1]^-1` is found by
+ Sancho-Rubio decimation: each iteration doubles the effective length of the lead, so the
+ convergence is exponential except near band edges where it can take up to `max_iterations`.
+
+ Energies are computed concurrently and every result is cached per (lead, energy), so repeated
+ transport calculations on the same energy grid only pay for the first one.
+ */
+class SelfEnergy {
+public:
+    explicit SelfEnergy(Leads const& leads, double broadening = 1e-8, double tolerance = 1e-12,
+                        int max_iterations = 1000);
+
+    /// Number of leads
+    idx_t size() const { return static_cast<idx_t>(leads.size()); }
+    /// Imaginary part which is added to the energy
+    double get_broadening() const { return broadening; }
+
+    /// Surface Green's function of `lead` at each of the `energies`. Threads: -1 -> all cores
+    std::vector<MatrixXcd> surface_greens(idx_t lead, ArrayXd const& energies,
+                                          idx_t num_threads = -1) const;
+    /// Self-energy `h1^dagger g h1` which `lead` adds to the main system Hamiltonian at the
+    /// indices given by `Lead::indices()`
+    std::vector<MatrixXcd> self_energy(idx_t lead, ArrayXd const& energies,
+                                       idx_t num_threads = -1) const;
+
+    /// Number of cached (lead, energy) results
+    idx_t cache_size() const;
+    void clear_cache();
+
+private:
+    struct LeadData {
+        MatrixXcd h0;
+        MatrixXcd h1;
+        std::map<double, MatrixXcd> cache; ///< surface Green's function per energy
+    };
+
+    /// Decimation for a single energy
+    MatrixXcd decimate(LeadData const& lead, double energy) const;
+    LeadData& at(idx_t lead) const;
+
+    mutable std::vector<LeadData> leads;
+    mutable std::mutex cache_mutex;
+    double broadening;
+    double tolerance;
+    int max_iterations;
+};
+
+}} // namespace cpb::leads
@@ -0,0 +1,49 @@
+#pragma once
+#include "leads/SelfEnergy.hpp"
+#include "numeric/sparse.hpp"
+
+#include <vector>
+
+namespace cpb { namespace leads {
+
+/**
+ Transmission between two leads using the recursive Green's function (RGF) method
+
+ The scattering region is split into slices by a breadth-first traversal of the Hamiltonian
+ which starts at the sites of the `from` lead, so each slice is only coupled to its neighbors.
+ All the slices from the first one which touches the `to` lead to the end are merged into the
+ last slice. Sites which can't be reached from the `from` lead don't contribute and are skipped.
+
+ For each energy, the Green's function `G_1N` between the first and last slice is found by
+ sweeping through the slices once, which takes `O(slice_width^2)` memory instead of the full
+ dense inverse. The transmission is `Tr[Gamma_from G_1N Gamma_to G_1N^dagger]`.
+ */
+class Transmission {
+public:
+    /// Slice the `hamiltonian` (main system) for transport between leads `from` and `to`
+    Transmission(Hamiltonian const& hamiltonian, Leads const& leads, idx_t from = 0, idx_t to = 1);
+
+    /// Number of slices of the scattering region (0 if the leads aren't connected)
+    idx_t num_slices() const { return static_cast<idx_t>(diagonal.size()); }
+    /// Number of Hamiltonian indices in the largest slice
+    idx_t max_slice_width() const;
+
+    /// Transmission at each of the `energies` which are computed concurrently on `num_threads`
+    /// (-1 -> all cores). The lead self-energies are taken from (and cached in) `self_energy`.
+    ArrayXd calc(SelfEnergy const& self_energy, ArrayXd const& energies,
+                 idx_t num_threads = -1) const;
+
+private:
+    using Matrix = SparseMatrixX<std::complex<double>>;
+
+    idx_t from;
+    idx_t to;
+    std::vector<int> from_local; ///< local indices of the `from` lead sites in the first slice
+    std::vector<int> to_local; ///< local indices of the `to` lead sites in the last slice
+
+    std::vector<Matrix> diagonal; ///< `H_ii`: hoppings within each slice
+    std::vector<Matrix> forward; ///< `H_i,i+1`: coupling to the next slice
+    std::vector<Matrix> backward; ///< `H_i+1,i`: coupling from the next slice
+};
+
+}} // namespace cpb::leads
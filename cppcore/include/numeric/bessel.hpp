@@ -0,0 +1,53 @@
+#pragma once
+#include "numeric/dense.hpp"
+
+#include <cmath>
+
+namespace cpb { namespace num {
+
+/**
+ Bessel functions of the first kind of integer order: `J_n(x)` for `n = 0, 1, ..., n_max`
+
+ Computed with Miller's backward recurrence which is stable for all orders. The result is
+ normalized using the identity `J_0(x) + 2 * sum_k J_2k(x) = 1`.
+ */
+inline ArrayXd bessel_j(idx_t n_max, double x) {
+    auto result = ArrayXd::Zero(n_max + 1).eval();
+    if (x == 0) {
+        result[0] = 1;
+        return result;
+    }
+
+    // The recurrence must start well above both the highest order and the argument
+    auto const ax = std::abs(x);
+    auto const m = std::max(static_cast<double>(n_max), ax);
+    auto const start = static_cast<idx_t>(m + std::sqrt(160 * m)) + 20;
+
+    constexpr auto big = 1e200;
+    auto j_next = 0.0; // J_{n+1}
+    auto j = 1e-30; // J_n
+    auto norm = 0.0;
+    for (auto n = start; n >= 0; --n) {
+        if (n <= n_max) { result[n] = j; }
+        norm += (n == 0) ? j : (n % 2 == 0) ? 2 * j : 0;
+        if (n == 0) { break; }
+
+        auto const j_prev = 2 * static_cast<double>(n) / ax * j - j_next;
+        j_next = j;
+        j = j_prev;
+        if (std::abs(j) > big) { // rescale to avoid overflow
+            j /= big;
+            j_next /= big;
+            norm /= big;
+            if (n <= n_max) { result.tail(n_max + 1 - n) /= big; }
+        }
+    }
+    result /= norm;
+
+    if (x < 0) { // J_n(-x) = (-1)^n J_n(x)
+        for (auto n = idx_t{1}; n <= n_max; n += 2) { result[n] = -result[n]; }
+    }
+    return result;
+}
+
+}} // namespace cpb::num
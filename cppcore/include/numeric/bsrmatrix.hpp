@@ -0,0 +1,120 @@
+#pragma once
+#include "numeric/dense.hpp"
+#include "numeric/sparse.hpp"
+
+#include <algorithm>
+
+namespace cpb { namespace num {
+
+/**
+ Block compressed sparse row (BSR) matrix with square dense blocks of a uniform size
+
+ Multi-orbital models have a dense `block_size x block_size` hopping structure between any
+ two sites: a single block column index replaces `block_size^2` scalar indices and the small
+ dense blocks can be multiplied with the vector held in registers. Rows `[i * block_size,
+ (i + 1) * block_size)` make up block row `i` and the values of each block are stored in
+ row-major order. Elements of a block which are zero in the original matrix are stored
+ as explicit zeros.
+ */
+template<class scalar_t>
+class BsrMatrix {
+public:
+    idx_t _rows, _cols;
+    idx_t block_size;
+    std::vector<storage_idx_t> block_indptr; ///< first block of each block row (+ end sentinel)
+    ArrayX<storage_idx_t> block_indices; ///< block column index of each block
+    ArrayX<scalar_t> data; ///< `block_size^2` values per block
+
+public:
+    using Scalar = scalar_t;
+    using StorageIndex = storage_idx_t;
+
+    BsrMatrix() = default;
+    BsrMatrix(idx_t rows, idx_t cols, idx_t block_size)
+        : _rows(rows), _cols(cols), block_size(block_size) {}
+
+    idx_t rows() const { return _rows; }
+    idx_t cols() const { return _cols; }
+    idx_t nonZeros() const { return data.size(); }
+    idx_t num_blocks() const { return block_indices.size(); }
+    idx_t num_block_rows() const { return static_cast<idx_t>(block_indptr.size()) - 1; }
+
+    /// Stored elements (including explicit zeros) of the block rows which start before `rows`
+    idx_t nonZeros(idx_t rows) const {
+        auto const n = std::min((rows + block_size - 1) / block_size, num_block_rows());
+        return block_indptr[n] * block_size * block_size;
+    }
+
+    template<class F>
+    void for_each(F lambda) const {
+        auto const b = block_size;
+        for (auto i = 0; i < num_block_rows(); ++i) {
+            for (auto n = block_indptr[i]; n < block_indptr[i + 1]; ++n) {
+                auto const values = data.data() + n * b * b;
+                for (auto r = 0; r < b; ++r) {
+                    for (auto c = 0; c < b; ++c) {
+                        lambda(static_cast<storage_idx_t>(i * b + r),
+                               static_cast<storage_idx_t>(block_indices[n] * b + c),
+                               values[r * b + c]);
+                    }
+                }
+            }
+        }
+    }
+};
+
+/**
+ Convert an Eigen CSR matrix to BSR with the given `block_size`
+
+ The number of rows and columns must be divisible by `block_size`.
+ */
+template<class scalar_t>
+num::BsrMatrix<scalar_t> csr_to_bsr(SparseMatrixX<scalar_t> const& csr, idx_t block_size) {
+    auto const b = block_size;
+    auto const num_block_rows = csr.rows() / b;
+    auto bsr = num::BsrMatrix<scalar_t>(csr.rows(), csr.cols(), b);
+    auto const loop = sparse::make_loop(csr);
+
+    // Find the unique block columns of each block row (sorted for locality of `x`)
+    auto positions = std::vector<storage_idx_t>(csr.cols() / b, -1);
+    auto columns = std::vector<storage_idx_t>();
+    auto row_columns = std::vector<storage_idx_t>();
+    bsr.block_indptr.reserve(num_block_rows + 1);
+    bsr.block_indptr.push_back(0);
+    for (auto i = 0; i < num_block_rows; ++i) {
+        row_columns.clear();
+        for (auto row = i * b; row < (i + 1) * b; ++row) {
+            loop.for_each_in_row(static_cast<storage_idx_t>(row), [&](storage_idx_t col, scalar_t) {
+                auto const block_col = static_cast<storage_idx_t>(col / b);
+                if (positions[block_col] != i) {
+                    positions[block_col] = static_cast<storage_idx_t>(i);
+                    row_columns.push_back(block_col);
+                }
+            });
+        }
+        std::sort(row_columns.begin(), row_columns.end());
+        columns.insert(columns.end(), row_columns.begin(), row_columns.end());
+        bsr.block_indptr.push_back(static_cast<storage_idx_t>(columns.size()));
+    }
+
+    bsr.block_indices = Eigen::Map<ArrayX<storage_idx_t>>(columns.data(), columns.size());
+    bsr.data = ArrayX<scalar_t>::Zero(bsr.num_blocks() * b * b);
+
+    // Scatter the values into the dense blocks
+    std::fill(positions.begin(), positions.end(), -1);
+    for (auto i = 0; i < num_block_rows; ++i) {
+        for (auto n = bsr.block_indptr[i]; n < bsr.block_indptr[i + 1]; ++n) {
+            positions[bsr.block_indices[n]] = n;
+        }
+        for (auto r = 0; r < b; ++r) {
+            auto const row = static_cast<storage_idx_t>(i * b + r);
+            loop.for_each_in_row(row, [&](storage_idx_t col, scalar_t value) {
+                auto const n = positions[col / b];
+                bsr.data[n * b * b + r * b + col % b] = value;
+            });
+        }
+    }
+    return bsr;
+}
+
+}} // namespace cpb::num
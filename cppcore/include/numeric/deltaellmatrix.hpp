@@ -0,0 +1,115 @@
+#pragma once
+#include "numeric/dense.hpp"
+#include "numeric/sparse.hpp"
+#include "numeric/traits.hpp"
+
+#include <cstdint>
+#include <limits>
+
+namespace cpb { namespace num {
+
+/**
+ ELLPACK format sparse matrix with 16-bit column offsets relative to the row
+
+ After the KPM reordering, neighboring lattice sites have nearby indices so most elements
+ are within a small distance of the main diagonal: `col = row + offsets(row, n)`. Elements
+ which are further away than the 16-bit range (long-range hoppings, periodic boundaries)
+ are kept with full 32-bit indices as the `escaped` CSR matrix which is added to the result.
+ Padding elements are zero with an offset of zero.
+ */
+template<class scalar_t>
+class DeltaEllMatrix {
+    using DataArray = ColMajorArrayXX<scalar_t>;
+    using OffsetArray = ColMajorArrayXX<std::int16_t>;
+    static constexpr auto align_bytes = 64; ///< column alignment, enough for AVX-512 registers
+
+public:
+    idx_t _rows, _cols;
+    idx_t nnz_per_row;
+    DataArray data;
+    OffsetArray offsets;
+    SparseMatrixX<scalar_t> escaped; ///< elements which are too far from the diagonal
+
+public:
+    using Scalar = scalar_t;
+    using StorageIndex = storage_idx_t;
+
+    DeltaEllMatrix() = default;
+    DeltaEllMatrix(idx_t rows, idx_t cols, idx_t nnz_per_row)
+        : _rows(rows), _cols(cols), nnz_per_row(nnz_per_row), escaped(rows, cols) {
+        data = DataArray::Zero(aligned_size<scalar_t, align_bytes>(rows), nnz_per_row);
+        offsets = OffsetArray::Zero(aligned_size<std::int16_t, align_bytes>(rows), nnz_per_row);
+    }
+
+    /// An empty matrix means that too many elements are far from the diagonal
+    explicit operator bool() const { return data.size() != 0; }
+
+    idx_t rows() const { return _rows; }
+    idx_t cols() const { return _cols; }
+    idx_t nonZeros() const { return _rows * nnz_per_row + escaped.nonZeros(); }
+    /// Stored elements of the rows `[0, rows)`
+    idx_t nonZeros(idx_t rows) const {
+        return rows * nnz_per_row + escaped.outerIndexPtr()[rows];
+    }
+
+    template<class F>
+    void for_each(F lambda) const {
+        for (auto n = 0; n < nnz_per_row; ++n) {
+            for (auto row = 0; row < _rows; ++row) {
+                lambda(row, static_cast<storage_idx_t>(row + offsets(row, n)), data(row, n));
+            }
+        }
+        sparse::make_loop(escaped).for_each(lambda);
+    }
+};
+
+/**
+ Convert an Eigen CSR matrix to ELLPACK with 16-bit column offsets
+
+ Return an empty matrix if more than `max_escaped_fraction` of the non-zeros are too far
+ from the diagonal, e.g. when the matrix was not reordered.
+ */
+template<class scalar_t>
+num::DeltaEllMatrix<scalar_t> csr_to_delta_ell(SparseMatrixX<scalar_t> const& csr,
+                                               double max_escaped_fraction = 0.25) {
+    using limits = std::numeric_limits<std::int16_t>;
+    auto const is_near = [](storage_idx_t row, storage_idx_t col) {
+        return col - row >= limits::min() && col - row <= limits::max();
+    };
+    auto const indptr = csr.outerIndexPtr();
+    auto const indices = csr.innerIndexPtr();
+    auto const values = csr.valuePtr();
+
+    auto max_row_nnz = idx_t{0};
+    auto escaped = std::vector<Eigen::Triplet<scalar_t>>();
+    for (auto row = storage_idx_t{0}; row < csr.rows(); ++row) {
+        auto row_nnz = idx_t{0};
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            if (is_near(row, indices[n])) {
+                ++row_nnz;
+            } else {
+                escaped.emplace_back(row, indices[n], values[n]);
+            }
+        }
+        max_row_nnz = std::max(max_row_nnz, row_nnz);
+    }
+    if (static_cast<double>(escaped.size()) > max_escaped_fraction * csr.nonZeros()) {
+        return {};
+    }
+
+    auto matrix = num::DeltaEllMatrix<scalar_t>(csr.rows(), csr.cols(), max_row_nnz);
+    matrix.escaped.setFromTriplets(escaped.begin(), escaped.end());
+    matrix.escaped.makeCompressed();
+    for (auto row = storage_idx_t{0}; row < csr.rows(); ++row) {
+        auto slot = idx_t{0};
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            if (!is_near(row, indices[n])) { continue; }
+            matrix.data(row, slot) = values[n];
+            matrix.offsets(row, slot) = static_cast<std::int16_t>(indices[n] - row);
+            ++slot;
+        }
+    }
+    return matrix;
+}
+
+}} // namespace cpb::num
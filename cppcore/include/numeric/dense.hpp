@@ -187,6 +187,10 @@ public:
     Cartesian operator[](idx_t i) const { return {x[i], y[i], z[i]}; }
 
     idx_t size() const { return x.size(); }
+    /// Bytes allocated by the coordinates
+    std::size_t memory_usage() const {
+        return 3 * static_cast<std::size_t>(size()) * sizeof(float);
+    }
 
     CartesianArrayConstRef head(idx_t size) const {
         return {x.head(size), y.head(size), z.head(size)};
@@ -11,7 +11,7 @@ template<class scalar_t>
 class EllMatrix {
     using DataArray = ColMajorArrayXX<scalar_t>;
     using IndexArray = ColMajorArrayXX<storage_idx_t>;
-    static constexpr auto align_bytes = 32;
+    static constexpr auto align_bytes = 64; ///< column alignment, enough for AVX-512 registers
 
 public:
     idx_t _rows, _cols;
@@ -56,17 +56,33 @@ public:
 /// Return an ELLPACK matrix reference
 template<class scalar_t>
 inline EllConstRef<scalar_t> ellref(EllMatrix<scalar_t> const& m) {
-    return {m.rows(), m.cols(), m.nnz_per_row, static_cast<int>(m.data.rows()),
+    using index_t = storage_idx_t;
+    return {static_cast<index_t>(m.rows()), static_cast<index_t>(m.cols()),
+            static_cast<index_t>(m.nnz_per_row), static_cast<index_t>(m.data.rows()),
             m.data.data(), m.indices.data()};
 }
 
-/// Convert an Eigen CSR matrix to ELLPACK
+/**
+ Fill the rows `[start, end)` of an ELLPACK matrix from an Eigen CSR matrix
+
+ Padding elements are zero and repeat the column index of the previous row. That index
+ is looked up in the CSR matrix for the first row, so disjoint row ranges are independent
+ of each other and they may be converted in parallel.
+ */
 template<class scalar_t>
-num::EllMatrix<scalar_t> csr_to_ell(SparseMatrixX<scalar_t> const& csr) {
-    auto ell = num::EllMatrix<scalar_t>(csr.rows(), csr.cols(),
-                                        sparse::max_nnz_per_row(csr));
+void csr_to_ell_rows(SparseMatrixX<scalar_t> const& csr, num::EllMatrix<scalar_t>& ell,
+                     idx_t start, idx_t end) {
+    auto const indptr = csr.outerIndexPtr();
+    auto const indices = csr.innerIndexPtr();
+    auto const previous_index = [&](idx_t row, idx_t n) {
+        for (auto r = row - 1; r >= 0; --r) {
+            if (indptr[r + 1] - indptr[r] > n) { return indices[indptr[r] + n]; }
+        }
+        return storage_idx_t{0};
+    };
+
     auto const loop = sparse::make_loop(csr);
-    for (auto row = 0; row < csr.rows(); ++row) {
+    for (auto row = start; row < end; ++row) {
         auto n = 0;
         loop.for_each_in_row(row, [&](storage_idx_t col, scalar_t value) {
             ell.data(row, n) = value;
@@ -75,9 +91,17 @@ num::EllMatrix<scalar_t> csr_to_ell(SparseMatrixX<scalar_t> const& csr) {
         });
         for (; n < ell.nnz_per_row; ++n) {
             ell.data(row, n) = scalar_t{0};
-            ell.indices(row, n) = (row > 0) ? ell.indices(row - 1, n) : 0;
+            ell.indices(row, n) = (row > start) ? ell.indices(row - 1, n) : previous_index(row, n);
         }
     }
+}
+
+/// Convert an Eigen CSR matrix to ELLPACK
+template<class scalar_t>
+num::EllMatrix<scalar_t> csr_to_ell(SparseMatrixX<scalar_t> const& csr) {
+    auto ell = num::EllMatrix<scalar_t>(csr.rows(), csr.cols(),
+                                        sparse::max_nnz_per_row(csr));
+    csr_to_ell_rows(csr, ell, 0, csr.rows());
     return ell;
 }
 
@@ -0,0 +1,49 @@
+#pragma once
+#include "numeric/dense.hpp"
+
+namespace cpb { namespace num {
+
+/// Return the smallest power of two which is greater than or equal to `n`
+inline idx_t next_pow2(idx_t n) {
+    auto p = idx_t{1};
+    while (p < n) { p *= 2; }
+    return p;
+}
+
+/**
+ In-place radix-2 discrete Fourier transform: `a_k = sum_n( a_n * exp(sign * 2*pi*i * n*k / N) )`
+
+ The size `N` must be a power of two. The result is not normalized for either `sign`.
+ */
+template<class real_t>
+void fft(ArrayX<std::complex<real_t>>& a, int sign = -1) {
+    using complex_t = std::complex<real_t>;
+    auto const size = a.size();
+    assert(size == next_pow2(size));
+
+    // Bit-reversal permutation
+    for (auto i = idx_t{1}, j = idx_t{0}; i < size; ++i) {
+        auto bit = size >> 1;
+        for (; j & bit; bit >>= 1) { j ^= bit; }
+        j ^= bit;
+        if (i < j) { std::swap(a[i], a[j]); }
+    }
+
+    // Butterflies -- the twiddle factors are computed in double precision to avoid drift
+    constexpr auto pi = 3.14159265358979323846;
+    for (auto len = idx_t{2}; len <= size; len *= 2) {
+        auto const angle = sign * 2 * pi / static_cast<double>(len);
+        auto const half = len / 2;
+        for (auto m = idx_t{0}; m < half; ++m) {
+            auto const w = complex_t(std::polar(1.0, angle * static_cast<double>(m)));
+            for (auto start = idx_t{0}; start < size; start += len) {
+                auto const u = a[start + m];
+                auto const v = a[start + m + half] * w;
+                a[start + m] = u + v;
+                a[start + m + half] = u - v;
+            }
+        }
+    }
+}
+
+}} // namespace cpb::num
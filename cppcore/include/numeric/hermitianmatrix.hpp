@@ -0,0 +1,101 @@
+#pragma once
+#include "numeric/dense.hpp"
+#include "numeric/sparse.hpp"
+#include "numeric/traits.hpp"
+
+#include <algorithm>
+
+namespace cpb { namespace num {
+
+/**
+ Hermitian sparse matrix which stores only the upper triangle (including the diagonal) in CSR
+
+ The lower triangle is implied: `H(j, i) == conj(H(i, j))`. Each off-diagonal value is read
+ once and used for both `H(i, j)` and `H(j, i)` which halves the matrix memory traffic of
+ a matrix-vector multiplication.
+
+ A row `i` of the full matrix also receives the (conjugated) elements stored in the rows
+ `k < i`. The `reach` of row `k` is the largest column index stored in rows `[0, k]` which
+ makes it possible to find all the rows which contribute to a row range.
+ */
+template<class scalar_t>
+class HermitianMatrix {
+public:
+    idx_t _rows, _cols;
+    std::vector<storage_idx_t> indptr; ///< start of each row in `data` (+ end sentinel)
+    std::vector<storage_idx_t> reach; ///< running maximum of the last column of each row
+    ArrayX<scalar_t> data;
+    ArrayX<storage_idx_t> indices; ///< sorted within each row, always `>=` the row index
+
+public:
+    using Scalar = scalar_t;
+    using StorageIndex = storage_idx_t;
+
+    HermitianMatrix() = default;
+    HermitianMatrix(idx_t rows, idx_t cols) : _rows(rows), _cols(cols) {}
+
+    idx_t rows() const { return _rows; }
+    idx_t cols() const { return _cols; }
+    idx_t nonZeros() const { return data.size(); }
+    /// Stored elements of the rows `[0, rows)`
+    idx_t nonZeros(idx_t rows) const { return indptr[rows]; }
+
+    /// The first row which makes a contribution to any of the rows `>= row`
+    idx_t first_row_reaching(idx_t row) const {
+        auto const it = std::lower_bound(reach.begin(), reach.end(), row);
+        return std::min(static_cast<idx_t>(it - reach.begin()), row);
+    }
+
+    /// Visit the elements of both triangles
+    template<class F>
+    void for_each(F lambda) const {
+        for (auto row = storage_idx_t{0}; row < _rows; ++row) {
+            for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                lambda(row, indices[n], data[n]);
+                if (indices[n] != row) {
+                    lambda(indices[n], row, num::conjugate(data[n]));
+                }
+            }
+        }
+    }
+};
+
+/**
+ Convert a Hermitian Eigen CSR matrix to upper triangle storage
+
+ The lower triangle of `csr` is ignored: its hermiticity is not checked.
+ */
+template<class scalar_t>
+num::HermitianMatrix<scalar_t> csr_to_hermitian(SparseMatrixX<scalar_t> const& csr) {
+    auto hermitian = num::HermitianMatrix<scalar_t>(csr.rows(), csr.cols());
+    auto const indptr = csr.outerIndexPtr();
+    auto const indices = csr.innerIndexPtr();
+    auto const data = csr.valuePtr();
+
+    hermitian.indptr.reserve(csr.rows() + 1);
+    hermitian.indptr.push_back(0);
+    hermitian.reach.reserve(csr.rows());
+    auto upper_starts = std::vector<storage_idx_t>(csr.rows());
+    for (auto row = storage_idx_t{0}; row < csr.rows(); ++row) {
+        auto const first = std::lower_bound(indices + indptr[row], indices + indptr[row + 1], row);
+        upper_starts[row] = static_cast<storage_idx_t>(first - indices);
+        auto const row_nnz = indptr[row + 1] - upper_starts[row];
+        hermitian.indptr.push_back(hermitian.indptr.back() + row_nnz);
+
+        auto const last_col = row_nnz > 0 ? indices[indptr[row + 1] - 1] : row;
+        auto const previous = hermitian.reach.empty() ? storage_idx_t{0} : hermitian.reach.back();
+        hermitian.reach.push_back(std::max(previous, last_col));
+    }
+
+    hermitian.data.resize(hermitian.indptr.back());
+    hermitian.indices.resize(hermitian.indptr.back());
+    for (auto row = storage_idx_t{0}; row < csr.rows(); ++row) {
+        auto const size = indptr[row + 1] - upper_starts[row];
+        std::copy_n(data + upper_starts[row], size, hermitian.data.data() + hermitian.indptr[row]);
+        std::copy_n(indices + upper_starts[row], size,
+                    hermitian.indices.data() + hermitian.indptr[row]);
+    }
+    return hermitian;
+}
+
+}} // namespace cpb::num
@@ -0,0 +1,104 @@
+#pragma once
+#include "numeric/dense.hpp"
+#include "numeric/sparse.hpp"
+#include "numeric/ellmatrix.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace cpb { namespace num {
+
+/**
+ Hybrid ELLPACK + overflow (HYB) format sparse matrix
+
+ Plain ELLPACK pads every row to the longest one, so a few hub sites (adatoms, long-range
+ hoppings from generators) can multiply the size of the whole matrix. Here, the `ell` part
+ only holds the first `ell.nnz_per_row` elements of each row, sized for a typical row, and
+ the remaining elements of the longer rows are kept in the `overflow` CSR matrix which is
+ added to the result. Padding elements are zero and point to the diagonal.
+ */
+template<class scalar_t>
+class HybMatrix {
+public:
+    EllMatrix<scalar_t> ell; ///< the first `ell.nnz_per_row` elements of each row
+    SparseMatrixX<scalar_t> overflow; ///< all the remaining elements
+
+public:
+    using Scalar = scalar_t;
+    using StorageIndex = storage_idx_t;
+
+    HybMatrix() = default;
+    HybMatrix(idx_t rows, idx_t cols, idx_t nnz_per_row)
+        : ell(rows, cols, nnz_per_row), overflow(rows, cols) {}
+
+    idx_t rows() const { return ell.rows(); }
+    idx_t cols() const { return ell.cols(); }
+    idx_t nnz_per_row() const { return ell.nnz_per_row; }
+    idx_t nonZeros() const { return ell.nonZeros() + overflow.nonZeros(); }
+    /// Stored elements of the rows `[0, rows)`
+    idx_t nonZeros(idx_t rows) const {
+        return rows * ell.nnz_per_row + overflow.outerIndexPtr()[rows];
+    }
+
+    template<class F>
+    void for_each(F lambda) const {
+        ell.for_each(lambda);
+        sparse::make_loop(overflow).for_each(lambda);
+    }
+};
+
+/// Number of elements which ELLPACK would store for each actual non-zero of `csr`
+template<class scalar_t>
+double ell_padding(SparseMatrixX<scalar_t> const& csr) {
+    if (csr.nonZeros() == 0) { return 1; }
+    return static_cast<double>(csr.rows() * sparse::max_nnz_per_row(csr))
+           / static_cast<double>(csr.nonZeros());
+}
+
+/// The smallest row length which is enough for a `percentile` fraction of the rows (at least 1)
+template<class scalar_t>
+idx_t row_length_percentile(SparseMatrixX<scalar_t> const& csr, double percentile) {
+    if (csr.rows() == 0) { return 1; }
+    auto const indptr = csr.outerIndexPtr();
+    auto lengths = std::vector<storage_idx_t>(static_cast<size_t>(csr.rows()));
+    for (auto row = idx_t{0}; row < csr.rows(); ++row) {
+        lengths[row] = indptr[row + 1] - indptr[row];
+    }
+
+    auto const rank = static_cast<idx_t>(std::ceil(percentile * csr.rows())) - 1;
+    auto const nth = lengths.begin() + std::min(std::max(rank, idx_t{0}), csr.rows() - 1);
+    std::nth_element(lengths.begin(), nth, lengths.end());
+    return std::max(static_cast<idx_t>(*nth), idx_t{1});
+}
+
+/// Convert an Eigen CSR matrix to HYB with `nnz_per_row` elements per row in the ELL part
+template<class scalar_t>
+num::HybMatrix<scalar_t> csr_to_hyb(SparseMatrixX<scalar_t> const& csr, idx_t nnz_per_row) {
+    auto const indptr = csr.outerIndexPtr();
+    auto const indices = csr.innerIndexPtr();
+    auto const values = csr.valuePtr();
+
+    auto matrix = num::HybMatrix<scalar_t>(csr.rows(), csr.cols(), nnz_per_row);
+    auto overflow = std::vector<Eigen::Triplet<scalar_t>>();
+    for (auto row = storage_idx_t{0}; row < csr.rows(); ++row) {
+        auto slot = idx_t{0};
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n, ++slot) {
+            if (slot < nnz_per_row) {
+                matrix.ell.data(row, slot) = values[n];
+                matrix.ell.indices(row, slot) = indices[n];
+            } else {
+                overflow.emplace_back(row, indices[n], values[n]);
+            }
+        }
+        for (; slot < nnz_per_row; ++slot) {
+            matrix.ell.data(row, slot) = scalar_t{0};
+            matrix.ell.indices(row, slot) = row;
+        }
+    }
+    matrix.overflow.setFromTriplets(overflow.begin(), overflow.end());
+    matrix.overflow.makeCompressed();
+    return matrix;
+}
+
+}} // namespace cpb::num
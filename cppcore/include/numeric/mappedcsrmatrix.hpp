@@ -0,0 +1,123 @@
+#pragma once
+#include "numeric/dense.hpp"
+#include "numeric/traits.hpp"
+#include "utils/MappedFile.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <utility>
+
+namespace cpb { namespace num {
+
+/**
+ CSR matrix which is read straight from a memory-mapped file (out-of-core)
+
+ The arrays point into the file mapping and they are never copied into memory, so the matrix
+ may be larger than the RAM: each pass over the rows streams the elements from the disk (or
+ the page cache). The rows are processed in blocks of `block_rows` and the KPM kernels call
+ `prefetch()` for the next block before the current one, so the reading overlaps with the
+ computation. A batch of vectors multiplies each element which has been read with all of
+ the vectors, i.e. the disk bandwidth is divided among the whole batch.
+
+ The file holds the original Hamiltonian `H` and it can't be modified so the KPM scaling
+ is applied on the fly: the matrix stands for `h2 = scale_a * H - scale_b * I`.
+ */
+template<class scalar_t>
+class MappedCsrMatrix {
+    using real_t = num::get_real_t<scalar_t>;
+
+public:
+    static constexpr auto block_rows = idx_t{16384}; ///< rows between `prefetch()` calls
+
+    std::shared_ptr<MappedFile const> file; ///< keeps the mapping alive
+    idx_t _rows = 0, _cols = 0, nnz = 0;
+    storage_idx_t const* indptr = nullptr; ///< `rows + 1` row offsets
+    storage_idx_t const* indices = nullptr; ///< `nnz` column indices
+    scalar_t const* values = nullptr; ///< `nnz` values of `H`
+
+    real_t scale_a = 1;
+    real_t scale_b = 0;
+
+public:
+    using Scalar = scalar_t;
+    using StorageIndex = storage_idx_t;
+
+    MappedCsrMatrix() = default;
+    MappedCsrMatrix(std::shared_ptr<MappedFile const> file, idx_t rows, idx_t cols,
+                    storage_idx_t const* indptr, storage_idx_t const* indices,
+                    scalar_t const* values)
+        : file(std::move(file)), _rows(rows), _cols(cols), nnz(indptr[rows]),
+          indptr(indptr), indices(indices), values(values) {}
+
+    idx_t rows() const { return _rows; }
+    idx_t cols() const { return _cols; }
+    idx_t nonZeros() const { return nnz; }
+    /// Stored elements of the rows `[0, rows)`
+    idx_t nonZeros(idx_t rows) const { return indptr[rows]; }
+    /// Bytes which are read from the file for one pass over all the rows
+    std::size_t stream_bytes() const {
+        return static_cast<std::size_t>(nnz) * (sizeof(scalar_t) + sizeof(storage_idx_t))
+               + static_cast<std::size_t>(_rows + 1) * sizeof(storage_idx_t);
+    }
+
+    /// The same view scaled as `h2 = 2 * (H - b) / a`, as in `kpm::OptimizedHamiltonian`
+    MappedCsrMatrix scaled(double a, double b) const {
+        auto result = *this;
+        result.scale_a = static_cast<real_t>(2 / a);
+        result.scale_b = static_cast<real_t>(2 * b / a);
+        return result;
+    }
+
+    /// Start reading the elements of the rows `[start, end)` in the background
+    void prefetch(idx_t start, idx_t end) const {
+        end = std::min(end, _rows);
+        if (start >= end) { return; }
+        auto const first = indptr[start];
+        auto const count = static_cast<std::size_t>(indptr[end] - first);
+        file->prefetch(indptr + start, static_cast<std::size_t>(end - start + 1)
+                                       * sizeof(storage_idx_t));
+        file->prefetch(indices + first, count * sizeof(storage_idx_t));
+        file->prefetch(values + first, count * sizeof(scalar_t));
+    }
+
+    /// Call `lambda(row, col, value)` for each stored element of `H` (unscaled)
+    template<class F>
+    void for_each(F lambda) const {
+        for (auto row = idx_t{0}; row < _rows; ++row) {
+            for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                lambda(static_cast<storage_idx_t>(row), indices[n], values[n]);
+            }
+        }
+    }
+};
+
+/// Energy bounds of `H` from the Gershgorin circles, computed in a single pass over the rows.
+/// They are never narrower than the spectrum (but they may be wider, unlike Lanczos bounds).
+template<class scalar_t>
+std::pair<double, double> gershgorin_bounds(MappedCsrMatrix<scalar_t> const& h) {
+    if (h.rows() == 0) { return {0, 0}; }
+
+    auto min = std::numeric_limits<double>::max();
+    auto max = std::numeric_limits<double>::lowest();
+    for (auto start = idx_t{0}; start < h.rows(); start += h.block_rows) {
+        auto const end = std::min(start + h.block_rows, h.rows());
+        h.prefetch(end, end + h.block_rows);
+        for (auto row = start; row < end; ++row) {
+            auto center = 0.0, radius = 0.0;
+            for (auto n = h.indptr[row]; n < h.indptr[row + 1]; ++n) {
+                if (h.indices[n] == row) {
+                    center += static_cast<double>(std::real(h.values[n]));
+                } else {
+                    radius += static_cast<double>(std::abs(h.values[n]));
+                }
+            }
+            min = std::min(min, center - radius);
+            max = std::max(max, center + radius);
+        }
+    }
+    return {min, max};
+}
+
+}} // namespace cpb::num
@@ -0,0 +1,114 @@
+#pragma once
+#include "numeric/dense.hpp"
+#include "numeric/sparse.hpp"
+
+#include <algorithm>
+#include <vector>
+
+namespace cpb { namespace num {
+
+/**
+ ELLPACK format for several matrices (members) which have the same sparsity pattern
+
+ The column `indices` are shared by all the members and each stored element is a group of
+ `num_lanes` consecutive values, one per member: `data(row * num_lanes + lane, n)`. It's made
+ for a batch of KPM vectors (`MatrixX` with `num_lanes` columns) where column `lane` belongs
+ to member `lane`: a single index load and a single load of the row of `x` serve the whole
+ batch and the values of all the members are one contiguous vector register.
+ */
+template<class scalar_t>
+class MultiEllMatrix {
+    using DataArray = ColMajorArrayXX<scalar_t>;
+    using IndexArray = ColMajorArrayXX<storage_idx_t>;
+    static constexpr auto align_bytes = 64; ///< column alignment, enough for AVX-512 registers
+
+public:
+    idx_t _rows, _cols;
+    idx_t nnz_per_row;
+    idx_t num_lanes;
+    DataArray data;
+    IndexArray indices;
+
+public:
+    using Scalar = scalar_t;
+    using StorageIndex = storage_idx_t;
+
+    MultiEllMatrix() = default;
+    MultiEllMatrix(idx_t rows, idx_t cols, idx_t nnz_per_row, idx_t num_lanes)
+        : _rows(rows), _cols(cols), nnz_per_row(nnz_per_row), num_lanes(num_lanes) {
+        data = DataArray::Zero(aligned_size<scalar_t, align_bytes>(rows) * num_lanes,
+                               nnz_per_row);
+        indices = IndexArray::Zero(aligned_size<storage_idx_t, align_bytes>(rows), nnz_per_row);
+    }
+
+    /// An empty matrix means that the members don't have the same sparsity pattern
+    explicit operator bool() const { return data.size() != 0; }
+
+    idx_t rows() const { return _rows; }
+    idx_t cols() const { return _cols; }
+    /// Stored elements of a single member (including padding)
+    idx_t nonZeros() const { return _rows * nnz_per_row; }
+
+    /// The `num_lanes` values of element `n` of `row`
+    scalar_t const* values(idx_t row, idx_t n) const { return &data(row * num_lanes, n); }
+    scalar_t* values(idx_t row, idx_t n) { return &data(row * num_lanes, n); }
+
+    /// The `lambda` gets the row, column and a pointer to the values of all the lanes
+    template<class F>
+    void for_each(F lambda) const {
+        for (auto n = 0; n < nnz_per_row; ++n) {
+            for (auto row = 0; row < _rows; ++row) {
+                lambda(row, indices(row, n), values(row, n));
+            }
+        }
+    }
+};
+
+/**
+ Convert CSR matrices with identical sparsity patterns to a single `MultiEllMatrix`
+
+ Member `i` goes into lane `i` and the lanes beyond `members.size()` are zero. Padding
+ elements are zero and repeat the column index of the previous row, like `csr_to_ell()`.
+ Return an empty matrix if the patterns are different or if there are too many members.
+ */
+template<class scalar_t>
+MultiEllMatrix<scalar_t>
+csr_to_multi_ell(std::vector<SparseMatrixX<scalar_t> const*> const& members, idx_t num_lanes) {
+    auto const num_members = static_cast<idx_t>(members.size());
+    if (num_members == 0 || num_members > num_lanes) { return {}; }
+
+    auto const& first = *members.front();
+    for (auto const* p : members) {
+        auto const& m = *p;
+        if (m.rows() != first.rows() || m.cols() != first.cols()
+            || m.nonZeros() != first.nonZeros() || !m.isCompressed()
+            || !std::equal(m.outerIndexPtr(), m.outerIndexPtr() + m.rows() + 1,
+                           first.outerIndexPtr())
+            || !std::equal(m.innerIndexPtr(), m.innerIndexPtr() + m.nonZeros(),
+                           first.innerIndexPtr())) { return {}; }
+    }
+
+    auto const indptr = first.outerIndexPtr();
+    auto const indices = first.innerIndexPtr();
+    auto matrix = MultiEllMatrix<scalar_t>(first.rows(), first.cols(),
+                                           sparse::max_nnz_per_row(first), num_lanes);
+    for (auto row = storage_idx_t{0}; row < first.rows(); ++row) {
+        auto const row_nnz = indptr[row + 1] - indptr[row];
+        for (auto n = 0; n < matrix.nnz_per_row; ++n) {
+            if (n >= row_nnz) {
+                matrix.indices(row, n) = (row > 0) ? matrix.indices(row - 1, n) : 0;
+                continue;
+            }
+
+            auto const k = indptr[row] + n;
+            matrix.indices(row, n) = indices[k];
+            auto const values = matrix.values(row, n);
+            for (auto lane = idx_t{0}; lane < num_members; ++lane) {
+                values[lane] = members[lane]->valuePtr()[k];
+            }
+        }
+    }
+    return matrix;
+}
+
+}} // namespace cpb::num
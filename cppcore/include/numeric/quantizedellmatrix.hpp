@@ -0,0 +1,152 @@
+#pragma once
+#include "numeric/dense.hpp"
+#include "numeric/sparse.hpp"
+#include "numeric/traits.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace cpb { namespace num {
+
+/// Storage of the values of a `QuantizedEllMatrix`
+enum class ValuePrecision {
+    BF16, ///< bfloat16: the upper half of a float, 8 bits of mantissa
+    INT8  ///< 8-bit integer multiples of a single step for the whole matrix
+};
+
+/// Round a float to the nearest bfloat16 (ties to even), keeping NaN as a quiet NaN
+inline std::uint16_t float_to_bf16(float value) {
+    auto bits = std::uint32_t{0};
+    std::memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7fffffffu) > 0x7f800000u) {
+        return static_cast<std::uint16_t>((bits >> 16) | 0x0040u);
+    }
+    bits += 0x7fffu + ((bits >> 16) & 1u);
+    return static_cast<std::uint16_t>(bits >> 16);
+}
+
+/// Exact: a bfloat16 is a float with the lower 16 bits of the mantissa set to zero
+inline float bf16_to_float(std::uint16_t code) {
+    auto const bits = static_cast<std::uint32_t>(code) << 16;
+    auto value = 0.0f;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/**
+ ELLPACK format sparse matrix with lossy low-precision values
+
+ The KPM kernels of large real Hamiltonians are limited by memory bandwidth and the values
+ make up half (float) or two thirds (double) of the ELLPACK data. Here, they are stored as
+ 16-bit `bf16` codes or as 8-bit `int8` codes, only one of which is allocated, and they are
+ converted back to `scalar_t` inside the kernels. The `bf16` values have a relative error
+ of at most 2^-8. The `int8` values are `step * code` with `step = max(|value|) / 127` for
+ the whole matrix: the absolute error is at most `step / 2`, so it only suits matrices with
+ a small dynamic range, e.g. hoppings with mild disorder. In both cases zero (the padding)
+ is exact. Padding elements point to the row itself for locality.
+ */
+template<class scalar_t>
+class QuantizedEllMatrix {
+    using real_t = get_real_t<scalar_t>;
+    using IndexArray = ColMajorArrayXX<storage_idx_t>;
+    static constexpr auto align_bytes = 64; ///< column alignment, enough for AVX-512 registers
+
+public:
+    idx_t _rows = 0, _cols = 0;
+    idx_t nnz_per_row = 0;
+    ValuePrecision precision = ValuePrecision::BF16;
+    ColMajorArrayXX<std::uint16_t> bf16; ///< the codes if `precision == BF16`, else empty
+    ColMajorArrayXX<std::int8_t> int8; ///< the codes if `precision == INT8`, else empty
+    real_t step = real_t{1}; ///< the value of `int8` code 1
+    IndexArray indices;
+
+public:
+    using Scalar = scalar_t;
+    using StorageIndex = storage_idx_t;
+
+    QuantizedEllMatrix() = default;
+    QuantizedEllMatrix(idx_t rows, idx_t cols, idx_t nnz_per_row, ValuePrecision precision)
+        : _rows(rows), _cols(cols), nnz_per_row(nnz_per_row), precision(precision),
+          indices(aligned_size<storage_idx_t, align_bytes>(rows), nnz_per_row) {
+        if (precision == ValuePrecision::BF16) {
+            bf16 = ColMajorArrayXX<std::uint16_t>::Zero(rows, nnz_per_row);
+        } else {
+            int8 = ColMajorArrayXX<std::int8_t>::Zero(rows, nnz_per_row);
+        }
+    }
+
+    /// An empty matrix means that the values couldn't be quantized (complex scalars)
+    explicit operator bool() const { return indices.size() != 0; }
+
+    idx_t rows() const { return _rows; }
+    idx_t cols() const { return _cols; }
+    idx_t nonZeros() const { return _rows * nnz_per_row; }
+
+    /// Bytes per stored value
+    idx_t value_bytes() const { return precision == ValuePrecision::BF16 ? 2 : 1; }
+
+    scalar_t value(idx_t row, idx_t n) const {
+        if (precision == ValuePrecision::BF16) {
+            return static_cast<real_t>(bf16_to_float(bf16(row, n)));
+        }
+        return step * static_cast<real_t>(int8(row, n));
+    }
+
+    template<class F>
+    void for_each(F lambda) const {
+        for (auto n = 0; n < nnz_per_row; ++n) {
+            for (auto row = 0; row < _rows; ++row) {
+                lambda(row, indices(row, n), value(row, n));
+            }
+        }
+    }
+};
+
+/**
+ Convert an Eigen CSR matrix to a quantized ELLPACK matrix with the given value `precision`
+
+ Only real values are supported: return an empty matrix for complex scalars.
+ */
+template<class scalar_t>
+num::QuantizedEllMatrix<scalar_t> csr_to_quantized_ell(SparseMatrixX<scalar_t> const& csr,
+                                                       ValuePrecision precision) {
+    using real_t = num::get_real_t<scalar_t>;
+    if (is_complex<scalar_t>()) { return {}; }
+
+    auto const indptr = csr.outerIndexPtr();
+    auto const indices = csr.innerIndexPtr();
+    auto const values = csr.valuePtr();
+    auto const nnz = csr.nonZeros();
+
+    auto max_value = real_t{0};
+    for (auto n = idx_t{0}; n < nnz; ++n) {
+        max_value = std::max(max_value, std::abs(std::real(values[n])));
+    }
+
+    auto matrix = num::QuantizedEllMatrix<scalar_t>(csr.rows(), csr.cols(),
+                                                    sparse::max_nnz_per_row(csr), precision);
+    if (max_value > real_t{0}) { matrix.step = max_value / real_t{127}; }
+    for (auto row = storage_idx_t{0}; row < csr.rows(); ++row) {
+        auto slot = idx_t{0};
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n, ++slot) {
+            auto const value = std::real(values[n]);
+            if (precision == ValuePrecision::BF16) {
+                matrix.bf16(row, slot) = float_to_bf16(static_cast<float>(value));
+            } else {
+                auto const code = std::round(value / matrix.step);
+                matrix.int8(row, slot) = static_cast<std::int8_t>(
+                    std::min(std::max(code, real_t{-127}), real_t{127})
+                );
+            }
+            matrix.indices(row, slot) = indices[n];
+        }
+        for (; slot < matrix.nnz_per_row; ++slot) {
+            matrix.indices(row, slot) = row; // padding points to the row itself for locality
+        }
+    }
+    return matrix;
+}
+
+}} // namespace cpb::num
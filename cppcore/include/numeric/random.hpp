@@ -2,6 +2,8 @@
 #include "numeric/dense.hpp"
 #include "support/cppfuture.hpp"
 
+#include <array>
+#include <cstdint>
 #include <random>
 
 namespace cpb { namespace num {
@@ -49,4 +51,104 @@ Container make_random(Size size) {
     return make_random<Container>(size, generator);
 }
 
+/**
+ Philox4x32-10 counter-based random number generator (Salmon et al., SC '11)
+
+ Each output block of four 32-bit numbers is a pure function of the `key` and the `counter`.
+ Any element of a random stream can be computed directly without generating the preceding
+ ones, so independent streams can be filled in parallel without any shared state.
+ */
+class Philox {
+public:
+    using Block = std::array<std::uint32_t, 4>;
+
+    explicit Philox(std::uint64_t key = 0)
+        : key{{static_cast<std::uint32_t>(key), static_cast<std::uint32_t>(key >> 32)}} {}
+
+    Block operator()(Block counter) const {
+        auto k = key;
+        for (auto round = 0; round < 10; ++round) {
+            auto const p0 = std::uint64_t{0xD2511F53} * counter[0];
+            auto const p1 = std::uint64_t{0xCD9E8D57} * counter[2];
+            counter = {{static_cast<std::uint32_t>(p1 >> 32) ^ counter[1] ^ k[0],
+                        static_cast<std::uint32_t>(p1),
+                        static_cast<std::uint32_t>(p0 >> 32) ^ counter[3] ^ k[1],
+                        static_cast<std::uint32_t>(p0)}};
+            k[0] += 0x9E3779B9;
+            k[1] += 0xBB67AE85;
+        }
+        return counter;
+    }
+
+private:
+    std::array<std::uint32_t, 2> key;
+};
+
+namespace detail {
+    /// Map random bits onto the interval [0, 1) with the full precision of the type
+    inline float uniform_real(std::uint32_t a, std::uint32_t, float) {
+        return static_cast<float>(a >> 8) * (1.0f / 16777216.0f);
+    }
+
+    inline double uniform_real(std::uint32_t a, std::uint32_t b, double) {
+        auto const bits = (std::uint64_t{a} << 21) ^ (std::uint64_t{b} >> 11);
+        return static_cast<double>(bits & ((std::uint64_t{1} << 53) - 1))
+               * (1.0 / 9007199254740992.0);
+    }
+}
+
+namespace detail {
+    /// Two elements per block of 4 x 32 bits
+    inline Philox::Block stream_block(Philox const& generator, std::uint64_t stream,
+                                      std::uint64_t index) {
+        auto const block = index / 2;
+        return generator({{static_cast<std::uint32_t>(block),
+                           static_cast<std::uint32_t>(block >> 32),
+                           static_cast<std::uint32_t>(stream),
+                           static_cast<std::uint32_t>(stream >> 32)}});
+    }
+}
+
+/**
+ Fill the container with data uniformly distributed on the interval [0, 1)
+
+ The values are elements `[start, start + size)` of random stream number `stream`: the same
+ `generator` key and `stream` always produce the same values regardless of where or when it's
+ called. E.g. filling `[0, 100)` at once or `[0, 50)` and `[50, 100)` separately is identical.
+ */
+template<class Container>
+void random_fill(Container& container, Philox const& generator, std::uint64_t stream,
+                 std::uint64_t start = 0) {
+    using real_t = detail::get_element_t<Container>;
+    static_assert(std::is_floating_point<real_t>::value, "");
+
+    auto const size = static_cast<std::uint64_t>(container.size());
+    for (auto i = std::uint64_t{0}; i < size;) {
+        auto const index = start + i;
+        auto const bits = detail::stream_block(generator, stream, index);
+        if (index % 2 == 0) {
+            container[i++] = detail::uniform_real(bits[0], bits[1], real_t{});
+        }
+        if (i < size) {
+            container[i++] = detail::uniform_real(bits[2], bits[3], real_t{});
+        }
+    }
+}
+
+template<class Container, class Size>
+Container make_random(Size size, Philox const& generator, std::uint64_t stream,
+                      std::uint64_t start = 0) {
+    auto container = Container(size);
+    random_fill(container, generator, stream, start);
+    return container;
+}
+
+/// Element `index` of random stream `stream`: the same as `make_random()` but for a single value
+template<class real_t>
+real_t random_uniform(Philox const& generator, std::uint64_t stream, std::uint64_t index) {
+    auto const bits = detail::stream_block(generator, stream, index);
+    return index % 2 == 0 ? detail::uniform_real(bits[0], bits[1], real_t{})
+                          : detail::uniform_real(bits[2], bits[3], real_t{});
+}
+
 }} // namespace cpb::num
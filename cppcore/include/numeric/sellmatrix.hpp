@@ -0,0 +1,167 @@
+#pragma once
+#include "numeric/dense.hpp"
+#include "numeric/sparse.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+namespace cpb { namespace num {
+
+/**
+ SELL-C-sigma format sparse matrix (sliced ELLPACK with local row sorting)
+
+ Rows are grouped into chunks of `chunk_size` (C) rows which are stored like small ELLPACK
+ matrices: column-major within the chunk and padded only up to the longest row of that chunk.
+ Before chunking, the rows inside each sorting window of (at most) `sigma` rows are sorted
+ by their number of non-zeros so that rows of similar length share a chunk and padding is
+ minimized. Sorting windows never cross the given border indices (e.g. KPM slice borders)
+ which means that any row range `[start, end)` made up of borders maps onto whole windows.
+
+ The rows are not physically reordered: each chunk slot records its row index and vectors
+ keep their original ordering. Padding slots of partially filled chunks have a row index -1.
+ */
+template<class scalar_t>
+class SellMatrix {
+public:
+    idx_t _rows, _cols;
+    idx_t chunk_size; ///< C -- number of rows in a chunk
+    idx_t sigma; ///< maximum number of rows in a sorting window
+    std::vector<storage_idx_t> window_starts; ///< first row of each window (+ end sentinel)
+    std::vector<storage_idx_t> window_chunks; ///< first chunk of each window (+ end sentinel)
+    std::vector<storage_idx_t> chunk_offsets; ///< start of each chunk in `data` (+ end sentinel)
+    std::vector<storage_idx_t> chunk_widths; ///< padded number of non-zeros per row of a chunk
+    ArrayX<storage_idx_t> row_indices; ///< row index of each chunk slot (`chunk_size` per chunk)
+    ArrayX<scalar_t> data;
+    ArrayX<storage_idx_t> indices;
+
+public:
+    using Scalar = scalar_t;
+    using StorageIndex = storage_idx_t;
+
+    SellMatrix() = default;
+    SellMatrix(idx_t rows, idx_t cols, idx_t chunk_size, idx_t sigma)
+        : _rows(rows), _cols(cols), chunk_size(chunk_size), sigma(sigma) {}
+
+    idx_t rows() const { return _rows; }
+    idx_t cols() const { return _cols; }
+    idx_t nonZeros() const { return data.size(); }
+    idx_t num_chunks() const { return static_cast<idx_t>(chunk_widths.size()); }
+    idx_t num_windows() const { return static_cast<idx_t>(window_starts.size()) - 1; }
+
+    /// Stored elements (including padding) of the windows which start before `rows`
+    idx_t nonZeros(idx_t rows) const {
+        auto const w = std::lower_bound(window_starts.begin(), window_starts.end() - 1, rows);
+        return chunk_offsets[window_chunks[w - window_starts.begin()]];
+    }
+
+    /// Return the range of windows `[first, last)` which overlap the rows `[start, end)`
+    std::pair<idx_t, idx_t> windows(idx_t start, idx_t end) const {
+        if (start >= end) { return {0, 0}; }
+        auto const first = std::upper_bound(window_starts.begin(), window_starts.end(), start);
+        auto const last = std::lower_bound(first, window_starts.end(), end);
+        return {static_cast<idx_t>(first - window_starts.begin()) - 1,
+                static_cast<idx_t>(last - window_starts.begin())};
+    }
+
+    /// Are all the rows of window `w` inside the range `[start, end)`?
+    bool window_inside(idx_t w, idx_t start, idx_t end) const {
+        return start <= window_starts[w] && window_starts[w + 1] <= end;
+    }
+
+    /// Is every slot of chunk `c` occupied by a row?
+    bool chunk_full(idx_t c) const { return row_indices[(c + 1) * chunk_size - 1] >= 0; }
+
+    template<class F>
+    void for_each(F lambda) const {
+        for (auto c = 0; c < num_chunks(); ++c) {
+            auto const offset = chunk_offsets[c];
+            for (auto j = 0; j < chunk_widths[c]; ++j) {
+                for (auto lane = 0; lane < chunk_size; ++lane) {
+                    auto const row = row_indices[c * chunk_size + lane];
+                    if (row < 0) { continue; }
+                    auto const n = offset + j * chunk_size + lane;
+                    lambda(row, indices[n], data[n]);
+                }
+            }
+        }
+    }
+};
+
+/**
+ Convert an Eigen CSR matrix to SELL-C-sigma
+
+ The `borders` are row indices which the sorting windows must not cross,
+ e.g. the KPM slice borders. The last border is always the number of rows.
+ */
+template<class scalar_t>
+num::SellMatrix<scalar_t> csr_to_sell(SparseMatrixX<scalar_t> const& csr, idx_t chunk_size,
+                                      idx_t sigma, std::vector<storage_idx_t> const& borders) {
+    auto sell = num::SellMatrix<scalar_t>(csr.rows(), csr.cols(), chunk_size, sigma);
+    auto const indptr = csr.outerIndexPtr();
+    auto const row_nnz = [&](storage_idx_t row) { return indptr[row + 1] - indptr[row]; };
+
+    // Split the rows into sorting windows
+    auto window_start = storage_idx_t{0};
+    auto add_windows = [&](storage_idx_t border) {
+        for (; window_start < border; window_start += static_cast<storage_idx_t>(sigma)) {
+            sell.window_starts.push_back(window_start);
+        }
+        window_start = border;
+    };
+    for (auto const border : borders) {
+        add_windows(std::min(border, static_cast<storage_idx_t>(csr.rows())));
+    }
+    add_windows(static_cast<storage_idx_t>(csr.rows()));
+    sell.window_starts.push_back(static_cast<storage_idx_t>(csr.rows()));
+
+    // Sort the rows by descending number of non-zeros within each window
+    auto sorted_rows = std::vector<storage_idx_t>(csr.rows());
+    std::iota(sorted_rows.begin(), sorted_rows.end(), 0);
+    auto num_slots = idx_t{0};
+    for (auto w = 0; w < sell.num_windows(); ++w) {
+        auto const first = sorted_rows.begin() + sell.window_starts[w];
+        auto const last = sorted_rows.begin() + sell.window_starts[w + 1];
+        std::stable_sort(first, last, [&](storage_idx_t a, storage_idx_t b) {
+            return row_nnz(a) > row_nnz(b);
+        });
+
+        sell.window_chunks.push_back(static_cast<storage_idx_t>(sell.chunk_widths.size()));
+        for (auto it = first; it < last; it += std::min(last - it, chunk_size)) {
+            sell.chunk_offsets.push_back(static_cast<storage_idx_t>(num_slots));
+            sell.chunk_widths.push_back(row_nnz(*it)); // the longest row goes first
+            num_slots += chunk_size * row_nnz(*it);
+        }
+    }
+    sell.window_chunks.push_back(static_cast<storage_idx_t>(sell.chunk_widths.size()));
+    sell.chunk_offsets.push_back(static_cast<storage_idx_t>(num_slots));
+
+    // Fill the chunks: padding elements are zero and point to the row itself for locality
+    sell.row_indices = ArrayX<storage_idx_t>::Constant(sell.num_chunks() * chunk_size, -1);
+    sell.data = ArrayX<scalar_t>::Zero(num_slots);
+    sell.indices = ArrayX<storage_idx_t>::Zero(num_slots);
+
+    auto const loop = sparse::make_loop(csr);
+    for (auto w = 0; w < sell.num_windows(); ++w) {
+        auto const window_size = sell.window_starts[w + 1] - sell.window_starts[w];
+        for (auto i = 0; i < window_size; ++i) {
+            auto const row = sorted_rows[sell.window_starts[w] + i];
+            auto const c = sell.window_chunks[w] + i / chunk_size;
+            auto const lane = i % chunk_size;
+            auto const offset = sell.chunk_offsets[c] + lane;
+            sell.row_indices[c * chunk_size + lane] = row;
+
+            auto j = idx_t{0};
+            loop.for_each_in_row(row, [&](storage_idx_t col, scalar_t value) {
+                sell.data[offset + j * chunk_size] = value;
+                sell.indices[offset + j * chunk_size] = col;
+                ++j;
+            });
+            for (; j < sell.chunk_widths[c]; ++j) {
+                sell.indices[offset + j * chunk_size] = row;
+            }
+        }
+    }
+    return sell;
+}
+
+}} // namespace cpb::num
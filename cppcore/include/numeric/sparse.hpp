@@ -4,6 +4,12 @@
 
 #include <Eigen/SparseCore>
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <vector>
+
 namespace cpb {
 
 template <class scalar_t>
@@ -24,8 +30,9 @@ using num::ComplexEllConstRef;
  */
 template<class scalar_t>
 inline num::CsrConstRef<scalar_t> csrref(SparseMatrixX<scalar_t> const& m) {
-    return {static_cast<int>(m.rows()), static_cast<int>(m.cols()), static_cast<int>(m.nonZeros()),
-            m.valuePtr(), m.innerIndexPtr(), m.outerIndexPtr()};
+    using index_t = storage_idx_t;
+    return {static_cast<index_t>(m.rows()), static_cast<index_t>(m.cols()),
+            static_cast<index_t>(m.nonZeros()), m.valuePtr(), m.innerIndexPtr(), m.outerIndexPtr()};
 };
 
 template<class scalar_t>
@@ -91,6 +98,110 @@ inline SparseMatrixX<float> force_cast<float>(SparseMatrixXcd const& m) {
     return m.real().cast<float>();
 }
 
+/// Energy bounds of a Hermitian `h` from the Gershgorin circles, computed in a single pass.
+/// They are never narrower than the spectrum (but they may be wider, unlike Lanczos bounds).
+template<class scalar_t>
+std::pair<double, double> gershgorin_bounds(SparseMatrixX<scalar_t> const& h) {
+    if (h.rows() == 0) { return {0, 0}; }
+
+    auto const data = h.valuePtr();
+    auto const indices = h.innerIndexPtr();
+    auto const indptr = h.outerIndexPtr();
+    auto min = std::numeric_limits<double>::max();
+    auto max = std::numeric_limits<double>::lowest();
+    for (auto row = idx_t{0}; row < h.rows(); ++row) {
+        auto center = 0.0, radius = 0.0;
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            if (indices[n] == row) {
+                center += static_cast<double>(std::real(data[n]));
+            } else {
+                radius += static_cast<double>(std::abs(data[n]));
+            }
+        }
+        min = std::min(min, center - radius);
+        max = std::max(max, center + radius);
+    }
+    return {min, max};
+}
+
+/**
+ The largest absolute row sum of `a - b` (infinity norm)
+
+ For Hermitian matrices, it's an upper bound of the spectral norm of the difference, so no
+ eigenvalue moves by more than this (Weyl's inequality). The rows are merged by column index
+ so the sparsity patterns don't need to match. The matrices must be compressed.
+ */
+template<class scalar_t>
+double difference_norm(SparseMatrixX<scalar_t> const& a, SparseMatrixX<scalar_t> const& b) {
+    if (a.rows() != b.rows() || a.cols() != b.cols()) {
+        return std::numeric_limits<double>::infinity();
+    }
+
+    auto norm = 0.0;
+    for (auto row = idx_t{0}; row < a.rows(); ++row) {
+        auto i = a.outerIndexPtr()[row], i_end = a.outerIndexPtr()[row + 1];
+        auto j = b.outerIndexPtr()[row], j_end = b.outerIndexPtr()[row + 1];
+        auto sum = 0.0;
+        while (i < i_end || j < j_end) {
+            auto const col_a = i < i_end ? a.innerIndexPtr()[i] : a.cols();
+            auto const col_b = j < j_end ? b.innerIndexPtr()[j] : b.cols();
+            if (col_a == col_b) {
+                sum += static_cast<double>(std::abs(a.valuePtr()[i++] - b.valuePtr()[j++]));
+            } else if (col_a < col_b) {
+                sum += static_cast<double>(std::abs(a.valuePtr()[i++]));
+            } else {
+                sum += static_cast<double>(std::abs(b.valuePtr()[j++]));
+            }
+        }
+        norm = std::max(norm, sum);
+    }
+    return norm;
+}
+
+/**
+ Greedy distance-`distance` coloring of the graph given by the sparsity pattern of `h`
+
+ Any two rows which are connected by a path of at most `distance` nonzero elements get
+ different colors, numbered from 0 in the order of the rows. Each row searches its
+ neighborhood breadth-first, so the cost is the rows times the size of the neighborhood.
+ The pattern should be symmetric (e.g. a Hermitian matrix) and the matrix compressed.
+ */
+template<class scalar_t>
+std::vector<storage_idx_t> distance_coloring(SparseMatrixX<scalar_t> const& h, idx_t distance) {
+    auto const indices = h.innerIndexPtr();
+    auto const indptr = h.outerIndexPtr();
+    auto const size = static_cast<size_t>(h.rows());
+
+    auto colors = std::vector<storage_idx_t>(size, -1);
+    auto visited = std::vector<idx_t>(size, -1); ///< the last row which reached this one
+    auto forbidden = std::vector<idx_t>(); ///< the last row which found this color nearby
+    auto frontier = std::vector<storage_idx_t>();
+    auto next = std::vector<storage_idx_t>();
+    for (auto row = idx_t{0}; row < h.rows(); ++row) {
+        visited[row] = row;
+        frontier.assign(1, static_cast<storage_idx_t>(row));
+        for (auto step = idx_t{0}; step < distance && !frontier.empty(); ++step) {
+            next.clear();
+            for (auto const v : frontier) {
+                for (auto n = indptr[v]; n < indptr[v + 1]; ++n) {
+                    auto const u = indices[n];
+                    if (visited[u] == row) { continue; }
+                    visited[u] = row;
+                    next.push_back(u);
+                    if (colors[u] >= 0) { forbidden[colors[u]] = row; }
+                }
+            }
+            std::swap(frontier, next);
+        }
+
+        auto color = size_t{0};
+        while (color < forbidden.size() && forbidden[color] == row) { ++color; }
+        if (color == forbidden.size()) { forbidden.push_back(-1); }
+        colors[row] = static_cast<storage_idx_t>(color);
+    }
+    return colors;
+}
+
 } // namespace num
 
 namespace sparse {
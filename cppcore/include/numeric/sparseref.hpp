@@ -9,9 +9,9 @@ namespace detail {
      Reference to CSR matrix of any type
      */
     struct BasicCsrConstRef {
-        int const rows;
-        int const cols;
-        int const nnz;
+        storage_idx_t const rows;
+        storage_idx_t const cols;
+        storage_idx_t const nnz;
         void const* const void_data;
         storage_idx_t const* const indices;
         storage_idx_t const* const indptr;
@@ -25,7 +25,7 @@ template<class scalar_t>
 struct CsrConstRef : detail::BasicCsrConstRef {
     using type = scalar_t;
 
-    CsrConstRef(int rows, int cols, int nnz, scalar_t const* data,
+    CsrConstRef(storage_idx_t rows, storage_idx_t cols, storage_idx_t nnz, scalar_t const* data,
                 storage_idx_t const* indices, storage_idx_t const* indptr)
         : detail::BasicCsrConstRef{rows, cols, nnz, data, indices, indptr} {}
 
@@ -44,7 +44,7 @@ struct AnyCsrConstRef : detail::BasicCsrConstRef {
 
     ArrayConstRef data_ref() const { return {void_data, tag, 1, true, nnz}; }
     ArrayConstRef indices_ref() const { return arrayref(indices, nnz); }
-    ArrayConstRef indptr_ref() const { return arrayref(indptr, rows + 1); }
+    ArrayConstRef indptr_ref() const { return arrayref(indptr, idx_t{rows} + 1); }
 };
 
 /**
@@ -71,14 +71,14 @@ namespace detail {
      Reference to ELLPACK matrix of any type
      */
     struct BasicEllConstRef {
-        int const rows;
-        int const cols;
-        int const nnz_per_row;
-        int const pitch;
+        storage_idx_t const rows;
+        storage_idx_t const cols;
+        storage_idx_t const nnz_per_row;
+        storage_idx_t const pitch;
         void const* const void_data;
         storage_idx_t const* const indices;
 
-        int size() const { return nnz_per_row * pitch; }
+        idx_t size() const { return nnz_per_row * pitch; }
     };
 } // namespace detail
 
@@ -89,8 +89,8 @@ template<class scalar_t>
 struct EllConstRef : detail::BasicEllConstRef {
     using type = scalar_t;
 
-    EllConstRef(int rows, int cols, int nnz_per_row, int pitch,
-                scalar_t const* data, storage_idx_t const* indices)
+    EllConstRef(storage_idx_t rows, storage_idx_t cols, storage_idx_t nnz_per_row,
+                storage_idx_t pitch, scalar_t const* data, storage_idx_t const* indices)
         : detail::BasicEllConstRef{rows, cols, nnz_per_row, pitch, data, indices} {}
 
     scalar_t const* data() const { return static_cast<scalar_t const*>(void_data); }
@@ -0,0 +1,111 @@
+#pragma once
+#include "numeric/dense.hpp"
+#include "numeric/sparse.hpp"
+#include "numeric/traits.hpp"
+
+#include <limits>
+#include <type_traits>
+
+namespace cpb { namespace num {
+
+/**
+ ELLPACK format sparse matrix with separate real and imaginary planes (structure of arrays)
+
+ Interleaved `std::complex` values need a few shuffles for each SIMD complex multiplication
+ to line up the real and imaginary parts. Here, `real(row, n)` and `imag(row, n)` are kept in
+ different arrays. The column index is stored premultiplied as the offset of the real part in
+ the interleaved vector `x` viewed as an array of `real_t`: `offsets(row, n) == 2 * col`.
+ Both parts of `x` are then gathered directly into separate registers and the products are
+ plain multiply-adds. For real scalars, `imag` is empty and `offsets(row, n) == col`.
+ Padding elements are zero with the offset of column 0.
+ */
+template<class scalar_t>
+class SplitEllMatrix {
+    using real_t = get_real_t<scalar_t>;
+    using PlaneArray = ColMajorArrayXX<real_t>;
+    using OffsetArray = ColMajorArrayXX<storage_idx_t>;
+    static constexpr auto align_bytes = 64; ///< column alignment, enough for AVX-512 registers
+
+public:
+    /// Number of `real_t` elements per `scalar_t`: the stride of the `offsets`
+    static constexpr auto components = static_cast<storage_idx_t>(is_complex<scalar_t>() ? 2 : 1);
+
+    idx_t _rows, _cols;
+    idx_t nnz_per_row;
+    PlaneArray real;
+    PlaneArray imag;
+    OffsetArray offsets;
+
+public:
+    using Scalar = scalar_t;
+    using StorageIndex = storage_idx_t;
+
+    SplitEllMatrix() = default;
+    SplitEllMatrix(idx_t rows, idx_t cols, idx_t nnz_per_row)
+        : _rows(rows), _cols(cols), nnz_per_row(nnz_per_row) {
+        auto const aligned_rows = aligned_size<real_t, align_bytes>(rows);
+        real = PlaneArray::Zero(aligned_rows, nnz_per_row);
+        imag = PlaneArray::Zero(components == 2 ? aligned_rows : 0, nnz_per_row);
+        offsets = OffsetArray::Zero(aligned_rows, nnz_per_row);
+    }
+
+    /// An empty matrix means that the offsets don't fit the 32-bit indices
+    explicit operator bool() const { return offsets.size() != 0; }
+
+    idx_t rows() const { return _rows; }
+    idx_t cols() const { return _cols; }
+    idx_t nonZeros() const { return _rows * nnz_per_row; }
+
+    storage_idx_t col(idx_t row, idx_t n) const { return offsets(row, n) / components; }
+    scalar_t value(idx_t row, idx_t n) const {
+        return make_value(real(row, n), components == 2 ? imag(row, n) : real_t{0},
+                          std::integral_constant<bool, is_complex<scalar_t>()>{});
+    }
+
+    template<class F>
+    void for_each(F lambda) const {
+        for (auto n = 0; n < nnz_per_row; ++n) {
+            for (auto row = 0; row < _rows; ++row) {
+                lambda(row, col(row, n), value(row, n));
+            }
+        }
+    }
+
+private:
+    static real_t make_value(real_t re, real_t, std::false_type) { return re; }
+    static std::complex<real_t> make_value(real_t re, real_t im, std::true_type) {
+        return {re, im};
+    }
+};
+
+template<class scalar_t>
+constexpr storage_idx_t SplitEllMatrix<scalar_t>::components;
+
+/**
+ Convert an Eigen CSR matrix to ELLPACK with split real and imaginary planes
+
+ Return an empty matrix if the premultiplied offsets would overflow `storage_idx_t`.
+ */
+template<class scalar_t>
+num::SplitEllMatrix<scalar_t> csr_to_split_ell(SparseMatrixX<scalar_t> const& csr) {
+    using Matrix = num::SplitEllMatrix<scalar_t>;
+    auto const max_cols = std::numeric_limits<storage_idx_t>::max() / Matrix::components;
+    if (csr.cols() > max_cols) { return {}; }
+
+    auto const indptr = csr.outerIndexPtr();
+    auto const indices = csr.innerIndexPtr();
+    auto const values = csr.valuePtr();
+
+    auto matrix = Matrix(csr.rows(), csr.cols(), sparse::max_nnz_per_row(csr));
+    for (auto row = storage_idx_t{0}; row < csr.rows(); ++row) {
+        auto slot = idx_t{0};
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n, ++slot) {
+            matrix.real(row, slot) = std::real(values[n]);
+            if (Matrix::components == 2) { matrix.imag(row, slot) = std::imag(values[n]); }
+            matrix.offsets(row, slot) = Matrix::components * indices[n];
+        }
+    }
+    return matrix;
+}
+
+}} // namespace cpb::num
@@ -0,0 +1,194 @@
+#pragma once
+#include "numeric/dense.hpp"
+#include "numeric/sparse.hpp"
+
+#include <algorithm>
+
+namespace cpb { namespace num {
+
+/**
+ Neighbor pattern of a translationally invariant lattice grid of `size` unit cells
+
+ The site indices are ordered like the `Foundation`: sublattice first followed by the
+ `c`, `b` and `a` lattice vector indices, i.e. `sub * size.prod() + (c * nb + b) * na + a`.
+ Each sublattice lists the offsets to its neighbors (`OptimizedUnitCell` relative indices).
+ */
+struct StencilPattern {
+    struct Offset {
+        Index3D relative_index;
+        storage_idx_t to_sub; ///< destination sublattice
+    };
+
+    Index3D size = Index3D::Zero(); ///< number of unit cells in each lattice vector direction
+    std::vector<std::vector<Offset>> sublattices;
+
+    explicit operator bool() const { return !sublattices.empty(); }
+    idx_t rows() const { return size.prod() * static_cast<idx_t>(sublattices.size()); }
+};
+
+/**
+ Matrix-free operator for the Hamiltonian of a pristine lattice grid with open boundaries
+
+ All the rows of a sublattice have identical elements: each term is a `value` at a column
+ offset `shift` relative to the row. A term is applied only where the neighbor is inside of
+ the grid, i.e. when the `(a, b, c)` indices of the row are within `[lower, upper)`.
+ The storage depends only on the unit cell and not on the size of the system.
+ */
+template<class scalar_t>
+class StencilMatrix {
+public:
+    struct Term {
+        Index3D lower; ///< first `(a, b, c)` index where the neighbor exists
+        Index3D upper; ///< one past the last `(a, b, c)` index where the neighbor exists
+        idx_t shift; ///< column - row
+        scalar_t value;
+    };
+
+    Index3D size = Index3D::Zero();
+    std::vector<storage_idx_t> term_starts; ///< first term of each sublattice (+ end sentinel)
+    std::vector<Term> terms;
+
+public:
+    using Scalar = scalar_t;
+    using StorageIndex = storage_idx_t;
+
+    explicit operator bool() const { return !term_starts.empty(); }
+
+    idx_t rows() const { return size.prod() * num_sublattices(); }
+    idx_t cols() const { return rows(); }
+    idx_t num_sublattices() const {
+        return term_starts.empty() ? 0 : static_cast<idx_t>(term_starts.size()) - 1;
+    }
+
+    /// Number of elements which the operator would have as an explicit sparse matrix
+    idx_t nonZeros() const {
+        auto result = idx_t{0};
+        for (auto const& t : terms) {
+            result += Array3i(t.upper - t.lower).cast<idx_t>().prod();
+        }
+        return result;
+    }
+
+    template<class T>
+    StencilMatrix<T> cast() const {
+        auto result = StencilMatrix<T>();
+        result.size = size;
+        result.term_starts = term_starts;
+        for (auto const& t : terms) {
+            result.terms.push_back({t.lower, t.upper, t.shift, static_cast<T>(t.value)});
+        }
+        return result;
+    }
+
+    /// Call `lambda(row, col, value)` for each element
+    template<class F>
+    void for_each(F lambda) const {
+        auto const block = size.prod();
+        for (auto sub = idx_t{0}; sub < num_sublattices(); ++sub) {
+            for (auto c = 0; c < size[2]; ++c) {
+                for (auto b = 0; b < size[1]; ++b) {
+                    for (auto a = 0; a < size[0]; ++a) {
+                        auto const row = sub * block + (c * size[1] + b) * size[0] + a;
+                        for (auto t = term_starts[sub]; t < term_starts[sub + 1]; ++t) {
+                            auto const& term = terms[t];
+                            if (a < term.lower[0] || a >= term.upper[0]
+                                || b < term.lower[1] || b >= term.upper[1]
+                                || c < term.lower[2] || c >= term.upper[2]) { continue; }
+                            lambda(row, row + term.shift, term.value);
+                        }
+                    }
+                }
+            }
+        }
+    }
+};
+
+/**
+ Convert an Eigen CSR matrix to a matrix-free `StencilMatrix` with the given neighbor `pattern`
+
+ Every element of the CSR matrix must be part of the pattern and all the rows of a sublattice
+ must have the same values (missing elements count as zero). This doesn't hold if defects,
+ modifiers or generators break the translational invariance: an empty matrix is returned.
+ */
+template<class scalar_t>
+StencilMatrix<scalar_t> csr_to_stencil(SparseMatrixX<scalar_t> const& csr,
+                                       StencilPattern const& pattern) {
+    if (!pattern || csr.rows() != pattern.rows() || csr.cols() != pattern.rows()) { return {}; }
+
+    auto stencil = StencilMatrix<scalar_t>();
+    auto const& n = pattern.size;
+    stencil.size = n;
+    auto const block = n.prod();
+
+    // The onsite term is always present: the KPM scaling adds a diagonal to every row
+    for (auto sub = idx_t{0}; sub < static_cast<idx_t>(pattern.sublattices.size()); ++sub) {
+        stencil.term_starts.push_back(static_cast<storage_idx_t>(stencil.terms.size()));
+
+        auto offsets = pattern.sublattices[sub];
+        offsets.insert(offsets.begin(), {Index3D::Zero(), static_cast<storage_idx_t>(sub)});
+        for (auto i = size_t{0}; i < offsets.size(); ++i) {
+            auto const& d = offsets[i].relative_index;
+            auto const is_duplicate = std::any_of(offsets.begin(), offsets.begin() + i,
+                                                  [&](StencilPattern::Offset const& o) {
+                return o.relative_index == d && o.to_sub == offsets[i].to_sub;
+            });
+            if (is_duplicate) { continue; }
+
+            auto const lower = Index3D(Array3i(-d).max(0));
+            auto const upper = Index3D(Array3i(n - d).min(Array3i(n)));
+            if ((Array3i(lower) >= Array3i(upper)).any()) { continue; } // never inside
+
+            auto const shift = (offsets[i].to_sub - sub) * block
+                               + (idx_t{d[2]} * n[1] + d[1]) * n[0] + d[0];
+            stencil.terms.push_back({lower, upper, shift, scalar_t{0}});
+        }
+    }
+    stencil.term_starts.push_back(static_cast<storage_idx_t>(stencil.terms.size()));
+
+    // Verify that the pattern reproduces the CSR matrix and extract the values
+    auto const indptr = csr.outerIndexPtr();
+    auto const indices = csr.innerIndexPtr();
+    auto const data = csr.valuePtr();
+    auto is_set = std::vector<bool>(stencil.terms.size(), false);
+
+    auto row = idx_t{0};
+    for (auto sub = idx_t{0}; sub < stencil.num_sublattices(); ++sub) {
+        for (auto c = 0; c < n[2]; ++c) {
+            for (auto b = 0; b < n[1]; ++b) {
+                for (auto a = 0; a < n[0]; ++a, ++row) {
+                    auto const row_begin = indices + indptr[row];
+                    auto const row_end = indices + indptr[row + 1];
+                    auto num_matched = idx_t{0};
+
+                    for (auto t = stencil.term_starts[sub]; t < stencil.term_starts[sub + 1]; ++t) {
+                        auto& term = stencil.terms[t];
+                        if (a < term.lower[0] || a >= term.upper[0]
+                            || b < term.lower[1] || b >= term.upper[1]
+                            || c < term.lower[2] || c >= term.upper[2]) { continue; }
+
+                        auto const col = static_cast<storage_idx_t>(row + term.shift);
+                        auto const it = std::lower_bound(row_begin, row_end, col);
+                        auto value = scalar_t{0};
+                        if (it != row_end && *it == col) {
+                            value = data[it - indices];
+                            ++num_matched;
+                        }
+
+                        if (!is_set[t]) {
+                            term.value = value;
+                            is_set[t] = true;
+                        } else if (value != term.value) {
+                            return {};
+                        }
+                    }
+
+                    if (num_matched != row_end - row_begin) { return {}; }
+                }
+            }
+        }
+    }
+
+    return stencil;
+}
+
+}} // namespace cpb::num
@@ -0,0 +1,161 @@
+#pragma once
+#include "numeric/dense.hpp"
+#include "numeric/sparse.hpp"
+#include "numeric/traits.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+
+namespace cpb { namespace num {
+
+/**
+ ELLPACK format sparse matrix which stores an 8-bit value ID instead of the value itself
+
+ Pristine lattices have only a handful of distinct Hamiltonian elements (the onsite and
+ hopping family energies) so every element is replaced by the index of its value in
+ a small `table`. ID 0 is reserved for zero (padding). Elements with values which
+ don't fit in the table (e.g. changed by modifiers) are kept in full as the `escaped`
+ CSR matrix which is added to the result. The table and escaped parts are disjoint.
+ */
+template<class scalar_t>
+class TableEllMatrix {
+    using IdArray = ColMajorArrayXX<std::uint8_t>;
+    using IndexArray = ColMajorArrayXX<storage_idx_t>;
+
+public:
+    static constexpr auto max_table_size = idx_t{256};
+
+    idx_t _rows, _cols;
+    idx_t nnz_per_row;
+    IdArray ids;
+    IndexArray indices;
+    ArrayX<scalar_t> table; ///< value of each ID, `table[0] == 0`
+    SparseMatrixX<scalar_t> escaped; ///< elements which are not in the table
+
+public:
+    using Scalar = scalar_t;
+    using StorageIndex = storage_idx_t;
+
+    TableEllMatrix() = default;
+    TableEllMatrix(idx_t rows, idx_t cols, idx_t nnz_per_row)
+        : _rows(rows), _cols(cols), nnz_per_row(nnz_per_row),
+          ids(IdArray::Zero(rows, nnz_per_row)), indices(rows, nnz_per_row),
+          escaped(rows, cols) {}
+
+    /// An empty matrix means that the values couldn't be compressed
+    explicit operator bool() const { return table.size() != 0; }
+
+    idx_t rows() const { return _rows; }
+    idx_t cols() const { return _cols; }
+    idx_t nonZeros() const { return _rows * nnz_per_row + escaped.nonZeros(); }
+    /// Stored elements of the rows `[0, rows)`
+    idx_t nonZeros(idx_t rows) const {
+        return rows * nnz_per_row + escaped.outerIndexPtr()[rows];
+    }
+
+    template<class F>
+    void for_each(F lambda) const {
+        for (auto n = 0; n < nnz_per_row; ++n) {
+            for (auto row = 0; row < _rows; ++row) {
+                lambda(row, indices(row, n), table[ids(row, n)]);
+            }
+        }
+        sparse::make_loop(escaped).for_each(lambda);
+    }
+};
+
+template<class scalar_t>
+constexpr idx_t TableEllMatrix<scalar_t>::max_table_size;
+
+namespace detail {
+    template<class scalar_t>
+    struct ValueHash {
+        std::size_t operator()(scalar_t value) const {
+            using real_t = num::get_real_t<scalar_t>;
+            auto const h = std::hash<real_t>();
+            return h(std::real(value)) ^ (h(std::imag(value)) << 1);
+        }
+    };
+} // namespace detail
+
+/**
+ Convert an Eigen CSR matrix to a value table ELLPACK matrix
+
+ The most frequent values make up the table. Return an empty matrix if more than
+ `max_escaped_fraction` of the non-zeros have values which don't fit in the table.
+ */
+template<class scalar_t>
+num::TableEllMatrix<scalar_t> csr_to_table_ell(SparseMatrixX<scalar_t> const& csr,
+                                               double max_escaped_fraction = 0.25) {
+    using Map = std::unordered_map<scalar_t, idx_t, detail::ValueHash<scalar_t>>;
+    constexpr auto max_table_size = num::TableEllMatrix<scalar_t>::max_table_size;
+    auto const nnz = csr.nonZeros();
+    auto const data = csr.valuePtr();
+    auto const max_distinct = static_cast<idx_t>(max_escaped_fraction * nnz) + max_table_size;
+
+    // Count the occurrences of each value -- give up early if there are too many distinct ones
+    auto counts = Map();
+    for (auto n = idx_t{0}; n < nnz; ++n) {
+        if (data[n] == scalar_t{0}) { continue; } // ID 0
+        ++counts[data[n]];
+        if (static_cast<idx_t>(counts.size()) > max_distinct) { return {}; }
+    }
+
+    auto sorted = std::vector<std::pair<scalar_t, idx_t>>(counts.begin(), counts.end());
+    std::sort(sorted.begin(), sorted.end(), [](std::pair<scalar_t, idx_t> const& a,
+                                               std::pair<scalar_t, idx_t> const& b) {
+        return a.second > b.second;
+    });
+    auto const table_size = std::min(static_cast<idx_t>(sorted.size()) + 1, max_table_size);
+    auto num_escaped = idx_t{0};
+    for (auto i = table_size - 1; i < static_cast<idx_t>(sorted.size()); ++i) {
+        num_escaped += sorted[i].second;
+    }
+    if (num_escaped > max_escaped_fraction * nnz) { return {}; }
+
+    auto ids = Map();
+    auto table = ArrayX<scalar_t>::Zero(table_size).eval();
+    for (auto i = idx_t{1}; i < table_size; ++i) {
+        table[i] = sorted[i - 1].first;
+        ids[sorted[i - 1].first] = i;
+    }
+
+    // Split the rows into the table and escaped parts
+    auto const indptr = csr.outerIndexPtr();
+    auto max_row_nnz = idx_t{0};
+    auto escaped = std::vector<Eigen::Triplet<scalar_t>>();
+    escaped.reserve(num_escaped);
+    for (auto row = storage_idx_t{0}; row < csr.rows(); ++row) {
+        auto row_nnz = idx_t{0};
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            if (data[n] == scalar_t{0} || ids.count(data[n])) {
+                ++row_nnz;
+            } else {
+                escaped.emplace_back(row, csr.innerIndexPtr()[n], data[n]);
+            }
+        }
+        max_row_nnz = std::max(max_row_nnz, row_nnz);
+    }
+
+    auto matrix = num::TableEllMatrix<scalar_t>(csr.rows(), csr.cols(), max_row_nnz);
+    matrix.table = std::move(table);
+    matrix.escaped.setFromTriplets(escaped.begin(), escaped.end());
+    matrix.escaped.makeCompressed();
+    for (auto row = storage_idx_t{0}; row < csr.rows(); ++row) {
+        auto slot = idx_t{0};
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            auto const it = ids.find(data[n]);
+            if (data[n] != scalar_t{0} && it == ids.end()) { continue; } // escaped
+            matrix.ids(row, slot) = static_cast<std::uint8_t>(it != ids.end() ? it->second : 0);
+            matrix.indices(row, slot) = csr.innerIndexPtr()[n];
+            ++slot;
+        }
+        for (; slot < max_row_nnz; ++slot) {
+            matrix.indices(row, slot) = row; // padding points to the row itself for locality
+        }
+    }
+    return matrix;
+}
+
+}} // namespace cpb::num
@@ -22,6 +22,12 @@ namespace detail {
         using complex_t = std::complex<T>;
         static constexpr bool is_complex = true;
     };
+
+    template<class T, class real_t>
+    struct with_real { using type = real_t; };
+
+    template<class T, class real_t>
+    struct with_real<std::complex<T>, real_t> { using type = std::complex<real_t>; };
 } // namespace detail
 
 /**
@@ -44,6 +50,19 @@ using get_real_t = typename detail::complex_traits<scalar_t>::real_t;
 template<class scalar_t>
 using get_complex_t = typename detail::complex_traits<scalar_t>::complex_t;
 
+/**
+ Return the single or double precision type corresponding to the given scalar type
+
+ For example:
+   std::complex<double> -> std::complex<float> (single)
+   float                -> double (double)
+ */
+template<class scalar_t>
+using get_single_t = typename detail::with_real<scalar_t, float>::type;
+
+template<class scalar_t>
+using get_double_t = typename detail::with_real<scalar_t, double>::type;
+
 /**
  Is the given scalar type complex?
  */
@@ -0,0 +1,37 @@
+#pragma once
+#include "Model.hpp"
+#include "solver/Solver.hpp"
+
+#include "numeric/dense.hpp"
+
+#include <vector>
+
+namespace cpb {
+
+/**
+ Compute the band structure of a periodic model: the eigenvalues at each point of `k_path`
+
+ The Bloch Hamiltonian of each k-point is built from the k-independent part of the model's
+ Hamiltonian (see `Model::hamiltonian_at()`) and the k-points are diagonalized in parallel
+ on a thread pool. Consecutive k-points are batched into a single job to keep the overhead
+ low for small unit cells.
+
+ Without a `make_strategy`, each Hamiltonian is converted to a dense matrix and all of its
+ eigenvalues are found with Eigen's `SelfAdjointEigenSolver`: the best option for unit cells
+ with a few orbitals. Otherwise, each job creates a (sparse) `SolverStrategy` and reuses it
+ for all the k-points of its batch. With `warm_start`, the eigenvectors of a k-point are
+ also the starting subspace of the next one in the batch (see `set_initial_subspace()`).
+
+ Returns a `k_path.size() x num_bands` array. All the eigenvalues are kept if `num_bands < 0`.
+ If some k-points have fewer eigenvalues (e.g. an energy window solver), the rest are `NaN`.
+ */
+ArrayXXd calc_bands(Model const& model, std::vector<Cartesian> const& k_path,
+                    idx_t num_bands = -1, idx_t num_threads = -1,
+                    BaseSolver::MakeStrategy const& make_strategy = {},
+                    bool warm_start = false);
+
+/// Band structure of an infinite lead: `h0 + h1 * exp(i k) + h.c.` for each `k` in `k_path`
+ArrayXXd calc_bands(Lead const& lead, ArrayXd const& k_path,
+                    idx_t num_bands = -1, idx_t num_threads = -1);
+
+} // namespace cpb
@@ -0,0 +1,84 @@
+#pragma once
+#include "solver/Solver.hpp"
+#include "kpm/Config.hpp"
+
+namespace cpb {
+
+struct ChebyshevFilterConfig {
+    // required user config
+    double energy_min = 0; ///< lowest eigenvalue
+    double energy_max = 0; ///< highest eigenvalue
+
+    // optional user config
+    int initial_size_guess = 0; ///< [0] subspace size, 0 -> stochastic estimate from the filter
+    int filter_degree = 0; ///< [0] Chebyshev polynomial degree, 0 -> based on the window width
+    int max_iterations = 30; ///< [30] maximum number of subspace iterations
+    double tolerance = 1e-6; ///< [1e-6] residual norm stopping criteria (scaled Hamiltonian)
+    bool recycle_subspace = false; ///< [false] use previous data as a starting point
+    idx_t num_threads = -1; ///< [-1] threads for the matrix-vector products, -1 -> all cores
+
+    // implementation detail config
+    kpm::MatrixFormat matrix_format = kpm::MatrixFormat::ELL; ///< CSR, ELL or SELL
+    float lanczos_precision = 0.002f; ///< precision of the spectrum bounds estimate
+};
+
+/**
+ Chebyshev filtered subspace iteration
+
+ Finds the eigenpairs in the energy window `[energy_min, energy_max]`. A Chebyshev expansion
+ of the window's indicator function (with Jackson damping) in the scaled Hamiltonian amplifies
+ the components of the subspace in the window. The filtered subspace is orthonormalized and
+ the eigenpairs are extracted with the Rayleigh-Ritz procedure on each iteration.
+
+ Nearly all of the work is in the batched sparse matrix-vector products of the KPM kernels:
+ the spectrum bounds, the scaled `OptimizedHamiltonian` and `kpm_spmv` are shared with KPM.
+ */
+template<class scalar_t>
+class ChebyshevFilter : public SolverStrategy {
+    using real_t = num::get_real_t<scalar_t>;
+
+public:
+    struct Info {
+        int subspace_size = 0; ///< final subspace size
+        int num_eigenvalues = 0; ///< the number of eigenvalues found in the window
+        int filter_degree = 0; ///< degree of the filter polynomial
+        int iterations = 0; ///< the number of subspace iterations executed
+        double max_residual = 0; ///< biggest residual of the eigenpairs in the window
+        bool size_warning = false; ///< the initial subspace size was too small
+    };
+
+public:
+    using Config = ChebyshevFilterConfig;
+    explicit ChebyshevFilter(SparseMatrixRC<scalar_t> hamiltonian, Config const& config = {})
+        : hamiltonian(std::move(hamiltonian)), config(config) {}
+
+public: // overrides
+    bool change_hamiltonian(Hamiltonian const& h) override;
+    void solve() override;
+    std::string report(bool shortform) const override;
+
+    RealArrayConstRef eigenvalues() const override { return arrayref(_eigenvalues); }
+    ComplexArrayConstRef eigenvectors() const override { return arrayref(_eigenvectors); }
+    bool set_initial_subspace(MatrixXcd const& vectors) override;
+    /// Kept with `Config::recycle_subspace`: they are the start of the next `solve()`
+    void release_eigenvectors() override {
+        if (!config.recycle_subspace) { _eigenvectors.resize(0, 0); }
+    }
+
+private:
+    SparseMatrixRC<scalar_t> hamiltonian;
+    Config config;
+
+    ArrayX<real_t> _eigenvalues;
+    ColMajorArrayXX<scalar_t> _eigenvectors;
+    MatrixX<scalar_t> initial_subspace; ///< warm start for the next `solve()`
+
+    Info info;
+};
+
+extern template class cpb::ChebyshevFilter<float>;
+extern template class cpb::ChebyshevFilter<std::complex<float>>;
+extern template class cpb::ChebyshevFilter<double>;
+extern template class cpb::ChebyshevFilter<std::complex<double>>;
+
+} // namespace cpb
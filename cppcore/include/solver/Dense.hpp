@@ -0,0 +1,49 @@
+#pragma once
+#include "solver/Solver.hpp"
+
+namespace cpb {
+
+struct DenseConfig {
+    bool eigenvalues_only = false; ///< [false] skip the eigenvectors: faster and less memory
+};
+
+/**
+ Dense Hermitian eigensolver for small models: all the eigenvalues and eigenvectors
+
+ The sparse Hamiltonian is copied into a dense matrix and diagonalized with Eigen's
+ `SelfAdjointEigenSolver`, i.e. LAPACK `syevd`/`heevd` (multithreaded) when built with MKL.
+ It's the native equivalent of `scipy.linalg.eigh()`: no Python or GIL is involved.
+ */
+template<class scalar_t>
+class Dense : public SolverStrategy {
+    using real_t = num::get_real_t<scalar_t>;
+
+public:
+    using Config = DenseConfig;
+    explicit Dense(SparseMatrixRC<scalar_t> hamiltonian, Config const& config = {})
+        : hamiltonian(std::move(hamiltonian)), config(config) {}
+
+public: // overrides
+    bool change_hamiltonian(Hamiltonian const& h) override;
+    void solve() override;
+    std::string report(bool shortform) const override;
+
+    RealArrayConstRef eigenvalues() const override { return arrayref(_eigenvalues); }
+    /// Empty with `Config::eigenvalues_only`
+    ComplexArrayConstRef eigenvectors() const override { return arrayref(_eigenvectors); }
+    void release_eigenvectors() override { _eigenvectors.resize(0, 0); }
+
+private:
+    SparseMatrixRC<scalar_t> hamiltonian;
+    Config config;
+
+    ArrayX<real_t> _eigenvalues;
+    ColMajorArrayXX<scalar_t> _eigenvectors;
+};
+
+extern template class cpb::Dense<float>;
+extern template class cpb::Dense<std::complex<float>>;
+extern template class cpb::Dense<double>;
+extern template class cpb::Dense<std::complex<double>>;
+
+} // namespace cpb
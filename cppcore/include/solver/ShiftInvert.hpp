@@ -0,0 +1,80 @@
+#pragma once
+#include "solver/Solver.hpp"
+
+#include <Eigen/SparseLU>
+
+namespace cpb {
+
+struct ShiftInvertConfig {
+    // required user config
+    double sigma = 0; ///< find the eigenvalues nearest to this energy
+    int num_eigenvalues = 0; ///< number of eigenpairs to compute
+
+    // optional user config
+    int subspace_size = 0; ///< [0] Krylov subspace size, 0 -> max(2 * num_eigenvalues + 1, 20)
+    double tolerance = 1e-10; ///< [1e-10] relative residual of the shift-inverted eigenvalues
+    int max_restarts = 100; ///< [100] raise an error if not converged after this many restarts
+};
+
+/**
+ Shift-invert Lanczos for the eigenpairs nearest to `sigma`
+
+ The eigenvalues nearest to `sigma` are the largest ones of `(H - sigma)^-1`. It's applied
+ with a sparse LU factorization of `H - sigma` in a Lanczos iteration with full
+ reorthogonalization and thick restarts, i.e. the same method as ARPACK's `eigsh(sigma=...)`.
+ The shifted matrix is indefinite so the factorization needs pivoting: an LDLT without it
+ breaks down on small pivots. The symbolic part (the fill-reducing column ordering) is
+ reused by a new Hamiltonian with the same sparsity pattern, e.g. along a band structure path.
+ */
+template<class scalar_t>
+class ShiftInvert : public SolverStrategy {
+    using real_t = num::get_real_t<scalar_t>;
+    using ColMajorSparse = Eigen::SparseMatrix<scalar_t, Eigen::ColMajor, storage_idx_t>;
+
+public:
+    struct Info {
+        int subspace_size = 0; ///< final Krylov subspace size
+        int restarts = 0; ///< the number of thick restarts executed
+        double max_residual = 0; ///< biggest relative residual of the results
+        bool is_pattern_reused = false; ///< the column ordering of the last `lu` was reused
+    };
+
+public:
+    using Config = ShiftInvertConfig;
+    explicit ShiftInvert(SparseMatrixRC<scalar_t> hamiltonian, Config const& config = {})
+        : hamiltonian(std::move(hamiltonian)), config(config) {}
+
+public: // overrides
+    bool change_hamiltonian(Hamiltonian const& h) override;
+    void solve() override;
+    std::string report(bool shortform) const override;
+
+    RealArrayConstRef eigenvalues() const override { return arrayref(_eigenvalues); }
+    ComplexArrayConstRef eigenvectors() const override { return arrayref(_eigenvectors); }
+    bool set_initial_subspace(MatrixXcd const& vectors) override;
+    void release_eigenvectors() override { _eigenvectors.resize(0, 0); }
+
+private:
+    /// LU of `H - sigma`: only a numerical factorization if the pattern hasn't changed
+    void factorize();
+
+private:
+    SparseMatrixRC<scalar_t> hamiltonian;
+    Config config;
+
+    Eigen::SparseLU<ColMajorSparse> lu;
+    std::vector<storage_idx_t> pattern; ///< column offsets and row indices of the last `lu`
+
+    ArrayX<real_t> _eigenvalues;
+    ColMajorArrayXX<scalar_t> _eigenvectors;
+    VectorX<scalar_t> initial_vector; ///< warm start for the next `solve()`
+
+    Info info;
+};
+
+extern template class cpb::ShiftInvert<float>;
+extern template class cpb::ShiftInvert<std::complex<float>>;
+extern template class cpb::ShiftInvert<double>;
+extern template class cpb::ShiftInvert<std::complex<double>>;
+
+} // namespace cpb
@@ -0,0 +1,125 @@
+#pragma once
+#include "hamiltonian/Hamiltonian.hpp"
+#include "solver/FEAST.hpp"
+
+#include <vector>
+
+namespace cpb {
+
+struct SpectrumSlicingConfig {
+    // required user config
+    double energy_min = 0; ///< lowest eigenvalue
+    double energy_max = 0; ///< highest eigenvalue
+
+    // optional user config
+    idx_t num_slices = 0; ///< [0] number of sub-intervals, 0 -> about `slice_size` eigenvalues each
+    idx_t slice_size = 500; ///< [500] target number of eigenvalues per slice if `num_slices == 0`
+    idx_t num_random = 4; ///< [4] random vectors of the stochastic KPM eigenvalue counts
+    double broadening = 0; ///< [0] KPM resolution of the counts, 0 -> 1/64 of the window
+    idx_t num_threads = -1; ///< [-1] total number of threads, -1 -> all cores
+};
+
+/**
+ Sub-intervals of `[energy_min, energy_max]` with about the same number of eigenvalues each
+ */
+struct SpectrumSlices {
+    std::vector<double> borders; ///< slice `i` is `[borders[i], borders[i + 1]]`
+    std::vector<double> counts; ///< estimated number of eigenvalues in each slice
+
+    double total_count() const;
+};
+
+/**
+ Split the window of the `config` into slices with about the same number of eigenvalues
+
+ The number of eigenvalues below `E` is the integral of the stochastic KPM DOS (the undamped
+ moments of `kpm::Core::dos()`) multiplied by the size of the Hamiltonian. The integral of
+ the Chebyshev expansion is analytic, so the counts are exact for the Jackson-damped DOS: the
+ only errors are the stochastic trace estimate and the `broadening` of the eigenvalues which
+ are close to a border. The borders are placed at equal steps of the cumulative count.
+ */
+SpectrumSlices slice_spectrum(Hamiltonian const& h, SpectrumSlicingConfig const& config);
+
+#ifdef CPB_USE_FEAST
+struct SlicedFEASTConfig {
+    SpectrumSlicingConfig slicing; ///< window, slices and the KPM eigenvalue counts
+
+    // optional user config
+    double size_factor = 1.5; ///< [1.5] FEAST subspace size per estimated eigenvalue
+    int size_margin = 8; ///< [8] extra subspace size of each slice for the error of the counts
+    idx_t threads_per_slice = 0; ///< [0] 0 -> the threads are split evenly among the slices
+    /// [1e-4] Eigenvalues closer than this to a border and to each other in the neighboring
+    /// slices are the same eigenpair if their eigenvectors also overlap
+    double duplicate_tolerance = 1e-4;
+
+    /// Contour and convergence settings of each slice: the energy range, subspace size
+    /// and system size are set for each slice
+    FEASTConfig feast;
+};
+
+/**
+ Spectrum slicing: FEAST on many sub-intervals of a wide energy window
+
+ A single FEAST window with thousands of eigenvalues scales poorly: the dense subspace work
+ grows with the square of its size and the contour solves of one window don't parallelize
+ well. Here, the window is split into slices with about the same number of eigenvalues (see
+ `slice_spectrum()`) and each slice gets a FEAST subspace of `size_factor` times its estimated
+ count plus `size_margin`, so the FEAST resizing reruns are rare. The slices are solved
+ concurrently: each one gets `threads_per_slice` threads (also for MKL PARDISO). The results
+ are merged in order of energy. A state right at a border may be found by both neighboring
+ slices: it's kept only once.
+ */
+template<class scalar_t>
+class SlicedFEAST : public SolverStrategy {
+    using real_t = num::get_real_t<scalar_t>;
+
+public:
+    struct Slice {
+        double energy_min = 0;
+        double energy_max = 0;
+        double estimated_count = 0; ///< from the KPM DOS
+        int initial_size_guess = 0; ///< FEAST subspace size
+        idx_t num_eigenvalues = 0; ///< found in the slice, including duplicates
+        idx_t num_duplicates = 0; ///< eigenpairs already found by the slice below
+        std::string report; ///< short FEAST report
+    };
+
+    struct Info {
+        std::vector<Slice> slices;
+        idx_t threads_per_slice = 0;
+        idx_t num_duplicates = 0; ///< total over all the borders
+    };
+
+public:
+    using Config = SlicedFEASTConfig;
+    explicit SlicedFEAST(SparseMatrixRC<scalar_t> hamiltonian, Config const& config = {})
+        : hamiltonian(std::move(hamiltonian)), config(config) {}
+
+public: // overrides
+    bool change_hamiltonian(Hamiltonian const& h) override;
+    void solve() override;
+    std::string report(bool shortform) const override;
+
+    RealArrayConstRef eigenvalues() const override { return arrayref(_eigenvalues); }
+    ComplexArrayConstRef eigenvectors() const override { return arrayref(_eigenvectors); }
+    void release_eigenvectors() override { _eigenvectors.resize(0, 0); }
+
+    Info const& get_info() const { return info; }
+
+private:
+    SparseMatrixRC<scalar_t> hamiltonian;
+    Config config;
+
+    ArrayX<real_t> _eigenvalues;
+    ColMajorArrayXX<scalar_t> _eigenvectors;
+
+    Info info;
+};
+
+extern template class cpb::SlicedFEAST<float>;
+extern template class cpb::SlicedFEAST<std::complex<float>>;
+extern template class cpb::SlicedFEAST<double>;
+extern template class cpb::SlicedFEAST<std::complex<double>>;
+#endif // CPB_USE_FEAST
+
+} // namespace cpb
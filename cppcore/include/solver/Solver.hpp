@@ -7,6 +7,7 @@
 #include "detail/strategy.hpp"
 
 #include <memory>
+#include <mutex>
 
 namespace cpb {
 
@@ -24,31 +25,68 @@ public:
 
     virtual RealArrayConstRef eigenvalues() const = 0;
     virtual ComplexArrayConstRef eigenvectors() const = 0;
+
+    /// Warm start: the next `solve()` begins from the subspace spanned by the columns of
+    /// `vectors`, e.g. the eigenvectors of the previous point of a parameter or k-point sweep.
+    /// Returns false if the strategy doesn't support it or the vectors don't fit the Hamiltonian.
+    virtual bool set_initial_subspace(MatrixXcd const& /*vectors*/) { return false; }
+    /// Free the memory of the eigenvectors once `BaseSolver` has made its own compact copy
+    virtual void release_eigenvectors() {}
 };
 
+/// Double precision copy of `eigenvectors`: the input of a warm start
+MatrixXcd copy_eigenvectors(ComplexArrayConstRef const& eigenvectors);
+
 /**
  Main solver interface
 
- Internally it uses a SolverStrategy with the scalar of the given Hamiltonian.
+ Internally it uses a SolverStrategy with the scalar of the given Hamiltonian. The first
+ calculation solves the eigenvalue problem: concurrent calculations wait for it and then
+ share the results. Only `set_model()` and `clear()` must not overlap with a calculation.
  */
 class BaseSolver {
 public:
+    using MakeStrategy = std::function<std::unique_ptr<SolverStrategy>(Hamiltonian const&)>;
+
     void solve();
     void clear() { is_solved = false; }
     std::string report(bool shortform) const;
 
+    /// With a warm start, the eigenvectors of the previous model are the starting subspace
+    /// of the next calculation, see `SolverStrategy::set_initial_subspace()`
     void set_model(Model const&);
     Model const& get_model() const { return model; }
+
     std::shared_ptr<System const> system() const { return model.system(); }
 
+    /// Carry the eigenvectors over to the next model and between consecutive k-points
+    void set_warm_start(bool enabled) { is_warm_start = enabled; }
+    bool get_warm_start() const { return is_warm_start; }
+    /// Keep only a single precision copy of double precision eigenvectors after `solve()`
+    void set_single_precision_eigenvectors(bool enabled) { is_single_precision = enabled; }
+    bool get_single_precision_eigenvectors() const { return is_single_precision; }
+
     RealArrayConstRef eigenvalues();
     ComplexArrayConstRef eigenvectors();
 
-    ArrayXd calc_dos(ArrayXf energies, float broadening);
-    ArrayXd calc_spatial_ldos(float energy, float broadening);
+    /// Copy of the eigenvectors of the `states` (columns) at the Hamiltonian rows of the system
+    /// `sites`, i.e. all the orbitals of each site. An empty list selects everything.
+    var::complex<ColMajorArrayXX> eigenvectors_at(std::vector<idx_t> const& sites,
+                                                  std::vector<idx_t> const& states);
+    /// The probability density `|psi|^2` of the same selection as `eigenvectors_at()`
+    var::real<ColMajorArrayXX> probability_at(std::vector<idx_t> const& sites,
+                                              std::vector<idx_t> const& states);
+
+    /// Only the eigenvalues within a few `broadening` widths of each energy are summed.
+    /// The energies are split among `num_threads` (-1 -> all cores).
+    ArrayXd calc_dos(ArrayXf energies, float broadening, idx_t num_threads = -1);
+    /// Computed as the product of `|psi|^2` with the Gaussian weights of the nearby states
+    ArrayXd calc_spatial_ldos(float energy, float broadening, idx_t num_threads = -1);
+
+    /// Eigenvalues at each point of `k_path` computed with this solver, see `cpb::calc_bands()`
+    ArrayXXd calc_bands(std::vector<Cartesian> const& k_path, idx_t num_threads = -1) const;
 
 protected:
-    using MakeStrategy = std::function<std::unique_ptr<SolverStrategy>(Hamiltonian const&)>;
     BaseSolver(Model const& model, MakeStrategy const& make_strategy);
 
 private:
@@ -57,6 +95,11 @@ private:
     std::unique_ptr<SolverStrategy> strategy;
 
     bool is_solved = false;
+    bool is_warm_start = false;
+    bool is_single_precision = false;
+    bool has_compact_eigenvectors = false; ///< the strategy's eigenvectors have been released
+    var::complex<ColMajorArrayXX> compact_eigenvectors; ///< single precision copy
+    std::unique_ptr<std::mutex> solve_mutex; ///< concurrent calculations `solve()` only once
     mutable Chrono calculation_timer; ///< last calculation time
 };
 
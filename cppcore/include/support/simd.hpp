@@ -1,6 +1,9 @@
 #pragma once
 
-#if defined(__AVX2__)
+#if defined(__AVX512F__)
+# define SIMDPP_ARCH_X86_AVX512F
+# define SIMDPP_ARCH_X86_AVX2
+#elif defined(__AVX2__)
 # define SIMDPP_ARCH_X86_AVX2
 #elif defined(__AVX__)
 # define SIMDPP_ARCH_X86_AVX
@@ -8,6 +11,8 @@
 # define SIMDPP_ARCH_X86_SSE3
 #elif defined(__SSE2__) || defined(_M_X64) || _M_IX86_FP == 2
 # define SIMDPP_ARCH_X86_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+# define SIMDPP_ARCH_ARM_NEON_FLT_SP // also enables double precision NEON on AArch64
 #endif
 
 #if defined(__FMA__) || (defined(_MSC_VER) && defined(__AVX2__))
@@ -28,13 +33,21 @@
 #include "detail/macros.hpp"
 #include "support/cppfuture.hpp"
 #include <complex>
+#include <cstdint>
+#include <string>
 
 namespace cpb { namespace simd {
+CPB_ISA_NAMESPACE_BEGIN
 using namespace simdpp;
 
 struct basic_traits {
+#if SIMDPP_USE_AVX512F
+    static constexpr auto align_bytes = 64;
+    static constexpr auto register_size_bytes = 64;
+#else
     static constexpr auto align_bytes = 32;
-    static constexpr auto register_size_bytes = 32; // emulated for < AVX-256
+    static constexpr auto register_size_bytes = 32; // emulated for < AVX-256 (and NEON)
+#endif
 };
 
 /// All SIMD vectors have the following traits
@@ -43,6 +56,25 @@ struct traits : basic_traits {
     static constexpr auto size = register_size_bytes / sizeof(T);
 };
 
+/// Name of the instruction set which the SIMD code was compiled for, e.g. "AVX2-256"
+constexpr char const* instruction_set() {
+#if SIMDPP_USE_AVX512F
+    return "AVX512-512";
+#elif SIMDPP_USE_AVX2
+    return "AVX2-256";
+#elif SIMDPP_USE_AVX
+    return "AVX-256";
+#elif SIMDPP_USE_NEON64
+    return "NEON64";
+#elif SIMDPP_USE_SSE3
+    return "SSE3";
+#elif SIMDPP_USE_SSE2
+    return "SSE2";
+#else
+    return "x87";
+#endif
+}
+
 namespace detail {
     template<class T> struct select_vector;
     template<> struct select_vector<float> { using type = float32<traits<float>::size>; };
@@ -137,10 +169,24 @@ split_loop_t<step> split_loop(scalar_t const* p, idx_t start, idx_t end) {
 /**
  RAII class which disables floating-point denormals (flush-to-zero mode)
  */
+#if SIMDPP_USE_NEON64
+struct scope_disable_denormals {
+    static constexpr auto flush_to_zero = std::uint64_t{1} << 24; // FZ bit of FPCR
+
+    CPB_ALWAYS_INLINE scope_disable_denormals() {
+        asm volatile("mrs %0, fpcr" : "=r"(fpcr));
+        asm volatile("msr fpcr, %0" : : "r"(fpcr | flush_to_zero));
+    }
+    CPB_ALWAYS_INLINE ~scope_disable_denormals() { asm volatile("msr fpcr, %0" : : "r"(fpcr)); }
+
+    std::uint64_t fpcr;
+};
+#else
 struct scope_disable_denormals {
     CPB_ALWAYS_INLINE scope_disable_denormals() { _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON); }
     CPB_ALWAYS_INLINE ~scope_disable_denormals() { _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_OFF); }
 };
+#endif
 
 namespace detail {
     template<class Vector> struct Gather;
@@ -179,6 +225,39 @@ namespace detail {
             return _mm_castpd_ps(r);
         }
     };
+#elif SIMDPP_USE_NEON64
+    // NEON has no gather instruction: the lanes are loaded individually
+    template<>
+    struct Gather<float64x2> {
+        CPB_ALWAYS_INLINE
+        static float64x2_t call(double const* data, std::int32_t const* indices) {
+            auto const low = vld1q_dup_f64(data + indices[0]);
+            return vld1q_lane_f64(data + indices[1], low, 1);
+        }
+
+        CPB_ALWAYS_INLINE
+        static float64x2_t call(std::complex<double> const* data, std::int32_t const* indices) {
+            return vld1q_f64(reinterpret_cast<double const*>(data + indices[0]));
+        }
+    };
+
+    template<>
+    struct Gather<float32x4> {
+        CPB_ALWAYS_INLINE
+        static float32x4_t call(float const* data, std::int32_t const* indices) {
+            auto r = vld1q_dup_f32(data + indices[0]);
+            r = vld1q_lane_f32(data + indices[1], r, 1);
+            r = vld1q_lane_f32(data + indices[2], r, 2);
+            return vld1q_lane_f32(data + indices[3], r, 3);
+        }
+
+        CPB_ALWAYS_INLINE
+        static float32x4_t call(std::complex<float> const* data, std::int32_t const* indices) {
+            auto const low = vld1_f32(reinterpret_cast<float const*>(data + indices[0]));
+            auto const high = vld1_f32(reinterpret_cast<float const*>(data + indices[1]));
+            return vcombine_f32(low, high);
+        }
+    };
 #endif // SIMDPP_USE_SSE2
 
 #if SIMDPP_USE_AVX && !SIMDPP_USE_AVX2
@@ -248,6 +327,41 @@ namespace detail {
     };
 #endif
 
+#if SIMDPP_USE_AVX512F
+    template<>
+    struct Gather<float64x8> {
+        CPB_ALWAYS_INLINE
+        static __m512d call(double const* data, std::int32_t const* indices) {
+            auto const idx = _mm256_load_si256(reinterpret_cast<__m256i const*>(indices));
+            constexpr auto scale = sizeof(*data);
+            return _mm512_i32gather_pd(idx, data, scale);
+        }
+
+        CPB_ALWAYS_INLINE
+        static __m512d call(std::complex<double> const* data, std::int32_t const* indices) {
+            auto const a = _mm512_castpd256_pd512(Gather<float64x4>::call(data, indices));
+            auto const b = Gather<float64x4>::call(data, indices + 2);
+            return _mm512_insertf64x4(a, b, 1);
+        }
+    };
+
+    template<>
+    struct Gather<float32x16> {
+        CPB_ALWAYS_INLINE
+        static __m512 call(float const* data, std::int32_t const* indices) {
+            auto const idx = _mm512_load_si512(reinterpret_cast<__m512i const*>(indices));
+            constexpr auto scale = sizeof(*data);
+            return _mm512_i32gather_ps(idx, data, scale);
+        }
+
+        CPB_ALWAYS_INLINE
+        static __m512 call(std::complex<float> const* data, std::int32_t const* indices) {
+            auto const r = Gather<float64x8>::call(reinterpret_cast<double const*>(data), indices);
+            return _mm512_castpd_ps(r);
+        }
+    };
+#endif // SIMDPP_USE_AVX512F
+
     template<template<unsigned, class> class V, unsigned N>
     struct Gather<V<N, void>> {
         using Vec = V<N, void>;
@@ -264,6 +378,25 @@ namespace detail {
             return r;
         }
     };
+
+    /**
+     The gather instructions only take 32-bit offsets. With 64-bit indices the elements are
+     collected one by one into an aligned buffer which is then loaded as a single vector.
+     */
+    template<class Vec>
+    struct Gather64 {
+        using Element = typename Vec::element_type;
+
+        template<class Scalar> CPB_ALWAYS_INLINE
+        static Vec call(Scalar const* data, std::int64_t const* indices) {
+            static constexpr auto size = Vec::length * sizeof(Element) / sizeof(Scalar);
+            alignas(64) Scalar buffer[size];
+            for (auto i = std::size_t{0}; i < size; ++i) {
+                buffer[i] = data[indices[i]];
+            }
+            return simd::load<Vec>(reinterpret_cast<Element const*>(buffer));
+        }
+    };
 } // namespace detail
 
 /**
@@ -282,6 +415,11 @@ Vec gather(Scalar const* data, Index const* indices) {
     return detail::Gather<Vec>::call(data, indices);
 }
 
+template<class Vec, class Scalar> CPB_ALWAYS_INLINE
+Vec gather(Scalar const* data, std::int64_t const* indices) {
+    return detail::Gather64<Vec>::call(data, indices);
+}
+
 /**
  Alternatively add and subtract elements
 
@@ -322,6 +460,19 @@ float64x4 addsub(float64<4, E1> const& a, float64<4, E2> const& b) {
 }
 #endif // SIMDPP_USE_AVX
 
+#if SIMDPP_USE_AVX512F
+// There is no 512-bit addsub: fused multiply-add with alternating signs of `+1`
+template<class E1, class E2> CPB_ALWAYS_INLINE
+float32x16 addsub(float32<16, E1> const& a, float32<16, E2> const& b) {
+    return _mm512_fmaddsub_ps(_mm512_set1_ps(1.f), a.eval(), b.eval());
+}
+
+template<class E1, class E2> CPB_ALWAYS_INLINE
+float64x8 addsub(float64<8, E1> const& a, float64<8, E2> const& b) {
+    return _mm512_fmaddsub_pd(_mm512_set1_pd(1.0), a.eval(), b.eval());
+}
+#endif // SIMDPP_USE_AVX512F
+
 /**
  Complex multiplication
  */
@@ -434,4 +585,5 @@ Vec load_splat_rc(std::complex<real_t> const* p) {
     return a;
 }
 
+CPB_ISA_NAMESPACE_END
 }} // namespace cpb::simd
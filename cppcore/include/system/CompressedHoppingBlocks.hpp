@@ -0,0 +1,109 @@
+#pragma once
+#include "system/HoppingBlocks.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace cpb {
+
+/**
+ Read-only `HoppingBlocks` in a compact byte encoding
+
+ The rows of a block are sorted and the columns are close to their rows, so each hopping is
+ stored as the difference from the previous row and the offset from its own row: `col - row`.
+ Both are signed (the boundary blocks aren't always upper triangular) and they are written
+ as zigzag varints, i.e. 7 bits per byte. A typical lattice needs 2 or 3 bytes per hopping
+ instead of the 8 bytes of a `COO` pair. Any order of the coordinates is still correct but
+ it's only compact if it's mostly sorted.
+
+ It's meant for keeping or transferring the hoppings of large systems (e.g. pickling). The
+ blocks are decoded sequentially: `for_each_chunk()` and `tocsr()` work directly on the
+ compressed data without restoring all of the `HoppingBlocks`.
+ */
+class CompressedHoppingBlocks {
+public:
+    using Bytes = std::vector<std::uint8_t>;
+    /// The encoded data and the number of hoppings of each family block
+    using SerializedBlocks = std::vector<std::pair<Bytes, idx_t>>;
+
+    /// Sequential reader of the coordinates of an encoded block
+    class Decoder {
+    public:
+        explicit Decoder(Bytes const& bytes) : it(bytes.data()) {}
+
+        COO next() {
+            row += unzigzag(read());
+            auto const col = row + unzigzag(read());
+            return {row, col};
+        }
+
+    private:
+        std::uint32_t read() {
+            auto value = std::uint32_t{0};
+            for (auto shift = 0; ; shift += 7) {
+                auto const byte = *it++;
+                value |= static_cast<std::uint32_t>(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0) { return value; }
+            }
+        }
+
+        static storage_idx_t unzigzag(std::uint32_t n) {
+            return static_cast<storage_idx_t>(n >> 1) ^ -static_cast<storage_idx_t>(n & 1);
+        }
+
+    private:
+        std::uint8_t const* it;
+        storage_idx_t row = 0; ///< of the previous hopping
+    };
+
+    /// The number of hoppings decoded at a time by `for_each_chunk()`
+    static constexpr auto default_chunk_size = idx_t{1} << 14;
+
+public:
+    CompressedHoppingBlocks() = default;
+    explicit CompressedHoppingBlocks(HoppingBlocks const& hopping_blocks, idx_t num_threads = 1);
+    /// Internal: construct from serialized data
+    CompressedHoppingBlocks(idx_t num_sites, SerializedBlocks data, NameMap name_map);
+
+    /// Internal: return serialized data
+    idx_t get_num_sites() const { return num_sites; }
+    SerializedBlocks const& get_serialized_blocks() const { return blocks; }
+    NameMap const& get_name_map() const { return name_map; }
+
+    /// Encode the coordinates of a single block
+    static Bytes encode(HoppingBlocks::Block const& coordinates);
+
+    /// Total number of hoppings, like `HoppingBlocks::nnz()`
+    idx_t nnz() const;
+    /// Bytes allocated by the encoded blocks
+    std::size_t memory_usage() const;
+
+    /// Restore the original blocks
+    HoppingBlocks decompress(idx_t num_threads = 1) const;
+
+    /// Call `lambda(HopID family_id, HoppingBlocks::Block const& chunk, idx_t start)` for
+    /// consecutive chunks of at most `chunk_size` decoded hoppings, in the original order.
+    /// The `start` is the index of the first hopping of the chunk within its family block.
+    template<class F>
+    void for_each_chunk(F lambda, idx_t chunk_size = default_chunk_size) const {
+        auto chunk = HoppingBlocks::Block();
+        for (auto f = size_t{0}; f < blocks.size(); ++f) {
+            auto decoder = Decoder(blocks[f].first);
+            for (auto start = idx_t{0}; start < blocks[f].second; start += chunk_size) {
+                chunk.resize(static_cast<size_t>(std::min(chunk_size, blocks[f].second - start)));
+                for (auto& coo : chunk) { coo = decoder.next(); }
+                lambda(HopID(f), static_cast<HoppingBlocks::Block const&>(chunk), start);
+            }
+        }
+    }
+
+    /// Return the matrix in the CSR sparse matrix format, the same as `HoppingBlocks::tocsr()`
+    HoppingCSR tocsr() const;
+
+private:
+    idx_t num_sites = 0;
+    SerializedBlocks blocks; ///< indexed by hopping family ID
+    NameMap name_map;
+};
+
+} // namespace cpb
@@ -73,7 +73,7 @@ public:
     void add(SiteID id, idx_t norb, idx_t count = 1);
 
     /// Remove sites for which `keep == false`
-    void filter(VectorX<bool> const& keep);
+    void filter(ArrayX<bool> const& keep);
 
     /// Verify that the stored data is correct: `sum(site_counts) == num_sites`
     void verify(idx_t num_sites) const;
@@ -2,9 +2,12 @@
 #include "Lattice.hpp"
 
 #include "detail/slice.hpp"
+#include "detail/thread.hpp"
 #include "numeric/dense.hpp"
 #include "support/cppfuture.hpp"
 
+#include <limits>
+
 namespace cpb {
 
 class Primitive;
@@ -13,17 +16,114 @@ class Site;
 class Foundation;
 
 namespace detail {
+    /**
+     Splits the foundation index space into tiles which can be processed concurrently
+
+     A tile is made up of consecutive rows of sites along the first lattice vector, i.e.
+     a contiguous range of flat indices. The tiles are in the same order as a sequential
+     pass over the foundation, so per-tile results can be merged in tile order.
+     Small foundations (or `num_threads == 1`) are made up of a single tile, unless the
+     number of sites per tile is limited by `max_tile_sites` (the minimum is a single row).
+     */
+    class FoundationTiles {
+    public:
+        static constexpr auto min_parallel_sites = idx_t{100000};
+
+        FoundationTiles(Index3D const& spatial_size, idx_t sub_size, idx_t num_threads,
+                        idx_t max_tile_sites = std::numeric_limits<idx_t>::max());
+
+        idx_t size() const { return num_tiles; }
+        /// Number of sites in each row (the first lattice vector direction)
+        idx_t row_size() const { return spatial_size[0]; }
+        /// Number of sites in the tile
+        idx_t num_sites(idx_t tile) const {
+            return (first_row(tile + 1) - first_row(tile)) * spatial_size[0];
+        }
+
+        /// Call `lambda(tile)` for every tile, concurrently if there is more than one
+        template<class F>
+        void for_each(F lambda) const {
+            if (num_tiles == 1) { return lambda(idx_t{0}); }
+            parallel_for_each(static_cast<size_t>(num_tiles), num_threads, [&](size_t n) {
+                lambda(static_cast<idx_t>(n));
+            });
+        }
+
+        /// Call `lambda(spatial_idx, sub_idx, flat_idx)` for the first site of each row
+        /// of the tile -- the rest of the row follows along the first lattice vector
+        template<class F>
+        void for_each_row(idx_t tile, F lambda) const {
+            for (auto row = first_row(tile), end = first_row(tile + 1); row < end; ++row) {
+                auto const b = row % spatial_size[1];
+                auto const c = (row / spatial_size[1]) % spatial_size[2];
+                auto const sub_idx = row / (spatial_size[1] * spatial_size[2]);
+                lambda(Index3D(0, static_cast<int>(b), static_cast<int>(c)), sub_idx,
+                       row * spatial_size[0]);
+            }
+        }
+
+    private:
+        idx_t first_row(idx_t tile) const { return tile * num_rows / num_tiles; }
+
+    private:
+        Index3D spatial_size;
+        idx_t num_rows;
+        idx_t num_tiles;
+        idx_t num_threads;
+    };
+
+    /**
+     Precomputed neighbor traversal for the sites of one sublattice
+
+     `offsets[n]` is the flat index distance from a site to its neighbor through hopping `n`
+     of `OptimizedUnitCell::Site::hoppings`: it's the same for every site of the sublattice.
+     The sites in the box `[lower, upper)` are far enough from the edges of the foundation
+     that all of their neighbors exist, so only the edge sites check the bounds of each hopping.
+     */
+    struct NeighborOffsets {
+        std::vector<idx_t> offsets;
+        Array3i lower;
+        Array3i upper;
+
+        bool is_interior(Index3D const& index) const {
+            return (index.array() >= lower).all() && (index.array() < upper).all();
+        }
+    };
+
+    /// The neighbor offsets of each sublattice in a foundation of `spatial_size` unit cells
+    std::vector<NeighborOffsets> make_neighbor_offsets(OptimizedUnitCell const& unit_cell,
+                                                       Index3D const& spatial_size);
+
     /// Return the lower and upper bounds of the shape in lattice vector coordinates
     std::pair<Index3D, Index3D> find_bounds(Shape const& shape, Lattice const& lattice);
+    /// Position of the first site of a row (see `FoundationTiles::for_each_row()`): the rest
+    /// of the row is `row_position(...) + a * lattice.vector(0)` for local index `a`
+    inline Cartesian row_position(Cartesian origin, Index3D const& index, Cartesian sub_position,
+                                  Lattice const& lattice) {
+        auto const b = index[1];
+        auto const c = index[2];
+        Cartesian ps = origin + sub_position;
+        Cartesian pc = (c == 0) ? ps : ps + static_cast<float>(c) * lattice.vector(2);
+        Cartesian pb = (b == 0) ? pc : pc + static_cast<float>(b) * lattice.vector(1);
+        return pb;
+    }
     /// Generate real space coordinates for a block of lattice sites
-    CartesianArray generate_positions(Cartesian origin, Index3D size, Lattice const& lattice);
-    /// Initialize the neighbor count for each site
-    ArrayXi count_neighbors(Foundation const& foundation);
-    /// Reduce this site's neighbor count to zero and inform its neighbors of the change
-    void clear_neighbors(Site& site, ArrayXi& neighbor_count, int min_neighbors);
+    CartesianArray generate_positions(Cartesian origin, Index3D size, Lattice const& lattice,
+                                      idx_t num_threads = 1);
+    /// Real space coordinates of the sites of a single tile, in flat index order: the same
+    /// values as the matching part of `generate_positions()`
+    CartesianArray tile_positions(Cartesian origin, Lattice const& lattice,
+                                  OptimizedUnitCell const& unit_cell,
+                                  FoundationTiles const& tiles, idx_t tile);
+    /// Evaluate `shape.contains()` for a block of lattice sites, `max_tile_sites` at a time,
+    /// so the positions of the whole block are never stored
+    ArrayX<bool> shape_contains(Shape const& shape, Cartesian origin, Index3D size,
+                                Lattice const& lattice, idx_t max_tile_sites = 1 << 16);
 } // namespace detail
 
-/// Remove sites which have a neighbor count lower than `min_neighbors`
+/// Remove sites which have a neighbor count lower than `min_neighbors`: only sites next
+/// to invalid sites are considered and the removal propagates to their neighbors. This is
+/// iterative (a frontier of sites at a time) and uses the foundation's `num_threads`.
 void remove_dangling(Foundation& foundation, int min_neighbors);
 
 /**
@@ -42,6 +142,8 @@ public:
     idx_t size() const { return total_valid_sites; }
     /// Upper limit for the number of hoppings, indexed by family ID (useful for reservation)
     ArrayXi const& max_hoppings_per_family() const { return hopping_counts; }
+    /// Bytes allocated by the index map
+    std::size_t memory_usage() const;
 
 private:
     ArrayXi indices;
@@ -52,6 +154,11 @@ private:
 /**
  The foundation class creates a lattice-vector-aligned set of sites. The number of sites is high
  enough to encompass the given shape. After creation, the foundation can be cut down to the shape.
+
+ The site positions are implicit: `origin + sub_position + a * a1 + b * a2 + c * a3` is evaluated
+ on demand from the site's indices. They are stored only once `get_positions()` is called,
+ e.g. by a `PositionModifier` which moves the sites, so pristine lattices skip the 12 bytes
+ per site and the `generate_positions()` pass.
  */
 class Foundation {
     template<bool is_const> class Iterator;
@@ -67,8 +174,9 @@ class Foundation {
     using NonConstSublatticeSlice = SublatticeSlice<false>;
 
 public:
-    Foundation(Lattice const& lattice, Primitive const& shape);
-    Foundation(Lattice const& lattice, Shape const& shape);
+    /// The construction passes use `num_threads` for large foundations (see `tiles()`)
+    Foundation(Lattice const& lattice, Primitive const& shape, idx_t num_threads = 1);
+    Foundation(Lattice const& lattice, Shape const& shape, idx_t num_threads = 1);
 
     ConstIterator begin() const;
     ConstIterator end() const;
@@ -88,22 +196,47 @@ public:
     std::pair<Index3D, Index3D> const& get_bounds() const { return bounds; }
     Index3D const& get_spatial_size() const { return spatial_size; }
     idx_t get_sub_size() const { return sub_size; }
-
-    CartesianArray const& get_positions() const { return positions; }
-    CartesianArray& get_positions() { return positions; }
+    idx_t get_num_threads() const { return num_threads; }
+
+    /// Independent parts of the foundation for concurrent passes
+    detail::FoundationTiles tiles() const { return {spatial_size, sub_size, num_threads}; }
+    /// Call `lambda(Site)` for each site of `tile`
+    template<class F>
+    void for_each_site(detail::FoundationTiles const& tiles, idx_t tile, F lambda) const;
+
+    /// Store the positions of all sites (if they aren't already) and return them. The first
+    /// call isn't thread-safe: a concurrent pass should use `Site::get_position()` instead.
+    CartesianArray const& get_positions() const { materialize_positions(); return positions; }
+    CartesianArray& get_positions() { materialize_positions(); return positions; }
+    /// Have the positions been stored or are they still implicit?
+    bool has_positions() const { return positions.size() != 0; }
+    /// The positions of a single sublattice block, without storing them all
+    CartesianArray sublattice_positions(idx_t sub_idx) const;
+    /// The positions of `size` consecutive sites of a sublattice block, from index `start`
+    /// within the block
+    CartesianArray sublattice_positions(idx_t sub_idx, idx_t start, idx_t size) const;
     ArrayX<bool> const& get_states() const { return is_valid; }
     ArrayX<bool>& get_states() { return is_valid; }
 
     FinalizedIndices const& get_finalized_indices() const;
 
+    /// Bytes allocated by the site positions, states and the finalized indices (if any)
+    std::size_t memory_usage() const;
+
+private:
+    void materialize_positions() const;
+
 private:
     Lattice const& lattice;
     OptimizedUnitCell unit_cell;
     std::pair<Index3D, Index3D> bounds; ///< in lattice vector coordinates
+    Cartesian origin; ///< position of the first unit cell (at the lower bound)
     Index3D spatial_size; ///< number of unit cells in each lattice vector direction
     idx_t sub_size; ///< number of sites in a unit cell (sublattices)
+    idx_t num_threads;
+    std::vector<detail::NeighborOffsets> neighbor_offsets; ///< indexed by sublattice
 
-    CartesianArray positions; ///< real space coordinates of lattice sites
+    mutable CartesianArray positions; ///< real space coordinates (empty while implicit)
     ArrayX<bool> is_valid; ///< indicates if the site should be included in the final system
 
     mutable FinalizedIndices finalized_indices;
@@ -135,7 +268,15 @@ public:
     SubAliasID get_alias_id() const { return foundation->unit_cell[sub_idx].alias_id; }
     storage_idx_t get_norb() const { return foundation->unit_cell[sub_idx].norb; }
 
-    Cartesian get_position() const { return foundation->positions[flat_idx]; }
+    Cartesian get_position() const {
+        if (foundation->has_positions()) { return foundation->positions[flat_idx]; }
+
+        auto const& lattice = foundation->lattice;
+        auto const pb = detail::row_position(foundation->origin, spatial_idx,
+                                             foundation->unit_cell[sub_idx].position, lattice);
+        Cartesian pa = pb + static_cast<float>(spatial_idx[0]) * lattice.vector(0);
+        return pa;
+    }
     bool is_valid() const { return foundation->is_valid[flat_idx]; }
     void set_valid(bool state) {foundation->is_valid[flat_idx] = state; }
 
@@ -145,14 +286,29 @@ public:
     /// Loop over all neighbours of this site
     template<class Fn>
     void for_each_neighbor(Fn lambda) const  {
-        auto const spatial_size = foundation->spatial_size.array();
+        auto const& hoppings = foundation->unit_cell[sub_idx].hoppings;
+        auto const& neighbors = foundation->neighbor_offsets[sub_idx];
+        auto const num_hoppings = hoppings.size();
+
+        if (neighbors.is_interior(spatial_idx)) {
+            // Fast path: no bounds checks and the flat index is a fixed offset
+            for (auto n = size_t{0}; n < num_hoppings; ++n) {
+                auto const& hopping = hoppings[n];
+                lambda(Site(foundation, spatial_idx + hopping.relative_index, hopping.to_sub_idx,
+                            flat_idx + neighbors.offsets[n]), hopping);
+            }
+            return;
+        }
 
-        for (auto const& hopping : foundation->unit_cell[sub_idx].hoppings) {
+        auto const spatial_size = foundation->spatial_size.array();
+        for (auto n = size_t{0}; n < num_hoppings; ++n) {
+            auto const& hopping = hoppings[n];
             auto const neighbor_index = Array3i(spatial_idx + hopping.relative_index);
             if ((neighbor_index < 0).any() || (neighbor_index >= spatial_size).any())
                 continue; // out of bounds
 
-            lambda(Site(foundation, neighbor_index, hopping.to_sub_idx), hopping);
+            lambda(Site(foundation, neighbor_index, hopping.to_sub_idx,
+                        flat_idx + neighbors.offsets[n]), hopping);
         }
     }
 
@@ -322,6 +478,8 @@ public:
     }
 
     idx_t size() const { return slice_size; }
+    /// Foundation index of the first site
+    idx_t start() const { return start_idx; }
 
     Foundation::Iterator<is_const> begin() const { return {foundation, start_idx}; }
     Foundation::Iterator<is_const> end() const { return {foundation, start_idx + slice_size}; }
@@ -335,11 +493,16 @@ public:
     }
 
     CartesianArrayConstRef get_positions() const {
-        return foundation->positions.segment(start_idx, slice_size);
+        return foundation->get_positions().segment(start_idx, slice_size);
     }
 
     CartesianArrayRef get_positions() {
-        return foundation->positions.segment(start_idx, slice_size);
+        return foundation->get_positions().segment(start_idx, slice_size);
+    }
+
+    /// A copy of the positions which doesn't store them in the foundation
+    CartesianArray positions() const {
+        return foundation->sublattice_positions(start_idx / std::max(slice_size, idx_t{1}));
     }
 
 private:
@@ -348,6 +511,17 @@ private:
     idx_t slice_size;
 };
 
+template<class F>
+void Foundation::for_each_site(detail::FoundationTiles const& tiles, idx_t tile, F lambda) const {
+    auto const self = const_cast<Foundation*>(this);
+    tiles.for_each_row(tile, [&](Index3D spatial_idx, idx_t sub_idx, idx_t flat_idx) {
+        for (auto a = 0; a < spatial_size[0]; ++a) {
+            spatial_idx[0] = a;
+            lambda(Site(self, spatial_idx, sub_idx, flat_idx + a));
+        }
+    });
+}
+
 inline storage_idx_t FinalizedIndices::operator[](Site const& site) const {
     return indices[site.get_flat_idx()];
 }
@@ -112,6 +112,8 @@ public:
     /// Number of non-zeros in this COO sparse matrix, i.e. the total number of hoppings.
     /// This only includes the upper triangular part (i.e. does not include 2x for hermiticity).
     idx_t nnz() const;
+    /// Bytes allocated by the coordinate blocks (including any reserved capacity)
+    std::size_t memory_usage() const;
 
     /// Return the number of neighbors for each site
     ArrayXi count_neighbors() const;
@@ -127,8 +129,15 @@ public:
     /// Append a range of coordinates to the given family block
     void append(HopID family_id, ArrayXi&& rows, ArrayXi&& cols);
 
+    /// Append the concatenation of `parts` (each one indexed by family ID) to the blocks.
+    /// The coordinates are assumed to be valid, i.e. unique and upper triangular.
+    void append(std::vector<Blocks>&& parts, idx_t num_threads = 1);
+
     /// Remove sites for which `keep == false`
     void filter(VectorX<bool> const& keep);
+    /// Remove the sites which `index_map` marks as negative and renumber the others to
+    /// `index_map[old_index]`. The blocks are compacted in place (without reallocation).
+    void filter(ArrayXi const& index_map, idx_t num_kept, idx_t num_threads = 1);
 
     /// Account for the addition of new sites (no new hoppings)
     void add_sites(idx_t num_new_sites);
@@ -0,0 +1,37 @@
+#pragma once
+#include "numeric/dense.hpp"
+
+#include <vector>
+
+namespace cpb {
+
+struct System;
+
+/**
+ Point-group operation (a rotation or a reflection) about the `center` of a system:
+ `r' = matrix * (r - center) + center`
+ */
+struct PointOperation {
+    Eigen::Matrix3f matrix;
+    Cartesian center;
+
+    Cartesian operator()(Cartesian const& r) const { return matrix * (r - center) + center; }
+};
+
+/// The usual candidates for planar flakes and ribbons: rotations about the z axis through
+/// the `center` by 60, 90, 120 and 180 degrees and the mirrors in the x and y lines
+std::vector<PointOperation> planar_point_operations(Cartesian center);
+
+/// The image (system index) of each site under `op`, or an empty array if some site has
+/// no image within `tolerance` (in nm) or the image has a different number of orbitals
+ArrayXi site_permutation(System const& system, PointOperation const& op,
+                         float tolerance = 1e-3f);
+
+/// The permutation of the Hamiltonian indices which maps the orbitals of each site, in order,
+/// to those of its image in `site_permutation`
+ArrayXi hamiltonian_permutation(System const& system, ArrayXi const& site_permutation);
+
+/// The lowest site index in the orbit of each site under all of the `permutations`
+ArrayXi orbit_representatives(idx_t num_sites, std::vector<ArrayXi> const& permutations);
+
+} // namespace cpb
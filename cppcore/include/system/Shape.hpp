@@ -60,9 +60,13 @@ public:
 
 /**
  Shape defined by a bounding box and a function
+
+ The function is called with at most `chunk_size` positions at a time.
  */
 class FreeformShape : public Shape {
 public:
+    static constexpr auto chunk_size = idx_t{1} << 16;
+
     FreeformShape(Contains const& contains, Cartesian width, Cartesian center = {0, 0, 0});
 };
 
@@ -70,14 +74,37 @@ namespace detail {
     // Is the angle formed by three points acute? The vertex is `b`.
     ArrayX<bool> is_acute_angle(Cartesian a, Cartesian b, CartesianArrayConstRef c);
 
-    /// Function object which determines if a point is within a polygon
+    /**
+     Function object which determines if a point is within a polygon
+
+     Crossing number test which is accelerated for polygons with many vertices: the edges are
+     sorted into horizontal bands and the points are tested in chunks. Only the edges which
+     pass near the bounding box of a chunk are tested for each point. Chunks which don't
+     touch any edges are entirely inside or outside and skip the per-point work.
+     */
     class WithinPolygon {
     public:
+        static constexpr auto chunk_size = idx_t{64};
+
         WithinPolygon(Shape::Vertices const& vertices);
         ArrayX<bool> operator()(CartesianArrayConstRef positions) const;
 
     private:
-        ArrayX<float> x, y;
+        /// Index of the band which contains `y`
+        int band(float y) const;
+
+    private:
+        struct Edge {
+            float x1, y1, y2; ///< `x1, y1` is the vertex used to compute the crossing
+            float k; ///< inverse slope: dx / dy
+            float x_min, x_max, y_min, y_max;
+        };
+        std::vector<Edge> edges; ///< sides of the polygon, excluding horizontal ones
+        float x_min = 0, x_max = 0, y_min = 0, y_max = 0; ///< bounding box of `edges`
+        float tolerance = 0; ///< margin for rounding errors when skipping edges
+        int num_bands = 0;
+        float band_height = 0;
+        std::vector<std::vector<int>> bands; ///< indices of the edges which overlap each band
     };
 } // namespace detail
 
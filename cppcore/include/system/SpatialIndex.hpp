@@ -0,0 +1,61 @@
+#pragma once
+#include "numeric/dense.hpp"
+
+#include <vector>
+
+namespace cpb {
+
+class Shape;
+
+/**
+ Uniform grid of site positions for fast spatial queries
+
+ The positions are binned into cells with roughly two sites each. The nearest-neighbor queries
+ search shells of cells around the target until no closer site is possible, which is O(1) per
+ query for the (mostly uniform) lattice systems. The returned indices are offset by `start`,
+ i.e. they are System indices if the grid is built from a range of the System positions.
+ */
+class SpatialIndex {
+public:
+    SpatialIndex(CartesianArrayConstRef positions, idx_t start = 0);
+
+    idx_t size() const { return static_cast<idx_t>(sites.size()); }
+
+    /// The index of the site closest to `position` (the lowest index in case of a tie)
+    idx_t find_nearest(Cartesian position) const;
+    /// The same for many positions at once
+    ArrayXi find_nearest(CartesianArrayConstRef positions) const;
+    /// The `k` closest sites, sorted by distance
+    std::vector<idx_t> find_k_nearest(Cartesian position, idx_t k) const;
+    /// All the sites within the box `[min_corner, max_corner]` in ascending index order
+    std::vector<idx_t> find_in_box(Cartesian min_corner, Cartesian max_corner) const;
+    /// All the sites within the shape in ascending index order: `Shape::contains` is called
+    /// only for the sites within the bounding box of the shape's vertices
+    std::vector<idx_t> find_in_shape(Shape const& shape) const;
+
+private:
+    /// Cell coordinates of a position, clamped to the grid
+    Index3D cell_of(Cartesian position) const;
+    idx_t flat_cell(Index3D const& cell) const {
+        return (static_cast<idx_t>(cell[2]) * num_cells[1] + cell[1]) * num_cells[0] + cell[0];
+    }
+
+    /// Call `f(k)` for each grid entry `k` in the cells at Chebyshev distance `r` from `center`
+    template<class F>
+    void for_each_in_shell(Index3D const& center, int r, F f) const;
+    /// Call `f(k)` for each grid entry `k` within the box (inclusive)
+    template<class F>
+    void for_each_in_box(Cartesian min_corner, Cartesian max_corner, F f) const;
+
+private:
+    idx_t start;
+    CartesianArray positions; ///< ordered by cell
+    std::vector<storage_idx_t> sites; ///< original index (minus `start`) ordered by cell
+    std::vector<storage_idx_t> cell_starts; ///< `cell_starts[c]` is the first entry of cell `c`
+    Cartesian origin; ///< minimum corner of the grid
+    Cartesian cell_size;
+    Index3D num_cells;
+    float min_cell_size; ///< over the dimensions which have more than one cell
+};
+
+} // namespace cpb
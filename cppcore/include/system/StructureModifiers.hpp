@@ -20,11 +20,28 @@ class SiteStateModifier {
 public:
     using Function = std::function<void(Eigen::Ref<ArrayX<bool>> state, CartesianArrayConstRef pos,
                                         string_view sublattice)>;
-    Function apply; ///< to be user-implemented
+    /// Also receives the index of the first site: `first_site + n` is the index of site `n` in
+    /// the foundation (or in the system if the modifier is applied after a generator). This is
+    /// independent of the state of any other sites.
+    using IndexedFunction = std::function<void(Eigen::Ref<ArrayX<bool>> state,
+                                               CartesianArrayConstRef pos,
+                                               string_view sublattice, idx_t first_site)>;
+    IndexedFunction apply; ///< to be user-implemented
     int min_neighbors; ///< afterwards, remove sites with less than this number of neighbors
+    bool is_thread_safe = false; ///< `apply` may be called concurrently (not Python functions)
+
+    SiteStateModifier(Function const& apply, int min_neighbors = 0, bool is_thread_safe = false)
+        : SiteStateModifier(ignore_index(apply), min_neighbors, is_thread_safe) {}
+    SiteStateModifier(IndexedFunction const& apply, int min_neighbors = 0,
+                      bool is_thread_safe = false)
+        : apply(apply), min_neighbors(min_neighbors), is_thread_safe(is_thread_safe) {}
 
-    SiteStateModifier(Function const& apply, int min_neighbors = 0)
-        : apply(apply), min_neighbors(min_neighbors) {}
+private:
+    static IndexedFunction ignore_index(Function const& f) {
+        if (!f) { return {}; }
+        return [f](Eigen::Ref<ArrayX<bool>> state, CartesianArrayConstRef pos,
+                   string_view sublattice, idx_t) { f(state, pos, sublattice); };
+    }
 };
 
 /**
@@ -34,8 +51,10 @@ class PositionModifier {
 public:
     using Function = std::function<void(CartesianArrayRef position, string_view sublattice)>;
     Function apply; ///< to be user-implemented
+    bool is_thread_safe = false; ///< `apply` may be called concurrently (not Python functions)
 
-    PositionModifier(Function const& apply) : apply(apply) {}
+    PositionModifier(Function const& apply, bool is_thread_safe = false)
+        : apply(apply), is_thread_safe(is_thread_safe) {}
 };
 
 /**
@@ -86,9 +105,18 @@ public:
     explicit operator bool() const { return static_cast<bool>(make); }
 };
 
+namespace detail {
+    /// Structure modifiers are applied to a foundation in chunks of at most this many sites
+    constexpr auto max_modifier_chunk_sites = idx_t{1} << 20;
+}
+
 template<class M> void apply(M const&, Foundation&) {}
-void apply(SiteStateModifier const& m, Foundation& f);
-void apply(PositionModifier const& m, Foundation& f);
+/// The modifier is called for consecutive chunks of each sublattice (`max_chunk_sites` at most)
+/// and the chunks are processed concurrently on the foundation's threads if it's thread-safe
+void apply(SiteStateModifier const& m, Foundation& f,
+           idx_t max_chunk_sites = detail::max_modifier_chunk_sites);
+void apply(PositionModifier const& m, Foundation& f,
+           idx_t max_chunk_sites = detail::max_modifier_chunk_sites);
 
 template<class M> void apply(M const&, System&) {}
 void apply(SiteStateModifier const& m, System& s);
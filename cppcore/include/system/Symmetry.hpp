@@ -39,6 +39,9 @@ public:
 
     explicit operator bool() const { return enabled_directions != Vector3b{false, false, false}; }
 
+    Cartesian const& get_length() const { return length; }
+    Vector3b const& get_enabled_directions() const { return enabled_directions; }
+
 private:
     Cartesian length;
     Vector3b enabled_directions = {false, false, false};
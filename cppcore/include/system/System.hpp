@@ -9,15 +9,35 @@
 
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 
 namespace cpb {
 
 class Foundation;
 class FinalizedIndices;
 class TranslationalSymmetry;
+class Shape;
+class SpatialIndex;
 
 struct Range { idx_t start, end; };
 
+namespace detail {
+    /// Lazily built spatial indices, one for each sublattice filter (empty string: all sites).
+    /// The cache is tied to the current positions: copies start out empty.
+    struct SpatialIndexCache {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::shared_ptr<SpatialIndex const>> indices;
+
+        SpatialIndexCache() = default;
+        SpatialIndexCache(SpatialIndexCache const&) {}
+        SpatialIndexCache& operator=(SpatialIndexCache const&) { clear(); return *this; }
+
+        void clear() { std::lock_guard<std::mutex> lock(mutex); indices.clear(); }
+    };
+} // namespace detail
+
 /**
  Stores the positions, sublattice and hopping IDs for all lattice sites.
  */
@@ -49,6 +69,9 @@ struct System {
     /// This function takes multi-orbital hopping terms into account.
     idx_t hamiltonian_nnz() const;
 
+    /// Bytes allocated by the positions, hoppings and boundaries (excluding spatial indices)
+    std::size_t memory_usage() const;
+
     /// Translate the given System site index into its corresponding Hamiltonian indices
     ArrayXi to_hamiltonian_indices(idx_t system_index) const;
 
@@ -57,9 +80,20 @@ struct System {
 
     /// Find the index of the site nearest to the given position. Optional: filter by sublattice.
     idx_t find_nearest(Cartesian position, string_view sublattice_name = "") const;
+    /// The same for many positions at once
+    ArrayXi find_nearest(CartesianArrayConstRef positions, string_view sublattice_name = "") const;
+
+    /// Spatial index of all sites or only those of the given sublattice. It's built on first
+    /// use and reused until the positions change, see `reset_spatial_index()`.
+    std::shared_ptr<SpatialIndex const> spatial_index(string_view sublattice_name = "") const;
+    /// Must be called after modifying `positions` or the sublattice layout
+    void reset_spatial_index() { spatial_index_cache.clear(); }
 
     /// Expand `positions` to `hamiltonian_size` by replicating site positions for each orbital
     CartesianArray expanded_positions() const;
+
+private:
+    mutable detail::SpatialIndexCache spatial_index_cache;
 };
 
 /**
@@ -72,9 +106,15 @@ struct System::Boundary {
 
 namespace detail {
     void populate_system(System& system, Foundation const& foundation);
+    /// Build the system directly from a shape without a `Foundation`: the bounding box is
+    /// processed in tiles of at most `max_tile_sites` and only the surviving sites are kept
+    void populate_system(System& system, Lattice const& lattice, Shape const& shape,
+                         idx_t num_threads = 1, idx_t max_tile_sites = 1 << 16);
     void populate_boundaries(System& system, Foundation const& foundation,
                              TranslationalSymmetry const& symmetry);
-    void remove_invalid(System& system);
+    /// Remove the sites marked in `System::is_valid` and renumber the rest. The positions and
+    /// hopping blocks are compacted in place on `num_threads` without copying the system.
+    void remove_invalid(System& system, idx_t num_threads = 1);
 } // namespace detail
 
 } // namespace cpb
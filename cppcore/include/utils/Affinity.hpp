@@ -0,0 +1,32 @@
+#pragma once
+#include <string>
+#include <vector>
+
+namespace cpb {
+
+/// A set of logical CPU indices
+using CpuList = std::vector<int>;
+
+/**
+ Restrict the calling thread to the given CPUs (and the threads it starts later, which
+ inherit the mask). Return false if there are no valid CPUs or if the platform doesn't
+ support thread affinity (only Linux does for now).
+ */
+bool set_thread_affinity(CpuList const& cpus);
+
+/// The CPU which the calling thread is currently running on (-1 if unknown)
+int current_cpu();
+
+/**
+ The CPUs of each NUMA domain (socket), read from the Linux sysfs topology. On other
+ platforms or if the topology is unknown, there's a single domain with all the CPUs.
+ */
+std::vector<CpuList> const& numa_domains();
+
+/// Index of the `numa_domains()` entry which contains the given CPU (0 if not found)
+int numa_domain_of(int cpu);
+
+/// Parse a Linux CPU list string such as "0-3,8,10-11"
+CpuList parse_cpu_list(std::string const& str);
+
+} // namespace cpb
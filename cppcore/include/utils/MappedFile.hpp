@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace cpb {
+
+/**
+ Read-only view of an entire file: memory mapped if supported by the platform
+
+ On POSIX systems, the pages are only read from disk when they are first touched and the
+ OS may drop them again under memory pressure, so the file may be larger than the RAM.
+ Elsewhere, the whole file is read into a buffer.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(std::string const& filename);
+    ~MappedFile();
+
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+
+    char const* data() const { return ptr; }
+    std::size_t size() const { return length; }
+
+    /// Hint that the file will be read from start to end: more aggressive read-ahead
+    void advise_sequential() const;
+    /// Start reading the pages of `[p, p + bytes)` in the background without waiting for them,
+    /// e.g. the next block of a streaming pass. The range must be within the file.
+    void prefetch(void const* p, std::size_t bytes) const;
+
+private:
+    char const* ptr = nullptr;
+    std::size_t length = 0;
+#ifdef _WIN32
+    std::vector<char> buffer;
+#endif
+};
+
+} // namespace cpb
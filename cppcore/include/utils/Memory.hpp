@@ -0,0 +1,49 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace cpb {
+
+/// Peak resident memory of the process so far in bytes (0 if the OS doesn't report it)
+std::size_t peak_process_memory();
+
+/// Current resident memory of the process in bytes (0 if the OS doesn't report it)
+std::size_t current_process_memory();
+
+/// Physical memory which is currently free in bytes (0 if the OS doesn't report it)
+std::size_t available_memory();
+
+/**
+ Memory footprint of a stage of the pipeline (in bytes)
+
+ `size` is what the result of the stage holds. `peak` is how much the stage raised the peak
+ resident memory of the process: it includes temporary buffers but it's 0 if the stage stayed
+ below an earlier peak. Concurrent work in the same process is also counted.
+ */
+struct MemoryUsage {
+    std::size_t size;
+    std::size_t peak;
+
+    std::string str() const;
+};
+
+/// Measures how much the peak memory of the process grows after construction
+class PeakMemoryMeter {
+public:
+    PeakMemoryMeter() : start(peak_process_memory()) {}
+
+    std::size_t growth() const {
+        auto const current = peak_process_memory();
+        return current > start ? current - start : 0;
+    }
+
+private:
+    std::size_t start;
+};
+
+/// Bytes allocated by a `std::vector`
+template<class T>
+std::size_t memory_usage(std::vector<T> const& v) { return v.capacity() * sizeof(T); }
+
+} // namespace cpb
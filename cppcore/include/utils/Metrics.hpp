@@ -0,0 +1,102 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace cpb { namespace metrics {
+
+/**
+ Live counters and gauges of the running calculations, e.g. to monitor long cluster jobs
+
+ The built-in metrics are always updated: each update is a single relaxed atomic operation
+ which is done once per KPM job or thread pool task, never per matrix row. They may be read
+ at any time from another thread with `snapshot()` or exported in the Prometheus text format
+ with `text()` or `write()`, e.g. for the textfile collector of the node exporter. The memory
+ gauges are read from the OS at that time.
+
+ The time and number of calls of each `trace::Span` stage (the system build, Hamiltonian,
+ bounds, reordering, KPM jobs, etc.) are only accumulated after `collect_stages(true)`.
+ */
+
+/// Monotonic count, e.g. of moments, or a total time in nanoseconds (exported in seconds)
+class Counter {
+public:
+    void add(std::uint64_t n) { value.fetch_add(n, std::memory_order_relaxed); }
+    void add(std::chrono::nanoseconds time) { add(static_cast<std::uint64_t>(time.count())); }
+    std::uint64_t get() const { return value.load(std::memory_order_relaxed); }
+    void reset() { value.store(0, std::memory_order_relaxed); }
+
+private:
+    std::atomic<std::uint64_t> value{0};
+};
+
+/// Current level of something which goes up and down, e.g. the number of queued tasks
+class Gauge {
+public:
+    void add(std::int64_t n) { value.fetch_add(n, std::memory_order_relaxed); }
+    void sub(std::int64_t n) { value.fetch_sub(n, std::memory_order_relaxed); }
+    std::int64_t get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<std::int64_t> value{0};
+};
+
+/// Raise a gauge by `n` for the lifetime of this object
+class GaugeScope {
+public:
+    explicit GaugeScope(Gauge& gauge, std::int64_t n = 1) : gauge(gauge), n(n) { gauge.add(n); }
+    ~GaugeScope() { gauge.sub(n); }
+
+    GaugeScope(GaugeScope const&) = delete;
+    GaugeScope& operator=(GaugeScope const&) = delete;
+
+private:
+    Gauge& gauge;
+    std::int64_t n;
+};
+
+// Built-in metrics
+extern Counter kpm_jobs; ///< KPM jobs: each one is the recursion of a starter vector or batch
+extern Counter kpm_moments; ///< moments of all the KPM jobs, counting each vector of a batch
+extern Counter kpm_starter_time; ///< ns making the KPM starter vectors
+extern Counter kpm_spmv_time; ///< ns of the KPM matrix-vector products
+extern Counter kpm_collect_time; ///< ns of the rest of the KPM jobs, mostly collecting moments
+extern Gauge pool_threads; ///< worker threads of all the live `ThreadPool`s
+extern Gauge active_threads; ///< `ThreadPool` workers which are running a task
+extern Gauge queued_tasks; ///< tasks added to a `ThreadPool` which no worker has taken yet
+extern Gauge in_flight_jobs; ///< `parallel_for` jobs which were produced but not yet computed
+
+/// The value of a metric at the time of the `snapshot()`
+struct Sample {
+    std::string name;
+    std::string labels; ///< e.g. `stage="job",category="kpm"` or empty
+    std::string type; ///< "counter" or "gauge"
+    std::string help;
+    double value;
+};
+
+/// All the metrics at this time, including the memory of the process and the stages
+std::vector<Sample> snapshot();
+/// `snapshot()` in the Prometheus text exposition format
+std::string text();
+/// Replace the file with `text()`: it's written next to it first and then renamed, so that
+/// a reader never sees a partial file
+void write(std::string const& filename);
+
+/// Zero the counters and the stage times (the gauges follow the running work)
+void reset();
+
+namespace detail {
+    extern std::atomic<bool> is_collecting_stages;
+    void add_stage_time(char const* name, char const* category, std::chrono::nanoseconds time);
+}
+
+/// Start or stop accumulating the times of the `trace::Span` stages
+void collect_stages(bool enable);
+inline bool is_collecting_stages() {
+    return detail::is_collecting_stages.load(std::memory_order_relaxed);
+}
+
+}} // namespace cpb::metrics
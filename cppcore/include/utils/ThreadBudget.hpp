@@ -0,0 +1,59 @@
+#pragma once
+#include "detail/config.hpp"
+
+#include <string>
+
+namespace cpb {
+
+/**
+ Number of CPUs which this process may actually use
+
+ The smallest of: the CPUs in the affinity mask of the process (e.g. `taskset` or a batch
+ scheduler), the CPU quota of its cgroup (e.g. a container limited to 4 CPUs on a 64-core
+ node) and the `CPB_NUM_THREADS` environment variable (if set). Computed once, at least 1.
+ */
+idx_t available_cpus();
+
+/**
+ Number of threads which the calling thread may use for its own parallel work
+
+ This is the central budget queried by every thread consumer (model build, solvers, KPM
+ compute, BLAS): a value of `num_threads <= 0` means "as many as the budget". It's
+ `available_cpus()` for the main thread. The workers of a `ThreadPool` or `ThreadTeam` get
+ an equal share of the budget of the thread which started them, so nested parallelism
+ (e.g. a KPM calculation inside a `parallel_for` job) divides the cores instead of
+ multiplying the number of threads.
+ */
+idx_t thread_budget();
+
+/// Set the `thread_budget()` of the calling thread (`budget <= 0` resets it to the default)
+void set_thread_budget(idx_t budget);
+
+/// `num_threads` if it's positive, otherwise the `thread_budget()` of the calling thread
+idx_t resolve_num_threads(idx_t num_threads);
+
+/// The share of the `thread_budget()` of the calling thread for each of `num_workers`
+idx_t share_budget(idx_t num_workers);
+
+/**
+ Set the `thread_budget()` of the calling thread for the lifetime of this object
+
+ With MKL, the thread-local MKL thread count is limited to the same budget.
+ */
+class ThreadBudgetScope {
+public:
+    explicit ThreadBudgetScope(idx_t budget);
+    ~ThreadBudgetScope();
+
+    ThreadBudgetScope(ThreadBudgetScope const&) = delete;
+    ThreadBudgetScope& operator=(ThreadBudgetScope const&) = delete;
+
+private:
+    idx_t previous;
+    int previous_mkl;
+};
+
+/// CPU limit of a cgroup v2 `cpu.max` line such as "200000 100000" (0 if it's unlimited)
+idx_t parse_cgroup_cpu_max(std::string const& cpu_max);
+
+} // namespace cpb
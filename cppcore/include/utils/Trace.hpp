@@ -0,0 +1,91 @@
+#pragma once
+#include "utils/Metrics.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+namespace cpb { namespace trace {
+
+/**
+ Optional recording of nested, thread-tagged time spans in the Chrome trace event format
+
+ The output of `json()` or `write()` can be opened in `chrome://tracing` or the Perfetto UI.
+ Spans are recorded around the main stages of the model-to-result pipeline: the system build
+ and its modifiers, the Hamiltonian assembly, the KPM bounds, reordering and format conversion,
+ each KPM job and the reconstruction of the results. Tracing is disabled by default and then
+ a `Span` costs two relaxed atomic loads. The spans also give the stage times of the live
+ metrics, see `metrics::collect_stages()`.
+ */
+
+namespace detail {
+    using Clock = std::chrono::steady_clock;
+    extern std::atomic<bool> is_enabled;
+    void record(char const* name, char const* category, Clock::time_point start,
+                Clock::time_point end);
+}
+
+/// Discard any previous events and start recording
+void start();
+/// Stop recording: the events are kept until the next `start()` or `clear()`
+void stop();
+/// Discard all recorded events
+void clear();
+/// Is recording in progress?
+inline bool is_enabled() { return detail::is_enabled.load(std::memory_order_relaxed); }
+
+/// Number of events recorded so far
+std::size_t size();
+/// The recorded events as a Chrome trace JSON document
+std::string json();
+/// Write `json()` to a file
+void write(std::string const& filename);
+
+/**
+ Record the time between construction and `end()` (or destruction) as a complete event
+
+ The name and category must be string literals: they are stored as pointers and they are
+ written to the JSON document without escaping. Spans nest naturally on each thread.
+ */
+class Span {
+    using Clock = detail::Clock;
+
+public:
+    explicit Span(char const* name, char const* category = "cpb")
+        : is_traced(is_enabled()),
+          name(is_traced || metrics::is_collecting_stages() ? name : nullptr),
+          category(category) {
+        if (this->name) { start = Clock::now(); }
+    }
+
+    Span(Span&& other) noexcept
+        : is_traced(other.is_traced), name(other.name), category(other.category),
+          start(other.start) {
+        other.name = nullptr;
+    }
+    Span(Span const&) = delete;
+    Span& operator=(Span const&) = delete;
+    Span& operator=(Span&&) = delete;
+
+    ~Span() { end(); }
+
+    /// Close the span early: later calls and the destructor do nothing
+    void end() {
+        if (!name) { return; }
+        auto const now = Clock::now();
+        if (is_traced) { detail::record(name, category, start, now); }
+        if (metrics::is_collecting_stages()) {
+            metrics::detail::add_stage_time(name, category, now - start);
+        }
+        name = nullptr;
+    }
+
+private:
+    bool is_traced; ///< tracing was enabled when the span started
+    char const* name;
+    char const* category;
+    Clock::time_point start;
+};
+
+}} // namespace cpb::trace
@@ -0,0 +1,425 @@
+#include "BinaryFile.hpp"
+#include "utils/MappedFile.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+using namespace fmt::literals;
+
+namespace cpb { namespace binary {
+namespace {
+
+constexpr char magic[8] = {'P', 'B', 'S', 'Y', 'S', 'T', 'E', 'M'};
+constexpr auto byte_order_mark = std::uint32_t{0x01020304};
+
+struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint64_t table_offset;
+    std::uint64_t num_sections;
+};
+
+struct Section {
+    char name[48];
+    std::uint64_t offset; ///< from the start of the file, multiple of `alignment`
+    std::uint64_t size; ///< in bytes
+};
+
+template<class scalar_t> std::int64_t scalar_code();
+template<> std::int64_t scalar_code<float>() { return 0; }
+template<> std::int64_t scalar_code<double>() { return 1; }
+template<> std::int64_t scalar_code<std::complex<float>>() { return 2; }
+template<> std::int64_t scalar_code<std::complex<double>>() { return 3; }
+
+std::string family_section(std::string const& prefix, size_t family_id) {
+    return prefix + "hoppings." + std::to_string(family_id);
+}
+
+std::string boundary_prefix(size_t n) { return "boundary." + std::to_string(n) + "."; }
+
+/// Sequential writer: every section starts at an aligned offset, the table goes at the end
+class Writer {
+public:
+    explicit Writer(std::string const& filename)
+        : file(filename, std::ios::binary | std::ios::trunc), filename(filename) {
+        if (!file) { throw std::runtime_error("Can't open '{}' for writing"_format(filename)); }
+        auto const header = Header();
+        write_raw(&header, sizeof(header));
+    }
+
+    template<class T>
+    void section(std::string const& name, T const* data, idx_t count) {
+        if (name.size() >= sizeof(Section::name)) {
+            throw std::logic_error("binary::save(): section name '{}' is too long"_format(name));
+        }
+        pad();
+        auto s = Section();
+        std::strncpy(s.name, name.c_str(), sizeof(s.name) - 1);
+        s.offset = position;
+        s.size = static_cast<std::uint64_t>(count) * sizeof(T);
+        sections.push_back(s);
+        write_raw(data, s.size);
+    }
+
+    void finish() {
+        pad();
+        auto header = Header();
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.byte_order = byte_order_mark;
+        header.table_offset = position;
+        header.num_sections = sections.size();
+        write_raw(sections.data(), sections.size() * sizeof(Section));
+
+        file.seekp(0);
+        file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+        file.flush();
+        if (!file) { throw std::runtime_error("Failed to write '{}'"_format(filename)); }
+    }
+
+private:
+    void write_raw(void const* data, std::uint64_t size) {
+        file.write(static_cast<char const*>(data), static_cast<std::streamsize>(size));
+        position += size;
+    }
+
+    void pad() {
+        static char const zeros[alignment] = {};
+        auto const remainder = position % alignment;
+        if (remainder != 0) { write_raw(zeros, alignment - remainder); }
+    }
+
+private:
+    std::ofstream file;
+    std::string filename;
+    std::uint64_t position = 0;
+    std::vector<Section> sections;
+};
+
+/// Small variable-length sections (registries) are assembled in memory
+class Blob {
+public:
+    template<class T>
+    void add(T const* data, size_t count) {
+        auto const p = reinterpret_cast<char const*>(data);
+        bytes.insert(bytes.end(), p, p + count * sizeof(T));
+    }
+    template<class T>
+    void add(T value) { add(&value, 1); }
+
+    std::vector<char> bytes;
+};
+
+/// Read back the data written by `Blob`: unaligned, so everything goes through `memcpy`
+class BlobReader {
+public:
+    BlobReader(char const* data, size_t size) : data(data), size(size) {}
+
+    template<class T>
+    void read(T* out, size_t count) {
+        auto const n = count * sizeof(T);
+        if (offset + n > size) { throw std::runtime_error("binary::load(): corrupted registry"); }
+        std::memcpy(out, data + offset, n);
+        offset += n;
+    }
+    template<class T>
+    T read() { auto value = T(); read(&value, 1); return value; }
+
+private:
+    char const* data;
+    size_t size;
+    size_t offset = 0;
+};
+
+template<class ID>
+void write_registry(Writer& writer, std::string const& name, Registry<ID> const& registry) {
+    auto blob = Blob();
+    blob.add(static_cast<std::uint64_t>(registry.size()));
+    for (auto i = idx_t{0}; i < registry.size(); ++i) {
+        auto const& family_name = registry.get_names()[i];
+        auto const& energy = registry.get_energies()[i];
+        blob.add(static_cast<std::uint64_t>(family_name.size()));
+        blob.add(family_name.data(), family_name.size());
+        blob.add(static_cast<std::int64_t>(energy.rows()));
+        blob.add(static_cast<std::int64_t>(energy.cols()));
+        blob.add(energy.data(), static_cast<size_t>(energy.size()));
+    }
+    writer.section(name, blob.bytes.data(), static_cast<idx_t>(blob.bytes.size()));
+}
+
+void write_hoppings(Writer& writer, std::string const& prefix, HoppingBlocks const& blocks) {
+    for (auto const& block : blocks) {
+        auto const& coordinates = block.coordinates();
+        writer.section(family_section(prefix, block.family_id().as<size_t>()),
+                       coordinates.data(), block.size());
+    }
+}
+
+struct WriteHamiltonian {
+    Writer& writer;
+
+    template<class scalar_t>
+    void operator()(SparseMatrixRC<scalar_t> const& m) const {
+        if (!m->isCompressed()) {
+            throw std::logic_error("binary::save(): the Hamiltonian must be compressed");
+        }
+        std::int64_t const info[] = {scalar_code<scalar_t>(), m->rows(), m->cols(),
+                                     m->nonZeros()};
+        writer.section("hamiltonian", info, 4);
+        writer.section("hamiltonian.outer", m->outerIndexPtr(), m->outerSize() + 1);
+        writer.section("hamiltonian.inner", m->innerIndexPtr(), m->nonZeros());
+        writer.section("hamiltonian.values", m->valuePtr(), m->nonZeros());
+    }
+};
+
+/// Typed access to the sections of a mapped file
+class Reader {
+public:
+    explicit Reader(std::string const& filename)
+        : mapping(std::make_shared<MappedFile>(filename)), file(*mapping) {
+        auto const invalid = [&]{
+            return std::runtime_error("'{}' is not a valid pybinding binary file"_format(filename));
+        };
+        if (file.size() < sizeof(Header)) { throw invalid(); }
+
+        auto header = Header();
+        std::memcpy(&header, file.data(), sizeof(header));
+        if (std::memcmp(header.magic, magic, sizeof(magic)) != 0) { throw invalid(); }
+        if (header.byte_order != byte_order_mark) {
+            throw std::runtime_error("'{}' was saved with a different byte order"_format(filename));
+        }
+        if (header.version > version) {
+            throw std::runtime_error("'{}' has format version {} but only versions up to {} are "
+                                     "supported"_format(filename, header.version, version));
+        }
+
+        auto const table_size = header.num_sections * sizeof(Section);
+        if (header.table_offset + table_size > file.size()) { throw invalid(); }
+        for (auto n = std::uint64_t{0}; n < header.num_sections; ++n) {
+            auto s = Section();
+            std::memcpy(&s, file.data() + header.table_offset + n * sizeof(Section), sizeof(s));
+            s.name[sizeof(s.name) - 1] = '\0';
+            if (s.offset + s.size > file.size() || s.offset % alignment != 0) { throw invalid(); }
+            sections.emplace(std::string(s.name), s);
+        }
+    }
+
+    bool has(std::string const& name) const { return sections.count(name) > 0; }
+
+    /// Pointer into the mapped file and the number of elements of a section
+    template<class T>
+    std::pair<T const*, idx_t> array(std::string const& name) const {
+        auto const it = sections.find(name);
+        if (it == sections.end()) {
+            throw std::runtime_error("binary::load(): missing section '{}'"_format(name));
+        }
+        auto const& s = it->second;
+        if (s.size % sizeof(T) != 0) {
+            throw std::runtime_error("binary::load(): invalid size of section '{}'"_format(name));
+        }
+        return {reinterpret_cast<T const*>(file.data() + s.offset),
+                static_cast<idx_t>(s.size / sizeof(T))};
+    }
+
+    BlobReader blob(std::string const& name) const {
+        auto const a = array<char>(name);
+        return {a.first, static_cast<size_t>(a.second)};
+    }
+
+    /// Keeps the mapping alive after the reader is gone, as long as views into it are in use
+    std::shared_ptr<MappedFile const> const& shared_file() const { return mapping; }
+
+private:
+    std::shared_ptr<MappedFile const> mapping;
+    MappedFile const& file;
+    std::unordered_map<std::string, Section> sections;
+};
+
+template<class ID>
+Registry<ID> read_registry(Reader const& reader, std::string const& name) {
+    auto blob = reader.blob(name);
+    auto const count = blob.read<std::uint64_t>();
+
+    auto energies = std::vector<MatrixXcd>();
+    auto names = std::vector<std::string>();
+    for (auto i = std::uint64_t{0}; i < count; ++i) {
+        auto family_name = std::string(blob.read<std::uint64_t>(), '\0');
+        blob.read(&family_name[0], family_name.size());
+        auto const rows = blob.read<std::int64_t>();
+        auto const cols = blob.read<std::int64_t>();
+        auto energy = MatrixXcd(rows, cols);
+        blob.read(energy.data(), static_cast<size_t>(energy.size()));
+
+        names.push_back(std::move(family_name));
+        energies.push_back(std::move(energy));
+    }
+    return {std::move(energies), std::move(names)};
+}
+
+template<class T>
+ArrayX<T> read_array(Reader const& reader, std::string const& name) {
+    auto const a = reader.array<T>(name);
+    return Eigen::Map<ArrayX<T> const>(a.first, a.second);
+}
+
+HoppingBlocks read_hoppings(Reader const& reader, std::string const& prefix, idx_t num_sites,
+                            NameMap const& name_map) {
+    auto blocks = HoppingBlocks::Blocks(name_map.size());
+    for (auto f = size_t{0}; f < blocks.size(); ++f) {
+        auto const name = family_section(prefix, f);
+        if (!reader.has(name)) { continue; }
+        auto const a = reader.array<COO>(name);
+        blocks[f].assign(a.first, a.first + a.second);
+    }
+
+    auto result = HoppingBlocks(num_sites, name_map);
+    auto parts = std::vector<HoppingBlocks::Blocks>();
+    parts.push_back(std::move(blocks));
+    result.append(std::move(parts)); // moved, not copied
+    return result;
+}
+
+template<class scalar_t>
+Hamiltonian read_hamiltonian(Reader const& reader, idx_t rows, idx_t cols, idx_t nnz) {
+    auto const outer = reader.array<storage_idx_t>("hamiltonian.outer");
+    auto const inner = reader.array<storage_idx_t>("hamiltonian.inner");
+    auto const values = reader.array<scalar_t>("hamiltonian.values");
+    if (outer.second != rows + 1 || inner.second != nnz || values.second != nnz) {
+        throw std::runtime_error("binary::load(): invalid Hamiltonian sections");
+    }
+
+    auto matrix = std::make_shared<SparseMatrixX<scalar_t>>(rows, cols);
+    matrix->resizeNonZeros(nnz);
+    std::copy_n(outer.first, outer.second, matrix->outerIndexPtr());
+    std::copy_n(inner.first, inner.second, matrix->innerIndexPtr());
+    std::copy_n(values.first, values.second, matrix->valuePtr());
+    return SparseMatrixRC<scalar_t>(std::move(matrix));
+}
+
+template<class scalar_t>
+num::MappedCsrMatrix<scalar_t> mapped_hamiltonian(Reader const& reader, idx_t rows, idx_t cols,
+                                                  idx_t nnz) {
+    auto const outer = reader.array<storage_idx_t>("hamiltonian.outer");
+    auto const inner = reader.array<storage_idx_t>("hamiltonian.inner");
+    auto const values = reader.array<scalar_t>("hamiltonian.values");
+    if (outer.second != rows + 1 || inner.second != nnz || values.second != nnz
+        || outer.first[rows] != nnz) {
+        throw std::runtime_error("binary::map_hamiltonian(): invalid Hamiltonian sections");
+    }
+    return {reader.shared_file(), rows, cols, outer.first, inner.first, values.first};
+}
+
+} // anonymous namespace
+
+void save(std::string const& filename, System const& system, Hamiltonian const& hamiltonian) {
+    Writer writer(filename);
+    write_registry(writer, "site_registry", system.site_registry);
+    write_registry(writer, "hopping_registry", system.hopping_registry);
+
+    auto const& p = system.positions;
+    writer.section("positions.x", p.x.data(), p.size());
+    writer.section("positions.y", p.y.data(), p.size());
+    writer.section("positions.z", p.z.data(), p.size());
+
+    auto sublattices = std::vector<std::int32_t>();
+    for (auto const& sub : system.compressed_sublattices) {
+        sublattices.push_back(sub.id().value());
+        sublattices.push_back(static_cast<std::int32_t>(sub.num_sites()));
+        sublattices.push_back(static_cast<std::int32_t>(sub.num_orbitals()));
+    }
+    writer.section("sublattices", sublattices.data(), static_cast<idx_t>(sublattices.size()));
+
+    std::int64_t const hoppings_info[] = {system.hopping_blocks.get_num_sites(),
+                                          system.hopping_registry.size()};
+    writer.section("hoppings", hoppings_info, 2);
+    write_hoppings(writer, "", system.hopping_blocks);
+
+    for (auto n = size_t{0}; n < system.boundaries.size(); ++n) {
+        auto const& b = system.boundaries[n];
+        writer.section(boundary_prefix(n) + "shift", b.shift.data(), 3);
+        write_hoppings(writer, boundary_prefix(n), b.hopping_blocks);
+    }
+
+    if (hamiltonian) {
+        hamiltonian.get_variant().match(WriteHamiltonian{writer});
+    }
+    writer.finish();
+}
+
+Contents load(std::string const& filename) {
+    Reader const reader(filename);
+
+    auto result = Contents();
+    result.system = std::make_shared<System>(read_registry<SiteID>(reader, "site_registry"),
+                                             read_registry<HopID>(reader, "hopping_registry"));
+    auto& s = *result.system;
+
+    s.positions = CartesianArray(read_array<float>(reader, "positions.x"),
+                                 read_array<float>(reader, "positions.y"),
+                                 read_array<float>(reader, "positions.z"));
+
+    auto const sublattices = reader.array<std::int32_t>("sublattices");
+    for (auto i = idx_t{0}; i + 2 < sublattices.second; i += 3) {
+        auto const data = sublattices.first + i;
+        s.compressed_sublattices.add(SiteID{data[0]}, data[2], data[1]);
+    }
+    s.compressed_sublattices.verify(s.num_sites());
+
+    auto const name_map = s.hopping_registry.name_map();
+    auto const hoppings_info = reader.array<std::int64_t>("hoppings");
+    if (hoppings_info.second != 2 || hoppings_info.first[0] != s.num_sites()
+        || hoppings_info.first[1] != s.hopping_registry.size()) {
+        throw std::runtime_error("binary::load(): invalid hopping sections");
+    }
+    s.hopping_blocks = read_hoppings(reader, "", s.num_sites(), name_map);
+
+    for (auto n = size_t{0}; reader.has(boundary_prefix(n) + "shift"); ++n) {
+        auto const shift = reader.array<float>(boundary_prefix(n) + "shift");
+        auto boundary = System::Boundary();
+        boundary.hopping_blocks = read_hoppings(reader, boundary_prefix(n), s.num_sites(),
+                                                name_map);
+        boundary.shift = Cartesian(shift.first[0], shift.first[1], shift.first[2]);
+        s.boundaries.push_back(std::move(boundary));
+    }
+
+    if (reader.has("hamiltonian")) {
+        auto const info = reader.array<std::int64_t>("hamiltonian");
+        if (info.second != 4) { throw std::runtime_error("binary::load(): invalid Hamiltonian"); }
+        auto const rows = info.first[1], cols = info.first[2], nnz = info.first[3];
+        auto& h = result.hamiltonian;
+        switch (info.first[0]) {
+            case 0: h = read_hamiltonian<float>(reader, rows, cols, nnz); break;
+            case 1: h = read_hamiltonian<double>(reader, rows, cols, nnz); break;
+            case 2: h = read_hamiltonian<std::complex<float>>(reader, rows, cols, nnz); break;
+            case 3: h = read_hamiltonian<std::complex<double>>(reader, rows, cols, nnz); break;
+            default: throw std::runtime_error("binary::load(): unknown Hamiltonian scalar type");
+        }
+    }
+
+    return result;
+}
+
+var::complex<num::MappedCsrMatrix> map_hamiltonian(std::string const& filename) {
+    Reader const reader(filename);
+    if (!reader.has("hamiltonian")) {
+        throw std::runtime_error("'{}' doesn't contain a Hamiltonian"_format(filename));
+    }
+    auto const info = reader.array<std::int64_t>("hamiltonian");
+    if (info.second != 4) {
+        throw std::runtime_error("binary::map_hamiltonian(): invalid Hamiltonian");
+    }
+    auto const rows = info.first[1], cols = info.first[2], nnz = info.first[3];
+    reader.shared_file()->advise_sequential(); // each KPM iteration is a pass over the rows
+    switch (info.first[0]) {
+        case 0: return mapped_hamiltonian<float>(reader, rows, cols, nnz);
+        case 1: return mapped_hamiltonian<double>(reader, rows, cols, nnz);
+        case 2: return mapped_hamiltonian<std::complex<float>>(reader, rows, cols, nnz);
+        case 3: return mapped_hamiltonian<std::complex<double>>(reader, rows, cols, nnz);
+        default: throw std::runtime_error("binary::map_hamiltonian(): unknown scalar type");
+    }
+}
+
+}} // namespace cpb::binary
@@ -1,19 +1,142 @@
 #include "KPM.hpp"
 
+#include "system/PointSymmetry.hpp"
+#include "system/SpatialIndex.hpp"
+#include "utils/ThreadBudget.hpp"
+
+#include <algorithm>
+#include <future>
+#include <numeric>
+
 using namespace fmt::literals;
 
 namespace cpb {
 
+namespace kpm {
+
+num::StencilPattern stencil_pattern(Model const& model) {
+    if (model.get_shape() || model.get_symmetry() || model.is_multiorbital()) { return {}; }
+
+    auto pattern = num::StencilPattern();
+    pattern.size = model.get_primitive().size;
+    for (auto const& site : model.get_lattice().optimized_unit_cell()) {
+        auto offsets = std::vector<num::StencilPattern::Offset>();
+        for (auto const& hopping : site.hoppings) {
+            offsets.push_back({hopping.relative_index, hopping.to_sub_idx});
+        }
+        pattern.sublattices.push_back(std::move(offsets));
+    }
+    return pattern;
+}
+
+idx_t bsr_block_size(Model const& model) {
+    auto block_size = idx_t{0};
+    for (auto const& sub : model.system()->compressed_sublattices) {
+        auto a = block_size, b = sub.num_orbitals();
+        while (b != 0) { a %= b; std::swap(a, b); }
+        block_size = a;
+    }
+    return std::max(block_size, idx_t{1});
+}
+
+CalculationMemory estimate_memory(Model const& model, idx_t num_moments, idx_t num_results,
+                                  bool dense, idx_t num_threads) {
+    auto m = CalculationMemory();
+    m.model = model.estimate_memory();
+
+    auto const threads = resolve_num_threads(num_threads);
+    auto const num_jobs = static_cast<std::size_t>(std::max(std::min(threads, num_results),
+                                                            idx_t{1}));
+    auto const moments = static_cast<std::size_t>(num_moments);
+    auto const vector = static_cast<std::size_t>(m.model.hamiltonian_size)
+                        * m.model.scalar_size;
+
+    m.matrix = m.model.hamiltonian; // reordering keeps the non-zeros (ignoring any padding)
+    // Each job needs the two vectors of the recursion and a work vector, or the dense
+    // moment matrices of both sides of the product
+    m.vectors = num_jobs * vector * (dense ? 2 * moments : 3);
+    // The dense products are reduced into a single square matrix of moments
+    m.moments = moments * (dense ? moments : static_cast<std::size_t>(num_results))
+                * m.model.scalar_size;
+    return m;
+}
+
+} // namespace kpm
+
+namespace {
+    /// The pattern is only needed (and worth creating) for the matrix-free format
+    num::StencilPattern stencil_pattern(Model const& model, kpm::Config const& config) {
+        return config.matrix_format == kpm::MatrixFormat::STENCIL ? kpm::stencil_pattern(model)
+                                                                  : num::StencilPattern{};
+    }
+
+    /// Also given to the auto-tuner which may pick BSR for multi-orbital models
+    idx_t bsr_block_size(Model const& model, kpm::Config const& config) {
+        auto const is_needed = config.matrix_format == kpm::MatrixFormat::BSR || config.auto_tune;
+        return is_needed ? kpm::bsr_block_size(model) : 1;
+    }
+
+    /// Block-diagonal matrix of all the `blocks` which have the same scalar type
+    struct StackBlocks {
+        std::vector<Hamiltonian> const& blocks;
+
+        template<class scalar_t>
+        Hamiltonian operator()(SparseMatrixRC<scalar_t> const&) const {
+            auto size = idx_t{0};
+            auto nnz = idx_t{0};
+            for (auto const& h : blocks) {
+                size += h.rows();
+                nnz += h.non_zeros();
+            }
+
+            auto stacked = std::make_shared<SparseMatrixX<scalar_t>>(size, size);
+            stacked->resizeNonZeros(nnz);
+            auto const indptr = stacked->outerIndexPtr();
+            indptr[0] = 0;
+
+            auto row = storage_idx_t{0};
+            auto start = storage_idx_t{0};
+            for (auto const& h : blocks) {
+                auto const& block = *h.get_variant().template get<SparseMatrixRC<scalar_t>>();
+                auto const block_nnz = static_cast<storage_idx_t>(block.nonZeros());
+                std::copy_n(block.valuePtr(), block_nnz, stacked->valuePtr() + start);
+                std::transform(block.innerIndexPtr(), block.innerIndexPtr() + block_nnz,
+                               stacked->innerIndexPtr() + start,
+                               [&](storage_idx_t col) { return col + row; });
+                for (auto i = storage_idx_t{0}; i < block.rows(); ++i) {
+                    indptr[row + i + 1] = start + block.outerIndexPtr()[i + 1];
+                }
+                row += static_cast<storage_idx_t>(block.rows());
+                start += block_nnz;
+            }
+            return stacked;
+        }
+    };
+} // anonymous namespace
+
 KPM::KPM(Model const& model, kpm::Compute const& compute, kpm::Config const& config)
-    : model(model.eval()), core(kpm::Core(model.hamiltonian(), compute, config)) {}
+    : model(model.eval_hamiltonian()),
+      core(kpm::Core(model.hamiltonian(), compute, config, stencil_pattern(model, config),
+                     bsr_block_size(model, config))),
+      calculation_timer(new CalculationTimer()) {}
 
 void KPM::set_model(Model const& new_model) {
     model = new_model;
-    core.set_hamiltonian(model.hamiltonian());
+    core.set_hamiltonian(model.hamiltonian(), stencil_pattern(model, core.get_config()),
+                         bsr_block_size(model, core.get_config()));
 }
 
 std::string KPM::report(bool shortform) const {
-    return core.report(shortform) + " " + calculation_timer.str();
+    auto const time = [&]{
+        std::lock_guard<std::mutex> lock(calculation_timer->mutex);
+        return calculation_timer->last.str();
+    }();
+    return core.report(shortform) + " " + time;
+}
+
+void KPM::set_calculation_time(Chrono const& timer) const {
+    std::lock_guard<std::mutex> lock(calculation_timer->mutex);
+    calculation_timer->last = timer;
 }
 
 ArrayXcd KPM::moments(idx_t num_moments, VectorXcd const& alpha, VectorXcd const& beta,
@@ -46,9 +169,45 @@ ArrayXcd KPM::moments(idx_t num_moments, VectorXcd const& alpha, VectorXcd const
         }
     }
 
-    calculation_timer.tic();
+    auto timer = Chrono();
     auto moments = core.moments(num_moments, alpha, beta, op);
-    calculation_timer.toc();
+    set_calculation_time(timer.toc());
+    return moments;
+}
+
+ArrayXXcd KPM::batch_moments(idx_t num_moments, MatrixXcd const& alpha, MatrixXcd const& beta,
+                             SparseMatrixXcd const& op) const {
+    auto const ham_size =  model.system()->hamiltonian_size();
+    auto const check_size = std::unordered_map<char const*, bool>{
+        {"alpha", alpha.rows() == ham_size},
+        {"beta", beta.size() == 0 || (beta.rows() == ham_size && beta.cols() == alpha.cols())},
+        {"operator", op.size() == 0 || (op.rows() == ham_size && op.cols() == ham_size)}
+    };
+    for (auto const& pair : check_size) {
+        if (!pair.second) {
+            throw std::runtime_error("Size mismatch between the model Hamiltonian and the given "
+                                     "argument '{}'"_format(pair.first));
+        }
+    }
+
+    if (!model.is_complex()) {
+        auto const check_scalar_type = std::unordered_map<char const*, bool>{
+            {"alpha", alpha.imag().isZero()},
+            {"beta", beta.imag().isZero()},
+            {"operator", Eigen::Map<ArrayXcd const>(op.valuePtr(), op.nonZeros()).imag().isZero()}
+        };
+
+        for (auto const& pair : check_scalar_type) {
+            if (!pair.second) {
+                throw std::runtime_error("The model Hamiltonian is real, but the given argument "
+                                         "'{}' is complex"_format(pair.first));
+            }
+        }
+    }
+
+    auto timer = Chrono();
+    auto moments = core.batch_moments(num_moments, alpha, beta, op);
+    set_calculation_time(timer.toc());
     return moments;
 }
 
@@ -57,58 +216,440 @@ ArrayXXdCM KPM::calc_ldos(ArrayXd const& energy, double broadening, Cartesian po
     auto const system_index = model.system()->find_nearest(position, sublattice);
     auto const ham_idx = model.system()->to_hamiltonian_indices(system_index);
 
-    calculation_timer.tic();
+    auto timer = Chrono();
     auto results = core.ldos({begin(ham_idx), end(ham_idx)}, energy, broadening);
-    calculation_timer.toc();
+    set_calculation_time(timer.toc());
 
-    return (reduce && results.cols() > 1) ? results.rowwise().sum() : results;
+    if (reduce && results.cols() > 1) {
+        return results.rowwise().sum();
+    }
+    return results; // moved: the ternary operator would copy
+}
+
+kpm::ExpansionMoments KPM::calc_ldos_moments(double broadening, Cartesian position,
+                                             string_view sublattice,
+                                             kpm::Checkpoint* checkpoint) const {
+    auto const system_index = model.system()->find_nearest(position, sublattice);
+    auto const ham_idx = model.system()->to_hamiltonian_indices(system_index);
+
+    auto timer = Chrono();
+    auto moments = core.ldos_moments({begin(ham_idx), end(ham_idx)}, broadening, checkpoint);
+    set_calculation_time(timer.toc());
+    return moments;
 }
 
 ArrayXXdCM KPM::calc_spatial_ldos(ArrayXd const& energy, double broadening, Shape const& shape,
-                                  string_view sublattice) const {
-    if (model.is_multiorbital()) {
-        throw std::runtime_error("This function doesn't currently support multi-orbital models");
+                                  string_view sublattice, idx_t num_random) const {
+    auto timer = Chrono();
+    // Only the sites within the shape's bounding box are passed to `Shape::contains`
+    auto const sites = model.system()->spatial_index(sublattice)->find_in_shape(shape);
+    if (!model.is_multiorbital()) {
+        auto results = num_random > 0 ? core.stochastic_ldos(sites, energy, broadening, num_random)
+                                      : core.ldos(sites, energy, broadening);
+        set_calculation_time(timer.toc());
+        return results;
     }
 
+    auto results = ArrayXXdCM(energy.size(), static_cast<idx_t>(sites.size()));
+    spatial_ldos(sites, energy, broadening, num_random, [&](idx_t first, ArrayXXdCM const& chunk) {
+        results.middleCols(first, chunk.cols()) = chunk;
+    });
+    set_calculation_time(timer.toc());
+    return results;
+}
+
+ArrayXXdCM KPM::calc_symmetric_spatial_ldos(ArrayXd const& energy, double broadening,
+                                            Shape const& shape,
+                                            std::vector<Eigen::Matrix3f> const& operations,
+                                            string_view sublattice) const {
+    auto timer = Chrono();
     auto const& system = *model.system();
+    auto const& p = system.positions;
+    auto const center = Cartesian{p.x.mean(), p.y.mean(), p.z.mean()};
+    auto candidates = std::vector<PointOperation>();
+    if (operations.empty()) {
+        candidates = planar_point_operations(center);
+    } else {
+        for (auto const& m : operations) { candidates.push_back({m, center}); }
+    }
+
+    // Only the operations which are actual symmetries of this Hamiltonian
+    auto const hamiltonian = model.hamiltonian();
+    auto permutations = std::vector<ArrayXi>();
+    for (auto const& op : candidates) {
+        auto site_map = site_permutation(system, op);
+        if (site_map.size() != 0
+            && is_invariant(hamiltonian, hamiltonian_permutation(system, site_map))) {
+            permutations.push_back(std::move(site_map));
+        }
+    }
+    auto const representative = orbit_representatives(system.num_sites(), permutations);
 
-    calculation_timer.tic();
-    auto const indices = [&]{
-        auto const contains = shape.contains(system.positions);
-        auto const range = system.sublattice_range(sublattice);
+    // The distinct representatives are computed in ascending order like regular spatial LDOS
+    auto const sites = system.spatial_index(sublattice)->find_in_shape(shape);
+    auto irreducible = std::vector<idx_t>();
+    irreducible.reserve(sites.size());
+    for (auto const site : sites) { irreducible.push_back(representative[site]); }
+    std::sort(irreducible.begin(), irreducible.end());
+    irreducible.erase(std::unique(irreducible.begin(), irreducible.end()), irreducible.end());
 
-        auto v = std::vector<idx_t>();
-        v.reserve(std::count(contains.data() + range.start, contains.data() + range.end, true));
+    auto reduced = ArrayXXdCM(energy.size(), static_cast<idx_t>(irreducible.size()));
+    spatial_ldos(irreducible, energy, broadening, 0, [&](idx_t first, ArrayXXdCM const& chunk) {
+        reduced.middleCols(first, chunk.cols()) = chunk;
+    });
 
-        for (auto i = range.start; i < range.end; ++i) {
-            if (contains[i]) { v.push_back(i); }
+    auto results = ArrayXXdCM(energy.size(), static_cast<idx_t>(sites.size()));
+    for (auto j = size_t{0}; j < sites.size(); ++j) {
+        auto const it = std::lower_bound(irreducible.begin(), irreducible.end(),
+                                         representative[sites[j]]);
+        results.col(static_cast<idx_t>(j)) = reduced.col(it - irreducible.begin());
+    }
+    set_calculation_time(timer.toc());
+    return results;
+}
+
+kpm::CompactMap KPM::calc_compact_spatial_ldos(ArrayXd const& energy, double broadening,
+                                               Shape const& shape, kpm::MapPrecision precision,
+                                               string_view sublattice, idx_t num_random) const {
+    auto timer = Chrono();
+    auto const sites = model.system()->spatial_index(sublattice)->find_in_shape(shape);
+    auto results = kpm::CompactMap(energy.size(), static_cast<idx_t>(sites.size()), precision);
+    spatial_ldos(sites, energy, broadening, num_random, [&](idx_t first, ArrayXXdCM const& chunk) {
+        results.set(first, chunk);
+    });
+    set_calculation_time(timer.toc());
+    return results;
+}
+
+void KPM::spatial_ldos(std::vector<idx_t> const& sites, ArrayXd const& energy,
+                       double broadening, idx_t num_random,
+                       kpm::Core::LdosSink const& sink) const {
+    auto const ldos = [&](std::vector<idx_t> const& idx, kpm::Core::LdosSink const& s) {
+        if (num_random > 0) {
+            s(0, core.stochastic_ldos(idx, energy, broadening, num_random));
+        } else {
+            core.ldos(idx, energy, broadening, s);
         }
+    };
+    if (!model.is_multiorbital()) {
+        ldos(sites, sink);
+        return;
+    }
 
-        return v;
-    }();
+    // All the orbitals go into a single batch: `offsets` marks the columns of each site
+    auto const& system = *model.system();
+    auto ham_indices = std::vector<idx_t>();
+    auto offsets = std::vector<idx_t>{0};
+    offsets.reserve(sites.size() + 1);
+    for (auto const site : sites) {
+        auto const orbitals = system.to_hamiltonian_indices(site);
+        ham_indices.insert(ham_indices.end(), begin(orbitals), end(orbitals));
+        offsets.push_back(static_cast<idx_t>(ham_indices.size()));
+    }
 
-    auto results = core.ldos(indices, energy, broadening);
-    calculation_timer.toc();
+    // The orbitals of a site may be split between two chunks: the completed sites are passed
+    // on and the partial sum of the last one carries over to the next chunk
+    auto site = size_t{0};
+    auto partial = ArrayXd::Zero(energy.size()).eval();
+    ldos(ham_indices, [&](idx_t first, ArrayXXdCM const& chunk) {
+        auto const first_site = site;
+        auto const end = first + chunk.cols();
+        auto last_site = site;
+        while (last_site < sites.size() && offsets[last_site + 1] <= end) { ++last_site; }
 
-    return results;
+        auto completed = ArrayXXdCM(energy.size(), static_cast<idx_t>(last_site - first_site));
+        for (auto j = idx_t{0}; j < chunk.cols(); ++j) {
+            partial += chunk.col(j);
+            if (first + j + 1 == offsets[site + 1]) { // the last orbital of `site`
+                completed.col(static_cast<idx_t>(site - first_site)) = partial;
+                partial.setZero();
+                ++site;
+            }
+        }
+        if (completed.cols() > 0) { sink(static_cast<idx_t>(first_site), completed); }
+    });
+}
+
+ArrayXd KPM::calc_local_charge(double chemical_potential, double temperature,
+                               double broadening, idx_t num_random) const {
+    if (temperature < 0) {
+        throw std::logic_error("KPM::calc_local_charge(): invalid value for temperature.");
+    }
+
+    auto const& system = *model.system();
+    auto idx = std::vector<idx_t>(static_cast<size_t>(system.hamiltonian_size()));
+    std::iota(idx.begin(), idx.end(), idx_t{0});
+
+    auto timer = Chrono();
+    auto orbital_charge = core.local_charge(idx, chemical_potential, temperature, broadening,
+                                            num_random);
+    set_calculation_time(timer.toc());
+    if (!model.is_multiorbital()) {
+        return orbital_charge;
+    }
+
+    auto charge = ArrayXd(system.num_sites());
+    for (auto n = idx_t{0}; n < system.num_sites(); ++n) {
+        auto const orbitals = system.to_hamiltonian_indices(n);
+        charge[n] = 0;
+        for (auto i = idx_t{0}; i < orbitals.size(); ++i) {
+            charge[n] += orbital_charge[orbitals[i]];
+        }
+    }
+    return charge;
 }
 
-ArrayXd KPM::calc_dos(ArrayXd const& energy, double broadening, idx_t num_random) const {
-    calculation_timer.tic();
-    auto dos = core.dos(energy, broadening, num_random);
-    calculation_timer.toc();
+ArrayXXdCM KPM::calc_probing_ldos(ArrayXd const& energy, double broadening,
+                                  idx_t distance) const {
+    auto const& system = *model.system();
+    auto idx = std::vector<idx_t>(static_cast<size_t>(system.hamiltonian_size()));
+    std::iota(idx.begin(), idx.end(), idx_t{0});
+
+    auto timer = Chrono();
+    auto orbital_ldos = core.probing_ldos(idx, energy, broadening, distance);
+    set_calculation_time(timer.toc());
+    if (!model.is_multiorbital()) {
+        return orbital_ldos;
+    }
+
+    auto ldos = ArrayXXdCM(energy.size(), system.num_sites());
+    for (auto n = idx_t{0}; n < system.num_sites(); ++n) {
+        auto const orbitals = system.to_hamiltonian_indices(n);
+        ldos.col(n).setZero();
+        for (auto i = idx_t{0}; i < orbitals.size(); ++i) {
+            ldos.col(n) += orbital_ldos.col(orbitals[i]);
+        }
+    }
+    return ldos;
+}
+
+ArrayXd KPM::calc_dos(ArrayXd const& energy, double broadening, idx_t num_random,
+                      double target_error) const {
+    if (target_error < 0) {
+        throw std::logic_error("KPM::calc_dos(): invalid value for target_error.");
+    }
+
+    auto timer = Chrono();
+    auto dos = core.dos(energy, broadening, num_random, target_error);
+    set_calculation_time(timer.toc());
     return dos;
 }
 
+ArrayXXdCM KPM::calc_projected_dos(ArrayXd const& energy, double broadening,
+                                   std::vector<ArrayX<bool>> const& masks,
+                                   idx_t num_random) const {
+    auto const& system = *model.system();
+    auto projections = std::vector<std::vector<idx_t>>();
+    projections.reserve(masks.size());
+    for (auto const& mask : masks) {
+        auto idx = std::vector<idx_t>();
+        if (mask.size() == system.hamiltonian_size()) {
+            for (auto i = idx_t{0}; i < mask.size(); ++i) {
+                if (mask[i]) { idx.push_back(i); }
+            }
+        } else if (mask.size() == system.num_sites()) {
+            for (auto const& sub : system.compressed_sublattices) {
+                for (auto n = sub.sys_start(); n < sub.sys_end(); ++n) {
+                    if (!mask[n]) { continue; }
+                    auto const first = sub.ham_start() + (n - sub.sys_start()) * sub.num_orbitals();
+                    for (auto i = first; i < first + sub.num_orbitals(); ++i) { idx.push_back(i); }
+                }
+            }
+        } else {
+            throw std::logic_error("KPM::calc_projected_dos(): the masks must have the size "
+                                   "of the system or of the Hamiltonian.");
+        }
+        projections.push_back(std::move(idx));
+    }
+
+    auto timer = Chrono();
+    auto dos = core.projected_dos(projections, energy, broadening, num_random);
+    set_calculation_time(timer.toc());
+    return dos;
+}
+
+kpm::ProjectedDOS KPM::calc_sublattice_dos(ArrayXd const& energy, double broadening,
+                                           idx_t num_random, bool orbitals) const {
+    auto const& system = *model.system();
+    auto names = std::vector<std::string>();
+    auto projections = std::vector<std::vector<idx_t>>();
+    for (auto const& sub : system.compressed_sublattices) {
+        auto const name = std::string(system.site_registry.name(sub.id()));
+        auto const norb = sub.num_orbitals();
+        auto const num_projections = orbitals ? norb : idx_t{1};
+        for (auto o = idx_t{0}; o < num_projections; ++o) {
+            // The orbitals of each site are consecutive: `o` is every `norb`-th index
+            auto idx = std::vector<idx_t>();
+            for (auto i = sub.ham_start() + o; i < sub.ham_end(); i += orbitals ? norb : 1) {
+                idx.push_back(i);
+            }
+            names.push_back(orbitals ? fmt::format("{}[{}]", name, o) : name);
+            projections.push_back(std::move(idx));
+        }
+    }
+
+    auto timer = Chrono();
+    auto dos = core.projected_dos(projections, energy, broadening, num_random);
+    set_calculation_time(timer.toc());
+    return {std::move(names), std::move(dos)};
+}
+
+ArrayXd KPM::calc_dos_k(ArrayXd const& energy, double broadening,
+                        std::vector<Cartesian> const& k_points, idx_t num_random) const {
+    if (!model.get_symmetry()) {
+        throw std::logic_error("KPM::calc_dos_k(): the model must be periodic "
+                               "(translational symmetry).");
+    }
+    if (k_points.empty()) { throw std::logic_error("KPM::calc_dos_k(): no k-points given."); }
+
+    auto timer = Chrono();
+    // A new wave vector only updates the boundary hoppings, see `BlochCache`
+    auto bloch = model;
+    auto blocks = std::vector<Hamiltonian>();
+    blocks.reserve(k_points.size());
+    for (auto const& k : k_points) {
+        bloch.set_wave_vector(k);
+        blocks.push_back(bloch.hamiltonian());
+    }
+    auto const stacked = blocks.front().get_variant().match(StackBlocks{blocks});
+    auto const num_blocks = static_cast<idx_t>(blocks.size());
+    blocks.clear();
+
+    auto const& config = core.get_config();
+    auto const block_size = bsr_block_size(model, config);
+    auto stacked_core = kpm::Core(stacked, core.get_compute(), config, {}, block_size);
+    ArrayXd dos = stacked_core.dos(energy, broadening, num_random) / num_blocks;
+    set_calculation_time(timer.toc());
+    return dos;
+}
+
+ArrayXXdCM KPM::calc_spectral_function(std::vector<Cartesian> const& k_points,
+                                       ArrayXd const& energy, double broadening) const {
+    if (k_points.empty()) {
+        throw std::logic_error("KPM::calc_spectral_function(): no k-points given.");
+    }
+
+    auto const& system = *model.system();
+    auto const& positions = model.is_multiorbital() ? system.expanded_positions()
+                                                    : system.positions;
+    auto timer = Chrono();
+    auto result = core.spectral_function(positions, k_points, energy, broadening);
+    set_calculation_time(timer.toc());
+    return result;
+}
+
+kpm::ExpansionMoments KPM::calc_dos_moments(double broadening, idx_t num_random,
+                                            double target_error,
+                                            kpm::Checkpoint* checkpoint) const {
+    if (target_error < 0) {
+        throw std::logic_error("KPM::calc_dos_moments(): invalid value for target_error.");
+    }
+
+    auto timer = Chrono();
+    auto moments = core.dos_moments(broadening, num_random, target_error, checkpoint);
+    set_calculation_time(timer.toc());
+    return moments;
+}
+
+kpm::QuantizationError KPM::quantization_error(double broadening, idx_t num_random) const {
+    auto timer = Chrono();
+    auto error = core.quantization_error(broadening, num_random);
+    set_calculation_time(timer.toc());
+    return error;
+}
+
+kpm::ExpansionMoments KPM::extend_moments(kpm::ExpansionMoments const& moments,
+                                          kpm::Checkpoint& checkpoint, idx_t num_moments) const {
+    auto timer = Chrono();
+    auto extended = core.extend_moments(moments, checkpoint, num_moments);
+    set_calculation_time(timer.toc());
+    return extended;
+}
+
+std::vector<MatrixXcd> KPM::propagate(MatrixXcd const& psi0, ArrayXd const& times) const {
+    if (psi0.rows() != model.system()->hamiltonian_size()) {
+        throw std::runtime_error("Size mismatch between the model Hamiltonian and the given "
+                                 "initial states 'psi0'");
+    }
+
+    auto timer = Chrono();
+    auto result = core.propagate(psi0, times);
+    set_calculation_time(timer.toc());
+    return result;
+}
+
+kpm::ExpansionMoments KPM::ensemble_dos_moments(kpm::ModelFactory const& factory,
+                                                idx_t num_realizations, double broadening,
+                                                idx_t num_random, double bounds_margin) const {
+    if (num_realizations < 1 || bounds_margin < 0) {
+        throw std::invalid_argument("KPM::ensemble_dos_moments(): invalid number of "
+                                    "realizations or bounds margin.");
+    }
+
+    auto timer = Chrono();
+    // The moments can only be averaged if all the realizations have the same scaling factors
+    auto config = core.get_config();
+    auto const scale = core.scaling_factors();
+    auto const half_width = scale.a * (1 + bounds_margin);
+    config.min_energy = static_cast<float>(scale.b - half_width);
+    config.max_energy = static_cast<float>(scale.b + half_width);
+
+    struct Realization {
+        Model model;
+        Hamiltonian h;
+    };
+    // Runs on a separate thread: the Lanczos check overlaps with the previous moments
+    auto const build = [&](idx_t n) {
+        auto model = factory(n);
+        auto h = model.hamiltonian();
+        auto bounds = kpm::Bounds(h, config.lanczos_precision);
+        if (bounds.min_energy() < config.min_energy || bounds.max_energy() > config.max_energy) {
+            throw std::runtime_error(
+                "KPM::ensemble_dos_moments(): the spectrum of realization {} [{:.3f}, {:.3f}] "
+                "doesn't fit within the shared bounds [{:.3f}, {:.3f}]. Increase the bounds "
+                "margin or set the energy range."_format(n, bounds.min_energy(),
+                                                         bounds.max_energy(), config.min_energy,
+                                                         config.max_energy)
+            );
+        }
+        return Realization{std::move(model), std::move(h)};
+    };
+
+    auto ensemble = std::unique_ptr<kpm::Core>();
+    auto sum = ArrayXXcd();
+    auto next = std::async(std::launch::async, build, idx_t{0});
+    for (auto n = idx_t{0}; n < num_realizations; ++n) {
+        auto const realization = next.get();
+        if (n + 1 < num_realizations) {
+            next = std::async(std::launch::async, build, n + 1);
+        }
+
+        auto const& m = realization.model;
+        if (!ensemble) {
+            ensemble.reset(new kpm::Core(realization.h, core.get_compute(), config,
+                                         stencil_pattern(m, config), bsr_block_size(m, config)));
+        } else {
+            ensemble->set_hamiltonian(realization.h, stencil_pattern(m, config),
+                                      bsr_block_size(m, config));
+        }
+
+        auto const moments = ensemble->dos_moments(broadening, num_random);
+        if (n == 0) { sum = moments.data; } else { sum += moments.data; }
+    }
+
+    set_calculation_time(timer.toc());
+    return {ensemble->scaling_factors(), sum / static_cast<double>(num_realizations)};
+}
+
 ArrayXcd KPM::calc_greens(idx_t row, idx_t col, ArrayXd const& energy, double broadening) const {
     auto const size = model.hamiltonian().rows();
     if (row < 0 || row > size || col < 0 || col > size) {
         throw std::logic_error("KPM::calc_greens(i,j): invalid value for i or j.");
     }
 
-    calculation_timer.tic();
+    auto timer = Chrono();
     auto greens_function = core.greens(row, col, energy, broadening);
-    calculation_timer.toc();
+    set_calculation_time(timer.toc());
     return greens_function;
 }
 
@@ -122,17 +663,68 @@ std::vector<ArrayXcd> KPM::calc_greens_vector(idx_t row, std::vector<idx_t> cons
         throw std::logic_error("KPM::calc_greens(i,j): invalid value for i or j.");
     }
 
-    calculation_timer.tic();
+    auto timer = Chrono();
     auto greens_functions = core.greens_vector(row, cols, energy, broadening);
-    calculation_timer.toc();
+    set_calculation_time(timer.toc());
     return greens_functions;
 }
 
+kpm::ExpansionMoments KPM::calc_greens_moments(idx_t row, std::vector<idx_t> const& cols,
+                                               double broadening) const {
+    auto const size = model.hamiltonian().rows();
+    auto const is_invalid = [&](idx_t i) { return i < 0 || i > size; };
+    if (cols.empty() || is_invalid(row) || std::any_of(cols.begin(), cols.end(), is_invalid)) {
+        throw std::logic_error("KPM::calc_greens_moments(i,j): invalid value for i or j.");
+    }
+
+    auto timer = Chrono();
+    auto moments = core.greens_moments(row, cols, broadening);
+    set_calculation_time(timer.toc());
+    return moments;
+}
+
+std::vector<ArrayXXcd> KPM::calc_greens_block(std::vector<idx_t> const& rows,
+                                              std::vector<idx_t> const& cols,
+                                              ArrayXd const& energy, double broadening) const {
+    auto const size = model.hamiltonian().rows();
+    auto const is_invalid = [&](idx_t i) { return i < 0 || i > size; };
+    if (rows.empty() || cols.empty()
+        || std::any_of(rows.begin(), rows.end(), is_invalid)
+        || std::any_of(cols.begin(), cols.end(), is_invalid)) {
+        throw std::logic_error("KPM::calc_greens(i,j): invalid value for i or j.");
+    }
+
+    auto timer = Chrono();
+    auto const greens_functions = core.greens_block(rows, cols, energy, broadening);
+    set_calculation_time(timer.toc());
+
+    auto const num_cols = static_cast<idx_t>(cols.size());
+    auto block = std::vector<ArrayXXcd>(rows.size(), ArrayXXcd(num_cols, energy.size()));
+    for (auto i = size_t{0}; i < rows.size(); ++i) {
+        for (auto j = idx_t{0}; j < num_cols; ++j) {
+            block[i].row(j) = greens_functions[i * cols.size() + j].transpose();
+        }
+    }
+    return block;
+}
+
 ArrayXd KPM::calc_conductivity(ArrayXd const& chemical_potential, double broadening,
                                double temperature, string_view direction, idx_t num_random,
                                idx_t num_points) const {
+    auto const directions = std::vector<std::string>{std::string(direction)};
+    return std::move(calc_conductivity(chemical_potential, broadening, temperature, directions,
+                                       num_random, num_points).front());
+}
+
+std::vector<ArrayXd> KPM::calc_conductivity(ArrayXd const& chemical_potential,
+                                            double broadening, double temperature,
+                                            std::vector<std::string> const& directions,
+                                            idx_t num_random, idx_t num_points) const {
     auto const xyz = std::string("xyz");
-    if (direction.size() != 2 || xyz.find_first_of(direction) == std::string::npos) {
+    auto const is_valid = [&](std::string const& d) {
+        return d.size() == 2 && d.find_first_not_of(xyz) == std::string::npos;
+    };
+    if (directions.empty() || !std::all_of(directions.begin(), directions.end(), is_valid)) {
         throw std::logic_error("Invalid direction: must be 'xx', 'xy', 'zz', or similar.");
     }
 
@@ -140,11 +732,46 @@ ArrayXd KPM::calc_conductivity(ArrayXd const& chemical_potential, double broaden
     auto const& p = model.is_multiorbital() ? system.expanded_positions() : system.positions;
     auto map = std::unordered_map<char, ArrayXf const*>{{'x', &p.x}, {'y', &p.y}, {'z', &p.z}};
 
-    calculation_timer.tic();
-    auto result = core.conductivity(*map[direction[0]], *map[direction[1]], chemical_potential,
-                                    broadening, temperature, num_random, num_points);
-    calculation_timer.toc();
-    return result.real();
+    // Only the coordinates which are actually used, each one once
+    auto coords = std::vector<ArrayXf>();
+    auto coord_index = std::unordered_map<char, idx_t>();
+    auto const index_of = [&](char c) {
+        if (coord_index.find(c) == coord_index.end()) {
+            coord_index[c] = static_cast<idx_t>(coords.size());
+            coords.push_back(*map[c]);
+        }
+        return coord_index[c];
+    };
+    auto pairs = std::vector<std::pair<idx_t, idx_t>>();
+    for (auto const& d : directions) {
+        pairs.emplace_back(index_of(d[0]), index_of(d[1]));
+    }
+
+    auto timer = Chrono();
+    auto const result = core.conductivity(coords, pairs, chemical_potential, broadening,
+                                          temperature, num_random, num_points);
+    set_calculation_time(timer.toc());
+
+    auto real = std::vector<ArrayXd>();
+    for (auto const& r : result) { real.push_back(r.real()); }
+    return real;
+}
+
+ArrayXd KPM::calc_kubo_greenwood(ArrayXd const& chemical_potential, double broadening,
+                                 string_view direction, idx_t num_random) const {
+    auto const d = std::string(direction);
+    if (d.size() != 2 || d[0] != d[1] || std::string("xyz").find(d[0]) == std::string::npos) {
+        throw std::logic_error("Invalid direction: must be 'xx', 'yy' or 'zz'.");
+    }
+
+    auto const& system = *model.system();
+    auto const& p = model.is_multiorbital() ? system.expanded_positions() : system.positions;
+    auto const& coords = d[0] == 'x' ? p.x : (d[0] == 'y' ? p.y : p.z);
+
+    auto timer = Chrono();
+    auto result = core.kubo_greenwood(coords, chemical_potential, broadening, num_random);
+    set_calculation_time(timer.toc());
+    return result;
 }
 
 } // namespace cpb
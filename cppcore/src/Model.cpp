@@ -1,9 +1,104 @@
 #include "Model.hpp"
+#include "BinaryFile.hpp"
 #include "system/Foundation.hpp"
+#include "utils/ThreadBudget.hpp"
+#include "utils/Trace.hpp"
 
 #include "support/format.hpp"
 
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <random>
+
 namespace cpb {
+namespace {
+
+/// Periodic systems reuse the wave vector independent part of the Hamiltonian and
+/// all systems try to reuse the sparsity pattern of the last build
+template<class scalar_t>
+Hamiltonian make_hamiltonian_impl(var::complex<BlochCacheRC>& bloch_cache,
+                                  var::complex<BuildPattern>& build_pattern, System const& system,
+                                  Lattice const& lattice, HamiltonianModifiers const& modifiers,
+                                  Cartesian k_vector, bool simple_build, idx_t num_threads) {
+    if (!build_pattern.is<BuildPattern<scalar_t>>()) {
+        build_pattern = BuildPattern<scalar_t>();
+    }
+    auto& pattern = build_pattern.get<BuildPattern<scalar_t>>();
+    if (system.boundaries.empty()) {
+        return ham::make<scalar_t>(system, lattice, modifiers, simple_build, pattern,
+                                   num_threads);
+    }
+
+    if (!bloch_cache.is<BlochCacheRC<scalar_t>>() || !bloch_cache.get<BlochCacheRC<scalar_t>>()) {
+        bloch_cache = ham::make_bloch_cache<scalar_t>(system, lattice, modifiers, simple_build,
+                                                      pattern, num_threads);
+    }
+    return ham::make(*bloch_cache.get<BlochCacheRC<scalar_t>>(), k_vector);
+}
+
+/// Resolve the `-1 -> thread budget` default
+idx_t get_num_threads(idx_t num_threads) {
+    return resolve_num_threads(num_threads);
+}
+
+struct MakeBlochHamiltonian {
+    Cartesian const& k_vector;
+
+    template<class scalar_t>
+    Hamiltonian operator()(BlochCacheRC<scalar_t> const& cache) const {
+        return cache ? ham::make(*cache, k_vector) : Hamiltonian();
+    }
+};
+
+/// 64-bit FNV-1a hash of the raw bytes of the structural inputs
+class Hasher {
+public:
+    void add(void const* data, size_t size) {
+        auto const bytes = static_cast<unsigned char const*>(data);
+        for (auto i = size_t{0}; i < size; ++i) {
+            value = (value ^ bytes[i]) * 0x100000001b3ull;
+        }
+    }
+
+    template<class T>
+    void add(T const& x) {
+        static_assert(std::is_arithmetic<T>::value, "Only plain numbers are hashed as bytes");
+        add(&x, sizeof(T));
+    }
+    void add(std::string const& s) { add(s.size()); add(s.data(), s.size()); }
+    template<class Scalar, int Rows, int Cols>
+    void add(Eigen::Matrix<Scalar, Rows, Cols> const& m) {
+        add(m.rows());
+        add(m.cols());
+        add(m.data(), static_cast<size_t>(m.size()) * sizeof(Scalar));
+    }
+    template<class ID>
+    void add(Registry<ID> const& registry) {
+        add(registry.size());
+        for (auto const& name : registry.get_names()) { add(name); }
+        for (auto const& energy : registry.get_energies()) { add(energy); }
+    }
+
+    std::uint64_t get() const { return value; }
+
+private:
+    std::uint64_t value = 0xcbf29ce484222325ull;
+};
+
+/// The entries of an unordered map sorted by name
+template<class Map>
+std::vector<typename Map::const_pointer> sorted_by_name(Map const& map) {
+    auto result = std::vector<typename Map::const_pointer>();
+    for (auto const& pair : map) { result.push_back(&pair); }
+    std::sort(result.begin(), result.end(), [](typename Map::const_pointer a,
+                                               typename Map::const_pointer b) {
+        return a->first < b->first;
+    });
+    return result;
+}
+
+} // anonymous namespace
 
 Model::Model(Lattice const& lattice)
     : lattice(lattice),
@@ -23,7 +118,8 @@ void Model::add(Primitive new_primitive) {
 void Model::set_wave_vector(Cartesian const& new_wave_vector) {
     if (wave_vector != new_wave_vector) {
         wave_vector = new_wave_vector;
-        clear_hamiltonian();
+        _hamiltonian.reset(); // but keep `_bloch_cache`
+        _leads.clear_hamiltonian();
     }
 }
 
@@ -99,9 +195,14 @@ bool Model::is_complex() const {
 
 std::shared_ptr<System const> const& Model::system() const {
     if (!_system) {
+        auto const span = trace::Span("system", "model");
+        auto const meter = PeakMemoryMeter();
+        foundation_memory = {};
         system_build_time.timeit([&]{
-            _system = make_system();
+            auto const use_cache = !system_cache_directory.empty() && _leads.size() == 0;
+            _system = use_cache ? cached_system() : make_system();
         });
+        system_memory = {_system->memory_usage(), meter.growth()};
     }
     return _system;
 }
@@ -109,24 +210,54 @@ std::shared_ptr<System const> const& Model::system() const {
 Hamiltonian const& Model::hamiltonian() const {
     system();
     if (!_hamiltonian) {
+        auto const span = trace::Span("hamiltonian", "model");
+        auto const meter = PeakMemoryMeter();
         hamiltonian_build_time.timeit([&]{
             _hamiltonian = make_hamiltonian();
         });
+        hamiltonian_memory = {_hamiltonian.memory_usage(), meter.growth()};
     }
     return _hamiltonian;
 }
 
+Hamiltonian Model::hamiltonian_at(Cartesian const& k) const {
+    auto const& h = hamiltonian();
+    if (system()->boundaries.empty()) {
+        return h; // the wave vector has no effect
+    }
+    return var::apply_visitor(MakeBlochHamiltonian{k}, _bloch_cache);
+}
+
 Leads const& Model::leads() const {
-    system();
-    hamiltonian();
-    _leads.make_hamiltonian(lattice, hamiltonian_modifiers, is_double(), is_complex());
+    eval_hamiltonian();
+    _leads.make_hamiltonian(lattice, hamiltonian_modifiers, is_double(), is_complex(),
+                            get_num_threads(num_threads));
     return _leads;
 }
 
+Lead Model::lead(size_t i) const {
+    eval_hamiltonian();
+    _leads.make_hamiltonian(i, lattice, hamiltonian_modifiers, is_double(), is_complex());
+    return _leads[i];
+}
+
+Model Model::with_shared_system() const {
+    system();
+    auto model = *this;
+    model.clear_hamiltonian_modifiers();
+    model.complex_override = false;
+    model.clear_hamiltonian();
+    return model;
+}
+
 Model const& Model::eval() const {
+    leads();
+    return *this;
+}
+
+Model const& Model::eval_hamiltonian() const {
     system();
     hamiltonian();
-    leads();
     return *this;
 }
 
@@ -134,41 +265,184 @@ std::string Model::report() {
     auto const num_sites = fmt::with_suffix(static_cast<double>(system()->num_sites()));
     auto const nnz = fmt::with_suffix(static_cast<double>(hamiltonian().non_zeros()));
 
+    auto const foundation = foundation_memory.size != 0
+                            ? fmt::format("foundation {}, ", foundation_memory.str())
+                            : std::string();
     return fmt::format("Built system with {} lattice sites, {}\n"
-                       "The Hamiltonian has {} non-zero values, {}",
-                       num_sites, system_build_time, nnz, hamiltonian_build_time);
+                       "The Hamiltonian has {} non-zero values, {}\n"
+                       "Memory: {}system {}, Hamiltonian {}",
+                       num_sites, system_build_time, nnz, hamiltonian_build_time,
+                       foundation, system_memory.str(), hamiltonian_memory.str());
 }
 
-std::shared_ptr<System> Model::make_system() const {
-    auto foundation = shape ? Foundation(lattice, shape)
-                            : Foundation(lattice, primitive);
-    if (symmetry) {
-        symmetry.apply(foundation);
+MemoryEstimate Model::estimate_memory() const {
+    auto const unit_cell = lattice.optimized_unit_cell();
+    auto sites_per_cell = idx_t{0};
+    auto orbitals_per_cell = idx_t{0};
+    auto hoppings_per_cell = idx_t{0};
+    auto nnz_per_cell = idx_t{0};
+    for (auto const& site : unit_cell) {
+        sites_per_cell += 1;
+        orbitals_per_cell += site.norb;
+        nnz_per_cell += site.norb * site.norb;
+        for (auto const& hopping : site.hoppings) {
+            if (hopping.is_conjugate) { continue; } // counted with the original term below
+            hoppings_per_cell += 1;
+            nnz_per_cell += 2 * site.norb * unit_cell[hopping.to_sub_idx].norb;
+        }
     }
 
+    auto const num_cells = [&]{
+        if (!shape) { return static_cast<idx_t>(primitive.size.prod()); }
+        auto const bounds = detail::find_bounds(shape, lattice);
+        return static_cast<idx_t>(((bounds.second - bounds.first) + Index3D::Ones()).prod());
+    }();
+
+    auto e = MemoryEstimate();
+    e.num_sites = num_cells * sites_per_cell;
+    e.hamiltonian_size = num_cells * orbitals_per_cell;
+    e.hamiltonian_nnz = num_cells * nnz_per_cell;
+    e.scalar_size = (is_double() ? 8 : 4) * (is_complex() ? 2 : 1);
+
+    auto const sites = static_cast<std::size_t>(e.num_sites);
+    auto const hoppings = static_cast<std::size_t>(num_cells * hoppings_per_cell);
+    auto const nnz = static_cast<std::size_t>(e.hamiltonian_nnz);
+    auto const site_bytes = 3 * sizeof(float) + sizeof(bool); // position and state
+    e.foundation = sites * (site_bytes + sizeof(storage_idx_t)); // + finalized indices
+    e.system = sites * site_bytes + hoppings * sizeof(COO);
+    e.hamiltonian = nnz * (e.scalar_size + sizeof(storage_idx_t))
+                    + static_cast<std::size_t>(e.hamiltonian_size + 1) * sizeof(storage_idx_t);
+
+    // The parallel assembly sorts (row, col, value) elements into buckets before merging
+    // them into the final matrix, the sequential one fills a reserved uncompressed matrix
+    auto const csr_element = e.scalar_size + sizeof(storage_idx_t);
+    auto const is_parallel = get_num_threads(num_threads) > 1
+                             && hamiltonian_modifiers.all_thread_safe()
+                             && e.hamiltonian_nnz >= min_parallel_build_nnz;
+    auto const bucket_element = 2 * sizeof(storage_idx_t) + e.scalar_size;
+    e.hamiltonian_build = nnz * (is_parallel ? bucket_element + csr_element : csr_element);
+    return e;
+}
+
+void Model::set_system_cache(std::string directory, std::string key) {
+    system_cache_directory = std::move(directory);
+    system_cache_key = std::move(key);
+    clear_structure();
+}
+
+std::uint64_t Model::structure_hash() const {
+    auto h = Hasher();
+    h.add(std::uint32_t{binary::version});
+
+    h.add(lattice.get_vectors().size());
+    for (auto const& v : lattice.get_vectors()) { h.add(v); }
+    h.add(lattice.get_offset());
+    h.add(lattice.get_min_neighbors());
+    for (auto const p : sorted_by_name(lattice.get_sublattices())) {
+        h.add(p->first);
+        h.add(p->second.position);
+        h.add(p->second.energy);
+        h.add(p->second.unique_id.value());
+        h.add(p->second.alias_id.value());
+    }
+    for (auto const p : sorted_by_name(lattice.get_hoppings())) {
+        h.add(p->first);
+        h.add(p->second.energy);
+        h.add(p->second.family_id.value());
+        for (auto const& term : p->second.terms) {
+            h.add(term.relative_index);
+            h.add(term.from.value());
+            h.add(term.to.value());
+        }
+    }
+    h.add(site_registry);
+    h.add(hopping_registry);
+
+    h.add(primitive.size);
+    h.add(static_cast<bool>(shape));
+    h.add(shape.vertices.size());
+    for (auto const& v : shape.vertices) { h.add(v); }
+    h.add(symmetry.get_length());
+    h.add(symmetry.get_enabled_directions());
+
+    h.add(structure_modifiers.size());
+    for (auto const& m : structure_modifiers) {
+        h.add(requires_system(m));
+        h.add(is_generator(m));
+    }
+    h.add(system_cache_key);
+    return h.get();
+}
+
+std::shared_ptr<System> Model::cached_system() const {
+    auto const filename = fmt::format("{}/{:016x}.pbbin", system_cache_directory,
+                                      structure_hash());
+    if (std::ifstream(filename).good()) {
+        try {
+            return binary::load(filename).system;
+        } catch (std::runtime_error const&) {
+            // An unreadable cache entry (e.g. an older format) is replaced below
+        }
+    }
+
+    auto system = make_system();
+    // Concurrent processes may build the same system: each one writes a separate temporary
+    // file and then renames it, so a cache entry is never seen partially written
+    auto const temporary = fmt::format("{}.{:08x}.tmp", filename, std::random_device()());
+    binary::save(temporary, *system);
+    if (std::rename(temporary.c_str(), filename.c_str()) != 0) {
+        std::remove(temporary.c_str());
+    }
+    return system;
+}
+
+std::shared_ptr<System> Model::make_system() const {
+    auto const threads = get_num_threads(num_threads);
     auto const it = std::find_if(structure_modifiers.begin(), structure_modifiers.end(),
                                  [](StructureModifier const& m) { return requires_system(m); });
     auto const foundation_modifiers = make_range(structure_modifiers.begin(), it);
     auto const system_modifiers = make_range(it, structure_modifiers.end());
 
-    for (auto const& modifier : foundation_modifiers) {
-        apply(modifier, foundation);
-    }
+    auto sys = std::make_shared<System>(site_registry, hopping_registry);
+    auto const meter = PeakMemoryMeter();
+    if (shape && !symmetry && it == structure_modifiers.begin() && _leads.size() == 0) {
+        // Nothing needs the full foundation: only the sites within the shape are stored
+        auto const span = trace::Span("populate", "model");
+        detail::populate_system(*sys, lattice, shape, threads);
+    } else {
+        auto foundation_span = trace::Span("foundation", "model");
+        auto foundation = shape ? Foundation(lattice, shape, threads)
+                                : Foundation(lattice, primitive, threads);
+        if (symmetry) {
+            symmetry.apply(foundation);
+        }
+        foundation_span.end();
+
+        for (auto const& modifier : foundation_modifiers) {
+            auto const span = trace::Span("foundation_modifier", "model");
+            apply(modifier, foundation);
+        }
 
-    _leads.create_attachment_area(foundation);
-    _leads.make_structure(foundation);
+        auto leads_span = trace::Span("leads", "model");
+        _leads.create_attachment_area(foundation);
+        _leads.make_structure(foundation);
+        leads_span.end();
 
-    auto sys = std::make_shared<System>(site_registry, hopping_registry);
-    detail::populate_system(*sys, foundation);
-    if (symmetry) {
-        detail::populate_boundaries(*sys, foundation, symmetry);
+        auto const span = trace::Span("populate", "model");
+        detail::populate_system(*sys, foundation);
+        if (symmetry) {
+            detail::populate_boundaries(*sys, foundation, symmetry);
+        }
+        foundation_memory = {foundation.memory_usage(), meter.growth()};
     }
 
     for (auto const& modifier : system_modifiers) {
+        auto const span = trace::Span("system_modifier", "model");
         apply(modifier, *sys);
     }
 
-    detail::remove_invalid(*sys);
+    auto const span = trace::Span("remove_invalid", "model");
+    detail::remove_invalid(*sys, threads);
 
     if (sys->num_sites() == 0) { throw std::runtime_error{"Impossible system: 0 sites"}; }
 
@@ -183,13 +457,25 @@ Hamiltonian Model::make_hamiltonian() const {
         structure_modifiers.begin(), structure_modifiers.end(),
         [](StructureModifier const& m) { return is_generator(m); }
     );
+    auto const threads = get_num_threads(num_threads);
+
+    if (!is_complex()) {
+        // A quick probe on a small sample usually finds out if a modifier needs complex
+        // numbers, instead of throwing away a partial real build. The full build still
+        // catches the rest (modifiers which are complex only for some of the elements).
+        complex_override = is_double() ? modifiers.probe_complex<double>(built_system)
+                                       : modifiers.probe_complex<float>(built_system);
+    }
 
     if (!is_complex()) {
         try {
             if (!is_double()) {
-                return ham::make<float>(built_system, lattice, modifiers, k, simple_build);
+                return make_hamiltonian_impl<float>(_bloch_cache, _build_pattern, built_system,
+                                                    lattice, modifiers, k, simple_build, threads);
             } else {
-                return ham::make<double>(built_system, lattice, modifiers, k, simple_build);
+                return make_hamiltonian_impl<double>(_bloch_cache, _build_pattern, built_system,
+                                                     lattice, modifiers, k, simple_build,
+                                                     threads);
             }
         } catch (ComplexOverride const&) {
             complex_override = true;
@@ -197,20 +483,26 @@ Hamiltonian Model::make_hamiltonian() const {
     }
 
     if (!is_double()) {
-        return ham::make<std::complex<float>>(built_system, lattice, modifiers, k, simple_build);
+        return make_hamiltonian_impl<std::complex<float>>(_bloch_cache, _build_pattern,
+                                                          built_system, lattice, modifiers, k,
+                                                          simple_build, threads);
     } else {
-        return ham::make<std::complex<double>>(built_system, lattice, modifiers, k, simple_build);
+        return make_hamiltonian_impl<std::complex<double>>(_bloch_cache, _build_pattern,
+                                                           built_system, lattice, modifiers, k,
+                                                           simple_build, threads);
     }
 }
 
 void Model::clear_structure() {
     _system.reset();
+    _build_pattern = var::complex<BuildPattern>();
     _leads.clear_structure();
     clear_hamiltonian();
 }
 
 void Model::clear_hamiltonian() {
     _hamiltonian.reset();
+    _bloch_cache = var::complex<BlochCacheRC>();
     _leads.clear_hamiltonian();
 }
 
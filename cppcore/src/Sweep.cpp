@@ -0,0 +1,131 @@
+#include "Sweep.hpp"
+
+#include "hamiltonian/BuiltinModifiers.hpp"
+#include "detail/thread.hpp"
+
+namespace cpb {
+
+SweepParameters SweepGrid::at(idx_t n) const {
+    auto parameters = SweepParameters();
+    for (auto i = size_t{0}; i < names.size(); ++i) {
+        parameters[names[i]] = points(n, static_cast<idx_t>(i));
+    }
+    return parameters;
+}
+
+SweepGrid make_sweep_grid(std::vector<std::string> const& names,
+                          std::vector<ArrayXd> const& values) {
+    if (names.size() != values.size()) {
+        throw std::invalid_argument("Sweep: expected one array of values per parameter name.");
+    }
+    auto const num_parameters = static_cast<idx_t>(names.size());
+    auto num_points = idx_t{1};
+    for (auto const& v : values) { num_points *= v.size(); }
+
+    auto grid = SweepGrid{names, ArrayXXd(num_points, num_parameters)};
+    for (auto n = idx_t{0}; n < num_points; ++n) {
+        auto remainder = n;
+        for (auto i = num_parameters - 1; i >= 0; --i) {
+            auto const& v = values[static_cast<size_t>(i)];
+            grid.points(n, i) = v[remainder % v.size()];
+            remainder /= v.size();
+        }
+    }
+    return grid;
+}
+
+namespace sweep {
+
+namespace {
+
+double get(SweepParameters const& parameters, std::string const& name) {
+    auto const it = parameters.find(name);
+    if (it == parameters.end()) {
+        throw std::invalid_argument("Sweep: there is no parameter named '" + name + "'.");
+    }
+    return it->second;
+}
+
+/// The sweep parameters take precedence over the fixed constants with the same name
+SweepParameters merged(SweepParameters constants, SweepParameters const& parameters) {
+    for (auto const& p : parameters) { constants[p.first] = p.second; }
+    return constants;
+}
+
+} // anonymous namespace
+
+SweepModifier onsite_expression(std::string const& expression,
+                                SweepParameters const& constants) {
+    return {[=](Model& model, SweepParameters const& parameters) {
+        model.add(builtin::onsite_expression(expression, merged(constants, parameters)));
+    }};
+}
+
+SweepModifier hopping_expression(std::string const& expression,
+                                 SweepParameters const& constants) {
+    return {[=](Model& model, SweepParameters const& parameters) {
+        model.add(builtin::hopping_expression(expression, merged(constants, parameters)));
+    }};
+}
+
+SweepModifier constant_magnetic_field(std::string const& magnitude) {
+    return {[=](Model& model, SweepParameters const& parameters) {
+        model.add(builtin::constant_magnetic_field(get(parameters, magnitude)));
+    }};
+}
+
+SweepModifier constant_electric_field(std::string const& magnitude, Cartesian direction) {
+    return {[=](Model& model, SweepParameters const& parameters) {
+        auto const field = static_cast<float>(get(parameters, magnitude));
+        model.add(builtin::constant_electric_field(Cartesian(direction * field)));
+    }};
+}
+
+SweepModifier anderson_disorder(std::string const& width, std::uint64_t seed) {
+    return {[=](Model& model, SweepParameters const& parameters) {
+        model.add(builtin::anderson_disorder(get(parameters, width), seed));
+    }};
+}
+
+SweepModifier strained_hopping(std::string const& beta, double reference_length) {
+    return {[=](Model& model, SweepParameters const& parameters) {
+        model.add(builtin::strained_hopping(get(parameters, beta), reference_length));
+    }};
+}
+
+} // namespace sweep
+
+ArrayXXdCM run_sweep(Model const& model, SweepGrid const& grid,
+                     std::vector<SweepModifier> const& modifiers,
+                     SweepCalculation const& calculation, idx_t num_threads) {
+    if (grid.points.cols() != static_cast<idx_t>(grid.names.size())) {
+        throw std::invalid_argument("Sweep: expected one column of points per parameter name.");
+    }
+
+    // Build the shared system now: the copies of the model would each build their own
+    model.system();
+
+    auto const num_points = grid.size();
+    auto const num_workers = std::min(num_points, resolve_num_threads(num_threads));
+    auto results = ArrayXXdCM(calculation.energy.size(), num_points);
+    parallel_for_each(static_cast<size_t>(num_points), num_workers, [&](size_t i) {
+        auto const n = static_cast<idx_t>(i);
+        auto point = model;
+        auto const parameters = grid.at(n);
+        for (auto const& modifier : modifiers) { modifier.apply(point, parameters); }
+
+        // The threads of the Hamiltonian build and the compute are this worker's share
+        point.set_num_threads(-1);
+        auto const kpm = KPM(point, kpm::DefaultCompute(), calculation.config);
+        if (calculation.kind == SweepCalculation::Kind::DOS) {
+            results.col(n) = kpm.calc_dos(calculation.energy, calculation.broadening,
+                                          calculation.num_random);
+        } else {
+            results.col(n) = kpm.calc_ldos(calculation.energy, calculation.broadening,
+                                           calculation.position, calculation.sublattice).col(0);
+        }
+    });
+    return results;
+}
+
+} // namespace cpb
@@ -0,0 +1,156 @@
+#include "hamiltonian/BuiltinModifiers.hpp"
+
+#include "numeric/constant.hpp"
+#include "numeric/random.hpp"
+
+namespace cpb { namespace builtin {
+
+namespace {
+
+/// Add `potential` to the diagonal orbitals of the onsite energy of `nsites` sites
+template<class Array>
+void add_to_diagonal(Array& energy, ArrayXd const& potential) {
+    using scalar_t = typename Array::Scalar;
+    auto const nsites = potential.size();
+    if (nsites == 0) { return; }
+
+    auto const norb = static_cast<idx_t>(std::lround(std::sqrt(energy.size() / nsites)));
+    auto const cast_potential = potential.cast<scalar_t>().eval();
+    for (auto i = idx_t{0}; i < norb; ++i) {
+        energy.segment((i * norb + i) * nsites, nsites) += cast_potential;
+    }
+}
+
+/// Multiply each element of the hopping matrices of `nhoppings` hoppings by `factor`
+template<class Array, class Factor>
+void scale_hoppings(Array& energy, Factor const& factor) {
+    auto const nhoppings = factor.size();
+    if (nhoppings == 0) { return; }
+
+    for (auto start = idx_t{0}; start < energy.size(); start += nhoppings) {
+        energy.segment(start, nhoppings) *= factor;
+    }
+}
+
+struct PotentialOp {
+    ArrayXd const& potential;
+
+    template<class Array>
+    void operator()(Array energy) const { add_to_diagonal(energy, potential); }
+};
+
+struct HoppingFactorOp {
+    ArrayXd const& factor;
+
+    template<class Array>
+    void operator()(Array energy) const {
+        using scalar_t = typename Array::Scalar;
+        scale_hoppings(energy, factor.cast<scalar_t>().eval());
+    }
+};
+
+struct PeierlsOp {
+    ArrayXd const& phase;
+
+    template<class Array>
+    void operator()(Array) const { throw ComplexOverride(); }
+
+    template<class real_t>
+    void operator()(Map<ArrayX<std::complex<real_t>>> energy) const {
+        using scalar_t = std::complex<real_t>;
+        auto const factor = phase.unaryExpr([](double p) {
+            return static_cast<scalar_t>(std::polar(1.0, p));
+        }).eval();
+        scale_hoppings(energy, factor);
+    }
+};
+
+/// Independent random streams for each kind of disorder
+enum RandomStream : std::uint64_t { onsite_disorder_stream = 0, vacancy_stream = 1 };
+
+} // anonymous namespace
+
+HoppingModifier constant_magnetic_field(double magnitude) {
+    // the vector potential and the coordinates are in [nm] -> scale to [m]
+    auto const k = 1e-18 / static_cast<double>(constant::hbar);
+    return {[magnitude, k](ComplexArrayRef energy, CartesianArrayConstRef pos1,
+                           CartesianArrayConstRef pos2, string_view) {
+        // vector potential along the x-axis, integrated from position 1 to position 2
+        auto const vp_x = 0.5 * magnitude * (pos1.y() + pos2.y()).cast<double>();
+        auto const phase = (k * vp_x * (pos1.x() - pos2.x()).cast<double>()).eval();
+        num::match<ArrayX>(energy, PeierlsOp{phase});
+    }, /*is_complex*/true, /*is_double*/false, /*is_thread_safe*/true};
+}
+
+OnsiteModifier constant_electric_field(Cartesian field) {
+    return {[field](ComplexArrayRef energy, CartesianArrayConstRef pos, string_view) {
+        auto const f = field.cast<double>().eval();
+        auto const potential = (f.x() * pos.x().cast<double>()
+                                + f.y() * pos.y().cast<double>()
+                                + f.z() * pos.z().cast<double>()).eval();
+        num::match<ArrayX>(energy, PotentialOp{potential});
+    }, /*is_complex*/false, /*is_double*/false, /*is_thread_safe*/true};
+}
+
+OnsiteModifier anderson_disorder(double width, std::uint64_t seed) {
+    auto const generator = num::Philox(seed);
+    return {[width, generator](ComplexArrayRef energy, CartesianArrayConstRef pos,
+                               string_view, idx_t first_site) {
+        auto const uniform = num::make_random<ArrayXd>(pos.size(), generator,
+                                                       onsite_disorder_stream, first_site);
+        num::match<ArrayX>(energy, PotentialOp{width * (uniform - 0.5)});
+    }, /*is_complex*/false, /*is_double*/false, /*is_thread_safe*/true};
+}
+
+SiteStateModifier random_vacancies(double probability, std::uint64_t seed, int min_neighbors) {
+    auto const generator = num::Philox(seed);
+    return {[probability, generator](Eigen::Ref<ArrayX<bool>> state, CartesianArrayConstRef,
+                                     string_view, idx_t first_site) {
+        auto const uniform = num::make_random<ArrayXd>(state.size(), generator,
+                                                       vacancy_stream, first_site);
+        state = state && (uniform >= probability);
+    }, min_neighbors};
+}
+
+HoppingModifier strained_hopping(double beta, double reference_length) {
+    return {[beta, reference_length](ComplexArrayRef energy, CartesianArrayConstRef pos1,
+                                     CartesianArrayConstRef pos2, string_view) {
+        auto const dx = (pos1.x() - pos2.x()).cast<double>();
+        auto const dy = (pos1.y() - pos2.y()).cast<double>();
+        auto const dz = (pos1.z() - pos2.z()).cast<double>();
+        auto const length = (dx.square() + dy.square() + dz.square()).sqrt();
+        auto const factor = (-beta * (length / reference_length - 1.0)).exp().eval();
+        num::match<ArrayX>(energy, HoppingFactorOp{factor});
+    }, /*is_complex*/false, /*is_double*/false, /*is_thread_safe*/true};
+}
+
+OnsiteModifier onsite_expression(std::string const& expression,
+                                 std::map<std::string, double> const& constants) {
+    auto const e = std::make_shared<Expression const>(
+        expression, std::vector<std::string>{"x", "y", "z"}, std::vector<std::string>{"sub_id"},
+        constants
+    );
+    return {[e](ComplexArrayRef energy, CartesianArrayConstRef pos, string_view sublattice) {
+        auto const potential = e->eval(pos.size(), {pos.x().data(), pos.y().data(),
+                                                    pos.z().data()}, {sublattice});
+        num::match<ArrayX>(energy, PotentialOp{potential});
+    }, /*is_complex*/false, /*is_double*/false, /*is_thread_safe*/true};
+}
+
+HoppingModifier hopping_expression(std::string const& expression,
+                                   std::map<std::string, double> const& constants) {
+    auto const e = std::make_shared<Expression const>(
+        expression, std::vector<std::string>{"x1", "y1", "z1", "x2", "y2", "z2"},
+        std::vector<std::string>{"hop_id"}, constants
+    );
+    return {[e](ComplexArrayRef energy, CartesianArrayConstRef pos1,
+                CartesianArrayConstRef pos2, string_view hopping_family) {
+        auto const factor = e->eval(pos1.size(), {pos1.x().data(), pos1.y().data(),
+                                                  pos1.z().data(), pos2.x().data(),
+                                                  pos2.y().data(), pos2.z().data()},
+                                    {hopping_family});
+        num::match<ArrayX>(energy, HoppingFactorOp{factor});
+    }, /*is_complex*/false, /*is_double*/false, /*is_thread_safe*/true};
+}
+
+}} // namespace cpb::builtin
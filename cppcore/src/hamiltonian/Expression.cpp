@@ -0,0 +1,305 @@
+#include "hamiltonian/Expression.hpp"
+
+#include "support/format.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+namespace cpb {
+
+namespace {
+
+/// Number of elements evaluated at once: the stack of blocks stays in cache
+constexpr auto block_size = idx_t{1024};
+constexpr auto pi = 3.14159265358979323846;
+
+bool is_name_start(char c) { return std::isalpha(static_cast<unsigned char>(c)) || c == '_'; }
+bool is_name_char(char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; }
+
+} // anonymous namespace
+
+/// Recursive descent parser which emits the postfix program of an `Expression`
+class ExpressionParser {
+    using Op = Expression::Op;
+
+public:
+    ExpressionParser(Expression& expression, std::vector<std::string> const& variables,
+                     std::vector<std::string> const& labels,
+                     std::map<std::string, double> const& constants)
+        : expression(expression), text(expression.source_text), variables(variables),
+          labels(labels), constants(constants) {}
+
+    void parse() {
+        skip_space();
+        comparison();
+        if (pos != text.size()) { fail("unexpected '" + text.substr(pos, 1) + "'"); }
+    }
+
+private:
+    struct Function {
+        char const* name;
+        Op op;
+        int num_args;
+    };
+
+    static Function const* find_function(std::string const& name) {
+        static Function const functions[] = {
+            {"exp", Op::exp, 1}, {"log", Op::log, 1}, {"sqrt", Op::sqrt, 1},
+            {"abs", Op::abs, 1}, {"sin", Op::sin, 1}, {"cos", Op::cos, 1},
+            {"tan", Op::tan, 1}, {"sinh", Op::sinh, 1}, {"cosh", Op::cosh, 1},
+            {"tanh", Op::tanh, 1}, {"min", Op::min, 2}, {"max", Op::max, 2},
+            {"atan2", Op::atan2, 2}, {"pow", Op::power, 2}, {"where", Op::where, 3}
+        };
+        auto const it = std::find_if(std::begin(functions), std::end(functions),
+                                     [&](Function const& f) { return name == f.name; });
+        return it != std::end(functions) ? it : nullptr;
+    }
+
+    [[noreturn]] void fail(std::string const& message) const {
+        throw std::invalid_argument(fmt::format("Expression \"{}\": {} at position {}",
+                                                text, message, pos));
+    }
+
+    /// Append an instruction which pops `num_args` values and pushes its result
+    void emit(Op op, int num_args, double value = 0, idx_t index = 0, std::string name = {}) {
+        depth += 1 - num_args;
+        expression.max_depth = std::max(expression.max_depth, depth);
+        expression.program.push_back({op, value, index, std::move(name)});
+    }
+
+    void skip_space() {
+        while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) { ++pos; }
+    }
+
+    bool accept(char const* token) {
+        auto const size = std::strlen(token);
+        if (text.compare(pos, size, token) != 0) { return false; }
+        pos += size;
+        skip_space();
+        return true;
+    }
+
+    void expect(char const* token) {
+        if (!accept(token)) { fail(fmt::format("expected '{}'", token)); }
+    }
+
+    static idx_t find(std::vector<std::string> const& names, std::string const& name) {
+        auto const it = std::find(names.begin(), names.end(), name);
+        return it != names.end() ? static_cast<idx_t>(it - names.begin()) : -1;
+    }
+
+    void comparison() {
+        additive();
+        while (true) {
+            auto op = Op::constant;
+            if (accept("<=")) { op = Op::less_equal; }
+            else if (accept(">=")) { op = Op::greater_equal; }
+            else if (accept("==")) { op = Op::equal; }
+            else if (accept("!=")) { op = Op::not_equal; }
+            else if (accept("<")) { op = Op::less; }
+            else if (accept(">")) { op = Op::greater; }
+            else { return; }
+            additive();
+            emit(op, 2);
+        }
+    }
+
+    void additive() {
+        term();
+        while (true) {
+            if (accept("+")) { term(); emit(Op::add, 2); }
+            else if (accept("-")) { term(); emit(Op::subtract, 2); }
+            else { return; }
+        }
+    }
+
+    void term() {
+        unary();
+        while (true) {
+            if (accept("*")) { unary(); emit(Op::multiply, 2); }
+            else if (accept("/")) { unary(); emit(Op::divide, 2); }
+            else { return; }
+        }
+    }
+
+    /// Like Python: `-a ** b` is `-(a ** b)` and `a ** -b` is allowed
+    void unary() {
+        if (accept("-")) {
+            unary();
+            emit(Op::negate, 1);
+        } else if (accept("+")) {
+            unary();
+        } else {
+            power();
+        }
+    }
+
+    void power() {
+        primary();
+        if (accept("**") || accept("^")) {
+            unary(); // right-associative
+            emit(Op::power, 2);
+        }
+    }
+
+    void primary() {
+        if (pos == text.size()) { fail("unexpected end"); }
+
+        if (accept("(")) {
+            comparison();
+            expect(")");
+        } else if (std::isdigit(static_cast<unsigned char>(text[pos])) || text[pos] == '.') {
+            number();
+        } else if (is_name_start(text[pos])) {
+            identifier();
+        } else {
+            fail("unexpected '" + text.substr(pos, 1) + "'");
+        }
+    }
+
+    void number() {
+        auto const start = text.c_str() + pos;
+        auto end = static_cast<char*>(nullptr);
+        auto const value = std::strtod(start, &end);
+        if (end == start) { fail("invalid number"); }
+        pos += static_cast<size_t>(end - start);
+        skip_space();
+        emit(Op::constant, 0, value);
+    }
+
+    /// A function call, a constant, a variable or a label comparison
+    void identifier() {
+        auto const start = pos;
+        while (pos < text.size() && is_name_char(text[pos])) { ++pos; }
+        auto const name = text.substr(start, pos - start);
+        skip_space();
+
+        if (auto const function = find_function(name)) {
+            expect("(");
+            for (auto n = 0; n < function->num_args; ++n) {
+                if (n > 0) { expect(","); }
+                comparison();
+            }
+            expect(")");
+            emit(function->op, function->num_args);
+        } else if (name == "pi") {
+            emit(Op::constant, 0, pi);
+        } else if (constants.count(name)) {
+            emit(Op::constant, 0, constants.at(name));
+        } else if (find(variables, name) >= 0) {
+            emit(Op::variable, 0, 0, find(variables, name));
+        } else if (find(labels, name) >= 0) {
+            label(find(labels, name));
+        } else {
+            pos = start;
+            fail("unknown name '" + name + "'");
+        }
+    }
+
+    void label(idx_t index) {
+        auto const is_equal = accept("==");
+        if (!is_equal && !accept("!=")) { fail("a label can only be compared (== or !=)"); }
+
+        auto const quote = pos < text.size() ? text[pos] : '\0';
+        if (quote != '"' && quote != '\'') { fail("expected a quoted name"); }
+        auto const end = text.find(quote, pos + 1);
+        if (end == std::string::npos) { fail("unterminated string"); }
+
+        auto name = text.substr(pos + 1, end - pos - 1);
+        pos = end + 1;
+        skip_space();
+        emit(Op::label, 0, is_equal ? 1 : 0, index, std::move(name));
+    }
+
+private:
+    Expression& expression;
+    std::string const& text;
+    std::vector<std::string> const& variables;
+    std::vector<std::string> const& labels;
+    std::map<std::string, double> const& constants;
+    size_t pos = 0;
+    idx_t depth = 0; ///< of the evaluation stack at the current instruction
+};
+
+Expression::Expression(std::string const& source, std::vector<std::string> const& variables,
+                       std::vector<std::string> const& labels,
+                       std::map<std::string, double> const& constants)
+    : source_text(source) {
+    ExpressionParser(*this, variables, labels, constants).parse();
+}
+
+ArrayXd Expression::eval(idx_t size, std::vector<float const*> const& variables,
+                         std::vector<std::string> const& labels) const {
+    auto result = ArrayXd(size);
+    auto stack = std::vector<ArrayXd>(static_cast<size_t>(max_depth), ArrayXd(block_size));
+
+    for (auto start = idx_t{0}; start < size; start += block_size) {
+        auto const n = std::min(block_size, size - start);
+        auto top = size_t{0}; ///< the number of values on the stack
+
+        for (auto const& i : program) {
+            if (i.op == Op::constant) {
+                stack[top++].head(n).setConstant(i.value);
+            } else if (i.op == Op::variable) {
+                auto const x = Eigen::Map<ArrayXf const>(variables[i.index] + start, n);
+                stack[top++].head(n) = x.cast<double>();
+            } else if (i.op == Op::label) {
+                auto const is_equal = labels[i.index] == i.text;
+                stack[top++].head(n).setConstant(is_equal ? i.value : 1 - i.value);
+            } else if (i.op == Op::where) {
+                top -= 2;
+                auto condition = stack[top - 1].head(n);
+                condition = (condition != 0).select(stack[top].head(n), stack[top + 1].head(n));
+            } else if (i.op == Op::negate || (i.op >= Op::exp && i.op <= Op::tanh)) {
+                auto a = stack[top - 1].head(n);
+                switch (i.op) {
+                    case Op::negate: a = -a; break;
+                    case Op::exp: a = a.exp(); break;
+                    case Op::log: a = a.log(); break;
+                    case Op::sqrt: a = a.sqrt(); break;
+                    case Op::abs: a = a.abs(); break;
+                    case Op::sin: a = a.sin(); break;
+                    case Op::cos: a = a.cos(); break;
+                    case Op::tan: a = a.tan(); break;
+                    case Op::sinh: a = a.sinh(); break;
+                    case Op::cosh: a = a.cosh(); break;
+                    case Op::tanh: a = a.tanh(); break;
+                    default: break;
+                }
+            } else {
+                --top;
+                auto a = stack[top - 1].head(n);
+                auto const b = stack[top].head(n);
+                switch (i.op) {
+                    case Op::add: a += b; break;
+                    case Op::subtract: a -= b; break;
+                    case Op::multiply: a *= b; break;
+                    case Op::divide: a /= b; break;
+                    case Op::less: a = (a < b).cast<double>(); break;
+                    case Op::less_equal: a = (a <= b).cast<double>(); break;
+                    case Op::greater: a = (a > b).cast<double>(); break;
+                    case Op::greater_equal: a = (a >= b).cast<double>(); break;
+                    case Op::equal: a = (a == b).cast<double>(); break;
+                    case Op::not_equal: a = (a != b).cast<double>(); break;
+                    case Op::min: a = a.min(b); break;
+                    case Op::max: a = a.max(b); break;
+                    case Op::power:
+                        for (auto k = idx_t{0}; k < n; ++k) { a[k] = std::pow(a[k], b[k]); }
+                        break;
+                    case Op::atan2:
+                        for (auto k = idx_t{0}; k < n; ++k) { a[k] = std::atan2(a[k], b[k]); }
+                        break;
+                    default: break;
+                }
+            }
+        }
+        result.segment(start, n) = stack[0].head(n);
+    }
+    return result;
+}
+
+} // namespace cpb
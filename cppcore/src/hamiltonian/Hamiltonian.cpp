@@ -33,13 +33,54 @@ struct Cols {
     idx_t operator()(SparseMatrixRC<scalar_t> const& m) const { return m->cols(); }
 };
 
+struct MatrixMemory {
+    template<class scalar_t>
+    std::size_t operator()(SparseMatrixRC<scalar_t> const& m) const {
+        if (!m) { return 0; }
+        auto const nnz = static_cast<std::size_t>(m->nonZeros());
+        auto const rows = static_cast<std::size_t>(m->outerSize());
+        return nnz * (sizeof(scalar_t) + sizeof(storage_idx_t))
+               + (rows + 1) * sizeof(storage_idx_t);
+    }
+};
+
+struct IsInvariant {
+    ArrayXi const& permutation;
+    double tolerance;
+
+    template<class scalar_t>
+    bool operator()(SparseMatrixRC<scalar_t> const& m) const {
+        if (!m || permutation.size() != m->rows()) { return false; }
+        auto const values = Eigen::Map<ArrayX<scalar_t> const>(m->valuePtr(), m->nonZeros());
+        auto const max_value = values.size() > 0 ? static_cast<double>(values.abs().maxCoeff())
+                                                 : 0.0;
+        auto const max_error = tolerance * max_value;
+
+        // The permutation is a bijection: equal values at all the permuted non-zeros are enough
+        for (auto row = idx_t{0}; row < m->outerSize(); ++row) {
+            for (auto it = typename SparseMatrixX<scalar_t>::InnerIterator(*m, row); it; ++it) {
+                auto const image = m->coeff(permutation[row], permutation[it.col()]);
+                if (static_cast<double>(std::abs(image - it.value())) > max_error) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
 } // namespace
 
+bool is_invariant(Hamiltonian const& h, ArrayXi const& permutation, double tolerance) {
+    return var::apply_visitor(IsInvariant{permutation, tolerance}, h.get_variant());
+}
+
 Hamiltonian::operator bool() const {
     return var::apply_visitor(IsValid(), variant_matrix);
 }
 
 void Hamiltonian::reset() {
+    view.reset();
     return var::apply_visitor(Reset(), variant_matrix);
 }
 
@@ -59,4 +100,42 @@ idx_t Hamiltonian::cols() const {
     return var::apply_visitor(Cols(), variant_matrix);
 }
 
+std::size_t Hamiltonian::memory_usage() const {
+    return var::apply_visitor(MatrixMemory(), variant_matrix);
+}
+
+std::shared_ptr<void>& Hamiltonian::view_cache() const {
+    if (!view) { view = std::make_shared<std::shared_ptr<void>>(); }
+    return *view;
+}
+
+namespace detail {
+
+ArrayXi max_row_nnz(System const& system, bool has_onsite) {
+    // Count per site first: all the orbitals (rows) of a site have the same number of terms
+    auto site_orbitals = ArrayXi(system.num_sites());
+    for (auto const& sub : system.compressed_sublattices) {
+        site_orbitals.segment(sub.sys_start(), sub.num_sites()).setConstant(sub.num_orbitals());
+    }
+
+    auto site_counts = has_onsite ? site_orbitals.eval() : ArrayXi::Zero(system.num_sites()).eval();
+    for (auto const& block : system.hopping_blocks) {
+        for (auto const& coo : block.coordinates()) {
+            site_counts[coo.row] += site_orbitals[coo.col];
+            site_counts[coo.col] += site_orbitals[coo.row];
+        }
+    }
+
+    auto counts = ArrayXi(system.hamiltonian_size());
+    for (auto const& sub : system.compressed_sublattices) {
+        auto const norb = sub.num_orbitals();
+        for (auto n = idx_t{0}; n < sub.num_sites(); ++n) {
+            counts.segment(sub.ham_start() + n * norb, norb)
+                  .setConstant(site_counts[sub.sys_start() + n]);
+        }
+    }
+    return counts;
+}
+
+} // namespace detail
 } // namespace cpb
@@ -1,7 +1,21 @@
 #include "hamiltonian/HamiltonianModifiers.hpp"
+#include "utils/Memory.hpp"
 
 namespace cpb {
 
+constexpr idx_t HamiltonianModifiers::max_slice_size;
+constexpr idx_t HamiltonianModifiers::max_indexed_slice_size;
+
+namespace {
+
+/// Transient memory of a hopping in an indexed slice: the energy and the positions which
+/// a Python modifier typically gathers from the indices, with room for temporaries
+constexpr auto bytes_per_hopping = std::size_t{128};
+/// A slice may take up this fraction of the available memory
+constexpr auto slice_memory_fraction = std::size_t{8};
+
+} // anonymous namespace
+
 bool HamiltonianModifiers::any_complex() const {
     const auto complex_potential = std::any_of(
         onsite.begin(), onsite.end(), [](OnsiteModifier const& o) { return o.is_complex; }
@@ -22,9 +36,67 @@ bool HamiltonianModifiers::any_double() const {
     return double_potential || double_hoppings;
 }
 
+bool HamiltonianModifiers::all_thread_safe() const {
+    auto const safe_potential = std::all_of(
+        onsite.begin(), onsite.end(), [](OnsiteModifier const& o) { return o.is_thread_safe; }
+    );
+    auto const safe_hoppings = std::all_of(
+        hopping.begin(), hopping.end(), [](HoppingModifier const& h) { return h.is_thread_safe; }
+    );
+    return safe_potential && safe_hoppings;
+}
+
+idx_t HamiltonianModifiers::hopping_slice_size() const {
+    auto const indexed = !hopping.empty() && std::all_of(
+        hopping.begin(), hopping.end(), [](HoppingModifier const& h) { return h.is_indexed(); }
+    );
+    auto const any_sequential = std::any_of(
+        hopping.begin(), hopping.end(), [](HoppingModifier const& h) { return !h.is_thread_safe; }
+    );
+    if (!indexed || !any_sequential) {
+        return max_slice_size; // small slices are cheap and they can be computed concurrently
+    }
+
+    auto const budget = available_memory() / slice_memory_fraction / bytes_per_hopping;
+    auto const size = static_cast<idx_t>(
+        std::min(budget, static_cast<std::size_t>(max_indexed_slice_size))
+    );
+    return std::max(size, max_slice_size);
+}
+
 void HamiltonianModifiers::clear() {
     onsite.clear();
     hopping.clear();
 }
 
+std::vector<OnsiteSlice> HamiltonianModifiers::onsite_slices(System const& system) const {
+    auto slices = std::vector<OnsiteSlice>();
+    if (!system.site_registry.has_nonzero_energy() && onsite.empty()) {
+        return slices;
+    }
+
+    for (auto const& sub : system.compressed_sublattices) {
+        auto const norb = sub.num_orbitals();
+        auto const step = std::max(max_slice_size / (norb * norb), idx_t{1});
+        for (auto start = idx_t{0}; start < sub.num_sites(); start += step) {
+            slices.push_back({sub, start, std::min(step, sub.num_sites() - start)});
+        }
+    }
+    return slices;
+}
+
+std::vector<HoppingSlice> HamiltonianModifiers::hopping_slices(
+    System const& system, HoppingBlocks const& hopping_blocks) const {
+    auto slices = std::vector<HoppingSlice>();
+    auto const slice_size = hopping_slice_size();
+    for (auto const& block : hopping_blocks) {
+        auto const unit_size = system.hopping_registry.energy(block.family_id()).size();
+        auto const step = std::max(slice_size / unit_size, idx_t{1});
+        for (auto start = idx_t{0}; start < block.size(); start += step) {
+            slices.push_back({block, start, std::min(step, block.size() - start)});
+        }
+    }
+    return slices;
+}
+
 } // namespace cpb
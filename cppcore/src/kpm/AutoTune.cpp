@@ -0,0 +1,196 @@
+#include "kpm/AutoTune.hpp"
+#include "kpm/default/dispatch.hpp"
+
+#include <fstream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+namespace cpb { namespace kpm {
+
+namespace {
+    /// Enough moments to amortize the setup of the compute kernels
+    constexpr auto num_tuning_moments = idx_t{64};
+    /// The best time of a few repetitions filters out noise from other processes
+    constexpr auto num_tuning_repeats = 3;
+
+    struct TuningCache {
+        std::mutex mutex;
+        std::map<std::string, TunedConfig> entries;
+        std::set<std::string> loaded_files;
+    };
+
+    TuningCache& tuning_cache() {
+        static TuningCache cache;
+        return cache;
+    }
+
+    char const* format_name(MatrixFormat format) {
+        switch (format) {
+            case MatrixFormat::CSR: return "CSR";
+            case MatrixFormat::ELL: return "ELL";
+            case MatrixFormat::SELL: return "SELL";
+            case MatrixFormat::STENCIL: return "STENCIL";
+            case MatrixFormat::BSR: return "BSR";
+            case MatrixFormat::HERMITIAN: return "HERMITIAN";
+            case MatrixFormat::ELL_TABLE: return "ELL_TABLE";
+            case MatrixFormat::ELL_DELTA: return "ELL_DELTA";
+            case MatrixFormat::HYB: return "HYB";
+            case MatrixFormat::ELL_SPLIT: return "ELL_SPLIT";
+            case MatrixFormat::ELL_BF16: return "ELL_BF16";
+            case MatrixFormat::ELL_INT8: return "ELL_INT8";
+        }
+        return "";
+    }
+
+    bool parse_format(std::string const& name, MatrixFormat& format) {
+        for (auto f : {MatrixFormat::CSR, MatrixFormat::ELL, MatrixFormat::SELL,
+                       MatrixFormat::STENCIL, MatrixFormat::BSR, MatrixFormat::HERMITIAN,
+                       MatrixFormat::ELL_TABLE, MatrixFormat::ELL_DELTA, MatrixFormat::HYB,
+                       MatrixFormat::ELL_SPLIT, MatrixFormat::ELL_BF16, MatrixFormat::ELL_INT8}) {
+            if (name == format_name(f)) { format = f; return true; }
+        }
+        return false;
+    }
+
+    /// Shape, max nnz per row and scalar type of the Hamiltonian matrix
+    struct MatrixSignature {
+        template<class scalar_t>
+        std::string operator()(SparseMatrixRC<scalar_t> const& m) const {
+            return fmt::format("{}x{}:{}:{}", m->rows(), m->cols(), sparse::max_nnz_per_row(*m),
+                               num::scalar_name<scalar_t>());
+        }
+    };
+
+    struct IsStencil {
+        template<class scalar_t>
+        bool operator()(num::StencilMatrix<scalar_t> const&) const { return true; }
+        template<class Matrix>
+        bool operator()(Matrix const&) const { return false; }
+    };
+
+    struct IsBsr {
+        template<class scalar_t>
+        bool operator()(num::BsrMatrix<scalar_t> const&) const { return true; }
+        template<class Matrix>
+        bool operator()(Matrix const&) const { return false; }
+    };
+
+    /// The cache key doesn't contain any spaces: it's the first word of a line in the file
+    std::string make_key(Hamiltonian const& h, Compute const& compute, Config const& config,
+                         bool has_stencil, idx_t block_size) {
+        auto const blocks = block_size > 1 ? fmt::format(":bsr{}", block_size) : std::string();
+        return fmt::format("{}:{}:{}{}:{}:{}/{}", h.get_variant().match(MatrixSignature{}),
+                           config.mixed_precision ? "mixed" : "full",
+                           has_stencil ? "stencil" : "sparse", blocks,
+                           dispatch::best().instruction_set,
+                           compute->get_num_threads(), std::thread::hardware_concurrency());
+    }
+
+    /// Read the `key format interleaved` lines of the cache file -- invalid lines are skipped
+    void load(TuningCache& cache, std::string const& filename) {
+        if (!cache.loaded_files.insert(filename).second) { return; }
+
+        std::ifstream file(filename);
+        auto key = std::string(), name = std::string();
+        auto interleaved = 0;
+        while (file >> key >> name >> interleaved) {
+            auto tuned = TunedConfig{MatrixFormat::ELL, interleaved != 0};
+            if (parse_format(name, tuned.matrix_format)) {
+                cache.entries[key] = tuned;
+            }
+        }
+    }
+
+    void save(std::string const& filename, std::string const& key, TunedConfig tuned) {
+        std::ofstream file(filename, std::ios::app);
+        file << key << ' ' << format_name(tuned.matrix_format) << ' '
+             << (tuned.interleaved ? 1 : 0) << '\n';
+    }
+
+    /// The best time of computing a few diagonal moments with the given configuration
+    double time_candidate(Hamiltonian const& h, Compute const& compute, Config const& config,
+                          Scale<> scale, num::StencilPattern const& stencil,
+                          idx_t block_size, TunedConfig candidate) {
+        auto algorithm = config.algorithm;
+        algorithm.interleaved = candidate.interleaved;
+
+        auto oh = OptimizedHamiltonian(h, candidate.matrix_format, algorithm.reorder(),
+                                       config.mixed_precision, stencil,
+                                       compute->get_num_threads(), /*cache_size*/0,
+                                       block_size);
+        oh.optimize_for(Indices::full_system(), scale);
+        auto const fell_back = (candidate.matrix_format == MatrixFormat::STENCIL
+                                && !oh.matrix().match(IsStencil{}))
+                               || (candidate.matrix_format == MatrixFormat::BSR
+                                   && !oh.matrix().match(IsBsr{}));
+        if (fell_back) {
+            return std::numeric_limits<double>::max(); // fell back to ELL: already a candidate
+        }
+
+        algorithm.optimal_size = false; // time full-size iterations: the same for any index
+        auto const starter = unit_starter(oh);
+        auto best = std::numeric_limits<double>::max();
+        for (auto i = 0; i < num_tuning_repeats; ++i) {
+            auto moments = DiagonalMoments(round_num_moments(num_tuning_moments));
+            auto timer = Chrono();
+            compute->moments(&moments, starter, algorithm, oh);
+            best = std::min(best, timer.toc().elapsed_seconds());
+        }
+        return best;
+    }
+} // anonymous namespace
+
+TunedConfig auto_tune(Hamiltonian const& h, Compute const& compute, Config const& config,
+                      Scale<> scale, num::StencilPattern const& stencil, idx_t block_size) {
+    auto const key = make_key(h, compute, config, static_cast<bool>(stencil), block_size);
+    auto& cache = tuning_cache();
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        if (!config.tuning_cache_file.empty()) { load(cache, config.tuning_cache_file); }
+
+        auto const it = cache.entries.find(key);
+        if (it != cache.entries.end()) { return it->second; }
+    }
+
+    auto candidates = std::vector<MatrixFormat>{MatrixFormat::CSR, MatrixFormat::ELL,
+                                                MatrixFormat::SELL, MatrixFormat::HERMITIAN};
+    if (stencil) { candidates.push_back(MatrixFormat::STENCIL); }
+    if (block_size > 1) { candidates.push_back(MatrixFormat::BSR); }
+
+    auto best = TunedConfig{config.matrix_format, config.algorithm.interleaved};
+    auto best_time = std::numeric_limits<double>::max();
+    for (auto format : candidates) {
+        for (auto interleaved : {false, true}) {
+            auto const candidate = TunedConfig{format, interleaved};
+            auto const t = time_candidate(h, compute, config, scale, stencil, block_size,
+                                          candidate);
+            if (t < best_time) {
+                best_time = t;
+                best = candidate;
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.entries[key] = best;
+    if (!config.tuning_cache_file.empty()) { save(config.tuning_cache_file, key, best); }
+    return best;
+}
+
+idx_t tuning_cache_size() {
+    auto& cache = tuning_cache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    return static_cast<idx_t>(cache.entries.size());
+}
+
+void clear_tuning_cache() {
+    auto& cache = tuning_cache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.entries.clear();
+    cache.loaded_files.clear();
+}
+
+}} // namespace cpb::kpm
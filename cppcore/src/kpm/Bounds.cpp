@@ -1,40 +1,104 @@
 #include "kpm/Bounds.hpp"
 #include "kpm/Stats.hpp"
 
-#include "compute/lanczos.hpp"
+#include "kpm/default/dispatch.hpp"
+#include "utils/ThreadBudget.hpp"
+#include "utils/Trace.hpp"
+
+#include <limits>
 
 namespace cpb { namespace kpm {
 
 namespace {
+    struct GershgorinBounds {
+        template<class scalar_t>
+        std::pair<double, double> operator()(SparseMatrixRC<scalar_t> const& h) const {
+            return num::gershgorin_bounds(*h);
+        }
+    };
 
-struct MinMaxEigenvalues {
-    double precision_percent;
-
-    template<class scalar_t>
-    compute::LanczosBounds operator()(SparseMatrixRC<scalar_t> const& ph) const {
-        return compute::minmax_eigenvalues(*ph, precision_percent);
-    }
-};
+    /// `num::difference_norm()` -- infinite if the scalar types don't match
+    struct DifferenceNorm {
+        Hamiltonian const& other;
 
+        template<class scalar_t>
+        double operator()(SparseMatrixRC<scalar_t> const& h) const {
+            if (!ham::is<scalar_t>(other)) { return std::numeric_limits<double>::infinity(); }
+            return num::difference_norm(*h, ham::get_reference<scalar_t>(other));
+        }
+    };
 } // anonymous namespace
 
+Bounds Bounds::gershgorin(Hamiltonian const& hamiltonian, double padding_percent) {
+    auto const span = trace::Span("bounds", "kpm");
+    auto timer = Chrono();
+    timer.tic();
+    auto const minmax = hamiltonian.get_variant().match(GershgorinBounds{});
+    timer.toc();
+
+    auto bounds = Bounds(minmax.first, minmax.second);
+    bounds.pad(padding_percent);
+    bounds.mode = BoundsMode::Gershgorin;
+    bounds.timer = timer;
+    return bounds;
+}
+
+Bounds Bounds::warm(Hamiltonian const& new_hamiltonian, double new_padding_percent) const {
+    auto bounds = Bounds(new_hamiltonian, precision_percent, num_threads, coarse_percent);
+    bounds.padding_percent = new_padding_percent;
+    bounds.reference = reference;
+    bounds.mode = BoundsMode::Warm;
+    return bounds;
+}
+
 void Bounds::compute_bounds() {
     if (!hamiltonian || min != max) { return; }
 
+    auto const span = trace::Span("bounds", "kpm");
     timer.tic();
-    auto const lanczos = hamiltonian.get_variant().match(MinMaxEigenvalues{precision_percent});
+    if (reference) {
+        auto const delta = hamiltonian.get_variant().match(DifferenceNorm{reference->hamiltonian});
+        if (delta <= max_perturbation * (reference->max - reference->min)) {
+            min = reference->min - delta;
+            max = reference->max + delta;
+            pad(padding_percent);
+            perturbation = delta;
+            lanczos_loops = 0;
+            timer.toc();
+            return;
+        }
+    }
+
+    auto const lanczos = dispatch::best().minmax_eigenvalues(hamiltonian, precision_percent,
+                                                             resolve_num_threads(num_threads),
+                                                             coarse_percent);
     timer.toc();
 
     min = lanczos.min;
     max = lanczos.max;
     lanczos_loops = lanczos.loops;
+    mode = BoundsMode::Lanczos;
+    reference = std::make_shared<Reference const>(Reference{hamiltonian, min, max});
+}
+
+void Bounds::pad(double percent) {
+    auto const padding = 0.5 * (max - min) * percent / 100;
+    min -= padding;
+    max += padding;
 }
 
 std::string Bounds::report(bool shortform) const {
     auto const fmt_str = shortform ? "{:.2f}, {:.2f}, {}"
-                                   : "Spectrum bounds found ({:.2f}, {:.2f} eV) "
-                                     "using Lanczos procedure with {} loops";
-    auto const msg = fmt::format(fmt_str, min, max, lanczos_loops);
+                       : mode == BoundsMode::Gershgorin
+                         ? "Spectrum bounds found ({:.2f}, {:.2f} eV) using Gershgorin circles"
+                         : mode == BoundsMode::Warm
+                           ? "Spectrum bounds found ({:.2f}, {:.2f} eV) from the previous "
+                             "Lanczos bounds, perturbation {:.3f} eV"
+                           : "Spectrum bounds found ({:.2f}, {:.2f} eV) "
+                             "using Lanczos procedure with {} loops";
+    auto const msg = mode == BoundsMode::Warm && !shortform
+                     ? fmt::format(fmt_str, min, max, perturbation)
+                     : fmt::format(fmt_str, min, max, lanczos_loops);
     return format_report(msg, timer, shortform);
 }
 
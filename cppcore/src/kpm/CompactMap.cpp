@@ -0,0 +1,67 @@
+#include "kpm/CompactMap.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace cpb { namespace kpm {
+
+namespace {
+    constexpr auto fixed_max = double{std::numeric_limits<std::int16_t>::max()};
+}
+
+CompactMap::CompactMap(idx_t rows, idx_t cols, MapPrecision precision) : precision(precision) {
+    if (precision == MapPrecision::Single) {
+        single.resize(rows, cols);
+    } else {
+        fixed.resize(rows, cols);
+        scales.resize(cols);
+    }
+}
+
+idx_t CompactMap::rows() const {
+    return precision == MapPrecision::Single ? single.rows() : fixed.rows();
+}
+
+idx_t CompactMap::cols() const {
+    return precision == MapPrecision::Single ? single.cols() : fixed.cols();
+}
+
+void CompactMap::set(idx_t first, ArrayXXdCM const& block) {
+    if (precision == MapPrecision::Single) {
+        single.middleCols(first, block.cols()) = block.cast<float>();
+        return;
+    }
+
+    for (auto j = idx_t{0}; j < block.cols(); ++j) {
+        auto const peak = block.col(j).abs().maxCoeff();
+        scales[first + j] = static_cast<float>(peak / fixed_max);
+        auto const scale = static_cast<double>(scales[first + j]);
+        auto const inverse = scale > 0 ? 1 / scale : 0.0;
+        for (auto i = idx_t{0}; i < block.rows(); ++i) {
+            auto const q = std::round(block(i, j) * inverse);
+            fixed(i, first + j) = static_cast<std::int16_t>(std::max(-fixed_max,
+                                                                     std::min(q, fixed_max)));
+        }
+    }
+}
+
+ArrayXXdCM CompactMap::decompressed() const {
+    if (precision == MapPrecision::Single) {
+        return single.cast<double>();
+    }
+
+    auto result = ArrayXXdCM(fixed.rows(), fixed.cols());
+    for (auto j = idx_t{0}; j < fixed.cols(); ++j) {
+        result.col(j) = fixed.col(j).cast<double>() * static_cast<double>(scales[j]);
+    }
+    return result;
+}
+
+size_t CompactMap::memory() const {
+    return static_cast<size_t>(single.size()) * sizeof(float)
+           + static_cast<size_t>(fixed.size()) * sizeof(std::int16_t)
+           + static_cast<size_t>(scales.size()) * sizeof(float);
+}
+
+}} // namespace cpb::kpm
@@ -1,35 +1,319 @@
 #include "kpm/Core.hpp"
 
+#include "kpm/AutoTune.hpp"
+#include "kpm/default/dispatch.hpp"
+#include "kpm/fermi.hpp"
 #include "kpm/reconstruct.hpp"
+#include "kpm/propagate.hpp"
+#include "utils/Trace.hpp"
+
+#include <algorithm>
+#include <iterator>
 
 namespace cpb { namespace kpm {
 
 namespace {
-    Bounds reset_bounds(Hamiltonian const& h, Config const& config) {
+    /// Return the result of `f()` and measure the time it took (also traced as `name`)
+    template<class F>
+    auto timed(Chrono& timer, F f, char const* name = "reconstruct") -> decltype(f()) {
+        auto const span = trace::Span(name, "kpm");
+        timer.tic();
+        auto result = f();
+        timer.toc();
+        return result;
+    }
+
+    struct DistanceColoring {
+        idx_t distance;
+
+        template<class scalar_t>
+        std::vector<storage_idx_t> operator()(SparseMatrixRC<scalar_t> const& h) const {
+            return num::distance_coloring(*h, distance);
+        }
+    };
+
+    struct ScalarSize {
+        template<class scalar_t>
+        size_t operator()(SparseMatrixRC<scalar_t> const&) const { return sizeof(scalar_t); }
+    };
+
+    /// Bytes held by the moment arrays of any of the `MomentsRef` types
+    struct DataMemory {
+        template<class Array>
+        size_t operator()(Array const& a) const {
+            return static_cast<size_t>(a.size()) * sizeof(typename Array::Scalar);
+        }
+
+        template<class scalar_t>
+        size_t operator()(std::vector<ArrayX<scalar_t>> const& v) const {
+            auto bytes = size_t{0};
+            for (auto const& a : v) { bytes += (*this)(a); }
+            return bytes;
+        }
+    };
+
+    struct MomentsMemory {
+        template<class M>
+        size_t operator()(M const* m) const { return var::apply_visitor(DataMemory{}, m->data); }
+
+        size_t operator()(KuboGreenwoodMoments const* m) const { return DataMemory{}(m->data); }
+
+        size_t operator()(BatchDenseMatrixMoments const* m) const {
+            auto bytes = size_t{0};
+            for (auto const& r : m->results) { bytes += var::apply_visitor(DataMemory{}, r.data); }
+            return bytes;
+        }
+    };
+
+    /// Only the LDOS recursions may stop early, see `AlgorithmConfig::convergence_tolerance`
+    struct SkippedMoments {
+        template<class M>
+        idx_t operator()(M const*) const { return 0; }
+
+        idx_t operator()(BatchDiagonalMoments const* m) const { return m->skipped_moments; }
+    };
+
+    /// The first `num_moments` of each result as a column of `ExpansionMoments::data`
+    struct ToExpansionData {
+        idx_t num_moments;
+
+        template<class scalar_t>
+        ArrayXXcd operator()(ArrayX<scalar_t> const& data) const {
+            return data.template cast<std::complex<double>>().head(num_moments);
+        }
+
+        template<class scalar_t>
+        ArrayXXcd operator()(ArrayXX<scalar_t> const& data) const {
+            return data.template cast<std::complex<double>>().topRows(num_moments);
+        }
+
+        template<class scalar_t>
+        ArrayXXcd operator()(std::vector<ArrayX<scalar_t>> const& data) const {
+            auto result = ArrayXXcd(num_moments, static_cast<idx_t>(data.size()));
+            for (auto j = size_t{0}; j < data.size(); ++j) {
+                result.col(j) = data[j].template cast<std::complex<double>>().head(num_moments);
+            }
+            return result;
+        }
+    };
+
+    /// Running mean of random vectors for `Core::dos()` which may stop at the `target_error`
+    BatchDiagonalMoments stochastic_moments(idx_t num_moments, idx_t num_random,
+                                            StochasticAccumulator const& accumulator,
+                                            double target_error) {
+        auto stop = BatchDiagonalMoments::Stop();
+        if (target_error > 0) {
+            stop = [accumulator] { return accumulator.is_converged(); };
+        }
+        return {num_moments, num_random, accumulator, std::move(stop)};
+    }
+
+    /// The `previous` bounds (if any) are the reference of the `BoundsMode::Warm` start
+    Bounds reset_bounds(Hamiltonian const& h, Config const& config,
+                        Bounds const* previous = nullptr) {
+        if (config.min_energy != config.max_energy) {
+            return {config.min_energy, config.max_energy}; // user-defined bounds
+        }
+
+        switch (config.bounds_mode) {
+            case BoundsMode::Gershgorin:
+                return Bounds::gershgorin(h, config.bounds_padding);
+            case BoundsMode::Warm:
+                if (previous) { return previous->warm(h, config.bounds_padding); }
+                break;
+            case BoundsMode::Lanczos:
+                break;
+        }
+        // will be automatically computed
+        return {h, config.lanczos_precision, /*num_threads*/-1, config.lanczos_coarse_precision};
+    }
+
+    struct GershgorinBounds {
+        template<class scalar_t>
+        std::pair<double, double> operator()(num::MappedCsrMatrix<scalar_t> const& h) const {
+            return num::gershgorin_bounds(h);
+        }
+    };
+
+    Bounds reset_bounds(MappedHamiltonian const& h, Config const& config) {
         if (config.min_energy == config.max_energy) {
-            return {h, config.lanczos_precision}; // will be automatically computed
+            auto const minmax = h.match(GershgorinBounds{}); // a single pass over the file
+            return {minmax.first, minmax.second};
         } else {
             return {config.min_energy, config.max_energy}; // user-defined bounds
         }
     }
+
+    /// The scaled and reordered matrix of an `OptimizedHamiltonian` in the CSR format
+    struct ScaledCsr {
+        template<class scalar_t>
+        VariantCSR operator()(SparseMatrixX<scalar_t> const& m) const { return m; }
+
+        template<class Matrix>
+        VariantCSR operator()(Matrix const&) const { return {}; }
+    };
+
+    struct MappedRows {
+        template<class scalar_t>
+        idx_t operator()(num::MappedCsrMatrix<scalar_t> const& h) const { return h.rows(); }
+    };
 } // anonymous namespace
 
-Core::Core(Hamiltonian const& h, Compute const& compute, Config const& config)
-    : hamiltonian(h), compute(compute), config(config), bounds(reset_bounds(h, config)),
-      optimized_hamiltonian(h, config.matrix_format, config.algorithm.reorder()) {
+Core::Core(Hamiltonian const& h, Compute const& compute, Config const& config,
+           num::StencilPattern stencil, idx_t block_size)
+    : hamiltonian(h), compute(compute), config(config), stencil(std::move(stencil)),
+      block_size(block_size), bounds(reset_bounds(h, config)),
+      shared(new Shared(config.moment_cache_size)) {
     if (config.min_energy > config.max_energy) {
         throw std::invalid_argument("KPM: Invalid energy range specified (min > max).");
     }
+    shared->contexts.emplace_back(new Context(make_optimized(h)));
 }
 
-void Core::set_hamiltonian(Hamiltonian const& h) {
+Core::Core(MappedHamiltonian const& h, Compute const& compute, Config const& config)
+    : mapped_hamiltonian(h), is_out_of_core(true), compute(compute), config(config),
+      block_size(1), bounds(reset_bounds(h, config)),
+      shared(new Shared(config.moment_cache_size)) {
+    if (config.min_energy > config.max_energy) {
+        throw std::invalid_argument("KPM: Invalid energy range specified (min > max).");
+    }
+    shared->contexts.emplace_back(new Context(new_optimized()));
+}
+
+void Core::set_hamiltonian(Hamiltonian const& h, num::StencilPattern new_stencil,
+                           idx_t new_block_size) {
     hamiltonian = h;
-    optimized_hamiltonian = {h, config.matrix_format, config.algorithm.reorder()};
-    bounds = reset_bounds(h, config);
+    mapped_hamiltonian = {};
+    is_out_of_core = false;
+    stencil = std::move(new_stencil);
+    block_size = new_block_size;
+    // Only the values differ (e.g. disorder realizations): the reordering is still valid
+    bounds = reset_bounds(h, config, &bounds);
+
+    auto& contexts = shared->contexts;
+    auto const is_updated = std::all_of(contexts.begin(), contexts.end(),
+                                        [&](std::unique_ptr<Context> const& c) {
+        c->velocities.clear(); // the values are different
+        return c->oh.update_values(h);
+    });
+    if (!is_updated) {
+        contexts.clear();
+        contexts.emplace_back(new Context(make_optimized(h)));
+    }
+    shared->moment_cache.clear();
+}
+
+idx_t Core::hamiltonian_size() const {
+    return is_out_of_core ? mapped_hamiltonian.match(MappedRows{}) : hamiltonian.rows();
+}
+
+OptimizedHamiltonian Core::make_optimized(Hamiltonian const& h) {
+    if (config.auto_tune) {
+        auto const tuned = auto_tune(h, compute, config, bounds.scaling_factors(), stencil,
+                                     block_size);
+        config.matrix_format = tuned.matrix_format;
+        config.algorithm.interleaved = tuned.interleaved;
+    }
+    return new_optimized();
+}
+
+OptimizedHamiltonian Core::new_optimized() const {
+    if (is_out_of_core) { return {mapped_hamiltonian, compute->get_num_threads()}; }
+    return {hamiltonian, config.matrix_format, config.algorithm.reorder(),
+            config.mixed_precision, stencil, compute->get_num_threads(),
+            config.reorder_cache_size, block_size};
+}
+
+Core::Session::Session(Session&& other) noexcept
+    : stats(std::move(other.stats)), shared(other.shared), context(other.context),
+      meter(other.meter) {
+    other.shared = nullptr;
+    other.context = nullptr;
+}
+
+Core::Session::~Session() {
+    if (!shared) { return; }
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    if (context) {
+        --context->num_users;
+        context->is_ready = true; // also if the optimization was interrupted by an exception
+    }
+    stats.peak_memory = meter.growth();
+    shared->last_stats = std::move(stats);
+}
+
+VariantCSR Core::Session::velocity(Hamiltonian const& h, ArrayXf const& coords) {
+    auto& velocities = context->velocities;
+    auto const find = [&]() {
+        return std::find_if(velocities.begin(), velocities.end(),
+                            [&](Context::Velocity const& v) {
+            return v.coords.size() == coords.size() && (v.coords == coords).all();
+        });
+    };
+
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        auto const it = find();
+        if (it != velocities.end()) { return it->op; }
+    }
+
+    auto op = kpm::velocity(h, coords, context->oh);
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    auto const it = find(); // another session may have added it in the meantime
+    if (it != velocities.end()) { return it->op; }
+    velocities.push_back({coords, op});
+    return op;
+}
+
+Core::Session Core::begin(Indices const& idx, Scale<> scale) {
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    auto& contexts = shared->contexts;
+
+    // Another calculation may be reading the matrix we need: it's never modified while in use
+    auto const it = std::find_if(contexts.begin(), contexts.end(),
+                                 [&](std::unique_ptr<Context> const& c) {
+        return c->is_ready && c->oh.is_optimized_for(idx);
+    });
+    if (it != contexts.end()) {
+        ++(*it)->num_users;
+        return {*shared, it->get()};
+    }
+
+    // Otherwise, the idle contexts keep their own cache of previous optimizations
+    auto idle = std::find_if(contexts.begin(), contexts.end(),
+                             [](std::unique_ptr<Context> const& c) { return c->num_users == 0; });
+    if (idle == contexts.end()) {
+        contexts.emplace_back(new Context(new_optimized()));
+        idle = std::prev(contexts.end());
+    }
+
+    auto& context = **idle;
+    context.num_users = 1;
+    context.is_ready = false;
+    auto session = Session(*shared, &context);
+
+    context.velocities.clear(); // the reordering may change
+    lock.unlock(); // the optimization may take a while and nobody else can use this context
+    context.oh.optimize_for(idx, scale);
+    lock.lock();
+    context.is_ready = true;
+    return session;
+}
+
+Scale<> Core::scaling_factors() {
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    return bounds.scaling_factors();
+}
+
+Stats Core::get_stats() const {
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    return shared->last_stats;
 }
 
 std::string Core::report(bool shortform) const {
-    return bounds.report(shortform) + stats.report(shortform) + (shortform ? "|" : "Total time:");
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    return bounds.report(shortform) + shared->last_stats.report(shortform)
+           + (shortform ? "|" : "Total time:");
 }
 
 ArrayXcd Core::moments(idx_t num_moments, VectorXcd const& alpha, VectorXcd const& beta,
@@ -37,56 +321,600 @@ ArrayXcd Core::moments(idx_t num_moments, VectorXcd const& alpha, VectorXcd cons
     auto specialized_algorithm = config.algorithm;
     specialized_algorithm.optimal_size = false; // not applicable for this calculation
 
-    optimized_hamiltonian.optimize_for({0, 0}, bounds.scaling_factors());
-    stats.reset(num_moments, optimized_hamiltonian, specialized_algorithm);
+    auto session = begin(Indices::full_system(), scaling_factors());
+    session.stats.reset(num_moments, session.oh(), specialized_algorithm);
 
-    auto const starter = constant_starter(optimized_hamiltonian, alpha);
+    auto const starter = constant_starter(session.oh(), alpha);
 
     if (beta.size() == 0 && op.size() == 0) {
         auto moments = DiagonalMoments(round_num_moments(num_moments));
-        timed_compute(&moments, starter, specialized_algorithm);
+        timed_compute(session, &moments, starter, specialized_algorithm);
         apply_damping(moments, config.kernel);
         return extract_data(moments, num_moments);
     } else {
         auto moments = GenericMoments(round_num_moments(num_moments), alpha, beta, op);
-        timed_compute(&moments, starter, specialized_algorithm);
+        timed_compute(session, &moments, starter, specialized_algorithm);
+        apply_damping(moments, config.kernel);
+        return extract_data(moments, num_moments);
+    }
+}
+
+ArrayXXcd Core::batch_moments(idx_t num_moments, MatrixXcd const& alpha,
+                              MatrixXcd const& beta, SparseMatrixXcd const& op) {
+    auto specialized_algorithm = config.algorithm;
+    specialized_algorithm.optimal_size = false; // not applicable for this calculation
+
+    auto session = begin(Indices::full_system(), scaling_factors());
+    session.stats.reset(num_moments, session.oh(), specialized_algorithm, alpha.cols());
+
+    auto const starter = constant_starter(session.oh(), alpha);
+    if (beta.size() == 0 && op.size() == 0) {
+        // Twice fewer products: the diagonal recursion gets two moments from each one
+        auto moments = BatchDiagonalMoments(round_num_moments(num_moments), alpha.cols(),
+                                            BatchConcatenator());
+        timed_compute(session, &moments, starter, specialized_algorithm);
+        apply_damping(moments, config.kernel);
+        return extract_data(moments, num_moments);
+    } else {
+        auto moments = BatchGenericMoments(round_num_moments(num_moments), alpha, beta, op);
+        timed_compute(session, &moments, starter, specialized_algorithm);
         apply_damping(moments, config.kernel);
         return extract_data(moments, num_moments);
     }
 }
 
 ArrayXXdCM Core::ldos(std::vector<idx_t> const& idx, ArrayXd const& energy, double broadening) {
-    auto const scale = bounds.scaling_factors();
+    auto const scale = scaling_factors();
     auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+    if (config.ldos_chunk_size > 0 && static_cast<idx_t>(idx.size()) > config.ldos_chunk_size) {
+        auto results = ArrayXXdCM(energy.size(), static_cast<idx_t>(idx.size()));
+        chunked_ldos(idx, energy, scale, num_moments, [&](idx_t first, ArrayXXdCM const& chunk) {
+            results.middleCols(first, chunk.cols()) = chunk;
+        });
+        return results;
+    }
+
+    auto moments = BatchDiagonalMoments(num_moments, static_cast<idx_t>(idx.size()),
+                                        BatchConcatenator());
+
+    auto session = compute_ldos(moments, idx, scale);
+    apply_damping(moments, config.kernel);
+    return timed(session.stats.reconstruct_timer, [&]{
+        return config.fast_reconstruction
+               ? reconstruct<FastSpectralDensity>(moments, energy, scale)
+               : reconstruct<SpectralDensity>(moments, energy, scale,
+                                              compute->get_num_threads());
+    });
+}
+
+void Core::ldos(std::vector<idx_t> const& idx, ArrayXd const& energy, double broadening,
+                LdosSink const& sink) {
+    if (config.ldos_chunk_size > 0 && static_cast<idx_t>(idx.size()) > config.ldos_chunk_size) {
+        auto const scale = scaling_factors();
+        auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+        chunked_ldos(idx, energy, scale, num_moments, sink);
+    } else {
+        sink(0, ldos(idx, energy, broadening));
+    }
+}
+
+void Core::chunked_ldos(std::vector<idx_t> const& idx, ArrayXd const& energy, Scale<> scale,
+                        idx_t num_moments, LdosSink const& sink) {
+    auto const indices = Indices(idx, idx);
     auto const num_indices = static_cast<idx_t>(idx.size());
+    auto session = begin(indices, scale);
+    session.stats.reset(num_moments, session.oh(), config.algorithm, num_indices);
+
+    auto const chunk_size = config.ldos_chunk_size;
+    for (auto first = idx_t{0}; first < num_indices; first += chunk_size) {
+        auto const count = std::min(chunk_size, num_indices - first);
+        auto moments = BatchDiagonalMoments(num_moments, count, BatchConcatenator());
+        timed_compute(session, &moments, unit_starter(session.oh(), first, count),
+                      config.algorithm);
+        apply_damping(moments, config.kernel);
+
+        auto const span = trace::Span("reconstruct", "kpm");
+        session.stats.reconstruct_timer.tic();
+        auto const chunk = config.fast_reconstruction
+            ? reconstruct<FastSpectralDensity>(moments, energy, scale)
+            : reconstruct<SpectralDensity>(moments, energy, scale, compute->get_num_threads());
+        session.stats.reconstruct_timer.toc_accumulate();
+        sink(first, chunk);
+    } // the moments and the result of each chunk are released before the next one
+}
+
+ExpansionMoments Core::ldos_moments(std::vector<idx_t> const& idx, double broadening,
+                                    Checkpoint* checkpoint) {
+    auto const scale = scaling_factors();
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+    auto moments = BatchDiagonalMoments(num_moments, static_cast<idx_t>(idx.size()),
+                                        BatchConcatenator());
+    if (checkpoint) {
+        *checkpoint = Checkpoint();
+        moments.checkpoint = checkpoint;
+    }
+
+    compute_ldos(moments, idx, scale);
+    return {scale, moments.data.match(ToExpansionData{num_moments})};
+}
+
+Core::Session Core::compute_ldos(BatchDiagonalMoments& moments, std::vector<idx_t> const& idx,
+                                 Scale<> scale) {
+    auto const indices = Indices(idx, idx);
+    auto algorithm = config.algorithm;
+    if (moments.checkpoint) {
+        algorithm.optimal_size = false; // the checkpoint needs the full vectors
+    }
+
+    auto session = begin(indices, scale);
+    session.stats.reset(moments.num_moments, session.oh(), algorithm, moments.num_vectors);
 
-    optimized_hamiltonian.optimize_for({idx, idx}, scale);
-    stats.reset(num_moments, optimized_hamiltonian, config.algorithm, num_indices);
+    auto starter = unit_starter(session.oh());
+    if (moments.checkpoint) {
+        checkpointed_compute(session, moments, indices, scale, starter, algorithm);
+    } else {
+        cached_compute(session, moments, {indices, scale, 0}, starter, algorithm);
+    }
+    return session;
+}
+
+ArrayXXdCM Core::stochastic_ldos(std::vector<idx_t> const& idx, ArrayXd const& energy,
+                                 double broadening, idx_t num_random) {
+    auto const scale = scaling_factors();
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+
+    auto specialized_algorithm = config.algorithm;
+    specialized_algorithm.optimal_size = false; // not applicable for this calculation
+
+    auto session = begin(Indices::full_system(), scale);
+    auto const& oh = session.oh();
+    session.stats.reset(num_moments, oh, specialized_algorithm, num_random);
 
-    auto starter = unit_starter(optimized_hamiltonian);
-    auto moments = BatchDiagonalMoments(num_moments, num_indices, BatchConcatenator());
+    auto reordered_idx = std::vector<storage_idx_t>();
+    reordered_idx.reserve(idx.size());
+    for (auto const i : idx) {
+        reordered_idx.push_back(static_cast<storage_idx_t>(oh.reordered_index(i)));
+    }
+
+    auto starter = random_starter(oh, {}, config.counter_based_random);
+    auto moments = LocalMoments(num_moments, num_random, std::move(reordered_idx));
+    timed_compute(session, &moments, starter, specialized_algorithm);
+    session.stats.num_random = num_random;
 
-    timed_compute(&moments, starter, config.algorithm);
+    moments.normalize();
     apply_damping(moments, config.kernel);
-    return reconstruct<SpectralDensity>(moments, energy, scale);
+    return timed(session.stats.reconstruct_timer, [&]{
+        return config.fast_reconstruction
+               ? reconstruct<FastSpectralDensity>(moments, energy, scale)
+               : reconstruct<SpectralDensity>(moments, energy, scale,
+                                              compute->get_num_threads());
+    });
 }
 
-ArrayXd Core::dos(ArrayXd const& energy, double broadening, idx_t num_random) {
-    auto const scale = bounds.scaling_factors();
+ArrayXXdCM Core::projected_dos(std::vector<std::vector<idx_t>> const& projections,
+                               ArrayXd const& energy, double broadening, idx_t num_random) {
+    auto const scale = scaling_factors();
     auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
 
     auto specialized_algorithm = config.algorithm;
     specialized_algorithm.optimal_size = false; // not applicable for this calculation
 
-    optimized_hamiltonian.optimize_for({0, 0}, scale);
-    stats.reset(num_moments, optimized_hamiltonian, specialized_algorithm, num_random);
+    auto session = begin(Indices::full_system(), scale);
+    auto const& oh = session.oh();
+    session.stats.reset(num_moments, oh, specialized_algorithm, num_random);
+
+    auto reordered_idx = std::vector<storage_idx_t>();
+    auto columns = std::vector<storage_idx_t>();
+    for (auto j = size_t{0}; j < projections.size(); ++j) {
+        for (auto const i : projections[j]) {
+            if (i < 0 || i >= oh.size()) {
+                throw std::invalid_argument("KPM: the projection indices must be within the "
+                                            "Hamiltonian.");
+            }
+            reordered_idx.push_back(static_cast<storage_idx_t>(oh.reordered_index(i)));
+            columns.push_back(static_cast<storage_idx_t>(j));
+        }
+    }
+
+    auto starter = random_starter(oh, {}, config.counter_based_random);
+    auto moments = LocalMoments(num_moments, num_random, std::move(reordered_idx),
+                                std::move(columns), static_cast<idx_t>(projections.size()));
+    timed_compute(session, &moments, starter, specialized_algorithm);
+    session.stats.num_random = num_random;
+
+    moments.normalize();
+    apply_damping(moments, config.kernel);
+    return timed(session.stats.reconstruct_timer, [&]{
+        return config.fast_reconstruction
+               ? reconstruct<FastSpectralDensity>(moments, energy, scale)
+               : reconstruct<SpectralDensity>(moments, energy, scale,
+                                              compute->get_num_threads());
+    });
+}
+
+ArrayXXdCM Core::spectral_function(CartesianArray const& positions,
+                                   std::vector<Cartesian> const& k_points, ArrayXd const& energy,
+                                   double broadening) {
+    if (positions.size() != hamiltonian_size()) {
+        throw std::invalid_argument("KPM: The positions must match the Hamiltonian size.");
+    }
+
+    auto const scale = scaling_factors();
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+    auto specialized_algorithm = config.algorithm;
+    specialized_algorithm.optimal_size = false; // plane waves cover the full system
 
-    auto starter = random_starter(optimized_hamiltonian);
-    auto moments = BatchDiagonalMoments(num_moments, num_random, BatchAccumulator());
+    auto session = begin(Indices::full_system(), scale);
+    auto const& oh = session.oh();
+    auto const num_k = static_cast<idx_t>(k_points.size());
+    auto const num_vectors = plane_wave_vectors(oh.scalar_tag(), num_k);
+    session.stats.reset(num_moments, oh, specialized_algorithm, num_vectors);
+
+    auto starter = plane_wave_starter(oh, positions, k_points);
+    auto moments = BatchDiagonalMoments(num_moments, num_vectors, BatchConcatenator());
+    timed_compute(session, &moments, starter, specialized_algorithm);
 
-    timed_compute(&moments, starter, specialized_algorithm);
     apply_damping(moments, config.kernel);
-    return reconstruct<SpectralDensity>(moments, energy, scale);
+    return timed(session.stats.reconstruct_timer, [&]{
+        ArrayXXdCM result = config.fast_reconstruction
+                            ? reconstruct<FastSpectralDensity>(moments, energy, scale)
+                            : reconstruct<SpectralDensity>(moments, energy, scale,
+                                                           compute->get_num_threads());
+        if (num_vectors == num_k) { return result; }
+
+        // Real scalars: the cosine and sine parts of each plane wave are added together
+        auto combined = ArrayXXdCM(energy.size(), num_k);
+        for (auto k = idx_t{0}; k < num_k; ++k) {
+            combined.col(k) = result.col(2 * k) + result.col(2 * k + 1);
+        }
+        return combined;
+    });
+}
+
+std::vector<ArrayXXdCM> Core::multi_ldos(std::vector<Hamiltonian> const& others,
+                                         std::vector<idx_t> const& idx, ArrayXd const& energy,
+                                         double broadening) {
+    if (is_out_of_core) {
+        throw std::logic_error("KPM: multiple Hamiltonians need the Hamiltonian in memory.");
+    }
+
+    auto members = std::vector<Hamiltonian>{hamiltonian};
+    members.insert(members.end(), others.begin(), others.end());
+
+    // The scaling factors must cover the spectra of all the members
+    auto min_energy = 0.0, max_energy = 0.0;
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        min_energy = bounds.min_energy();
+        max_energy = bounds.max_energy();
+    }
+    for (auto const& h : others) {
+        auto b = reset_bounds(h, config);
+        min_energy = std::min(min_energy, b.min_energy());
+        max_energy = std::max(max_energy, b.max_energy());
+    }
+    auto const scale = Scale<>(min_energy, max_energy);
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+
+    // Same reordering for every member: only the values of the optimized matrix are rewritten
+    auto const indices = Indices(idx, idx);
+    auto oh = OptimizedHamiltonian(hamiltonian, MatrixFormat::CSR, config.algorithm.reorder(),
+                                   /*mixed_precision*/false, {}, compute->get_num_threads());
+    auto scaled = std::vector<VariantCSR>();
+    for (auto const& h : members) {
+        if (!oh.update_values(h)) {
+            throw std::invalid_argument("KPM: the Hamiltonians must have the same sparsity "
+                                        "pattern and scalar type.");
+        }
+        oh.optimize_for(indices, scale);
+        scaled.push_back(var::apply_visitor(ScaledCsr{}, oh.matrix()));
+    }
+
+    auto session = Session(*shared, nullptr); // the `oh` is private to this calculation
+    auto& stats = session.stats;
+    auto const num_members = static_cast<idx_t>(members.size());
+    stats.reset(num_moments, oh, config.algorithm, num_members * static_cast<idx_t>(idx.size()));
+    stats.bounds_timer = bounds.get_timer();
+    auto data = timed(stats.moments_timer, [&]{
+        return compute->multi_moments(scaled, oh.map(), oh.idx(), num_moments, config.algorithm);
+    }, "moments");
+    stats.profile = compute->profile();
+
+    auto results = std::vector<ArrayXXdCM>();
+    stats.reconstruct_timer.tic();
+    for (auto& d : data) {
+        auto moments = BatchDiagonalMoments(num_moments, static_cast<idx_t>(idx.size()),
+                                            BatchConcatenator());
+        moments.data = std::move(d);
+        apply_damping(moments, config.kernel);
+        results.push_back(config.fast_reconstruction
+            ? reconstruct<FastSpectralDensity>(moments, energy, scale)
+            : reconstruct<SpectralDensity>(moments, energy, scale, compute->get_num_threads()));
+    }
+    stats.reconstruct_timer.toc();
+    return results;
+}
+
+ArrayXXdCM Core::probing_ldos(std::vector<idx_t> const& idx, ArrayXd const& energy,
+                              double broadening, idx_t distance) {
+    if (is_out_of_core) {
+        throw std::logic_error("KPM: the probing LDOS needs the sparsity pattern of a "
+                               "Hamiltonian in memory, not an out-of-core one.");
+    }
+    if (distance < 1) {
+        throw std::invalid_argument("KPM: the probing distance must be at least 1.");
+    }
+    auto const scale = scaling_factors();
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+
+    // One probe per color, but only for the colors of the requested indices
+    auto const colors = hamiltonian.get_variant().match(DistanceColoring{distance});
+    auto const num_colors = colors.empty() ? size_t{0} : static_cast<size_t>(
+        *std::max_element(colors.begin(), colors.end()) + 1
+    );
+    auto probe_of_color = std::vector<idx_t>(num_colors, -1);
+    auto num_probes = idx_t{0};
+    for (auto const i : idx) {
+        auto& p = probe_of_color[static_cast<size_t>(colors[static_cast<size_t>(i)])];
+        if (p < 0) { p = num_probes++; }
+    }
+    auto probes = std::vector<std::vector<idx_t>>(static_cast<size_t>(num_probes));
+    for (auto i = idx_t{0}; i < static_cast<idx_t>(colors.size()); ++i) {
+        auto const p = probe_of_color[static_cast<size_t>(colors[static_cast<size_t>(i)])];
+        if (p >= 0) { probes[static_cast<size_t>(p)].push_back(i); }
+    }
+
+    auto specialized_algorithm = config.algorithm;
+    specialized_algorithm.optimal_size = false; // not applicable for this calculation
+
+    auto session = begin(Indices::full_system(), scale);
+    auto const& oh = session.oh();
+    session.stats.reset(num_moments, oh, specialized_algorithm, num_probes);
+
+    auto reordered_idx = std::vector<storage_idx_t>();
+    reordered_idx.reserve(idx.size());
+    for (auto const i : idx) {
+        reordered_idx.push_back(static_cast<storage_idx_t>(oh.reordered_index(i)));
+    }
+
+    // The sum over the probes picks only the probe which contains each index: no normalization
+    auto starter = probing_starter(oh, probes);
+    auto moments = LocalMoments(num_moments, num_probes, std::move(reordered_idx));
+    timed_compute(session, &moments, starter, specialized_algorithm);
+
+    apply_damping(moments, config.kernel);
+    return timed(session.stats.reconstruct_timer, [&]{
+        return config.fast_reconstruction
+               ? reconstruct<FastSpectralDensity>(moments, energy, scale)
+               : reconstruct<SpectralDensity>(moments, energy, scale,
+                                              compute->get_num_threads());
+    });
+}
+
+ArrayXd Core::density_matrix_diagonal(std::vector<idx_t> const& idx,
+                                      ArrayXd const& coefficients, idx_t num_random) {
+    auto const scale = scaling_factors();
+    auto const num_moments = coefficients.size();
+    auto const num_indices = static_cast<idx_t>(idx.size());
+
+    if (num_random <= 0) {
+        // Same moments as `ldos()`: the cache is shared
+        auto const indices = Indices(idx, idx);
+        auto session = begin(indices, scale);
+        session.stats.reset(num_moments, session.oh(), config.algorithm, num_indices);
+
+        auto moments = BatchDiagonalMoments(num_moments, num_indices, BatchConcatenator());
+        cached_compute(session, moments, {indices, scale, 0}, unit_starter(session.oh()),
+                       config.algorithm);
+        apply_damping(moments, config.kernel);
+        return timed(session.stats.reconstruct_timer, [&]{
+            return reconstruct<ChebyshevSeries>(moments, coefficients);
+        });
+    }
+
+    auto specialized_algorithm = config.algorithm;
+    specialized_algorithm.optimal_size = false; // not applicable for this calculation
+
+    auto session = begin(Indices::full_system(), scale);
+    auto const& oh = session.oh();
+    session.stats.reset(num_moments, oh, specialized_algorithm, num_random);
+
+    auto reordered_idx = std::vector<storage_idx_t>();
+    reordered_idx.reserve(idx.size());
+    for (auto const i : idx) {
+        reordered_idx.push_back(static_cast<storage_idx_t>(oh.reordered_index(i)));
+    }
+
+    auto starter = random_starter(oh, {}, config.counter_based_random);
+    auto moments = LocalMoments(num_moments, num_random, std::move(reordered_idx));
+    timed_compute(session, &moments, starter, specialized_algorithm);
+    session.stats.num_random = num_random;
+
+    moments.normalize();
+    apply_damping(moments, config.kernel);
+    return timed(session.stats.reconstruct_timer, [&]{
+        return reconstruct<ChebyshevSeries>(moments, coefficients);
+    });
+}
+
+ArrayXd Core::local_charge(std::vector<idx_t> const& idx, double chemical_potential,
+                           double temperature, double broadening, idx_t num_random) {
+    auto const scale = scaling_factors();
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+    auto const coefficients = fermi_coefficients(scale, chemical_potential, temperature,
+                                                 num_moments);
+    return density_matrix_diagonal(idx, coefficients, num_random);
+}
+
+ArrayXd Core::dos(ArrayXd const& energy, double broadening, idx_t num_random,
+                  double target_error) {
+    auto const scale = scaling_factors();
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+    auto const accumulator = StochasticAccumulator(
+        target_error, config.kernel.damping_coefficients(num_moments)
+    );
+    auto moments = stochastic_moments(num_moments, num_random, accumulator, target_error);
+
+    auto session = compute_dos(moments, accumulator, scale, target_error);
+    apply_damping(moments, config.kernel);
+    return timed(session.stats.reconstruct_timer, [&]{
+        return config.fast_reconstruction
+               ? reconstruct<FastSpectralDensity>(moments, energy, scale)
+               : reconstruct<SpectralDensity>(moments, energy, scale,
+                                              compute->get_num_threads());
+    });
+}
+
+ExpansionMoments Core::dos_moments(double broadening, idx_t num_random, double target_error,
+                                   Checkpoint* checkpoint) {
+    if (checkpoint && target_error > 0) {
+        throw std::invalid_argument("KPM: a DOS checkpoint requires a fixed number of random "
+                                    "vectors (target_error == 0).");
+    }
+    auto const scale = scaling_factors();
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+    auto const accumulator = StochasticAccumulator(
+        target_error, config.kernel.damping_coefficients(num_moments)
+    );
+    auto moments = stochastic_moments(num_moments, num_random, accumulator, target_error);
+    if (checkpoint) {
+        *checkpoint = Checkpoint();
+        moments.checkpoint = checkpoint;
+    }
+
+    compute_dos(moments, accumulator, scale, target_error);
+    return {scale, moments.data.match(ToExpansionData{num_moments})};
+}
+
+QuantizationError Core::quantization_error(double broadening, idx_t num_random) {
+    if (is_out_of_core) {
+        throw std::logic_error("KPM: the quantization error needs the Hamiltonian in memory.");
+    }
+    auto const scale = scaling_factors();
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+    auto specialized_algorithm = config.algorithm;
+    specialized_algorithm.optimal_size = false; // not applicable for this calculation
+
+    auto session = begin(Indices::full_system(), scale);
+    session.stats.reset(num_moments, session.oh(), specialized_algorithm, num_random);
+    auto reference = OptimizedHamiltonian(hamiltonian, MatrixFormat::ELL,
+                                          config.algorithm.reorder(), /*mixed_precision*/false,
+                                          {}, compute->get_num_threads());
+    reference.optimize_for(Indices::full_system(), scale);
+
+    // The reordering doesn't depend on the format: both get the same random vectors
+    auto const make_moments = [&] {
+        auto const accumulator = StochasticAccumulator(
+            0, config.kernel.damping_coefficients(num_moments)
+        );
+        return stochastic_moments(num_moments, num_random, accumulator, 0);
+    };
+    auto lossy = make_moments();
+    timed_compute(session, &lossy, random_starter(session.oh(), {}, config.counter_based_random),
+                  specialized_algorithm);
+    auto exact = make_moments();
+    compute->moments(&exact, random_starter(reference, {}, config.counter_based_random),
+                     specialized_algorithm, reference);
+
+    auto const mu = lossy.data.match(ToExpansionData{num_moments}).col(0).eval();
+    auto const ref = exact.data.match(ToExpansionData{num_moments}).col(0).eval();
+    auto const diff = (mu - ref).abs() / std::abs(ref[0]);
+    auto result = QuantizationError();
+    result.matrix_format = session.oh().format_name();
+    result.max_error = diff.maxCoeff();
+    result.rms_error = std::sqrt(diff.square().mean());
+    result.num_moments = num_moments;
+    result.num_random = num_random;
+    session.stats.num_random = num_random;
+    return result;
+}
+
+ExpansionMoments Core::extend_moments(ExpansionMoments const& moments, Checkpoint& checkpoint,
+                                      idx_t num_moments) {
+    auto const is_random = checkpoint.idx.is_full_system();
+    auto const num_results = is_random ? idx_t{1} : checkpoint.idx.src.size();
+    if (checkpoint.empty() || moments.num_moments() != checkpoint.num_moments
+        || moments.num_results() != num_results) {
+        throw std::invalid_argument("KPM: the moments don't match the checkpoint.");
+    }
+
+    num_moments = round_num_moments(num_moments);
+    if (num_moments <= checkpoint.num_moments) {
+        return moments.truncated(num_moments);
+    }
+
+    auto const scale = scaling_factors();
+    auto const first = checkpoint.num_moments;
+    auto extended = ExpansionMoments();
+    if (is_random) {
+        auto const accumulator = StochasticAccumulator(
+            0, config.kernel.damping_coefficients(num_moments)
+        );
+        auto m = BatchDiagonalMoments(num_moments, checkpoint.num_vectors, accumulator);
+        m.checkpoint = &checkpoint;
+        compute_dos(m, accumulator, scale, 0);
+        extended = {scale, m.data.match(ToExpansionData{num_moments})};
+    } else {
+        auto m = BatchDiagonalMoments(num_moments, checkpoint.num_vectors, BatchConcatenator());
+        m.checkpoint = &checkpoint;
+        auto const& src = checkpoint.idx.src;
+        compute_ldos(m, std::vector<idx_t>(src.data(), src.data() + src.size()), scale);
+        extended = {scale, m.data.match(ToExpansionData{num_moments})};
+    }
+    // Only the new moments have been computed
+    extended.data.topRows(first) = moments.data;
+    return extended;
+}
+
+void Core::checkpointed_compute(Session& session, BatchDiagonalMoments& moments,
+                                Indices const& idx, Scale<> scale, Starter const& starter,
+                                AlgorithmConfig const& algorithm) {
+    auto& checkpoint = *moments.checkpoint;
+    auto const& map = session.oh().map().get_data();
+    if (checkpoint.empty()) {
+        checkpoint.idx = idx;
+        checkpoint.scale = scale;
+        checkpoint.num_vectors = moments.num_vectors;
+        checkpoint.map = map;
+    } else if (!(checkpoint.idx == idx) || checkpoint.scale.a != scale.a
+               || checkpoint.scale.b != scale.b || checkpoint.map != map) {
+        throw std::invalid_argument("KPM: the checkpoint was made for a different calculation "
+                                    "or Hamiltonian.");
+    }
+
+    timed_compute(session, &moments, starter, algorithm);
+    checkpoint.num_moments = moments.num_moments;
+}
+
+Core::Session Core::compute_dos(BatchDiagonalMoments& moments,
+                                StochasticAccumulator const& accumulator, Scale<> scale,
+                                double target_error) {
+    auto specialized_algorithm = config.algorithm;
+    specialized_algorithm.optimal_size = false; // not applicable for this calculation
+
+    auto session = begin(Indices::full_system(), scale);
+    auto& stats = session.stats;
+    stats.reset(moments.num_moments, session.oh(), specialized_algorithm, moments.num_vectors);
+
+    auto starter = random_starter(session.oh(), {}, config.counter_based_random);
+    // A continued checkpoint only computes the last moments: there's no error estimate
+    auto const is_resumed = moments.checkpoint && !moments.checkpoint->empty();
+    if (moments.checkpoint) {
+        checkpointed_compute(session, moments, Indices::full_system(), scale, starter,
+                             specialized_algorithm);
+    } else if (target_error > 0) {
+        // The number of vectors depends on the error: not comparable with the cached results
+        timed_compute(session, &moments, starter, specialized_algorithm);
+    } else {
+        cached_compute(session, moments, {{0, 0}, scale, moments.num_vectors}, starter,
+                       specialized_algorithm);
+    }
+    if (!stats.from_cache) {
+        stats.num_random = accumulator.count();
+        stats.stochastic_error = is_resumed ? 0 : accumulator.relative_error();
+        stats.multiplier = static_cast<double>(stats.num_random);
+    }
+    return session;
 }
 
 ArrayXcd Core::greens(idx_t row, idx_t col, ArrayXd const& energy, double broadening) {
@@ -96,63 +924,308 @@ ArrayXcd Core::greens(idx_t row, idx_t col, ArrayXd const& energy, double broade
 std::vector<ArrayXcd> Core::greens_vector(idx_t row, std::vector<idx_t> const& cols,
                                           ArrayXd const& energy, double broadening) {
     assert(!cols.empty());
-    auto const scale = bounds.scaling_factors();
+    if (config.algorithm.lanczos_greens && !is_out_of_core
+        && cols.size() == 1 && cols.front() == row) {
+        return {lanczos_greens(row, energy, broadening)};
+    }
+
+    auto const scale = scaling_factors();
     auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
 
-    auto& oh = optimized_hamiltonian;
-    oh.optimize_for({row, cols}, scale);
-    stats.reset(num_moments, oh, config.algorithm);
+    auto const indices = Indices(row, cols);
+    auto session = begin(indices, scale);
+    auto const& oh = session.oh();
+    session.stats.reset(num_moments, oh, config.algorithm);
 
     if (oh.idx().is_diagonal()) {
         auto moments = DiagonalMoments(num_moments);
-        timed_compute(&moments, unit_starter(oh), config.algorithm);
+        cached_compute(session, moments, {indices, scale, 0}, unit_starter(oh),
+                       config.algorithm);
         apply_damping(moments, config.kernel);
-        return {reconstruct<GreensFunction>(moments, energy, scale)};
+        return {timed(session.stats.reconstruct_timer, [&]{
+            return config.fast_reconstruction
+                   ? reconstruct<FastGreensFunction>(moments, energy, scale)
+                   : reconstruct<GreensFunction>(moments, energy, scale);
+        })};
     } else {
         auto moments_vector = MultiUnitMoments(num_moments, oh.idx());
-        timed_compute(&moments_vector, unit_starter(oh), config.algorithm);
+        cached_compute(session, moments_vector, {indices, scale, 0}, unit_starter(oh),
+                       config.algorithm);
         apply_damping(moments_vector, config.kernel);
-        return reconstruct<GreensFunction>(moments_vector, energy, scale);
+        return timed(session.stats.reconstruct_timer, [&]{
+            return config.fast_reconstruction
+                   ? reconstruct<FastGreensFunction>(moments_vector, energy, scale)
+                   : reconstruct<GreensFunction>(moments_vector, energy, scale,
+                                                 compute->get_num_threads());
+        });
+    }
+}
+
+ExpansionMoments Core::greens_moments(idx_t row, std::vector<idx_t> const& cols,
+                                      double broadening) {
+    assert(!cols.empty());
+    auto const scale = scaling_factors();
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+
+    auto const indices = Indices(row, cols);
+    auto session = begin(indices, scale);
+    auto const& oh = session.oh();
+    session.stats.reset(num_moments, oh, config.algorithm);
+
+    if (oh.idx().is_diagonal()) {
+        auto moments = DiagonalMoments(num_moments);
+        cached_compute(session, moments, {indices, scale, 0}, unit_starter(oh),
+                       config.algorithm);
+        return {scale, moments.data.match(ToExpansionData{num_moments})};
+    } else {
+        auto moments_vector = MultiUnitMoments(num_moments, oh.idx());
+        cached_compute(session, moments_vector, {indices, scale, 0}, unit_starter(oh),
+                       config.algorithm);
+        return {scale, moments_vector.data.match(ToExpansionData{num_moments})};
     }
 }
 
+std::vector<ArrayXcd> Core::greens_block(std::vector<idx_t> const& rows,
+                                         std::vector<idx_t> const& cols,
+                                         ArrayXd const& energy, double broadening) {
+    assert(!rows.empty() && !cols.empty());
+    if (rows.size() == 1) {
+        return greens_vector(rows.front(), cols, energy, broadening);
+    }
+
+    auto const scale = scaling_factors();
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+    auto const num_rows = static_cast<idx_t>(rows.size());
+
+    // Each row is a separate unit starter vector. There's a special case for the diagonal
+    // elements in `greens_vector()`, but here all the `cols` are needed for each row.
+    auto const indices = Indices(rows, cols);
+    auto session = begin(indices, scale);
+    auto const& oh = session.oh();
+    session.stats.reset(num_moments, oh, config.algorithm, num_rows);
+
+    auto moments_vector = MultiUnitMoments(num_moments, oh.idx());
+    cached_compute(session, moments_vector, {indices, scale, 0}, unit_starter(oh),
+                   config.algorithm);
+    apply_damping(moments_vector, config.kernel);
+    return timed(session.stats.reconstruct_timer, [&]{
+        return config.fast_reconstruction
+               ? reconstruct<FastGreensFunction>(moments_vector, energy, scale)
+               : reconstruct<GreensFunction>(moments_vector, energy, scale,
+                                             compute->get_num_threads());
+    });
+}
+
 ArrayXcd Core::conductivity(ArrayXf const& left_coords, ArrayXf const& right_coords,
                             ArrayXd const& chemical_potential, double broadening,
                             double temperature, idx_t num_random, idx_t num_points) {
-    auto const scale = bounds.scaling_factors();
+    auto const coords = std::vector<ArrayXf>{left_coords, right_coords};
+    auto const directions = std::vector<std::pair<idx_t, idx_t>>{{0, 1}};
+    return std::move(conductivity(coords, directions, chemical_potential, broadening,
+                                  temperature, num_random, num_points).front());
+}
+
+std::vector<ArrayXcd> Core::conductivity(std::vector<ArrayXf> const& coords,
+                                         std::vector<std::pair<idx_t, idx_t>> const& directions,
+                                         ArrayXd const& chemical_potential, double broadening,
+                                         double temperature, idx_t num_random,
+                                         idx_t num_points) {
+    if (is_out_of_core) {
+        throw std::logic_error("KPM: the conductivity needs the velocity operators of a "
+                               "Hamiltonian in memory, not an out-of-core one.");
+    }
+    auto const scale = scaling_factors();
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+
+    auto specialized_algorithm = config.algorithm;
+    specialized_algorithm.optimal_size = false; // not applicable for this calculation
+
+    auto session = begin(Indices::full_system(), scale);
+    auto const& oh = session.oh();
+
+    // Each distinct coordinate gives one velocity operator on the left and/or right. They
+    // are cached with the optimized Hamiltonian, already reordered, for the next calls.
+    auto ops_l = std::vector<VariantCSR>(), ops_r = std::vector<VariantCSR>();
+    auto index_l = std::vector<idx_t>(coords.size(), -1), index_r = index_l;
+    auto const find_or_add = [&](std::vector<VariantCSR>& ops, std::vector<idx_t>& index,
+                                 idx_t i) {
+        if (index[i] < 0) {
+            index[i] = static_cast<idx_t>(ops.size());
+            ops.push_back(session.velocity(hamiltonian, coords[i]));
+        }
+        return index[i];
+    };
+    auto products = std::vector<BatchDenseMatrixMoments::Product>();
+    for (auto const& d : directions) {
+        products.push_back({find_or_add(ops_l, index_l, d.first),
+                            find_or_add(ops_r, index_r, d.second)});
+    }
+
+    // On the left, the velocity operators are only applied to the starter and on the right,
+    // they're applied at collection time to each vector. The random vectors are independent
+    // so they can be computed in parallel by the `compute` implementation.
+    auto starter = random_starter(oh, {}, config.counter_based_random);
+    auto moments = BatchDenseMatrixMoments(num_moments, num_random, std::move(ops_l),
+                                           std::move(ops_r), std::move(products),
+                                           oh.scalar_tag(), config.conductivity_block_size);
+
+    // The right vectors are recomputed for each block: count that as extra work
+    auto const num_left = static_cast<idx_t>(moments.ops_l.size());
+    auto const num_passes = num_random * num_left * (1 + moments.num_blocks()) / 2;
+    session.stats.reset(num_moments, oh, specialized_algorithm, num_passes);
+
+    timed_compute(session, &moments, starter, specialized_algorithm);
+
+    return timed(session.stats.reconstruct_timer, [&]{
+        auto result = std::vector<ArrayXcd>();
+        auto const energy = bounds.linspaced(num_points);
+        for (auto& total_mu : moments.results) {
+            total_mu.normalize(num_random);
+            apply_damping(total_mu, config.kernel);
+            result.push_back(reconstruct<KuboBastin>(total_mu, chemical_potential, energy,
+                                                     temperature, scale,
+                                                     compute->get_num_threads()));
+        }
+        return result;
+    });
+}
+
+ArrayXd Core::kubo_greenwood(ArrayXf const& coords, ArrayXd const& chemical_potential,
+                             double broadening, idx_t num_random) {
+    if (is_out_of_core) {
+        throw std::logic_error("KPM: the conductivity needs the velocity operators of a "
+                               "Hamiltonian in memory, not an out-of-core one.");
+    }
+    auto const scale = scaling_factors();
     auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
 
     auto specialized_algorithm = config.algorithm;
     specialized_algorithm.optimal_size = false; // not applicable for this calculation
 
-    optimized_hamiltonian.optimize_for({0, 0}, scale);
-    stats.reset(num_moments, optimized_hamiltonian, specialized_algorithm, num_random);
+    auto session = begin(Indices::full_system(), scale);
+    auto const& oh = session.oh();
+
+    // The coefficients project each random vector onto the chemical potentials, so only one
+    // state per energy is kept instead of all the moments of the Kubo-Bastin expansion
+    auto coefficients = delta_coefficients(chemical_potential, scale,
+                                           config.kernel.damping_coefficients(num_moments));
+    auto moments = KuboGreenwoodMoments(num_random, session.velocity(hamiltonian, coords),
+                                        std::move(coefficients), config.conductivity_block_size);
+
+    // Two recursions per random vector and pass: `r` and `op * r`
+    session.stats.reset(num_moments, oh, specialized_algorithm,
+                        2 * num_random * moments.num_passes());
+
+    auto starter = random_starter(oh, {}, config.counter_based_random);
+    timed_compute(session, &moments, starter, specialized_algorithm);
+
+    return timed(session.stats.reconstruct_timer, [&]{
+        auto const pi = 3.14159265358979323846;
+        return ArrayXd(pi * pi / static_cast<double>(num_random) * moments.data.real());
+    });
+}
+
+std::vector<MatrixXcd> Core::propagate(MatrixXcd const& psi0, ArrayXd const& times) {
+    if (psi0.rows() != hamiltonian_size()) {
+        throw std::invalid_argument("KPM: The initial states must match the Hamiltonian size.");
+    }
+
+    auto const scale = scaling_factors();
+    auto specialized_algorithm = config.algorithm;
+    specialized_algorithm.optimal_size = false; // not applicable for this calculation
+    auto session = begin(Indices::full_system(), scale);
+    auto const& oh = session.oh();
+    auto& stats = session.stats;
+
+    constexpr auto precision = 1e-12;
+    auto coefficients = std::vector<ArrayXcd>();
+    auto num_terms = idx_t{0};
+    for (auto const t : times) {
+        coefficients.push_back(propagation_coefficients(scale, t, precision));
+        num_terms = std::max(num_terms, coefficients.back().size());
+    }
+    stats.reset(num_terms, oh, specialized_algorithm, psi0.cols());
 
-    // On the left, the velocity operator is only applied to the starter
-    auto starter_l = random_starter(optimized_hamiltonian, velocity(hamiltonian, left_coords));
-    auto moments_l = DenseMatrixMoments(num_moments);
+    auto reordered_psi0 = psi0;
+    oh.reorder_rows(reordered_psi0);
+    auto result = std::vector<MatrixXcd>(coefficients.size(),
+                                         MatrixXcd::Zero(psi0.rows(), psi0.cols()));
 
-    // On the right, the operator is applied at collection time to each vector
-    auto starter_r = random_starter(optimized_hamiltonian);
-    auto moments_r = DenseMatrixMoments(num_moments, velocity(hamiltonian, right_coords));
+    stats.moments_timer.tic();
+    var::apply_visitor(Propagate{reordered_psi0, coefficients, result,
+                                 compute->get_num_threads()},
+                       oh.matrix());
+    stats.moments_timer.toc_accumulate();
 
-    auto total_mu = MomentMultiplication(num_moments, optimized_hamiltonian.scalar_tag());
-    for (auto j = 0; j < num_random; ++j) {
-        timed_compute(&moments_l, starter_l, specialized_algorithm);
-        timed_compute(&moments_r, starter_r, specialized_algorithm);
-        total_mu.matrix_mul_add(moments_l, moments_r);
+    for (auto& psi : result) {
+        oh.restore_rows(psi);
     }
-    total_mu.normalize(num_random);
+    return result;
+}
+
+ArrayXcd Core::lanczos_greens(idx_t index, ArrayXd const& energy, double broadening) {
+    constexpr auto tolerance = 1e-6; // relative change of the result between two checks
+    auto const scale = scaling_factors();
+    // Never more matrix-vector products than the Chebyshev moments would need
+    auto const max_steps = config.kernel.required_num_moments(broadening / scale.a);
+
+    auto previous = ArrayXcd();
+    auto const is_converged = [&](compute::LanczosCoefficients const& c) {
+        auto const current = compute::continued_fraction(c, energy, broadening);
+        auto const converged = previous.size() == current.size() && current.size() > 0
+                               && (current - previous).abs().maxCoeff()
+                                  <= tolerance * current.abs().maxCoeff();
+        previous = current;
+        return converged;
+    };
 
-    apply_damping(total_mu, config.kernel);
-    return reconstruct<KuboBastin>(total_mu, chemical_potential, bounds.linspaced(num_points),
-                                   temperature, scale);
+    auto timer = Chrono();
+    auto const coefficients = timed(timer, [&]{
+        return dispatch::best().lanczos_coefficients(hamiltonian, index, max_steps,
+                                                     is_converged);
+    }, "lanczos");
+
+    auto session = Session(*shared, nullptr); // the original matrix is used as is
+    auto& stats = session.stats;
+    stats.reset_lanczos(static_cast<idx_t>(coefficients.alpha.size()), hamiltonian.non_zeros(),
+                        hamiltonian.rows(), hamiltonian.get_variant().match(ScalarSize{}));
+    stats.bounds_timer = bounds.get_timer();
+    stats.moments_timer = timer;
+    return timed(stats.reconstruct_timer, [&]{
+        return compute::continued_fraction(coefficients, energy, broadening);
+    });
 }
 
-void Core::timed_compute(MomentsRef m, Starter const& starter, AlgorithmConfig const& ac) {
+void Core::timed_compute(Session& session, MomentsRef m, Starter const& starter,
+                         AlgorithmConfig const& ac) {
+    auto& stats = session.stats;
+    stats.bounds_timer = bounds.get_timer();
+    auto const span = trace::Span("moments", "kpm");
     stats.moments_timer.tic();
-    compute->moments(std::move(m), starter, ac, optimized_hamiltonian);
+    compute->moments(m, starter, ac, session.oh());
     stats.moments_timer.toc_accumulate();
+    stats.moments_memory = var::apply_visitor(MomentsMemory{}, m);
+    stats.skipped_moments += var::apply_visitor(SkippedMoments{}, m);
+    // Overlapping calculations share the `compute` profile: it's only exact for one at a time
+    stats.profile = compute->profile();
+}
+
+template<class M>
+void Core::cached_compute(Session& session, M& moments, MomentCache::Key key,
+                          Starter const& starter, AlgorithmConfig const& ac) {
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        if (shared->moment_cache.find(key, moments.num_moments, moments.data)) {
+            session.stats.bounds_timer = bounds.get_timer();
+            session.stats.from_cache = true;
+            return;
+        }
+    }
+
+    // Concurrent misses for the same key compute the same moments: the last insert wins
+    timed_compute(session, &moments, starter, ac);
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    shared->moment_cache.insert(std::move(key), moments.num_moments, moments.data);
 }
 
 }} // namespace cpb::kpm
@@ -0,0 +1,50 @@
+#include "kpm/ExpansionMoments.hpp"
+#include "kpm/reconstruct.hpp"
+#include "support/format.hpp"
+
+namespace cpb { namespace kpm {
+
+ExpansionMoments ExpansionMoments::truncated(idx_t n) const {
+    if (n < 2 || n > num_moments()) {
+        throw std::invalid_argument(fmt::format(
+            "KPM moments: can't truncate {} moments to {}", num_moments(), n
+        ));
+    }
+    return {scale, data.topRows(n)};
+}
+
+ExpansionMoments ExpansionMoments::truncated(Kernel const& kernel, double broadening) const {
+    if (broadening <= 0) { return *this; }
+
+    auto const n = kernel.required_num_moments(broadening / scale.a);
+    if (n > num_moments()) {
+        throw std::invalid_argument(fmt::format(
+            "KPM moments: a broadening of {} requires {} moments but only {} have been "
+            "computed", broadening, n, num_moments()
+        ));
+    }
+    return truncated(n);
+}
+
+ArrayXXdCM ExpansionMoments::spectral_density(ArrayXd const& energy, Kernel const& kernel,
+                                              double broadening) const {
+    auto moments = truncated(kernel, broadening).data;
+    kernel(moments);
+    return SpectralDensity{energy, scale}(moments);
+}
+
+std::vector<ArrayXcd> ExpansionMoments::greens(ArrayXd const& energy, Kernel const& kernel,
+                                               double broadening) const {
+    auto moments = truncated(kernel, broadening).data;
+    kernel(moments);
+
+    auto const reconstruct = GreensFunction{energy, scale};
+    auto results = std::vector<ArrayXcd>();
+    results.reserve(moments.cols());
+    for (auto j = idx_t{0}; j < moments.cols(); ++j) {
+        results.push_back(reconstruct(ArrayXcd(moments.col(j))));
+    }
+    return results;
+}
+
+}} // namespace cpb::kpm
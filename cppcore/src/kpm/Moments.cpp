@@ -1,5 +1,7 @@
 #include "kpm/Moments.hpp"
 
+#include <limits>
+
 namespace cpb { namespace kpm {
 
 namespace {
@@ -100,6 +102,15 @@ struct MatrixMulAdd {
     }
 };
 
+struct Add {
+    var::complex<MatrixX>& result;
+
+    template<class scalar_t>
+    void operator()(MatrixX<scalar_t> const& partial) {
+        result.template get<MatrixX<scalar_t>>() += partial;
+    }
+};
+
 struct Div {
     idx_t n;
 
@@ -107,8 +118,116 @@ struct Div {
     void operator()(T& x) const { x /= static_cast<real_t>(n); }
 };
 
+/// Add each moment vector (column) to the running mean and variance, then write the mean
+struct StochasticAccumulatorImpl {
+    BatchData& var_result;
+    idx_t idx;
+    idx_t num_vectors;
+    idx_t& count;
+    ArrayXcd& mean;
+    ArrayXd& m2;
+
+    void add(ArrayXcd const& x) {
+        if (count == 0) {
+            mean = ArrayXcd::Zero(x.size());
+            m2 = ArrayXd::Zero(x.size());
+        }
+
+        ++count;
+        ArrayXcd const delta = x - mean;
+        mean += delta / static_cast<double>(count);
+        m2 += (delta.conjugate() * (x - mean)).real();
+    }
+
+    template<class scalar_t>
+    void store() {
+        var_result = ArrayX<scalar_t>(num::force_cast<scalar_t>(VectorXcd(mean.matrix())));
+    }
+
+    template<class scalar_t>
+    void operator()(ArrayX<scalar_t> const& a) {
+        add(a.template cast<std::complex<double>>());
+        store<scalar_t>();
+    }
+
+    template<class scalar_t>
+    void operator()(ArrayXX<scalar_t> const& a) {
+        auto const cols = std::max(std::min(a.cols(), num_vectors - idx), idx_t{0});
+        for (auto j = idx_t{0}; j < cols; ++j) {
+            add(a.col(j).template cast<std::complex<double>>());
+        }
+        if (count > 0) { store<scalar_t>(); }
+    }
+};
+
+struct Bytes {
+    template<class T>
+    std::size_t operator()(T const& x) const {
+        return static_cast<std::size_t>(x.size()) * sizeof(typename T::Scalar);
+    }
+};
+
 } // anonymous namespace
 
+std::size_t Checkpoint::memory_usage() const {
+    auto bytes = std::size_t{0};
+    for (auto const& s : states) {
+        bytes += var::apply_visitor(Bytes{}, s.r0) + var::apply_visitor(Bytes{}, s.r1);
+    }
+    return bytes;
+}
+
+struct StochasticAccumulator::State {
+    double target_error;
+    ArrayXd weights;
+    std::mutex mutex;
+
+    idx_t count = 0;
+    ArrayXcd mean;
+    ArrayXd m2; ///< sum of the squared differences from the mean
+};
+
+constexpr idx_t StochasticAccumulator::min_vectors;
+
+StochasticAccumulator::StochasticAccumulator(double target_error, ArrayXd weights)
+    : state(std::make_shared<State>()) {
+    state->target_error = target_error;
+    state->weights = std::move(weights);
+}
+
+void StochasticAccumulator::operator()(BatchData& result, BatchData const& nd, idx_t idx,
+                                       idx_t nvec) {
+    std::lock_guard<std::mutex> lk(state->mutex);
+    var::apply_visitor(StochasticAccumulatorImpl{result, idx, nvec, state->count,
+                                                 state->mean, state->m2}, nd);
+}
+
+idx_t StochasticAccumulator::count() const {
+    std::lock_guard<std::mutex> lk(state->mutex);
+    return state->count;
+}
+
+double StochasticAccumulator::relative_error() const {
+    std::lock_guard<std::mutex> lk(state->mutex);
+    auto const& s = *state;
+    if (s.count < 2) { return std::numeric_limits<double>::infinity(); }
+
+    auto const n = std::min(s.weights.size(), s.mean.size());
+    auto const w2 = s.weights.head(n).square();
+    auto const variance = s.m2.head(n) / static_cast<double>(s.count - 1);
+    auto const error = std::sqrt((w2 * variance).sum() / static_cast<double>(s.count));
+    auto const norm = std::sqrt((w2 * s.mean.head(n).abs2()).sum());
+    return norm > 0 ? error / norm : std::numeric_limits<double>::infinity();
+}
+
+bool StochasticAccumulator::is_converged() const {
+    return count() >= min_vectors && relative_error() <= state->target_error;
+}
+
+void LocalMoments::normalize() {
+    var::apply_visitor(Div{num_vectors}, data);
+}
+
 void BatchAccumulator::operator()(BatchData& result, BatchData const& nd, idx_t idx, idx_t nvec) {
     var::apply_visitor(BatchAccumulatorImpl{result, idx, nvec, count}, nd);
 }
@@ -125,12 +244,18 @@ void  MomentMultiplication::matrix_mul_add(DenseMatrixMoments const& a,
     var::apply_visitor(MatrixMulAdd{data, a.data}, b.data);
 }
 
+void MomentMultiplication::add(var::complex<MatrixX> const& partial) {
+    std::lock_guard<std::mutex> lk(*mutex);
+    var::apply_visitor(Add{data}, partial);
+}
+
 void MomentMultiplication::normalize(idx_t total) {
     var::apply_visitor(Div{total}, data);
 }
 
 struct Velocity {
     ArrayXf const& alpha;
+    OptimizedHamiltonian const* oh; ///< reorder the result if not null
 
     template<class scalar_t>
     VariantCSR operator()(SparseMatrixRC<scalar_t> const& ham) const {
@@ -147,12 +272,18 @@ struct Velocity {
             }
         }
 
+        if (oh) { oh->reorder(result); }
         return std::move(result);
     }
 };
 
 VariantCSR velocity(Hamiltonian const& hamiltonian, ArrayXf const& alpha) {
-    return var::apply_visitor(Velocity{alpha}, hamiltonian.get_variant());
+    return var::apply_visitor(Velocity{alpha, nullptr}, hamiltonian.get_variant());
+}
+
+VariantCSR velocity(Hamiltonian const& hamiltonian, ArrayXf const& alpha,
+                    OptimizedHamiltonian const& oh) {
+    return var::apply_visitor(Velocity{alpha, &oh}, hamiltonian.get_variant());
 }
 
 }} // namespace cpb::kpm
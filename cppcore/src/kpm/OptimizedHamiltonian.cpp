@@ -1,7 +1,97 @@
 #include "kpm/OptimizedHamiltonian.hpp"
+#include "support/simd.hpp"
+#include "detail/thread.hpp"
+#include "utils/Trace.hpp"
+
+#include <algorithm>
+#include <atomic>
 
 namespace cpb { namespace kpm {
 
+namespace {
+    /// Source of `OptimizedHamiltonian::revision()`, shared by all instances
+    std::atomic<idx_t> last_revision{0};
+
+    /// Call `f(start, end)` for contiguous blocks of rows split among `num_threads`.
+    /// Only large matrices are worth starting the extra threads.
+    template<class F>
+    void for_each_row_block(idx_t num_threads, idx_t rows, F f) {
+        constexpr auto min_rows_per_thread = idx_t{4096};
+        num_threads = std::min(num_threads, std::max(rows / min_rows_per_thread, idx_t{1}));
+        if (num_threads <= 1) { return f(idx_t{0}, rows); }
+
+        auto const block_size = (rows + num_threads - 1) / num_threads;
+        ThreadTeam team(num_threads);
+        team.run([&](idx_t thread_id) {
+            auto const start = std::min(thread_id * block_size, rows);
+            f(start, std::min(start + block_size, rows));
+        });
+    }
+
+    /// ELLPACK is replaced by HYB if it would store more than this many elements per non-zero
+    constexpr auto hyb_padding_threshold = 2.0;
+    /// Fraction of the rows which fit entirely into the ELL part of HYB
+    constexpr auto hyb_row_percentile = 0.95;
+
+    /// Number of non-zeros in the rows of `block` (of `bs` rows)
+    template<class scalar_t>
+    storage_idx_t block_degree(SparseMatrixX<scalar_t> const& h, storage_idx_t bs,
+                               storage_idx_t block) {
+        return h.outerIndexPtr()[(block + 1) * bs] - h.outerIndexPtr()[block * bs];
+    }
+
+    /**
+     Find a pseudo-peripheral block of rows (George-Liu): the breadth-first traversal which
+     starts there reaches as far as possible, so its levels are as narrow as possible.
+     Only the part of the system which is connected to the first block is searched.
+     */
+    template<class scalar_t>
+    storage_idx_t peripheral_block(SparseMatrixX<scalar_t> const& h, storage_idx_t bs) {
+        auto const indptr = h.outerIndexPtr();
+        auto const indices = h.innerIndexPtr();
+        auto const num_blocks = static_cast<size_t>(h.rows() / bs);
+        auto level = std::vector<storage_idx_t>(num_blocks);
+        auto queue = std::vector<storage_idx_t>();
+        queue.reserve(num_blocks);
+
+        // Return the eccentricity of `start`: the blocks of the last level end up last in `queue`
+        auto const traverse = [&](storage_idx_t start) {
+            std::fill(level.begin(), level.end(), -1);
+            queue.clear();
+            queue.push_back(start);
+            level[start] = 0;
+            for (auto i = size_t{0}; i < queue.size(); ++i) {
+                auto const block = queue[i];
+                for (auto n = indptr[block * bs]; n < indptr[(block + 1) * bs]; ++n) {
+                    auto const col = indices[n] / bs;
+                    if (level[col] < 0) {
+                        level[col] = level[block] + 1;
+                        queue.push_back(col);
+                    }
+                }
+            }
+            return level[queue.back()];
+        };
+
+        constexpr auto max_iterations = 8; // it usually converges after 2 or 3
+        auto start = storage_idx_t{0};
+        auto eccentricity = traverse(start);
+        for (auto i = 0; i < max_iterations; ++i) {
+            // The next candidate is the block in the last level with the lowest degree
+            auto candidate = queue.back();
+            for (auto it = queue.rbegin(); it != queue.rend() && level[*it] == eccentricity; ++it) {
+                if (block_degree(h, bs, *it) < block_degree(h, bs, candidate)) { candidate = *it; }
+            }
+
+            auto const candidate_eccentricity = traverse(candidate);
+            if (candidate_eccentricity <= eccentricity) { break; }
+            start = candidate;
+            eccentricity = candidate_eccentricity;
+        }
+        return start;
+    }
+} // anonymous namespace
+
 SliceMap::SliceMap(std::vector<storage_idx_t> indices, Indices const& optimized_idx)
     : data(std::move(indices)) {
     auto find_offset = [&](ArrayXi const& idx) {
@@ -24,35 +114,405 @@ struct Optimize {
 
     template<class scalar_t>
     void operator()(SparseMatrixRC<scalar_t> const&) {
+        auto reorder_span = trace::Span("reorder", "kpm");
+        oh.reorder_timer.tic();
+        if (oh.matrix_format == MatrixFormat::STENCIL && oh.stencil_pattern) {
+            auto const is_stencil = oh.create_stencil<scalar_t>(idx, scale);
+            if (is_stencil) { oh.reorder_timer.toc(); return; }
+            oh.stencil_pattern = {}; // not translation invariant: use ELL from now on
+        }
+
         if (oh.is_reordered) {
             oh.create_reordered<scalar_t>(idx, scale);
         } else {
             oh.create_scaled<scalar_t>(idx, scale);
         }
+        oh.reorder_timer.toc();
+        reorder_span.end();
 
-        if (oh.matrix_format == MatrixFormat::ELL) {
+        auto const convert_span = trace::Span("convert", "kpm");
+        oh.convert_timer.tic();
+        using single_t = num::get_single_t<scalar_t>;
+        if (oh.is_mixed_precision && !std::is_same<scalar_t, single_t>::value) {
             auto const& csr = oh.optimized_matrix.template get<SparseMatrixX<scalar_t>>();
-            oh.optimized_matrix = num::csr_to_ell(csr);
+            oh.optimized_matrix = SparseMatrixX<single_t>(csr.template cast<single_t>());
+            convert_format<single_t>();
+        } else {
+            convert_format<scalar_t>();
+        }
+        oh.convert_timer.toc();
+    }
+
+    /// Convert the optimized CSR matrix to the final `MatrixFormat`
+    template<class scalar_t>
+    void convert_format() {
+        auto const bsr_block_size = oh.bsr_block_size();
+        auto table = oh.matrix_format == MatrixFormat::ELL_TABLE
+                     ? num::csr_to_table_ell(
+                           oh.optimized_matrix.template get<SparseMatrixX<scalar_t>>())
+                     : num::TableEllMatrix<scalar_t>();
+        auto delta = oh.matrix_format == MatrixFormat::ELL_DELTA
+                     ? num::csr_to_delta_ell(
+                           oh.optimized_matrix.template get<SparseMatrixX<scalar_t>>())
+                     : num::DeltaEllMatrix<scalar_t>();
+        // Real values are already split: they use the regular ELLPACK kernels
+        auto split = oh.matrix_format == MatrixFormat::ELL_SPLIT && num::is_complex<scalar_t>()
+                     ? num::csr_to_split_ell(
+                           oh.optimized_matrix.template get<SparseMatrixX<scalar_t>>())
+                     : num::SplitEllMatrix<scalar_t>();
+        // Complex values can't be quantized: they use the regular ELLPACK kernels
+        auto const is_quantized = oh.matrix_format == MatrixFormat::ELL_BF16
+                                  || oh.matrix_format == MatrixFormat::ELL_INT8;
+        auto quantized = is_quantized
+                         ? num::csr_to_quantized_ell(
+                               oh.optimized_matrix.template get<SparseMatrixX<scalar_t>>(),
+                               oh.matrix_format == MatrixFormat::ELL_BF16
+                               ? num::ValuePrecision::BF16 : num::ValuePrecision::INT8)
+                         : num::QuantizedEllMatrix<scalar_t>();
+        if (bsr_block_size > 1) {
+            auto const& csr = oh.optimized_matrix.template get<SparseMatrixX<scalar_t>>();
+            oh.optimized_matrix = num::csr_to_bsr(csr, bsr_block_size);
+        } else if (table) {
+            oh.optimized_matrix = std::move(table);
+        } else if (delta) {
+            oh.optimized_matrix = std::move(delta);
+        } else if (split) {
+            oh.optimized_matrix = std::move(split);
+        } else if (quantized) {
+            oh.optimized_matrix = std::move(quantized);
+        } else if (oh.matrix_format == MatrixFormat::ELL
+                   || oh.matrix_format == MatrixFormat::STENCIL
+                   || oh.matrix_format == MatrixFormat::BSR
+                   || oh.matrix_format == MatrixFormat::ELL_TABLE
+                   || oh.matrix_format == MatrixFormat::ELL_DELTA
+                   || oh.matrix_format == MatrixFormat::ELL_SPLIT
+                   || is_quantized
+                   || oh.matrix_format == MatrixFormat::HYB) { // not applicable: use ELL
+            auto const& csr = oh.optimized_matrix.template get<SparseMatrixX<scalar_t>>();
+            if (oh.matrix_format == MatrixFormat::HYB
+                || num::ell_padding(csr) > hyb_padding_threshold) { // a few very long rows
+                auto const width = num::row_length_percentile(csr, hyb_row_percentile);
+                oh.optimized_matrix = num::csr_to_hyb(csr, width);
+            } else {
+                auto ell = num::EllMatrix<scalar_t>(csr.rows(), csr.cols(),
+                                                    sparse::max_nnz_per_row(csr));
+                for_each_row_block(oh.num_threads, csr.rows(), [&](idx_t start, idx_t end) {
+                    num::csr_to_ell_rows(csr, ell, start, end);
+                });
+                oh.optimized_matrix = std::move(ell);
+            }
+        } else if (oh.matrix_format == MatrixFormat::SELL) {
+            // Chunks are one SIMD register tall and rows are sorted within 16 chunks at most
+            auto const& csr = oh.optimized_matrix.template get<SparseMatrixX<scalar_t>>();
+            constexpr auto chunk_size = static_cast<idx_t>(simd::traits<scalar_t>::size);
+            oh.optimized_matrix = num::csr_to_sell(csr, chunk_size, 16 * chunk_size,
+                                                   oh.slice_map.get_data());
+        } else if (oh.matrix_format == MatrixFormat::HERMITIAN) {
+            auto const& csr = oh.optimized_matrix.template get<SparseMatrixX<scalar_t>>();
+            oh.optimized_matrix = num::csr_to_hermitian(csr);
         }
 
         oh.tag = var::tag<scalar_t>{};
     }
 };
 
+namespace {
+    /// Write the values of `csr` into an optimized matrix with the same structure. Return false
+    /// if the structure is different, e.g. due to a missing diagonal for a new scale factor.
+    template<class scalar_t>
+    struct WriteValues {
+        SparseMatrixX<scalar_t>& csr;
+        idx_t num_threads;
+
+        bool operator()(SparseMatrixX<scalar_t>& m) const {
+            if (m.rows() != csr.rows() || m.nonZeros() != csr.nonZeros()) { return false; }
+            auto const nnz = m.nonZeros();
+            if (!std::equal(m.outerIndexPtr(), m.outerIndexPtr() + m.rows() + 1,
+                            csr.outerIndexPtr())
+                || !std::equal(m.innerIndexPtr(), m.innerIndexPtr() + nnz,
+                               csr.innerIndexPtr())) { return false; }
+            m.swap(csr);
+            return true;
+        }
+
+        bool operator()(num::EllMatrix<scalar_t>& ell) const {
+            if (ell.rows() != csr.rows()) { return false; }
+
+            auto const indptr = csr.outerIndexPtr();
+            auto const indices = csr.innerIndexPtr();
+            auto const data = csr.valuePtr();
+            auto is_same = std::atomic<bool>{true};
+            for_each_row_block(num_threads, csr.rows(), [&](idx_t start, idx_t end) {
+                for (auto row = start; row < end; ++row) {
+                    auto const row_nnz = indptr[row + 1] - indptr[row];
+                    if (row_nnz > ell.nnz_per_row) { is_same = false; return; }
+
+                    for (auto n = 0; n < row_nnz; ++n) {
+                        if (ell.indices(row, n) != indices[indptr[row] + n]) {
+                            is_same = false; return;
+                        }
+                        ell.data(row, n) = data[indptr[row] + n];
+                    }
+                    for (auto n = row_nnz; n < ell.nnz_per_row; ++n) {
+                        if (ell.data(row, n) != scalar_t{0}) { is_same = false; return; }
+                    }
+                }
+            });
+            return is_same;
+        }
+
+        bool operator()(num::SplitEllMatrix<scalar_t>& split) const {
+            using Matrix = num::SplitEllMatrix<scalar_t>;
+            if (split.rows() != csr.rows()) { return false; }
+
+            auto const indptr = csr.outerIndexPtr();
+            auto const indices = csr.innerIndexPtr();
+            auto const data = csr.valuePtr();
+            auto is_same = std::atomic<bool>{true};
+            for_each_row_block(num_threads, csr.rows(), [&](idx_t start, idx_t end) {
+                for (auto row = start; row < end; ++row) {
+                    auto const row_nnz = indptr[row + 1] - indptr[row];
+                    if (row_nnz > split.nnz_per_row) { is_same = false; return; }
+
+                    for (auto n = 0; n < row_nnz; ++n) {
+                        auto const k = indptr[row] + n;
+                        if (split.offsets(row, n) != Matrix::components * indices[k]) {
+                            is_same = false; return;
+                        }
+                        split.real(row, n) = std::real(data[k]);
+                        if (Matrix::components == 2) { split.imag(row, n) = std::imag(data[k]); }
+                    }
+                    for (auto n = row_nnz; n < split.nnz_per_row; ++n) {
+                        if (split.value(row, n) != scalar_t{0}) { is_same = false; return; }
+                    }
+                }
+            });
+            return is_same;
+        }
+
+        bool operator()(num::SellMatrix<scalar_t>& sell) const {
+            if (sell.rows() != csr.rows()) { return false; }
+
+            auto const indptr = csr.outerIndexPtr();
+            auto const indices = csr.innerIndexPtr();
+            auto const data = csr.valuePtr();
+            for (auto c = 0; c < sell.num_chunks(); ++c) {
+                for (auto lane = 0; lane < sell.chunk_size; ++lane) {
+                    auto const row = sell.row_indices[c * sell.chunk_size + lane];
+                    if (row < 0) { continue; }
+                    auto const row_nnz = indptr[row + 1] - indptr[row];
+                    if (row_nnz > sell.chunk_widths[c]) { return false; }
+
+                    auto const offset = sell.chunk_offsets[c] + lane;
+                    for (auto j = 0; j < sell.chunk_widths[c]; ++j) {
+                        auto const n = offset + j * sell.chunk_size;
+                        if (j >= row_nnz) {
+                            if (sell.data[n] != scalar_t{0}) { return false; }
+                        } else if (sell.indices[n] != indices[indptr[row] + j]) {
+                            return false;
+                        } else {
+                            sell.data[n] = data[indptr[row] + j];
+                        }
+                    }
+                }
+            }
+            return true;
+        }
+
+        bool operator()(num::BsrMatrix<scalar_t>& bsr) const {
+            if (bsr.rows() != csr.rows()) { return false; }
+
+            auto other = num::csr_to_bsr(csr, bsr.block_size);
+            if (other.block_indptr != bsr.block_indptr
+                || !(other.block_indices == bsr.block_indices).all()) { return false; }
+            bsr.data.swap(other.data);
+            return true;
+        }
+
+        bool operator()(num::HermitianMatrix<scalar_t>& hermitian) const {
+            if (hermitian.rows() != csr.rows()) { return false; }
+
+            auto other = num::csr_to_hermitian(csr);
+            if (other.indptr != hermitian.indptr
+                || !(other.indices == hermitian.indices).all()) { return false; }
+            hermitian.data.swap(other.data);
+            return true;
+        }
+
+        bool operator()(num::HybMatrix<scalar_t>& hyb) const {
+            if (hyb.rows() != csr.rows()) { return false; }
+
+            auto other = num::csr_to_hyb(csr, hyb.nnz_per_row());
+            auto const rows = hyb.rows();
+            if (!(other.ell.indices.topRows(rows) == hyb.ell.indices.topRows(rows)).all()
+                || !WriteValues{other.overflow, num_threads}(hyb.overflow)) { return false; }
+            hyb.ell.data.swap(other.ell.data);
+            return true;
+        }
+
+        /// Different scalar type, a matrix-free operator or a format which depends on the values
+        /// (value table, escaped elements): there is nothing to reuse
+        template<class Matrix>
+        bool operator()(Matrix&) const { return false; }
+    };
+} // anonymous namespace
+
+struct UpdateValues {
+    OptimizedHamiltonian& oh;
+    Scale<> scale;
+
+    template<class scalar_t>
+    bool operator()(SparseMatrixRC<scalar_t> const&) {
+        auto h2 = oh.is_reordered ? oh.reordered_matrix<scalar_t>(scale)
+                                  : oh.scaled_matrix<scalar_t>(scale);
+
+        using single_t = num::get_single_t<scalar_t>;
+        if (oh.is_mixed_precision && !std::is_same<scalar_t, single_t>::value) {
+            auto h2_single = SparseMatrixX<single_t>(h2.template cast<single_t>());
+            return var::apply_visitor(WriteValues<single_t>{h2_single, oh.num_threads},
+                                      oh.optimized_matrix);
+        } else {
+            return var::apply_visitor(WriteValues<scalar_t>{h2, oh.num_threads},
+                                      oh.optimized_matrix);
+        }
+    }
+};
+
+namespace {
+    struct NumRows {
+        template<class Matrix>
+        idx_t operator()(Matrix const& m) const { return m.rows(); }
+    };
+
+    /// The mapped matrix is only a view: scaling it doesn't touch the file
+    struct OptimizeMapped {
+        OptimizedHamiltonian::VariantMatrix& optimized_matrix;
+        var::scalar_tag& tag;
+        Scale<> scale;
+
+        template<class scalar_t>
+        void operator()(num::MappedCsrMatrix<scalar_t> const& h) const {
+            optimized_matrix = h.scaled(scale.a, scale.b);
+            tag = var::tag<scalar_t>{};
+        }
+    };
+} // anonymous namespace
+
+OptimizedHamiltonian::OptimizedHamiltonian(MappedHamiltonian const& h, idx_t num_threads)
+    : mapped_h(h), is_mapped(true), slice_map(h.match(NumRows{})),
+      matrix_format(MatrixFormat::CSR), is_reordered(false), is_mixed_precision(false),
+      num_threads(num_threads), cache_size(0), block_size(1) {}
+
+idx_t OptimizedHamiltonian::size() const {
+    return is_mapped ? mapped_h.match(NumRows{}) : original_h.rows();
+}
+
 void OptimizedHamiltonian::optimize_for(Indices const& idx, Scale<> scale) {
-    if (original_idx == idx) {
+    if (original_idx == idx && !is_outdated) {
         return; // already optimized for this idx
     }
 
+    matrix_revision = ++last_revision;
     timer.tic();
-    original_h.get_variant().match(Optimize{*this, idx, scale});
+    reorder_timer = {};
+    convert_timer = {};
+    if (is_mapped) {
+        mapped_h.match(OptimizeMapped{optimized_matrix, tag, scale});
+        optimized_idx = idx;
+        original_idx = idx;
+        timer.toc();
+        return;
+    }
+    if (is_outdated) {
+        // The structure can only be reused for the same target indices. Otherwise, the
+        // outdated values must not end up in the cache.
+        auto const is_updated = original_idx == idx
+                                && var::apply_visitor(UpdateValues{*this, scale},
+                                                      original_h.get_variant());
+        if (!is_updated) { original_idx = {}; }
+        is_outdated = false;
+    }
+    if (!(original_idx == idx) && !swap_with_cache(idx)) {
+        original_h.get_variant().match(Optimize{*this, idx, scale});
+        original_idx = idx;
+    }
     timer.toc();
+}
+
+namespace {
+    /// Do the two matrices have the same scalar type and sparsity pattern?
+    struct SamePattern {
+        Hamiltonian const& other;
+
+        template<class scalar_t>
+        bool operator()(SparseMatrixRC<scalar_t> const& a) const {
+            if (!ham::is<scalar_t>(other)) { return false; }
+            auto const& b = ham::get_reference<scalar_t>(other);
+            if (a->rows() != b.rows() || a->cols() != b.cols()
+                || a->nonZeros() != b.nonZeros()) { return false; }
+            if (!a->isCompressed() || !b.isCompressed()) { return false; }
+
+            return std::equal(a->outerIndexPtr(), a->outerIndexPtr() + a->rows() + 1,
+                              b.outerIndexPtr())
+                   && std::equal(a->innerIndexPtr(), a->innerIndexPtr() + a->nonZeros(),
+                                 b.innerIndexPtr());
+        }
+    };
+} // anonymous namespace
+
+bool OptimizedHamiltonian::update_values(Hamiltonian const& h) {
+    if (!original_h || !h || !var::apply_visitor(SamePattern{h}, original_h.get_variant())) {
+        return false;
+    }
+
+    original_h = h;
+    cache.clear(); // the cached optimizations have the old values
+    is_outdated = original_idx.src.size() != 0;
+    return true;
+}
+
+bool OptimizedHamiltonian::swap_with_cache(Indices const& idx) {
+    // Only the reordered matrix depends on the target indices
+    auto const is_stencil = matrix_format == MatrixFormat::STENCIL && stencil_pattern;
+    if (cache_size <= 0 || !is_reordered || is_stencil || original_idx.src.size() == 0) {
+        return false;
+    }
+
+    auto current = Optimization{std::move(original_idx), std::move(optimized_matrix), tag,
+                                std::move(optimized_idx), std::move(slice_map),
+                                std::move(reorder_map)};
+
+    auto const it = std::find_if(cache.begin(), cache.end(), [&](Optimization const& o) {
+        return o.original_idx == idx;
+    });
+    if (it == cache.end()) {
+        cache.push_front(std::move(current));
+        if (static_cast<idx_t>(cache.size()) > cache_size) {
+            cache.pop_back();
+        }
+        return false;
+    }
+
+    original_idx = std::move(it->original_idx);
+    optimized_matrix = std::move(it->optimized_matrix);
+    tag = it->tag;
+    optimized_idx = std::move(it->optimized_idx);
+    slice_map = std::move(it->slice_map);
+    reorder_map = std::move(it->reorder_map);
 
-    original_idx = idx;
+    *it = std::move(current);
+    cache.splice(cache.begin(), cache, it);
+    return true;
 }
 
 template<class scalar_t>
 void OptimizedHamiltonian::create_scaled(Indices const& idx, Scale<> s) {
+    optimized_matrix = scaled_matrix<scalar_t>(s);
+    optimized_idx = idx;
+}
+
+template<class scalar_t>
+SparseMatrixX<scalar_t> OptimizedHamiltonian::scaled_matrix(Scale<> s) const {
     using real_t = num::get_real_t<scalar_t>;
     auto const scale = Scale<real_t>(s);
 
@@ -66,74 +526,78 @@ void OptimizedHamiltonian::create_scaled(Indices const& idx, Scale<> s) {
         h2 = (h - I * scale.b) * (2 / scale.a);
     }
     h2.makeCompressed();
+    return h2;
+}
 
-    optimized_matrix = h2.markAsRValue();
-    optimized_idx = idx;
+idx_t OptimizedHamiltonian::bsr_block_size() const {
+    if (matrix_format != MatrixFormat::BSR || block_size <= 1
+        || size() % block_size != 0) { return 1; }
+    return block_size;
 }
 
 template<class scalar_t>
 void OptimizedHamiltonian::create_reordered(Indices const& idx, Scale<> s) {
-    using real_t = num::get_real_t<scalar_t>;
-    auto scale = Scale<real_t>(s);
-
     auto const& h = ham::get_reference<scalar_t>(original_h);
-    auto const system_size = h.rows();
-    auto const inverted_a = real_t{2 / scale.a};
+    auto const h_indptr = h.outerIndexPtr();
+    auto const h_indices = h.innerIndexPtr();
 
-    auto h2 = SparseMatrixX<scalar_t>(system_size, system_size);
-    // Reserve the same nnz per row as the original + 1 in case the scaling adds diagonal elements
-    h2.reserve(VectorX<idx_t>::Constant(system_size, sparse::max_nnz_per_row(h) + 1));
+    // The traversal moves whole blocks of rows (a single row unless the format is BSR)
+    auto const bs = static_cast<storage_idx_t>(bsr_block_size());
+    auto const num_blocks = h.rows() / bs;
 
     // Note: The following "queue" and "map" use vectors instead of other container types because
     //       they serve a very simple purpose. Using preallocated vectors results in better
     //       performance (this is not an assumption, it has been tested).
 
+    // Without a target, the traversal is a Cuthill-McKee ordering. It starts at the edge of the
+    // system and visits the neighbors in order of increasing degree to minimize the bandwidth.
+    auto const is_full_system = idx.is_full_system();
+    auto const first = is_full_system ? peripheral_block(h, bs) : idx.src[0] / bs;
+
     // The index queue will contain the indices that need to be checked next
     auto index_queue = std::vector<storage_idx_t>();
-    index_queue.reserve(system_size);
-    index_queue.push_back(idx.src[0]); // starting from the given index
+    index_queue.reserve(num_blocks);
+    index_queue.push_back(first); // starting from the given index
 
-    // Map from original matrix indices to reordered matrix indices
-    reorder_map = std::vector<storage_idx_t>(system_size, -1); // reset all to invalid state
+    // Map from original matrix (block) indices to reordered matrix (block) indices
+    auto block_map = std::vector<storage_idx_t>(num_blocks, -1); // reset all to invalid state
     // The point of the reordering is to have the target become index number 0
-    reorder_map[idx.src[0]] = 0;
+    block_map[first] = 0;
 
     // As the reordered matrix is filled, the slice border indices are recorded
     auto slice_border_indices = std::vector<storage_idx_t>();
     slice_border_indices.push_back(1);
 
-    // Fill the reordered matrix row by row
-    auto const h_view = sparse::make_loop(h);
-    for (auto h2_row = 0; h2_row < system_size; ++h2_row) {
-        auto diagonal_inserted = false;
-
-        // Loop over elements in the row of the original matrix
-        // corresponding to the h2_row of the reordered matrix
-        auto const row = index_queue[h2_row];
-        h_view.for_each_in_row(row, [&](storage_idx_t col, scalar_t value) {
-            // This may be a new index, map it
-            if (reorder_map[col] < 0) {
-                reorder_map[col] = static_cast<storage_idx_t>(index_queue.size());
-                index_queue.push_back(col);
-            }
-
-            // Get the reordered column index
-            auto const h2_col = reorder_map[col];
+    // The new ordering only depends on the sparsity pattern: a breadth-first traversal
+    auto next_unvisited = storage_idx_t{0};
+    for (auto h2_row = 0; h2_row < num_blocks; ++h2_row) {
+        // The system may consist of disconnected parts which the traversal can't reach
+        if (h2_row == static_cast<idx_t>(index_queue.size())) {
+            while (block_map[next_unvisited] >= 0) { ++next_unvisited; }
+            block_map[next_unvisited] = static_cast<storage_idx_t>(h2_row);
+            index_queue.push_back(next_unvisited);
+        }
 
-            // Calculate the new value that will be inserted into the scaled/reordered matrix
-            auto h2_value = value * inverted_a;
-            if (row == col) { // diagonal elements
-                h2_value -= scale.b * inverted_a;
-                diagonal_inserted = true;
+        auto const block = index_queue[h2_row];
+        auto const first_new = index_queue.size();
+        for (auto row = block * bs; row < (block + 1) * bs; ++row) {
+            for (auto n = h_indptr[row]; n < h_indptr[row + 1]; ++n) {
+                auto const col = h_indices[n] / bs;
+                // This may be a new index, map it
+                if (block_map[col] < 0) {
+                    block_map[col] = static_cast<storage_idx_t>(index_queue.size());
+                    index_queue.push_back(col);
+                }
+            }
+        }
+        if (is_full_system) {
+            auto const new_begin = index_queue.begin() + static_cast<std::ptrdiff_t>(first_new);
+            std::stable_sort(new_begin, index_queue.end(), [&](storage_idx_t a, storage_idx_t b) {
+                return block_degree(h, bs, a) < block_degree(h, bs, b);
+            });
+            for (auto i = first_new; i < index_queue.size(); ++i) {
+                block_map[index_queue[i]] = static_cast<storage_idx_t>(i);
             }
-
-            h2.insert(h2_row, h2_col) = h2_value;
-        });
-
-        // A diagonal element may need to be inserted into the reordered matrix
-        // even if the original matrix doesn't have an element on the main diagonal
-        if (scale.b != 0 && !diagonal_inserted) {
-            h2.insert(h2_row, h2_row) = -scale.b * inverted_a;
         }
 
         // Reached the end of a slice
@@ -141,16 +605,133 @@ void OptimizedHamiltonian::create_reordered(Indices const& idx, Scale<> s) {
             slice_border_indices.push_back(static_cast<storage_idx_t>(index_queue.size()));
         }
     }
-    h2.makeCompressed();
-    optimized_matrix = h2.markAsRValue();
 
     slice_border_indices.pop_back(); // the last element is a duplicate of the second to last
     slice_border_indices.shrink_to_fit();
 
-    optimized_idx = reorder_indices(idx, reorder_map);
+    if (bs == 1) {
+        reorder_map = std::move(block_map);
+    } else {
+        reorder_map = std::vector<storage_idx_t>(h.rows());
+        for (auto i = storage_idx_t{0}; i < h.rows(); ++i) {
+            reorder_map[i] = block_map[i / bs] * bs + i % bs;
+        }
+        for (auto& border : slice_border_indices) { border *= bs; }
+    }
+
+    optimized_matrix = reordered_matrix<scalar_t>(s);
+    optimized_idx = is_full_system ? idx : reorder_indices(idx, reorder_map);
     slice_map = {std::move(slice_border_indices), optimized_idx};
 }
 
+template<class scalar_t>
+SparseMatrixX<scalar_t> OptimizedHamiltonian::reordered_matrix(Scale<> s) const {
+    using real_t = num::get_real_t<scalar_t>;
+    auto scale = Scale<real_t>(s);
+
+    auto const& h = ham::get_reference<scalar_t>(original_h);
+    auto const system_size = h.rows();
+    auto const inverted_a = real_t{2 / scale.a};
+    auto const h_indptr = h.outerIndexPtr();
+    auto const h_indices = h.innerIndexPtr();
+    auto const h_data = h.valuePtr();
+
+    // Map from reordered matrix indices back to the original indices
+    auto original_rows = std::vector<storage_idx_t>(system_size);
+    for (auto i = storage_idx_t{0}; i < system_size; ++i) {
+        original_rows[reorder_map[i]] = i;
+    }
+
+    // A diagonal element may need to be inserted into the reordered matrix
+    // even if the original matrix doesn't have an element on the main diagonal
+    auto h2 = SparseMatrixX<scalar_t>(system_size, system_size);
+    auto const h2_indptr = h2.outerIndexPtr();
+    h2_indptr[0] = 0;
+    for (auto h2_row = 0; h2_row < system_size; ++h2_row) {
+        auto const row = original_rows[h2_row];
+        auto const extra_diagonal = scale.b != 0 && !std::binary_search(
+            h_indices + h_indptr[row], h_indices + h_indptr[row + 1], row
+        );
+        h2_indptr[h2_row + 1] = h2_indptr[h2_row] + (h_indptr[row + 1] - h_indptr[row])
+                                + (extra_diagonal ? 1 : 0);
+    }
+
+    // Fill the reordered matrix: the rows are independent so they're split among the threads
+    h2.resizeNonZeros(h2_indptr[system_size]);
+    auto const h2_indices = h2.innerIndexPtr();
+    auto const h2_data = h2.valuePtr();
+    for_each_row_block(num_threads, system_size, [&](idx_t start, idx_t end) {
+        auto elements = std::vector<std::pair<storage_idx_t, scalar_t>>();
+        for (auto h2_row = start; h2_row < end; ++h2_row) {
+            auto const row = original_rows[h2_row];
+            auto diagonal_inserted = false;
+            elements.clear();
+
+            for (auto n = h_indptr[row]; n < h_indptr[row + 1]; ++n) {
+                auto const col = h_indices[n];
+                // Calculate the new value that will be inserted into the scaled/reordered matrix
+                auto h2_value = h_data[n] * inverted_a;
+                if (row == col) { // diagonal elements
+                    h2_value -= scale.b * inverted_a;
+                    diagonal_inserted = true;
+                }
+                elements.emplace_back(reorder_map[col], h2_value);
+            }
+            if (scale.b != 0 && !diagonal_inserted) {
+                elements.emplace_back(static_cast<storage_idx_t>(h2_row), -scale.b * inverted_a);
+            }
+
+            // The column indices of each compressed row must be sorted
+            std::sort(elements.begin(), elements.end(),
+                      [](std::pair<storage_idx_t, scalar_t> const& a,
+                         std::pair<storage_idx_t, scalar_t> const& b) {
+                return a.first < b.first;
+            });
+            auto n = h2_indptr[h2_row];
+            for (auto const& e : elements) {
+                h2_indices[n] = e.first;
+                h2_data[n] = e.second;
+                ++n;
+            }
+        }
+    });
+    return h2;
+}
+
+template<class scalar_t>
+bool OptimizedHamiltonian::create_stencil(Indices const& idx, Scale<> s) {
+    using real_t = num::get_real_t<scalar_t>;
+    auto const scale = Scale<real_t>(s);
+
+    auto const& h = ham::get_reference<scalar_t>(original_h);
+    auto stencil = num::csr_to_stencil(h, stencil_pattern);
+    if (!stencil) { return false; }
+
+    // Same as `create_scaled()`: only the onsite terms (zero shift) get the `b` offset
+    auto const inverted_a = real_t{2 / scale.a};
+    for (auto& term : stencil.terms) {
+        term.value *= inverted_a;
+        if (term.shift == 0) {
+            term.value -= scale.b * inverted_a;
+        }
+    }
+
+    using single_t = num::get_single_t<scalar_t>;
+    if (is_mixed_precision && !std::is_same<scalar_t, single_t>::value) {
+        optimized_matrix = stencil.template cast<single_t>();
+        tag = var::tag<single_t>{};
+    } else {
+        optimized_matrix = std::move(stencil);
+        tag = var::tag<scalar_t>{};
+    }
+
+    // The natural ordering is kept: a single slice spanning the whole system
+    optimized_idx = idx;
+    slice_map = SliceMap(size());
+    reorder_map.clear();
+    return true;
+}
+
 Indices OptimizedHamiltonian::reorder_indices(Indices const& original_idx,
                                               std::vector<storage_idx_t> const& map) {
     return {transform<ArrayX>(original_idx.src,  [&](storage_idx_t i) { return map[i]; }),
@@ -171,6 +752,56 @@ namespace {
         size_t operator()(num::EllMatrix<scalar_t> const& ell) {
             return static_cast<size_t>(rows * ell.nnz_per_row);
         }
+
+        template<class scalar_t>
+        size_t operator()(num::SellMatrix<scalar_t> const& sell) {
+            return static_cast<size_t>(sell.nonZeros(rows));
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::StencilMatrix<scalar_t> const& stencil) {
+            return static_cast<size_t>(stencil.nonZeros() * rows / stencil.rows());
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::BsrMatrix<scalar_t> const& bsr) {
+            return static_cast<size_t>(bsr.nonZeros(rows));
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::HermitianMatrix<scalar_t> const& hermitian) {
+            return static_cast<size_t>(hermitian.nonZeros(rows));
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::TableEllMatrix<scalar_t> const& table_ell) {
+            return static_cast<size_t>(table_ell.nonZeros(rows));
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::DeltaEllMatrix<scalar_t> const& delta_ell) {
+            return static_cast<size_t>(delta_ell.nonZeros(rows));
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::HybMatrix<scalar_t> const& hyb) {
+            return static_cast<size_t>(hyb.nonZeros(rows));
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::SplitEllMatrix<scalar_t> const& split) {
+            return static_cast<size_t>(rows * split.nnz_per_row);
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::QuantizedEllMatrix<scalar_t> const& quantized) {
+            return static_cast<size_t>(rows * quantized.nnz_per_row);
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::MappedCsrMatrix<scalar_t> const& mapped) {
+            return static_cast<size_t>(mapped.nonZeros(rows));
+        }
     };
 }
 
@@ -223,11 +854,126 @@ namespace {
             auto const nnz = static_cast<size_t>(ell.nonZeros());
             return nnz * sizeof(scalar_t) + nnz * sizeof(index_t);
         }
+
+        template<class scalar_t>
+        size_t operator()(num::SellMatrix<scalar_t> const& sell) const {
+            using index_t = typename num::SellMatrix<scalar_t>::StorageIndex;
+            auto const nnz = static_cast<size_t>(sell.nonZeros());
+            auto const row_indices = static_cast<size_t>(sell.row_indices.size());
+            auto const chunk_info = static_cast<size_t>(2 * sell.num_chunks());
+            return nnz * sizeof(scalar_t) + (nnz + row_indices + chunk_info) * sizeof(index_t);
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::StencilMatrix<scalar_t> const& stencil) const {
+            using Term = typename num::StencilMatrix<scalar_t>::Term;
+            using index_t = typename num::StencilMatrix<scalar_t>::StorageIndex;
+            return stencil.terms.size() * sizeof(Term)
+                   + stencil.term_starts.size() * sizeof(index_t);
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::BsrMatrix<scalar_t> const& bsr) const {
+            using index_t = typename num::BsrMatrix<scalar_t>::StorageIndex;
+            auto const nnz = static_cast<size_t>(bsr.nonZeros());
+            auto const blocks = static_cast<size_t>(bsr.num_blocks());
+            auto const row_starts = bsr.block_indptr.size();
+            return nnz * sizeof(scalar_t) + (blocks + row_starts) * sizeof(index_t);
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::HermitianMatrix<scalar_t> const& hermitian) const {
+            using index_t = typename num::HermitianMatrix<scalar_t>::StorageIndex;
+            auto const nnz = static_cast<size_t>(hermitian.nonZeros());
+            auto const row_info = hermitian.indptr.size() + hermitian.reach.size();
+            return nnz * sizeof(scalar_t) + (nnz + row_info) * sizeof(index_t);
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::TableEllMatrix<scalar_t> const& table_ell) const {
+            using index_t = typename num::TableEllMatrix<scalar_t>::StorageIndex;
+            auto const slots = static_cast<size_t>(table_ell.rows() * table_ell.nnz_per_row);
+            auto const table = static_cast<size_t>(table_ell.table.size());
+            return slots * (sizeof(std::uint8_t) + sizeof(index_t)) + table * sizeof(scalar_t)
+                   + (*this)(table_ell.escaped);
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::DeltaEllMatrix<scalar_t> const& delta_ell) const {
+            auto const slots = static_cast<size_t>(delta_ell.rows() * delta_ell.nnz_per_row);
+            return slots * (sizeof(scalar_t) + sizeof(std::int16_t))
+                   + (*this)(delta_ell.escaped);
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::HybMatrix<scalar_t> const& hyb) const {
+            return (*this)(hyb.ell) + (*this)(hyb.overflow);
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::SplitEllMatrix<scalar_t> const& split) const {
+            using index_t = typename num::SplitEllMatrix<scalar_t>::StorageIndex;
+            auto const nnz = static_cast<size_t>(split.nonZeros());
+            return nnz * sizeof(scalar_t) + nnz * sizeof(index_t);
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::QuantizedEllMatrix<scalar_t> const& quantized) const {
+            using index_t = typename num::QuantizedEllMatrix<scalar_t>::StorageIndex;
+            auto const nnz = static_cast<size_t>(quantized.nonZeros());
+            return nnz * static_cast<size_t>(quantized.value_bytes()) + nnz * sizeof(index_t);
+        }
+
+        /// Not allocated but read from the file (or the page cache) for each pass
+        template<class scalar_t>
+        size_t operator()(num::MappedCsrMatrix<scalar_t> const& mapped) const {
+            return mapped.stream_bytes();
+        }
+    };
+
+    /// Return the name of the matrix format, as in `MatrixFormat`
+    struct FormatName {
+        template<class scalar_t>
+        char const* operator()(SparseMatrixX<scalar_t> const&) const { return "CSR"; }
+        template<class scalar_t>
+        char const* operator()(num::EllMatrix<scalar_t> const&) const { return "ELL"; }
+        template<class scalar_t>
+        char const* operator()(num::SellMatrix<scalar_t> const&) const { return "SELL"; }
+        template<class scalar_t>
+        char const* operator()(num::StencilMatrix<scalar_t> const&) const { return "STENCIL"; }
+        template<class scalar_t>
+        char const* operator()(num::BsrMatrix<scalar_t> const&) const { return "BSR"; }
+        template<class scalar_t>
+        char const* operator()(num::HermitianMatrix<scalar_t> const&) const {
+            return "HERMITIAN";
+        }
+        template<class scalar_t>
+        char const* operator()(num::TableEllMatrix<scalar_t> const&) const {
+            return "ELL_TABLE";
+        }
+        template<class scalar_t>
+        char const* operator()(num::DeltaEllMatrix<scalar_t> const&) const {
+            return "ELL_DELTA";
+        }
+        template<class scalar_t>
+        char const* operator()(num::HybMatrix<scalar_t> const&) const { return "HYB"; }
+        template<class scalar_t>
+        char const* operator()(num::SplitEllMatrix<scalar_t> const&) const {
+            return "ELL_SPLIT";
+        }
+        template<class scalar_t>
+        char const* operator()(num::QuantizedEllMatrix<scalar_t> const& quantized) const {
+            return quantized.precision == num::ValuePrecision::BF16 ? "ELL_BF16" : "ELL_INT8";
+        }
+        template<class scalar_t>
+        char const* operator()(num::MappedCsrMatrix<scalar_t> const&) const {
+            return "MAPPED";
+        }
     };
 
     struct VectorMemory {
         template<class scalar_t>
-        size_t operator()(SparseMatrixRC<scalar_t> const&) const { return sizeof(scalar_t); }
+        size_t operator()(var::tag<scalar_t>) const { return sizeof(scalar_t); }
     };
 }
 
@@ -235,8 +981,20 @@ size_t OptimizedHamiltonian::matrix_memory() const {
     return var::apply_visitor(MatrixMemory{}, optimized_matrix);
 }
 
+char const* OptimizedHamiltonian::format_name() const {
+    return var::apply_visitor(FormatName{}, optimized_matrix);
+}
+
+double OptimizedHamiltonian::padding() const {
+    if (is_mapped) { return 1; }
+    auto const nnz = original_h.non_zeros();
+    if (nnz == 0) { return 1; }
+    auto const stored = var::apply_visitor(NonZeros{size()}, optimized_matrix);
+    return static_cast<double>(stored) / static_cast<double>(nnz);
+}
+
 size_t OptimizedHamiltonian::vector_memory() const {
-    return size() * original_h.get_variant().match(VectorMemory{});
+    return size() * tag.match(VectorMemory{});
 }
 
 }} // namespace cpb::kpm
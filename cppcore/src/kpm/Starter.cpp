@@ -2,10 +2,20 @@
 
 #include "numeric/random.hpp"
 
+#include <cmath>
+
 namespace cpb { namespace kpm {
 
 namespace {
 
+/// Per-thread scratch space which keeps its memory between calls of the same size
+template<class T>
+T& scratch(idx_t size) {
+    thread_local T buffer;
+    buffer.resize(size);
+    return buffer;
+}
+
 struct ConstantStarter {
     OptimizedHamiltonian const& oh;
     VectorXcd const& alpha;
@@ -13,7 +23,9 @@ struct ConstantStarter {
     ConstantStarter(OptimizedHamiltonian const& oh, VectorXcd const& alpha)
         : oh(oh), alpha(alpha) {}
 
-    var::complex<VectorX> operator()(var::scalar_tag tag) const { return tag.match(*this); }
+    var::complex<VectorX> operator()(var::scalar_tag tag, idx_t) const {
+        return tag.match(*this);
+    }
 
     template<class scalar_t>
     var::complex<VectorX> operator()(var::tag<scalar_t>) const {
@@ -23,45 +35,209 @@ struct ConstantStarter {
     }
 };
 
+struct ConstantColumnsStarter {
+    OptimizedHamiltonian const& oh;
+    MatrixXcd const& alpha;
+
+    ConstantColumnsStarter(OptimizedHamiltonian const& oh, MatrixXcd const& alpha)
+        : oh(oh), alpha(alpha) {}
+
+    var::complex<VectorX> operator()(var::scalar_tag tag, idx_t index) const {
+        return var::apply_visitor(Make{*this, index}, tag);
+    }
+
+    struct Make {
+        ConstantColumnsStarter const& s;
+        idx_t index;
+
+        template<class scalar_t>
+        var::complex<VectorX> operator()(var::tag<scalar_t>) const {
+            if (index >= s.alpha.cols()) {
+                return VectorX<scalar_t>::Zero(s.alpha.rows()).eval();
+            }
+            auto r0 = num::force_cast<scalar_t>(VectorXcd(s.alpha.col(index)));
+            s.oh.reorder(r0);
+            return r0;
+        }
+    };
+};
+
 struct UnitStarter {
     idx_t size;
     ArrayXi sources;
-    idx_t i = 0;
 
     UnitStarter(OptimizedHamiltonian const& oh) : size(oh.size()), sources(oh.idx().src) {}
+    UnitStarter(OptimizedHamiltonian const& oh, idx_t first, idx_t count)
+        : size(oh.size()), sources(oh.idx().src.segment(first, count)) {}
 
-    var::complex<VectorX> operator()(var::scalar_tag tag) {
-        return var::apply_visitor(*this, tag);
+    var::complex<VectorX> operator()(var::scalar_tag tag, idx_t index) const {
+        return var::apply_visitor(Make{*this, index}, tag);
     }
 
-    template<class scalar_t>
-    var::complex<VectorX> operator()(var::tag<scalar_t>) {
-        auto r0 = VectorX<scalar_t>::Zero(size).eval();
-        if (i < sources.size()) {
-            r0[sources[i]] = 1;
-            ++i;
+    struct Make {
+        UnitStarter const& s;
+        idx_t index;
+
+        template<class scalar_t>
+        var::complex<VectorX> operator()(var::tag<scalar_t>) const {
+            auto r0 = VectorX<scalar_t>(s.size);
+            Fill{s, index}(r0.data());
+            return r0;
         }
-        return r0;
+    };
+
+    /// In-place version of `Make`
+    void operator()(var::complex<StarterData> data, idx_t index) const {
+        var::apply_visitor(Fill{*this, index}, data);
     }
+
+    struct Fill {
+        UnitStarter const& s;
+        idx_t index;
+
+        template<class scalar_t>
+        void operator()(scalar_t* data) const {
+            auto r0 = Eigen::Map<VectorX<scalar_t>>(data, s.size);
+            r0.setZero();
+            if (index < s.sources.size()) {
+                r0[s.sources[index]] = 1;
+            }
+        }
+    };
 };
 
-struct RandomStarter {
+/// Plane waves `|k> = sum_i exp(i k.r_i)|i> / sqrt(N)` for each of the `k_points`. A real
+/// vector can't hold the phase so real scalars give two vectors per `k`, the cosine followed
+/// by the sine part: for a real (symmetric) Hamiltonian, their moments add up to those of `|k>`.
+struct PlaneWaveStarter {
     OptimizedHamiltonian const& oh;
-    VariantCSR op;
-    std::mt19937 generator;
+    CartesianArray const& positions;
+    std::vector<Cartesian> const& k_points;
 
-    RandomStarter(OptimizedHamiltonian const& oh, VariantCSR const& op) : oh(oh), op(op) {}
+    var::complex<VectorX> operator()(var::scalar_tag tag, idx_t index) const {
+        return var::apply_visitor(Make{*this, index}, tag);
+    }
+
+    struct Make {
+        PlaneWaveStarter const& s;
+        idx_t index;
 
-    var::complex<VectorX> operator()(var::scalar_tag tag) {
-        return var::apply_visitor(*this, tag);
+        template<class scalar_t>
+        var::complex<VectorX> operator()(var::tag<scalar_t>) const {
+            auto r0 = VectorX<scalar_t>(s.oh.size());
+            Fill{s, index}(r0.data());
+            return r0;
+        }
+    };
+
+    /// In-place version of `Make`
+    void operator()(var::complex<StarterData> data, idx_t index) const {
+        var::apply_visitor(Fill{*this, index}, data);
+    }
+
+    struct Fill {
+        PlaneWaveStarter const& s;
+        idx_t index;
+
+        template<class real_t>
+        void operator()(real_t* data) const {
+            auto const is_cos = index % 2 == 0;
+            fill(data, index / 2, [is_cos](double phase) {
+                return static_cast<real_t>(is_cos ? std::cos(phase) : std::sin(phase));
+            });
+        }
+
+        template<class real_t>
+        void operator()(std::complex<real_t>* data) const {
+            fill(data, index, [](double phase) {
+                return std::complex<real_t>(static_cast<real_t>(std::cos(phase)),
+                                            static_cast<real_t>(std::sin(phase)));
+            });
+        }
+
+        /// Vector `k` (zero beyond the last one) with the elements `value(phase) / sqrt(N)`
+        template<class scalar_t, class Value>
+        void fill(scalar_t* data, idx_t k, Value value) const {
+            auto r0 = Eigen::Map<VectorX<scalar_t>>(data, s.oh.size());
+            r0.setZero();
+            if (k >= static_cast<idx_t>(s.k_points.size())) { return; }
+
+            auto const q = Eigen::Vector3d(s.k_points[k].cast<double>());
+            auto const& p = s.positions;
+            auto const norm = static_cast<num::get_real_t<scalar_t>>(
+                1 / std::sqrt(static_cast<double>(p.size()))
+            );
+            for (auto i = idx_t{0}; i < p.size(); ++i) {
+                auto const phase = q[0] * p.x[i] + q[1] * p.y[i] + q[2] * p.z[i];
+                r0[s.oh.reordered_index(i)] = value(phase) * norm;
+            }
+        }
+    };
+};
+
+/// Each vector is the sum of the unit vectors of the sources of one probe
+struct ProbingStarter {
+    idx_t size;
+    std::vector<std::vector<storage_idx_t>> probes; ///< reordered indices
+
+    ProbingStarter(OptimizedHamiltonian const& oh, std::vector<std::vector<idx_t>> const& p)
+        : size(oh.size()) {
+        probes.reserve(p.size());
+        for (auto const& sources : p) {
+            probes.emplace_back();
+            probes.back().reserve(sources.size());
+            for (auto const i : sources) {
+                probes.back().push_back(static_cast<storage_idx_t>(oh.reordered_index(i)));
+            }
+        }
     }
 
+    var::complex<VectorX> operator()(var::scalar_tag tag, idx_t index) const {
+        return var::apply_visitor(Make{*this, index}, tag);
+    }
+
+    struct Make {
+        ProbingStarter const& s;
+        idx_t index;
+
+        template<class scalar_t>
+        var::complex<VectorX> operator()(var::tag<scalar_t>) const {
+            auto r0 = VectorX<scalar_t>(s.size);
+            Fill{s, index}(r0.data());
+            return r0;
+        }
+    };
+
+    /// In-place version of `Make`
+    void operator()(var::complex<StarterData> data, idx_t index) const {
+        var::apply_visitor(Fill{*this, index}, data);
+    }
+
+    struct Fill {
+        ProbingStarter const& s;
+        idx_t index;
+
+        template<class scalar_t>
+        void operator()(scalar_t* data) const {
+            auto r0 = Eigen::Map<VectorX<scalar_t>>(data, s.size);
+            r0.setZero();
+            if (index < static_cast<idx_t>(s.probes.size())) {
+                for (auto const i : s.probes[index]) { r0[i] = 1; }
+            }
+        }
+    };
+};
+
+/// Real random vectors have elements -1 or 1 and complex ones have a random phase
+struct RandomVector {
+    OptimizedHamiltonian const& oh;
+    VariantCSR const& op;
+
     template<class real_t>
-    var::complex<VectorX> operator()(var::tag<real_t>) {
-        auto r0 = transform<VectorX>(
-            num::make_random<VectorX<real_t>>(oh.size(), generator),
-            [](real_t x) -> real_t { return (x < 0.5f) ? -1.f : 1.f; }
-        );
+    VectorX<real_t> operator()(ArrayX<real_t> const& uniform, var::tag<real_t>) const {
+        auto r0 = transform<VectorX>(uniform, [](real_t x) -> real_t {
+            return (x < 0.5f) ? -1.f : 1.f;
+        });
 
         if (op) { r0 = op.get<real_t>() * r0; }
 
@@ -70,8 +246,8 @@ struct RandomStarter {
     }
 
     template<class real_t>
-    var::complex<VectorX> operator()(var::tag<std::complex<real_t>>) {
-        auto const phase = num::make_random<ArrayX<real_t>>(oh.size(), generator);
+    VectorX<std::complex<real_t>> operator()(ArrayX<real_t> const& phase,
+                                             var::tag<std::complex<real_t>>) const {
         auto const k = std::complex<real_t>{2 * constant::pi * constant::i1};
         auto r0 = exp(k * phase).matrix().eval();
 
@@ -80,6 +256,107 @@ struct RandomStarter {
         oh.reorder(r0);
         return r0;
     }
+
+    /// The same as above (without `op`), but the reordered vector is written into `data`
+    template<class scalar_t>
+    void fill(ArrayX<num::get_real_t<scalar_t>> const& uniform, scalar_t* data) const {
+        assert(!op);
+        auto& r0 = scratch<VectorX<scalar_t>>(uniform.size());
+        values(uniform, r0);
+        for (auto i = idx_t{0}; i < r0.size(); ++i) {
+            data[oh.reordered_index(i)] = r0[i];
+        }
+    }
+
+    template<class real_t>
+    static void values(ArrayX<real_t> const& uniform, VectorX<real_t>& r0) {
+        r0 = uniform.unaryExpr([](real_t x) -> real_t { return (x < 0.5f) ? -1.f : 1.f; });
+    }
+
+    template<class real_t>
+    static void values(ArrayX<real_t> const& phase, VectorX<std::complex<real_t>>& r0) {
+        auto const k = std::complex<real_t>{2 * constant::pi * constant::i1};
+        r0 = exp(k * phase).matrix();
+    }
+};
+
+/// Sequential Mersenne Twister: the vectors must be made in increasing order of `index`
+struct RandomStarter {
+    OptimizedHamiltonian const& oh;
+    VariantCSR op;
+    std::mt19937 generator;
+    idx_t next_index = 0;
+
+    RandomStarter(OptimizedHamiltonian const& oh, VariantCSR const& op) : oh(oh), op(op) {}
+
+    var::complex<VectorX> operator()(var::scalar_tag tag, idx_t index) {
+        if (index < next_index) { // start over
+            generator = std::mt19937();
+            next_index = 0;
+        }
+        for (; next_index < index; ++next_index) { // skip ahead, e.g. other MPI processes
+            var::apply_visitor(Make{*this}, tag);
+        }
+        ++next_index;
+        return var::apply_visitor(Make{*this}, tag);
+    }
+
+    struct Make {
+        RandomStarter& s;
+
+        template<class scalar_t>
+        var::complex<VectorX> operator()(var::tag<scalar_t> tag) const {
+            using real_t = num::get_real_t<scalar_t>;
+            auto const uniform = num::make_random<ArrayX<real_t>>(s.oh.size(), s.generator);
+            return RandomVector{s.oh, s.op}(uniform, tag);
+        }
+    };
+};
+
+/// Counter-based Philox generator: the vector elements only depend on `index`
+struct CounterRandomStarter {
+    OptimizedHamiltonian const& oh;
+    VariantCSR op;
+    num::Philox generator;
+
+    CounterRandomStarter(OptimizedHamiltonian const& oh, VariantCSR const& op)
+        : oh(oh), op(op) {}
+
+    var::complex<VectorX> operator()(var::scalar_tag tag, idx_t index) const {
+        return var::apply_visitor(Make{*this, index}, tag);
+    }
+
+    struct Make {
+        CounterRandomStarter const& s;
+        idx_t index;
+
+        template<class scalar_t>
+        var::complex<VectorX> operator()(var::tag<scalar_t> tag) const {
+            using real_t = num::get_real_t<scalar_t>;
+            auto const uniform = num::make_random<ArrayX<real_t>>(
+                s.oh.size(), s.generator, static_cast<std::uint64_t>(index)
+            );
+            return RandomVector{s.oh, s.op}(uniform, tag);
+        }
+    };
+
+    /// In-place version of `Make` (only without `op`)
+    void operator()(var::complex<StarterData> data, idx_t index) const {
+        var::apply_visitor(Fill{*this, index}, data);
+    }
+
+    struct Fill {
+        CounterRandomStarter const& s;
+        idx_t index;
+
+        template<class scalar_t>
+        void operator()(scalar_t* data) const {
+            using real_t = num::get_real_t<scalar_t>;
+            auto& uniform = scratch<ArrayX<real_t>>(s.oh.size());
+            num::random_fill(uniform, s.generator, static_cast<std::uint64_t>(index));
+            RandomVector{s.oh, s.op}.fill(uniform, data);
+        }
+    };
 };
 
 } // anonymous namespace
@@ -88,12 +365,45 @@ Starter constant_starter(OptimizedHamiltonian const& oh, VectorXcd const& alpha)
     return {ConstantStarter(oh, alpha), oh.size()};
 }
 
+Starter constant_starter(OptimizedHamiltonian const& oh, MatrixXcd const& alpha) {
+    // Each column is only read, so the pool workers can make their vectors concurrently
+    return {ConstantColumnsStarter(oh, alpha), oh.size(), /*is_concurrent*/true};
+}
+
 Starter unit_starter(OptimizedHamiltonian const& oh) {
-    return {UnitStarter(oh), oh.size()};
+    auto const unit = UnitStarter(oh);
+    auto starter = Starter(unit, oh.size(), /*is_concurrent*/true, unit);
+    starter.unit_sources = unit.sources;
+    return starter;
 }
 
-Starter random_starter(OptimizedHamiltonian const& oh, VariantCSR const& op) {
-    return {RandomStarter(oh, op), oh.size()};
+Starter unit_starter(OptimizedHamiltonian const& oh, idx_t first, idx_t count) {
+    auto const unit = UnitStarter(oh, first, count);
+    auto starter = Starter(unit, oh.size(), /*is_concurrent*/true, unit);
+    starter.unit_sources = unit.sources;
+    return starter;
+}
+
+Starter probing_starter(OptimizedHamiltonian const& oh,
+                        std::vector<std::vector<idx_t>> const& probes) {
+    auto const probing = ProbingStarter(oh, probes);
+    return {probing, oh.size(), /*is_concurrent*/true, probing};
+}
+
+Starter plane_wave_starter(OptimizedHamiltonian const& oh, CartesianArray const& positions,
+                           std::vector<Cartesian> const& k_points) {
+    auto const plane_wave = PlaneWaveStarter{oh, positions, k_points};
+    return {plane_wave, oh.size(), /*is_concurrent*/true, plane_wave};
+}
+
+Starter random_starter(OptimizedHamiltonian const& oh, VariantCSR const& op, bool counter_based) {
+    if (counter_based) {
+        auto const random = CounterRandomStarter(oh, op);
+        auto fill = op ? Starter::Fill{} : Starter::Fill{random};
+        return {random, oh.size(), /*is_concurrent*/true, std::move(fill)};
+    } else {
+        return {RandomStarter(oh, op), oh.size(), /*is_concurrent*/false};
+    }
 }
 
 }} // namespace cpb::kpm
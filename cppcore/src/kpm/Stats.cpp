@@ -3,6 +3,8 @@
 #include "kpm/Config.hpp"
 #include "kpm/OptimizedHamiltonian.hpp"
 
+#include <numeric>
+
 namespace cpb { namespace kpm {
 
 namespace {
@@ -18,6 +20,12 @@ namespace {
     }
 
     std::string moments_report(Stats const& s, bool shortform) {
+        if (s.from_cache) {
+            auto const fmt_str = shortform ? "{} cached" : "KPM reused {} cached moments";
+            auto const msg = fmt::format(fmt_str, fmt::with_suffix(s.num_moments));
+            return format_report(msg, s.moments_timer, shortform);
+        }
+
         auto const fmt_str = shortform ? "{} @ {}eps"
                                        : "KPM calculated {} moments "
                                          "at {} non-zero elements per second";
@@ -26,6 +34,51 @@ namespace {
                                      fmt::with_suffix(s.eps()));
         return format_report(msg, s.moments_timer, shortform);
     }
+
+    std::string milliseconds(double seconds) { return fmt::format("{:.1f}ms", 1e3 * seconds); }
+
+    /// Only in the long form: the sizes of the main buffers without a time column
+    std::string memory_report(Stats const& s) {
+        auto const bytes = [](size_t n) { return fmt::with_suffix(static_cast<double>(n)); };
+        auto const msg = fmt::format(
+            "Memory: matrix {}B (original {}B), {}B per vector, moments {}B, peak +{}B",
+            bytes(s.matrix_memory), bytes(s.hamiltonian_memory), bytes(s.vector_memory),
+            bytes(s.moments_memory), bytes(s.peak_memory)
+        );
+        return fmt::format("- {:<80s} |\n", msg);
+    }
+
+    /// Only in the long form: the per-phase breakdown, memory traffic and thread balance
+    std::string profile_report(Stats const& s) {
+        if (s.from_cache) { return {}; }
+
+        auto const& p = s.profile;
+        auto const phases = fmt::format(
+            "Phase times: reorder {}, format {}, starter {}, SpMV {}, collect {}",
+            s.reorder_timer, s.convert_timer, milliseconds(p.starter_time),
+            milliseconds(p.spmv_time), milliseconds(p.collect_time)
+        );
+        auto const traffic = fmt::format(
+            "Memory traffic of {}B per iteration ({} matrix, padding {:.2f}) at {}B/s, "
+            "thread balance {:.0f}% over {} threads", fmt::with_suffix(s.bytes_per_iteration()),
+            s.matrix_format, s.padding, fmt::with_suffix(s.bandwidth()), 100 * s.thread_balance(),
+            p.thread_busy_time.size()
+        );
+        auto const stochastic = s.num_random > 0 ? format_report(
+            fmt::format("Stochastic error {:.2g}% with {} random vectors",
+                        100 * s.stochastic_error, s.num_random), s.moments_timer, false
+        ) : std::string();
+        auto const total_moments = static_cast<double>(s.num_moments) * s.multiplier;
+        auto const converged = s.skipped_moments > 0 ? format_report(
+            fmt::format("Converged early: skipped {} moments ({:.0f}% of the iterations)",
+                        s.skipped_moments, 100 * s.skipped_moments / total_moments),
+            s.moments_timer, false
+        ) : std::string();
+        return format_report(phases, s.hamiltonian_timer, false)
+               + format_report(traffic, s.moments_timer, false) + stochastic + converged
+               + format_report("Reconstructed the results from the moments",
+                               s.reconstruct_timer, false);
+    }
 }
 
 void Stats::reset(idx_t num_moments, OptimizedHamiltonian const& oh,
@@ -38,12 +91,52 @@ void Stats::reset(idx_t num_moments, OptimizedHamiltonian const& oh,
     vec = oh.num_vec_elements(num_moments, /*optimal_size*/false);
     opt_vec = oh.num_vec_elements(num_moments, ac.optimal_size);
     this->multiplier = static_cast<double>(multiplier);
+    from_cache = false;
+    num_random = 0;
+    stochastic_error = 0;
+    skipped_moments = 0;
 
+    matrix_format = oh.format_name();
+    padding = oh.padding();
     matrix_memory = oh.matrix_memory();
     vector_memory = oh.vector_memory();
+    hamiltonian_memory = oh.original_memory();
+    moments_memory = 0;
 
     hamiltonian_timer = oh.timer;
+    reorder_timer = oh.reorder_timer;
+    convert_timer = oh.convert_timer;
     moments_timer = {};
+    reconstruct_timer = {};
+    profile = {};
+}
+
+void Stats::reset_lanczos(idx_t num_steps, idx_t nnz, idx_t size, size_t scalar_size) {
+    num_moments = num_steps;
+    uses_full_system = true;
+
+    this->nnz = opt_nnz = static_cast<size_t>(nnz * num_steps);
+    vec = opt_vec = static_cast<size_t>(size * num_steps);
+    multiplier = 1;
+    from_cache = false;
+    num_random = 0;
+    stochastic_error = 0;
+    skipped_moments = 0;
+
+    matrix_format = "CSR";
+    padding = 1;
+    matrix_memory = static_cast<size_t>(nnz) * (scalar_size + sizeof(storage_idx_t))
+                    + static_cast<size_t>(size + 1) * sizeof(storage_idx_t);
+    vector_memory = static_cast<size_t>(size) * scalar_size;
+    hamiltonian_memory = matrix_memory; // the same matrix
+    moments_memory = 0;
+
+    hamiltonian_timer = {};
+    reorder_timer = {};
+    convert_timer = {};
+    moments_timer = {};
+    reconstruct_timer = {};
+    profile = {};
 }
 
 double Stats::eps() const {
@@ -64,8 +157,32 @@ double Stats::ops(bool is_diagonal, bool non_unit_vector) const {
     return multiplier * static_cast<double>(operations) / moments_timer.elapsed_seconds();
 }
 
+double Stats::bytes_per_iteration() const {
+    auto ratio = [](size_t opt, size_t full) {
+        return full != 0 ? static_cast<double>(opt) / static_cast<double>(full) : 1.0;
+    };
+    return static_cast<double>(matrix_memory) * ratio(opt_nnz, nnz)
+           + 3.0 * static_cast<double>(vector_memory) * ratio(opt_vec, vec);
+}
+
+double Stats::bandwidth() const {
+    auto const num_iterations = multiplier * static_cast<double>(num_moments);
+    return num_iterations * bytes_per_iteration() / moments_timer.elapsed_seconds();
+}
+
+double Stats::thread_balance() const {
+    auto const& busy = profile.thread_busy_time;
+    if (busy.empty()) { return 1; }
+
+    auto const max = *std::max_element(busy.begin(), busy.end());
+    auto const mean = std::accumulate(busy.begin(), busy.end(), 0.0)
+                      / static_cast<double>(busy.size());
+    return max > 0 ? mean / max : 1;
+}
+
 std::string Stats::report(bool shortform) const {
-    return hamiltonian_report(*this, shortform) + moments_report(*this, shortform);
+    return hamiltonian_report(*this, shortform) + moments_report(*this, shortform)
+           + (shortform ? "" : profile_report(*this) + memory_report(*this));
 }
 
 }} // namespace cpb::kpm
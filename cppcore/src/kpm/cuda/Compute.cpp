@@ -0,0 +1,109 @@
+#include "kpm/cuda/Compute.hpp"
+
+#include "cuda/kpm/calc_moments.hpp"
+
+namespace cpb { namespace kpm {
+
+namespace {
+
+template<class scalar_t>
+struct CudaAlgorithm {
+    num::EllMatrix<scalar_t> const& h2;
+    Starter const& starter;
+    AlgorithmConfig const& config;
+    OptimizedHamiltonian const& oh;
+    CudaCompute const& compute;
+
+    /// Moments of the next vector produced by the starter
+    ArrayX<scalar_t> diagonal(idx_t num_moments) const {
+        auto const r0 = make_r0(starter, var::tag<VectorX<scalar_t>>{}, 1);
+        auto const r1 = make_r1(h2, r0);
+
+        // The GPU only needs the optimal size of each iteration, not the full slice map
+        auto sizes = std::vector<int>();
+        if (config.optimal_size) {
+            for (auto n = idx_t{2}; n <= num_moments / 2; ++n) {
+                sizes.push_back(static_cast<int>(oh.map().optimal_size(n, num_moments)));
+            }
+        }
+
+        auto const moments = cuda::I<scalar_t>::calc_diag_moments(
+            num::ellref(h2),
+            thr::host_vector<scalar_t>(r0.data(), r0.data() + r0.size()),
+            thr::host_vector<scalar_t>(r1.data(), r1.data() + r1.size()),
+            static_cast<int>(num_moments), sizes
+        );
+        return Eigen::Map<ArrayX<scalar_t> const>(moments.data(), moments.size());
+    }
+
+    void operator()(DiagonalMoments* m) {
+        if (m->checkpoint) { throw_checkpoint(); }
+        m->data = diagonal(m->num_moments);
+    }
+
+    void operator()(BatchDiagonalMoments* m) {
+        if (m->checkpoint) { throw_checkpoint(); }
+        compute.progress_start(m->num_vectors);
+        for (auto i = idx_t{0}; i < m->num_vectors; ++i) {
+            m->add(diagonal(m->num_moments), i);
+            compute.progress_update(1, m->num_vectors);
+        }
+        compute.progress_finish(m->num_vectors);
+    }
+
+    template<class M>
+    void operator()(M*) {
+        throw std::runtime_error("CUDA KPM: this calculation is not supported on the GPU. "
+                                 "Use the default CPU implementation instead.");
+    }
+
+    /// The recursion vectors stay on the GPU
+    [[noreturn]] static void throw_checkpoint() {
+        throw std::runtime_error("CUDA KPM: checkpoints are not supported on the GPU. "
+                                 "Use the default CPU implementation instead.");
+    }
+};
+
+struct SelectMatrix {
+    MomentsRef m;
+    Starter const& s;
+    AlgorithmConfig const& ac;
+    OptimizedHamiltonian const& oh;
+    CudaCompute const& compute;
+
+    template<class scalar_t>
+    void operator()(num::EllMatrix<scalar_t> const& h2) {
+        var::apply_visitor(CudaAlgorithm<scalar_t>{h2, s, ac, oh, compute}, m);
+    }
+
+    template<class Matrix>
+    void operator()(Matrix const&) {
+        throw std::runtime_error("CUDA KPM: only the ELL matrix format is supported.");
+    }
+};
+
+} // anonymous namespace
+
+CudaCompute::CudaCompute(idx_t num_threads, ProgressCallback progress_callback)
+    : num_threads(num_threads),
+      progress_callback(progress_callback) {}
+
+void CudaCompute::moments(MomentsRef m, Starter const& s, AlgorithmConfig const& ac,
+                          OptimizedHamiltonian const& oh) const {
+    var::apply_visitor(SelectMatrix{std::move(m), s, ac, oh, *this}, oh.matrix());
+}
+
+void CudaCompute::progress_start(idx_t total) const {
+    progress_update(-1, total);
+}
+
+void CudaCompute::progress_update(idx_t delta, idx_t total) const {
+    if (!progress_callback) { return; }
+    progress_callback(delta, total);
+}
+
+void CudaCompute::progress_finish(idx_t total) const {
+    progress_update(total, total);
+}
+
+}} // namespace cpb::kpm
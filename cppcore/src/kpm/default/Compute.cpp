@@ -1,146 +1,215 @@
 #include "kpm/default/Compute.hpp"
-#include "kpm/default/collectors.hpp"
+#include "kpm/default/dispatch.hpp"
+#include "utils/Metrics.hpp"
 
-#include "compute/kernel_polynomial.hpp"
-#include "kpm/calc_moments.hpp"
-
-#include "detail/thread.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 namespace cpb { namespace kpm {
 
-namespace {
-
-template<class Matrix>
-struct SelectAlgorithm {
-    using scalar_t = typename Matrix::Scalar;
-
-    Matrix const& h2;
-    Starter const& starter;
-    AlgorithmConfig const& config;
-    OptimizedHamiltonian const& oh;
-    DefaultCompute const& compute;
-
-    template<template<class> class C, class Vector = typename C<scalar_t>::Vector>
-    idx_t with(C<scalar_t>& collect) const {
-        simd::scope_disable_denormals guard;
-
-        starter.lock();
-        auto const idx = starter.count;
-        auto r0 = make_r0(starter, var::tag<Vector>{}, simd::traits<scalar_t>::size);
-        starter.unlock();
-
-        auto r1 = make_r1(h2, r0);
-        collect.initial(r0, r1);
-
-        if (config.interleaved) {
-            calc_moments::interleaved(collect, std::move(r0), std::move(r1),
-                                      h2, oh.map(), config.optimal_size);
-        } else {
-            calc_moments::basic(collect, std::move(r0), std::move(r1),
-                                h2, oh.map(), config.optimal_size);
-        }
-
-        return idx;
+namespace dispatch {
+
+// The builds of `kpm/default/kernels.cpp`, see `PB_CPU_DISPATCH` in CMakeLists.txt
+#ifdef CPB_CPU_DISPATCH
+namespace avx512 { extern Kernels const kernels; }
+namespace avx2 { extern Kernels const kernels; }
+namespace sse2 { extern Kernels const kernels; }
+#else
+namespace native { extern Kernels const kernels; }
+#endif
+
+std::vector<Kernels const*> supported() {
+    auto result = std::vector<Kernels const*>();
+#ifdef CPB_CPU_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        result.push_back(&avx512::kernels);
     }
-
-    void operator()(DiagonalMoments* m) {
-        auto collect = DiagonalCollector<scalar_t>(m->num_moments);
-        with<DiagonalCollector>(collect);
-        m->data = std::move(collect.moments);
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        result.push_back(&avx2::kernels);
     }
+    result.push_back(&sse2::kernels);
+#else
+    result.push_back(&native::kernels);
+#endif
+    return result;
+}
 
-    void operator()(BatchDiagonalMoments* m) {
-        constexpr auto batch_size = static_cast<idx_t>(simd::traits<scalar_t>::size);
-        auto const num_threads = compute.get_num_threads();
-
-        auto num_batches = m->num_vectors / batch_size;
-        auto num_singles = m->num_vectors % batch_size;
+Kernels const& best() {
+    static auto const kernels = supported().front();
+    return *kernels;
+}
 
-        // Heuristic: prefer SIMD execution when there's a low number of threads
-        if (num_singles > num_threads * batch_size / 2) {
-            num_batches += 1;
-            num_singles = 0;
-        }
+} // namespace dispatch
 
-        ThreadPool pool(num_threads);
-        compute.progress_start(m->num_vectors);
+struct DefaultCompute::Profiler {
+    std::mutex mutex;
+    ComputeProfile data;
+    std::vector<std::thread::id> threads; ///< the owners of `data.thread_busy_time`
+};
 
-        for (auto i = 0; i < num_batches; ++i) {
-            pool.add([&]() {
-                auto collect = BatchDiagonalCollector<scalar_t>(m->num_moments, batch_size);
-                auto const idx = with<BatchDiagonalCollector>(collect);
-                m->add(collect.moments, idx);
-                compute.progress_update(batch_size, m->num_vectors);
-            });
+struct DefaultCompute::ProgressCounter {
+    std::atomic<idx_t> done{0};
+    std::atomic<idx_t> total{0};
+    std::atomic<idx_t> active{0}; ///< number of running calculations
+
+    std::mutex mutex; ///< guards the reporter thread
+    std::condition_variable wake;
+    idx_t generation = 0; ///< the reporter stops when this is changed
+    std::thread reporter;
+
+    ~ProgressCounter() { stop(); }
+
+    /// Report the finished units every `interval` until the `generation` changes.
+    /// The callback is never called while holding the lock.
+    void report(ProgressCallback const& callback, idx_t self) {
+        auto reported = idx_t{0};
+        auto lock = std::unique_lock<std::mutex>(mutex);
+        while (!wake.wait_for(lock, progress_interval, [&]{ return generation != self; })) {
+            auto const n = done.load(std::memory_order_relaxed);
+            auto const t = total.load(std::memory_order_relaxed);
+            if (n == reported || n >= t) { continue; } // the end is reported by `finish()`
+
+            lock.unlock();
+            callback(n - reported, t);
+            reported = n;
+            lock.lock();
         }
+    }
 
-        for (auto i = 0; i < num_singles; ++i) {
-            pool.add([&]() {
-                auto collect = DiagonalCollector<scalar_t>(m->num_moments);
-                auto const idx = with<DiagonalCollector>(collect);
-                m->add(collect.moments, idx);
-                compute.progress_update(1, m->num_vectors);
-            });
+    void stop() {
+        auto thread = std::thread();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++generation;
+            thread = std::move(reporter);
         }
-
-        pool.join();
-        compute.progress_finish(m->num_vectors);
+        wake.notify_all();
+        if (thread.joinable()) { thread.join(); }
     }
+};
 
-    void operator()(GenericMoments* m) {
-        auto collect = GenericCollector<scalar_t>(m->num_moments, oh, m->alpha, m->beta, m->op);
-        with<OffDiagonalCollector>(collect);
-        m->data = std::move(collect.moments);
-    }
+constexpr std::chrono::milliseconds DefaultCompute::progress_interval;
 
-    void operator()(MultiUnitMoments* m) {
-        auto collect = MultiUnitCollector<scalar_t>(m->num_moments, m->idx);
-        with<OffDiagonalCollector>(collect);
-        m->data = std::move(collect.moments);
+DefaultCompute::DefaultCompute(idx_t num_threads, ProgressCallback progress_callback,
+                               std::vector<CpuList> affinity)
+    : num_threads(num_threads),
+      progress_callback(progress_callback), affinity(std::move(affinity)),
+      profiler(std::make_shared<Profiler>()), progress_counter(std::make_shared<ProgressCounter>()),
+      kernels(&dispatch::best()) {}
+
+void DefaultCompute::moments(MomentsRef m, Starter const& s, AlgorithmConfig const& ac,
+                             OptimizedHamiltonian const& oh) const {
+    {
+        std::lock_guard<std::mutex> lock(profiler->mutex);
+        profiler->data = {};
+        profiler->threads.clear();
     }
+    kernels->moments(std::move(m), s, ac, oh, *this);
+}
 
-    void operator()(DenseMatrixMoments* m) {
-        auto collect = DenseMatrixCollector<scalar_t>(m->num_moments, oh, m->op);
-        with<OffDiagonalCollector>(collect);
-        m->data = std::move(collect.moments);
+std::vector<BatchData> DefaultCompute::multi_moments(std::vector<VariantCSR> const& members,
+                                                     SliceMap const& map, Indices const& idx,
+                                                     idx_t num_moments,
+                                                     AlgorithmConfig const& ac) const {
+    {
+        std::lock_guard<std::mutex> lock(profiler->mutex);
+        profiler->data = {};
+        profiler->threads.clear();
     }
-};
+    return kernels->multi_moments(members, map, idx, num_moments, ac, *this);
+}
 
-struct SelectMatrix {
-    MomentsRef m;
-    Starter const& s;
-    AlgorithmConfig const& ac;
-    OptimizedHamiltonian const& oh;
-    DefaultCompute const& compute;
+char const* DefaultCompute::instruction_set() const {
+    return kernels->instruction_set;
+}
 
-    template<class Matrix>
-    void operator()(Matrix const& h2) {
-        var::apply_visitor(SelectAlgorithm<Matrix>{h2, s, ac, oh, compute}, m);
-    }
-};
+std::shared_ptr<SparseBackendBase const>
+DefaultCompute::sparse_backend(OptimizedHamiltonian const&) const {
+    return nullptr;
+}
 
-} // anonymous namespace
+ComputeProfile DefaultCompute::profile() const {
+    std::lock_guard<std::mutex> lock(profiler->mutex);
+    return profiler->data;
+}
 
-DefaultCompute::DefaultCompute(idx_t num_threads, ProgressCallback progress_callback)
-    : num_threads(num_threads > 0 ? num_threads : std::thread::hardware_concurrency()),
-      progress_callback(progress_callback) {}
+void DefaultCompute::profile_record(double starter_time, double spmv_time,
+                                    double collect_time, idx_t num_moments) const {
+    auto const ns = [](double seconds) {
+        return std::chrono::nanoseconds(static_cast<std::int64_t>(seconds * 1e9));
+    };
+    metrics::kpm_jobs.add(1);
+    metrics::kpm_moments.add(static_cast<std::uint64_t>(num_moments));
+    metrics::kpm_starter_time.add(ns(starter_time));
+    metrics::kpm_spmv_time.add(ns(spmv_time));
+    metrics::kpm_collect_time.add(ns(collect_time));
+
+    std::lock_guard<std::mutex> lock(profiler->mutex);
+    auto& data = profiler->data;
+    data.starter_time += starter_time;
+    data.spmv_time += spmv_time;
+    data.collect_time += collect_time;
+
+    auto& threads = profiler->threads;
+    auto const it = std::find(threads.begin(), threads.end(), std::this_thread::get_id());
+    auto const i = static_cast<size_t>(it - threads.begin());
+    if (it == threads.end()) {
+        threads.push_back(std::this_thread::get_id());
+        data.thread_busy_time.push_back(0);
+    }
+    data.thread_busy_time[i] += starter_time + spmv_time + collect_time;
+}
 
-void DefaultCompute::moments(MomentsRef m, Starter const& s, AlgorithmConfig const& ac,
-                             OptimizedHamiltonian const& oh) const {
-    var::apply_visitor(SelectMatrix{std::move(m), s, ac, oh, *this}, oh.matrix());
+ComputeProgress DefaultCompute::progress() const {
+    auto const& p = *progress_counter;
+    return {p.done.load(), p.total.load(), p.active.load() > 0};
 }
 
 void DefaultCompute::progress_start(idx_t total) const {
-    progress_update(-1, total);
+    auto& p = *progress_counter;
+    {
+        std::lock_guard<std::mutex> lock(p.mutex);
+        if (p.active == 0) {
+            p.done = 0;
+            p.total = 0;
+        }
+        p.total += total;
+        ++p.active;
+
+        if (progress_callback && !p.reporter.joinable()) {
+            auto const callback = progress_callback;
+            auto const self = p.generation;
+            auto const counter = &p; // outlives the thread: `stop()` joins it
+            p.reporter = std::thread([counter, callback, self]{ counter->report(callback, self); });
+        }
+    }
+
+    if (progress_callback) { progress_callback(-1, total); }
 }
 
-void DefaultCompute::progress_update(idx_t delta, idx_t total) const {
-    if (!progress_callback) { return; }
-    progress_callback(delta, total);
+void DefaultCompute::progress_update(idx_t delta, idx_t) const {
+    progress_counter->done.fetch_add(delta, std::memory_order_relaxed);
 }
 
 void DefaultCompute::progress_finish(idx_t total) const {
-    progress_update(total, total);
+    auto& p = *progress_counter;
+    auto thread = std::thread();
+    {
+        // A new calculation may start right after this: it gets a new reporter
+        std::lock_guard<std::mutex> lock(p.mutex);
+        if (--p.active == 0) {
+            ++p.generation;
+            thread = std::move(p.reporter);
+        }
+    }
+    p.wake.notify_all();
+    if (thread.joinable()) { thread.join(); }
+
+    if (progress_callback) { progress_callback(total, total); }
 }
 
 }} // namespace cpb::kpm
@@ -1,35 +1,58 @@
 #include "kpm/default/collectors.hpp"
 
+#include <algorithm>
+
 namespace cpb { namespace kpm {
+CPB_ISA_NAMESPACE_BEGIN
 
-template<class scalar_t>
-void DiagonalCollector<scalar_t>::initial(VectorRef r0, VectorRef r1) {
-    m0 = moments[0] = r0.squaredNorm() * scalar_t{0.5};
-    m1 = moments[1] = r1.dot(r0);
+template<class scalar_t, class moment_t>
+void DiagonalCollector<scalar_t, moment_t>::initial(VectorRef r0, VectorRef r1) {
+    auto const r0_cast = r0.template cast<moment_t>();
+    m0 = moments[0] = r0_cast.squaredNorm() * moment_t{0.5};
+    m1 = moments[1] = r1.template cast<moment_t>().dot(r0_cast);
 }
 
-template<class scalar_t>
-void DiagonalCollector<scalar_t>::operator()(idx_t n, scalar_t m2, scalar_t m3) {
-    moments[2 * (n - 1)] = scalar_t{2} * (m2 - m0);
-    moments[2 * (n - 1) + 1] = scalar_t{2} * m3 - m1;
+template<class scalar_t, class moment_t>
+void DiagonalCollector<scalar_t, moment_t>::operator()(idx_t n, moment_t m2, moment_t m3) {
+    if (convergence.is_converged()) { return; } // e.g. the second moment pair of `interleaved`
+    auto const a = moments[2 * (n - 1)] = moment_t{2} * (m2 - m0);
+    auto const b = moments[2 * (n - 1) + 1] = moment_t{2} * m3 - m1;
+
+    auto const mu0 = 2 * static_cast<double>(std::abs(m0));
+    auto const relative = mu0 > 0 ? static_cast<double>(std::max(std::abs(a), std::abs(b))) / mu0
+                                  : 0.0;
+    if (convergence.update(n, relative)) {
+        moments.tail(size() - convergence.size).setZero();
+    }
 }
 
-template<class scalar_t>
-void BatchDiagonalCollector<scalar_t>::initial(VectorRef r0, VectorRef r1) {
+template<class scalar_t, class moment_t>
+void BatchDiagonalCollector<scalar_t, moment_t>::initial(VectorRef r0, VectorRef r1) {
     auto const size = m0.size();
     for (auto i = size_t{0}; i < size; ++i) {
-        moments(0, i) = m0[i] = r0.col(i).squaredNorm() * scalar_t{0.5};
-        moments(1, i) = m1[i] = r1.col(i).dot(r0.col(i));
+        auto const r0_cast = r0.col(i).template cast<moment_t>();
+        moments(0, i) = m0[i] = r0_cast.squaredNorm() * moment_t{0.5};
+        moments(1, i) = m1[i] = r1.col(i).template cast<moment_t>().dot(r0_cast);
     }
 }
 
-template<class scalar_t>
-void BatchDiagonalCollector<scalar_t>::operator()(idx_t n, simd::array<scalar_t> m2,
-                                                  simd::array<scalar_t> m3) {
+template<class scalar_t, class moment_t>
+void BatchDiagonalCollector<scalar_t, moment_t>::operator()(idx_t n, Array m2, Array m3) {
+    if (convergence.is_converged()) { return; }
     auto const size = m0.size();
+    auto relative = 0.0; // the largest of all the columns: padding columns have `m0 == 0`
     for (auto i = size_t{0}; i < size; ++i) {
-        moments(2 * (n - 1), i) = scalar_t{2} * (m2[i] - m0[i]);
-        moments(2 * (n - 1) + 1, i) = scalar_t{2} * m3[i] - m1[i];
+        auto const a = moments(2 * (n - 1), i) = moment_t{2} * (m2[i] - m0[i]);
+        auto const b = moments(2 * (n - 1) + 1, i) = moment_t{2} * m3[i] - m1[i];
+
+        auto const mu0 = 2 * static_cast<double>(std::abs(m0[i]));
+        if (mu0 > 0) {
+            auto const m = static_cast<double>(std::max(std::abs(a), std::abs(b)));
+            relative = std::max(relative, m / mu0);
+        }
+    }
+    if (convergence.update(n, relative)) {
+        moments.bottomRows(moments.rows() - convergence.size).setZero();
     }
 }
 
@@ -37,24 +60,21 @@ template<class scalar_t>
 GenericCollector<scalar_t>::GenericCollector(idx_t num_moments, OptimizedHamiltonian const& oh,
                                              VectorXcd const& alpha_, VectorXcd const& beta_,
                                              SparseMatrixXcd const& op_) : moments(num_moments) {
-    beta = num::force_cast<scalar_t>(beta_.size() != 0 ? beta_ : alpha_);
+    auto const& b = beta_.size() != 0 ? beta_ : alpha_;
+    beta = num::force_cast<scalar_t>(op_.size() != 0 ? (op_.adjoint() * b).eval() : b);
     oh.reorder(beta);
-    if (op_.size() != 0){
-        op = num::force_cast<scalar_t>(op_);
-        oh.reorder(op);
-    }
 }
 
 template<class scalar_t>
 void GenericCollector<scalar_t>::initial(VectorRef r0, VectorRef r1) {
-    moments[0] = (op.size() != 0) ? beta.dot(op * r0) : beta.dot(r0);
-    moments[0] *= 0.5f;
-    moments[1] = (op.size() != 0) ? beta.dot(op * r1) : beta.dot(r1);
+    using real_t = num::get_real_t<scalar_t>;
+    moments[0] = beta.dot(r0) * real_t{0.5}; // 0.5 is special for the moment zero
+    moments[1] = beta.dot(r1);
 }
 
 template<class scalar_t>
 void GenericCollector<scalar_t>::operator()(idx_t n, VectorRef r1) {
-    moments[n] = (op.size() != 0) ? beta.dot(op * r1) : beta.dot(r1);
+    moments[n] = beta.dot(r1);
 }
 
 template<class scalar_t>
@@ -74,6 +94,122 @@ void MultiUnitCollector<scalar_t>::operator()(idx_t n, VectorRef r1) {
     }
 }
 
+template<class scalar_t>
+BatchGenericCollector<scalar_t>::BatchGenericCollector(
+    idx_t num_moments, OptimizedHamiltonian const& oh, MatrixXcd const& beta_,
+    SparseMatrixXcd const& op_, idx_t first, idx_t batch_size
+) : moments(num_moments, batch_size), beta(MatrixX<scalar_t>::Zero(oh.size(), batch_size)) {
+    auto const n = std::max(std::min(batch_size, beta_.cols() - first), idx_t{0});
+    for (auto j = idx_t{0}; j < n; ++j) {
+        auto const b_cd = (op_.size() != 0) ? VectorXcd(op_.adjoint() * beta_.col(first + j))
+                                            : VectorXcd(beta_.col(first + j));
+        auto b = num::force_cast<scalar_t>(b_cd);
+        oh.reorder(b);
+        beta.col(j) = b;
+    }
+}
+
+template<class scalar_t>
+void BatchGenericCollector<scalar_t>::initial(VectorRef r0, VectorRef r1) {
+    using real_t = num::get_real_t<scalar_t>;
+    store(0, r0, real_t{0.5}); // 0.5 is special for the moment zero
+    store(1, r1, real_t{1});
+}
+
+template<class scalar_t>
+void BatchGenericCollector<scalar_t>::operator()(idx_t n, VectorRef r1) {
+    using real_t = num::get_real_t<scalar_t>;
+    store(n, r1, real_t{1});
+}
+
+template<class scalar_t>
+template<class Vector>
+void BatchGenericCollector<scalar_t>::store(idx_t n, Vector const& v,
+                                            num::get_real_t<scalar_t> factor) {
+    // Column-wise `beta.dot(v)`: the conjugate of `beta` times `v`, summed over rows
+    moments.row(n) = (beta.conjugate().cwiseProduct(v)).colwise().sum().array() * factor;
+}
+
+template<class scalar_t>
+void BatchMultiUnitCollector<scalar_t>::initial(VectorRef r0, VectorRef r1) {
+    using real_t = num::get_real_t<scalar_t>;
+
+    for (auto i = 0; i < idx.dest.size(); ++i) {
+        moments[i].row(0) = r0.row(idx.dest[i]).array() * real_t{0.5}; // special moment zero
+        moments[i].row(1) = r1.row(idx.dest[i]).array();
+    }
+}
+
+template<class scalar_t>
+void BatchMultiUnitCollector<scalar_t>::operator()(idx_t n, VectorRef r1) {
+    for (auto i = 0; i < idx.dest.size(); ++i) {
+        moments[i].row(n) = r1.row(idx.dest[i]).array();
+    }
+}
+
+template<class scalar_t>
+void LocalCollector<scalar_t>::initial(VectorRef r0, VectorRef r1) {
+    using real_t = num::get_real_t<scalar_t>;
+
+    auto const size = static_cast<idx_t>(idx.size());
+    conj_r0.resize(size);
+    for (auto k = idx_t{0}; k < size; ++k) {
+        auto const c = columns.empty() ? k : idx_t{columns[k]};
+        conj_r0[k] = num::conjugate(r0[idx[k]]);
+        moments(0, c) += conj_r0[k] * r0[idx[k]] * real_t{0.5}; // special moment zero
+        moments(1, c) += conj_r0[k] * r1[idx[k]];
+    }
+}
+
+template<class scalar_t>
+void LocalCollector<scalar_t>::operator()(idx_t n, VectorRef r1) {
+    auto const size = static_cast<idx_t>(idx.size());
+    for (auto k = idx_t{0}; k < size; ++k) {
+        auto const c = columns.empty() ? k : idx_t{columns[k]};
+        moments(n, c) += conj_r0[k] * r1[idx[k]];
+    }
+}
+
+template<class scalar_t>
+void BatchLocalCollector<scalar_t>::initial(VectorRef r0, VectorRef r1) {
+    using real_t = num::get_real_t<scalar_t>;
+
+    auto const size = static_cast<idx_t>(idx.size());
+    conj_r0.resize(size, num_used);
+    for (auto k = idx_t{0}; k < size; ++k) {
+        auto const i = idx[k];
+        auto const c = columns.empty() ? k : idx_t{columns[k]};
+        conj_r0.row(k) = r0.row(i).leftCols(num_used).array().conjugate();
+        moments(0, c) += (conj_r0.row(k) * r0.row(i).leftCols(num_used).array()).sum()
+                         * real_t{0.5}; // special moment zero
+        moments(1, c) += (conj_r0.row(k) * r1.row(i).leftCols(num_used).array()).sum();
+    }
+}
+
+template<class scalar_t>
+void BatchLocalCollector<scalar_t>::operator()(idx_t n, VectorRef r1) {
+    auto const size = static_cast<idx_t>(idx.size());
+    for (auto k = idx_t{0}; k < size; ++k) {
+        auto const c = columns.empty() ? k : idx_t{columns[k]};
+        moments(n, c) += (conj_r0.row(k) * r1.row(idx[k]).leftCols(num_used).array()).sum();
+    }
+}
+
+template<class scalar_t>
+void ProjectionCollector<scalar_t>::initial(VectorRef r0, VectorRef r1) {
+    for (auto k = size_t{0}; k < states.size(); ++k) {
+        auto const c = coefficients.col(static_cast<idx_t>(k));
+        states[k] = c[0] * r0 + c[1] * r1;
+    }
+}
+
+template<class scalar_t>
+void ProjectionCollector<scalar_t>::operator()(idx_t n, VectorRef r1) {
+    for (auto k = size_t{0}; k < states.size(); ++k) {
+        states[k] += coefficients(n, static_cast<idx_t>(k)) * r1;
+    }
+}
+
 template<class scalar_t>
 DenseMatrixCollector<scalar_t>::DenseMatrixCollector(
     idx_t num_moments, OptimizedHamiltonian const& oh, VariantCSR const& op_
@@ -105,10 +241,123 @@ void DenseMatrixCollector<scalar_t>::operator()(idx_t n, VectorRef r1) {
     }
 }
 
+template<class scalar_t>
+DenseMatrixBlockCollector<scalar_t>::DenseMatrixBlockCollector(
+    idx_t num_moments, idx_t block_size, OptimizedHamiltonian const& oh, VariantCSR const& op_
+) : num_moments(num_moments), block(std::min(block_size, num_moments), oh.size()) {
+    if (op_) {
+        op = op_.template get<scalar_t>();
+        oh.reorder(op);
+    }
+}
+
+template<class scalar_t>
+void DenseMatrixBlockCollector<scalar_t>::initial(VectorRef r0, VectorRef r1) {
+    using real_t = num::get_real_t<scalar_t>;
+    store(0, r0 * real_t{0.5}); // 0.5 is special for the moment zero
+    store(1, r1);
+}
+
+template<class scalar_t>
+void DenseMatrixBlockCollector<scalar_t>::operator()(idx_t n, VectorRef r1) {
+    store(n, r1);
+}
+
+template<class scalar_t>
+template<class Vector>
+void DenseMatrixBlockCollector<scalar_t>::store(idx_t n, Vector const& v) {
+    auto const block_size = block.rows();
+    auto const i = n % block_size;
+    if (op.size() != 0) {
+        block.row(i) = op * v;
+    } else {
+        block.row(i) = v;
+    }
+
+    if (i == block_size - 1 || n == num_moments - 1) {
+        process(n - i, i + 1);
+    }
+}
+
+template<class scalar_t>
+void BatchDenseMatrixBlockCollector<scalar_t>::initial(VectorRef r0, VectorRef r1) {
+    using real_t = num::get_real_t<scalar_t>;
+    store(0, r0 * real_t{0.5}); // 0.5 is special for the moment zero
+    store(1, r1);
+}
+
+template<class scalar_t>
+void BatchDenseMatrixBlockCollector<scalar_t>::operator()(idx_t n, VectorRef r1) {
+    store(n, r1);
+}
+
+template<class scalar_t>
+template<class Vector>
+void BatchDenseMatrixBlockCollector<scalar_t>::store(idx_t n, Vector const& v) {
+    auto const block_size = blocks.front().rows();
+    auto const i = n % block_size;
+    for (auto j = size_t{0}; j < blocks.size(); ++j) {
+        blocks[j].row(i) = v.col(static_cast<idx_t>(j)).transpose();
+    }
+
+    if (i == block_size - 1 || n == num_moments - 1) {
+        process(n - i, i + 1);
+    }
+}
+
+template<class scalar_t>
+void ProductIdentityCollector<scalar_t>::initial(VectorRef r0, VectorRef r1) {
+    using real_t = num::get_real_t<scalar_t>;
+
+    for (auto i = size_t{0}; i < columns.size(); ++i) {
+        auto const c = columns[i];
+        m0[i] = r0.col(c).dot(r0.col(0));
+        m1[i] = r0.col(c).dot(r1.col(0));
+
+        moments[i][0] = m0[i] * real_t{0.5}; // 0.5 is special the moment zero
+        moments[i][1] = m1[i];
+        if (size() > 2) {
+            moments[i][2] = real_t{2} * r1.col(c).dot(r1.col(0)) - m0[i];
+        }
+    }
+}
+
+template<class scalar_t>
+void ProductIdentityCollector<scalar_t>::operator()(idx_t n, VectorRef r0, VectorRef r1,
+                                                    idx_t rows) {
+    using real_t = num::get_real_t<scalar_t>;
+
+    // All the `<l|...|r>` products at once: one element for each column of the batch
+    auto const r = r1.topRows(rows).col(0);
+    auto const odd = VectorX<scalar_t>(r0.topRows(rows).adjoint() * r);
+    auto const even = VectorX<scalar_t>(r1.topRows(rows).adjoint() * r);
+
+    for (auto i = size_t{0}; i < columns.size(); ++i) {
+        auto const c = columns[i];
+        moments[i][2 * n - 1] = real_t{2} * odd[c] - m1[i];
+        if (2 * n < size()) {
+            moments[i][2 * n] = real_t{2} * even[c] - m0[i];
+        }
+    }
+}
+
 CPB_INSTANTIATE_TEMPLATE_CLASS(DiagonalCollector)
 CPB_INSTANTIATE_TEMPLATE_CLASS(BatchDiagonalCollector)
+template class DiagonalCollector<float, double>;
+template class DiagonalCollector<std::complex<float>, std::complex<double>>;
+template class BatchDiagonalCollector<float, double>;
+template class BatchDiagonalCollector<std::complex<float>, std::complex<double>>;
 CPB_INSTANTIATE_TEMPLATE_CLASS(GenericCollector)
 CPB_INSTANTIATE_TEMPLATE_CLASS(MultiUnitCollector)
+CPB_INSTANTIATE_TEMPLATE_CLASS(BatchGenericCollector)
+CPB_INSTANTIATE_TEMPLATE_CLASS(BatchMultiUnitCollector)
+CPB_INSTANTIATE_TEMPLATE_CLASS(LocalCollector)
+CPB_INSTANTIATE_TEMPLATE_CLASS(BatchLocalCollector)
+CPB_INSTANTIATE_TEMPLATE_CLASS(ProjectionCollector)
 CPB_INSTANTIATE_TEMPLATE_CLASS(DenseMatrixCollector)
+CPB_INSTANTIATE_TEMPLATE_CLASS(DenseMatrixBlockCollector)
+CPB_INSTANTIATE_TEMPLATE_CLASS(BatchDenseMatrixBlockCollector)
+CPB_INSTANTIATE_TEMPLATE_CLASS(ProductIdentityCollector)
 
+CPB_ISA_NAMESPACE_END
 }} // namespace cpb::kpm
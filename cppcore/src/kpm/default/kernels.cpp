@@ -0,0 +1,1274 @@
+#include "kpm/default/dispatch.hpp"
+#include "kpm/default/Compute.hpp"
+#include "kpm/default/collectors.hpp"
+#include "kpm/default/pool.hpp"
+
+#include "compute/kernel_polynomial.hpp"
+#include "compute/lanczos.hpp"
+#include "kpm/calc_moments.hpp"
+
+#include "detail/thread.hpp"
+#include "utils/Trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+
+/**
+ The instruction set specific kernels of `DefaultCompute`, `Bounds` and the Lanczos Green's
+ function of `Core`
+
+ With `PB_CPU_DISPATCH`, this file is compiled once for each instruction set with the build
+ name in `CPB_DISPATCH_ISA` (see `dispatch::best()`). All the SIMD code which it pulls in from
+ the `compute` headers is then placed in an inline namespace of the same name.
+ */
+#ifdef CPB_DISPATCH_ISA
+# define CPB_DISPATCH_NAMESPACE CPB_DISPATCH_ISA
+#else
+# define CPB_DISPATCH_NAMESPACE native
+#endif
+
+namespace cpb { namespace kpm {
+
+namespace {
+
+/// Intra-vector threading only pays off for large matrices
+constexpr auto min_rows_per_thread = idx_t{4096};
+/// Memory limit for the partial sums of the concurrent `LocalMoments` workers (bytes)
+constexpr auto max_partial_memory = size_t{1} << 30;
+
+using Clock = std::chrono::high_resolution_clock;
+
+double seconds(Clock::duration d) { return std::chrono::duration<double>(d).count(); }
+
+/// Total time of the `from()` calls nested within the current one on this thread,
+/// e.g. the right vectors which are generated while collecting the conductivity
+thread_local Clock::duration nested_time{0};
+
+/**
+ One copy of the optimized matrix for each NUMA domain of the worker threads
+
+ The copy is made by the first worker which asks for it, so its pages are first touched
+ (i.e. allocated) in the memory local to that domain. Nothing is copied if all the workers
+ are in a single domain or if they are not pinned at all.
+ */
+template<class Matrix>
+class NumaReplicas {
+public:
+    NumaReplicas(Matrix const& original, std::vector<CpuList> const& affinity)
+        : original(original), copies(numa_domains().size()) {
+        auto domains = std::vector<int>();
+        for (auto const& cpus : affinity) {
+            for (auto cpu : cpus) { domains.push_back(numa_domain_of(cpu)); }
+        }
+        is_enabled = std::any_of(domains.begin(), domains.end(),
+                                 [&](int d) { return d != domains.front(); });
+    }
+
+    /// The matrix in the NUMA domain of the calling thread
+    Matrix const& local() {
+        if (!is_enabled) { return original; }
+
+        auto const domain = static_cast<size_t>(numa_domain_of(current_cpu()));
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& copy = copies[domain];
+        if (!copy) { copy.reset(new Matrix(original)); }
+        return *copy;
+    }
+
+private:
+    Matrix const& original;
+    std::vector<std::unique_ptr<Matrix>> copies;
+    std::mutex mutex;
+    bool is_enabled = false;
+};
+
+/**
+ `calc_moments` SpMV with a `SparseBackend` for the products over all the rows
+
+ The partial products (`optimal_size`) use the built-in CSR kernels. The `m2` and `m3` sums of
+ the diagonal version are computed like the CSR kernels, after the backend product.
+ */
+template<class scalar_t>
+struct BackendSpmv {
+    SparseBackend<scalar_t> const& backend;
+
+    template<class Vector>
+    void operator()(idx_t start, idx_t end, SparseMatrixX<scalar_t> const& h2, Vector const& x,
+                    Vector& y) const {
+        if (start == 0 && end == h2.rows()) {
+            backend.spmv(x, y);
+        } else {
+            compute::kpm_spmv(start, end, h2, x, y);
+        }
+    }
+
+    template<class Vector, class Value>
+    void operator()(idx_t start, idx_t end, SparseMatrixX<scalar_t> const& h2, Vector const& x,
+                    Vector& y, Value& m2, Value& m3) const {
+        if (start != 0 || end != h2.rows()) {
+            return calc_moments::Serial{}(start, end, h2, x, y, m2, m3);
+        }
+        backend.spmv(x, y);
+        add_sums(x, y, m2, m3);
+    }
+
+    template<class Value>
+    static void add_sums(VectorX<scalar_t> const& x, VectorX<scalar_t> const& y,
+                         Value& m2, Value& m3) {
+        m2 += static_cast<Value>(x.squaredNorm());
+        m3 += static_cast<Value>(y.dot(x));
+    }
+
+    template<class Value>
+    static void add_sums(MatrixX<scalar_t> const& x, MatrixX<scalar_t> const& y,
+                         Value& m2, Value& m3) {
+        using value_t = typename Value::value_type;
+        for (auto i = idx_t{0}; i < x.cols(); ++i) {
+            m2[i] += static_cast<value_t>(x.col(i).squaredNorm());
+            m3[i] += static_cast<value_t>(y.col(i).dot(x.col(i)));
+        }
+    }
+};
+
+/// Only the CSR format can have a `SparseBackend`
+template<class scalar_t>
+SparseBackend<scalar_t> const* csr_backend(SparseMatrixX<scalar_t> const&,
+                                           SparseBackendBase const* backend) {
+    return dynamic_cast<SparseBackend<scalar_t> const*>(backend);
+}
+
+template<class Matrix>
+SparseBackend<typename Matrix::Scalar> const* csr_backend(Matrix const&,
+                                                         SparseBackendBase const*) {
+    return nullptr;
+}
+
+/// Keep the final recursion vectors and the first two moments, see `Checkpoint`
+template<class scalar_t, class moment_t, class Vector>
+void save_state(Checkpoint::State& state, DiagonalCollector<scalar_t, moment_t> const& collect,
+                Vector const& r0, Vector const& r1) {
+    state.r0 = MatrixX<scalar_t>(r0);
+    state.r1 = MatrixX<scalar_t>(r1);
+    state.m0 = ArrayX<moment_t>::Constant(1, collect.m0).eval();
+    state.m1 = ArrayX<moment_t>::Constant(1, collect.m1).eval();
+}
+
+template<class scalar_t, class moment_t, class Vector>
+void save_state(Checkpoint::State& state,
+                BatchDiagonalCollector<scalar_t, moment_t> const& collect,
+                Vector const& r0, Vector const& r1) {
+    using Map = Eigen::Map<ArrayX<moment_t> const>;
+    auto const size = static_cast<idx_t>(collect.m0.size());
+    state.r0 = MatrixX<scalar_t>(r0);
+    state.r1 = MatrixX<scalar_t>(r1);
+    state.m0 = ArrayX<moment_t>(Map(collect.m0.data(), size));
+    state.m1 = ArrayX<moment_t>(Map(collect.m1.data(), size));
+}
+
+/**
+ Sum the results of concurrent jobs in the order of their starter index
+
+ The jobs finish in any order but floating point addition isn't associative. A result which
+ arrives early is kept until all the ones before it are done, so `deliver(result, index)` sees
+ the same sequence for any number of threads, see `AlgorithmConfig::deterministic`. The
+ indices must cover a contiguous range from 0 where each result takes `count` of them.
+ */
+template<class T>
+class OrderedReduction {
+public:
+    template<class Deliver>
+    void add(T const& result, idx_t index, idx_t count, Deliver deliver) {
+        std::lock_guard<std::mutex> lk(mutex);
+        pending.emplace(index, std::make_pair(count, result));
+        while (!pending.empty() && pending.begin()->first == next) {
+            auto const& front = pending.begin()->second;
+            deliver(front.second, next);
+            next += front.first;
+            pending.erase(pending.begin());
+        }
+    }
+
+private:
+    std::mutex mutex;
+    std::map<idx_t, std::pair<idx_t, T>> pending; ///< by index
+    idx_t next = 0; ///< index of the next result to deliver
+};
+
+struct NumCols {
+    template<class T>
+    idx_t operator()(T const& x) const { return x.cols(); }
+};
+
+/// Only the diagonal recursions can be checkpointed
+template<class Collector, class Vector>
+void save_state(Checkpoint::State&, Collector const&, Vector const&, Vector const&) {}
+
+/// The saved data must have the same precision as the current calculation
+template<class T, class Variant>
+T const& saved(Variant const& v) {
+    if (!v.template is<T>()) {
+        throw std::runtime_error("KPM checkpoint: the saved state doesn't match the precision "
+                                 "of the Hamiltonian.");
+    }
+    return v.template get<T>();
+}
+
+/// Resume `r0`, `r1` and the first two moments of `collect` from a saved `state`
+template<class scalar_t, class moment_t, class Vector>
+void load_state(Checkpoint::State const& state, DiagonalCollector<scalar_t, moment_t>& collect,
+                Vector& r0, Vector& r1) {
+    r0 = saved<MatrixX<scalar_t>>(state.r0);
+    r1 = saved<MatrixX<scalar_t>>(state.r1);
+    collect.m0 = saved<ArrayX<moment_t>>(state.m0)[0];
+    collect.m1 = saved<ArrayX<moment_t>>(state.m1)[0];
+}
+
+template<class scalar_t, class moment_t, class Vector>
+void load_state(Checkpoint::State const& state,
+                BatchDiagonalCollector<scalar_t, moment_t>& collect, Vector& r0, Vector& r1) {
+    r0 = saved<MatrixX<scalar_t>>(state.r0);
+    r1 = saved<MatrixX<scalar_t>>(state.r1);
+    auto const& m0 = saved<ArrayX<moment_t>>(state.m0);
+    auto const& m1 = saved<ArrayX<moment_t>>(state.m1);
+    for (auto i = size_t{0}; i < collect.m0.size(); ++i) {
+        collect.m0[i] = m0[i];
+        collect.m1[i] = m1[i];
+    }
+}
+
+/// Do all the operators have the same CSR sparsity pattern? The empty ones are the identity.
+template<class scalar_t>
+bool is_shared_pattern(std::vector<SparseMatrixX<scalar_t> const*> const& ops) {
+    auto const first = std::find_if(ops.begin(), ops.end(),
+                                    [](SparseMatrixX<scalar_t> const* op) { return op; });
+    if (first == ops.end()) { return false; }
+
+    auto const& a = **first;
+    return std::all_of(ops.begin(), ops.end(), [&](SparseMatrixX<scalar_t> const* op) {
+        if (!op) { return true; }
+        auto const& b = *op;
+        return b.rows() == a.rows() && b.nonZeros() == a.nonZeros()
+               && a.isCompressed() && b.isCompressed()
+               && std::equal(b.outerIndexPtr(), b.outerIndexPtr() + b.rows() + 1,
+                             a.outerIndexPtr())
+               && std::equal(b.innerIndexPtr(), b.innerIndexPtr() + b.nonZeros(),
+                             a.innerIndexPtr());
+    });
+}
+
+/**
+ `results[k] = ops[k] * transpose(block)` for operators with a shared sparsity pattern, e.g.
+ the velocity operators which all have the pattern of the Hamiltonian
+
+ A single sweep over the pattern loads each column index and each column of the `block`
+ (one element of every collected vector) once for all the operators. A null operator is the
+ identity. The columns are transposed into contiguous rows first: `block` is row-major.
+ */
+template<class scalar_t, class Block>
+void fused_products(std::vector<SparseMatrixX<scalar_t> const*> const& ops, Block const& block,
+                    std::vector<MatrixX<scalar_t>>& results) {
+    auto const transposed = MatrixX<scalar_t>(block.transpose());
+    auto const pattern = std::find_if(ops.begin(), ops.end(),
+                                      [](SparseMatrixX<scalar_t> const* op) { return op; });
+    auto sparse = std::vector<idx_t>();
+    results.resize(ops.size());
+    for (auto k = size_t{0}; k < ops.size(); ++k) {
+        if (ops[k]) {
+            results[k].setZero(transposed.rows(), transposed.cols());
+            sparse.push_back(static_cast<idx_t>(k));
+        } else {
+            results[k] = transposed;
+        }
+    }
+    if (pattern == ops.end()) { return; }
+
+    auto const indptr = (*pattern)->outerIndexPtr();
+    auto const indices = (*pattern)->innerIndexPtr();
+    for (auto row = idx_t{0}; row < (*pattern)->rows(); ++row) {
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            auto const x = transposed.row(indices[n]);
+            for (auto k : sparse) {
+                results[k].row(row) += ops[k]->valuePtr()[n] * x;
+            }
+        }
+    }
+}
+
+template<class Matrix>
+struct SelectAlgorithm {
+    using scalar_t = typename Matrix::Scalar;
+    /// Moments are accumulated in double precision when using a mixed precision Hamiltonian
+    using mixed_moment_t = num::get_double_t<scalar_t>;
+
+    Matrix const& h2;
+    Starter const& starter;
+    AlgorithmConfig const& config;
+    OptimizedHamiltonian const& oh;
+    DefaultCompute const& compute;
+    SparseBackend<scalar_t> const* backend; ///< optional, see `csr_backend()`
+
+    /// Compute the moments of the next vector (or batch) produced by the starter,
+    /// see `from()`. Returns the index of the vector within the starter sequence.
+    template<class Collector, class Vector = typename Collector::Vector>
+    idx_t with(Collector& collect, idx_t num_threads = 1,
+               Checkpoint::State* state = nullptr) const {
+        auto idx = idx_t{0};
+        auto starter_time = 0.0;
+        auto const support = unit_support(collect, state);
+        auto r0 = timed_r0(var::tag<Vector>{}, simd::traits<scalar_t>::size, idx, starter_time,
+                           support);
+
+        from(collect, std::move(r0), num_threads, starter_time, state, support);
+        if (state) { state->index = idx; }
+        return idx;
+    }
+
+    /// The unit vectors of the starter only need the first `SliceMap::support_size()` rows if
+    /// the size-optimized diagonal recursion of `collect` are the only thing which reads them.
+    /// Return 0 if the full vectors are needed.
+    template<class Collector>
+    idx_t unit_support(Collector const& collect, Checkpoint::State const* state) const {
+        if (starter.unit_sources.size() == 0 || !config.optimal_size || config.matrix_powers > 1
+            || backend || state || !calc_moments::is_diagonal<Collector>::value) {
+            return 0;
+        }
+        auto const support = oh.map().support_size(collect.size());
+        return support < h2.rows() ? support : 0;
+    }
+
+    /// The same algorithm using the replica of the matrix in the calling thread's NUMA domain
+    SelectAlgorithm on_local_matrix(NumaReplicas<Matrix>& replicas) const {
+        return {replicas.local(), starter, config, oh, compute, backend};
+    }
+
+    /// Same as `make_r0()` but the vector is filled in a buffer from the calling thread's
+    /// pool and the time it takes is written to `elapsed` (in seconds). With a `support`,
+    /// only that part of the unit vectors is written, see `make_unit_r0()`.
+    template<class Vector>
+    Vector timed_r0(var::tag<Vector>, idx_t cols, idx_t& index, double& elapsed,
+                    idx_t support = 0) const {
+        auto const span = trace::Span("starter", "kpm");
+        auto const start = Clock::now();
+        auto const num_vectors = (Vector::ColsAtCompileTime == 1) ? idx_t{1} : cols;
+        auto r0 = pool::acquire<Vector>(starter.vector_size, num_vectors);
+        if (support > 0) {
+            make_unit_r0(starter, r0, cols, index, support);
+        } else {
+            make_r0(starter, r0, cols, index);
+        }
+        elapsed = seconds(Clock::now() - start);
+        return r0;
+    }
+
+    /// Compute the moments of the given `r0` vector using a row-partitioned matrix-vector
+    /// product on `num_threads`. The threads are only started if the matrix is large enough
+    /// for the work to be worth splitting. The phase times are recorded in the profile.
+    /// Both vectors are given back to the calling thread's pool for the next job -- after
+    /// they are copied to the `state`, if given, which requires `optimal_size == false`.
+    /// A non-zero `support` means that `r0` holds only that many rows of unit vectors, see
+    /// `unit_support()`: the first step and the initial moments are limited to them.
+    template<class Collector, class Vector>
+    void from(Collector& collect, Vector r0, idx_t num_threads, double starter_time = 0,
+              Checkpoint::State* state = nullptr, idx_t support = 0) const {
+        simd::scope_disable_denormals guard;
+        auto const span = trace::Span("job", "kpm");
+        auto const start = Clock::now();
+        auto const outer_nested_time = nested_time;
+        auto spmv_time = Clock::duration{0};
+
+        auto r1 = pool::acquire<Vector>(r0.rows(), r0.cols());
+        if (support > 0) {
+            make_unit_r1(h2, r0, r1, oh.map().reach_size(1), support, calc_moments::Serial{});
+            spmv_time += Clock::now() - start;
+            collect.initial(r0.topRows(support), r1.topRows(support));
+        } else {
+            make_r1(h2, r0, r1);
+            spmv_time += Clock::now() - start;
+            collect.initial(r0, r1);
+        }
+
+        auto const max_threads = std::max(h2.rows() / min_rows_per_thread, idx_t{1});
+        num_threads = std::min(num_threads, max_threads);
+        if (backend) {
+            ThreadBudgetScope budget(num_threads); // the backend's own threads
+            run_on_backend(collect, r0, r1, spmv_time, is_csr{});
+        } else if (num_threads > 1 || config.deterministic) {
+            // The fixed row blocks sum the same way on any number of threads, even just one
+            ThreadTeam team(num_threads);
+            auto const spmv = calc_moments::Parallel(team, min_rows_per_thread,
+                                                     config.deterministic);
+            run(collect, r0, r1, calc_moments::timed(spmv, spmv_time));
+        } else {
+            run(collect, r0, r1, calc_moments::timed(calc_moments::Serial{}, spmv_time));
+        }
+        auto const num_moments = collect.size() * r0.cols();
+        if (state) {
+            assert(!config.optimal_size);
+            save_state(*state, collect, r0, r1);
+        }
+        pool::release(r0);
+        pool::release(r1);
+
+        // The nested calls have already recorded their own time
+        auto const total = Clock::now() - start;
+        auto const inner = nested_time - outer_nested_time;
+        nested_time = outer_nested_time + total;
+        compute.profile_record(starter_time, seconds(spmv_time),
+                               seconds(total - spmv_time - inner), num_moments);
+    }
+
+    /// Continue the recursion of a saved `state` which has `first_moment` moments so far up to
+    /// the size of the `collect`-or. Only the new moments are written. The `state` is updated.
+    template<class Collector, class Vector = typename Collector::Vector>
+    void resume(Collector& collect, Checkpoint::State& state, idx_t first_moment,
+                idx_t num_threads) const {
+        simd::scope_disable_denormals guard;
+        auto const span = trace::Span("job", "kpm");
+        auto const start = Clock::now();
+        auto spmv_time = Clock::duration{0};
+
+        auto r0 = Vector(), r1 = Vector();
+        load_state(state, collect, r0, r1);
+        if (r0.rows() != h2.rows()) {
+            throw std::runtime_error("KPM checkpoint: the saved vectors don't match the size of "
+                                     "the Hamiltonian.");
+        }
+
+        auto const first = first_moment / 2 + 1;
+        auto const max_threads = std::max(h2.rows() / min_rows_per_thread, idx_t{1});
+        num_threads = std::min(num_threads, max_threads);
+        if (num_threads > 1 || config.deterministic) {
+            ThreadTeam team(num_threads);
+            auto const spmv = calc_moments::Parallel(team, min_rows_per_thread,
+                                                     config.deterministic);
+            calc_moments::basic(collect, r0, r1, h2, oh.map(), false,
+                                calc_moments::timed(spmv, spmv_time), first);
+        } else {
+            calc_moments::basic(collect, r0, r1, h2, oh.map(), false,
+                                calc_moments::timed(calc_moments::Serial{}, spmv_time), first);
+        }
+        auto const num_moments = (collect.size() - first_moment) * r0.cols();
+        save_state(state, collect, r0, r1);
+
+        auto const total = Clock::now() - start;
+        compute.profile_record(0, seconds(spmv_time), seconds(total - spmv_time), num_moments);
+    }
+
+    template<class Collector, class Vector, class SpMV>
+    void run(Collector& collect, Vector& r0, Vector& r1, SpMV const& spmv) const {
+        if (config.matrix_powers > 1 && calc_moments::is_diagonal<Collector>::value) {
+            run_matrix_powers(collect, r0, r1, spmv);
+        } else if (config.interleaved) {
+            calc_moments::interleaved(collect, r0, r1, h2, oh.map(), config.optimal_size, spmv);
+        } else {
+            calc_moments::basic(collect, r0, r1, h2, oh.map(), config.optimal_size, spmv);
+        }
+    }
+
+    using is_csr = std::is_same<Matrix, SparseMatrixX<scalar_t>>;
+
+    template<class Collector, class Vector>
+    void run_on_backend(Collector& collect, Vector& r0, Vector& r1,
+                        Clock::duration& spmv_time, std::true_type) const {
+        run(collect, r0, r1, calc_moments::timed(BackendSpmv<scalar_t>{*backend}, spmv_time));
+    }
+
+    /// The other formats never have a `backend`
+    template<class Collector, class Vector>
+    void run_on_backend(Collector&, Vector&, Vector&, Clock::duration&, std::false_type) const {}
+
+    template<class Collector, class Vector, class SpMV,
+             calc_moments::requires_diagonal<Collector> = 1>
+    void run_matrix_powers(Collector& collect, Vector& r0, Vector& r1, SpMV const& spmv) const {
+        calc_moments::matrix_powers(collect, r0, r1, h2, oh.map(), config.optimal_size,
+                                    config.matrix_powers, spmv);
+    }
+
+    /// Only the diagonal algorithms have a matrix-powers version
+    template<class Collector, class Vector, class SpMV,
+             calc_moments::requires_offdiagonal<Collector> = 1>
+    void run_matrix_powers(Collector&, Vector&, Vector&, SpMV const&) const {}
+
+    template<class Vector, class SpMV>
+    void run(ProductIdentityCollector<scalar_t>& collect, Vector& r0, Vector& r1,
+             SpMV const& spmv) const {
+        calc_moments::product_identity(collect, r0, r1, h2, oh.map(), config.optimal_size, spmv);
+    }
+
+    void operator()(DiagonalMoments* m) {
+        if (oh.mixed_precision()) {
+            diagonal<mixed_moment_t>(m);
+        } else {
+            diagonal<scalar_t>(m);
+        }
+    }
+
+    template<class moment_t>
+    void diagonal(DiagonalMoments* m) {
+        auto collect = DiagonalCollector<scalar_t, moment_t>(m->num_moments);
+        auto const checkpoint = m->checkpoint;
+        if (checkpoint && !checkpoint->empty()) {
+            collect.moments.setZero();
+            resume(collect, checkpoint->states.front(), checkpoint->num_moments,
+                   compute.get_num_threads());
+        } else if (checkpoint) {
+            checkpoint->states.resize(1);
+            with(collect, compute.get_num_threads(), &checkpoint->states.front());
+        } else {
+            with(collect, compute.get_num_threads());
+        }
+        m->data = std::move(collect.moments);
+    }
+
+    void operator()(BatchDiagonalMoments* m) {
+        if (oh.mixed_precision()) {
+            batch_diagonal<mixed_moment_t>(m);
+        } else {
+            batch_diagonal<scalar_t>(m);
+        }
+    }
+
+    template<class moment_t>
+    void batch_diagonal(BatchDiagonalMoments* m) {
+        constexpr auto batch_size = static_cast<idx_t>(simd::traits<scalar_t>::size);
+        auto const num_threads = compute.get_num_threads();
+
+        idx_t num_batches, num_singles;
+        std::tie(num_batches, num_singles) = batch_split(m->num_vectors, num_threads);
+
+        auto replicas = NumaReplicas<Matrix>(h2, compute.get_affinity());
+        ThreadPool pool(num_threads, compute.get_affinity());
+        auto const progress = compute.progress_scope(m->num_vectors);
+
+        auto ordered = OrderedReduction<BatchData>();
+        auto const add = [&](BatchData const& moments, idx_t idx, idx_t count) {
+            if (config.deterministic) {
+                ordered.add(moments, idx, count, [&](BatchData const& data, idx_t i) {
+                    m->add(data, i);
+                });
+            } else {
+                m->add(moments, idx);
+            }
+        };
+
+        if (m->checkpoint && !m->checkpoint->empty()) {
+            resume_batch_diagonal<moment_t>(m, replicas, pool, add);
+            return;
+        }
+
+        // The checkpoint needs the final vectors of the full recursion
+        auto const tolerance = m->checkpoint ? 0.0 : config.convergence_tolerance;
+        for (auto i = 0; i < num_batches; ++i) {
+            pool.add([&]() {
+                if (m->is_stopped()) { return; }
+                auto const local = on_local_matrix(replicas);
+                auto collect = BatchDiagonalCollector<scalar_t, moment_t>(
+                    pool::acquire<ArrayXX<moment_t>>(m->num_moments, batch_size)
+                );
+                collect.convergence.tolerance = tolerance;
+                auto state = Checkpoint::State();
+                auto const idx = local.with(collect, 1, m->checkpoint ? &state : nullptr);
+                add(collect.moments, idx, batch_size);
+                if (collect.is_converged()) {
+                    m->skip(std::min(batch_size, m->num_vectors - idx), collect.convergence.size);
+                }
+                if (m->checkpoint) { m->save(std::move(state)); }
+                pool::release(collect.moments);
+                compute.progress_update(batch_size, m->num_vectors);
+            });
+        }
+
+        for (auto i = 0; i < num_singles; ++i) {
+            pool.add([&]() {
+                if (m->is_stopped()) { return; }
+                auto const local = on_local_matrix(replicas);
+                auto collect = DiagonalCollector<scalar_t, moment_t>(
+                    pool::acquire<ArrayX<moment_t>>(m->num_moments, 1)
+                );
+                collect.convergence.tolerance = tolerance;
+                auto state = Checkpoint::State();
+                auto const idx = local.with(collect, 1, m->checkpoint ? &state : nullptr);
+                add(collect.moments, idx, 1);
+                if (collect.is_converged()) { m->skip(1, collect.convergence.size); }
+                if (m->checkpoint) { m->save(std::move(state)); }
+                pool::release(collect.moments);
+                compute.progress_update(1, m->num_vectors);
+            });
+        }
+
+        pool.join();
+    }
+
+    /// Continue each of the saved states: there's one job per vector (or batch) like the
+    /// calculation which made the checkpoint. The results go to `add(moments, index, count)`.
+    template<class moment_t, class Add>
+    void resume_batch_diagonal(BatchDiagonalMoments* m, NumaReplicas<Matrix>& replicas,
+                               ThreadPool& pool, Add const& add) {
+        auto& checkpoint = *m->checkpoint;
+        for (auto i = size_t{0}; i < checkpoint.states.size(); ++i) {
+            pool.add([&, i]() {
+                auto& state = checkpoint.states[i];
+                auto const local = on_local_matrix(replicas);
+                auto const cols = var::apply_visitor(NumCols{}, state.r0);
+                if (cols == 1) {
+                    auto collect = DiagonalCollector<scalar_t, moment_t>(m->num_moments);
+                    collect.moments.setZero();
+                    local.resume(collect, state, checkpoint.num_moments, 1);
+                    add(collect.moments, state.index, 1);
+                } else {
+                    auto collect = BatchDiagonalCollector<scalar_t, moment_t>(m->num_moments,
+                                                                              cols);
+                    collect.moments.setZero();
+                    local.resume(collect, state, checkpoint.num_moments, 1);
+                    add(collect.moments, state.index, cols);
+                }
+                compute.progress_update(cols, m->num_vectors);
+            });
+        }
+
+        pool.join();
+    }
+
+    void operator()(GenericMoments* m) {
+        auto collect = GenericCollector<scalar_t>(m->num_moments, oh, m->alpha, m->beta, m->op);
+        with<OffDiagonalCollector<scalar_t>>(collect, compute.get_num_threads());
+        m->data = std::move(collect.moments);
+    }
+
+    /// Split `num_vectors` into SIMD batches and leftover single vectors. A vector doesn't
+    /// give bit-identical moments in a batch and on its own, so the `deterministic` split
+    /// doesn't depend on the number of threads: it's only batches.
+    std::pair<idx_t, idx_t> batch_split(idx_t num_vectors, idx_t num_threads) const {
+        constexpr auto batch_size = static_cast<idx_t>(simd::traits<scalar_t>::size);
+        if (config.deterministic) { return {(num_vectors + batch_size - 1) / batch_size, 0}; }
+
+        auto num_batches = num_vectors / batch_size;
+        auto num_singles = num_vectors % batch_size;
+
+        // Heuristic: prefer SIMD execution when there's a low number of threads
+        if (num_singles > num_threads * batch_size / 2) {
+            num_batches += 1;
+            num_singles = 0;
+        }
+        return {num_batches, num_singles};
+    }
+
+    void operator()(BatchGenericMoments* m) {
+        constexpr auto batch_size = static_cast<idx_t>(simd::traits<scalar_t>::size);
+        auto const num_threads = compute.get_num_threads();
+        auto const num_vectors = m->num_vectors();
+        auto const& beta = (m->beta.size() != 0) ? m->beta : m->alpha;
+
+        idx_t num_batches, num_singles;
+        std::tie(num_batches, num_singles) = batch_split(num_vectors, num_threads);
+
+        auto data = ArrayXX<scalar_t>(m->num_moments, num_vectors);
+        auto replicas = NumaReplicas<Matrix>(h2, compute.get_affinity());
+        ThreadPool pool(num_threads, compute.get_affinity());
+        auto const progress = compute.progress_scope(num_vectors);
+
+        for (auto i = 0; i < num_batches; ++i) {
+            pool.add([&]() {
+                auto const local = on_local_matrix(replicas);
+                auto idx = idx_t{0};
+                auto starter_time = 0.0;
+                auto r0 = timed_r0(var::tag<MatrixX<scalar_t>>{}, batch_size, idx, starter_time);
+                auto collect = BatchGenericCollector<scalar_t>(m->num_moments, oh, beta, m->op,
+                                                               idx, batch_size);
+                local.template from<BatchOffDiagonalCollector<scalar_t>>(
+                    collect, std::move(r0), 1, starter_time);
+
+                auto const n = std::max(std::min(batch_size, num_vectors - idx), idx_t{0});
+                data.middleCols(idx, n) = collect.moments.leftCols(n);
+                compute.progress_update(n, num_vectors);
+            });
+        }
+
+        for (auto i = 0; i < num_singles; ++i) {
+            pool.add([&]() {
+                auto const local = on_local_matrix(replicas);
+                auto idx = idx_t{0};
+                auto starter_time = 0.0;
+                auto r0 = timed_r0(var::tag<VectorX<scalar_t>>{}, 1, idx, starter_time);
+                if (idx >= num_vectors) { return; } // covered by a batch
+
+                auto collect = GenericCollector<scalar_t>(m->num_moments, oh, {},
+                                                          beta.col(idx), m->op);
+                local.template from<OffDiagonalCollector<scalar_t>>(collect, std::move(r0), 1,
+                                                                    starter_time);
+
+                data.col(idx) = collect.moments;
+                compute.progress_update(1, num_vectors);
+            });
+        }
+
+        pool.join();
+        m->data = std::move(data);
+    }
+
+    void operator()(MultiUnitMoments* m) {
+        if (m->idx.src.size() > 1) {
+            return batch_multi_unit(m);
+        } else if (config.product_identity) {
+            return product_identity(m);
+        }
+
+        auto collect = MultiUnitCollector<scalar_t>(m->num_moments, m->idx);
+        with<OffDiagonalCollector<scalar_t>>(collect, compute.get_num_threads());
+        m->data = std::move(collect.moments);
+    }
+
+    /// Each source index is a separate starter vector: these are computed in SIMD batches
+    void batch_multi_unit(MultiUnitMoments* m) {
+        constexpr auto batch_size = static_cast<idx_t>(simd::traits<scalar_t>::size);
+        auto const num_threads = compute.get_num_threads();
+        auto const num_src = m->idx.src.size();
+        auto const num_dest = m->idx.dest.size();
+
+        idx_t num_batches, num_singles;
+        std::tie(num_batches, num_singles) = batch_split(num_src, num_threads);
+
+        // Leftover threads (fewer batches than threads) speed up each individual batch
+        auto const num_workers = std::max(std::min(num_threads, num_batches + num_singles),
+                                          idx_t{1});
+        auto const threads_per_batch = std::max(num_threads / num_workers, idx_t{1});
+
+        auto data = MultiUnitMoments::Data<scalar_t>(num_src * num_dest);
+        auto replicas = NumaReplicas<Matrix>(h2, compute.get_affinity());
+        ThreadPool pool(num_workers, compute.get_affinity());
+        auto const progress = compute.progress_scope(num_src);
+
+        for (auto i = 0; i < num_batches; ++i) {
+            pool.add([&]() {
+                auto const local = on_local_matrix(replicas);
+                auto collect = BatchMultiUnitCollector<scalar_t>(m->num_moments, m->idx,
+                                                                 batch_size);
+                auto const idx = local.template with<BatchOffDiagonalCollector<scalar_t>>(
+                    collect, threads_per_batch);
+
+                auto const n = std::max(std::min(batch_size, num_src - idx), idx_t{0});
+                for (auto j = idx_t{0}; j < n; ++j) {
+                    for (auto d = idx_t{0}; d < num_dest; ++d) {
+                        data[(idx + j) * num_dest + d] = collect.moments[d].col(j);
+                    }
+                }
+                compute.progress_update(n, num_src);
+            });
+        }
+
+        for (auto i = 0; i < num_singles; ++i) {
+            pool.add([&]() {
+                auto const local = on_local_matrix(replicas);
+                auto collect = MultiUnitCollector<scalar_t>(m->num_moments, m->idx);
+                auto const idx = local.template with<OffDiagonalCollector<scalar_t>>(
+                    collect, threads_per_batch);
+                if (idx >= num_src) { return; } // covered by a batch
+
+                for (auto d = idx_t{0}; d < num_dest; ++d) {
+                    data[idx * num_dest + d] = std::move(collect.moments[d]);
+                }
+                compute.progress_update(1, num_src);
+            });
+        }
+
+        pool.join();
+        m->data = std::move(data);
+    }
+
+    /// The source vector is column 0 of each SIMD batch and the other columns are used by
+    /// the unit vectors of the destination indices. A destination equal to the source
+    /// doesn't need its own column. Each batch is a separate job for the thread pool.
+    void product_identity(MultiUnitMoments* m) {
+        constexpr auto batch_size = static_cast<idx_t>(simd::traits<scalar_t>::size);
+        constexpr auto dest_per_batch = batch_size - 1;
+        auto const num_threads = compute.get_num_threads();
+        auto const& idx = m->idx;
+        auto const num_dest = idx.dest.size();
+
+        // Batch `b` and column of each destination
+        auto batch_of = std::vector<idx_t>(num_dest, 0);
+        auto column_of = std::vector<idx_t>(num_dest, 0);
+        auto num_columns = idx_t{0};
+        for (auto i = idx_t{0}; i < num_dest; ++i) {
+            if (idx.dest[i] == idx.src[0]) { continue; }
+            batch_of[i] = num_columns / dest_per_batch;
+            column_of[i] = 1 + num_columns % dest_per_batch;
+            ++num_columns;
+        }
+        auto const num_batches = std::max((num_columns + dest_per_batch - 1) / dest_per_batch,
+                                          idx_t{1});
+
+        auto starter_time = 0.0;
+        auto index = idx_t{0};
+        auto const source = timed_r0(var::tag<VectorX<scalar_t>>{}, 1, index, starter_time);
+
+        // Leftover threads (fewer batches than threads) speed up each individual batch
+        auto const num_workers = std::min(num_threads, num_batches);
+        auto const threads_per_batch = std::max(num_threads / num_workers, idx_t{1});
+
+        auto data = MultiUnitMoments::Data<scalar_t>(num_dest);
+        auto replicas = NumaReplicas<Matrix>(h2, compute.get_affinity());
+        ThreadPool pool(num_workers, compute.get_affinity());
+
+        for (auto b = idx_t{0}; b < num_batches; ++b) {
+            pool.add([&, b]() {
+                auto const local = on_local_matrix(replicas);
+                auto r0 = MatrixX<scalar_t>::Zero(source.size(), batch_size).eval();
+                r0.col(0) = source;
+
+                auto dest = std::vector<idx_t>(), columns = std::vector<idx_t>();
+                for (auto i = idx_t{0}; i < num_dest; ++i) {
+                    if (batch_of[i] != b) { continue; }
+                    dest.push_back(i);
+                    columns.push_back(column_of[i]);
+                    if (column_of[i] != 0) { r0(idx.dest[i], column_of[i]) = scalar_t{1}; }
+                }
+
+                auto collect = ProductIdentityCollector<scalar_t>(m->num_moments, columns);
+                local.from(collect, std::move(r0), threads_per_batch,
+                           b == 0 ? starter_time : 0.0);
+
+                for (auto k = size_t{0}; k < dest.size(); ++k) {
+                    data[dest[k]] = std::move(collect.moments[k]);
+                }
+            });
+        }
+
+        pool.join();
+        m->data = std::move(data);
+    }
+
+    void operator()(DenseMatrixMoments* m) {
+        auto collect = DenseMatrixCollector<scalar_t>(m->num_moments, oh, m->op);
+        with<OffDiagonalCollector<scalar_t>>(collect, compute.get_num_threads());
+        m->data = std::move(collect.moments);
+    }
+
+    void operator()(BatchDenseMatrixMoments* m) {
+        auto const num_threads = compute.get_num_threads();
+        auto const num_workers = std::max(std::min(num_threads, m->num_vectors), idx_t{1});
+        // Leftover threads (fewer vectors than threads) speed up each individual vector
+        auto const threads_per_vector = std::max(num_threads / num_workers, idx_t{1});
+
+        // The left operators are applied to the starter vector and the right ones to each
+        // collected vector. They are already in the order of the optimized Hamiltonian.
+        auto const matrices = [&](std::vector<VariantCSR> const& ops) {
+            auto result = std::vector<SparseMatrixX<scalar_t> const*>(ops.size(), nullptr);
+            for (auto i = size_t{0}; i < ops.size(); ++i) {
+                if (ops[i]) { result[i] = &ops[i].template get<scalar_t>(); }
+            }
+            return result;
+        };
+        auto const ops_l = matrices(m->ops_l);
+        auto const ops_r = matrices(m->ops_r);
+        auto const is_fused = ops_r.size() > 1 && is_shared_pattern(ops_r);
+
+        using Products = std::vector<MatrixX<scalar_t>>;
+        auto const add = [&](Products const& partial, idx_t) {
+            for (auto i = size_t{0}; i < partial.size(); ++i) {
+                m->results[i].add(partial[i]);
+            }
+        };
+        // With `deterministic`, each vector is a separate partial sum added in index order
+        auto ordered = OrderedReduction<Products>();
+        auto replicas = NumaReplicas<Matrix>(h2, compute.get_affinity());
+        ThreadPool pool(num_workers, compute.get_affinity());
+        auto const progress = compute.progress_scope(m->num_vectors);
+
+        for (auto w = idx_t{0}; w < num_workers; ++w) {
+            pool.add([&, w]() {
+                auto const local = on_local_matrix(replicas);
+                // Each worker has its own partial products
+                auto partial = Products(
+                    m->products.size(), MatrixX<scalar_t>::Zero(m->num_moments, m->num_moments)
+                );
+
+                for (auto j = w; j < m->num_vectors; j += num_workers) {
+                    auto idx = idx_t{0};
+                    auto starter_time = 0.0;
+                    auto r0 = timed_r0(var::tag<VectorX<scalar_t>>{}, 1, idx, starter_time);
+                    if (config.deterministic) {
+                        for (auto& p : partial) { p.setZero(); }
+                    }
+                    local.dense_matrix_products(*m, r0, ops_l, ops_r, is_fused, partial,
+                                                threads_per_vector, starter_time);
+                    if (config.deterministic) { ordered.add(partial, idx, 1, add); }
+                    pool::release(r0);
+                    compute.progress_update(1, m->num_vectors);
+                }
+
+                if (!config.deterministic) { add(partial, w); }
+            });
+        }
+
+        pool.join();
+    }
+
+    void operator()(LocalMoments* m) {
+        constexpr auto batch_size = static_cast<idx_t>(simd::traits<scalar_t>::size);
+        auto const num_threads = compute.get_num_threads();
+        auto const num_batches = (m->num_vectors + batch_size - 1) / batch_size;
+        auto const num_columns = m->num_columns;
+
+        // Each worker sums into its own buffer, so their number is limited by the memory:
+        // with many indices, fewer workers use more threads for each batch instead
+        auto const partial_bytes = static_cast<size_t>(m->num_moments * num_columns)
+                                   * sizeof(scalar_t);
+        auto const max_workers = static_cast<idx_t>(
+            max_partial_memory / std::max(partial_bytes, size_t{1})
+        );
+        auto const num_workers = std::max(std::min({num_threads, num_batches, max_workers}),
+                                          idx_t{1});
+        auto const threads_per_batch = std::max(num_threads / num_workers, idx_t{1});
+
+        auto sum = ArrayXX<scalar_t>::Zero(m->num_moments, num_columns).eval();
+        auto mutex = std::mutex();
+        // With `deterministic`, each batch is a separate partial sum added in index order
+        auto ordered = OrderedReduction<ArrayXX<scalar_t>>();
+        auto replicas = NumaReplicas<Matrix>(h2, compute.get_affinity());
+        ThreadPool pool(num_workers, compute.get_affinity());
+        auto const progress = compute.progress_scope(m->num_vectors);
+
+        for (auto w = idx_t{0}; w < num_workers; ++w) {
+            pool.add([&, w]() {
+                auto const local = on_local_matrix(replicas);
+                auto partial = ArrayXX<scalar_t>::Zero(m->num_moments, num_columns).eval();
+
+                for (auto b = w; b < num_batches; b += num_workers) {
+                    auto idx = idx_t{0};
+                    auto starter_time = 0.0;
+                    auto r0 = timed_r0(var::tag<MatrixX<scalar_t>>{}, batch_size, idx,
+                                       starter_time);
+                    auto const n = std::max(std::min(batch_size, m->num_vectors - idx), idx_t{0});
+                    if (config.deterministic) { partial.setZero(); }
+                    auto collect = BatchLocalCollector<scalar_t>(m->idx, m->columns, partial, n);
+                    local.template from<BatchOffDiagonalCollector<scalar_t>>(
+                        collect, std::move(r0), threads_per_batch, starter_time);
+                    if (config.deterministic) {
+                        ordered.add(partial, idx, batch_size,
+                                    [&](ArrayXX<scalar_t> const& p, idx_t) { sum += p; });
+                    }
+                    compute.progress_update(n, m->num_vectors);
+                }
+
+                if (config.deterministic) { return; }
+                std::lock_guard<std::mutex> lk(mutex);
+                sum += partial;
+            });
+        }
+
+        pool.join();
+        m->data = std::move(sum);
+    }
+
+    void operator()(KuboGreenwoodMoments* m) {
+        auto const num_threads = compute.get_num_threads();
+        auto const num_workers = std::max(std::min(num_threads, m->num_vectors), idx_t{1});
+        auto const threads_per_vector = std::max(num_threads / num_workers, idx_t{1});
+        auto const num_energies = m->num_energies();
+        auto const per_pass = (num_energies + m->num_passes() - 1) / m->num_passes();
+        auto const& op = m->op.template get<scalar_t>(); // already reordered
+        // Each recursion takes its starter from the pool: `from()` gives it back at the end
+        auto const pooled = [](VectorX<scalar_t> const& v) {
+            auto buffer = pool::acquire<VectorX<scalar_t>>(v.size(), 1);
+            buffer = v;
+            return buffer;
+        };
+
+        auto sum = ArrayXcd::Zero(num_energies).eval();
+        auto mutex = std::mutex();
+        auto ordered = OrderedReduction<ArrayXcd>(); // per vector with `deterministic`
+        auto replicas = NumaReplicas<Matrix>(h2, compute.get_affinity());
+        ThreadPool pool(num_workers, compute.get_affinity());
+        auto const progress = compute.progress_scope(m->num_vectors);
+
+        for (auto w = idx_t{0}; w < num_workers; ++w) {
+            pool.add([&, w]() {
+                auto const local = on_local_matrix(replicas);
+                auto partial = ArrayXcd::Zero(num_energies).eval();
+
+                for (auto j = w; j < m->num_vectors; j += num_workers) {
+                    auto idx = idx_t{0};
+                    auto starter_time = 0.0;
+                    auto r0 = timed_r0(var::tag<VectorX<scalar_t>>{}, 1, idx, starter_time);
+                    auto const op_r0 = (op * r0).eval();
+                    if (config.deterministic) { partial.setZero(); }
+
+                    for (auto first = idx_t{0}; first < num_energies; first += per_pass) {
+                        auto const n = std::min(per_pass, num_energies - first);
+                        auto const c = m->coefficients.middleCols(first, n).eval();
+                        auto a = ProjectionCollector<scalar_t>(c, r0.size());
+                        local.from(a, pooled(r0), threads_per_vector, starter_time);
+                        auto b = ProjectionCollector<scalar_t>(c, r0.size());
+                        local.from(b, pooled(op_r0), threads_per_vector);
+                        starter_time = 0; // only counted once
+
+                        for (auto k = idx_t{0}; k < n; ++k) {
+                            auto const& a_k = a.states[static_cast<size_t>(k)];
+                            auto const& b_k = b.states[static_cast<size_t>(k)];
+                            partial[first + k] += static_cast<std::complex<double>>(
+                                b_k.dot(op * a_k)
+                            );
+                        }
+                    }
+                    if (config.deterministic) {
+                        ordered.add(partial, idx, 1, [&](ArrayXcd const& p, idx_t) { sum += p; });
+                    }
+                    pool::release(r0);
+                    compute.progress_update(1, m->num_vectors);
+                }
+
+                if (config.deterministic) { return; }
+                std::lock_guard<std::mutex> lk(mutex);
+                sum += partial;
+            });
+        }
+
+        pool.join();
+        m->data = std::move(sum);
+    }
+
+    /// Add the contribution of the random starter `r0` to the `partial` result of each of
+    /// the `m.products`. The left operators are processed in SIMD batches (or as a single
+    /// vector if there's only one): the right vectors are computed once per batch and block
+    /// and they are shared by all the products which involve the left operators of the batch.
+    /// If `is_fused`, all the right operators are applied in a single sweep of their shared
+    /// sparsity pattern, see `fused_products()`.
+    void dense_matrix_products(BatchDenseMatrixMoments const& m, VectorX<scalar_t> const& r0,
+                               std::vector<SparseMatrixX<scalar_t> const*> const& ops_l,
+                               std::vector<SparseMatrixX<scalar_t> const*> const& ops_r,
+                               bool is_fused, std::vector<MatrixX<scalar_t>>& partial,
+                               idx_t num_threads, double starter_time) const {
+        constexpr auto batch_size = static_cast<idx_t>(simd::traits<scalar_t>::size);
+        auto const num_left = static_cast<idx_t>(ops_l.size());
+        auto const block_size = (m.num_moments + m.num_blocks() - 1) / m.num_blocks();
+        auto const apply = [](SparseMatrixX<scalar_t> const* op, VectorX<scalar_t> const& v) {
+            return op ? (*op * v).eval() : v;
+        };
+
+        // Every filled left block is multiplied by all the right blocks. The right vectors
+        // are regenerated from the starter `r0` for each left block. Without blocking,
+        // there's just one left block and a single pass on the right. The right blocks are
+        // transposed: column `j` of `right_t[r]` is `op_r * v_j` for each vector `v_j`.
+        auto right = DenseMatrixBlockCollector<scalar_t>(m.num_moments, block_size, oh, {});
+        auto right_t = std::vector<MatrixX<scalar_t>>(ops_r.size());
+        auto multiply = [&](std::vector<MatrixX<scalar_t> const*> const& left_blocks,
+                            idx_t first_left, idx_t left_start, idx_t left_rows) {
+            right.process = [&](idx_t right_start, idx_t right_rows) {
+                auto const block = right.block.topRows(right_rows);
+                auto const is_used = [&](BatchDenseMatrixMoments::Product const& product) {
+                    auto const l = product.left - first_left;
+                    return l >= 0 && l < static_cast<idx_t>(left_blocks.size());
+                };
+                if (is_fused) { fused_products(ops_r, block, right_t); }
+
+                for (auto r = size_t{0}; r < ops_r.size(); ++r) {
+                    auto is_computed = is_fused;
+                    for (auto p = size_t{0}; p < m.products.size(); ++p) {
+                        auto const& product = m.products[p];
+                        if (product.right != static_cast<idx_t>(r) || !is_used(product)) {
+                            continue;
+                        }
+
+                        if (!is_computed) {
+                            if (ops_r[r]) {
+                                right_t[r] = *ops_r[r] * block.transpose();
+                            } else {
+                                right_t[r] = block.transpose();
+                            }
+                            is_computed = true;
+                        }
+                        auto const l = product.left - first_left;
+                        partial[p].block(left_start, right_start, left_rows, right_rows) +=
+                            left_blocks[l]->topRows(left_rows) * right_t[r].conjugate();
+                    }
+                }
+            };
+            from(right, r0, num_threads);
+        };
+
+        if (num_left == 1) {
+            auto left = DenseMatrixBlockCollector<scalar_t>(m.num_moments, block_size, oh, {});
+            left.process = [&](idx_t start, idx_t rows) {
+                multiply({&left.block}, 0, start, rows);
+            };
+            from(left, apply(ops_l[0], r0), num_threads, starter_time);
+            return;
+        }
+
+        for (auto first = idx_t{0}; first < num_left; first += batch_size) {
+            auto const n = std::min(batch_size, num_left - first);
+            auto r0_l = MatrixX<scalar_t>::Zero(r0.size(), batch_size).eval();
+            for (auto k = idx_t{0}; k < n; ++k) {
+                r0_l.col(k) = apply(ops_l[first + k], r0);
+            }
+
+            auto left = BatchDenseMatrixBlockCollector<scalar_t>(m.num_moments, block_size, n, oh);
+            auto left_blocks = std::vector<MatrixX<scalar_t> const*>();
+            for (auto const& block : left.blocks) { left_blocks.push_back(&block); }
+            left.process = [&](idx_t start, idx_t rows) {
+                multiply(left_blocks, first, start, rows);
+            };
+            from<BatchOffDiagonalCollector<scalar_t>>(left, std::move(r0_l), num_threads,
+                                                      starter_time);
+            starter_time = 0; // only counted once
+        }
+    }
+};
+
+/**
+ The members of `DefaultCompute::multi_moments()` in groups as wide as a SIMD batch: each group
+ is a `MultiEllMatrix` and there's one job for each group and index. All the columns of the
+ starter batch are the same unit vector, so column `k` is the recursion of member `k`.
+ */
+struct MultiMoments {
+    std::vector<VariantCSR> const& members;
+    SliceMap const& map;
+    Indices const& idx;
+    idx_t num_moments;
+    AlgorithmConfig const& config;
+    DefaultCompute const& compute;
+
+    template<class scalar_t>
+    std::vector<BatchData> operator()(SparseMatrixX<scalar_t> const&) const {
+        constexpr auto batch_size = static_cast<idx_t>(simd::traits<scalar_t>::size);
+        auto const num_members = static_cast<idx_t>(members.size());
+        auto const num_indices = static_cast<idx_t>(idx.src.size());
+
+        auto groups = std::vector<num::MultiEllMatrix<scalar_t>>();
+        for (auto first = idx_t{0}; first < num_members; first += batch_size) {
+            auto csr = std::vector<SparseMatrixX<scalar_t> const*>();
+            for (auto k = first; k < std::min(first + batch_size, num_members); ++k) {
+                csr.push_back(&members[k].template get<scalar_t>());
+            }
+            groups.push_back(num::csr_to_multi_ell(csr, batch_size));
+            if (!groups.back()) {
+                throw std::invalid_argument("KPM: the Hamiltonians must have the same sparsity "
+                                            "pattern.");
+            }
+        }
+
+        auto data = std::vector<ArrayXX<scalar_t>>(static_cast<size_t>(num_members),
+                                                   ArrayXX<scalar_t>(num_moments, num_indices));
+        auto const num_jobs = static_cast<idx_t>(groups.size()) * num_indices;
+        ThreadPool pool(compute.get_num_threads(), compute.get_affinity());
+        auto const progress = compute.progress_scope(num_jobs);
+
+        for (auto g = size_t{0}; g < groups.size(); ++g) {
+            for (auto i = idx_t{0}; i < num_indices; ++i) {
+                pool.add([&, g, i]() {
+                    simd::scope_disable_denormals guard;
+                    auto const span = trace::Span("job", "kpm");
+                    auto const start = Clock::now();
+                    auto const& h2 = groups[g];
+
+                    // Only the part of the unit vectors which the recursion touches is zeroed
+                    auto const support = config.optimal_size
+                                         ? std::min(map.support_size(num_moments), h2.rows())
+                                         : h2.rows();
+                    auto const rows = config.optimal_size ? map.reach_size(1) : h2.rows();
+                    auto r0 = MatrixX<scalar_t>(h2.rows(), batch_size);
+                    r0.topRows(support).setZero();
+                    r0.row(idx.src[i]).setOnes();
+                    auto r1 = MatrixX<scalar_t>();
+                    make_unit_r1(h2, r0, r1, rows, support, calc_moments::Serial{});
+
+                    auto collect = BatchDiagonalCollector<scalar_t>(num_moments, batch_size);
+                    collect.initial(r0.topRows(support), r1.topRows(support));
+                    calc_moments::basic(collect, r0, r1, h2, map, config.optimal_size);
+
+                    auto const first = static_cast<idx_t>(g) * batch_size;
+                    auto const count = std::min(batch_size, num_members - first);
+                    for (auto k = idx_t{0}; k < count; ++k) {
+                        data[first + k].col(i) = collect.moments.col(k);
+                    }
+                    compute.profile_record(0, seconds(Clock::now() - start), 0,
+                                           num_moments * count);
+                    compute.progress_update(1, num_jobs);
+                });
+            }
+        }
+
+        pool.join();
+        auto result = std::vector<BatchData>();
+        for (auto& d : data) { result.emplace_back(std::move(d)); }
+        return result;
+    }
+};
+
+struct SelectMatrix {
+    MomentsRef m;
+    Starter const& s;
+    AlgorithmConfig const& ac;
+    OptimizedHamiltonian const& oh;
+    DefaultCompute const& compute;
+    SparseBackendBase const* backend;
+
+    template<class Matrix>
+    void operator()(Matrix const& h2) {
+        auto const b = csr_backend(h2, backend);
+        var::apply_visitor(SelectAlgorithm<Matrix>{h2, s, ac, oh, compute, b}, m);
+    }
+};
+
+} // anonymous namespace
+
+namespace dispatch { namespace CPB_DISPATCH_NAMESPACE {
+
+void moments(MomentsRef m, Starter const& s, AlgorithmConfig const& ac,
+             OptimizedHamiltonian const& oh, DefaultCompute const& compute) {
+    auto const backend = compute.sparse_backend(oh); // kept alive for the whole calculation
+    var::apply_visitor(SelectMatrix{std::move(m), s, ac, oh, compute, backend.get()},
+                       oh.matrix());
+}
+
+std::vector<BatchData> multi_moments(std::vector<VariantCSR> const& members,
+                                     SliceMap const& map, Indices const& idx, idx_t num_moments,
+                                     AlgorithmConfig const& ac, DefaultCompute const& compute) {
+    return members.front().match(MultiMoments{members, map, idx, num_moments, ac, compute});
+}
+
+struct MinMaxEigenvalues {
+    double precision_percent;
+    idx_t num_threads;
+    double coarse_percent;
+
+    template<class scalar_t>
+    compute::LanczosBounds operator()(SparseMatrixRC<scalar_t> const& ph) const {
+        return compute::minmax_eigenvalues(*ph, precision_percent, num_threads, coarse_percent);
+    }
+};
+
+compute::LanczosBounds minmax_eigenvalues(Hamiltonian const& h, double precision_percent,
+                                          idx_t num_threads, double coarse_percent) {
+    return h.get_variant().match(MinMaxEigenvalues{precision_percent, num_threads,
+                                                   coarse_percent});
+}
+
+struct LanczosRecursion {
+    idx_t index;
+    idx_t max_steps;
+    compute::LanczosStop const& stop;
+
+    template<class scalar_t>
+    compute::LanczosCoefficients operator()(SparseMatrixRC<scalar_t> const& ph) const {
+        return compute::lanczos_coefficients(*ph, index, max_steps, stop);
+    }
+};
+
+compute::LanczosCoefficients lanczos_coefficients(Hamiltonian const& h, idx_t index,
+                                                  idx_t max_steps,
+                                                  compute::LanczosStop const& stop) {
+    return h.get_variant().match(LanczosRecursion{index, max_steps, stop});
+}
+
+/// Constant initialization: nothing from this build runs before the CPU has been checked
+extern Kernels const kernels;
+Kernels const kernels = {simd::instruction_set(), &moments, &multi_moments,
+                         &minmax_eigenvalues, &lanczos_coefficients};
+
+}} // namespace dispatch::CPB_DISPATCH_NAMESPACE
+
+}} // namespace cpb::kpm
@@ -0,0 +1,232 @@
+#include "kpm/distributed/Compute.hpp"
+#include "BinaryFile.hpp"
+
+#include <cstdio>
+
+namespace cpb { namespace kpm {
+
+namespace {
+
+/// Number of vectors out of `total` which belong to process `rank`
+idx_t local_share(idx_t total, Communicator const& comm) {
+    return total / comm.size() + (comm.rank() < total % comm.size() ? 1 : 0);
+}
+
+/// Produce only the share of vectors which belongs to this process, see `DistributedCompute`
+Starter local_starter(Starter const& starter, Communicator const& comm) {
+    auto const rank = comm.rank();
+    auto const size = comm.size();
+    auto fill = Starter::Fill{};
+    if (starter.fill) {
+        fill = [&starter, rank, size](var::complex<StarterData> data, idx_t index) {
+            starter.fill(data, index * size + rank);
+        };
+    }
+    return {[&starter, rank, size](var::scalar_tag tag, idx_t index) {
+        return starter.make(tag, index * size + rank);
+    }, starter.vector_size, starter.is_concurrent, std::move(fill)};
+}
+
+/// The allreduce is done in complex double precision for all scalar types
+void allreduce_sum(Communicator const& comm, std::complex<double>* data, idx_t size) {
+    comm.allreduce_sum(reinterpret_cast<double*>(data), 2 * size);
+}
+
+/// Place the local moment vectors into the columns of the global `result`
+struct ScatterColumns {
+    ArrayXXcd& result;
+    Communicator const& comm;
+
+    template<class scalar_t>
+    void operator()(ArrayX<scalar_t> const& local) const {
+        result.col(comm.rank()) = local.template cast<std::complex<double>>();
+    }
+
+    template<class scalar_t>
+    void operator()(ArrayXX<scalar_t> const& local) const {
+        for (auto i = idx_t{0}; i < local.cols(); ++i) {
+            auto const j = comm.rank() + i * comm.size();
+            result.col(j) = local.col(i).template cast<std::complex<double>>();
+        }
+    }
+};
+
+/// Add the moments of every vector to the original collection in the original order
+struct CollectColumns {
+    BatchDiagonalMoments& m;
+    ArrayXXcd const& all;
+    bool mixed_precision;
+
+    template<class scalar_t>
+    void operator()(var::tag<scalar_t>) const {
+        if (mixed_precision) {
+            collect<num::get_double_t<scalar_t>>();
+        } else {
+            collect<scalar_t>();
+        }
+    }
+
+    template<class moment_t>
+    void collect() const {
+        for (auto j = idx_t{0}; j < all.cols(); ++j) {
+            auto const column = num::force_cast<moment_t>(VectorXcd(all.col(j).matrix()));
+            m.add(ArrayX<moment_t>(column.array()), j);
+        }
+    }
+};
+
+/// Sum the partial moment products of all the processes
+struct ReduceMatrix {
+    Communicator const& comm;
+
+    template<class scalar_t>
+    var::complex<MatrixX> operator()(MatrixX<scalar_t> const& local) const {
+        auto sum = MatrixXcd(local.template cast<std::complex<double>>());
+        allreduce_sum(comm, sum.data(), sum.size());
+        return num::force_cast<scalar_t>(sum);
+    }
+};
+
+/// The contribution of a process without any vectors
+struct ZeroArray {
+    idx_t rows, cols;
+
+    template<class scalar_t>
+    var::complex<ArrayXX> operator()(var::tag<scalar_t>) const {
+        return ArrayXX<scalar_t>::Zero(rows, cols).eval();
+    }
+};
+
+/// Sum the partial local moments of all the processes
+struct ReduceArray {
+    Communicator const& comm;
+
+    template<class scalar_t>
+    var::complex<ArrayXX> operator()(ArrayXX<scalar_t> const& local) const {
+        auto sum = ArrayXXcd(local.template cast<std::complex<double>>());
+        allreduce_sum(comm, sum.data(), sum.size());
+        return ArrayXX<scalar_t>(num::force_cast<scalar_t>(MatrixXcd(sum.matrix())).array());
+    }
+};
+
+struct Distribute {
+    Starter const& s;
+    AlgorithmConfig const& ac;
+    OptimizedHamiltonian const& oh;
+    Compute const& local;
+    Communicator const& comm;
+
+    void operator()(BatchDiagonalMoments* m) const {
+        if (m->checkpoint) {
+            throw std::runtime_error("Distributed KPM: checkpoints are not supported, "
+                                     "the vectors are spread over all the processes.");
+        }
+        auto const num_local = local_share(m->num_vectors, comm);
+        auto moments = BatchDiagonalMoments(m->num_moments, num_local, BatchConcatenator());
+        if (num_local > 0) {
+            local->moments(&moments, local_starter(s, comm), ac, oh);
+        }
+
+        auto all = ArrayXXcd::Zero(m->num_moments, m->num_vectors).eval();
+        if (num_local > 0) {
+            var::apply_visitor(ScatterColumns{all, comm}, moments.data);
+        }
+        allreduce_sum(comm, all.data(), all.size());
+        var::apply_visitor(CollectColumns{*m, all, oh.mixed_precision()}, oh.scalar_tag());
+    }
+
+    void operator()(BatchDenseMatrixMoments* m) const {
+        auto const num_local = local_share(m->num_vectors, comm);
+        auto moments = BatchDenseMatrixMoments(m->num_moments, num_local, m->ops_l, m->ops_r,
+                                               m->products, oh.scalar_tag(), m->block_size);
+        if (num_local > 0) {
+            local->moments(&moments, local_starter(s, comm), ac, oh);
+        }
+        for (auto i = size_t{0}; i < m->results.size(); ++i) {
+            m->results[i].add(var::apply_visitor(ReduceMatrix{comm}, moments.results[i].data));
+        }
+    }
+
+    void operator()(KuboGreenwoodMoments* m) const {
+        auto const num_local = local_share(m->num_vectors, comm);
+        auto moments = KuboGreenwoodMoments(num_local, m->op, m->coefficients,
+                                            m->energies_per_pass);
+        if (num_local > 0) {
+            local->moments(&moments, local_starter(s, comm), ac, oh);
+        }
+        allreduce_sum(comm, moments.data.data(), moments.data.size());
+        m->data = std::move(moments.data);
+    }
+
+    void operator()(LocalMoments* m) const {
+        auto const num_local = local_share(m->num_vectors, comm);
+        auto moments = LocalMoments(m->num_moments, num_local, m->idx, m->columns,
+                                    m->num_columns);
+        if (num_local > 0) {
+            local->moments(&moments, local_starter(s, comm), ac, oh);
+        } else {
+            moments.data = var::apply_visitor(ZeroArray{m->num_moments, m->num_columns},
+                                              oh.scalar_tag());
+        }
+        m->data = var::apply_visitor(ReduceArray{comm}, moments.data);
+    }
+
+    template<class M>
+    void operator()(M* m) const {
+        local->moments(m, s, ac, oh);
+    }
+};
+
+} // anonymous namespace
+
+DistributedCompute::DistributedCompute(Compute local,
+                                       std::shared_ptr<Communicator const> communicator)
+    : local(std::move(local)), comm(std::move(communicator)) {}
+
+void DistributedCompute::moments(MomentsRef m, Starter const& s, AlgorithmConfig const& ac,
+                                 OptimizedHamiltonian const& oh) const {
+    if (comm->size() <= 1) {
+        return local->moments(std::move(m), s, ac, oh);
+    }
+    var::apply_visitor(Distribute{s, ac, oh, local, *comm}, m);
+}
+
+MappedHamiltonian share_hamiltonian(Model const& model, std::string const& path,
+                                    Communicator const& node) {
+    auto const is_leader = node.rank() == 0;
+    auto failed = 0.0; // the sum is also a barrier: all the processes wait for the leader
+    auto message = std::string();
+    auto const check = [&](char const* what) {
+        node.allreduce_sum(&failed, 1);
+        if (failed == 0) { return; }
+        if (is_leader) { std::remove(path.c_str()); }
+        throw std::runtime_error(!message.empty() ? message
+                                                  : "KPM: the shared Hamiltonian " + path
+                                                    + " couldn't be " + what);
+    };
+
+    if (is_leader) {
+        try {
+            binary::save(path, *model.system(), model.hamiltonian());
+        } catch (std::exception const& e) {
+            failed = 1;
+            message = e.what();
+        }
+    }
+    check("saved by the leader");
+
+    auto result = std::vector<MappedHamiltonian>();
+    try {
+        result.push_back(binary::map_hamiltonian(path));
+    } catch (std::exception const& e) {
+        failed = 1;
+        message = e.what();
+    }
+    check("mapped by all the processes"); // the leader removes the file after this
+
+    // The existing mappings remain valid: the memory is released after the last one is closed
+    if (is_leader) { std::remove(path.c_str()); }
+    return result.front();
+}
+
+}} // namespace cpb::kpm
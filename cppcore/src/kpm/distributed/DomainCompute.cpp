@@ -0,0 +1,304 @@
+#include "kpm/distributed/DomainCompute.hpp"
+#include "kpm/default/collectors.hpp"
+#include "kpm/calc_moments.hpp"
+
+#include <algorithm>
+
+namespace cpb { namespace kpm {
+
+namespace {
+
+using Domain = DomainCompute::Domain;
+constexpr auto row_alignment = calc_moments::Parallel::row_alignment;
+
+/// Split the reordered rows into `comm.size()` domains with about the same number of non-zeros
+/// and find the halo rows, i.e. the ones which are referenced by another domain
+std::shared_ptr<Domain const> make_domain(OptimizedHamiltonian const& oh,
+                                          Communicator const& comm) {
+    auto const& h = oh.original();
+    if (!h) {
+        throw std::runtime_error("Domain KPM: the Hamiltonian must be in memory, "
+                                 "not out-of-core.");
+    }
+    auto const csr = h.csrref();
+    auto const size = idx_t{csr.rows};
+    auto const num_domains = comm.size();
+
+    auto row_nnz = std::vector<idx_t>(static_cast<size_t>(size));
+    for (auto i = idx_t{0}; i < size; ++i) {
+        row_nnz[oh.reordered_index(i)] = csr.indptr[i + 1] - csr.indptr[i];
+    }
+
+    // Domain `d` has the rows `[borders[d], borders[d + 1])`: aligned like the SIMD kernels
+    auto borders = std::vector<idx_t>(static_cast<size_t>(num_domains + 1), size);
+    borders[0] = 0;
+    auto const total = idx_t{csr.nnz};
+    auto sum = idx_t{0};
+    auto d = idx_t{1};
+    for (auto row = idx_t{0}; row < size; row += row_alignment) {
+        while (d < num_domains && sum * num_domains >= d * total) { borders[d++] = row; }
+        auto const end = std::min(row + row_alignment, size);
+        for (auto r = row; r < end; ++r) { sum += row_nnz[r]; }
+    }
+
+    auto is_halo = std::vector<bool>(static_cast<size_t>(size), false);
+    for (auto i = idx_t{0}; i < size; ++i) {
+        auto const row = oh.reordered_index(i);
+        auto const it = std::upper_bound(borders.begin(), borders.end(), row) - 1;
+        auto const first = *it;
+        auto const last = *(it + 1);
+        for (auto n = csr.indptr[i]; n < csr.indptr[i + 1]; ++n) {
+            auto const col = oh.reordered_index(csr.indices[n]);
+            if (col < first || col >= last) { is_halo[col] = true; }
+        }
+    }
+
+    auto domain = std::make_shared<Domain>();
+    domain->start = borders[comm.rank()];
+    domain->end = borders[comm.rank() + 1];
+    for (auto row = idx_t{0}; row < size; ++row) {
+        if (is_halo[row]) { domain->halo.push_back(static_cast<storage_idx_t>(row)); }
+        auto const num_halo = static_cast<idx_t>(domain->halo.size());
+        if (row < domain->start) { domain->halo_start = num_halo; }
+        if (row < domain->end) { domain->halo_end = num_halo; }
+    }
+
+    // The blocks of owned rows which contain any halo rows are on the surface of the domain
+    for (auto row = domain->start; row < domain->end; row += row_alignment) {
+        auto const block_end = std::min(row + row_alignment, domain->end);
+        auto on_surface = false;
+        for (auto r = row; r < block_end; ++r) { on_surface = on_surface || is_halo[r]; }
+
+        auto& ranges = on_surface ? domain->surface : domain->interior;
+        auto const max_rows = on_surface ? size : DomainCompute::block_rows;
+        if (!ranges.empty() && ranges.back().second == row
+            && block_end - ranges.back().first <= max_rows) {
+            ranges.back().second = block_end;
+        } else {
+            ranges.emplace_back(row, block_end);
+        }
+    }
+    return domain;
+}
+
+/// The scalars are exchanged as 1 (real) or 2 (complex) doubles
+template<class scalar_t>
+constexpr idx_t num_doubles() { return num::is_complex<scalar_t>() ? 2 : 1; }
+
+template<class real_t>
+void store(real_t value, double* out) { out[0] = static_cast<double>(value); }
+
+template<class real_t>
+void store(std::complex<real_t> value, double* out) {
+    out[0] = static_cast<double>(value.real());
+    out[1] = static_cast<double>(value.imag());
+}
+
+template<class real_t>
+void load(double const* in, real_t& value) { value = static_cast<real_t>(in[0]); }
+
+template<class real_t>
+void load(double const* in, std::complex<real_t>& value) {
+    value = {static_cast<real_t>(in[0]), static_cast<real_t>(in[1])};
+}
+
+/// Sum the values of the vector `v` over all the processes for the `indices` in `[start, end)`:
+/// the other processes get this one's value and the other `indices` get the others' values
+template<class Vector, class Rows>
+void exchange(Vector& v, Rows const& indices, idx_t start, idx_t end,
+              Communicator const& comm, std::vector<double>& buffer) {
+    constexpr auto w = num_doubles<typename Vector::Scalar>();
+    auto const size = static_cast<idx_t>(indices.size());
+    buffer.assign(static_cast<size_t>(size * w), 0.0);
+    for (auto i = start; i < end; ++i) { store(v[indices[i]], &buffer[i * w]); }
+    comm.allreduce_sum(buffer.data(), size * w);
+    for (auto i = idx_t{0}; i < start; ++i) { load(&buffer[i * w], v[indices[i]]); }
+    for (auto i = end; i < size; ++i) { load(&buffer[i * w], v[indices[i]]); }
+}
+
+/// All the rows of the vector, from their owners
+struct AllRows {
+    idx_t operator[](idx_t i) const { return i; }
+    size_t size() const { return static_cast<size_t>(rows); }
+    idx_t rows;
+};
+
+/**
+ The `calc_moments` policy: the Chebyshev step of this process's domain, see `DomainCompute`
+ */
+struct DomainSpmv {
+    Domain const& domain;
+    Communicator const& comm;
+    ThreadTeam& team;
+    std::vector<double>& buffer;
+
+    template<class Matrix, class Vector, class Value>
+    void operator()(idx_t, idx_t, Matrix const& h2, Vector const& x, Vector& y,
+                    Value& m2, Value& m3) const {
+        using calc_moments::detail::spmv_diagonal;
+        using calc_moments::detail::accumulate;
+
+        // The rows which the other processes need for the next step go first
+        for (auto const& range : domain.surface) {
+            spmv_diagonal(range.first, range.second, h2, x, y, m2, m3);
+        }
+
+        // The interior is computed while they are sent: it only reads `x`
+        auto const& interior = domain.interior;
+        auto partial_m2 = std::vector<Value>(interior.size(), Value{});
+        auto partial_m3 = partial_m2;
+        auto const num_workers = std::max(team.size() - 1, idx_t{1});
+        team.run([&](idx_t thread_id) {
+            if (thread_id == 0) {
+                exchange(y, domain.halo, domain.halo_start, domain.halo_end, comm, buffer);
+                if (team.size() > 1) { return; }
+            }
+
+            auto const first = (team.size() > 1) ? thread_id - 1 : 0;
+            for (auto i = first; i < static_cast<idx_t>(interior.size()); i += num_workers) {
+                auto local_m2 = Value{}, local_m3 = Value{};
+                spmv_diagonal(interior[i].first, interior[i].second, h2, x, y,
+                              local_m2, local_m3);
+                partial_m2[i] = local_m2;
+                partial_m3[i] = local_m3;
+            }
+        });
+
+        for (auto i = size_t{0}; i < interior.size(); ++i) {
+            accumulate(m2, partial_m2[i]);
+            accumulate(m3, partial_m3[i]);
+        }
+
+        // The moments are sums over all the domains
+        constexpr auto w = num_doubles<Value>();
+        double sums[2 * w];
+        store(m2, sums);
+        store(m3, sums + w);
+        comm.allreduce_sum(sums, 2 * w);
+        load(sums, m2);
+        load(sums + w, m3);
+    }
+};
+
+template<class Matrix>
+struct DomainMoments {
+    using scalar_t = typename Matrix::Scalar;
+    using Vector = VectorX<scalar_t>;
+
+    Matrix const& h2;
+    Starter const& starter;
+    AlgorithmConfig const& config;
+    OptimizedHamiltonian const& oh;
+    Domain const& domain;
+    Communicator const& comm;
+    ThreadTeam& team;
+
+    /// Compute the moments of the next vector produced by the starter.
+    /// Returns the index of the vector within the starter sequence.
+    template<class Collector>
+    idx_t with(Collector& collect) const {
+        auto buffer = std::vector<double>();
+        auto idx = idx_t{0};
+        auto r0 = make_r0(starter, var::tag<Vector>{}, 1, idx);
+
+        // r1 = h2 * r0 * 0.5: the owned rows are computed and then shared with everyone
+        auto r1 = Vector::Zero(r0.size()).eval();
+        compute::kpm_spmv(domain.start, domain.end, h2, r0, r1);
+        r1.segment(domain.start, domain.end - domain.start) *= scalar_t{0.5};
+        exchange(r1, AllRows{r1.size()}, domain.start, domain.end, comm, buffer);
+        collect.initial(r0, r1);
+
+        calc_moments::basic(collect, r0, r1, h2, oh.map(), /*opt_size*/false,
+                            DomainSpmv{domain, comm, team, buffer});
+        return idx;
+    }
+
+    void operator()(DiagonalMoments* m) const {
+        if (m->checkpoint) { throw_unsupported(); }
+        if (oh.mixed_precision()) {
+            diagonal<num::get_double_t<scalar_t>>(m);
+        } else {
+            diagonal<scalar_t>(m);
+        }
+    }
+
+    template<class moment_t>
+    void diagonal(DiagonalMoments* m) const {
+        auto collect = DiagonalCollector<scalar_t, moment_t>(m->num_moments);
+        with(collect);
+        m->data = std::move(collect.moments);
+    }
+
+    void operator()(BatchDiagonalMoments* m) const {
+        if (m->checkpoint) { throw_unsupported(); }
+        if (oh.mixed_precision()) {
+            batch_diagonal<num::get_double_t<scalar_t>>(m);
+        } else {
+            batch_diagonal<scalar_t>(m);
+        }
+    }
+
+    /// The moments and the stopping condition are the same on all the processes
+    template<class moment_t>
+    void batch_diagonal(BatchDiagonalMoments* m) const {
+        for (auto i = idx_t{0}; i < m->num_vectors && !m->is_stopped(); ++i) {
+            auto collect = DiagonalCollector<scalar_t, moment_t>(m->num_moments);
+            collect.convergence.tolerance = config.convergence_tolerance;
+            auto const idx = with(collect);
+            m->add(collect.moments, idx);
+            if (collect.is_converged()) { m->skip(1, collect.convergence.size); }
+        }
+    }
+
+    template<class M>
+    void operator()(M*) const { throw_unsupported(); }
+
+    [[noreturn]] static void throw_unsupported() {
+        throw std::runtime_error("Domain KPM: only the diagonal moments (LDOS and stochastic "
+                                 "DOS) without checkpoints are supported.");
+    }
+};
+
+struct SelectMatrix {
+    MomentsRef m;
+    Starter const& s;
+    AlgorithmConfig const& ac;
+    OptimizedHamiltonian const& oh;
+    Domain const& domain;
+    Communicator const& comm;
+    ThreadTeam& team;
+
+    template<class Matrix>
+    void operator()(Matrix const& h2) {
+        var::apply_visitor(DomainMoments<Matrix>{h2, s, ac, oh, domain, comm, team}, m);
+    }
+};
+
+} // anonymous namespace
+
+constexpr idx_t DomainCompute::block_rows;
+
+DomainCompute::DomainCompute(std::shared_ptr<Communicator const> communicator,
+                             idx_t num_threads)
+    : comm(std::move(communicator)), num_threads(num_threads),
+      cache(std::make_shared<Cache>()) {}
+
+void DomainCompute::moments(MomentsRef m, Starter const& s, AlgorithmConfig const& ac,
+                            OptimizedHamiltonian const& oh) const {
+    simd::scope_disable_denormals guard;
+    auto const d = domain(oh);
+    ThreadTeam team(get_num_threads());
+    var::apply_visitor(SelectMatrix{std::move(m), s, ac, oh, *d, *comm, team}, oh.matrix());
+}
+
+std::shared_ptr<DomainCompute::Domain const>
+DomainCompute::domain(OptimizedHamiltonian const& oh) const {
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    if (!cache->domain || cache->revision != oh.revision()) {
+        cache->domain = make_domain(oh, *comm);
+        cache->revision = oh.revision();
+    }
+    return cache->domain;
+}
+
+}} // namespace cpb::kpm
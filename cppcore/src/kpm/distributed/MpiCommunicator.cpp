@@ -0,0 +1,58 @@
+#include "kpm/distributed/MpiCommunicator.hpp"
+
+#include <climits>
+#include <cstdlib>
+
+namespace cpb { namespace kpm {
+
+namespace {
+    void check(int error_code) {
+        if (error_code != MPI_SUCCESS) {
+            throw std::runtime_error("MPI: communication error " + std::to_string(error_code));
+        }
+    }
+} // anonymous namespace
+
+MpiCommunicator::MpiCommunicator(MPI_Comm comm) : comm(comm) {
+    auto is_initialized = 0;
+    check(MPI_Initialized(&is_initialized));
+    if (!is_initialized) {
+        check(MPI_Init(nullptr, nullptr));
+        std::atexit([] {
+            auto is_finalized = 0;
+            MPI_Finalized(&is_finalized);
+            if (!is_finalized) { MPI_Finalize(); }
+        });
+    }
+}
+
+MpiCommunicator MpiCommunicator::node(MPI_Comm comm) {
+    auto const all = MpiCommunicator(comm); // initializes MPI if needed
+    auto node_comm = MPI_Comm();
+    check(MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, static_cast<int>(all.rank()),
+                              MPI_INFO_NULL, &node_comm));
+    return MpiCommunicator(node_comm);
+}
+
+idx_t MpiCommunicator::rank() const {
+    auto rank = 0;
+    check(MPI_Comm_rank(comm, &rank));
+    return rank;
+}
+
+idx_t MpiCommunicator::size() const {
+    auto size = 0;
+    check(MPI_Comm_size(comm, &size));
+    return size;
+}
+
+void MpiCommunicator::allreduce_sum(double* data, idx_t size) const {
+    // The MPI element count is an `int`: split very large buffers
+    constexpr auto max_count = idx_t{INT_MAX};
+    for (auto start = idx_t{0}; start < size; start += max_count) {
+        auto const count = static_cast<int>(std::min(size - start, max_count));
+        check(MPI_Allreduce(MPI_IN_PLACE, data + start, count, MPI_DOUBLE, MPI_SUM, comm));
+    }
+}
+
+}} // namespace cpb::kpm
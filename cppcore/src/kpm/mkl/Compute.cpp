@@ -0,0 +1,135 @@
+#include "kpm/mkl/Compute.hpp"
+
+#include "compute/mkl/wrapper.hpp"
+#include "support/simd.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+namespace cpb { namespace kpm {
+
+namespace {
+
+/// The handle is reused for all the moments of all the vectors: tune it for many products
+constexpr auto expected_calls = 1000;
+
+void check(sparse_status_t status) {
+    if (status != SPARSE_STATUS_SUCCESS) {
+        throw std::runtime_error{"MKL sparse error: " + std::to_string(status)};
+    }
+}
+
+/// Same value as the corresponding MKL C API type
+template<class scalar_t>
+mkl::type<scalar_t> to_mkl(scalar_t value) {
+    auto result = mkl::type<scalar_t>();
+    std::memcpy(&result, &value, sizeof(result));
+    return result;
+}
+
+template<class scalar_t>
+mkl::type<scalar_t>* to_mkl(scalar_t* p) { return reinterpret_cast<mkl::type<scalar_t>*>(p); }
+
+template<class scalar_t>
+mkl::type<scalar_t> const* to_mkl(scalar_t const* p) {
+    return reinterpret_cast<mkl::type<scalar_t> const*>(p);
+}
+
+/**
+ MKL sparse handle of the optimized CSR matrix
+
+ The handle points to the arrays of `h2`, it doesn't copy them. MKL may keep its own tuned
+ copy after `mkl_sparse_optimize()`, so the handle is only valid for one `revision()`.
+ */
+template<class scalar_t>
+class MklCsr : public SparseBackend<scalar_t> {
+public:
+    explicit MklCsr(SparseMatrixX<scalar_t> const& h2) {
+        descr.type = SPARSE_MATRIX_TYPE_GENERAL;
+        auto const indptr = const_cast<MKL_INT*>(h2.outerIndexPtr());
+        auto const indices = const_cast<MKL_INT*>(h2.innerIndexPtr());
+        auto const values = const_cast<scalar_t*>(h2.valuePtr());
+        check(mkl::sparse_create_csr<scalar_t>::call(
+            &handle, SPARSE_INDEX_BASE_ZERO, static_cast<MKL_INT>(h2.rows()),
+            static_cast<MKL_INT>(h2.cols()), indptr, indptr + 1, indices, to_mkl(values)
+        ));
+
+        constexpr auto batch_size = static_cast<MKL_INT>(simd::traits<scalar_t>::size);
+        check(mkl_sparse_set_mv_hint(handle, SPARSE_OPERATION_NON_TRANSPOSE, descr,
+                                     expected_calls));
+        check(mkl_sparse_set_mm_hint(handle, SPARSE_OPERATION_NON_TRANSPOSE, descr,
+                                     SPARSE_LAYOUT_ROW_MAJOR, batch_size, expected_calls));
+        check(mkl_sparse_optimize(handle));
+    }
+
+    ~MklCsr() override { mkl_sparse_destroy(handle); }
+
+    MklCsr(MklCsr const&) = delete;
+    MklCsr& operator=(MklCsr const&) = delete;
+
+    void spmv(VectorX<scalar_t> const& x, VectorX<scalar_t>& y) const override {
+        check(mkl::sparse_mv<scalar_t>::call(
+            SPARSE_OPERATION_NON_TRANSPOSE, to_mkl(scalar_t{1}), handle, descr,
+            to_mkl(x.data()), to_mkl(scalar_t{-1}), to_mkl(y.data())
+        ));
+    }
+
+    void spmv(MatrixX<scalar_t> const& x, MatrixX<scalar_t>& y) const override {
+        auto const cols = static_cast<MKL_INT>(x.cols()); // row-major: `cols` is the stride
+        check(mkl::sparse_mm<scalar_t>::call(
+            SPARSE_OPERATION_NON_TRANSPOSE, to_mkl(scalar_t{1}), handle, descr,
+            SPARSE_LAYOUT_ROW_MAJOR, to_mkl(x.data()), cols, cols, to_mkl(scalar_t{-1}),
+            to_mkl(y.data()), cols
+        ));
+    }
+
+private:
+    sparse_matrix_t handle = nullptr;
+    matrix_descr descr;
+};
+
+struct MakeHandle {
+    using Handle = std::shared_ptr<SparseBackendBase const>;
+
+    template<class scalar_t>
+    Handle operator()(SparseMatrixX<scalar_t> const& h2) const {
+        return std::make_shared<MklCsr<scalar_t>>(h2);
+    }
+
+    /// The other formats use the regular kernels
+    template<class Matrix>
+    Handle operator()(Matrix const&) const { return nullptr; }
+};
+
+} // anonymous namespace
+
+MklCompute::MklCompute(idx_t num_threads, ProgressCallback progress_callback)
+    : DefaultCompute(num_threads, std::move(progress_callback)),
+      handles(std::make_shared<Handles>()) {}
+
+void MklCompute::moments(MomentsRef m, Starter const& s, AlgorithmConfig const& ac,
+                         OptimizedHamiltonian const& oh) const {
+    auto config = ac;
+    config.interleaved = false;
+    config.matrix_powers = 1;
+    DefaultCompute::moments(std::move(m), s, config, oh);
+}
+
+std::shared_ptr<SparseBackendBase const>
+MklCompute::sparse_backend(OptimizedHamiltonian const& oh) const {
+    std::lock_guard<std::mutex> lock(handles->mutex);
+    auto& entries = handles->entries;
+    auto const it = std::find_if(entries.begin(), entries.end(), [&](Handles::Entry const& e) {
+        return e.first == oh.revision();
+    });
+    if (it != entries.end()) { return it->second; }
+
+    auto handle = var::apply_visitor(MakeHandle{}, oh.matrix());
+    if (!handle) { return nullptr; }
+    if (entries.size() >= Handles::max_size) { entries.erase(entries.begin()); } // the oldest
+    entries.emplace_back(oh.revision(), handle);
+    return handle;
+}
+
+}} // namespace cpb::kpm
@@ -1,7 +1,20 @@
 #include "leads/Leads.hpp"
 
+#include "detail/thread.hpp"
+#include "support/format.hpp"
+
+using namespace fmt::literals;
+
 namespace cpb {
 
+Lead Leads::operator[](size_t i) const {
+    auto const& pair = hamiltonians.at(i);
+    if (!pair) {
+        throw std::logic_error("The Hamiltonian of lead {} hasn't been built"_format(i));
+    }
+    return {specs.at(i), structures.at(i), *pair};
+}
+
 void Leads::create_attachment_area(Foundation& foundation) const {
     for (auto const& spec : specs) {
         leads::create_attachment_area(foundation, spec);
@@ -18,15 +31,25 @@ void Leads::make_structure(Foundation const& foundation) {
     }
 }
 
-void Leads::make_hamiltonian(Lattice const& lattice, HamiltonianModifiers const& modifiers,
+void Leads::make_hamiltonian(size_t i, Lattice const& lattice,
+                             HamiltonianModifiers const& modifiers,
                              bool is_double, bool is_complex) {
-    if (!hamiltonians.empty()) {
-        return;
+    hamiltonians.resize(structures.size());
+    auto& pair = hamiltonians.at(i);
+    if (!pair) {
+        pair = std::make_shared<leads::HamiltonianPair>(structures[i].system, lattice, modifiers,
+                                                        is_double, is_complex);
     }
+}
 
-    for (auto const& structure : structures) {
-        hamiltonians.emplace_back(structure.system, lattice, modifiers, is_double, is_complex);
-    }
+void Leads::make_hamiltonian(Lattice const& lattice, HamiltonianModifiers const& modifiers,
+                             bool is_double, bool is_complex, idx_t num_threads) {
+    hamiltonians.resize(structures.size());
+    auto const threads = modifiers.all_thread_safe() ? num_threads : idx_t{1};
+    // Each lead is built independently and the results go into separate slots
+    parallel_for_each(structures.size(), threads, [&](size_t i) {
+        make_hamiltonian(i, lattice, modifiers, is_double, is_complex);
+    });
 }
 
 void Leads::clear_structure() {
@@ -0,0 +1,137 @@
+#include "leads/SelfEnergy.hpp"
+#include "detail/thread.hpp"
+
+#include "support/format.hpp"
+
+#include <Eigen/LU>
+
+#include <algorithm>
+
+namespace cpb { namespace leads {
+
+namespace {
+
+struct ToDense {
+    template<class scalar_t>
+    MatrixXcd operator()(SparseMatrixRC<scalar_t> const& m) const {
+        return MatrixX<scalar_t>(*m).template cast<std::complex<double>>();
+    }
+};
+
+MatrixXcd to_dense(Hamiltonian const& h) {
+    return h.get_variant().match(ToDense{});
+}
+
+} // anonymous namespace
+
+SelfEnergy::SelfEnergy(Leads const& all_leads, double broadening, double tolerance,
+                       int max_iterations)
+    : broadening(broadening), tolerance(tolerance), max_iterations(max_iterations) {
+    leads.reserve(static_cast<size_t>(all_leads.size()));
+    for (auto i = 0; i < all_leads.size(); ++i) {
+        auto const lead = all_leads[i];
+        leads.push_back({to_dense(lead.h0()), to_dense(lead.h1()), {}});
+    }
+}
+
+std::vector<MatrixXcd> SelfEnergy::surface_greens(idx_t lead_index, ArrayXd const& energies,
+                                                  idx_t num_threads) const {
+    auto& lead = at(lead_index);
+
+    // Only the energies which are not yet cached are computed, each one at most once
+    auto missing = std::vector<double>();
+    {
+        std::lock_guard<std::mutex> lk(cache_mutex);
+        for (auto i = idx_t{0}; i < energies.size(); ++i) {
+            if (lead.cache.find(energies[i]) == lead.cache.end()) {
+                missing.push_back(energies[i]);
+            }
+        }
+    }
+    std::sort(missing.begin(), missing.end());
+    missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+
+    auto const threads = resolve_num_threads(num_threads);
+    auto results = std::vector<MatrixXcd>(missing.size());
+    parallel_for_each(missing.size(), std::min(threads, static_cast<idx_t>(missing.size())),
+                      [&](size_t n) { results[n] = decimate(lead, missing[n]); });
+
+    std::lock_guard<std::mutex> lk(cache_mutex);
+    for (auto n = size_t{0}; n < missing.size(); ++n) {
+        lead.cache.emplace(missing[n], std::move(results[n]));
+    }
+
+    auto greens = std::vector<MatrixXcd>();
+    greens.reserve(static_cast<size_t>(energies.size()));
+    for (auto i = idx_t{0}; i < energies.size(); ++i) {
+        greens.push_back(lead.cache.at(energies[i]));
+    }
+    return greens;
+}
+
+std::vector<MatrixXcd> SelfEnergy::self_energy(idx_t lead_index, ArrayXd const& energies,
+                                               idx_t num_threads) const {
+    auto greens = surface_greens(lead_index, energies, num_threads);
+    auto const& h1 = at(lead_index).h1;
+    for (auto& g : greens) {
+        g = h1.adjoint() * g * h1;
+    }
+    return greens;
+}
+
+idx_t SelfEnergy::cache_size() const {
+    std::lock_guard<std::mutex> lk(cache_mutex);
+    auto size = idx_t{0};
+    for (auto const& lead : leads) {
+        size += static_cast<idx_t>(lead.cache.size());
+    }
+    return size;
+}
+
+void SelfEnergy::clear_cache() {
+    std::lock_guard<std::mutex> lk(cache_mutex);
+    for (auto& lead : leads) {
+        lead.cache.clear();
+    }
+}
+
+MatrixXcd SelfEnergy::decimate(LeadData const& lead, double energy) const {
+    auto const size = lead.h0.rows();
+    MatrixXcd const z = std::complex<double>{energy, broadening}
+                        * MatrixXcd::Identity(size, size);
+
+    // Sancho-Rubio: `alpha` and `beta` are the effective couplings to the next remaining
+    // cell (forward and backward), which shrink as the intermediate cells are decimated
+    MatrixXcd surface = lead.h0;
+    MatrixXcd bulk = lead.h0;
+    MatrixXcd alpha = lead.h1.adjoint();
+    MatrixXcd beta = lead.h1;
+
+    for (auto i = 0; i < max_iterations; ++i) {
+        auto const lu = Eigen::PartialPivLU<MatrixXcd>(z - bulk);
+        MatrixXcd const g_alpha = lu.solve(alpha);
+        MatrixXcd const g_beta = lu.solve(beta);
+
+        MatrixXcd const alpha_g_beta = alpha * g_beta;
+        surface += alpha_g_beta;
+        bulk += alpha_g_beta + beta * g_alpha;
+        alpha = (alpha * g_alpha).eval();
+        beta = (beta * g_beta).eval();
+
+        if (alpha.cwiseAbs().maxCoeff() < tolerance && beta.cwiseAbs().maxCoeff() < tolerance) {
+            return Eigen::PartialPivLU<MatrixXcd>(z - surface).inverse();
+        }
+    }
+
+    throw std::runtime_error(fmt::format("The lead surface Green's function did not converge "
+                                         "at E = {} after {} iterations", energy, max_iterations));
+}
+
+SelfEnergy::LeadData& SelfEnergy::at(idx_t lead) const {
+    if (lead < 0 || lead >= size()) {
+        throw std::out_of_range(fmt::format("There is no lead with index {}", lead));
+    }
+    return leads[static_cast<size_t>(lead)];
+}
+
+}} // namespace cpb::leads
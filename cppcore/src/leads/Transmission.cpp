@@ -0,0 +1,188 @@
+#include "leads/Transmission.hpp"
+#include "detail/thread.hpp"
+
+#include "support/format.hpp"
+
+#include <Eigen/LU>
+
+#include <algorithm>
+#include <limits>
+
+namespace cpb { namespace leads {
+
+namespace {
+
+struct ToComplexDouble {
+    template<class scalar_t>
+    SparseMatrixXcd operator()(SparseMatrixRC<scalar_t> const& m) const {
+        return m->template cast<std::complex<double>>();
+    }
+};
+
+/// Subtract the lead `sigma` from `a` at the given local `indices`
+void subtract_at(MatrixXcd& a, MatrixXcd const& sigma, std::vector<int> const& indices) {
+    auto const size = static_cast<idx_t>(indices.size());
+    for (auto j = idx_t{0}; j < size; ++j) {
+        for (auto i = idx_t{0}; i < size; ++i) {
+            a(indices[i], indices[j]) -= sigma(i, j);
+        }
+    }
+}
+
+/// The lead coupling matrix `Gamma = i (Sigma - Sigma^dagger)`
+MatrixXcd broadening_matrix(MatrixXcd const& sigma) {
+    return std::complex<double>{0, 1} * (sigma - sigma.adjoint());
+}
+
+} // anonymous namespace
+
+Transmission::Transmission(Hamiltonian const& hamiltonian, Leads const& leads,
+                           idx_t from, idx_t to) : from(from), to(to) {
+    if (!hamiltonian) {
+        throw std::runtime_error("Transmission requires a non-empty Hamiltonian");
+    } else if (from == to) {
+        throw std::logic_error("Transmission requires two different leads");
+    }
+    auto const h = hamiltonian.get_variant().match(ToComplexDouble{});
+    auto const from_indices = leads[static_cast<size_t>(from)].indices();
+    auto const to_indices = leads[static_cast<size_t>(to)].indices();
+
+    // Breadth-first traversal from the `from` lead: `layer` is the distance in hoppings
+    auto const size = h.rows();
+    auto layer = ArrayXi::Constant(size, -1).eval();
+    auto queue = std::vector<storage_idx_t>();
+    queue.reserve(static_cast<size_t>(size));
+    for (auto const i : from_indices) {
+        if (layer[i] < 0) {
+            layer[i] = 0;
+            queue.push_back(i);
+        }
+    }
+    for (auto n = size_t{0}; n < queue.size(); ++n) {
+        auto const row = queue[n];
+        for (auto it = Matrix::InnerIterator(h, row); it; ++it) {
+            if (layer[it.col()] < 0) {
+                layer[it.col()] = layer[row] + 1;
+                queue.push_back(it.col());
+            }
+        }
+    }
+
+    auto last = std::numeric_limits<int>::max();
+    for (auto const i : to_indices) {
+        if (layer[i] < 0) { return; } // not connected: zero slices
+        last = std::min(last, layer[i]);
+    }
+
+    // The queue is ordered by layer: assign the local indices within each slice
+    auto const num_slices = static_cast<size_t>(last) + 1;
+    auto widths = std::vector<int>(num_slices, 0);
+    auto local = ArrayXi::Constant(size, -1).eval();
+    for (auto const i : queue) {
+        layer[i] = std::min(layer[i], last);
+        local[i] = widths[layer[i]]++;
+    }
+
+    auto diagonal_triplets = std::vector<std::vector<Eigen::Triplet<std::complex<double>>>>(
+        num_slices);
+    auto forward_triplets = diagonal_triplets;
+    auto backward_triplets = diagonal_triplets;
+    for (auto const row : queue) {
+        auto const s = layer[row];
+        for (auto it = Matrix::InnerIterator(h, row); it; ++it) {
+            auto const col_slice = layer[it.col()];
+            if (col_slice == s) {
+                diagonal_triplets[s].emplace_back(local[row], local[it.col()], it.value());
+            } else if (col_slice == s + 1) {
+                forward_triplets[s].emplace_back(local[row], local[it.col()], it.value());
+            } else if (col_slice == s - 1) {
+                backward_triplets[col_slice].emplace_back(local[row], local[it.col()],
+                                                          it.value());
+            }
+        }
+    }
+
+    diagonal.resize(num_slices);
+    forward.resize(num_slices - 1);
+    backward.resize(num_slices - 1);
+    for (auto s = size_t{0}; s < num_slices; ++s) {
+        diagonal[s].resize(widths[s], widths[s]);
+        diagonal[s].setFromTriplets(diagonal_triplets[s].begin(), diagonal_triplets[s].end());
+        if (s + 1 < num_slices) {
+            forward[s].resize(widths[s], widths[s + 1]);
+            forward[s].setFromTriplets(forward_triplets[s].begin(), forward_triplets[s].end());
+            backward[s].resize(widths[s + 1], widths[s]);
+            backward[s].setFromTriplets(backward_triplets[s].begin(),
+                                        backward_triplets[s].end());
+        }
+    }
+
+    for (auto const i : from_indices) { from_local.push_back(local[i]); }
+    for (auto const i : to_indices) { to_local.push_back(local[i]); }
+}
+
+idx_t Transmission::max_slice_width() const {
+    auto width = idx_t{0};
+    for (auto const& d : diagonal) {
+        width = std::max(width, static_cast<idx_t>(d.rows()));
+    }
+    return width;
+}
+
+ArrayXd Transmission::calc(SelfEnergy const& self_energy, ArrayXd const& energies,
+                           idx_t num_threads) const {
+    auto result = ArrayXd::Zero(energies.size()).eval();
+    if (diagonal.empty() || energies.size() == 0) {
+        return result;
+    }
+
+    auto const threads = resolve_num_threads(num_threads);
+    auto const sigma_from = self_energy.self_energy(from, energies, threads);
+    auto const sigma_to = self_energy.self_energy(to, energies, threads);
+    if (sigma_from.front().rows() != static_cast<idx_t>(from_local.size())
+        || sigma_to.front().rows() != static_cast<idx_t>(to_local.size())) {
+        throw std::runtime_error("The lead self-energies don't match the lead indices");
+    }
+
+    auto const last = diagonal.size() - 1;
+    auto const eta = self_energy.get_broadening();
+    parallel_for_each(static_cast<size_t>(energies.size()), threads, [&](size_t n) {
+        auto const z = std::complex<double>{energies[n], eta};
+
+        // Left-connected Green's functions: only the last slice and `G_1i` are kept
+        auto g = MatrixXcd();
+        auto g_1i = MatrixXcd();
+        for (auto s = size_t{0}; s <= last; ++s) {
+            MatrixXcd a = -MatrixXcd(diagonal[s]);
+            a.diagonal().array() += z;
+            if (s == 0) {
+                subtract_at(a, sigma_from[n], from_local);
+            } else {
+                a -= backward[s - 1] * (g * forward[s - 1]);
+            }
+            if (s == last) {
+                subtract_at(a, sigma_to[n], to_local);
+            }
+
+            g = a.partialPivLu().inverse();
+            g_1i = (s == 0) ? g : (g_1i * forward[s - 1] * g).eval();
+        }
+
+        // Restrict `G_1N` to the lead sites
+        auto const num_from = static_cast<idx_t>(from_local.size());
+        auto const num_to = static_cast<idx_t>(to_local.size());
+        auto g_lead = MatrixXcd(num_from, num_to);
+        for (auto j = idx_t{0}; j < num_to; ++j) {
+            for (auto i = idx_t{0}; i < num_from; ++i) {
+                g_lead(i, j) = g_1i(from_local[i], to_local[j]);
+            }
+        }
+
+        auto const gamma_from = broadening_matrix(sigma_from[n]);
+        auto const gamma_to = broadening_matrix(sigma_to[n]);
+        result[n] = (gamma_from * g_lead * gamma_to * g_lead.adjoint()).trace().real();
+    });
+    return result;
+}
+
+}} // namespace cpb::leads
@@ -0,0 +1,135 @@
+#include "solver/Bands.hpp"
+#include "detail/thread.hpp"
+
+#include <Eigen/Eigenvalues>
+
+#include <exception>
+#include <limits>
+
+namespace cpb {
+namespace {
+
+struct DenseEigenvalues {
+    template<class scalar_t>
+    ArrayXd operator()(SparseMatrixRC<scalar_t> const& h) const {
+        auto const dense = MatrixX<scalar_t>(*h);
+        auto const solver = Eigen::SelfAdjointEigenSolver<MatrixX<scalar_t>>(
+            dense, Eigen::EigenvaluesOnly
+        );
+        if (solver.info() != Eigen::Success) {
+            throw std::runtime_error("calc_bands(): the dense eigensolver did not converge");
+        }
+        return solver.eigenvalues().array().template cast<double>();
+    }
+};
+
+struct ToDouble {
+    template<class Array>
+    ArrayXd operator()(Array a) const { return a.template cast<double>(); }
+};
+
+struct ToComplexDouble {
+    template<class scalar_t>
+    SparseMatrixX<std::complex<double>> operator()(SparseMatrixRC<scalar_t> const& m) const {
+        return m->template cast<std::complex<double>>();
+    }
+};
+
+/// Returns the Hamiltonian of the k-point with the given index
+using MakeHamiltonian = std::function<Hamiltonian(size_t)>;
+
+/// Solve the k-points `[start, end)` with a single `SolverStrategy` (or the dense solver)
+void solve_batch(MakeHamiltonian const& make_hamiltonian, size_t start, size_t end,
+                 BaseSolver::MakeStrategy const& make_strategy, bool warm_start,
+                 std::vector<ArrayXd>& results) {
+    auto strategy = std::unique_ptr<SolverStrategy>();
+    for (auto i = start; i < end; ++i) {
+        auto const h = make_hamiltonian(i);
+        if (!make_strategy) {
+            results[i] = var::apply_visitor(DenseEigenvalues(), h.get_variant());
+            continue;
+        }
+
+        auto const previous = (warm_start && strategy)
+                              ? copy_eigenvectors(strategy->eigenvectors())
+                              : MatrixXcd();
+        if (!strategy || !strategy->change_hamiltonian(h)) {
+            strategy = make_strategy(h);
+        }
+        if (previous.size() != 0) {
+            strategy->set_initial_subspace(previous);
+        }
+        strategy->solve();
+        results[i] = num::match<ArrayX>(strategy->eigenvalues(), ToDouble());
+    }
+}
+
+ArrayXXd solve_all(size_t num_points, MakeHamiltonian const& make_hamiltonian,
+                   idx_t num_bands, idx_t num_threads,
+                   BaseSolver::MakeStrategy const& make_strategy, bool warm_start) {
+    auto results = std::vector<ArrayXd>(num_points);
+    auto const threads = resolve_num_threads(num_threads);
+    // A few batches per thread balances the load while keeping the job count low
+    auto const num_batches = std::min(num_points, static_cast<size_t>(4 * threads));
+    auto error = std::exception_ptr();
+    std::mutex error_mutex;
+    {
+        ThreadPool pool(threads);
+        for (auto n = size_t{0}; n < num_batches; ++n) {
+            auto const start = n * num_points / num_batches;
+            auto const end = (n + 1) * num_points / num_batches;
+            pool.add([&, start, end] {
+                try {
+                    solve_batch(make_hamiltonian, start, end, make_strategy, warm_start,
+                                results);
+                } catch (...) { // rethrown on the calling thread
+                    std::lock_guard<std::mutex> lk(error_mutex);
+                    error = std::current_exception();
+                }
+            });
+        }
+        pool.join();
+    }
+    if (error) { std::rethrow_exception(error); }
+
+    auto max_bands = idx_t{0};
+    for (auto const& r : results) {
+        max_bands = std::max(max_bands, static_cast<idx_t>(r.size()));
+    }
+    auto const cols = num_bands >= 0 ? std::min(num_bands, max_bands) : max_bands;
+
+    auto const nan = std::numeric_limits<double>::quiet_NaN();
+    auto bands = ArrayXXd::Constant(num_points, cols, nan).eval();
+    for (auto i = size_t{0}; i < num_points; ++i) {
+        auto const n = std::min(cols, static_cast<idx_t>(results[i].size()));
+        bands.row(i).head(n) = results[i].head(n).transpose();
+    }
+    return bands;
+}
+
+} // anonymous namespace
+
+ArrayXXd calc_bands(Model const& model, std::vector<Cartesian> const& k_path,
+                    idx_t num_bands, idx_t num_threads,
+                    BaseSolver::MakeStrategy const& make_strategy, bool warm_start) {
+    model.eval_hamiltonian(); // the lazy evaluation is not thread-safe: build it here
+    auto const make_hamiltonian = [&](size_t i) { return model.hamiltonian_at(k_path[i]); };
+    return solve_all(k_path.size(), make_hamiltonian, num_bands, num_threads, make_strategy,
+                     warm_start);
+}
+
+ArrayXXd calc_bands(Lead const& lead, ArrayXd const& k_path, idx_t num_bands,
+                    idx_t num_threads) {
+    using complex_t = std::complex<double>;
+    auto const h0 = var::apply_visitor(ToComplexDouble(), lead.h0().get_variant());
+    auto const h1 = var::apply_visitor(ToComplexDouble(), lead.h1().get_variant());
+    auto const make_hamiltonian = [&](size_t i) {
+        auto const h1_phase = (h1 * std::exp(complex_t{0, k_path[i]})).eval();
+        auto const adjoint = SparseMatrixX<complex_t>(h1_phase.adjoint());
+        return Hamiltonian(std::make_shared<SparseMatrixX<complex_t>>(h0 + h1_phase + adjoint));
+    };
+    return solve_all(static_cast<size_t>(k_path.size()), make_hamiltonian, num_bands,
+                     num_threads, {}, /*warm_start*/false);
+}
+
+} // namespace cpb
@@ -0,0 +1,317 @@
+#include "solver/ChebyshevFilter.hpp"
+
+#include "kpm/OptimizedHamiltonian.hpp"
+#include "kpm/Starter.hpp"
+#include "kpm/calc_moments.hpp"
+#include "numeric/random.hpp"
+#include "support/format.hpp"
+#include "utils/ThreadBudget.hpp"
+
+#include <Eigen/QR>
+#include <Eigen/Eigenvalues>
+
+using namespace fmt::literals;
+
+namespace cpb { namespace {
+
+/**
+ Chebyshev coefficients of the indicator function of the window `[lower, upper]` within
+ the scaled spectrum [-1, 1], damped by the Jackson kernel to suppress Gibbs oscillations
+
+ The window is widened by the resolution of the kernel (about pi / degree) so that the
+ eigenvalues right at the edges are still amplified as much as the ones in the middle.
+ */
+ArrayXd window_coefficients(double lower, double upper, idx_t degree) {
+    auto const resolution = constant::pi / static_cast<double>(degree);
+    auto const theta_lower = std::min(std::acos(lower) + resolution, double{constant::pi});
+    auto const theta_upper = std::max(std::acos(upper) - resolution, 0.0);
+
+    auto c = ArrayXd(degree + 1);
+    c[0] = (theta_lower - theta_upper) / constant::pi;
+    for (auto n = idx_t{1}; n <= degree; ++n) {
+        auto const dn = static_cast<double>(n);
+        c[n] = 2 * (std::sin(dn * theta_lower) - std::sin(dn * theta_upper)) / (dn * constant::pi);
+    }
+    return c * kpm::jackson_kernel().damping_coefficients(degree + 1);
+}
+
+/// Value of the filter polynomial at the scaled energy `x`
+double filter_value(ArrayXd const& coefficients, double x) {
+    auto const theta = std::acos(std::min(std::max(x, -1.0), 1.0));
+    auto result = 0.0;
+    for (auto n = idx_t{0}; n < coefficients.size(); ++n) {
+        result += coefficients[n] * std::cos(static_cast<double>(n) * theta);
+    }
+    return result;
+}
+
+/// Uniformly distributed random values in [-1, 1) for the real and imaginary parts
+template<class real_t>
+void fill_random(VectorX<real_t>& v, num::Philox const& generator, std::uint64_t stream) {
+    v = 2 * num::make_random<ArrayX<real_t>>(v.size(), generator, stream) - 1;
+}
+
+template<class real_t>
+void fill_random(VectorX<std::complex<real_t>>& v, num::Philox const& generator,
+                 std::uint64_t stream) {
+    v.real() = 2 * num::make_random<ArrayX<real_t>>(v.size(), generator, 2 * stream) - 1;
+    v.imag() = 2 * num::make_random<ArrayX<real_t>>(v.size(), generator, 2 * stream + 1) - 1;
+}
+
+/**
+ Apply the Chebyshev series `sum_n(c_n * T_n(H'))` to the columns of `x` or simply `H'`
+ if there are no `coefficients`. The columns are processed in SIMD-width batches.
+ */
+template<class scalar_t>
+struct ApplySeries {
+    ArrayXd const& coefficients;
+    MatrixX<scalar_t> const& x;
+    MatrixX<scalar_t>& y;
+    ThreadTeam& team;
+
+    template<class Matrix>
+    std14::enable_if_t<std::is_same<typename Matrix::Scalar, scalar_t>::value>
+    operator()(Matrix const& h2) const {
+        using real_t = num::get_real_t<scalar_t>;
+        constexpr auto batch_size = static_cast<idx_t>(simd::traits<scalar_t>::size);
+        auto const spmv = kpm::calc_moments::Parallel(team);
+        simd::scope_disable_denormals guard;
+
+        y.resize(x.rows(), x.cols());
+        auto r0 = MatrixX<scalar_t>(x.rows(), batch_size);
+        for (auto first = idx_t{0}; first < x.cols(); first += batch_size) {
+            auto const n = std::min(batch_size, x.cols() - first);
+            r0.setZero();
+            r0.leftCols(n) = x.middleCols(first, n);
+            auto r1 = kpm::make_r1(h2, r0);
+            if (coefficients.size() == 0) {
+                y.middleCols(first, n) = r1.leftCols(n);
+                continue;
+            }
+
+            MatrixX<scalar_t> sum = static_cast<real_t>(coefficients[0]) * r0
+                                    + static_cast<real_t>(coefficients[1]) * r1;
+            for (auto k = idx_t{2}; k < coefficients.size(); ++k) {
+                spmv(0, h2.rows(), h2, r1, r0); // r0 = 2 * H' * r1 - r0
+                r0.swap(r1);
+                sum += static_cast<real_t>(coefficients[k]) * r1;
+            }
+            y.middleCols(first, n) = sum.leftCols(n);
+        }
+    }
+
+    template<class Matrix>
+    std14::enable_if_t<!std::is_same<typename Matrix::Scalar, scalar_t>::value>
+    operator()(Matrix const&) const {
+        throw std::logic_error("ChebyshevFilter: unexpected Hamiltonian scalar type.");
+    }
+};
+
+} // anonymous namespace
+
+template<class scalar_t>
+void ChebyshevFilter<scalar_t>::solve() {
+    info = {};
+    auto const h = Hamiltonian(hamiltonian);
+    auto const size = h.rows();
+    auto const scale = kpm::Bounds(h, config.lanczos_precision).scaling_factors();
+    auto const lower = std::max((config.energy_min - scale.b) / scale.a, -1.0);
+    auto const upper = std::min((config.energy_max - scale.b) / scale.a, 1.0);
+    if (lower >= upper) { // the window is outside of the spectrum
+        _eigenvalues.resize(0);
+        _eigenvectors.resize(size, 0);
+        return;
+    }
+
+    auto const num_threads = resolve_num_threads(config.num_threads);
+    auto oh = kpm::OptimizedHamiltonian(h, config.matrix_format, /*reorder*/false,
+                                        /*mixed_precision*/false, {}, num_threads);
+    oh.optimize_for(kpm::Indices::full_system(), scale);
+    ThreadTeam team(num_threads);
+
+    // The polynomial must resolve the window: the degree is inversely proportional to its width
+    auto const degree = config.filter_degree > 0 ? idx_t{config.filter_degree} : [&]{
+        auto const width = std::acos(lower) - std::acos(upper);
+        auto const d = static_cast<idx_t>(std::ceil(8 * constant::pi / width));
+        return std::min(std::max(d, idx_t{20}), idx_t{10000});
+    }();
+    info.filter_degree = static_cast<int>(degree);
+    auto const coefficients = window_coefficients(lower, upper, degree);
+    auto const no_coefficients = ArrayXd();
+
+    auto const generator = num::Philox(0x5eed);
+    auto stream = std::uint64_t{0};
+    auto append_random = [&](MatrixX<scalar_t>& x, idx_t first) {
+        auto v = VectorX<scalar_t>(size);
+        for (auto j = first; j < x.cols(); ++j) {
+            fill_random(v, generator, stream++);
+            x.col(j) = v;
+        }
+    };
+
+    // The number of eigenvalues in the window is estimated from the trace of the filter
+    constexpr auto batch_size = static_cast<idx_t>(simd::traits<scalar_t>::size);
+    auto subspace_size = idx_t{config.initial_size_guess};
+    if (subspace_size <= 0) {
+        auto x = MatrixX<scalar_t>(size, std::min(idx_t{16}, size));
+        append_random(x, 0);
+        auto y = MatrixX<scalar_t>();
+        var::apply_visitor(ApplySeries<scalar_t>{coefficients, x, y, team}, oh.matrix());
+        auto const trace = std::real(x.cwiseProduct(y.conjugate()).sum()) / x.squaredNorm();
+        auto const estimate = std::max(trace * static_cast<double>(size), 0.0);
+        subspace_size = static_cast<idx_t>(std::ceil(1.5 * estimate)) + batch_size;
+    }
+    subspace_size = std::min(subspace_size, size);
+
+    auto const orthonormalize = [](MatrixX<scalar_t> const& m) -> MatrixX<scalar_t> {
+        auto const qr = Eigen::HouseholderQR<MatrixX<scalar_t>>(m);
+        return qr.householderQ() * MatrixX<scalar_t>::Identity(m.rows(), m.cols());
+    };
+
+    auto x = MatrixX<scalar_t>(size, subspace_size);
+    auto num_recycled = idx_t{0};
+    if (initial_subspace.rows() == size) {
+        num_recycled = std::min(initial_subspace.cols(), subspace_size);
+        x.leftCols(num_recycled) = initial_subspace.leftCols(num_recycled);
+        initial_subspace.resize(0, 0);
+    } else if (config.recycle_subspace && _eigenvectors.rows() == size) {
+        num_recycled = std::min(_eigenvectors.cols(), subspace_size);
+        x.leftCols(num_recycled) = _eigenvectors.leftCols(num_recycled).matrix();
+    }
+    append_random(x, num_recycled);
+    x = orthonormalize(x);
+
+    auto const tolerance = std::max(config.tolerance,
+                                    100.0 * std::numeric_limits<real_t>::epsilon());
+    auto y = MatrixX<scalar_t>();
+    auto hq = MatrixX<scalar_t>();
+    auto theta = ArrayX<real_t>();
+    auto is_result = ArrayX<bool>();
+    for (info.iterations = 1; ; ++info.iterations) {
+        var::apply_visitor(ApplySeries<scalar_t>{coefficients, x, y, team}, oh.matrix());
+
+        // Rayleigh-Ritz in the orthonormalized filtered subspace `y = q * r`
+        auto const qr = Eigen::HouseholderQR<MatrixX<scalar_t>>(y);
+        MatrixX<scalar_t> const q = qr.householderQ()
+                                    * MatrixX<scalar_t>::Identity(size, subspace_size);
+        var::apply_visitor(ApplySeries<scalar_t>{no_coefficients, q, hq, team}, oh.matrix());
+        MatrixX<scalar_t> const hs = q.adjoint() * hq;
+        auto const eigen = Eigen::SelfAdjointEigenSolver<MatrixX<scalar_t>>(hs);
+        auto const& v = eigen.eigenvectors();
+
+        x = q * v;
+        theta = eigen.eigenvalues().array();
+        MatrixX<scalar_t> const r = hq * v - x * theta.matrix().template cast<scalar_t>()
+                                                          .asDiagonal();
+        ArrayX<real_t> const residual = r.colwise().norm().array();
+
+        // Ritz vector `i` was amplified by the filter as `1 / |r^-1 * v_i|`. Spurious Ritz
+        // values inside the window are mixtures of strongly suppressed states: they land in
+        // the window but they are not amplified like the true eigenvectors.
+        MatrixX<scalar_t> const rv = qr.matrixQR().topRows(subspace_size)
+                                       .template triangularView<Eigen::Upper>().solve(v);
+        ArrayX<real_t> const amplification = rv.colwise().norm().array().inverse();
+
+        is_result = ArrayX<bool>::Constant(subspace_size, false);
+        auto min_result = 1.0, min_other = 1.0;
+        for (auto i = idx_t{0}; i < subspace_size; ++i) {
+            auto const a = static_cast<double>(amplification[i]);
+            auto const t = static_cast<double>(theta[i]);
+            is_result[i] = t >= lower && t <= upper
+                           && a > 0.25 * std::abs(filter_value(coefficients, t));
+            (is_result[i] ? min_result : min_other) = std::min(
+                is_result[i] ? min_result : min_other, a
+            );
+        }
+        info.num_eigenvalues = static_cast<int>(is_result.count());
+        info.max_residual = info.num_eigenvalues == 0 ? 0.0 : static_cast<double>(
+            is_result.select(residual, real_t{0}).maxCoeff()
+        );
+
+        // Convergence requires the subspace to extend beyond the states amplified by the
+        // filter: even the weakest of the other Ritz vectors must be strongly suppressed
+        if (min_other > 0.1 * min_result && subspace_size < size) {
+            info.size_warning = true;
+            auto const new_size = std::min(subspace_size * 3 / 2 + batch_size, size);
+            x.conservativeResize(Eigen::NoChange, new_size);
+            append_random(x, subspace_size);
+            x = orthonormalize(x);
+            subspace_size = new_size;
+        } else if (info.iterations > 1 && info.max_residual < tolerance) {
+            break; // the first iteration can't tell apart the results from a random start
+        }
+
+        if (info.iterations >= config.max_iterations) {
+            throw std::runtime_error("ChebyshevFilter: failed to converge within {} "
+                                     "iterations."_format(config.max_iterations));
+        }
+    }
+    info.subspace_size = static_cast<int>(subspace_size);
+
+    _eigenvalues.resize(info.num_eigenvalues);
+    _eigenvectors.resize(size, info.num_eigenvalues);
+    for (auto i = idx_t{0}, j = idx_t{0}; i < subspace_size; ++i) {
+        if (!is_result[i]) { continue; }
+        _eigenvalues[j] = static_cast<real_t>(scale.a * theta[i] + scale.b);
+        _eigenvectors.col(j) = x.col(i).array();
+        ++j;
+    }
+}
+
+template<class scalar_t>
+std::string ChebyshevFilter<scalar_t>::report(bool is_shortform) const {
+    std::string report;
+
+    if (info.size_warning)
+        report += fmt::format("Resized subspace: {}\n", info.subspace_size);
+
+    std::string fmt_string;
+    if (is_shortform) {
+        fmt_string = "Subspace({subspace_size}|{num_eigenvalues}), "
+                     "Filter({degree}), Iterations({iterations}|{residual:.2e})";
+    } else {
+        fmt_string = "Found {num_eigenvalues} eigenvalue(s) with subspace size {subspace_size}\n"
+                     "Filter polynomial degree is {degree}\n"
+                     "Converged after {iterations} iteration(s) | Max. residual: {residual:.2e}\n"
+                     "\nCompleted in";
+    }
+
+    report += fmt::format(
+        fmt_string, "subspace_size"_a=info.subspace_size,
+        "num_eigenvalues"_a=info.num_eigenvalues, "degree"_a=info.filter_degree,
+        "iterations"_a=info.iterations, "residual"_a=info.max_residual
+    );
+
+    return report;
+}
+
+template<class scalar_t>
+bool ChebyshevFilter<scalar_t>::change_hamiltonian(Hamiltonian const& h) {
+    if (!ham::is<scalar_t>(h)) {
+        return false;
+    }
+
+    hamiltonian = ham::get_shared_ptr<scalar_t>(h);
+    if (!config.recycle_subspace) {
+        _eigenvalues.resize(0);
+        _eigenvectors.resize(0, 0);
+    }
+    return true;
+}
+
+template<class scalar_t>
+bool ChebyshevFilter<scalar_t>::set_initial_subspace(MatrixXcd const& vectors) {
+    if (vectors.rows() != hamiltonian->rows()) {
+        return false;
+    }
+
+    initial_subspace = num::force_cast<scalar_t>(vectors);
+    return true;
+}
+
+template class ChebyshevFilter<float>;
+template class ChebyshevFilter<std::complex<float>>;
+template class ChebyshevFilter<double>;
+template class ChebyshevFilter<std::complex<double>>;
+
+} // namespace cpb
@@ -0,0 +1,51 @@
+#include "solver/Dense.hpp"
+#include "support/format.hpp"
+
+#include <Eigen/Eigenvalues>
+
+namespace cpb {
+
+template<class scalar_t>
+void Dense<scalar_t>::solve() {
+    auto const dense = ColMajorMatrixX<scalar_t>(*hamiltonian);
+    auto const options = config.eigenvalues_only ? Eigen::EigenvaluesOnly
+                                                 : Eigen::ComputeEigenvectors;
+    auto const solver = Eigen::SelfAdjointEigenSolver<ColMajorMatrixX<scalar_t>>(dense, options);
+    if (solver.info() != Eigen::Success) {
+        throw std::runtime_error("Dense eigensolver: the diagonalization did not converge");
+    }
+
+    _eigenvalues = solver.eigenvalues().array(); // sorted in increasing order
+    if (config.eigenvalues_only) {
+        _eigenvectors.resize(0, 0);
+    } else {
+        _eigenvectors = solver.eigenvectors().array();
+    }
+}
+
+template<class scalar_t>
+std::string Dense<scalar_t>::report(bool is_shortform) const {
+    auto const what = config.eigenvalues_only ? "eigenvalues" : "eigenpairs";
+    return is_shortform ? fmt::format("Dense({}), {}", _eigenvalues.size(), what)
+                        : fmt::format("Found {} {} of the dense Hamiltonian\n\nCompleted in",
+                                      _eigenvalues.size(), what);
+}
+
+template<class scalar_t>
+bool Dense<scalar_t>::change_hamiltonian(Hamiltonian const& h) {
+    if (!ham::is<scalar_t>(h)) {
+        return false;
+    }
+
+    hamiltonian = ham::get_shared_ptr<scalar_t>(h);
+    _eigenvalues.resize(0);
+    _eigenvectors.resize(0, 0);
+    return true;
+}
+
+template class Dense<float>;
+template class Dense<std::complex<float>>;
+template class Dense<double>;
+template class Dense<std::complex<double>>;
+
+} // namespace cpb
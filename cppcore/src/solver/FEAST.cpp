@@ -62,7 +62,8 @@ void FEAST<scalar_t>::solve() {
         }
     }
     
-    info.max_residual = residual.head(info.final_size).maxCoeff();
+    // no eigenvalues in the range (return code 1): there are no residuals either
+    info.max_residual = info.final_size > 0 ? residual.head(info.final_size).maxCoeff() : 0;
     if (info.recycle_warning)
         info.refinement_loops += info.recycle_warning_loops;
 }
@@ -0,0 +1,229 @@
+#include "solver/ShiftInvert.hpp"
+
+#include "numeric/random.hpp"
+#include "support/format.hpp"
+
+#include <Eigen/Eigenvalues>
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+using namespace fmt::literals;
+
+namespace cpb { namespace {
+
+/// Uniformly distributed random values in [-1, 1) for the real and imaginary parts
+template<class real_t>
+void fill_random(VectorX<real_t>& v, num::Philox const& generator, std::uint64_t stream) {
+    v = 2 * num::make_random<ArrayX<real_t>>(v.size(), generator, stream) - 1;
+}
+
+template<class real_t>
+void fill_random(VectorX<std::complex<real_t>>& v, num::Philox const& generator,
+                 std::uint64_t stream) {
+    v.real() = 2 * num::make_random<ArrayX<real_t>>(v.size(), generator, 2 * stream) - 1;
+    v.imag() = 2 * num::make_random<ArrayX<real_t>>(v.size(), generator, 2 * stream + 1) - 1;
+}
+
+/// Classical Gram-Schmidt of `w` against the orthonormal `basis`, applied twice for stability.
+/// Returns the projection coefficients `basis^H * w` of the original `w`.
+template<class Basis, class scalar_t>
+VectorX<scalar_t> orthogonalize(Basis const& basis, VectorX<scalar_t>& w) {
+    auto coefficients = VectorX<scalar_t>::Zero(basis.cols()).eval();
+    for (auto pass = 0; pass < 2; ++pass) {
+        VectorX<scalar_t> const c = basis.adjoint() * w;
+        w -= basis * c;
+        coefficients += c;
+    }
+    return coefficients;
+}
+
+} // anonymous namespace
+
+template<class scalar_t>
+void ShiftInvert<scalar_t>::factorize() {
+    auto const size = hamiltonian->rows();
+    auto identity = ColMajorSparse(size, size);
+    identity.setIdentity();
+    auto const shifted = ColMajorSparse(ColMajorSparse(*hamiltonian)
+                                        - scalar_t(static_cast<real_t>(config.sigma)) * identity);
+
+    auto const outer = shifted.outerIndexPtr();
+    auto const inner = shifted.innerIndexPtr();
+    auto new_pattern = std::vector<storage_idx_t>(outer, outer + size + 1);
+    new_pattern.insert(new_pattern.end(), inner, inner + shifted.nonZeros());
+
+    info.is_pattern_reused = !pattern.empty() && new_pattern == pattern;
+    if (!info.is_pattern_reused) {
+        lu.analyzePattern(shifted);
+        pattern = std::move(new_pattern);
+    }
+    lu.factorize(shifted);
+    if (lu.info() != Eigen::Success) {
+        throw std::runtime_error("ShiftInvert: the LU factorization of H - sigma failed: {}. "
+                                 "Try a value of sigma which isn't an eigenvalue."_format(
+                                     lu.lastErrorMessage()));
+    }
+}
+
+template<class scalar_t>
+void ShiftInvert<scalar_t>::solve() {
+    using Matrix = ColMajorMatrixX<scalar_t>;
+    using Vector = VectorX<scalar_t>;
+
+    info = {};
+    auto const size = hamiltonian->rows();
+    auto const k = idx_t{config.num_eigenvalues};
+    if (k < 1 || k >= size) {
+        throw std::invalid_argument("ShiftInvert: the number of eigenvalues must be between "
+                                    "1 and {}."_format(size - 1));
+    }
+    auto const m = std::min(size, config.subspace_size > 0
+                                  ? std::max(idx_t{config.subspace_size}, k + 1)
+                                  : std::max(2 * k + 1, idx_t{20}));
+    info.subspace_size = static_cast<int>(m);
+    auto const epsilon = std::numeric_limits<real_t>::epsilon();
+    auto const tolerance = std::max(config.tolerance, 10.0 * epsilon);
+
+    factorize();
+
+    auto const generator = num::Philox(0x5eed);
+    auto stream = std::uint64_t{0};
+    auto basis = Matrix(size, m + 1);
+    auto v = Vector(size);
+    if (initial_vector.size() == size && initial_vector.norm() > 0) {
+        v = initial_vector;
+    } else {
+        fill_random(v, generator, stream++);
+    }
+    initial_vector.resize(0);
+    basis.col(0) = v.normalized();
+
+    // The projection of `(H - sigma)^-1` onto the basis
+    auto g = Matrix::Zero(m, m).eval();
+    auto beta = real_t{0}; ///< coupling of the last basis vector to the next one
+    auto num_kept = idx_t{0};
+    auto theta = ArrayX<real_t>();
+    auto ritz = Matrix();
+    auto order = std::vector<idx_t>(static_cast<size_t>(m));
+    while (true) {
+        // Expand the Krylov basis from the kept Ritz vectors and the residual vector
+        for (auto j = num_kept; j < m; ++j) {
+            Vector w = lu.solve(Vector(basis.col(j)));
+            auto const norm = w.norm();
+            Vector const c = orthogonalize(basis.leftCols(j + 1), w);
+            g.col(j).head(j + 1) = c;
+            g.row(j).head(j) = c.head(j).adjoint();
+            beta = w.norm();
+            if (beta <= epsilon * norm) { // invariant subspace: continue with a new direction
+                fill_random(w, generator, stream++);
+                orthogonalize(basis.leftCols(j + 1), w);
+            }
+            basis.col(j + 1) = w.normalized();
+            if (j + 1 < m) { g(j + 1, j) = beta; }
+        }
+
+        // Rayleigh-Ritz: the eigenvalues nearest to sigma have the largest |theta|
+        auto const eigen = Eigen::SelfAdjointEigenSolver<Matrix>(g);
+        theta = eigen.eigenvalues().array();
+        ritz = eigen.eigenvectors();
+        std::iota(order.begin(), order.end(), idx_t{0});
+        std::sort(order.begin(), order.end(), [&](idx_t a, idx_t b) {
+            return std::abs(theta[a]) > std::abs(theta[b]);
+        });
+
+        info.max_residual = 0;
+        for (auto i = idx_t{0}; i < k; ++i) {
+            auto const n = order[i];
+            auto const residual = beta * std::abs(ritz(m - 1, n)) / std::abs(theta[n]);
+            info.max_residual = std::max(info.max_residual, static_cast<double>(residual));
+        }
+        if (info.max_residual <= tolerance || m == size) { break; }
+
+        if (info.restarts >= config.max_restarts) {
+            throw std::runtime_error("ShiftInvert: failed to converge within {} "
+                                     "restarts."_format(config.max_restarts));
+        }
+        ++info.restarts;
+
+        // Thick restart: keep the best Ritz vectors, they're coupled only to the last vector
+        num_kept = std::min(k + (m - k) / 2, m - 1);
+        auto kept = Matrix(m, num_kept);
+        for (auto i = idx_t{0}; i < num_kept; ++i) {
+            kept.col(i) = ritz.col(order[i]);
+        }
+        basis.leftCols(num_kept) = (basis.leftCols(m) * kept).eval();
+        basis.col(num_kept) = basis.col(m);
+        g.setZero();
+        for (auto i = idx_t{0}; i < num_kept; ++i) {
+            g(i, i) = theta[order[i]];
+        }
+    }
+
+    // Sorted by energy: lambda = sigma + 1 / theta
+    auto nearest = std::vector<idx_t>(order.begin(), order.begin() + k);
+    auto const energy = [&](idx_t n) { return config.sigma + 1.0 / theta[n]; };
+    std::sort(nearest.begin(), nearest.end(), [&](idx_t a, idx_t b) {
+        return energy(a) < energy(b);
+    });
+
+    _eigenvalues.resize(k);
+    _eigenvectors.resize(size, k);
+    for (auto i = idx_t{0}; i < k; ++i) {
+        auto const n = nearest[i];
+        _eigenvalues[i] = static_cast<real_t>(energy(n));
+        _eigenvectors.col(i) = (basis.leftCols(m) * ritz.col(n)).normalized().array();
+    }
+}
+
+template<class scalar_t>
+std::string ShiftInvert<scalar_t>::report(bool is_shortform) const {
+    std::string fmt_string;
+    if (is_shortform) {
+        fmt_string = "ShiftInvert({num_eigenvalues}|{subspace_size}), "
+                     "Restarts({restarts}|{residual:.2e})";
+    } else {
+        fmt_string = "Found {num_eigenvalues} eigenvalue(s) nearest to {sigma} "
+                     "with subspace size {subspace_size}\n"
+                     "Converged after {restarts} restart(s) | Max. residual: {residual:.2e}\n"
+                     "Reused the column ordering: {reused}\n"
+                     "\nCompleted in";
+    }
+
+    return fmt::format(
+        fmt_string, "num_eigenvalues"_a=_eigenvalues.size(), "sigma"_a=config.sigma,
+        "subspace_size"_a=info.subspace_size, "restarts"_a=info.restarts,
+        "residual"_a=info.max_residual, "reused"_a=info.is_pattern_reused ? "yes" : "no"
+    );
+}
+
+template<class scalar_t>
+bool ShiftInvert<scalar_t>::change_hamiltonian(Hamiltonian const& h) {
+    if (!ham::is<scalar_t>(h)) {
+        return false;
+    }
+
+    hamiltonian = ham::get_shared_ptr<scalar_t>(h);
+    _eigenvalues.resize(0);
+    _eigenvectors.resize(0, 0);
+    return true; // the column ordering is kept: it's checked against the new pattern
+}
+
+template<class scalar_t>
+bool ShiftInvert<scalar_t>::set_initial_subspace(MatrixXcd const& vectors) {
+    if (vectors.rows() != hamiltonian->rows() || vectors.cols() == 0) {
+        return false;
+    }
+
+    // A single-vector Lanczos: start from a combination of the whole subspace
+    initial_vector = num::force_cast<scalar_t>(VectorXcd(vectors.rowwise().sum()));
+    return true;
+}
+
+template class ShiftInvert<float>;
+template class ShiftInvert<std::complex<float>>;
+template class ShiftInvert<double>;
+template class ShiftInvert<std::complex<double>>;
+
+} // namespace cpb
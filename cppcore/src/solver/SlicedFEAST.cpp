@@ -0,0 +1,262 @@
+#include "solver/SlicedFEAST.hpp"
+
+#include "kpm/Core.hpp"
+#include "kpm/default/Compute.hpp"
+#include "detail/thread.hpp"
+#include "support/format.hpp"
+#include "utils/ThreadBudget.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+using namespace fmt::literals;
+
+namespace cpb {
+
+double SpectrumSlices::total_count() const {
+    return std::accumulate(counts.begin(), counts.end(), 0.0);
+}
+
+SpectrumSlices slice_spectrum(Hamiltonian const& h, SpectrumSlicingConfig const& config) {
+    if (config.energy_max <= config.energy_min) {
+        throw std::invalid_argument("Spectrum slicing: the energy range is empty.");
+    }
+    auto const width = config.energy_max - config.energy_min;
+    auto const broadening = config.broadening > 0 ? config.broadening : width / 64;
+
+    auto core = kpm::Core(h, kpm::DefaultCompute(config.num_threads));
+    auto const moments = core.dos_moments(broadening, std::max(config.num_random, idx_t{1}));
+    auto const num_moments = moments.num_moments();
+    auto const scale = moments.scale;
+
+    // c_n = g_n * mu_n / (g_0 * mu_0): the damped moments relative to the total weight
+    ArrayXd const g = core.get_config().kernel.damping_coefficients(num_moments);
+    ArrayXd const mu = moments.data.col(0).real();
+    ArrayXd const c = (g * mu) / (g[0] * mu[0]);
+
+    // The integral of the DOS `(1 + sum_n c_n T_n(x)) / (pi * sqrt(1 - x^2))` from -1 to x.
+    // With `x = cos(theta)`: `(pi - theta - sum_n c_n sin(n theta) / n) / pi`.
+    constexpr auto pi = 3.14159265358979323846; ///< `constant::pi` is single precision
+    auto const size = static_cast<double>(h.rows());
+    auto const count_below = [&](double energy) {
+        auto const x = std::min(std::max((energy - scale.b) / scale.a, -1.0), 1.0);
+        auto const theta = std::acos(x);
+        auto const two_cos = 2 * x;
+        auto sin0 = 0.0; // sin((n - 1) theta)
+        auto sin1 = std::sin(theta); // sin(n theta)
+        auto sum = 0.0;
+        for (auto n = idx_t{1}; n < num_moments; ++n) {
+            sum += c[n] * sin1 / static_cast<double>(n);
+            auto const next = two_cos * sin1 - sin0;
+            sin0 = sin1;
+            sin1 = next;
+        }
+        return size * (pi - theta - sum) / pi;
+    };
+
+    // The cumulative count on a fine grid locates the borders
+    constexpr auto num_points = idx_t{2048};
+    auto cumulative = ArrayXd(num_points + 1);
+    auto const step = width / static_cast<double>(num_points);
+    parallel_for_each(static_cast<size_t>(num_points + 1), resolve_num_threads(config.num_threads),
+                      [&](size_t i) {
+        auto const n = static_cast<idx_t>(i);
+        cumulative[n] = count_below(config.energy_min + static_cast<double>(n) * step);
+    });
+    cumulative -= cumulative[0];
+    auto const total = cumulative[num_points];
+
+    auto const num_slices = [&]{
+        if (config.num_slices > 0) { return config.num_slices; }
+        auto const n = static_cast<idx_t>(
+            std::ceil(total / static_cast<double>(std::max(config.slice_size, idx_t{1})))
+        );
+        return std::min(std::max(n, idx_t{1}), num_points / 16);
+    }();
+
+    auto slices = SpectrumSlices();
+    slices.borders.push_back(config.energy_min);
+    for (auto k = idx_t{1}; k < num_slices; ++k) {
+        auto const target = total * static_cast<double>(k) / static_cast<double>(num_slices);
+        auto const it = std::lower_bound(cumulative.data(), cumulative.data() + num_points + 1,
+                                         target);
+        auto const i = std::max(static_cast<idx_t>(it - cumulative.data()), idx_t{1});
+        auto const rise = cumulative[i] - cumulative[i - 1];
+        auto const t = rise > 0 ? (target - cumulative[i - 1]) / rise : 1.0;
+        auto const border = config.energy_min + (static_cast<double>(i - 1) + t) * step;
+        slices.borders.push_back(std::max(border, slices.borders.back()));
+    }
+    slices.borders.push_back(config.energy_max);
+
+    auto previous = count_below(config.energy_min);
+    for (auto k = idx_t{0}; k < num_slices; ++k) {
+        auto const next = count_below(slices.borders[k + 1]);
+        slices.counts.push_back(std::max(next - previous, 0.0));
+        previous = next;
+    }
+    return slices;
+}
+
+#ifdef CPB_USE_FEAST
+namespace {
+
+template<class real_t>
+Eigen::Map<ArrayX<real_t> const> map_values(num::ArrayConstRef const& ref) {
+    return {static_cast<real_t const*>(ref.data), ref.shape[0]};
+}
+
+template<class scalar_t>
+Eigen::Map<ColMajorArrayXX<scalar_t> const> map_vectors(num::ArrayConstRef const& ref) {
+    return {static_cast<scalar_t const*>(ref.data), ref.shape[0], ref.shape[1]};
+}
+
+/// The eigenpairs of a single slice in ascending order of energy
+template<class scalar_t>
+struct SliceResult {
+    ArrayX<num::get_real_t<scalar_t>> values;
+    ColMajorArrayXX<scalar_t> vectors;
+    std::vector<bool> is_duplicate;
+};
+
+} // anonymous namespace
+
+template<class scalar_t>
+void SlicedFEAST<scalar_t>::solve() {
+    auto const h = Hamiltonian(hamiltonian);
+    auto const slices = slice_spectrum(h, config.slicing);
+    auto const num_slices = static_cast<idx_t>(slices.counts.size());
+
+    auto const num_threads = resolve_num_threads(config.slicing.num_threads);
+    auto const threads_per_slice = config.threads_per_slice > 0
+                                   ? std::min(config.threads_per_slice, num_threads)
+                                   : std::max(num_threads / std::min(num_slices, num_threads),
+                                              idx_t{1});
+    auto const num_workers = std::min(num_slices, std::max(num_threads / threads_per_slice,
+                                                           idx_t{1}));
+
+    info = {};
+    info.threads_per_slice = threads_per_slice;
+    info.slices.resize(static_cast<size_t>(num_slices));
+    auto results = std::vector<SliceResult<scalar_t>>(static_cast<size_t>(num_slices));
+    parallel_for_each(static_cast<size_t>(num_slices), num_workers, [&](size_t k) {
+        ThreadBudgetScope budget(threads_per_slice);
+        auto& slice = info.slices[k];
+        slice.energy_min = slices.borders[k];
+        slice.energy_max = slices.borders[k + 1];
+        slice.estimated_count = slices.counts[k];
+        slice.initial_size_guess = static_cast<int>(
+            std::ceil(config.size_factor * slices.counts[k])
+        ) + config.size_margin;
+
+        auto feast_config = config.feast;
+        feast_config.energy_min = slice.energy_min;
+        feast_config.energy_max = slice.energy_max;
+        feast_config.initial_size_guess = slice.initial_size_guess;
+        auto feast = FEAST<scalar_t>(hamiltonian, feast_config);
+        feast.solve();
+        slice.report = feast.report(true);
+
+        auto const values = map_values<real_t>(feast.eigenvalues());
+        auto const vectors = map_vectors<scalar_t>(feast.eigenvectors());
+        auto order = std::vector<idx_t>(static_cast<size_t>(values.size()));
+        std::iota(order.begin(), order.end(), idx_t{0});
+        std::sort(order.begin(), order.end(), [&](idx_t a, idx_t b) {
+            return values[a] < values[b];
+        });
+
+        auto& result = results[k];
+        result.values.resize(values.size());
+        result.vectors.resize(vectors.rows(), values.size());
+        for (auto i = idx_t{0}; i < values.size(); ++i) {
+            result.values[i] = values[order[i]];
+            result.vectors.col(i) = vectors.col(order[i]);
+        }
+        result.is_duplicate.assign(static_cast<size_t>(values.size()), false);
+        slice.num_eigenvalues = values.size();
+    });
+
+    // A state right at a border may converge in both slices: the upper copy is dropped
+    auto const tolerance = config.duplicate_tolerance;
+    for (auto k = idx_t{1}; k < num_slices; ++k) {
+        auto const border = slices.borders[k];
+        auto const& lower = results[k - 1];
+        auto& upper = results[k];
+        for (auto j = idx_t{0}; j < upper.values.size(); ++j) {
+            if (upper.values[j] - border > tolerance) { break; }
+            for (auto i = lower.values.size() - 1; i >= 0; --i) {
+                if (border - lower.values[i] > tolerance) { break; }
+                auto const distance = std::abs(lower.values[i] - upper.values[j]);
+                if (lower.is_duplicate[i] || distance > tolerance) { continue; }
+                auto const overlap = std::abs(lower.vectors.col(i).matrix()
+                                                  .dot(upper.vectors.col(j).matrix()));
+                if (overlap > 0.5) {
+                    upper.is_duplicate[j] = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    auto num_eigenvalues = idx_t{0};
+    for (auto k = idx_t{0}; k < num_slices; ++k) {
+        auto const& d = results[k].is_duplicate;
+        info.slices[k].num_duplicates = std::count(d.begin(), d.end(), true);
+        info.num_duplicates += info.slices[k].num_duplicates;
+        num_eigenvalues += info.slices[k].num_eigenvalues - info.slices[k].num_duplicates;
+    }
+
+    _eigenvalues.resize(num_eigenvalues);
+    _eigenvectors.resize(hamiltonian->rows(), num_eigenvalues);
+    auto n = idx_t{0};
+    for (auto& result : results) {
+        for (auto i = idx_t{0}; i < result.values.size(); ++i) {
+            if (result.is_duplicate[i]) { continue; }
+            _eigenvalues[n] = result.values[i];
+            _eigenvectors.col(n) = result.vectors.col(i);
+            ++n;
+        }
+        result = {}; // free the memory of the slice
+    }
+}
+
+template<class scalar_t>
+std::string SlicedFEAST<scalar_t>::report(bool is_shortform) const {
+    auto estimated = 0.0;
+    for (auto const& slice : info.slices) { estimated += slice.estimated_count; }
+
+    auto report = fmt::format(
+        "Slices({num_slices}|{threads} threads), Eigenvalues({found}|{estimated:.0f}), "
+        "Duplicates({duplicates})", "num_slices"_a=info.slices.size(),
+        "threads"_a=info.threads_per_slice, "found"_a=_eigenvalues.size(),
+        "estimated"_a=estimated, "duplicates"_a=info.num_duplicates
+    );
+    if (is_shortform) { return report; }
+
+    report += "\n";
+    for (auto const& slice : info.slices) {
+        report += fmt::format("[{:.4f}, {:.4f}] estimated {:.1f}, found {}: {}\n",
+                              slice.energy_min, slice.energy_max, slice.estimated_count,
+                              slice.num_eigenvalues, slice.report);
+    }
+    return report + "\nCompleted in";
+}
+
+template<class scalar_t>
+bool SlicedFEAST<scalar_t>::change_hamiltonian(Hamiltonian const& h) {
+    if (!ham::is<scalar_t>(h)) {
+        return false;
+    }
+
+    hamiltonian = ham::get_shared_ptr<scalar_t>(h);
+    _eigenvalues.resize(0);
+    _eigenvectors.resize(0, 0);
+    return true;
+}
+
+template class cpb::SlicedFEAST<float>;
+template class cpb::SlicedFEAST<std::complex<float>>;
+template class cpb::SlicedFEAST<double>;
+template class cpb::SlicedFEAST<std::complex<double>>;
+#endif // CPB_USE_FEAST
+
+} // namespace cpb
@@ -1,21 +1,60 @@
 #include "solver/Solver.hpp"
+#include "solver/Bands.hpp"
+#include "detail/thread.hpp"
+#include "support/format.hpp"
+
+#include <algorithm>
+
+using namespace fmt::literals;
 
 namespace cpb { namespace compute {
 
+inline idx_t get_num_threads(idx_t num_threads) {
+    return resolve_num_threads(num_threads);
+}
+
+/// Gaussian terms beyond this many broadenings are below double precision and skipped
+constexpr auto gaussian_cutoff = 9.0;
+
+/// Split `size` jobs into ranges of at least `min_chunk_size` and run `f(begin, end)` on them
+template<class F>
+void parallel_ranges(idx_t size, idx_t num_threads, idx_t min_chunk_size, F f) {
+    auto const num_chunks = std::max(idx_t{1}, std::min(4 * num_threads, size / min_chunk_size));
+    auto const chunk_size = (size + num_chunks - 1) / num_chunks;
+    parallel_for_each(static_cast<size_t>(num_chunks), num_threads, [&](size_t n) {
+        auto const begin = static_cast<idx_t>(n) * chunk_size;
+        f(begin, std::min(size, begin + chunk_size));
+    });
+}
+
 struct CalcDOS {
     ArrayXf const& target_energies;
     float broadening;
+    idx_t num_threads;
 
     template<class Array>
     ArrayXd operator()(Array En) {
         auto const scale = 1 / (broadening * sqrt(2 * constant::pi));
-        auto const constant = -0.5f / pow(broadening, 2);
+        auto const constant = -0.5 / pow(broadening, 2);
+        auto const cutoff = gaussian_cutoff * broadening;
+
+        // With sorted eigenvalues, each energy only sums over the window within `cutoff`
+        auto sorted = std::vector<double>(En.data(), En.data() + En.size());
+        std::sort(sorted.begin(), sorted.end());
 
         // DOS(E) = 1 / (broadening * sqrt(2pi)) * sum(exp(-0.5 * (En-E)^2 / broadening^2))
         ArrayXd dos(target_energies.size());
-        transform(target_energies, dos, [&](float E) {
-            auto gaussian = exp((En - E).square() * constant);
-            return scale * sum(gaussian);
+        parallel_ranges(dos.size(), num_threads, 64, [&](idx_t begin, idx_t end) {
+            for (auto i = begin; i < end; ++i) {
+                auto const E = static_cast<double>(target_energies[i]);
+                auto const first = std::lower_bound(sorted.begin(), sorted.end(), E - cutoff);
+                auto const last = std::upper_bound(first, sorted.end(), E + cutoff);
+                auto sum = 0.0;
+                for (auto it = first; it != last; ++it) {
+                    sum += std::exp((*it - E) * (*it - E) * constant);
+                }
+                dos[i] = scale * sum;
+            }
         });
         return dos;
     }
@@ -24,32 +63,143 @@ struct CalcDOS {
 struct CalcSpatialLDOS {
     float target_energy;
     float broadening;
+    idx_t num_threads;
 
     template<class Array1D, class Array2D>
     ArrayXd operator()(Array1D En, Array2D psi) {
-        using scalar_t = typename Array1D::Scalar;
+        // The eigenvectors may be a single precision copy of double precision results
+        using real_t = num::get_real_t<typename Array2D::Scalar>;
         auto const scale = 1 / (broadening * sqrt(2 * constant::pi));
-        auto const constant = -0.5f / pow(broadening, 2);
+        auto const constant = -0.5 / pow(broadening, 2);
+        auto const cutoff = gaussian_cutoff * broadening;
+
+        // Only the states within `cutoff` of the target energy contribute
+        auto states = std::vector<idx_t>();
+        auto weights = std::vector<real_t>();
+        for (auto n = idx_t{0}; n < En.size(); ++n) {
+            auto const d = static_cast<double>(En[n]) - target_energy;
+            if (std::abs(d) < cutoff) {
+                states.push_back(n);
+                weights.push_back(static_cast<real_t>(scale * std::exp(d * d * constant)));
+            }
+        }
+        auto const gaussian = Eigen::Map<VectorX<real_t> const>(weights.data(),
+                                                                 weights.size());
 
         // DOS(r) = 1 / (b * sqrt(2pi)) * sum(|psi(r)|^2 * exp(-0.5 * (En-E)^2 / b^2))
+        // computed as the dense matrix-vector product `|psi|^2 * gaussian` in blocks of rows
         ArrayXd ldos(psi.rows());
-        for (auto i = 0; i < ldos.size(); ++i) {
-            ArrayX<scalar_t> psi2 = psi.row(i).abs2();
-            auto gaussian = exp((En - target_energy).square() * constant);
-            ldos[i] = scale * sum(psi2 * gaussian);
-        }
+        auto const num_states = static_cast<idx_t>(states.size());
+        parallel_ranges(ldos.size(), num_threads, 4096, [&](idx_t begin, idx_t end) {
+            auto psi2 = MatrixX<real_t>(end - begin, num_states);
+            for (auto k = idx_t{0}; k < num_states; ++k) {
+                psi2.col(k) = psi.col(states[k]).segment(begin, end - begin).abs2().matrix();
+            }
+            ldos.segment(begin, end - begin) = (psi2 * gaussian).array().template cast<double>();
+        });
         return ldos;
     }
 };
 
+struct CopyEigenvectors {
+    template<class Array>
+    MatrixXcd operator()(Array const& a) const {
+        return a.matrix().template cast<std::complex<double>>();
+    }
+};
+
+struct ToSinglePrecision {
+    template<class Array>
+    var::complex<ColMajorArrayXX> operator()(Array const& a) const {
+        using single_t = std14::conditional_t<num::is_complex<typename Array::Scalar>(),
+                                              std::complex<float>, float>;
+        return ColMajorArrayXX<single_t>(a.template cast<single_t>());
+    }
+};
+
+struct ToArrayRef {
+    template<class Array>
+    ComplexArrayConstRef operator()(Array const& a) const { return arrayref(a); }
+};
+
+/// The Hamiltonian rows of the system `sites`: all the orbitals of each site
+std::vector<idx_t> hamiltonian_rows(System const& system, std::vector<idx_t> const& sites) {
+    auto rows = std::vector<idx_t>();
+    for (auto const site : sites) {
+        if (site < 0 || site >= system.num_sites()) {
+            throw std::out_of_range("The site index {} is out of range [0, {})"_format(
+                site, system.num_sites()));
+        }
+        auto const indices = system.to_hamiltonian_indices(site);
+        rows.insert(rows.end(), indices.data(), indices.data() + indices.size());
+    }
+    return rows;
+}
+
+/// Select the `rows` and `cols` of `psi` (all if empty) and apply `f` to each element
+template<class Result, class Array, class F>
+Result select(Array const& psi, std::vector<idx_t> const& rows, std::vector<idx_t> const& cols,
+              F f) {
+    for (auto const col : cols) {
+        if (col < 0 || col >= psi.cols()) {
+            throw std::out_of_range("The state index {} is out of range [0, {})"_format(
+                col, psi.cols()));
+        }
+    }
+
+    auto const num_rows = rows.empty() ? psi.rows() : static_cast<idx_t>(rows.size());
+    auto const num_cols = cols.empty() ? psi.cols() : static_cast<idx_t>(cols.size());
+    auto result = Result(num_rows, num_cols);
+    for (auto j = idx_t{0}; j < num_cols; ++j) {
+        auto const col = cols.empty() ? j : cols[j];
+        for (auto i = idx_t{0}; i < num_rows; ++i) {
+            result(i, j) = f(psi(rows.empty() ? i : rows[i], col));
+        }
+    }
+    return result;
+}
+
+struct SelectEigenvectors {
+    std::vector<idx_t> const& rows;
+    std::vector<idx_t> const& cols;
+
+    template<class Array>
+    var::complex<ColMajorArrayXX> operator()(Array const& psi) const {
+        using scalar_t = typename Array::Scalar;
+        return select<ColMajorArrayXX<scalar_t>>(psi, rows, cols,
+                                                 [](scalar_t v) { return v; });
+    }
+};
+
+struct SelectProbability {
+    std::vector<idx_t> const& rows;
+    std::vector<idx_t> const& cols;
+
+    template<class Array>
+    var::real<ColMajorArrayXX> operator()(Array const& psi) const {
+        using scalar_t = typename Array::Scalar;
+        using real_t = num::get_real_t<scalar_t>;
+        return select<ColMajorArrayXX<real_t>>(psi, rows, cols,
+                                               [](scalar_t v) { return std::norm(v); });
+    }
+};
+
 } // namespace compute
 
+MatrixXcd copy_eigenvectors(ComplexArrayConstRef const& eigenvectors) {
+    return num::match<ColMajorArrayXX>(eigenvectors, compute::CopyEigenvectors());
+}
+
 BaseSolver::BaseSolver(Model const& model, MakeStrategy const& make_strategy)
-    : model(model.eval()), make_strategy(make_strategy),
-      strategy(make_strategy(model.hamiltonian())) {}
+    : model(model.eval_hamiltonian()), make_strategy(make_strategy),
+      strategy(make_strategy(model.hamiltonian())), solve_mutex(new std::mutex()) {}
 
 void BaseSolver::set_model(Model const& new_model) {
+    auto const previous = (is_warm_start && is_solved) ? copy_eigenvectors(eigenvectors())
+                                                       : MatrixXcd();
     is_solved = false;
+    has_compact_eigenvectors = false;
+    compact_eigenvectors = {};
     model = new_model;
 
     if (strategy) {// try to assign a new Hamiltonian to the existing Solver strategy
@@ -62,9 +212,14 @@ void BaseSolver::set_model(Model const& new_model) {
     if (!strategy) { // creates a SolverStrategy with a scalar type suited to the Hamiltonian
         strategy = make_strategy(model.hamiltonian());
     }
+
+    if (previous.size() != 0) { // it's only a starting guess: ignored if it doesn't fit
+        strategy->set_initial_subspace(previous);
+    }
 }
 
 void BaseSolver::solve() {
+    std::lock_guard<std::mutex> lock(*solve_mutex);
     if (is_solved)
         return;
 
@@ -72,6 +227,15 @@ void BaseSolver::solve() {
     strategy->solve();
     calculation_timer.toc();
 
+    has_compact_eigenvectors = false;
+    compact_eigenvectors = {};
+    auto const vectors = strategy->eigenvectors();
+    if (is_single_precision && (vectors.tag == num::Tag::f64 || vectors.tag == num::Tag::cf64)) {
+        compact_eigenvectors = num::match<ColMajorArrayXX>(vectors, compute::ToSinglePrecision());
+        has_compact_eigenvectors = true;
+        strategy->release_eigenvectors();
+    }
+
     is_solved = true;
 }
 
@@ -82,20 +246,44 @@ RealArrayConstRef BaseSolver::eigenvalues() {
 
 ComplexArrayConstRef BaseSolver::eigenvectors() {
     solve();
-    return strategy->eigenvectors();
+    return has_compact_eigenvectors ? var::apply_visitor(compute::ToArrayRef(),
+                                                         compact_eigenvectors)
+                                    : strategy->eigenvectors();
+}
+
+var::complex<ColMajorArrayXX> BaseSolver::eigenvectors_at(std::vector<idx_t> const& sites,
+                                                          std::vector<idx_t> const& states) {
+    auto const rows = compute::hamiltonian_rows(*model.system(), sites);
+    return num::match<ColMajorArrayXX>(eigenvectors(),
+                                       compute::SelectEigenvectors{rows, states});
 }
 
-ArrayXd BaseSolver::calc_dos(ArrayXf target_energies, float broadening) {
-    return num::match<ArrayX>(eigenvalues(), compute::CalcDOS{target_energies, broadening});
+var::real<ColMajorArrayXX> BaseSolver::probability_at(std::vector<idx_t> const& sites,
+                                                      std::vector<idx_t> const& states) {
+    auto const rows = compute::hamiltonian_rows(*model.system(), sites);
+    return num::match<ColMajorArrayXX>(eigenvectors(),
+                                       compute::SelectProbability{rows, states});
 }
 
-ArrayXd BaseSolver::calc_spatial_ldos(float target_energy, float broadening) {
-    return num::match2sp<ArrayX, ColMajorArrayXX>(
+ArrayXd BaseSolver::calc_dos(ArrayXf target_energies, float broadening, idx_t num_threads) {
+    auto const threads = compute::get_num_threads(num_threads);
+    return num::match<ArrayX>(eigenvalues(),
+                              compute::CalcDOS{target_energies, broadening, threads});
+}
+
+ArrayXd BaseSolver::calc_spatial_ldos(float target_energy, float broadening, idx_t num_threads) {
+    auto const threads = compute::get_num_threads(num_threads);
+    return num::match2<ArrayX, ColMajorArrayXX>(
         eigenvalues(), eigenvectors(),
-        compute::CalcSpatialLDOS{target_energy, broadening}
+        compute::CalcSpatialLDOS{target_energy, broadening, threads}
     );
 }
 
+ArrayXXd BaseSolver::calc_bands(std::vector<Cartesian> const& k_path, idx_t num_threads) const {
+    return cpb::calc_bands(model, k_path, /*num_bands*/-1, num_threads, make_strategy,
+                           is_warm_start);
+}
+
 std::string BaseSolver::report(bool shortform) const {
     return strategy->report(shortform) + " " + calculation_timer.str();
 }
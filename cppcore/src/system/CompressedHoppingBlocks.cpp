@@ -0,0 +1,128 @@
+#include "system/CompressedHoppingBlocks.hpp"
+#include "detail/thread.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+namespace cpb {
+
+namespace {
+
+std::uint32_t zigzag(storage_idx_t n) {
+    return (static_cast<std::uint32_t>(n) << 1) ^ static_cast<std::uint32_t>(n >> 31);
+}
+
+void write_varint(std::uint32_t value, CompressedHoppingBlocks::Bytes& bytes) {
+    while (value >= 0x80) {
+        bytes.push_back(static_cast<std::uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    bytes.push_back(static_cast<std::uint8_t>(value));
+}
+
+} // anonymous namespace
+
+CompressedHoppingBlocks::CompressedHoppingBlocks(HoppingBlocks const& hopping_blocks,
+                                                 idx_t num_threads)
+    : num_sites(hopping_blocks.get_num_sites()), name_map(hopping_blocks.get_name_map()) {
+    auto families = std::vector<HoppingBlocks::Block const*>();
+    for (auto const& block : hopping_blocks) { families.push_back(&block.coordinates()); }
+
+    blocks.resize(families.size());
+    parallel_for_each(families.size(), num_threads, [&](size_t f) {
+        blocks[f] = {encode(*families[f]), static_cast<idx_t>(families[f]->size())};
+    });
+}
+
+CompressedHoppingBlocks::CompressedHoppingBlocks(idx_t num_sites, SerializedBlocks data,
+                                                 NameMap name_map)
+    : num_sites(num_sites), blocks(std::move(data)), name_map(std::move(name_map)) {}
+
+CompressedHoppingBlocks::Bytes
+CompressedHoppingBlocks::encode(HoppingBlocks::Block const& coordinates) {
+    auto bytes = Bytes();
+    bytes.reserve(coordinates.size() * 3); // typical for a lattice
+    auto row = storage_idx_t{0};
+    for (auto const& coo : coordinates) {
+        write_varint(zigzag(coo.row - row), bytes);
+        write_varint(zigzag(coo.col - coo.row), bytes);
+        row = coo.row;
+    }
+    bytes.shrink_to_fit();
+    return bytes;
+}
+
+idx_t CompressedHoppingBlocks::nnz() const {
+    return std::accumulate(blocks.begin(), blocks.end(), idx_t{0},
+                           [](idx_t n, SerializedBlocks::value_type const& b) {
+                               return n + b.second;
+                           });
+}
+
+std::size_t CompressedHoppingBlocks::memory_usage() const {
+    auto bytes = std::size_t{0};
+    for (auto const& block : blocks) { bytes += block.first.capacity(); }
+    return bytes;
+}
+
+HoppingBlocks CompressedHoppingBlocks::decompress(idx_t num_threads) const {
+    auto parts = std::vector<HoppingBlocks::Blocks>(1, HoppingBlocks::Blocks(blocks.size()));
+    auto& decoded = parts.front();
+    parallel_for_each(blocks.size(), num_threads, [&](size_t f) {
+        decoded[f].resize(static_cast<size_t>(blocks[f].second));
+        auto decoder = Decoder(blocks[f].first);
+        for (auto& coo : decoded[f]) { coo = decoder.next(); }
+    });
+
+    auto result = HoppingBlocks(num_sites, name_map);
+    result.append(std::move(parts), num_threads); // the single part is moved, not copied
+    return result;
+}
+
+HoppingCSR CompressedHoppingBlocks::tocsr() const {
+    // Two passes over the encoded data: count the elements of each row and then fill them
+    auto counts = ArrayXi::Zero(num_sites).eval();
+    for_each_chunk([&](HopID, HoppingBlocks::Block const& chunk, idx_t) {
+        for (auto const& coo : chunk) { counts[coo.row] += 1; }
+    });
+
+    auto csr = HoppingCSR(num_sites, num_sites);
+    csr.resizeNonZeros(counts.sum());
+    auto const outer = csr.outerIndexPtr();
+    auto const inner = csr.innerIndexPtr();
+    auto const values = csr.valuePtr();
+
+    // `cursor[row]` is the next free position in the row
+    auto cursor = std::vector<storage_idx_t>(static_cast<size_t>(num_sites));
+    outer[0] = 0;
+    for (auto row = idx_t{0}; row < num_sites; ++row) {
+        cursor[row] = outer[row];
+        outer[row + 1] = outer[row] + counts[row];
+    }
+
+    for_each_chunk([&](HopID family_id, HoppingBlocks::Block const& chunk, idx_t) {
+        for (auto const& coo : chunk) {
+            auto& n = cursor[coo.row];
+            inner[n] = coo.col;
+            values[n] = family_id.value();
+            ++n;
+        }
+    });
+
+    // The coordinates are unique: each row only needs to be sorted by column
+    auto sorted = std::vector<std::pair<storage_idx_t, storage_idx_t>>();
+    for (auto row = idx_t{0}; row < num_sites; ++row) {
+        sorted.clear();
+        for (auto n = outer[row]; n < outer[row + 1]; ++n) {
+            sorted.emplace_back(inner[n], values[n]);
+        }
+        std::sort(sorted.begin(), sorted.end());
+        for (auto k = size_t{0}; k < sorted.size(); ++k) {
+            inner[outer[row] + k] = sorted[k].first;
+            values[outer[row] + k] = sorted[k].second;
+        }
+    }
+    return csr.markAsRValue();
+}
+
+} // namespace cpb
@@ -20,7 +20,7 @@ void CompressedSublattices::add(SiteID id, idx_t norb, idx_t count) {
     }
 }
 
-void CompressedSublattices::filter(VectorX<bool> const& keep) {
+void CompressedSublattices::filter(ArrayX<bool> const& keep) {
     using std::begin;
 
     auto new_counts = std::vector<storage_idx_t>();
@@ -1,8 +1,50 @@
 #include "system/Foundation.hpp"
 #include "system/Shape.hpp"
 
+#include <algorithm>
+
 namespace cpb { namespace detail {
 
+constexpr idx_t FoundationTiles::min_parallel_sites;
+
+FoundationTiles::FoundationTiles(Index3D const& spatial_size, idx_t sub_size, idx_t num_threads,
+                                 idx_t max_tile_sites)
+    : spatial_size(spatial_size),
+      num_rows(sub_size * spatial_size[1] * spatial_size[2]),
+      num_threads(num_threads) {
+    auto const num_sites = num_rows * spatial_size[0];
+    // A few tiles per thread balances the load (the shape may leave some tiles mostly empty)
+    num_tiles = (num_threads > 1 && num_sites >= min_parallel_sites)
+                ? std::min(8 * num_threads, num_rows)
+                : idx_t{1};
+    auto const rows_per_tile = std::max(max_tile_sites / spatial_size[0], idx_t{1});
+    auto const min_tiles = num_rows / rows_per_tile + (num_rows % rows_per_tile != 0);
+    num_tiles = std::min(std::max(num_tiles, min_tiles), std::max(num_rows, idx_t{1}));
+}
+
+std::vector<NeighborOffsets> make_neighbor_offsets(OptimizedUnitCell const& unit_cell,
+                                                   Index3D const& spatial_size) {
+    auto const size = spatial_size.cast<idx_t>().eval();
+    auto const sub_stride = size.prod(); // the flat index is `((sub * c + k) * b + j) * a + i`
+    auto const stride = Eigen::Matrix<idx_t, 3, 1>(1, size[0], size[0] * size[1]);
+
+    auto result = std::vector<NeighborOffsets>();
+    auto sub_idx = idx_t{0};
+    for (auto const& site : unit_cell) {
+        auto table = NeighborOffsets{{}, Array3i::Zero(), Array3i(spatial_size.array())};
+        for (auto const& hopping : site.hoppings) {
+            auto const& r = hopping.relative_index;
+            table.offsets.push_back((hopping.to_sub_idx - sub_idx) * sub_stride
+                                    + r.cast<idx_t>().dot(stride));
+            table.lower = table.lower.max(-r.array());
+            table.upper = table.upper.min(spatial_size.array() - r.array());
+        }
+        result.push_back(std::move(table));
+        ++sub_idx;
+    }
+    return result;
+}
+
 std::pair<Index3D, Index3D> find_bounds(Shape const& shape, Lattice const& lattice) {
     Array3i lower_bound = Array3i::Constant(std::numeric_limits<int>::max());
     Array3i upper_bound = Array3i::Constant(std::numeric_limits<int>::min());
@@ -21,82 +63,153 @@ std::pair<Index3D, Index3D> find_bounds(Shape const& shape, Lattice const& latti
     return {lower_bound, upper_bound};
 }
 
-CartesianArray generate_positions(Cartesian origin, Index3D size, Lattice const& lattice) {
-    // The nested loops look messy, but it's the fastest way to calculate all the positions
-    // because the intermediate a, b, c positions are reused.
+CartesianArray generate_positions(Cartesian origin, Index3D size, Lattice const& lattice,
+                                  idx_t num_threads) {
+    // The intermediate a, b, c positions are reused along each row. The arithmetic is
+    // the same for every tile split so the positions don't depend on `num_threads`.
     auto const nsub = lattice.nsub();
     auto const num_sites = size.prod() * nsub;
     auto const unit_cell = lattice.optimized_unit_cell();
 
     auto positions = CartesianArray(num_sites);
-    auto idx = 0;
-    for (auto n = 0; n < nsub; ++n) {
-        Cartesian ps = origin + unit_cell[n].position;
-        for (auto c = 0; c < size[2]; ++c) {
-            Cartesian pc = (c == 0) ? ps : ps + static_cast<float>(c) * lattice.vector(2);
-            for (auto b = 0; b < size[1]; ++b) {
-                Cartesian pb = (b == 0) ? pc : pc + static_cast<float>(b) * lattice.vector(1);
-                for (auto a = 0; a < size[0]; ++a) {
-                    Cartesian pa = pb + static_cast<float>(a) * lattice.vector(0);
-                    positions[idx++] = pa;
-                } // a
-            } // b
-        } // c
-    } // n
+    auto const tiles = FoundationTiles(size, nsub, num_threads);
+    tiles.for_each([&](idx_t tile) {
+        tiles.for_each_row(tile, [&](Index3D const& index, idx_t n, idx_t idx) {
+            auto const pb = row_position(origin, index, unit_cell[n].position, lattice);
+            for (auto a = 0; a < size[0]; ++a) {
+                Cartesian pa = pb + static_cast<float>(a) * lattice.vector(0);
+                positions[idx++] = pa;
+            }
+        });
+    });
 
     return positions;
 }
 
-ArrayXi count_neighbors(Foundation const& foundation) {
-    ArrayXi neighbor_count(foundation.size());
-
-    auto const& unit_cell = foundation.get_optimized_unit_cell();
-    auto const spatial_size = foundation.get_spatial_size().array();
-
-    for (auto const& site : foundation) {
-        auto const& sublattice = unit_cell[site.get_sub_idx()];
-        auto num_neighbors = static_cast<storage_idx_t>(sublattice.hoppings.size());
-
-        // Reduce the neighbor count for sites on the edges
-        for (auto const& hopping : sublattice.hoppings) {
-            auto const index = Array3i(site.get_spatial_idx() + hopping.relative_index);
-            if ((index < 0).any() || (index >= spatial_size).any()) {
-                num_neighbors -= 1;
-            }
+CartesianArray tile_positions(Cartesian origin, Lattice const& lattice,
+                              OptimizedUnitCell const& unit_cell,
+                              FoundationTiles const& tiles, idx_t tile) {
+    auto positions = CartesianArray(tiles.num_sites(tile));
+    auto n = idx_t{0};
+    tiles.for_each_row(tile, [&](Index3D const& index, idx_t sub_idx, idx_t) {
+        auto const pb = row_position(origin, index, unit_cell[sub_idx].position, lattice);
+        for (auto a = 0; a < tiles.row_size(); ++a) {
+            Cartesian pa = pb + static_cast<float>(a) * lattice.vector(0);
+            positions[n++] = pa;
         }
+    });
+    return positions;
+}
 
-        neighbor_count[site.get_flat_idx()] = num_neighbors;
+ArrayX<bool> shape_contains(Shape const& shape, Cartesian origin, Index3D size,
+                            Lattice const& lattice, idx_t max_tile_sites) {
+    // The shape is evaluated one tile at a time on this thread (it may be a Python function)
+    auto const unit_cell = lattice.optimized_unit_cell();
+    auto const tiles = FoundationTiles(size, lattice.nsub(), 1, max_tile_sites);
+    auto is_valid = ArrayX<bool>(size.prod() * lattice.nsub());
+    auto start = idx_t{0};
+    for (auto tile = idx_t{0}; tile < tiles.size(); ++tile) {
+        auto const n = tiles.num_sites(tile);
+        is_valid.segment(start, n) = shape.contains(
+            tile_positions(origin, lattice, unit_cell, tiles, tile)
+        );
+        start += n;
     }
-
-    return neighbor_count;
+    return is_valid;
 }
 
-void clear_neighbors(Site& site, ArrayXi& neighbor_count, int min_neighbors) {
-    if (neighbor_count[site.get_flat_idx()] == 0) { return; }
+} // namespace detail
+
+namespace {
 
+/// Number of valid neighbors (within the foundation bounds)
+int count_valid_neighbors(Site const& site) {
+    auto count = 0;
     site.for_each_neighbor([&](Site neighbor, Hopping) {
-        if (!neighbor.is_valid()) { return; }
-
-        auto const neighbor_idx = neighbor.get_flat_idx();
-        neighbor_count[neighbor_idx] -= 1;
-        if (neighbor_count[neighbor_idx] < min_neighbors) {
-            neighbor.set_valid(false);
-            // recursive call... but it will not be very deep
-            clear_neighbors(neighbor, neighbor_count, min_neighbors);
-        }
+        if (neighbor.is_valid()) { ++count; }
     });
+    return count;
+}
+
+using SiteIt = std::vector<Site>::const_iterator;
 
-    neighbor_count[site.get_flat_idx()] = 0;
+/// Frontiers smaller than this are processed on a single thread
+constexpr auto min_parallel_frontier = size_t{10000};
+
+/// Call `f(first, last)` for consecutive blocks of `sites`, concurrently for large frontiers
+template<class F>
+void for_each_block(std::vector<Site> const& sites, idx_t num_threads, F f) {
+    auto const num_blocks = (num_threads > 1 && sites.size() >= min_parallel_frontier)
+                            ? static_cast<size_t>(4 * num_threads) : size_t{1};
+    parallel_for_each(num_blocks, num_threads, [&](size_t n) {
+        f(n, sites.begin() + n * sites.size() / num_blocks,
+          sites.begin() + (n + 1) * sites.size() / num_blocks);
+    });
 }
 
-} // namespace detail
+} // anonymous namespace
 
 void remove_dangling(Foundation& foundation, int min_neighbors) {
-    auto neighbor_count = detail::count_neighbors(foundation);
-    for (auto& site : foundation) {
-        if (!site.is_valid()) {
-            detail::clear_neighbors(site, neighbor_count, min_neighbors);
+    // The starting points are valid sites next to an invalid site which have fewer than
+    // `min_neighbors` valid neighbors. This pass only reads the site states.
+    auto const tiles = foundation.tiles();
+    auto starts = std::vector<std::vector<Site>>(tiles.size());
+    tiles.for_each([&](idx_t tile) {
+        foundation.for_each_site(tiles, tile, [&](Site const& site) {
+            if (!site.is_valid()) { return; }
+
+            auto count = 0;
+            auto any_invalid = false;
+            site.for_each_neighbor([&](Site neighbor, Hopping) {
+                if (neighbor.is_valid()) { ++count; } else { any_invalid = true; }
+            });
+            if (any_invalid && count < min_neighbors) {
+                starts[tile].push_back(site);
+            }
+        });
+    });
+
+    auto frontier = std::vector<Site>();
+    for (auto& s : starts) {
+        frontier.insert(frontier.end(), s.begin(), s.end());
+        std::vector<Site>().swap(s);
+    }
+
+    // The removal propagates one frontier at a time: all the frontier sites are removed and
+    // then their valid neighbors with too few remaining neighbors make up the next frontier.
+    // The final result doesn't depend on the order of removal, which makes each step parallel.
+    auto const num_threads = foundation.get_num_threads();
+    auto candidates = std::vector<std::vector<Site>>(4 * std::max(num_threads, idx_t{1}));
+    while (!frontier.empty()) {
+        for_each_block(frontier, num_threads, [](size_t, SiteIt first, SiteIt last) {
+            for (auto it = first; it != last; ++it) {
+                auto site = *it;
+                site.set_valid(false);
+            }
+        });
+
+        for_each_block(frontier, num_threads, [&](size_t n, SiteIt first, SiteIt last) {
+            auto& c = candidates[n];
+            c.clear();
+            for (auto it = first; it != last; ++it) {
+                it->for_each_neighbor([&](Site neighbor, Hopping) {
+                    if (neighbor.is_valid() && count_valid_neighbors(neighbor) < min_neighbors) {
+                        c.push_back(neighbor);
+                    }
+                });
+            }
+        });
+
+        // A site may be the neighbor of several frontier sites
+        frontier.clear();
+        for (auto& c : candidates) {
+            frontier.insert(frontier.end(), c.begin(), c.end());
+            c.clear();
         }
+        std::sort(frontier.begin(), frontier.end(), [](Site const& a, Site const& b) {
+            return a.get_flat_idx() < b.get_flat_idx();
+        });
+        frontier.erase(std::unique(frontier.begin(), frontier.end()), frontier.end());
     }
 }
 
@@ -104,26 +217,72 @@ FinalizedIndices::FinalizedIndices(ArrayXi i, ArrayXi h, idx_t n)
     : indices(std::move(i)), hopping_counts(std::move(h)), total_valid_sites(n) {}
 
 
-Foundation::Foundation(Lattice const& lattice, Primitive const& primitive)
+std::size_t FinalizedIndices::memory_usage() const {
+    return static_cast<std::size_t>(indices.size() + hopping_counts.size()) * sizeof(int);
+}
+
+Foundation::Foundation(Lattice const& lattice, Primitive const& primitive, idx_t num_threads)
     : lattice(lattice),
       unit_cell(lattice.optimized_unit_cell()),
       bounds(-primitive.size.array() / 2, (primitive.size.array() - 1) / 2),
+      origin(lattice.calc_position(bounds.first)),
       spatial_size(primitive.size),
       sub_size(lattice.nsub()),
-      positions(detail::generate_positions(lattice.calc_position(bounds.first), spatial_size, lattice)),
+      num_threads(num_threads),
+      neighbor_offsets(detail::make_neighbor_offsets(unit_cell, spatial_size)),
       is_valid(ArrayX<bool>::Constant(size(), true)) {}
 
-Foundation::Foundation(Lattice const& lattice, Shape const& shape)
+Foundation::Foundation(Lattice const& lattice, Shape const& shape, idx_t num_threads)
     : lattice(lattice),
       unit_cell(lattice.optimized_unit_cell()),
       bounds(detail::find_bounds(shape, lattice)),
+      origin(lattice.calc_position(bounds.first)),
       spatial_size((bounds.second - bounds.first) + Index3D::Ones()),
       sub_size(lattice.nsub()),
-      positions(detail::generate_positions(lattice.calc_position(bounds.first), spatial_size, lattice)),
-      is_valid(shape.contains(positions)) {
+      num_threads(num_threads),
+      neighbor_offsets(detail::make_neighbor_offsets(unit_cell, spatial_size)),
+      is_valid(detail::shape_contains(shape, origin, spatial_size, lattice)) {
     remove_dangling(*this, lattice.get_min_neighbors());
 }
 
+void Foundation::materialize_positions() const {
+    if (!has_positions()) {
+        positions = detail::generate_positions(origin, spatial_size, lattice, num_threads);
+    }
+}
+
+CartesianArray Foundation::sublattice_positions(idx_t sub_idx) const {
+    return sublattice_positions(sub_idx, 0, spatial_size.prod());
+}
+
+CartesianArray Foundation::sublattice_positions(idx_t sub_idx, idx_t start, idx_t size) const {
+    if (has_positions()) {
+        auto const first = sub_idx * spatial_size.prod() + start;
+        return {positions.x.segment(first, size), positions.y.segment(first, size),
+                positions.z.segment(first, size)};
+    }
+
+    auto result = CartesianArray(size);
+    auto const& sub_position = unit_cell[sub_idx].position;
+    auto const row_size = static_cast<idx_t>(spatial_size[0]);
+    for (auto n = idx_t{0}; n < size;) {
+        auto const row = (start + n) / row_size;
+        auto const index = Index3D(0, static_cast<int>(row % spatial_size[1]),
+                                   static_cast<int>(row / spatial_size[1]));
+        auto const pb = detail::row_position(origin, index, sub_position, lattice);
+        for (auto a = (start + n) % row_size; a < row_size && n < size; ++a, ++n) {
+            Cartesian pa = pb + static_cast<float>(a) * lattice.vector(0);
+            result[n] = pa;
+        }
+    }
+    return result;
+}
+
+std::size_t Foundation::memory_usage() const {
+    return positions.memory_usage() + static_cast<std::size_t>(is_valid.size()) * sizeof(bool)
+           + finalized_indices.memory_usage();
+}
+
 FinalizedIndices const& Foundation::get_finalized_indices() const {
     if (finalized_indices) {
         return finalized_indices;
@@ -131,23 +290,35 @@ FinalizedIndices const& Foundation::get_finalized_indices() const {
 
     auto indices = ArrayXi::Constant(size(), -1).eval();
     auto hopping_counts = ArrayXi::Zero(lattice.nhop()).eval();
-    auto total_valid_sites = storage_idx_t{0};
 
-    // Each sublattice block has the same initial number of sites (block_size),
-    // but the number of final valid sites may differ.
-    auto const block_size = spatial_size.prod();
+    // Each sublattice block has the same initial number of sites,
+    // but the number of final valid sites may differ: count them per tile.
+    auto const tiles = this->tiles();
+    auto tile_counts = ArrayXXi::Zero(sub_size, tiles.size()).eval();
+    auto tile_starts = ArrayXi::Zero(tiles.size() + 1).eval();
+    tiles.for_each([&](idx_t tile) {
+        tiles.for_each_row(tile, [&](Index3D const&, idx_t sub_idx, idx_t start) {
+            auto const count = is_valid.segment(start, spatial_size[0]).count();
+            tile_counts(sub_idx, tile) += static_cast<int>(count);
+        });
+    });
+    for (auto tile = idx_t{0}; tile < tiles.size(); ++tile) {
+        tile_starts[tile + 1] = tile_starts[tile] + tile_counts.col(tile).sum();
+    }
+    auto const total_valid_sites = tile_starts[tiles.size()];
 
-    for (auto n = 0; n < sub_size; ++n) {
-        auto valid_sites_for_this_sublattice = 0;
-
-        // Assign final indices to all valid sites
-        for (auto i = n * block_size; i < (n + 1) * block_size; ++i) {
-            if (is_valid[i]) {
-                indices[i] = total_valid_sites;
-                ++total_valid_sites;
-                ++valid_sites_for_this_sublattice;
+    // Assign final indices to all valid sites
+    tiles.for_each([&](idx_t tile) {
+        auto index = tile_starts[tile];
+        tiles.for_each_row(tile, [&](Index3D const&, idx_t, idx_t start) {
+            for (auto i = start; i < start + spatial_size[0]; ++i) {
+                if (is_valid[i]) { indices[i] = index++; }
             }
-        }
+        });
+    });
+
+    for (auto n = 0; n < sub_size; ++n) {
+        auto const valid_sites_for_this_sublattice = tile_counts.row(n).sum();
 
         // Count the number of non-conjugate hoppings per family ID. This is
         // overestimated, i.e. it includes some invalid hoppings, but it's a
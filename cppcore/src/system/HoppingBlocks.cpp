@@ -1,4 +1,5 @@
 #include "system/HoppingBlocks.hpp"
+#include "detail/thread.hpp"
 
 namespace cpb {
 
@@ -38,6 +39,12 @@ idx_t HoppingBlocks::nnz() const {
     });
 }
 
+std::size_t HoppingBlocks::memory_usage() const {
+    auto bytes = std::size_t{0};
+    for (auto const& block : blocks) { bytes += block.capacity() * sizeof(COO); }
+    return bytes;
+}
+
 ArrayXi HoppingBlocks::count_neighbors() const {
     auto counts = ArrayXi::Zero(num_sites).eval();
     for (auto const& block : blocks) {
@@ -77,14 +84,61 @@ void HoppingBlocks::append(HopID family_id, ArrayXi&& rows, ArrayXi&& cols) {
     block.erase(std::unique(block.begin(), block.end()), block.end());
 }
 
+void HoppingBlocks::append(std::vector<Blocks>&& parts, idx_t num_threads) {
+    auto const num_families = blocks.size();
+    auto offsets = std::vector<std::vector<std::ptrdiff_t>>(
+        parts.size(), std::vector<std::ptrdiff_t>(num_families)
+    );
+    for (auto f = size_t{0}; f < num_families; ++f) {
+        if (blocks[f].empty() && !parts.empty()) { // no need to copy the first part
+            blocks[f] = std::move(parts[0][f]);
+            parts[0][f].clear();
+        }
+
+        auto size = blocks[f].size();
+        for (auto n = size_t{0}; n < parts.size(); ++n) {
+            offsets[n][f] = static_cast<std::ptrdiff_t>(size);
+            size += parts[n][f].size();
+        }
+        blocks[f].resize(size);
+    }
+
+    parallel_for_each(parts.size() * num_families, num_threads, [&](size_t i) {
+        auto const n = i / num_families;
+        auto const f = i % num_families;
+        std::copy(parts[n][f].begin(), parts[n][f].end(), blocks[f].begin() + offsets[n][f]);
+    });
+}
+
 void HoppingBlocks::filter(VectorX<bool> const& keep) {
-    using std::begin; using std::end;
+    auto index_map = ArrayXi(keep.size());
+    auto n = storage_idx_t{0};
+    for (auto i = idx_t{0}; i < keep.size(); ++i) {
+        index_map[i] = keep[i] ? n++ : -1;
+    }
+    filter(index_map, n);
+}
 
-    num_sites = std::accumulate(begin(keep), end(keep), idx_t{0});
+void HoppingBlocks::filter(ArrayXi const& index_map, idx_t num_kept, idx_t num_threads) {
+    num_sites = num_kept;
     for (auto& block : blocks) {
-        block.erase(std::remove_if(block.begin(), block.end(), [&](COO coo) {
-            return !keep[coo.row] || !keep[coo.col];
-        }), block.end());
+        auto const size = parallel_compact(
+            static_cast<idx_t>(block.size()), num_threads,
+            [&](idx_t i) { return index_map[block[i].row] >= 0 && index_map[block[i].col] >= 0; },
+            [&](idx_t from, idx_t to) { block[to] = block[from]; }
+        );
+        block.resize(static_cast<size_t>(size));
+
+        // The map is monotonic so the blocks remain sorted and upper triangular
+        auto const chunk_size = size_t{1} << 16;
+        auto const num_chunks = block.size() / chunk_size + 1;
+        parallel_for_each(num_chunks, num_threads, [&](size_t c) {
+            auto const last = std::min((c + 1) * chunk_size, block.size());
+            for (auto k = c * chunk_size; k < last; ++k) {
+                block[k].row = index_map[block[k].row];
+                block[k].col = index_map[block[k].col];
+            }
+        });
     }
 }
 
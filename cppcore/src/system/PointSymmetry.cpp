@@ -0,0 +1,99 @@
+#include "system/PointSymmetry.hpp"
+#include "system/SpatialIndex.hpp"
+#include "system/System.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace cpb {
+
+namespace {
+    /// The first Hamiltonian index and the number of orbitals of each site
+    struct SiteOrbitals {
+        ArrayXi first, count;
+
+        SiteOrbitals(System const& system)
+            : first(system.num_sites()), count(system.num_sites()) {
+            for (auto const& sub : system.compressed_sublattices) {
+                auto const norb = sub.num_orbitals();
+                auto n = sub.ham_start();
+                for (auto i = sub.sys_start(); i < sub.sys_end(); ++i, n += norb) {
+                    first[i] = static_cast<storage_idx_t>(n);
+                    count[i] = static_cast<storage_idx_t>(norb);
+                }
+            }
+        }
+    };
+} // anonymous namespace
+
+std::vector<PointOperation> planar_point_operations(Cartesian center) {
+    constexpr auto pi = 3.14159265358979323846;
+    auto result = std::vector<PointOperation>();
+    for (auto const n : {6, 4, 3, 2}) {
+        auto const angle = static_cast<float>(2 * pi / n);
+        auto rotation = Eigen::Matrix3f::Identity().eval();
+        rotation.topLeftCorner<2, 2>() << std::cos(angle), -std::sin(angle),
+                                          std::sin(angle), std::cos(angle);
+        result.push_back({rotation, center});
+    }
+    result.push_back({Eigen::Matrix3f(Eigen::Vector3f(1, -1, 1).asDiagonal()), center}); // y
+    result.push_back({Eigen::Matrix3f(Eigen::Vector3f(-1, 1, 1).asDiagonal()), center}); // x
+    return result;
+}
+
+ArrayXi site_permutation(System const& system, PointOperation const& op, float tolerance) {
+    auto const num_sites = system.num_sites();
+    auto const index = system.spatial_index();
+    auto const orbitals = SiteOrbitals(system);
+
+    auto result = ArrayXi(num_sites);
+    auto is_taken = std::vector<bool>(static_cast<size_t>(num_sites), false);
+    for (auto i = idx_t{0}; i < num_sites; ++i) {
+        auto const image = op(system.positions[i]);
+        auto const j = index->find_nearest(image);
+        if ((system.positions[j] - image).norm() > tolerance
+            || orbitals.count[j] != orbitals.count[i] || is_taken[j]) {
+            return {};
+        }
+        is_taken[j] = true;
+        result[i] = static_cast<storage_idx_t>(j);
+    }
+    return result;
+}
+
+ArrayXi hamiltonian_permutation(System const& system, ArrayXi const& site_permutation) {
+    auto const orbitals = SiteOrbitals(system);
+    auto result = ArrayXi(system.hamiltonian_size());
+    for (auto i = idx_t{0}; i < site_permutation.size(); ++i) {
+        auto const j = site_permutation[i];
+        for (auto k = 0; k < orbitals.count[i]; ++k) {
+            result[orbitals.first[i] + k] = orbitals.first[j] + k;
+        }
+    }
+    return result;
+}
+
+ArrayXi orbit_representatives(idx_t num_sites, std::vector<ArrayXi> const& permutations) {
+    // Union-find where the root of each set is always its lowest index
+    auto parent = ArrayXi(num_sites);
+    for (auto i = idx_t{0}; i < num_sites; ++i) { parent[i] = static_cast<storage_idx_t>(i); }
+    auto const find = [&](idx_t i) {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    };
+
+    for (auto const& p : permutations) {
+        for (auto i = idx_t{0}; i < num_sites; ++i) {
+            auto const a = find(i);
+            auto const b = find(p[i]);
+            if (a != b) { parent[std::max(a, b)] = static_cast<storage_idx_t>(std::min(a, b)); }
+        }
+    }
+    for (auto i = idx_t{0}; i < num_sites; ++i) { parent[i] = static_cast<storage_idx_t>(find(i)); }
+    return parent;
+}
+
+} // namespace cpb
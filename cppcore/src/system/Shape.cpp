@@ -1,5 +1,8 @@
 #include "system/Shape.hpp"
 
+#include <algorithm>
+#include <limits>
+
 namespace cpb {
 
 Primitive::Primitive(int a1, int a2, int a3) : size(a1, a2, a3) {
@@ -41,47 +44,118 @@ ArrayX<bool> is_acute_angle(Cartesian a, Cartesian b, CartesianArrayConstRef c)
     return cos_theta >= 0; // acute angle
 };
 
-WithinPolygon::WithinPolygon(Shape::Vertices const& vertices)
-    : x(vertices.size()), y(vertices.size()) {
-    for (auto i = size_t{0}, size = vertices.size(); i < size; ++i) {
-        x[i] = vertices[i].x();
-        y[i] = vertices[i].y();
-    }
-}
-
-ArrayX<bool> WithinPolygon::operator()(CartesianArrayConstRef positions) const {
-    // Raycasting algorithm checks if `positions` are inside this polygon
-    ArrayX<bool> is_within = ArrayX<bool>::Constant(positions.size(), false);
+constexpr idx_t WithinPolygon::chunk_size;
 
+WithinPolygon::WithinPolygon(Shape::Vertices const& vertices) {
     // Loop over all the sides of the polygon (neighbouring vertices)
-    auto const num_vertices = static_cast<int>(x.size());
+    auto const num_vertices = static_cast<int>(vertices.size());
     for (auto i = 0, j = num_vertices - 1; i < num_vertices; j = i++) {
-        // Aliases for readability
-        auto const& x1 = x[i]; auto const& x2 = x[j];
-        auto const& y1 = y[i]; auto const& y2 = y[j];
+        auto const x1 = vertices[i].x(); auto const x2 = vertices[j].x();
+        auto const y1 = vertices[i].y(); auto const y2 = vertices[j].y();
+
+        // A ray parallel to this side never crosses it (and avoids division by zero)
+        if (num::approx_equal(y1, y2)) { continue; }
 
-        // Check if ray is parallel to this side of the polygon
-        if (num::approx_equal(y1, y2)) {
-            continue; // avoid division by zero in the next step
+        auto const k = (x2 - x1) / (y2 - y1); // the slope of this side
+        edges.push_back({x1, y1, y2, k, std::min(x1, x2), std::max(x1, x2),
+                         std::min(y1, y2), std::max(y1, y2)});
+    }
+
+    auto max_abs = 1.f;
+    for (auto const& v : vertices) {
+        max_abs = std::max({max_abs, std::abs(v.x()), std::abs(v.y())});
+    }
+    tolerance = 1e-4f * max_abs;
+
+    if (edges.empty()) { return; }
+    x_min = y_min = std::numeric_limits<float>::max();
+    x_max = y_max = std::numeric_limits<float>::lowest();
+    for (auto const& e : edges) {
+        x_min = std::min(x_min, e.x_min); x_max = std::max(x_max, e.x_max);
+        y_min = std::min(y_min, e.y_min); y_max = std::max(y_max, e.y_max);
+    }
+
+    // Sort the edges into horizontal bands: a point can only cross the edges of its band
+    num_bands = std::min(static_cast<int>(edges.size()), 1024);
+    band_height = (y_max - y_min) / static_cast<float>(num_bands);
+    bands.resize(num_bands);
+    for (auto n = 0; n < static_cast<int>(edges.size()); ++n) {
+        for (auto b = band(edges[n].y_min), last = band(edges[n].y_max); b <= last; ++b) {
+            bands[b].push_back(n);
         }
+    }
+}
 
-        // The slope of this side
-        auto const k = (x2 - x1) / (y2 - y1);
+int WithinPolygon::band(float y) const {
+    auto const b = band_height > 0 ? static_cast<int>((y - y_min) / band_height) : 0;
+    return std::max(0, std::min(b, num_bands - 1));
+}
 
-        // Shoot the ray along the x direction and see if it passes between `y1` and `y2`
-        auto intersects_y = (y1 > positions.y()) != (y2 > positions.y());
+ArrayX<bool> WithinPolygon::operator()(CartesianArrayConstRef positions) const {
+    // Raycasting algorithm checks if `positions` are inside this polygon
+    auto const size = positions.size();
+    ArrayX<bool> is_within = ArrayX<bool>::Constant(size, false);
+    if (edges.empty()) { return is_within; }
+
+    // The positions are processed in chunks of consecutive points. Only the edges near the
+    // bounding box of a chunk are tested per point -- the others have the same result for
+    // all the points of the chunk. `tolerance` is a safe margin for rounding errors.
+    auto seen = std::vector<idx_t>(edges.size(), -1); // the last chunk which tested the edge
+    auto straddling = std::vector<Edge const*>(); // may be crossed at any point of the chunk
+    auto partial_left = std::vector<Edge const*>(); // left of the chunk, but not spanning it
+    for (auto start = idx_t{0}; start < size; start += chunk_size) {
+        auto const n = std::min(chunk_size, size - start);
+        auto const px = positions.x().segment(start, n);
+        auto const py = positions.y().segment(start, n);
+        auto const cx_min = px.minCoeff(); auto const cx_max = px.maxCoeff();
+        auto const cy_min = py.minCoeff(); auto const cy_max = py.maxCoeff();
+        if (cy_max < y_min || cy_min >= y_max || cx_max < x_min - tolerance
+            || cx_min > x_max + tolerance) {
+            continue; // entirely outside of the polygon
+        }
 
-        // The ray is moving from left to right and may cross a side of the polygon
-        auto x_side = k * (positions.y() - y1) + x1;
-        auto intersects_x = positions.x() > x_side;
+        // Edges to the right of the chunk are never crossed by the ray
+        // and edges to the left are crossed if they span the point's `y`
+        straddling.clear();
+        partial_left.clear();
+        auto left_crossings = 0; // left edges which span the entire chunk
+        for (auto b = band(cy_min), last = band(cy_max); b <= last; ++b) {
+            for (auto const idx : bands[b]) {
+                if (seen[idx] == start) { continue; }
+                seen[idx] = start;
+
+                auto const& e = edges[idx];
+                if (e.y_max <= cy_min || e.y_min > cy_max || e.x_min - tolerance > cx_max) {
+                    continue;
+                } else if (e.x_max + tolerance < cx_min) {
+                    if (e.y_min <= cy_min && cy_max < e.y_max) {
+                        ++left_crossings;
+                    } else {
+                        partial_left.push_back(&e);
+                    }
+                } else {
+                    straddling.push_back(&e);
+                }
+            }
+        }
+
+        auto within = is_within.segment(start, n);
+        if (left_crossings % 2 != 0) { within.setConstant(true); }
+        if (straddling.empty() && partial_left.empty()) {
+            continue; // the chunk is entirely inside or outside
+        }
 
-        // Eigen doesn't support `operator!`, so this will have to do...
-        auto negate = is_within.select(
-            ArrayX<bool>::Constant(is_within.size(), false),
-            ArrayX<bool>::Constant(is_within.size(), true)
-        );
-        // Flip the states which intersect the side
-        is_within = (intersects_y && intersects_x).select(negate, is_within);
+        for (auto const* e : partial_left) {
+            within = within != ((e->y1 > py) != (e->y2 > py));
+        }
+        for (auto const* e : straddling) {
+            // Shoot the ray along the x direction and see if it passes between `y1` and `y2`
+            auto const intersects_y = (e->y1 > py) != (e->y2 > py);
+            // The ray is moving from left to right and may cross a side of the polygon
+            auto const intersects_x = px > (e->k * (py - e->y1) + e->x1);
+            // Flip the states which intersect the side
+            within = within != (intersects_y && intersects_x);
+        }
     }
 
     return is_within;
@@ -109,9 +183,30 @@ Shape::Vertices make_freeformshape_vertices(Cartesian width, Cartesian center) {
     };
 }
 
+/// Evaluate the user function in chunks to limit the size of its temporary arrays
+Shape::Contains chunked(Shape::Contains const& contains) {
+    if (!contains) { return {}; }
+    return [contains](CartesianArrayConstRef positions) -> ArrayX<bool> {
+        auto const size = positions.size();
+        auto const chunk_size = FreeformShape::chunk_size;
+        if (size <= chunk_size) { return contains(positions); }
+
+        auto is_within = ArrayX<bool>(size);
+        for (auto start = idx_t{0}; start < size; start += chunk_size) {
+            auto const n = std::min(chunk_size, size - start);
+            is_within.segment(start, n) = contains({positions.x().segment(start, n),
+                                                    positions.y().segment(start, n),
+                                                    positions.z().segment(start, n)});
+        }
+        return is_within;
+    };
+}
+
 } // anonymous namespace
 
+constexpr idx_t FreeformShape::chunk_size;
+
 FreeformShape::FreeformShape(Contains const& contains, Cartesian width, Cartesian center)
-    : Shape(make_freeformshape_vertices(width, center), contains) {}
+    : Shape(make_freeformshape_vertices(width, center), chunked(contains)) {}
 
 } // namespace cpb
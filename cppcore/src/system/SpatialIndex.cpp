@@ -0,0 +1,222 @@
+#include "system/SpatialIndex.hpp"
+#include "system/Shape.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+namespace cpb {
+
+namespace {
+    /// The target average number of sites per cell
+    constexpr auto sites_per_cell = 2.f;
+    /// Dimensions with a smaller extent (relative to the largest one) are flat
+    constexpr auto flat_extent = 1e-6f;
+
+    /// Candidate site: ordered by distance and then by index for deterministic ties
+    struct Candidate {
+        float distance2;
+        idx_t index;
+
+        friend bool operator<(Candidate const& a, Candidate const& b) {
+            return a.distance2 < b.distance2
+                   || (a.distance2 == b.distance2 && a.index < b.index);
+        }
+    };
+}
+
+SpatialIndex::SpatialIndex(CartesianArrayConstRef p, idx_t start)
+    : start(start), origin(Cartesian::Zero()), cell_size(Cartesian::Ones()),
+      num_cells(Index3D::Ones()), min_cell_size(std::numeric_limits<float>::infinity()) {
+    auto const size = p.size();
+    if (size > 0) {
+        origin = {p.x().minCoeff(), p.y().minCoeff(), p.z().minCoeff()};
+        Cartesian const extent = Cartesian{p.x().maxCoeff(), p.y().maxCoeff(),
+                                           p.z().maxCoeff()} - origin;
+
+        auto const max_extent = extent.maxCoeff();
+        auto num_dims = 0;
+        auto volume = 1.f;
+        for (auto d = 0; d < 3; ++d) {
+            if (extent[d] > flat_extent * max_extent) {
+                ++num_dims;
+                volume *= extent[d];
+            }
+        }
+
+        if (num_dims > 0) {
+            auto const target_cells = std::max(static_cast<float>(size) / sites_per_cell, 1.f);
+            auto const side = std::pow(volume / target_cells, 1.f / static_cast<float>(num_dims));
+            for (auto d = 0; d < 3; ++d) {
+                if (extent[d] <= flat_extent * max_extent) { continue; }
+                auto const n = std::min(std::ceil(extent[d] / side), static_cast<float>(size));
+                num_cells[d] = std::max(static_cast<int>(n), 1);
+                cell_size[d] = extent[d] / static_cast<float>(num_cells[d]);
+                if (num_cells[d] > 1) { min_cell_size = std::min(min_cell_size, cell_size[d]); }
+            }
+        }
+    }
+
+    // Counting sort of the sites by cell
+    auto const total_cells = static_cast<idx_t>(num_cells.prod());
+    auto cell_index = std::vector<storage_idx_t>(size);
+    cell_starts.assign(total_cells + 1, 0);
+    for (auto i = idx_t{0}; i < size; ++i) {
+        auto const c = flat_cell(cell_of({p.x()[i], p.y()[i], p.z()[i]}));
+        cell_index[i] = static_cast<storage_idx_t>(c);
+        ++cell_starts[c + 1];
+    }
+    std::partial_sum(cell_starts.begin(), cell_starts.end(), cell_starts.begin());
+
+    auto cursor = cell_starts;
+    positions.resize(size);
+    sites.resize(size);
+    for (auto i = idx_t{0}; i < size; ++i) {
+        auto const k = cursor[cell_index[i]]++;
+        positions[k] = Cartesian{p.x()[i], p.y()[i], p.z()[i]};
+        sites[k] = static_cast<storage_idx_t>(i);
+    }
+}
+
+Index3D SpatialIndex::cell_of(Cartesian position) const {
+    auto cell = Index3D();
+    for (auto d = 0; d < 3; ++d) {
+        auto const c = std::floor((position[d] - origin[d]) / cell_size[d]);
+        auto const max_c = static_cast<float>(num_cells[d] - 1);
+        cell[d] = static_cast<int>(std::max(0.f, std::min(c, max_c)));
+    }
+    return cell;
+}
+
+template<class F>
+void SpatialIndex::for_each_in_shell(Index3D const& center, int r, F f) const {
+    Array3i const first = (center.array() - r).max(0);
+    Array3i const last = (center.array() + r).min(num_cells.array() - 1);
+
+    for (auto z = first[2]; z <= last[2]; ++z) {
+        for (auto y = first[1]; y <= last[1]; ++y) {
+            // Only the outer layer of the cube: the inner cells have already been visited
+            auto const is_face = std::abs(z - center[2]) == r || std::abs(y - center[1]) == r;
+            for (auto x = first[0]; x <= last[0]; ++x) {
+                if (!is_face && std::abs(x - center[0]) != r) { continue; }
+                auto const c = flat_cell({x, y, z});
+                for (auto k = cell_starts[c]; k < cell_starts[c + 1]; ++k) {
+                    f(static_cast<idx_t>(k));
+                }
+            }
+        }
+    }
+}
+
+idx_t SpatialIndex::find_nearest(Cartesian position) const {
+    auto const result = find_k_nearest(position, 1);
+    if (result.empty()) {
+        throw std::runtime_error("SpatialIndex::find_nearest(): there are no sites");
+    }
+    return result.front();
+}
+
+ArrayXi SpatialIndex::find_nearest(CartesianArrayConstRef p) const {
+    auto result = ArrayXi(p.size());
+    for (auto i = idx_t{0}; i < p.size(); ++i) {
+        result[i] = static_cast<storage_idx_t>(find_nearest({p.x()[i], p.y()[i], p.z()[i]}));
+    }
+    return result;
+}
+
+std::vector<idx_t> SpatialIndex::find_k_nearest(Cartesian position, idx_t k) const {
+    k = std::min(k, size());
+    auto best = std::vector<Candidate>(); // max-heap of the `k` best so far
+    if (k <= 0) { return {}; }
+
+    auto const center = cell_of(position);
+    auto const max_r = num_cells.maxCoeff();
+    for (auto r = 0; r <= max_r; ++r) {
+        for_each_in_shell(center, r, [&](idx_t n) {
+            auto const candidate = Candidate{(positions[n] - position).squaredNorm(), sites[n]};
+            if (static_cast<idx_t>(best.size()) < k) {
+                best.push_back(candidate);
+                std::push_heap(best.begin(), best.end());
+            } else if (candidate < best.front()) {
+                std::pop_heap(best.begin(), best.end());
+                best.back() = candidate;
+                std::push_heap(best.begin(), best.end());
+            }
+        });
+
+        // The sites in the following shells are at least `r * min_cell_size` away
+        auto const bound = r > 0 ? static_cast<float>(r) * min_cell_size : 0.f;
+        if (static_cast<idx_t>(best.size()) == k && best.front().distance2 < bound * bound) {
+            break;
+        }
+    }
+
+    std::sort_heap(best.begin(), best.end());
+    auto result = std::vector<idx_t>(best.size());
+    std::transform(best.begin(), best.end(), result.begin(),
+                   [&](Candidate const& c) { return start + c.index; });
+    return result;
+}
+
+template<class F>
+void SpatialIndex::for_each_in_box(Cartesian min_corner, Cartesian max_corner, F f) const {
+    auto const first = cell_of(min_corner);
+    auto const last = cell_of(max_corner);
+    for (auto z = first[2]; z <= last[2]; ++z) {
+        for (auto y = first[1]; y <= last[1]; ++y) {
+            for (auto x = first[0]; x <= last[0]; ++x) {
+                auto const c = flat_cell({x, y, z});
+                for (auto k = cell_starts[c]; k < cell_starts[c + 1]; ++k) {
+                    auto const p = positions[k];
+                    if ((p.array() >= min_corner.array()).all()
+                        && (p.array() <= max_corner.array()).all()) {
+                        f(static_cast<idx_t>(k));
+                    }
+                }
+            }
+        }
+    }
+}
+
+std::vector<idx_t> SpatialIndex::find_in_box(Cartesian min_corner, Cartesian max_corner) const {
+    auto result = std::vector<idx_t>();
+    for_each_in_box(min_corner, max_corner, [&](idx_t k) { result.push_back(start + sites[k]); });
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+std::vector<idx_t> SpatialIndex::find_in_shape(Shape const& shape) const {
+    // The bounding box of the vertices -- flat dimensions (e.g. z for a polygon) are unbounded
+    Cartesian min_corner = Cartesian::Constant(std::numeric_limits<float>::max());
+    Cartesian max_corner = Cartesian::Constant(std::numeric_limits<float>::lowest());
+    for (auto const& v : shape.vertices) {
+        min_corner = min_corner.cwiseMin(v);
+        max_corner = max_corner.cwiseMax(v);
+    }
+    for (auto d = 0; d < 3; ++d) {
+        if (!(min_corner[d] < max_corner[d])) {
+            min_corner[d] = std::numeric_limits<float>::lowest();
+            max_corner[d] = std::numeric_limits<float>::max();
+        }
+    }
+
+    auto candidates = std::vector<idx_t>();
+    for_each_in_box(min_corner, max_corner, [&](idx_t k) { candidates.push_back(k); });
+
+    auto p = CartesianArray(static_cast<idx_t>(candidates.size()));
+    for (auto n = idx_t{0}; n < p.size(); ++n) {
+        p[n] = positions[candidates[n]];
+    }
+    auto const is_within = shape.contains(p);
+
+    auto result = std::vector<idx_t>();
+    for (auto n = idx_t{0}; n < p.size(); ++n) {
+        if (is_within[n]) { result.push_back(start + sites[candidates[n]]); }
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+} // namespace cpb
@@ -5,11 +5,56 @@
 
 namespace cpb {
 
-void apply(SiteStateModifier const& m, Foundation& f) {
+namespace {
+
+/// Consecutive foundation sites of a single sublattice
+struct FoundationChunk {
+    string_view sublattice;
+    idx_t sub_idx;
+    idx_t start; ///< index of the first site within the sublattice block
+    idx_t size;
+};
+
+/// Split each sublattice of the foundation into chunks of at most `max_chunk_sites`. The order
+/// is the same as a single call for each sublattice: small sublattices are a single chunk.
+std::vector<FoundationChunk> make_chunks(Foundation& f, idx_t max_chunk_sites) {
+    auto const block_size = static_cast<idx_t>(f.get_spatial_size().prod());
+    auto const chunk_size = std::max(max_chunk_sites, idx_t{1});
+
+    auto chunks = std::vector<FoundationChunk>();
     for (auto const& pair : f.get_lattice().get_sublattices()) {
-        auto slice = f[pair.second.unique_id];
-        m.apply(slice.get_states(), slice.get_positions(), pair.first);
+        auto const sub_idx = f[pair.second.unique_id].start() / std::max(block_size, idx_t{1});
+        for (auto start = idx_t{0}; start < block_size; start += chunk_size) {
+            auto const size = std::min(chunk_size, block_size - start);
+            chunks.push_back({pair.first, sub_idx, start, size});
+        }
     }
+    return chunks;
+}
+
+/// Call `lambda(chunk, first_site)` for all chunks, concurrently only if `is_thread_safe`
+template<class F>
+void for_each_chunk(Foundation& f, idx_t max_chunk_sites, bool is_thread_safe, F lambda) {
+    auto const chunks = make_chunks(f, max_chunk_sites);
+    auto const block_size = static_cast<idx_t>(f.get_spatial_size().prod());
+    auto const num_threads = is_thread_safe ? f.get_num_threads() : idx_t{1};
+    parallel_for_each(chunks.size(), num_threads, [&](size_t n) {
+        auto const& chunk = chunks[n];
+        lambda(chunk, chunk.sub_idx * block_size + chunk.start);
+    });
+}
+
+} // anonymous namespace
+
+void apply(SiteStateModifier const& m, Foundation& f, idx_t max_chunk_sites) {
+    // Only a chunk of the (usually implicit) positions is generated at a time
+    auto& states = f.get_states();
+    for_each_chunk(f, max_chunk_sites, m.is_thread_safe,
+                   [&](FoundationChunk const& chunk, idx_t first_site) {
+        m.apply(states.segment(first_site, chunk.size),
+                f.sublattice_positions(chunk.sub_idx, chunk.start, chunk.size),
+                chunk.sublattice, first_site);
+    });
 
     if (m.min_neighbors > 0) {
         remove_dangling(f, m.min_neighbors);
@@ -24,7 +69,7 @@ void apply(SiteStateModifier const& m, System& s) {
     for (auto const& sub : s.compressed_sublattices) {
         m.apply(s.is_valid.segment(sub.sys_start(), sub.num_sites()),
                 s.positions.segment(sub.sys_start(), sub.num_sites()),
-                s.site_registry.name(sub.id()));
+                s.site_registry.name(sub.id()), sub.sys_start());
     }
 
     if (m.min_neighbors > 0) {
@@ -33,11 +78,12 @@ void apply(SiteStateModifier const& m, System& s) {
     }
 }
 
-void apply(PositionModifier const& m, Foundation& f) {
-    for (auto const& pair : f.get_lattice().get_sublattices()) {
-        auto slice = f[pair.second.unique_id];
-        m.apply(slice.get_positions(), pair.first);
-    }
+void apply(PositionModifier const& m, Foundation& f, idx_t max_chunk_sites) {
+    auto& positions = f.get_positions(); // the modified positions must be stored
+    for_each_chunk(f, max_chunk_sites, m.is_thread_safe,
+                   [&](FoundationChunk const& chunk, idx_t first_site) {
+        m.apply(positions.segment(first_site, chunk.size), chunk.sublattice);
+    });
 }
 
 void apply(PositionModifier const& m, System& s) {
@@ -45,6 +91,7 @@ void apply(PositionModifier const& m, System& s) {
         m.apply(s.positions.segment(sub.sys_start(), sub.num_sites()),
                 s.site_registry.name(sub.id()));
     }
+    s.reset_spatial_index();
 }
 
 void apply(SiteGenerator const& g, System& s) {
@@ -56,6 +103,7 @@ void apply(SiteGenerator const& g, System& s) {
     s.compressed_sublattices.add(s.site_registry.id(g.name), norb, nsites);
     s.hopping_blocks.add_sites(nsites);
     s.positions = concat(s.positions, new_positions);
+    s.reset_spatial_index();
 }
 
 void apply(HoppingGenerator const& g, System& s) {
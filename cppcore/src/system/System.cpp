@@ -1,7 +1,13 @@
 #include "system/System.hpp"
 
 #include "system/Foundation.hpp"
+#include "system/Shape.hpp"
+#include "system/SpatialIndex.hpp"
 #include "system/Symmetry.hpp"
+#include "detail/thread.hpp"
+
+#include <cstdint>
+#include <numeric>
 
 namespace cpb {
 
@@ -30,6 +36,13 @@ idx_t System::hamiltonian_nnz() const {
     return onsite_nnz + 2 * hopping_nnz;
 }
 
+std::size_t System::memory_usage() const {
+    auto bytes = positions.memory_usage() + hopping_blocks.memory_usage()
+                 + static_cast<std::size_t>(is_valid.size()) * sizeof(bool);
+    for (auto const& boundary : boundaries) { bytes += boundary.hopping_blocks.memory_usage(); }
+    return bytes;
+}
+
 ArrayXi System::to_hamiltonian_indices(idx_t system_index) const {
     for (auto const& sub : compressed_sublattices) {
         if (sub.sys_start() <= system_index && system_index < sub.sys_end()) {
@@ -66,19 +79,24 @@ Range System::sublattice_range(string_view sublattice) const {
 }
 
 idx_t System::find_nearest(Cartesian target_position, string_view sublattice_name) const {
-    auto const range = sublattice_range(sublattice_name);
-    auto nearest_index = range.start;
-    auto min_distance = (positions[range.start] - target_position).norm();
+    return spatial_index(sublattice_name)->find_nearest(target_position);
+}
 
-    for (auto i = range.start + 1; i < range.end; ++i) {
-        auto const distance = (positions[i] - target_position).norm();
-        if (distance < min_distance) {
-            min_distance = distance;
-            nearest_index = i;
-        }
-    }
+ArrayXi System::find_nearest(CartesianArrayConstRef target_positions,
+                             string_view sublattice_name) const {
+    return spatial_index(sublattice_name)->find_nearest(target_positions);
+}
 
-    return nearest_index;
+std::shared_ptr<SpatialIndex const> System::spatial_index(string_view sublattice_name) const {
+    std::lock_guard<std::mutex> lock(spatial_index_cache.mutex);
+    auto& index = spatial_index_cache.indices[sublattice_name];
+    if (!index) {
+        auto const range = sublattice_range(sublattice_name);
+        index = std::make_shared<SpatialIndex const>(
+            positions.segment(range.start, range.end - range.start), range.start
+        );
+    }
+    return index;
 }
 
 CartesianArray System::expanded_positions() const {
@@ -97,6 +115,275 @@ CartesianArray System::expanded_positions() const {
 }
 
 namespace detail {
+namespace {
+
+/// Portable number of set bits
+int popcount(std::uint64_t x) {
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return static_cast<int>((x * 0x0101010101010101ull) >> 56);
+}
+
+/**
+ The valid sites of a foundation bounding box: a single bit per site
+
+ The sites are addressed by row (see `FoundationTiles::for_each_row()`) and the index `a`
+ along the row. Each row starts at a new word so concurrent tiles never write the same word.
+ After `finalize()`, `index()` returns the final System index of a valid site which is the
+ same as `FinalizedIndices` would assign.
+ */
+class SiteMask {
+public:
+    SiteMask(Index3D const& spatial_size, idx_t sub_size)
+        : spatial_size(spatial_size), words_per_row((spatial_size[0] + 63) / 64),
+          words(sub_size * spatial_size[1] * spatial_size[2] * words_per_row, 0) {}
+
+    idx_t row(Index3D const& i, idx_t sub_idx) const {
+        return (sub_idx * spatial_size[2] + i[2]) * spatial_size[1] + i[1];
+    }
+
+    bool get(idx_t row, idx_t a) const {
+        return ((words[row * words_per_row + a / 64] >> (a % 64)) & 1u) != 0;
+    }
+
+    void set(idx_t row, idx_t a, bool state) {
+        auto& word = words[row * words_per_row + a / 64];
+        auto const bit = std::uint64_t{1} << (a % 64);
+        word = state ? (word | bit) : (word & ~bit);
+    }
+
+    /// Count the valid sites before each word
+    void finalize() {
+        word_starts.resize(words.size() + 1);
+        word_starts[0] = 0;
+        for (auto n = size_t{0}; n < words.size(); ++n) {
+            word_starts[n + 1] = word_starts[n] + popcount(words[n]);
+        }
+    }
+
+    storage_idx_t index(idx_t row, idx_t a) const {
+        auto const n = row * words_per_row + a / 64;
+        auto const before = (std::uint64_t{1} << (a % 64)) - 1;
+        return word_starts[n] + popcount(words[n] & before);
+    }
+
+    /// Number of valid sites in rows `[0, row)`
+    idx_t count_before(idx_t row) const { return word_starts[row * words_per_row]; }
+
+private:
+    Index3D spatial_size;
+    idx_t words_per_row;
+    std::vector<std::uint64_t> words;
+    std::vector<storage_idx_t> word_starts;
+};
+
+/// A site of the bounding box: the same as `Site` but without a `Foundation`
+struct MaskSite {
+    Index3D index;
+    idx_t sub_idx;
+};
+
+/// Call `lambda(MaskSite neighbor, Hopping)` for the neighbors which are within the bounds:
+/// only the sites at the edges (see `NeighborOffsets::is_interior()`) check each hopping
+struct MaskNeighbors {
+    OptimizedUnitCell const& unit_cell;
+    Index3D spatial_size;
+    std::vector<NeighborOffsets> offsets;
+
+    MaskNeighbors(OptimizedUnitCell const& unit_cell, Index3D const& spatial_size)
+        : unit_cell(unit_cell), spatial_size(spatial_size),
+          offsets(make_neighbor_offsets(unit_cell, spatial_size)) {}
+
+    template<class F>
+    void operator()(MaskSite const& site, F lambda) const {
+        auto const& hoppings = unit_cell[site.sub_idx].hoppings;
+        if (offsets[site.sub_idx].is_interior(site.index)) {
+            for (auto const& hopping : hoppings) {
+                lambda(MaskSite{site.index + hopping.relative_index, hopping.to_sub_idx}, hopping);
+            }
+            return;
+        }
+
+        for (auto const& hopping : hoppings) {
+            auto const neighbor_index = Array3i(site.index + hopping.relative_index);
+            if ((neighbor_index < 0).any() || (neighbor_index >= spatial_size.array()).any())
+                continue; // out of bounds
+
+            lambda(MaskSite{neighbor_index.matrix(), hopping.to_sub_idx}, hopping);
+        }
+    }
+};
+
+/// The same as `remove_dangling(Foundation&, int)`: the neighbor counts are recomputed on
+/// demand instead of being stored for every site of the bounding box
+void remove_dangling(SiteMask& mask, OptimizedUnitCell const& unit_cell,
+                     Index3D const& spatial_size, detail::FoundationTiles const& tiles,
+                     int min_neighbors) {
+    auto const for_each_neighbor = MaskNeighbors(unit_cell, spatial_size);
+    auto const is_valid = [&](MaskSite const& s) {
+        return mask.get(mask.row(s.index, s.sub_idx), s.index[0]);
+    };
+    auto const count_valid = [&](MaskSite const& s, bool* any_invalid) {
+        auto count = 0;
+        for_each_neighbor(s, [&](MaskSite const& neighbor, Hopping) {
+            if (is_valid(neighbor)) {
+                ++count;
+            } else if (any_invalid) {
+                *any_invalid = true;
+            }
+        });
+        return count;
+    };
+
+    auto starts = std::vector<std::vector<MaskSite>>(tiles.size());
+    tiles.for_each([&](idx_t tile) {
+        tiles.for_each_row(tile, [&](Index3D index, idx_t sub_idx, idx_t flat_idx) {
+            auto const row = flat_idx / spatial_size[0];
+            for (auto a = 0; a < spatial_size[0]; ++a) {
+                if (!mask.get(row, a)) { continue; }
+
+                index[0] = a;
+                auto any_invalid = false;
+                auto const site = MaskSite{index, sub_idx};
+                if (count_valid(site, &any_invalid) < min_neighbors && any_invalid) {
+                    starts[tile].push_back(site);
+                }
+            }
+        });
+    });
+
+    auto pending = std::vector<MaskSite>();
+    for (auto& s : starts) {
+        pending.insert(pending.end(), s.begin(), s.end());
+        std::vector<MaskSite>().swap(s);
+    }
+    while (!pending.empty()) {
+        auto const site = pending.back();
+        pending.pop_back();
+        if (!is_valid(site)) { continue; }
+
+        mask.set(mask.row(site.index, site.sub_idx), site.index[0], false);
+        for_each_neighbor(site, [&](MaskSite const& neighbor, Hopping) {
+            if (is_valid(neighbor) && count_valid(neighbor, nullptr) < min_neighbors) {
+                pending.push_back(neighbor);
+            }
+        });
+    }
+}
+
+/// Call `f(family_id, row, col)` for each boundary hopping of a tile of the translation slice
+struct BoundaryHoppings {
+    Foundation const& foundation;
+    Translation const& translation;
+    detail::FoundationTiles const& tiles;
+    idx_t tile;
+
+    template<class F>
+    void operator()(F f) const {
+        auto const& finalized_indices = foundation.get_finalized_indices();
+        auto const slice = foundation[translation.boundary_slice];
+        auto const start = Index3D(slice[0].start, slice[1].start, slice[2].start);
+        auto const row_size = slice[0].size();
+
+        tiles.for_each_row(tile, [&](Index3D const& row, idx_t sub_idx, idx_t) {
+            for (auto a = 0; a < row_size; ++a) {
+                auto const site = Site(const_cast<Foundation*>(&foundation),
+                                       start + row + Index3D(a, 0, 0), sub_idx);
+                auto const index = finalized_indices[site];
+                if (index < 0) { continue; }
+
+                // The site is shifted to the opposite edge of the translation unit
+                auto const shifted_site = site.shifted(translation.shift_index);
+                shifted_site.for_each_neighbor([&](Site neighbor, Hopping hopping) {
+                    auto const neighbor_index = finalized_indices[neighbor];
+                    if (neighbor_index < 0) { return; }
+                    f(hopping.family_id, index, neighbor_index);
+                });
+            }
+        });
+    }
+};
+
+} // anonymous namespace
+
+void populate_system(System& system, Lattice const& lattice, Shape const& shape,
+                     idx_t num_threads, idx_t max_tile_sites) {
+    auto const bounds = find_bounds(shape, lattice);
+    auto const spatial_size = Index3D((bounds.second - bounds.first) + Index3D::Ones());
+    auto const sub_size = lattice.nsub();
+    auto const unit_cell = lattice.optimized_unit_cell();
+    auto const origin = lattice.calc_position(bounds.first);
+    auto const tiles = FoundationTiles(spatial_size, sub_size, num_threads, max_tile_sites);
+
+    // The shape is evaluated one tile at a time on this thread (it may be a Python function)
+    auto mask = SiteMask(spatial_size, sub_size);
+    for (auto tile = idx_t{0}; tile < tiles.size(); ++tile) {
+        auto const is_valid = shape.contains(
+            tile_positions(origin, lattice, unit_cell, tiles, tile)
+        );
+        auto n = idx_t{0};
+        tiles.for_each_row(tile, [&](Index3D const&, idx_t, idx_t flat_idx) {
+            auto const row = flat_idx / spatial_size[0];
+            for (auto a = 0; a < spatial_size[0]; ++a) {
+                mask.set(row, a, is_valid[n++]);
+            }
+        });
+    }
+
+    if (lattice.get_min_neighbors() > 0) {
+        remove_dangling(mask, unit_cell, spatial_size, tiles, lattice.get_min_neighbors());
+    }
+    mask.finalize();
+
+    auto const rows_per_sub = spatial_size[1] * spatial_size[2];
+    auto const size = mask.count_before(sub_size * rows_per_sub);
+    for (auto n = idx_t{0}; n < sub_size; ++n) {
+        auto const num_valid = mask.count_before((n + 1) * rows_per_sub)
+                               - mask.count_before(n * rows_per_sub);
+        if (num_valid > 0) {
+            system.compressed_sublattices.add(SiteID{unit_cell[n].alias_id}, unit_cell[n].norb,
+                                              num_valid);
+        }
+    }
+
+    // Positions and hoppings of the surviving sites, merged in tile order
+    auto const for_each_neighbor = MaskNeighbors(unit_cell, spatial_size);
+    system.positions.resize(size);
+    system.hopping_blocks = {size, system.hopping_registry.name_map()};
+    auto parts = std::vector<HoppingBlocks::Blocks>(tiles.size());
+    tiles.for_each([&](idx_t tile) {
+        auto& part = parts[tile];
+        part.resize(system.hopping_registry.name_map().size());
+
+        tiles.for_each_row(tile, [&](Index3D index, idx_t sub_idx, idx_t flat_idx) {
+            auto const row = flat_idx / spatial_size[0];
+            auto const pb = row_position(origin, index, unit_cell[sub_idx].position, lattice);
+            for (auto a = 0; a < spatial_size[0]; ++a) {
+                if (!mask.get(row, a)) { continue; }
+
+                index[0] = a;
+                auto const site_index = mask.index(row, a);
+                Cartesian pa = pb + static_cast<float>(a) * lattice.vector(0);
+                system.positions[site_index] = pa;
+
+                auto const site = MaskSite{index, sub_idx};
+                for_each_neighbor(site, [&](MaskSite const& neighbor, Hopping hopping) {
+                    auto const neighbor_row = mask.row(neighbor.index, neighbor.sub_idx);
+                    if (!mask.get(neighbor_row, neighbor.index[0])) { return; }
+
+                    if (!hopping.is_conjugate) {
+                        part[hopping.family_id.as<size_t>()].emplace_back(
+                            site_index, mask.index(neighbor_row, neighbor.index[0])
+                        );
+                    }
+                });
+            }
+        });
+    });
+    system.hopping_blocks.append(std::move(parts), num_threads);
+    system.compressed_sublattices.verify(size);
+}
 
 void populate_system(System& system, Foundation const& foundation) {
     auto const& finalized_indices = foundation.get_finalized_indices();
@@ -104,24 +391,45 @@ void populate_system(System& system, Foundation const& foundation) {
     auto const size = finalized_indices.size();
     system.positions.resize(size);
     system.hopping_blocks = {size, system.hopping_registry.name_map()};
-    system.hopping_blocks.reserve(finalized_indices.max_hoppings_per_family());
 
-    for (auto const& site : foundation) {
-        auto const index = finalized_indices[site];
-        if (index < 0) { continue; } // invalid site
+    // Each sublattice is a single block of foundation sites
+    auto const& unit_cell = foundation.get_optimized_unit_cell();
+    auto const block_size = foundation.get_spatial_size().prod();
+    for (auto n = idx_t{0}; n < foundation.get_sub_size(); ++n) {
+        auto const num_valid = foundation.get_states().segment(n * block_size, block_size).count();
+        if (num_valid > 0) {
+            system.compressed_sublattices.add(SiteID{unit_cell[n].alias_id}, unit_cell[n].norb,
+                                              num_valid);
+        }
+    }
+
+    // The hoppings of each tile are collected separately and then merged in order
+    auto const tiles = foundation.tiles();
+    auto const& max_hoppings = finalized_indices.max_hoppings_per_family();
+    auto parts = std::vector<HoppingBlocks::Blocks>(tiles.size());
+    tiles.for_each([&](idx_t tile) {
+        auto& part = parts[tile];
+        part.resize(system.hopping_registry.name_map().size());
+        for (auto i = idx_t{0}; i < max_hoppings.size(); ++i) {
+            part[i].reserve(max_hoppings[i] / tiles.size());
+        }
 
-        system.positions[index] = site.get_position();
-        system.compressed_sublattices.add(SiteID{site.get_alias_id()}, site.get_norb());
+        foundation.for_each_site(tiles, tile, [&](Site const& site) {
+            auto const index = finalized_indices[site];
+            if (index < 0) { return; } // invalid site
 
-        site.for_each_neighbor([&](Site neighbor, Hopping hopping) {
-            auto const neighbor_index = finalized_indices[neighbor];
-            if (neighbor_index < 0) { return; } // invalid neighbor
+            system.positions[index] = site.get_position();
+            site.for_each_neighbor([&](Site neighbor, Hopping hopping) {
+                auto const neighbor_index = finalized_indices[neighbor];
+                if (neighbor_index < 0) { return; } // invalid neighbor
 
-            if (!hopping.is_conjugate) { // only make half the matrix, other half is the conjugate
-                system.hopping_blocks.add(hopping.family_id, index, neighbor_index);
-            }
+                if (!hopping.is_conjugate) { // only make half the matrix, other half is the conjugate
+                    part[hopping.family_id.as<size_t>()].emplace_back(index, neighbor_index);
+                }
+            });
         });
-    }
+    });
+    system.hopping_blocks.append(std::move(parts), foundation.get_num_threads());
     system.compressed_sublattices.verify(size);
 }
 
@@ -129,25 +437,77 @@ void populate_boundaries(System& system, Foundation const& foundation,
                          TranslationalSymmetry const& symmetry) {
     auto const& finalized_indices = foundation.get_finalized_indices();
     auto const size = finalized_indices.size();
+    auto const num_families = system.hopping_registry.name_map().size();
+    auto const num_threads = foundation.get_num_threads();
+    auto const translations = symmetry.translations(foundation);
 
-    for (const auto& translation : symmetry.translations(foundation)) {
-        auto boundary = System::Boundary();
-        boundary.shift = translation.shift_lenght;
-        boundary.hopping_blocks = {size, system.hopping_registry.name_map()};
+    // Each boundary slice is split into tiles the same way as the foundation. The jobs for
+    // all translations and tiles are independent: first count the hoppings, then fill the
+    // exactly sized blocks. The tiles are in slice order so the result is always the same.
+    struct Job { size_t translation; idx_t tile; };
+    auto slice_tiles = std::vector<detail::FoundationTiles>();
+    auto jobs = std::vector<Job>();
+    for (auto t = size_t{0}; t < translations.size(); ++t) {
+        auto const slice = foundation[translations[t].boundary_slice];
+        auto const slice_size = Index3D(slice[0].size(), slice[1].size(), slice[2].size());
+        slice_tiles.emplace_back(slice_size.cwiseMax(1), foundation.get_sub_size(),
+                                 slice.size() > 0 ? num_threads : 1);
+        if (slice.size() == 0) { continue; }
+        for (auto tile = idx_t{0}; tile < slice_tiles.back().size(); ++tile) {
+            jobs.push_back({t, tile});
+        }
+    }
 
-        for (auto const& site : foundation[translation.boundary_slice]) {
-            auto const index = finalized_indices[site];
-            if (index < 0) { continue; }
+    auto const hoppings = [&](Job const& job) {
+        return BoundaryHoppings{foundation, translations[job.translation],
+                                slice_tiles[job.translation], job.tile};
+    };
 
-            // The site is shifted to the opposite edge of the translation unit
-            auto const shifted_site = site.shifted(translation.shift_index);
-            shifted_site.for_each_neighbor([&](Site neighbor, Hopping hopping) {
-                auto const neighbor_index = finalized_indices[neighbor];
-                if (neighbor_index < 0) { return; }
+    auto counts = std::vector<std::vector<size_t>>(jobs.size(),
+                                                   std::vector<size_t>(num_families, 0));
+    parallel_for_each(jobs.size(), num_threads, [&](size_t n) {
+        hoppings(jobs[n])([&](HopID family_id, storage_idx_t, storage_idx_t) {
+            ++counts[n][family_id.as<size_t>()];
+        });
+    });
 
-                boundary.hopping_blocks.add(hopping.family_id, index, neighbor_index);
-            });
+    // Exclusive prefix sums per translation: `counts[n]` becomes the offset of job `n`
+    auto sizes = std::vector<std::vector<size_t>>(translations.size(),
+                                                  std::vector<size_t>(num_families, 0));
+    for (auto n = size_t{0}; n < jobs.size(); ++n) {
+        auto& translation_sizes = sizes[jobs[n].translation];
+        for (auto f = size_t{0}; f < num_families; ++f) {
+            auto const count = counts[n][f];
+            counts[n][f] = translation_sizes[f];
+            translation_sizes[f] += count;
+        }
+    }
+
+    auto blocks = std::vector<HoppingBlocks::Blocks>(translations.size());
+    for (auto t = size_t{0}; t < translations.size(); ++t) {
+        blocks[t].resize(num_families);
+        for (auto f = size_t{0}; f < num_families; ++f) {
+            blocks[t][f].resize(sizes[t][f]);
         }
+    }
+
+    parallel_for_each(jobs.size(), num_threads, [&](size_t n) {
+        auto& translation_blocks = blocks[jobs[n].translation];
+        auto offsets = counts[n];
+        hoppings(jobs[n])([&](HopID family_id, storage_idx_t row, storage_idx_t col) {
+            auto const f = family_id.as<size_t>();
+            translation_blocks[f][offsets[f]++] = COO(row, col);
+        });
+    });
+
+    for (auto t = size_t{0}; t < translations.size(); ++t) {
+        auto boundary = System::Boundary();
+        boundary.shift = translations[t].shift_lenght;
+        boundary.hopping_blocks = {size, system.hopping_registry.name_map()};
+
+        auto parts = std::vector<HoppingBlocks::Blocks>();
+        parts.push_back(std::move(blocks[t]));
+        boundary.hopping_blocks.append(std::move(parts)); // moved, not copied
 
         if (boundary.hopping_blocks.nnz() > 0) {
             system.boundaries.push_back(std::move(boundary));
@@ -155,20 +515,48 @@ void populate_boundaries(System& system, Foundation const& foundation,
     }
 }
 
-void remove_invalid(System& s) {
+void remove_invalid(System& s, idx_t num_threads) {
     if (s.is_valid.size() == 0) { return; }
 
-    s.positions.x = slice(s.positions.x, s.is_valid);
-    s.positions.y = slice(s.positions.y, s.is_valid);
-    s.positions.z = slice(s.positions.z, s.is_valid);
-    s.compressed_sublattices.filter(s.is_valid);
-    s.hopping_blocks.filter(s.is_valid);
+    // Prefix sum of the valid sites: the new index of each kept site or -1 if it's removed
+    auto const size = s.num_sites();
+    auto const chunk_size = idx_t{1} << 16;
+    auto const num_chunks = size / chunk_size + 1;
+    auto offsets = std::vector<storage_idx_t>(static_cast<size_t>(num_chunks) + 1, 0);
+    parallel_for_each(static_cast<size_t>(num_chunks), num_threads, [&](size_t c) {
+        auto const first = static_cast<idx_t>(c) * chunk_size;
+        auto const n = std::min(chunk_size, size - first);
+        offsets[c + 1] = static_cast<storage_idx_t>(s.is_valid.segment(first, n).count());
+    });
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
 
+    auto index_map = ArrayXi(size);
+    parallel_for_each(static_cast<size_t>(num_chunks), num_threads, [&](size_t c) {
+        auto n = offsets[c];
+        auto const last = std::min((static_cast<idx_t>(c) + 1) * chunk_size, size);
+        for (auto i = static_cast<idx_t>(c) * chunk_size; i < last; ++i) {
+            index_map[i] = s.is_valid[i] ? n++ : -1;
+        }
+    });
+    auto const num_kept = static_cast<idx_t>(offsets.back());
+
+    auto& p = s.positions;
+    parallel_compact(size, num_threads, [&](idx_t i) { return index_map[i] >= 0; },
+                     [&](idx_t from, idx_t to) {
+                         p.x[to] = p.x[from];
+                         p.y[to] = p.y[from];
+                         p.z[to] = p.z[from];
+                     });
+    p.conservativeResize(num_kept);
+
+    s.compressed_sublattices.filter(s.is_valid);
+    s.hopping_blocks.filter(index_map, num_kept, num_threads);
     for (auto& b : s.boundaries) {
-        b.hopping_blocks.filter(s.is_valid);
+        b.hopping_blocks.filter(index_map, num_kept, num_threads);
     }
 
     s.is_valid.resize(0);
+    s.reset_spatial_index();
 }
 
 } // namespace detail
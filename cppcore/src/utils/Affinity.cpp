@@ -0,0 +1,98 @@
+#include "utils/Affinity.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#ifdef __linux__
+# include <pthread.h>
+# include <sched.h>
+#endif
+
+namespace cpb {
+
+namespace {
+    std::vector<CpuList> read_numa_domains() {
+        auto domains = std::vector<CpuList>();
+#ifdef __linux__
+        // The node indices may have gaps: stop after a few missing ones
+        for (auto node = 0, num_missing = 0; num_missing < 4; ++node) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node)
+                               + "/cpulist");
+            auto line = std::string();
+            if (!std::getline(file, line)) { ++num_missing; continue; }
+
+            auto cpus = parse_cpu_list(line);
+            if (!cpus.empty()) { domains.push_back(std::move(cpus)); }
+        }
+#endif
+        if (domains.empty()) {
+            auto all = CpuList(std::max(std::thread::hardware_concurrency(), 1u));
+            for (auto i = 0; i < static_cast<int>(all.size()); ++i) { all[i] = i; }
+            domains.push_back(std::move(all));
+        }
+        return domains;
+    }
+} // anonymous namespace
+
+bool set_thread_affinity(CpuList const& cpus) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    auto num_valid = 0;
+    for (auto cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+            ++num_valid;
+        }
+    }
+    if (num_valid == 0) { return false; }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+int current_cpu() {
+#ifdef __linux__
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+
+std::vector<CpuList> const& numa_domains() {
+    static auto const domains = read_numa_domains();
+    return domains;
+}
+
+int numa_domain_of(int cpu) {
+    auto const& domains = numa_domains();
+    for (auto i = size_t{0}; i < domains.size(); ++i) {
+        auto const& d = domains[i];
+        if (std::find(d.begin(), d.end(), cpu) != d.end()) { return static_cast<int>(i); }
+    }
+    return 0;
+}
+
+CpuList parse_cpu_list(std::string const& str) {
+    auto cpus = CpuList();
+    std::istringstream stream(str);
+    auto range = std::string();
+    while (std::getline(stream, range, ',')) {
+        auto const dash = range.find('-');
+        try {
+            auto const first = std::stoi(range.substr(0, dash));
+            auto const last = (dash == std::string::npos) ? first
+                                                           : std::stoi(range.substr(dash + 1));
+            for (auto cpu = first; cpu <= last; ++cpu) { cpus.push_back(cpu); }
+        } catch (std::exception const&) {
+            // skip malformed entries, e.g. an empty string
+        }
+    }
+    return cpus;
+}
+
+} // namespace cpb
@@ -0,0 +1,76 @@
+#include "utils/MappedFile.hpp"
+#include "support/format.hpp"
+
+#include <cstdint>
+#include <stdexcept>
+
+#ifdef _WIN32
+# include <fstream>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+using namespace fmt::literals;
+
+namespace cpb {
+
+MappedFile::MappedFile(std::string const& filename) {
+#ifdef _WIN32
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file) { throw std::runtime_error("Can't open '{}'"_format(filename)); }
+    buffer.resize(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    ptr = buffer.data();
+    length = buffer.size();
+#else
+    auto const fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) { throw std::runtime_error("Can't open '{}'"_format(filename)); }
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Can't read '{}'"_format(filename));
+    }
+    length = static_cast<size_t>(info.st_size);
+    if (length > 0) {
+        auto const p = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Can't map '{}' into memory"_format(filename));
+        }
+        ptr = static_cast<char const*>(p);
+    }
+    ::close(fd); // the mapping remains valid
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+    if (ptr) { ::munmap(const_cast<char*>(ptr), length); }
+#endif
+}
+
+void MappedFile::advise_sequential() const {
+#ifndef _WIN32
+    if (ptr) { ::madvise(const_cast<char*>(ptr), length, MADV_SEQUENTIAL); }
+#endif
+}
+
+void MappedFile::prefetch(void const* p, std::size_t bytes) const {
+#ifndef _WIN32
+    if (!ptr || bytes == 0) { return; }
+    // `madvise()` needs a page aligned address: round down and extend the range to match
+    static auto const page_size = static_cast<std::uintptr_t>(::sysconf(_SC_PAGESIZE));
+    auto const address = reinterpret_cast<std::uintptr_t>(p);
+    auto const start = address - address % page_size;
+    auto const size = static_cast<size_t>(bytes + (address - start));
+    ::madvise(reinterpret_cast<void*>(start), size, MADV_WILLNEED); // only a hint
+#else
+    (void)p; (void)bytes; // already in memory
+#endif
+}
+
+} // namespace cpb
@@ -0,0 +1,75 @@
+#include "utils/Memory.hpp"
+#include "support/format.hpp"
+
+#ifdef _WIN32
+# define NOMINMAX
+# include <windows.h>
+# include <psapi.h>
+#else
+# include <sys/resource.h>
+# include <unistd.h>
+#endif
+
+#ifdef __linux__
+# include <cstdio>
+#endif
+
+namespace cpb {
+
+std::size_t peak_process_memory() {
+#ifdef _WIN32
+    auto counters = PROCESS_MEMORY_COUNTERS{};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) { return 0; }
+    return counters.PeakWorkingSetSize;
+#else
+    auto usage = rusage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0) { return 0; }
+# ifdef __APPLE__
+    return static_cast<std::size_t>(usage.ru_maxrss); // bytes
+# else
+    return static_cast<std::size_t>(usage.ru_maxrss) * 1024; // kilobytes
+# endif
+#endif
+}
+
+std::size_t current_process_memory() {
+#ifdef _WIN32
+    auto counters = PROCESS_MEMORY_COUNTERS{};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) { return 0; }
+    return counters.WorkingSetSize;
+#elif defined(__linux__)
+    auto const file = std::fopen("/proc/self/statm", "r");
+    if (!file) { return 0; }
+    unsigned long size = 0, resident = 0; // in pages
+    auto const num_read = std::fscanf(file, "%lu %lu", &size, &resident);
+    std::fclose(file);
+    if (num_read != 2) { return 0; }
+    return static_cast<std::size_t>(resident) * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#else
+    return 0;
+#endif
+}
+
+std::size_t available_memory() {
+#ifdef _WIN32
+    auto status = MEMORYSTATUSEX{};
+    status.dwLength = sizeof(status);
+    if (!GlobalMemoryStatusEx(&status)) { return 0; }
+    return static_cast<std::size_t>(status.ullAvailPhys);
+#elif defined(_SC_AVPHYS_PAGES)
+    auto const pages = sysconf(_SC_AVPHYS_PAGES);
+    auto const page_size = sysconf(_SC_PAGESIZE);
+    if (pages < 0 || page_size < 0) { return 0; }
+    return static_cast<std::size_t>(pages) * static_cast<std::size_t>(page_size);
+#else
+    return 0; // e.g. macOS doesn't have `_SC_AVPHYS_PAGES`
+#endif
+}
+
+std::string MemoryUsage::str() const {
+    auto const to_double = [](std::size_t n) { return static_cast<double>(n); };
+    return fmt::format("{}B (peak +{}B)", fmt::with_suffix(to_double(size)),
+                       fmt::with_suffix(to_double(peak)));
+}
+
+} // namespace cpb
@@ -0,0 +1,155 @@
+#include "utils/Metrics.hpp"
+#include "utils/Memory.hpp"
+#include "support/format.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+
+namespace cpb { namespace metrics {
+
+Counter kpm_jobs;
+Counter kpm_moments;
+Counter kpm_starter_time;
+Counter kpm_spmv_time;
+Counter kpm_collect_time;
+Gauge pool_threads;
+Gauge active_threads;
+Gauge queued_tasks;
+Gauge in_flight_jobs;
+
+namespace detail {
+    std::atomic<bool> is_collecting_stages{false};
+}
+
+namespace {
+    struct Stage {
+        std::uint64_t count = 0;
+        std::chrono::nanoseconds time{0};
+    };
+
+    /// The stages are keyed by `(name, category)`
+    struct Stages {
+        std::mutex mutex;
+        std::map<std::pair<std::string, std::string>, Stage> data;
+    };
+
+    Stages& stages() {
+        static Stages instance;
+        return instance;
+    }
+
+    double seconds(std::uint64_t ns) { return 1e-9 * static_cast<double>(ns); }
+} // anonymous namespace
+
+void detail::add_stage_time(char const* name, char const* category,
+                            std::chrono::nanoseconds time) {
+    auto& s = stages();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto& stage = s.data[{name, category}];
+    stage.count += 1;
+    stage.time += time;
+}
+
+void collect_stages(bool enable) {
+    detail::is_collecting_stages.store(enable);
+}
+
+std::vector<Sample> snapshot() {
+    auto const count = [](Counter const& c) { return static_cast<double>(c.get()); };
+    auto const level = [](Gauge const& g) { return static_cast<double>(g.get()); };
+    auto const bytes = [](std::size_t n) { return static_cast<double>(n); };
+
+    auto samples = std::vector<Sample>{
+        {"cpb_kpm_jobs_total", "", "counter", "KPM recursions of a starter vector or batch",
+         count(kpm_jobs)},
+        {"cpb_kpm_moments_total", "", "counter", "KPM moments, counting each vector of a batch",
+         count(kpm_moments)},
+        {"cpb_kpm_starter_seconds_total", "", "counter", "Time making KPM starter vectors",
+         seconds(kpm_starter_time.get())},
+        {"cpb_kpm_spmv_seconds_total", "", "counter", "Time of the KPM matrix-vector products",
+         seconds(kpm_spmv_time.get())},
+        {"cpb_kpm_collect_seconds_total", "", "counter", "Rest of the time of the KPM jobs",
+         seconds(kpm_collect_time.get())},
+        {"cpb_pool_threads", "", "gauge", "Worker threads of the live thread pools",
+         level(pool_threads)},
+        {"cpb_active_threads", "", "gauge", "Thread pool workers which are running a task",
+         level(active_threads)},
+        {"cpb_queued_tasks", "", "gauge", "Thread pool tasks which no worker has taken yet",
+         level(queued_tasks)},
+        {"cpb_in_flight_jobs", "", "gauge", "Parallel for jobs which are produced but not computed",
+         level(in_flight_jobs)},
+        {"cpb_resident_memory_bytes", "", "gauge", "Resident memory of the process",
+         bytes(current_process_memory())},
+        {"cpb_peak_resident_memory_bytes", "", "gauge", "Peak resident memory of the process",
+         bytes(peak_process_memory())},
+    };
+
+    auto& s = stages();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto const labels = [](std::pair<std::string, std::string> const& key) {
+        return fmt::format("stage=\"{}\",category=\"{}\"", key.first, key.second);
+    };
+    for (auto const& entry : s.data) {
+        auto const ns = static_cast<std::uint64_t>(entry.second.time.count());
+        samples.push_back({"cpb_stage_seconds_total", labels(entry.first), "counter",
+                           "Time of the pipeline stages", seconds(ns)});
+    }
+    for (auto const& entry : s.data) {
+        samples.push_back({"cpb_stage_calls_total", labels(entry.first), "counter",
+                           "Number of calls of the pipeline stages",
+                           static_cast<double>(entry.second.count)});
+    }
+    return samples;
+}
+
+std::string text() {
+    auto out = std::string();
+    auto previous = std::string();
+    for (auto const& sample : snapshot()) {
+        if (sample.name != previous) { // the labeled samples of a metric follow each other
+            out += fmt::format("# HELP {0} {1}\n# TYPE {0} {2}\n", sample.name, sample.help,
+                               sample.type);
+            previous = sample.name;
+        }
+        if (sample.labels.empty()) {
+            out += fmt::format("{} {}\n", sample.name, sample.value);
+        } else {
+            out += fmt::format("{}{{{}}} {}\n", sample.name, sample.labels, sample.value);
+        }
+    }
+    return out;
+}
+
+void write(std::string const& filename) {
+    auto const temporary = filename + ".tmp";
+    {
+        std::ofstream file(temporary);
+        if (!file) {
+            throw std::runtime_error("Can't open metrics file: " + temporary);
+        }
+        file << text();
+    }
+#ifdef _WIN32
+    std::remove(filename.c_str()); // the rename doesn't replace an existing file
+#endif
+    if (std::rename(temporary.c_str(), filename.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        throw std::runtime_error("Can't write metrics file: " + filename);
+    }
+}
+
+void reset() {
+    for (auto counter : {&kpm_jobs, &kpm_moments, &kpm_starter_time, &kpm_spmv_time,
+                         &kpm_collect_time}) {
+        counter->reset();
+    }
+    auto& s = stages();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.data.clear();
+}
+
+}} // namespace cpb::metrics
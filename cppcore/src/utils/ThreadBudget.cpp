@@ -0,0 +1,126 @@
+#include "utils/ThreadBudget.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#ifdef __linux__
+# include <sched.h>
+#endif
+
+#ifdef CPB_USE_MKL
+# include <mkl.h>
+#endif
+
+namespace cpb {
+
+namespace {
+    idx_t affinity_cpus() {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            return static_cast<idx_t>(CPU_COUNT(&set));
+        }
+#endif
+        return static_cast<idx_t>(std::thread::hardware_concurrency());
+    }
+
+    /// The quota of cgroup v2 (`cpu.max`) or v1 (`cpu.cfs_quota_us / cpu.cfs_period_us`)
+    idx_t cgroup_cpus() {
+#ifdef __linux__
+        {
+            std::ifstream file("/sys/fs/cgroup/cpu.max");
+            auto line = std::string();
+            if (std::getline(file, line)) { return parse_cgroup_cpu_max(line); }
+        }
+        {
+            std::ifstream quota_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+            std::ifstream period_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+            auto quota = std::string(), period = std::string();
+            if (std::getline(quota_file, quota) && std::getline(period_file, period)) {
+                return parse_cgroup_cpu_max(quota + " " + period);
+            }
+        }
+#endif
+        return 0;
+    }
+
+    idx_t environment_cpus() {
+        auto const value = std::getenv("CPB_NUM_THREADS");
+        return value ? std::max(std::atoi(value), 0) : 0;
+    }
+
+    idx_t find_available_cpus() {
+        auto cpus = affinity_cpus();
+        for (auto limit : {cgroup_cpus(), environment_cpus()}) {
+            if (limit > 0) { cpus = std::min(cpus, limit); }
+        }
+        return std::max(cpus, idx_t{1});
+    }
+
+    /// 0 means the thread hasn't been given a budget: it gets all the `available_cpus()`
+    idx_t& local_budget() {
+        static thread_local idx_t budget = 0;
+        return budget;
+    }
+} // anonymous namespace
+
+idx_t available_cpus() {
+    static auto const cpus = find_available_cpus();
+    return cpus;
+}
+
+idx_t thread_budget() {
+    auto const budget = local_budget();
+    return budget > 0 ? budget : available_cpus();
+}
+
+void set_thread_budget(idx_t budget) {
+    local_budget() = std::max(budget, idx_t{0});
+#ifdef CPB_USE_MKL
+    mkl_set_num_threads_local(static_cast<int>(local_budget()));
+#endif
+}
+
+idx_t resolve_num_threads(idx_t num_threads) {
+    return num_threads > 0 ? num_threads : thread_budget();
+}
+
+idx_t share_budget(idx_t num_workers) {
+    return std::max(thread_budget() / std::max(num_workers, idx_t{1}), idx_t{1});
+}
+
+ThreadBudgetScope::ThreadBudgetScope(idx_t budget) : previous(local_budget()), previous_mkl(0) {
+    local_budget() = std::max(budget, idx_t{1});
+#ifdef CPB_USE_MKL
+    previous_mkl = mkl_set_num_threads_local(static_cast<int>(local_budget()));
+#endif
+}
+
+ThreadBudgetScope::~ThreadBudgetScope() {
+    local_budget() = previous;
+#ifdef CPB_USE_MKL
+    mkl_set_num_threads_local(previous_mkl);
+#endif
+}
+
+idx_t parse_cgroup_cpu_max(std::string const& cpu_max) {
+    std::istringstream stream(cpu_max);
+    auto quota = std::string();
+    auto period = 0.0;
+    if (!(stream >> quota >> period) || quota == "max" || period <= 0) { return 0; }
+
+    try {
+        auto const q = std::stod(quota);
+        if (q <= 0) { return 0; } // cgroup v1 uses -1 for no limit
+        return std::max(static_cast<idx_t>(std::ceil(q / period)), idx_t{1});
+    } catch (std::exception const&) {
+        return 0;
+    }
+}
+
+} // namespace cpb
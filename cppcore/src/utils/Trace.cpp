@@ -0,0 +1,107 @@
+#include "utils/Trace.hpp"
+#include "support/format.hpp"
+
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace cpb { namespace trace {
+
+namespace detail {
+    std::atomic<bool> is_enabled{false};
+}
+
+namespace {
+    using detail::Clock;
+
+    struct Event {
+        char const* name;
+        char const* category;
+        std::chrono::nanoseconds start;
+        std::chrono::nanoseconds duration;
+        int thread;
+    };
+
+    struct Recorder {
+        std::mutex mutex;
+        std::vector<Event> events;
+        Clock::time_point origin = Clock::now();
+    };
+
+    Recorder& recorder() {
+        static Recorder instance;
+        return instance;
+    }
+
+    /// Small sequential IDs are easier to follow in the trace viewer than the native ones
+    int thread_index() {
+        static std::atomic<int> next{0};
+        thread_local int const index = next++;
+        return index;
+    }
+
+    double microseconds(std::chrono::nanoseconds ns) {
+        return 1e-3 * static_cast<double>(ns.count());
+    }
+} // anonymous namespace
+
+void detail::record(char const* name, char const* category, Clock::time_point start,
+                    Clock::time_point end) {
+    auto const thread = thread_index();
+    auto& r = recorder();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.events.push_back({name, category, start - r.origin, end - start, thread});
+}
+
+void start() {
+    auto& r = recorder();
+    {
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.events.clear();
+        r.origin = Clock::now();
+    }
+    detail::is_enabled.store(true);
+}
+
+void stop() {
+    detail::is_enabled.store(false);
+}
+
+void clear() {
+    auto& r = recorder();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.events.clear();
+}
+
+std::size_t size() {
+    auto& r = recorder();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    return r.events.size();
+}
+
+std::string json() {
+    auto& r = recorder();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    auto out = std::string{"{\"traceEvents\":["};
+    auto separator = "\n";
+    for (auto const& e : r.events) {
+        out += fmt::format("{}{{\"name\":\"{}\",\"cat\":\"{}\",\"ph\":\"X\",\"ts\":{:.3f},"
+                           "\"dur\":{:.3f},\"pid\":0,\"tid\":{}}}", separator, e.name,
+                           e.category, microseconds(e.start), microseconds(e.duration), e.thread);
+        separator = ",\n";
+    }
+    out += "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return out;
+}
+
+void write(std::string const& filename) {
+    std::ofstream file(filename);
+    if (!file) {
+        throw std::runtime_error("Can't open trace file: " + filename);
+    }
+    file << json();
+}
+
+}} // namespace cpb::trace
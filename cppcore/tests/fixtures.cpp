@@ -55,6 +55,18 @@ Lattice square_multiorbital() {
     return lattice;
 }
 
+Lattice cubic(float a, float t) {
+    auto lattice = Lattice({a, 0, 0}, {0, a, 0}, {0, 0, a});
+
+    lattice.add_sublattice("A", {0, 0, 0}, 6 * t);
+
+    lattice.register_hopping_energy("-t", -t);
+    lattice.add_hopping({1, 0, 0}, "A", "A", "-t");
+    lattice.add_hopping({0, 1, 0}, "A", "A", "-t");
+    lattice.add_hopping({0, 0, 1}, "A", "A", "-t");
+
+    return lattice;
+}
 
 } // namespace lattice
 
@@ -24,6 +24,56 @@ TEST_CASE("Lanczos", "[lanczos]") {
     REQUIRE(all_equal);
 }
 
+TEST_CASE("Lanczos threads and coarse precision", "[lanczos]") {
+    // Large enough for the steps to be split into row blocks
+    auto const model = Model(graphene::monolayer(), Primitive(70, 70),
+                             TranslationalSymmetry(1, 1));
+    auto const& matrix = ham::get_reference<std::complex<float>>(model.hamiltonian());
+    REQUIRE(compute::LanczosPartition(matrix.rows(), 4).num_blocks == 2);
+
+    auto const expected = abs(3 * graphene::t);
+    auto const serial = compute::minmax_eigenvalues(matrix, 1e-3f);
+    auto const threaded = compute::minmax_eigenvalues(matrix, 1e-3f, /*num_threads*/4);
+    REQUIRE(threaded.max == Approx(expected));
+    REQUIRE(threaded.min == Approx(-expected));
+    REQUIRE(threaded.loops == Approx(serial.loops).margin(2));
+
+    auto const coarse = compute::minmax_eigenvalues(matrix, 1e-3f, /*num_threads*/4, 1.0);
+    REQUIRE(coarse.loops <= threaded.loops);
+    REQUIRE(coarse.max == Approx(expected).epsilon(0.01));
+    REQUIRE(coarse.min == Approx(-expected).epsilon(0.01));
+}
+
+template<class scalar_t, class index_t = std::int32_t>
+void test_gather() {
+    using simd_register_t = simd::select_vector_t<scalar_t>;
+    constexpr auto size = static_cast<int>(simd::traits<scalar_t>::size);
+
+    auto const data = VectorX<scalar_t>::Random(64).eval();
+    alignas(simd::traits<scalar_t>::align_bytes) index_t indices[size];
+    for (auto i = 0; i < size; ++i) { indices[i] = (7 * i + 3) % 64; }
+
+    alignas(simd::traits<scalar_t>::align_bytes) scalar_t result[size];
+    simd::store(result, simd::gather<simd_register_t>(data.data(), indices));
+    for (auto i = 0; i < size; ++i) {
+        REQUIRE(result[i] == data[indices[i]]);
+    }
+}
+
+TEST_CASE("SIMD gather") {
+    INFO(simd::instruction_set());
+    test_gather<float>();
+    test_gather<double>();
+    test_gather<std::complex<float>>();
+    test_gather<std::complex<double>>();
+
+    // 64-bit indices, see `PB_64BIT_INDICES`
+    test_gather<float, std::int64_t>();
+    test_gather<double, std::int64_t>();
+    test_gather<std::complex<float>, std::int64_t>();
+    test_gather<std::complex<double>, std::int64_t>();
+}
+
 template<class scalar_t>
 SparseMatrixX<scalar_t> make_random_csr(idx_t rows, idx_t cols) {
     using real_t = num::get_real_t<scalar_t>;
@@ -79,6 +129,14 @@ num::EllMatrix<scalar_t> convert_sparse(SparseMatrixX<scalar_t> const& m,
     return num::csr_to_ell(m);
 }
 
+template<class scalar_t>
+num::SellMatrix<scalar_t> convert_sparse(SparseMatrixX<scalar_t> const& m,
+                                         var::tag<num::SellMatrix<scalar_t>>) {
+    constexpr auto chunk_size = static_cast<idx_t>(simd::traits<scalar_t>::size);
+    auto const borders = std::vector<storage_idx_t>{5, static_cast<storage_idx_t>(m.rows() / 2)};
+    return num::csr_to_sell(m, chunk_size, 4 * chunk_size, borders);
+}
+
 template<class SparseMatrix, class scalar_t = typename SparseMatrix::Scalar>
 void test_kpm_spmv(idx_t size) {
     constexpr auto cols = static_cast<idx_t>(simd::traits<scalar_t>::size);
@@ -159,4 +217,606 @@ TEST_CASE("KPM SpMV") {
     test_kpm_spmv<num::EllMatrix<std::complex<float>>>(size);
     test_kpm_spmv<num::EllMatrix<double>>(size);
     test_kpm_spmv<num::EllMatrix<std::complex<double>>>(size);
+
+    test_kpm_spmv<num::SellMatrix<float>>(size);
+    test_kpm_spmv<num::SellMatrix<std::complex<float>>>(size);
+    test_kpm_spmv<num::SellMatrix<double>>(size);
+    test_kpm_spmv<num::SellMatrix<std::complex<double>>>(size);
+}
+
+template<class scalar_t>
+void test_ell_widths(idx_t size) {
+    auto const x = VectorX<scalar_t>::Random(size).eval();
+    auto const y = VectorX<scalar_t>::Random(size).eval();
+    constexpr auto cols = static_cast<idx_t>(simd::traits<scalar_t>::size);
+    auto const xx = MatrixX<scalar_t>::Random(size, cols).eval();
+    auto const yy = MatrixX<scalar_t>::Random(size, cols).eval();
+
+    // Widths up to 16 have specialized kernels and the rest take the generic one
+    for (auto width = idx_t{1}; width <= 18; ++width) {
+        INFO("nnz_per_row: " << width);
+        auto triplets = std::vector<Eigen::Triplet<scalar_t>>();
+        for (auto row = storage_idx_t{0}; row < size; ++row) {
+            for (auto n = storage_idx_t{0}; n < width; ++n) {
+                auto const col = static_cast<storage_idx_t>((row + 7 * n) % size);
+                triplets.emplace_back(row, col, static_cast<scalar_t>(1 + n + row % 3));
+            }
+        }
+        auto csr = SparseMatrixX<scalar_t>(size, size);
+        csr.setFromTriplets(triplets.begin(), triplets.end());
+        csr.makeCompressed();
+        auto const ell = num::csr_to_ell(csr);
+        REQUIRE(ell.nnz_per_row == width);
+
+        // An unaligned row range also covers the peel and tail of the vectorized loop
+        auto const start = idx_t{3}, end = size - 2;
+        auto expected_r = y;
+        auto expected_m2 = scalar_t{0};
+        auto expected_m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(start, end, csr, x, expected_r, expected_m2, expected_m3);
+
+        auto r = y;
+        auto m2 = scalar_t{0};
+        auto m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(start, end, ell, x, r, m2, m3);
+        REQUIRE(r.isApprox(expected_r));
+        REQUIRE(approx_equal(m2, expected_m2));
+        REQUIRE(approx_equal(m3, expected_m3));
+
+        r = y;
+        compute::kpm_spmv(start, end, ell, x, r);
+        REQUIRE(r.isApprox(expected_r));
+
+        auto expected_rr = yy;
+        auto expected_m22 = simd::array<scalar_t>{{0}};
+        auto expected_m33 = simd::array<scalar_t>{{0}};
+        compute::kpm_spmv_diagonal(start, end, csr, xx, expected_rr, expected_m22, expected_m33);
+
+        auto rr = yy;
+        auto m22 = simd::array<scalar_t>{{0}};
+        auto m33 = simd::array<scalar_t>{{0}};
+        compute::kpm_spmv_diagonal(start, end, ell, xx, rr, m22, m33);
+        REQUIRE(rr.isApprox(expected_rr));
+        REQUIRE(approx_equal(m22, expected_m22));
+        REQUIRE(approx_equal(m33, expected_m33));
+
+        rr = yy;
+        compute::kpm_spmv(start, end, ell, xx, rr);
+        REQUIRE(rr.isApprox(expected_rr));
+    }
+}
+
+TEST_CASE("KPM SpMV fixed-width ELL") {
+    test_ell_widths<float>(100);
+    test_ell_widths<std::complex<float>>(100);
+    test_ell_widths<double>(100);
+    test_ell_widths<std::complex<double>>(100);
+}
+
+template<class scalar_t>
+void test_sell_ranges(idx_t size) {
+    auto const csr = make_random_csr<scalar_t>(size, size);
+    auto const sell = convert_sparse(csr, var::tag<num::SellMatrix<scalar_t>>{});
+    auto const x = VectorX<scalar_t>::Random(size).eval();
+    auto const y = VectorX<scalar_t>::Random(size).eval();
+
+    // Ranges which cut through sorting windows must only touch their own rows
+    using Range = std::pair<idx_t, idx_t>;
+    for (auto const& range : {Range{0, 5}, Range{3, 61}, Range{50, 51}, Range{17, size}}) {
+        INFO("range: [" << range.first << ", " << range.second << ")");
+        auto expected_r = y;
+        auto expected_m2 = scalar_t{0};
+        auto expected_m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(range.first, range.second, csr, x, expected_r,
+                                   expected_m2, expected_m3);
+
+        auto r = y;
+        auto m2 = scalar_t{0};
+        auto m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(range.first, range.second, sell, x, r, m2, m3);
+        REQUIRE(r.isApprox(expected_r));
+        REQUIRE(approx_equal(m2, expected_m2));
+        REQUIRE(approx_equal(m3, expected_m3));
+
+        r = y;
+        compute::kpm_spmv(range.first, range.second, sell, x, r);
+        REQUIRE(r.isApprox(expected_r));
+    }
+}
+
+TEST_CASE("KPM SpMV SELL row ranges") {
+    test_sell_ranges<float>(100);
+    test_sell_ranges<std::complex<double>>(100);
+}
+
+template<class scalar_t>
+void test_bsr(idx_t size, idx_t block_size) {
+    INFO("block size: " << block_size);
+    constexpr auto cols = static_cast<idx_t>(simd::traits<scalar_t>::size);
+    auto const csr = make_random_csr<scalar_t>(size, size);
+    auto const bsr = num::csr_to_bsr(csr, block_size);
+    REQUIRE(bsr.num_block_rows() == size / block_size);
+    REQUIRE(bsr.nonZeros() >= csr.nonZeros());
+
+    auto const x = VectorX<scalar_t>::Random(size).eval();
+    auto const y = VectorX<scalar_t>::Random(size).eval();
+    auto const xx = MatrixX<scalar_t>::Random(size, cols).eval();
+    auto const yy = MatrixX<scalar_t>::Random(size, cols).eval();
+
+    // Ranges which cut through block rows must only touch their own rows
+    using Range = std::pair<idx_t, idx_t>;
+    for (auto const& range : {Range{0, size}, Range{0, 5}, Range{4, 61}, Range{50, 51}}) {
+        INFO("range: [" << range.first << ", " << range.second << ")");
+        auto expected_r = y;
+        auto expected_m2 = scalar_t{0};
+        auto expected_m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(range.first, range.second, csr, x, expected_r,
+                                   expected_m2, expected_m3);
+
+        auto r = y;
+        auto m2 = scalar_t{0};
+        auto m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(range.first, range.second, bsr, x, r, m2, m3);
+        REQUIRE(r.isApprox(expected_r));
+        REQUIRE(approx_equal(m2, expected_m2));
+        REQUIRE(approx_equal(m3, expected_m3));
+
+        auto expected_rr = yy;
+        compute::kpm_spmv(range.first, range.second, csr, xx, expected_rr);
+        auto rr = yy;
+        compute::kpm_spmv(range.first, range.second, bsr, xx, rr);
+        REQUIRE(rr.isApprox(expected_rr));
+    }
+}
+
+template<class scalar_t>
+void test_hermitian(idx_t size) {
+    constexpr auto cols = static_cast<idx_t>(simd::traits<scalar_t>::size);
+    auto const random = make_random_csr<scalar_t>(size, size);
+    auto const csr = SparseMatrixX<scalar_t>(random + SparseMatrixX<scalar_t>(random.adjoint()));
+    auto const hermitian = num::csr_to_hermitian(csr);
+    REQUIRE(hermitian.nonZeros() < csr.nonZeros());
+
+    auto const x = VectorX<scalar_t>::Random(size).eval();
+    auto const y = VectorX<scalar_t>::Random(size).eval();
+    auto const xx = MatrixX<scalar_t>::Random(size, cols).eval();
+    auto const yy = MatrixX<scalar_t>::Random(size, cols).eval();
+
+    // Each range gets the transposed elements of the rows before it but writes only its own
+    using Range = std::pair<idx_t, idx_t>;
+    for (auto const& range : {Range{0, size}, Range{0, 5}, Range{4, 61}, Range{50, 51},
+                              Range{17, size}}) {
+        INFO("range: [" << range.first << ", " << range.second << ")");
+        auto expected_r = y;
+        auto expected_m2 = scalar_t{0};
+        auto expected_m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(range.first, range.second, csr, x, expected_r,
+                                   expected_m2, expected_m3);
+
+        auto r = y;
+        auto m2 = scalar_t{0};
+        auto m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(range.first, range.second, hermitian, x, r, m2, m3);
+        REQUIRE(r.isApprox(expected_r));
+        REQUIRE(approx_equal(m2, expected_m2));
+        REQUIRE(approx_equal(m3, expected_m3));
+
+        auto expected_rr = yy;
+        compute::kpm_spmv(range.first, range.second, csr, xx, expected_rr);
+        auto rr = yy;
+        compute::kpm_spmv(range.first, range.second, hermitian, xx, rr);
+        REQUIRE(rr.isApprox(expected_rr));
+    }
+}
+
+TEST_CASE("KPM SpMV Hermitian half storage") {
+    test_hermitian<float>(100);
+    test_hermitian<std::complex<float>>(100);
+    test_hermitian<double>(100);
+    test_hermitian<std::complex<double>>(100);
+}
+
+template<class scalar_t>
+void test_table_ell(idx_t size) {
+    constexpr auto cols = static_cast<idx_t>(simd::traits<scalar_t>::size);
+    auto csr = make_random_csr<scalar_t>(size, size);
+    REQUIRE_FALSE(num::csr_to_table_ell(csr)); // (almost) all values are different
+
+    // A few distinct values, except for the first rows which don't all fit in the table
+    auto const values = std::vector<scalar_t>{scalar_t{0.5f}, scalar_t{-1}, scalar_t{2}};
+    auto const indptr = csr.outerIndexPtr();
+    for (auto row = size / 10; row < size; ++row) {
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            csr.valuePtr()[n] = values[n % values.size()];
+        }
+    }
+    auto const table_ell = num::csr_to_table_ell(csr);
+    REQUIRE(table_ell);
+    REQUIRE(table_ell.table.size() == num::TableEllMatrix<scalar_t>::max_table_size);
+    REQUIRE(table_ell.escaped.nonZeros() > 0);
+    REQUIRE(table_ell.escaped.nonZeros() < indptr[size / 10]);
+
+    auto const x = VectorX<scalar_t>::Random(size).eval();
+    auto const y = VectorX<scalar_t>::Random(size).eval();
+    auto const xx = MatrixX<scalar_t>::Random(size, cols).eval();
+    auto const yy = MatrixX<scalar_t>::Random(size, cols).eval();
+
+    using Range = std::pair<idx_t, idx_t>;
+    for (auto const& range : {Range{0, size}, Range{0, 5}, Range{4, 61}, Range{50, 51}}) {
+        INFO("range: [" << range.first << ", " << range.second << ")");
+        auto expected_r = y;
+        auto expected_m2 = scalar_t{0};
+        auto expected_m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(range.first, range.second, csr, x, expected_r,
+                                   expected_m2, expected_m3);
+
+        auto r = y;
+        auto m2 = scalar_t{0};
+        auto m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(range.first, range.second, table_ell, x, r, m2, m3);
+        REQUIRE(r.isApprox(expected_r));
+        REQUIRE(approx_equal(m2, expected_m2));
+        REQUIRE(approx_equal(m3, expected_m3));
+
+        auto expected_rr = yy;
+        compute::kpm_spmv(range.first, range.second, csr, xx, expected_rr);
+        auto rr = yy;
+        compute::kpm_spmv(range.first, range.second, table_ell, xx, rr);
+        REQUIRE(rr.isApprox(expected_rr));
+    }
+}
+
+TEST_CASE("KPM SpMV value table ELL") {
+    test_table_ell<float>(200);
+    test_table_ell<std::complex<float>>(200);
+    test_table_ell<double>(200);
+    test_table_ell<std::complex<double>>(200);
+}
+
+template<class scalar_t>
+void test_delta_ell(SparseMatrixX<scalar_t> const& csr, idx_t expected_escaped) {
+    constexpr auto cols = static_cast<idx_t>(simd::traits<scalar_t>::size);
+    auto const size = csr.rows();
+    auto const delta_ell = num::csr_to_delta_ell(csr);
+    REQUIRE(delta_ell);
+    REQUIRE(delta_ell.escaped.nonZeros() == expected_escaped);
+    REQUIRE(delta_ell.nonZeros(size) == delta_ell.nonZeros());
+
+    auto const x = VectorX<scalar_t>::Random(size).eval();
+    auto const y = VectorX<scalar_t>::Random(size).eval();
+    auto const xx = MatrixX<scalar_t>::Random(size, cols).eval();
+    auto const yy = MatrixX<scalar_t>::Random(size, cols).eval();
+
+    using Range = std::pair<idx_t, idx_t>;
+    for (auto const& range : {Range{0, size}, Range{0, 5}, Range{4, 61}, Range{size - 3, size}}) {
+        INFO("range: [" << range.first << ", " << range.second << ")");
+        auto expected_r = y;
+        auto expected_m2 = scalar_t{0};
+        auto expected_m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(range.first, range.second, csr, x, expected_r,
+                                   expected_m2, expected_m3);
+
+        auto r = y;
+        auto m2 = scalar_t{0};
+        auto m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(range.first, range.second, delta_ell, x, r, m2, m3);
+        REQUIRE(r.isApprox(expected_r));
+        REQUIRE(approx_equal(m2, expected_m2));
+        REQUIRE(approx_equal(m3, expected_m3));
+
+        auto expected_rr = yy;
+        compute::kpm_spmv(range.first, range.second, csr, xx, expected_rr);
+        auto rr = yy;
+        compute::kpm_spmv(range.first, range.second, delta_ell, xx, rr);
+        REQUIRE(rr.isApprox(expected_rr));
+    }
+}
+
+/// Periodic chain: the elements which close the ring are too far from the diagonal
+template<class scalar_t>
+SparseMatrixX<scalar_t> make_ring_csr(idx_t size) {
+    auto triplets = std::vector<Eigen::Triplet<scalar_t>>();
+    for (auto i = storage_idx_t{0}; i < size; ++i) {
+        auto const j = static_cast<storage_idx_t>((i + 1) % size);
+        auto const value = static_cast<scalar_t>(1 + i % 7);
+        triplets.emplace_back(i, j, value);
+        triplets.emplace_back(j, i, value);
+        triplets.emplace_back(i, i, static_cast<scalar_t>(i % 3));
+    }
+
+    auto csr = SparseMatrixX<scalar_t>(size, size);
+    csr.setFromTriplets(triplets.begin(), triplets.end());
+    csr.makeCompressed();
+    return csr;
+}
+
+TEST_CASE("KPM SpMV 16-bit offset ELL") {
+    test_delta_ell(make_random_csr<float>(200, 200), 0);
+    test_delta_ell(make_random_csr<std::complex<float>>(200, 200), 0);
+    test_delta_ell(make_random_csr<double>(200, 200), 0);
+    test_delta_ell(make_random_csr<std::complex<double>>(200, 200), 0);
+
+    constexpr auto ring_size = idx_t{40000}; // larger than the 16-bit offsets
+    test_delta_ell(make_ring_csr<float>(ring_size), 2);
+    test_delta_ell(make_ring_csr<std::complex<double>>(ring_size), 2);
+    REQUIRE_FALSE(num::csr_to_delta_ell(make_ring_csr<float>(ring_size), /*max_escaped*/0.0));
+}
+
+template<class scalar_t>
+void test_split_ell(idx_t size) {
+    constexpr auto cols = static_cast<idx_t>(simd::traits<scalar_t>::size);
+    auto const csr = make_random_csr<scalar_t>(size, size);
+    auto const split_ell = num::csr_to_split_ell(csr);
+    REQUIRE(split_ell);
+    REQUIRE(split_ell.imag.size() == (num::is_complex<scalar_t>() ? split_ell.real.size() : 0));
+
+    auto const x = VectorX<scalar_t>::Random(size).eval();
+    auto const y = VectorX<scalar_t>::Random(size).eval();
+    auto const xx = MatrixX<scalar_t>::Random(size, cols).eval();
+    auto const yy = MatrixX<scalar_t>::Random(size, cols).eval();
+
+    using Range = std::pair<idx_t, idx_t>;
+    for (auto const& range : {Range{0, size}, Range{0, 5}, Range{4, 61}, Range{size - 3, size}}) {
+        INFO("range: [" << range.first << ", " << range.second << ")");
+        auto expected_r = y;
+        auto expected_m2 = scalar_t{0};
+        auto expected_m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(range.first, range.second, csr, x, expected_r,
+                                   expected_m2, expected_m3);
+
+        auto r = y;
+        auto m2 = scalar_t{0};
+        auto m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(range.first, range.second, split_ell, x, r, m2, m3);
+        REQUIRE(r.isApprox(expected_r));
+        REQUIRE(approx_equal(m2, expected_m2));
+        REQUIRE(approx_equal(m3, expected_m3));
+
+        auto expected_rr = yy;
+        compute::kpm_spmv(range.first, range.second, csr, xx, expected_rr);
+        auto rr = yy;
+        compute::kpm_spmv(range.first, range.second, split_ell, xx, rr);
+        REQUIRE(rr.isApprox(expected_rr));
+    }
+}
+
+TEST_CASE("KPM SpMV split complex ELL") {
+    test_split_ell<float>(200);
+    test_split_ell<std::complex<float>>(200);
+    test_split_ell<double>(200);
+    test_split_ell<std::complex<double>>(200);
+    test_split_ell<std::complex<float>>(203); // not a multiple of the SIMD width
+}
+
+template<class scalar_t>
+void test_quantized_ell(idx_t size, num::ValuePrecision precision) {
+    constexpr auto cols = static_cast<idx_t>(simd::traits<scalar_t>::size);
+    auto const csr = make_random_csr<scalar_t>(size, size);
+    auto const quantized = num::csr_to_quantized_ell(csr, precision);
+    REQUIRE(quantized);
+
+    // The decoded values are within half a step of the precision (plus rounding)
+    auto const indptr = csr.outerIndexPtr();
+    auto const values = csr.valuePtr();
+    auto const max_value = ArrayX<scalar_t>::Map(values, csr.nonZeros()).abs().maxCoeff();
+    for (auto row = idx_t{0}; row < size; ++row) {
+        for (auto n = idx_t{0}; n < indptr[row + 1] - indptr[row]; ++n) {
+            auto const original = values[indptr[row] + n];
+            auto const bound = precision == num::ValuePrecision::BF16 ? std::abs(original) / 256
+                                                                      : max_value / 250;
+            REQUIRE(std::abs(quantized.value(row, n) - original) <= bound);
+        }
+    }
+
+    auto triplets = std::vector<Eigen::Triplet<scalar_t>>();
+    quantized.for_each([&](storage_idx_t row, storage_idx_t col, scalar_t value) {
+        if (value != scalar_t{0}) { triplets.emplace_back(row, col, value); } // not padding
+    });
+    auto decoded = SparseMatrixX<scalar_t>(size, size);
+    decoded.setFromTriplets(triplets.begin(), triplets.end());
+
+    auto const x = VectorX<scalar_t>::Random(size).eval();
+    auto const y = VectorX<scalar_t>::Random(size).eval();
+    auto const xx = MatrixX<scalar_t>::Random(size, cols).eval();
+    auto const yy = MatrixX<scalar_t>::Random(size, cols).eval();
+
+    using Range = std::pair<idx_t, idx_t>;
+    for (auto const& range : {Range{0, size}, Range{0, 5}, Range{4, 61}, Range{size - 3, size}}) {
+        INFO("range: [" << range.first << ", " << range.second << ")");
+        auto expected_r = y;
+        auto expected_m2 = scalar_t{0};
+        auto expected_m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(range.first, range.second, decoded, x, expected_r,
+                                   expected_m2, expected_m3);
+
+        auto r = y;
+        auto m2 = scalar_t{0};
+        auto m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(range.first, range.second, quantized, x, r, m2, m3);
+        REQUIRE(r.isApprox(expected_r));
+        REQUIRE(approx_equal(m2, expected_m2));
+        REQUIRE(approx_equal(m3, expected_m3));
+
+        auto expected_rr = yy;
+        compute::kpm_spmv(range.first, range.second, decoded, xx, expected_rr);
+        auto rr = yy;
+        compute::kpm_spmv(range.first, range.second, quantized, xx, rr);
+        REQUIRE(rr.isApprox(expected_rr));
+    }
+}
+
+TEST_CASE("KPM SpMV quantized ELL") {
+    for (auto precision : {num::ValuePrecision::BF16, num::ValuePrecision::INT8}) {
+        INFO("precision: " << static_cast<int>(precision));
+        test_quantized_ell<float>(200, precision);
+        test_quantized_ell<double>(200, precision);
+        test_quantized_ell<float>(203, precision); // not a multiple of the SIMD width
+    }
+
+    // Round to nearest even: 1 + 2^-8 is halfway between 1 and the next bfloat16
+    REQUIRE(num::bf16_to_float(num::float_to_bf16(1.5f)) == 1.5f);
+    REQUIRE(num::bf16_to_float(num::float_to_bf16(1.0f + 1.0f / 256)) == 1.0f);
+    REQUIRE(num::bf16_to_float(num::float_to_bf16(1.0f + 3.0f / 256)) == 1.0f + 4.0f / 256);
+    REQUIRE(std::isnan(num::bf16_to_float(num::float_to_bf16(std::nanf("")))));
+
+    // Complex values are not quantized
+    REQUIRE_FALSE(num::csr_to_quantized_ell(make_random_csr<std::complex<float>>(10, 10),
+                                            num::ValuePrecision::BF16));
+}
+
+template<class scalar_t>
+void test_multi_ell(idx_t size, idx_t num_members) {
+    constexpr auto lanes = static_cast<idx_t>(simd::traits<scalar_t>::size);
+    auto members = std::vector<SparseMatrixX<scalar_t>>();
+    members.push_back(make_random_csr<scalar_t>(size, size));
+    for (auto i = idx_t{1}; i < num_members; ++i) {
+        auto m = members.front();
+        for (auto n = idx_t{0}; n < m.nonZeros(); ++n) {
+            m.valuePtr()[n] *= static_cast<scalar_t>(i + 1);
+        }
+        members.push_back(m);
+    }
+    auto pointers = std::vector<SparseMatrixX<scalar_t> const*>();
+    for (auto const& m : members) { pointers.push_back(&m); }
+
+    auto const multi_ell = num::csr_to_multi_ell(pointers, lanes);
+    REQUIRE(multi_ell);
+    REQUIRE(multi_ell.num_lanes == lanes);
+
+    auto const xx = MatrixX<scalar_t>::Random(size, lanes).eval();
+    auto const yy = MatrixX<scalar_t>::Random(size, lanes).eval();
+
+    using Range = std::pair<idx_t, idx_t>;
+    for (auto const& range : {Range{0, size}, Range{0, 5}, Range{4, 61}, Range{size - 3, size}}) {
+        INFO("range: [" << range.first << ", " << range.second << ")");
+        auto rr = yy;
+        auto m2 = simd::array<scalar_t>{{0}};
+        auto m3 = simd::array<scalar_t>{{0}};
+        compute::kpm_spmv_diagonal(range.first, range.second, multi_ell, xx, rr, m2, m3);
+
+        auto rr_plain = yy;
+        compute::kpm_spmv(range.first, range.second, multi_ell, xx, rr_plain);
+        REQUIRE(rr_plain.isApprox(rr));
+
+        // Lane `i` is the product with member `i` and the lanes without a member are zero
+        for (auto i = idx_t{0}; i < lanes; ++i) {
+            INFO("lane: " << i);
+            auto expected_r = yy.col(i).eval();
+            auto expected_m2 = scalar_t{0};
+            auto expected_m3 = scalar_t{0};
+            if (i < num_members) {
+                auto const x = xx.col(i).eval();
+                compute::kpm_spmv_diagonal(range.first, range.second, members[i], x,
+                                           expected_r, expected_m2, expected_m3);
+            } else {
+                expected_r.segment(range.first, range.second - range.first) *= scalar_t{-1};
+                auto const r = expected_r.segment(range.first, range.second - range.first);
+                auto const x = xx.col(i).segment(range.first, range.second - range.first);
+                expected_m2 = x.squaredNorm();
+                expected_m3 = r.dot(x);
+            }
+            REQUIRE(rr.col(i).isApprox(expected_r));
+            REQUIRE(approx_equal(m2[i], expected_m2));
+            REQUIRE(approx_equal(m3[i], expected_m3));
+        }
+    }
+
+    // Different patterns or too many members can't share the lanes
+    auto const other = make_random_csr<scalar_t>(size + 1, size + 1);
+    REQUIRE_FALSE(num::csr_to_multi_ell({pointers.front(), &other}, lanes));
+    REQUIRE_FALSE(num::csr_to_multi_ell(pointers, num_members - 1));
+}
+
+TEST_CASE("KPM SpMV multiple Hamiltonian ELL") {
+    test_multi_ell<float>(200, 2);
+    test_multi_ell<std::complex<float>>(200, 2);
+    test_multi_ell<double>(200, 2);
+    test_multi_ell<std::complex<double>>(200, 2);
+    test_multi_ell<float>(203, 3); // not a multiple of the SIMD width
+}
+
+/// Tridiagonal matrix with `num_hubs` rows which are coupled to every third row
+template<class scalar_t>
+SparseMatrixX<scalar_t> make_hub_csr(idx_t size, idx_t num_hubs) {
+    auto triplets = std::vector<Eigen::Triplet<scalar_t>>();
+    for (auto i = storage_idx_t{0}; i < size; ++i) {
+        triplets.emplace_back(i, i, static_cast<scalar_t>(i % 3));
+        if (i + 1 < size) {
+            auto const value = static_cast<scalar_t>(1 + i % 7);
+            triplets.emplace_back(i, i + 1, value);
+            triplets.emplace_back(i + 1, i, value);
+        }
+    }
+    for (auto hub = storage_idx_t{0}; hub < num_hubs; ++hub) {
+        for (auto j = hub + 2; j < size; j += 3) {
+            auto const value = static_cast<scalar_t>(0.5f);
+            triplets.emplace_back(hub, j, value);
+            triplets.emplace_back(j, hub, value);
+        }
+    }
+
+    auto csr = SparseMatrixX<scalar_t>(size, size);
+    csr.setFromTriplets(triplets.begin(), triplets.end());
+    csr.makeCompressed();
+    return csr;
+}
+
+template<class scalar_t>
+void test_hyb(idx_t size) {
+    constexpr auto cols = static_cast<idx_t>(simd::traits<scalar_t>::size);
+    auto const csr = make_hub_csr<scalar_t>(size, 2);
+    REQUIRE(num::ell_padding(csr) > 2);
+
+    auto const width = num::row_length_percentile(csr, 0.95);
+    REQUIRE(width < sparse::max_nnz_per_row(csr));
+    auto const hyb = num::csr_to_hyb(csr, width);
+    REQUIRE(hyb.overflow.nonZeros() > 0);
+    REQUIRE(hyb.nonZeros(size) == hyb.nonZeros());
+    REQUIRE(hyb.nonZeros() < size * sparse::max_nnz_per_row(csr));
+
+    auto const x = VectorX<scalar_t>::Random(size).eval();
+    auto const y = VectorX<scalar_t>::Random(size).eval();
+    auto const xx = MatrixX<scalar_t>::Random(size, cols).eval();
+    auto const yy = MatrixX<scalar_t>::Random(size, cols).eval();
+
+    using Range = std::pair<idx_t, idx_t>;
+    for (auto const& range : {Range{0, size}, Range{0, 1}, Range{1, 61}, Range{size - 3, size}}) {
+        INFO("range: [" << range.first << ", " << range.second << ")");
+        auto expected_r = y;
+        auto expected_m2 = scalar_t{0};
+        auto expected_m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(range.first, range.second, csr, x, expected_r,
+                                   expected_m2, expected_m3);
+
+        auto r = y;
+        auto m2 = scalar_t{0};
+        auto m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(range.first, range.second, hyb, x, r, m2, m3);
+        REQUIRE(r.isApprox(expected_r));
+        REQUIRE(approx_equal(m2, expected_m2));
+        REQUIRE(approx_equal(m3, expected_m3));
+
+        auto expected_rr = yy;
+        compute::kpm_spmv(range.first, range.second, csr, xx, expected_rr);
+        auto rr = yy;
+        compute::kpm_spmv(range.first, range.second, hyb, xx, rr);
+        REQUIRE(rr.isApprox(expected_rr));
+    }
+}
+
+TEST_CASE("KPM SpMV hybrid ELL") {
+    test_hyb<float>(200);
+    test_hyb<std::complex<float>>(200);
+    test_hyb<double>(200);
+    test_hyb<std::complex<double>>(200);
+}
+
+TEST_CASE("KPM SpMV BSR") {
+    constexpr auto size = 84; // divisible by all the tested block sizes
+    for (auto block_size : {2, 3, 6, 7}) {
+        test_bsr<float>(size, block_size);
+        test_bsr<std::complex<float>>(size, block_size);
+        test_bsr<double>(size, block_size);
+        test_bsr<std::complex<double>>(size, block_size);
+    }
 }
@@ -3,6 +3,9 @@
 
 #include "Model.hpp"
 #include "detail/algorithm.hpp"
+#include "detail/thread.hpp"
+
+#include <numeric>
 using namespace cpb;
 
 namespace static_test_typelist {
@@ -56,3 +59,109 @@ TEST_CASE("sliced") {
     REQUIRE_THAT(vectors[2], Catch::Equals(std::vector<int>{6, 7, 8}));
     REQUIRE_THAT(vectors[3], Catch::Equals(std::vector<int>{9}));
 }
+
+TEST_CASE("WorkStealingDeque") {
+    auto values = std::vector<int>(1000);
+    std::iota(values.begin(), values.end(), 0);
+
+    detail::WorkStealingDeque<int*> deque(/*capacity*/4); // must grow
+    for (auto& v : values) { deque.push(&v); }
+    REQUIRE(deque.size() == 1000);
+    REQUIRE(*deque.pop() == 999); // LIFO for the owner
+    REQUIRE(*deque.steal() == 0); // FIFO for the thieves
+
+    // Every element is taken exactly once by either the owner or one of the thieves
+    auto taken = std::vector<std::atomic<int>>(values.size());
+    for (auto& t : taken) { t = 0; }
+    taken[0] = taken[999] = 1;
+
+    auto thieves = std::vector<std::thread>(3);
+    for (auto& thief : thieves) {
+        thief = std::thread([&] {
+            while (deque.size() > 0) {
+                if (auto p = deque.steal()) { ++taken[static_cast<size_t>(*p)]; }
+            }
+        });
+    }
+    while (auto p = deque.pop()) { ++taken[static_cast<size_t>(*p)]; }
+    for (auto& thief : thieves) { thief.join(); }
+    while (auto p = deque.pop()) { ++taken[static_cast<size_t>(*p)]; } // lost races
+
+    REQUIRE(std::all_of(taken.begin(), taken.end(), [](std::atomic<int> const& t) {
+        return t == 1;
+    }));
+}
+
+TEST_CASE("ThreadPool") {
+    auto sum = std::atomic<int>(0);
+    {
+        ThreadPool pool(4);
+        for (auto i = 1; i <= 1000; ++i) {
+            pool.add([&sum, &pool, i] {
+                sum += i;
+                if (i % 100 == 0) { pool.add([&sum] { sum += 1; }); } // from a worker
+            });
+        }
+        pool.join();
+        REQUIRE(sum == 500500 + 10);
+    }
+
+    auto results = std::vector<int>(100, 0);
+    auto retired = std::vector<size_t>();
+    parallel_for(results.size(), 3, 2,
+                 [](size_t id) { return static_cast<int>(id); },
+                 [](int& value) { value *= 2; },
+                 [&](int value, size_t id) {
+                     results[id] = value;
+                     retired.push_back(id);
+                 });
+    REQUIRE(retired.size() == results.size());
+    for (auto i = size_t{0}; i < results.size(); ++i) {
+        REQUIRE(results[i] == 2 * static_cast<int>(i));
+    }
+}
+
+TEST_CASE("Thread budget") {
+    REQUIRE(available_cpus() >= 1);
+    REQUIRE(resolve_num_threads(3) == 3);
+    REQUIRE(resolve_num_threads(-1) == thread_budget());
+
+    REQUIRE(parse_cgroup_cpu_max("max 100000") == 0);
+    REQUIRE(parse_cgroup_cpu_max("-1 100000") == 0);
+    REQUIRE(parse_cgroup_cpu_max("400000 100000") == 4);
+    REQUIRE(parse_cgroup_cpu_max("150000 100000") == 2);
+    REQUIRE(parse_cgroup_cpu_max("") == 0);
+
+    ThreadBudgetScope scope(8);
+    REQUIRE(thread_budget() == 8);
+    REQUIRE(resolve_num_threads(-1) == 8);
+
+    // Nested parallelism divides the budget among the workers
+    auto budgets = std::vector<idx_t>(8, 0);
+    parallel_for_each(budgets.size(), 4, [&](size_t n) {
+        budgets[n] = thread_budget();
+        parallel_for_each(1, resolve_num_threads(-1), [&](size_t) {
+            REQUIRE(thread_budget() == 1);
+        });
+    });
+    REQUIRE(std::all_of(budgets.begin(), budgets.end(), [](idx_t b) { return b == 2; }));
+
+    ThreadTeam team(3);
+    auto team_budgets = std::vector<idx_t>(3, 0);
+    team.run([&](idx_t id) { team_budgets[id] = thread_budget(); });
+    REQUIRE(team_budgets == (std::vector<idx_t>{8, 2, 2}));
+}
+
+TEST_CASE("parallel_compact") {
+    auto const size = idx_t{1000};
+    for (auto const num_threads : {1, 3, 8}) {
+        auto v = std::vector<int>(static_cast<size_t>(size));
+        std::iota(v.begin(), v.end(), 0);
+        auto const n = parallel_compact(size, num_threads, [&](idx_t i) { return v[i] % 3 != 0; },
+                                        [&](idx_t from, idx_t to) { v[to] = v[from]; }, 64);
+        REQUIRE(n == 666);
+        for (auto i = 0; i < n; ++i) {
+            REQUIRE(v[i] == i / 2 * 3 + i % 2 + 1);
+        }
+    }
+}
@@ -2,6 +2,32 @@
 
 #include "fixtures.hpp"
 #include "KPM.hpp"
+#include "BinaryFile.hpp"
+#include "Sweep.hpp"
+#include "hamiltonian/BuiltinModifiers.hpp"
+#include "kpm/AutoTune.hpp"
+#include "kpm/CompactMap.hpp"
+#include "kpm/default/collectors.hpp"
+#include "kpm/default/dispatch.hpp"
+#include "kpm/default/pool.hpp"
+#include "kpm/calc_moments.hpp"
+#include "kpm/reconstruct.hpp"
+#include "kpm/fermi.hpp"
+#include "kpm/distributed/Compute.hpp"
+#include "kpm/distributed/DomainCompute.hpp"
+#ifdef CPB_USE_MKL
+# include "kpm/mkl/Compute.hpp"
+#endif
+#include "utils/Metrics.hpp"
+#include "utils/Trace.hpp"
+
+#include <Eigen/Eigenvalues>
+
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <numeric>
+#include <thread>
 using namespace cpb;
 
 Model make_test_model(bool is_double = false, bool is_complex = false) {
@@ -183,138 +209,2519 @@ TEST_CASE("OptimizedHamiltonian scaling") {
     REQUIRE(scaled.nonZeros() == model.hamiltonian().non_zeros() + model.hamiltonian().rows());
 }
 
-struct TestGreensResult {
-    ArrayXcd g_ii, g_ij;
+template<class Matrix, class SpMV>
+ArrayXf test_diagonal_moments(kpm::OptimizedHamiltonian const& oh, Matrix const& h2,
+                              kpm::AlgorithmConfig const& ac, SpMV const& spmv) {
+    auto const starter = kpm::unit_starter(oh);
+    auto r0 = kpm::make_r0(starter, var::tag<VectorXf>{}, 1);
+    auto r1 = kpm::make_r1(h2, r0);
 
-    TestGreensResult() = default;
-};
+    auto collect = kpm::DiagonalCollector<float>(kpm::round_num_moments(40));
+    collect.initial(r0, r1);
+    if (ac.interleaved) {
+        kpm::calc_moments::interleaved(collect, r0, r1, h2, oh.map(), ac.optimal_size, spmv);
+    } else {
+        kpm::calc_moments::basic(collect, r0, r1, h2, oh.map(), ac.optimal_size, spmv);
+    }
+    return collect.moments;
+}
 
-struct TestDosResult {
-    ArrayXd dos1, dos2, dos3, dos20;
+template<class Matrix, class SpMV>
+ArrayXf test_offdiagonal_moments(kpm::OptimizedHamiltonian const& oh, Matrix const& h2,
+                                 kpm::AlgorithmConfig const& ac, SpMV const& spmv) {
+    auto const starter = kpm::unit_starter(oh);
+    auto r0 = kpm::make_r0(starter, var::tag<VectorXf>{}, 1);
+    auto r1 = kpm::make_r1(h2, r0);
 
-    TestDosResult() = default;
-};
+    auto collect = kpm::MultiUnitCollector<float>(kpm::round_num_moments(40), oh.idx());
+    collect.initial(r0, r1);
+    if (ac.interleaved) {
+        kpm::calc_moments::interleaved(collect, r0, r1, h2, oh.map(), ac.optimal_size, spmv);
+    } else {
+        kpm::calc_moments::basic(collect, r0, r1, h2, oh.map(), ac.optimal_size, spmv);
+    }
+    return collect.moments[0];
+}
 
-std::vector<TestGreensResult> test_kpm_core(kpm::Compute const& compute,
-                                            std::vector<kpm::Config> const& configs) {
-    constexpr auto pi = double{constant::pi};
-    auto results = std::vector<TestGreensResult>();
+TEST_CASE("Row-partitioned KPM moments", "[kpm]") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(2, 2));
+    auto const num_sites = model.system()->num_sites();
+    auto const i = num_sites / 2;
+    auto const j = num_sites / 4;
+    auto bounds = kpm::Bounds(model.hamiltonian(), kpm::Config{}.lanczos_precision);
+    auto team = ThreadTeam(4);
+    auto const parallel = kpm::calc_moments::Parallel(team, /*min_rows*/16);
+    auto const serial = kpm::calc_moments::Serial{};
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
 
-    for (auto is_double_precision : {false, true}) {
-        for (auto is_complex : {false, true}) {
-            INFO("double: " << is_double_precision << ", complex: " << is_complex);
-            auto const model = make_test_model(is_double_precision, is_complex);
+    for (auto optimal_size : {false, true}) {
+        for (auto interleaved : {false, true}) {
+            INFO("optimal_size: " << optimal_size << ", interleaved: " << interleaved);
+            auto const ac = kpm::AlgorithmConfig{optimal_size, interleaved};
 
-            auto const num_sites = model.system()->num_sites();
-            auto const i = num_sites / 2;
-            auto const j = num_sites / 4;
-            auto const energy_range = ArrayXd::LinSpaced(10, -0.3, 0.3);
-            auto const broadening = 0.8;
-            auto const cols = std::vector<idx_t>{i, j, j+1, j+2};
-            auto const precision = Eigen::NumTraits<float>::dummy_precision();
+            auto csr = kpm::OptimizedHamiltonian(model.hamiltonian(), kpm::MatrixFormat::CSR,
+                                                 ac.reorder());
+            csr.optimize_for({i, i}, bounds.scaling_factors());
+            auto const& h2_csr = csr.matrix().get<SparseMatrixX<float>>();
+            REQUIRE(test_diagonal_moments(csr, h2_csr, ac, parallel).isApprox(
+                    test_diagonal_moments(csr, h2_csr, ac, serial), precision));
 
-            auto unoptimized_greens = TestGreensResult();
-            auto unoptimized_dos = TestDosResult();
+            auto ell = kpm::OptimizedHamiltonian(model.hamiltonian(), kpm::MatrixFormat::ELL,
+                                                 ac.reorder());
+            ell.optimize_for({i, i}, bounds.scaling_factors());
+            auto const& h2_ell = ell.matrix().get<num::EllMatrix<float>>();
+            REQUIRE(test_diagonal_moments(ell, h2_ell, ac, parallel).isApprox(
+                    test_diagonal_moments(ell, h2_ell, ac, serial), precision));
 
-            for (auto opt_level = size_t{0}; opt_level < configs.size(); ++opt_level) {
-                INFO("opt_level: " << opt_level);
-                auto core = kpm::Core(model.hamiltonian(), compute, configs[opt_level]);
+            auto sell = kpm::OptimizedHamiltonian(model.hamiltonian(), kpm::MatrixFormat::SELL,
+                                                  ac.reorder());
+            sell.optimize_for({i, i}, bounds.scaling_factors());
+            auto const& h2_sell = sell.matrix().get<num::SellMatrix<float>>();
+            REQUIRE(test_diagonal_moments(sell, h2_sell, ac, parallel).isApprox(
+                    test_diagonal_moments(sell, h2_sell, ac, serial), precision));
+            REQUIRE(test_diagonal_moments(sell, h2_sell, ac, serial).isApprox(
+                    test_diagonal_moments(csr, h2_csr, ac, serial), precision));
 
-                auto const gs = core.greens_vector(i, cols, energy_range, broadening);
-                REQUIRE(gs.size() == cols.size());
-                REQUIRE_FALSE(gs[0].isApprox(gs[1], precision));
-                REQUIRE_FALSE(gs[1].isApprox(gs[2], precision));
+            csr.optimize_for({i, j}, bounds.scaling_factors());
+            auto const& h2_offdiag = csr.matrix().get<SparseMatrixX<float>>();
+            REQUIRE(test_offdiagonal_moments(csr, h2_offdiag, ac, parallel).isApprox(
+                    test_offdiagonal_moments(csr, h2_offdiag, ac, serial), precision));
+        }
+    }
+}
 
-                core.set_hamiltonian(model.hamiltonian());
-                auto const g_ii = core.greens(i, i, energy_range, broadening);
-                REQUIRE(g_ii.isApprox(gs[0], precision));
+TEST_CASE("OptimizedHamiltonian full-system reordering", "[kpm]") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(6, 6));
+    auto const scale = kpm::Bounds(model.hamiltonian(), 0.002f).scaling_factors();
+    auto const bandwidth = [](SparseMatrixX<float> const& m) {
+        auto result = idx_t{0};
+        for (auto row = 0; row < m.outerSize(); ++row) {
+            for (auto it = SparseMatrixX<float>::InnerIterator(m, row); it; ++it) {
+                result = std::max(result, static_cast<idx_t>(std::abs(it.col() - row)));
+            }
+        }
+        return result;
+    };
 
-                auto const g_ij = core.greens(i, j, energy_range, broadening);
-                REQUIRE(g_ij.isApprox(gs[1], precision));
+    auto plain = kpm::OptimizedHamiltonian(model.hamiltonian(), kpm::MatrixFormat::CSR, false);
+    plain.optimize_for(kpm::Indices::full_system(), scale);
+    auto oh = kpm::OptimizedHamiltonian(model.hamiltonian(), kpm::MatrixFormat::CSR, true);
+    oh.optimize_for(kpm::Indices::full_system(), scale);
+    REQUIRE(oh.idx().is_full_system());
 
-                if (!is_complex) {
-                    auto const g_ji = core.greens(j, i, energy_range, broadening);
-                    REQUIRE(g_ij.isApprox(g_ji, precision));
-                }
+    // The sublattice-major system order couples sites from opposite halves of the matrix
+    auto const& h2 = oh.matrix().get<SparseMatrixX<float>>();
+    REQUIRE(bandwidth(h2) < bandwidth(plain.matrix().get<SparseMatrixX<float>>()) / 4);
 
-                auto const ldos0 = core.ldos({i}, energy_range, broadening);
-                auto const ldos1 = core.ldos({j}, energy_range, broadening);
-                REQUIRE(ldos0.isApprox(-1/pi * g_ii.imag(), precision));
-                REQUIRE_FALSE(ldos0.isApprox(ldos1, precision));
+    // The levels of the traversal are still valid slices: only neighbors are coupled
+    auto const& borders = oh.map().get_data();
+    auto const slice_of = [&](idx_t i) {
+        return std::upper_bound(borders.begin(), borders.end(), i) - borders.begin();
+    };
+    for (auto row = 0; row < h2.outerSize(); ++row) {
+        for (auto it = SparseMatrixX<float>::InnerIterator(h2, row); it; ++it) {
+            REQUIRE(std::abs(slice_of(it.col()) - slice_of(row)) <= 1);
+        }
+    }
 
-                auto const ldos2 = core.ldos({i, j, i, j, i, j, i, j, i, j},
-                                             energy_range, broadening);
-                REQUIRE(ldos2.cols() == 10);
-                for (auto n = 0; n < 10; n += 2) {
-                    REQUIRE(ldos0.isApprox(ldos2.col(n + 0), precision));
-                    REQUIRE(ldos1.isApprox(ldos2.col(n + 1), precision));
-                }
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto config = kpm::Config{};
+    config.algorithm = {/*optimal_size*/false, /*interleaved*/false, false, 0};
+    auto reordered = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1));
+    auto natural = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1), config);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+    REQUIRE(reordered.dos(energy, 0.1, 3).isApprox(natural.dos(energy, 0.1, 3), precision));
+}
 
-                if (opt_level == 0) {
-                    unoptimized_greens = {g_ii, g_ij};
-                } else {
-                    REQUIRE(g_ii.isApprox(unoptimized_greens.g_ii, precision));
-                    REQUIRE(g_ij.isApprox(unoptimized_greens.g_ij, precision));
-                }
+TEST_CASE("KPM matrix-powers moments", "[kpm]") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(2, 2));
+    auto const i = model.system()->num_sites() / 2;
+    auto bounds = kpm::Bounds(model.hamiltonian(), kpm::Config{}.lanczos_precision);
+    auto team = ThreadTeam(4);
+    auto const parallel = kpm::calc_moments::Parallel(team, /*min_rows*/16);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
 
-                auto const dos1 = core.dos(energy_range, broadening, 1);
-                auto const dos2 = core.dos(energy_range, broadening, 2);
-                auto const dos3 = core.dos(energy_range, broadening, 3);
-                auto const dos20 = core.dos(energy_range, broadening, 20);
-                REQUIRE_FALSE(dos1.isApprox(dos2, precision));
-                REQUIRE_FALSE(dos2.isApprox(dos3, precision));
-                REQUIRE_FALSE(dos3.isApprox(dos20, precision));
-                REQUIRE_FALSE(dos20.isApprox(dos1, precision));
+    auto oh = kpm::OptimizedHamiltonian(model.hamiltonian(), kpm::MatrixFormat::CSR, true);
+    oh.optimize_for({i, i}, bounds.scaling_factors());
+    auto const& h2 = oh.matrix().get<SparseMatrixX<float>>();
+    auto const starter = kpm::unit_starter(oh);
+    auto const num_moments = kpm::round_num_moments(40);
 
-                if (opt_level == 0) {
-                    unoptimized_dos = {dos1, dos2, dos3, dos20};
-                } else {
-                    REQUIRE(dos1.isApprox(unoptimized_dos.dos1, precision));
-                    REQUIRE(dos2.isApprox(unoptimized_dos.dos2, precision));
-                    REQUIRE(dos3.isApprox(unoptimized_dos.dos3, precision));
-                    REQUIRE(dos20.isApprox(unoptimized_dos.dos20, precision));
-                }
-            } // for opt_level
+    for (auto optimal_size : {false, true}) {
+        auto const expected = test_diagonal_moments(oh, h2, {optimal_size, false},
+                                                    kpm::calc_moments::Serial{});
+        for (auto depth : {1, 2, 3, 5, 8}) {
+            INFO("optimal_size: " << optimal_size << ", depth: " << depth);
+            auto r0 = kpm::make_r0(starter, var::tag<VectorXf>{}, 1);
+            auto r1 = kpm::make_r1(h2, r0);
+            auto collect = kpm::DiagonalCollector<float>(num_moments);
+            collect.initial(r0, r1);
+            kpm::calc_moments::matrix_powers(collect, r0, r1, h2, oh.map(), optimal_size,
+                                             depth, parallel);
+            REQUIRE(collect.moments.isApprox(expected, precision));
+        }
+    }
 
-            results.push_back(unoptimized_greens);
-        } // for is_complex
-    } // for is_double_precision
+    auto config = kpm::Config{};
+    config.algorithm.matrix_powers = 4;
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto plain = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2));
+    auto blocked = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2), config);
+    REQUIRE(blocked.ldos({i}, energy, 0.1).isApprox(plain.ldos({i}, energy, 0.1), precision));
+    REQUIRE(blocked.dos(energy, 0.1, 3).isApprox(plain.dos(energy, 0.1, 3), precision));
+}
 
-    return results;
+TEST_CASE("KPM unit starter support", "[kpm]") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(8, 8));
+    auto const i = model.system()->num_sites() / 2;
+    auto bounds = kpm::Bounds(model.hamiltonian(), kpm::Config{}.lanczos_precision);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+
+    auto oh = kpm::OptimizedHamiltonian(model.hamiltonian(), kpm::MatrixFormat::CSR, true);
+    oh.optimize_for({i, i}, bounds.scaling_factors());
+    auto const& h2 = oh.matrix().get<SparseMatrixX<float>>();
+    auto const num_moments = kpm::round_num_moments(40);
+    auto const support = oh.map().support_size(num_moments);
+    auto const rows = oh.map().reach_size(1);
+    REQUIRE(support < h2.rows());
+
+    auto const full_r0 = kpm::make_r0(kpm::unit_starter(oh), var::tag<VectorXf>{}, 1);
+    auto const full_r1 = kpm::make_r1(h2, full_r0);
+    REQUIRE(full_r1.tail(h2.rows() - rows).isZero());
+
+    SECTION("Vector") {
+        // Reused buffers may hold anything beyond the support
+        auto r0 = VectorXf::Constant(h2.rows(), 1e3f).eval();
+        auto r1 = VectorXf::Constant(h2.rows(), 1e3f).eval();
+        auto index = idx_t{0};
+        kpm::make_unit_r0(kpm::unit_starter(oh), r0, 1, index, support);
+        kpm::make_unit_r1(h2, r0, r1, rows, support, kpm::calc_moments::Serial{});
+        REQUIRE(r0.head(support).isApprox(full_r0.head(support)));
+        REQUIRE(r1.head(support).isApprox(full_r1.head(support)));
+
+        auto collect = kpm::DiagonalCollector<float>(num_moments);
+        collect.initial(r0.head(support), r1.head(support));
+        kpm::calc_moments::basic(collect, r0, r1, h2, oh.map(), true, kpm::calc_moments::Serial{});
+        auto const expected = test_diagonal_moments(oh, h2, {false, false},
+                                                    kpm::calc_moments::Serial{});
+        REQUIRE(collect.moments.isApprox(expected, precision));
+    }
+
+    SECTION("Batch") {
+        auto r0 = MatrixXf::Constant(h2.rows(), 4, 1e3f).eval();
+        auto r1 = MatrixXf::Constant(h2.rows(), 4, 1e3f).eval();
+        auto index = idx_t{0};
+        kpm::make_unit_r0(kpm::unit_starter(oh), r0, 4, index, support);
+        kpm::make_unit_r1(h2, r0, r1, rows, support, kpm::calc_moments::Serial{});
+        REQUIRE(r0.col(0).head(support).isApprox(full_r0.head(support)));
+        REQUIRE(r1.col(0).head(support).isApprox(full_r1.head(support)));
+        REQUIRE(r0.topRows(support).rightCols(3).isZero()); // past the last source
+        REQUIRE(r1.topRows(support).rightCols(3).isZero());
+    }
+
+    auto config = kpm::Config{};
+    config.algorithm.optimal_size = false;
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto full = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2), config);
+    auto optimized = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2));
+    REQUIRE(optimized.ldos({i}, energy, 0.1).isApprox(full.ldos({i}, energy, 0.1), precision));
 }
 
-TEST_CASE("KPM core", "[kpm]") {
-    auto make_config = [](kpm::MatrixFormat matrix_format, bool optimal_size, bool interleaved) {
+TEST_CASE("OptimizedHamiltonian parallel and cached reordering", "[kpm]") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(25, 25),
+                             field::constant_potential(1));
+    REQUIRE(model.system()->num_sites() > 4 * 4096); // large enough to use multiple threads
+    auto const scale = kpm::Bounds(model.hamiltonian(), 0.002f).scaling_factors();
+    auto const indices = std::vector<kpm::Indices>{
+        kpm::Indices(5, 5), kpm::Indices(100, 100), kpm::Indices(7, ArrayXi::LinSpaced(3, 7, 9))
+    };
+
+    auto make_oh = [&](kpm::MatrixFormat format, idx_t num_threads, idx_t cache_size) {
+        return kpm::OptimizedHamiltonian(model.hamiltonian(), format, /*reorder*/true,
+                                         /*mixed_precision*/false, {}, num_threads, cache_size);
+    };
+    auto require_same = [](kpm::OptimizedHamiltonian const& a,
+                           kpm::OptimizedHamiltonian const& b) {
+        REQUIRE(a.idx() == b.idx());
+        REQUIRE(a.map().get_data() == b.map().get_data());
+        REQUIRE(a.matrix().is<num::EllMatrix<float>>());
+        auto const& ell_a = a.matrix().get<num::EllMatrix<float>>();
+        auto const& ell_b = b.matrix().get<num::EllMatrix<float>>();
+        // Only the actual rows: the ones added for alignment are not initialized
+        auto const rows = ell_a.rows();
+        REQUIRE((ell_a.data.topRows(rows) == ell_b.data.topRows(rows)).all());
+        REQUIRE((ell_a.indices.topRows(rows) == ell_b.indices.topRows(rows)).all());
+    };
+
+    auto csr_serial = make_oh(kpm::MatrixFormat::CSR, 1, 0);
+    auto csr_parallel = make_oh(kpm::MatrixFormat::CSR, 4, 0);
+    csr_serial.optimize_for(indices[0], scale);
+    csr_parallel.optimize_for(indices[0], scale);
+    auto const& a = csr_serial.matrix().get<SparseMatrixX<float>>();
+    auto const& b = csr_parallel.matrix().get<SparseMatrixX<float>>();
+    REQUIRE(a.nonZeros() == b.nonZeros());
+    REQUIRE(std::equal(a.innerIndexPtr(), a.innerIndexPtr() + a.nonZeros(), b.innerIndexPtr()));
+    REQUIRE(std::equal(a.valuePtr(), a.valuePtr() + a.nonZeros(), b.valuePtr()));
+
+    // Leaving and returning to the same indices restores the previous optimization
+    auto cached = make_oh(kpm::MatrixFormat::ELL, 4, 2);
+    for (auto const& i : {0, 1, 2, 0, 1, 0, 2}) {
+        INFO("indices: " << i);
+        auto reference = make_oh(kpm::MatrixFormat::ELL, 1, 0);
+        reference.optimize_for(indices[i], scale);
+        cached.optimize_for(indices[i], scale);
+        require_same(cached, reference);
+    }
+}
+
+TEST_CASE("KPM conductivity", "[kpm]") {
+    auto const model = make_test_model(/*is_double*/true, /*is_complex*/true);
+    auto const& p = model.system()->positions;
+    auto const chemical_potential = ArrayXd::LinSpaced(5, -0.5, 0.5);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+
+    auto serial = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1));
+    auto const s_xx = serial.conductivity(p.x, p.x, chemical_potential, 0.5, 0, 6, 50);
+    auto const s_xy = serial.conductivity(p.x, p.y, chemical_potential, 0.5, 0, 6, 50);
+
+    // Random vectors are distributed among the threads: the result must be the same
+    for (auto num_threads : {2, 4, 8}) {
+        INFO("num_threads: " << num_threads);
+        auto parallel = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(num_threads));
+        auto const p_xx = parallel.conductivity(p.x, p.x, chemical_potential, 0.5, 0, 6, 50);
+        auto const p_xy = parallel.conductivity(p.x, p.y, chemical_potential, 0.5, 0, 6, 50);
+        REQUIRE(p_xx.isApprox(s_xx, precision));
+        REQUIRE(p_xy.isApprox(s_xy, precision));
+    }
+
+    // Memory-bounded blocks recompute the right vectors: the result must be the same
+    for (auto block_size : {1, 7, 16, 1000}) {
+        INFO("block_size: " << block_size);
         auto config = kpm::Config{};
-        config.matrix_format = matrix_format;
-        config.algorithm.optimal_size = optimal_size;
-        config.algorithm.interleaved = interleaved;
-        return config;
+        config.conductivity_block_size = block_size;
+        auto blocked = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2), config);
+        auto const b_xy = blocked.conductivity(p.x, p.y, chemical_potential, 0.5, 0, 6, 50);
+        REQUIRE(b_xy.isApprox(s_xy, precision));
+    }
+
+    // Several directions share the random vectors and recursions: the same as separate calls.
+    // Three left operators don't fit into a single SIMD batch of complex doubles.
+    auto const s_yx = serial.conductivity(p.y, p.x, chemical_potential, 0.5, 0, 6, 50);
+    auto const s_zy = serial.conductivity(p.z, p.y, chemical_potential, 0.5, 0, 6, 50);
+    auto const coords = std::vector<ArrayXf>{p.x, p.y, p.z};
+    auto const directions = std::vector<std::pair<idx_t, idx_t>>{{0, 0}, {0, 1}, {1, 0}, {2, 1}};
+    for (auto block_size : {0, 7}) {
+        INFO("block_size: " << block_size);
+        auto config = kpm::Config{};
+        config.conductivity_block_size = block_size;
+        auto multi = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2), config);
+        auto const m = multi.conductivity(coords, directions, chemical_potential, 0.5, 0, 6, 50);
+        REQUIRE(m.size() == 4);
+        REQUIRE(m[0].isApprox(s_xx, precision));
+        REQUIRE(m[1].isApprox(s_xy, precision));
+        REQUIRE(m[2].isApprox(s_yx, precision));
+        REQUIRE(m[3].isMuchSmallerThan(1.0, precision)); // no z coordinates
+        REQUIRE(s_zy.isMuchSmallerThan(1.0, precision));
+
+        // The second call reuses the velocity operators of the first
+        auto const again = multi.conductivity(coords, directions, chemical_potential, 0.5, 0,
+                                              6, 50);
+        REQUIRE(again[1].isApprox(m[1], precision));
+    }
+
+    // The cached velocity operators must follow the values of a new Hamiltonian
+    auto const other = Model(graphene::monolayer(), shape::rectangle(0.6f, 0.8f),
+                             field::constant_potential(1), field::force_double_precision(),
+                             field::constant_magnetic_field(2e4));
+    auto fresh = kpm::Core(other.hamiltonian(), kpm::DefaultCompute(1));
+    serial.set_hamiltonian(other.hamiltonian());
+    REQUIRE(serial.conductivity(p.x, p.y, chemical_potential, 0.5, 0, 6, 50)
+                  .isApprox(fresh.conductivity(p.x, p.y, chemical_potential, 0.5, 0, 6, 50),
+                            precision));
+}
+
+TEST_CASE("KPM Kubo-Greenwood conductivity", "[kpm]") {
+    auto const model = make_test_model(/*is_double*/true, /*is_complex*/true);
+    auto const& p = model.system()->positions;
+    auto const chemical_potential = ArrayXd::LinSpaced(5, -0.5, 0.5);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+
+    auto serial = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1));
+    auto const s_xx = serial.kubo_greenwood(p.x, chemical_potential, 0.5, 6);
+    REQUIRE(s_xx.size() == chemical_potential.size());
+    REQUIRE(s_xx.allFinite());
+    REQUIRE_FALSE(s_xx.isMuchSmallerThan(1.0, precision));
+    REQUIRE(serial.kubo_greenwood(p.z, chemical_potential, 0.5, 6)
+                  .isMuchSmallerThan(1.0, precision)); // no z coordinates
+
+    // Random vectors are distributed among the threads: the result must be the same
+    for (auto num_threads : {2, 4}) {
+        INFO("num_threads: " << num_threads);
+        auto parallel = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(num_threads));
+        REQUIRE(parallel.kubo_greenwood(p.x, chemical_potential, 0.5, 6)
+                        .isApprox(s_xx, precision));
+    }
+
+    // Fewer energies per pass repeat the recursions: the result must be the same
+    for (auto block_size : {1, 2, 1000}) {
+        INFO("block_size: " << block_size);
+        auto config = kpm::Config{};
+        config.conductivity_block_size = block_size;
+        auto blocked = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2), config);
+        REQUIRE(blocked.kubo_greenwood(p.x, chemical_potential, 0.5, 6)
+                       .isApprox(s_xx, precision));
+    }
+}
+
+TEST_CASE("KPM concurrent calculations", "[kpm]") {
+    auto const model = make_test_model();
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const indices = std::vector<std::vector<idx_t>>{
+        {0}, {1, 2}, {0}, {3}, {1, 2}, {4, 5, 6}, {0}, {3}
     };
 
-#ifndef CPB_USE_CUDA
-    test_kpm_core(kpm::DefaultCompute(), {
-        make_config(kpm::MatrixFormat::CSR, false, false),
-        make_config(kpm::MatrixFormat::CSR, true,  false),
-        make_config(kpm::MatrixFormat::CSR, false,  true),
-        make_config(kpm::MatrixFormat::CSR, true,  true),
-        make_config(kpm::MatrixFormat::ELL, false, false),
-        make_config(kpm::MatrixFormat::ELL, true,  false),
-        make_config(kpm::MatrixFormat::ELL, false,  true),
-        make_config(kpm::MatrixFormat::ELL, true,  true),
-    });
-#else
-    auto const cpu_results = test_kpm_strategy<kpm::DefaultStrategy>({
-        make_config(kpm::MatrixFormat::ELL, true,  true)
-    });
-    auto const cuda_results = test_kpm_strategy<kpm::CudaStrategy>({
-        make_config(kpm::MatrixFormat::ELL, false, false),
-        make_config(kpm::MatrixFormat::ELL, true,  false)
-    });
+    auto config = kpm::Config{};
+    config.moment_cache_size = 4;
+    auto reference = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1), config);
+    auto expected_ldos = std::vector<ArrayXXdCM>();
+    for (auto const& idx : indices) {
+        expected_ldos.push_back(reference.ldos(idx, energy, 0.1));
+    }
+    auto const expected_dos = reference.dos(energy, 0.1, 4);
+
+    // A single core is shared by all the threads: the same and different target indices
+    // overlap, as well as full-system calculations and the moment cache
+    auto core = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2), config);
+    auto ldos = std::vector<ArrayXXdCM>(indices.size());
+    auto dos = std::vector<ArrayXd>(indices.size());
+    auto threads = std::vector<std::thread>();
+    for (auto i = size_t{0}; i < indices.size(); ++i) {
+        threads.emplace_back([&, i] {
+            ldos[i] = core.ldos(indices[i], energy, 0.1);
+            dos[i] = core.dos(energy, 0.1, 4);
+        });
+    }
+    for (auto& t : threads) { t.join(); }
+
+    for (auto i = size_t{0}; i < indices.size(); ++i) {
+        INFO("i: " << i);
+        REQUIRE(ldos[i].isApprox(expected_ldos[i]));
+        REQUIRE(dos[i].isApprox(expected_dos));
+    }
+    REQUIRE(core.get_stats().num_moments == reference.get_stats().num_moments);
+}
+
+TEST_CASE("KPM tracing", "[kpm]") {
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const contains = [](std::string const& json, std::string const& name) {
+        return json.find("\"name\":\"" + name + "\"") != std::string::npos;
+    };
+
+    trace::start();
+    auto const model = make_test_model();
+    auto core = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2));
+    core.dos(energy, 0.1, 4);
+    trace::stop();
+
+    auto const json = trace::json();
+    REQUIRE(json.find("\"traceEvents\"") != std::string::npos);
+    for (auto const name : {"system", "hamiltonian", "hamiltonian_slice", "bounds", "reorder",
+                            "moments", "starter", "job", "reconstruct"}) {
+        INFO(name);
+        REQUIRE(contains(json, name));
+    }
+
+    // Nothing is recorded while disabled
+    auto const num_events = trace::size();
+    core.dos(energy, 0.1, 4);
+    REQUIRE(trace::size() == num_events);
+    trace::clear();
+    REQUIRE(trace::size() == 0);
+}
+
+TEST_CASE("KPM live metrics", "[kpm]") {
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const value = [](std::string const& name, std::string const& labels) {
+        for (auto const& sample : metrics::snapshot()) {
+            if (sample.name == name && sample.labels == labels) { return sample.value; }
+        }
+        return -1.0;
+    };
+
+    metrics::reset();
+    metrics::collect_stages(true);
+    auto const model = make_test_model();
+    auto core = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2));
+    core.dos(energy, 0.1, 4);
+    metrics::collect_stages(false);
+
+    auto const num_moments = static_cast<double>(core.get_stats().num_moments);
+    REQUIRE(value("cpb_kpm_jobs_total", "") >= 1);
+    REQUIRE(value("cpb_kpm_moments_total", "") >= 4 * num_moments);
+    REQUIRE(value("cpb_kpm_spmv_seconds_total", "") > 0);
+    REQUIRE(value("cpb_stage_calls_total", "stage=\"job\",category=\"kpm\"") >= 1);
+    REQUIRE(value("cpb_stage_seconds_total", "stage=\"moments\",category=\"kpm\"") > 0);
+
+    // All the thread pools are finished
+    REQUIRE(value("cpb_pool_threads", "") == 0);
+    REQUIRE(value("cpb_active_threads", "") == 0);
+    REQUIRE(value("cpb_queued_tasks", "") == 0);
+#ifdef __linux__
+    REQUIRE(value("cpb_resident_memory_bytes", "") > 0);
+#endif
+
+    auto const text = metrics::text();
+    REQUIRE(text.find("# TYPE cpb_kpm_moments_total counter\n") != std::string::npos);
+    REQUIRE(text.find("# TYPE cpb_active_threads gauge\n") != std::string::npos);
+    REQUIRE(text.find("cpb_stage_seconds_total{stage=\"job\",category=\"kpm\"} ")
+            != std::string::npos);
+
+    // The stage times are only collected when enabled
+    auto const num_jobs = value("cpb_stage_calls_total", "stage=\"job\",category=\"kpm\"");
+    core.dos(energy, 0.1, 4);
+    REQUIRE(value("cpb_stage_calls_total", "stage=\"job\",category=\"kpm\"") == num_jobs);
+
+    metrics::reset();
+    REQUIRE(value("cpb_kpm_moments_total", "") == 0);
+    REQUIRE(value("cpb_stage_calls_total", "stage=\"job\",category=\"kpm\"") == -1);
+}
+
+TEST_CASE("KuboBastin reconstruction", "[kpm]") {
+    auto const num_moments = 12;
+    auto const moments = MatrixXcd::Random(num_moments, num_moments).eval();
+    auto const chemical_potential = ArrayXd::LinSpaced(7, -0.6, 0.6);
+    auto const energy_samples = ArrayXd::LinSpaced(150, -0.95, 0.95); // multiple blocks
+    auto const temperature = 100.0;
+    auto const scale = kpm::Scale<>(-1.2, 1.1);
+
+    // Direct evaluation of the full gamma matrix for each energy sample
+    auto const inv_kbt_sc = scale.a / (constant::kb * temperature);
+    auto const en = scale(energy_samples);
+    auto sum_nm = ArrayXcd(en.size());
+    for (auto p = 0; p < en.size(); ++p) {
+        auto gamma = MatrixXcd(num_moments, num_moments);
+        for (auto n = 0; n < num_moments; ++n) {
+            for (auto m = 0; m < num_moments; ++m) {
+                auto const g = [&](int i, int j) {
+                    auto const i1 = std::complex<double>{constant::i1};
+                    return (en[p] - i1 * double(j) * std::sqrt(1 - en[p] * en[p]))
+                           * std::exp(i1 * double(j) * std::acos(en[p]))
+                           * std::cos(double(i) * std::acos(en[p]));
+                };
+                gamma(n, m) = g(n, m) + std::conj(g(m, n));
+            }
+        }
+        auto const k = 1 / ((1 - en[p] * en[p]) * (1 - en[p] * en[p]));
+        sum_nm[p] = k * (moments.array() * gamma.array()).sum();
+    }
+    auto const coeff = (en.maxCoeff() - en.minCoeff()) / static_cast<double>(2 * en.size());
+    auto expected = ArrayXcd(chemical_potential.size());
+    for (auto i = 0; i < chemical_potential.size(); ++i) {
+        auto const mu = (chemical_potential[i] - scale.b) / scale.a;
+        auto const f = (sum_nm / (1 + exp((en - mu) * inv_kbt_sc))).eval();
+        expected[i] = 4 / (scale.a * scale.a)
+                      * coeff * (2.0 * f.sum() - f(0) - f(f.size() - 1));
+    }
+
+    for (auto num_threads : {1, 3}) {
+        INFO("num_threads: " << num_threads);
+        auto const result = kpm::KuboBastin{chemical_potential, energy_samples, temperature,
+                                            scale, num_threads}(moments);
+        REQUIRE(result.isApprox(expected));
+    }
+}
+
+TEST_CASE("KPM mixed precision", "[kpm]") {
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const indices = std::vector<idx_t>{0, 3, 5, 8, 13};
     auto const precision = Eigen::NumTraits<float>::dummy_precision();
-    for (auto i = 0u; i < cuda_results.size(); ++i) {
-        REQUIRE(cuda_results[i].g_ii.isApprox(cpu_results[0].g_ii, precision));
-        REQUIRE(cuda_results[i].g_ij.isApprox(cpu_results[0].g_ij, precision));
+
+    auto mixed_config = kpm::Config{};
+    mixed_config.mixed_precision = true;
+
+    for (auto is_complex : {false, true}) {
+        INFO("is_complex: " << is_complex);
+        auto const model = make_test_model(/*is_double*/true, is_complex);
+
+        auto oh = kpm::OptimizedHamiltonian(model.hamiltonian(), kpm::MatrixFormat::ELL,
+                                            /*reorder*/true, /*mixed_precision*/true);
+        auto bounds = kpm::Bounds(model.hamiltonian(), kpm::Config{}.lanczos_precision);
+        oh.optimize_for({0, 0}, bounds.scaling_factors());
+        auto const& h2 = oh.matrix();
+        REQUIRE((h2.is<num::EllMatrix<float>>() || h2.is<num::EllMatrix<std::complex<float>>>()));
+
+        auto full = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1));
+        auto mixed = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1), mixed_config);
+
+        // Single site (diagonal collector) and multiple sites (batch collector)
+        REQUIRE(mixed.ldos({0}, energy, 0.1).isApprox(full.ldos({0}, energy, 0.1), precision));
+        REQUIRE(mixed.ldos(indices, energy, 0.1).isApprox(full.ldos(indices, energy, 0.1),
+                                                          precision));
     }
-#endif // CPB_USE_CUDA
+}
+
+TEST_CASE("KPM moment cache", "[kpm]") {
+    auto const model = make_test_model();
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const indices = std::vector<idx_t>{0, 3, 5, 8, 13};
+
+    auto cache_config = kpm::Config{};
+    cache_config.moment_cache_size = 4;
+
+    auto plain = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1));
+    auto cached = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1), cache_config);
+
+    auto const expected = plain.ldos(indices, energy, 0.05);
+    REQUIRE(cached.ldos(indices, energy, 0.05).isApprox(expected));
+    REQUIRE_FALSE(cached.get_stats().from_cache);
+    REQUIRE(cached.ldos(indices, energy, 0.05).isApprox(expected));
+    REQUIRE(cached.get_stats().from_cache);
+
+    // A larger broadening needs fewer moments: served by truncating the cached ones
+    auto const energy2 = ArrayXd::LinSpaced(15, -0.5, 0.5);
+    REQUIRE(cached.ldos(indices, energy2, 0.1).isApprox(plain.ldos(indices, energy2, 0.1)));
+    REQUIRE(cached.get_stats().from_cache);
+    REQUIRE(cached.ldos({0, 3}, energy, 0.1).isApprox(plain.ldos({0, 3}, energy, 0.1)));
+    REQUIRE_FALSE(cached.get_stats().from_cache);
+
+    REQUIRE(cached.dos(energy, 0.1, 4).isApprox(plain.dos(energy, 0.1, 4)));
+    REQUIRE_FALSE(cached.get_stats().from_cache);
+    REQUIRE(cached.dos(energy, 0.1, 4).isApprox(plain.dos(energy, 0.1, 4)));
+    REQUIRE(cached.get_stats().from_cache);
+
+    auto const g = plain.greens_vector(0, {0, 3, 8}, energy, 0.1);
+    auto const g_cached = cached.greens_vector(0, {0, 3, 8}, energy, 0.1);
+    REQUIRE_FALSE(cached.get_stats().from_cache);
+    auto const g_hit = cached.greens_vector(0, {0, 3, 8}, energy, 0.1);
+    REQUIRE(cached.get_stats().from_cache);
+    for (auto i = 0u; i < g.size(); ++i) {
+        REQUIRE(g_cached[i].isApprox(g[i]));
+        REQUIRE(g_hit[i].isApprox(g[i]));
+    }
+
+    // A new Hamiltonian invalidates the cache
+    cached.set_hamiltonian(model.hamiltonian());
+    REQUIRE(cached.ldos(indices, energy, 0.05).isApprox(expected));
+    REQUIRE_FALSE(cached.get_stats().from_cache);
+}
+
+TEST_CASE("KPM reuse of the optimized structure", "[kpm]") {
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const indices = std::vector<idx_t>{0, 3, 5, 8, 13};
+
+    // Same sparsity pattern with different onsite values, e.g. disorder realizations
+    auto const first = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                             field::linear_onsite(1.f));
+    auto const second = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                              field::linear_onsite(2.f));
+    auto const pristine = Model(graphene::monolayer(), shape::rectangle(2, 2));
+
+    auto oh = kpm::OptimizedHamiltonian(first.hamiltonian(), kpm::MatrixFormat::ELL, true);
+    REQUIRE(oh.update_values(second.hamiltonian()));
+    REQUIRE_FALSE(oh.update_values(pristine.hamiltonian()));
+
+    for (auto format : {kpm::MatrixFormat::CSR, kpm::MatrixFormat::ELL, kpm::MatrixFormat::SELL,
+                        kpm::MatrixFormat::HERMITIAN, kpm::MatrixFormat::ELL_TABLE,
+                        kpm::MatrixFormat::ELL_DELTA, kpm::MatrixFormat::ELL_SPLIT,
+                        kpm::MatrixFormat::ELL_BF16, kpm::MatrixFormat::ELL_INT8}) {
+        for (auto mixed_precision : {false, true}) {
+            INFO("format: " << static_cast<int>(format) << ", mixed: " << mixed_precision);
+            auto config = kpm::Config{};
+            config.matrix_format = format;
+            config.mixed_precision = mixed_precision;
+
+            auto core = kpm::Core(first.hamiltonian(), kpm::DefaultCompute(1), config);
+            core.ldos(indices, energy, 0.1);
+            for (auto const& model : {second, pristine, first}) {
+                auto fresh = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1), config);
+                core.set_hamiltonian(model.hamiltonian());
+                REQUIRE(core.ldos(indices, energy, 0.1).isApprox(fresh.ldos(indices, energy, 0.1)));
+                REQUIRE(core.dos(energy, 0.1, 4).isApprox(fresh.dos(energy, 0.1, 4)));
+            }
+        }
+    }
+}
+
+TEST_CASE("KPM multiple Hamiltonians in one batch", "[kpm]") {
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const indices = std::vector<idx_t>{0, 3, 5};
+    auto const make_model = [](float onsite) {
+        return Model(graphene::monolayer(), shape::rectangle(2, 2),
+                     field::linear_onsite(onsite));
+    };
+    auto const first = make_model(1.f);
+    auto const others = std::vector<Hamiltonian>{make_model(2.f).hamiltonian(),
+                                                 make_model(0.5f).hamiltonian()};
+
+    // The members share the scaling factors: compare with the same fixed bounds
+    auto config = kpm::Config{};
+    config.min_energy = -10;
+    config.max_energy = 10;
+    auto core = kpm::Core(first.hamiltonian(), kpm::DefaultCompute(1), config);
+    auto const results = core.multi_ldos(others, indices, energy, 0.1);
+    REQUIRE(results.size() == 3);
+
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+    auto hamiltonians = std::vector<Hamiltonian>{first.hamiltonian()};
+    hamiltonians.insert(hamiltonians.end(), others.begin(), others.end());
+    for (auto i = size_t{0}; i < hamiltonians.size(); ++i) {
+        INFO("member: " << i);
+        auto single = kpm::Core(hamiltonians[i], kpm::DefaultCompute(1), config);
+        REQUIRE(results[i].isApprox(single.ldos(indices, energy, 0.1), precision));
+    }
+    REQUIRE_FALSE(results[0].isApprox(results[1], precision));
+
+    auto const pristine = Model(graphene::monolayer(), shape::rectangle(2, 2));
+    REQUIRE_THROWS_WITH(core.multi_ldos({pristine.hamiltonian()}, indices, energy, 0.1),
+                        Catch::Contains("same sparsity pattern"));
+}
+
+TEST_CASE("KPM bounds modes", "[kpm]") {
+    auto const first = Model(graphene::monolayer(), shape::rectangle(0.6f, 0.8f),
+                             field::constant_potential(1));
+    auto const second = Model(graphene::monolayer(), shape::rectangle(0.6f, 0.8f),
+                              field::constant_potential(1.05f));
+    auto lanczos = kpm::Bounds(first.hamiltonian(), kpm::Config{}.lanczos_precision);
+
+    auto gershgorin = kpm::Bounds::gershgorin(first.hamiltonian());
+    REQUIRE(gershgorin.min_energy() <= lanczos.min_energy());
+    REQUIRE(gershgorin.max_energy() >= lanczos.max_energy());
+    REQUIRE(gershgorin.max_energy() <= 1 + 3 * std::abs(graphene::t) + 1e-5);
+    auto padded = kpm::Bounds::gershgorin(first.hamiltonian(), /*padding_percent*/10);
+    REQUIRE(padded.max_energy() - padded.min_energy()
+            == Approx(1.1 * (gershgorin.max_energy() - gershgorin.min_energy())));
+
+    // Only the onsite energy changes: the bounds are shifted without a new Lanczos procedure
+    auto config = kpm::Config{};
+    config.bounds_mode = kpm::BoundsMode::Warm;
+    auto core = kpm::Core(first.hamiltonian(), kpm::DefaultCompute(1), config);
+    auto const s0 = core.scaling_factors();
+    core.set_hamiltonian(second.hamiltonian());
+    auto const s1 = core.scaling_factors();
+    REQUIRE(s1.a == Approx(s0.a + 0.05 * (1 + kpm::Scale<>::tolerance)));
+    REQUIRE(s1.b == Approx(s0.b));
+    REQUIRE_THAT(core.report(), Catch::Contains("perturbation 0.050"));
+
+    // A large change runs the full Lanczos procedure again
+    auto const third = Model(graphene::monolayer(), shape::rectangle(0.6f, 0.8f),
+                             field::constant_potential(3));
+    core.set_hamiltonian(third.hamiltonian());
+    auto fresh = kpm::Bounds(third.hamiltonian(), config.lanczos_precision);
+    REQUIRE(core.scaling_factors().b == Approx(fresh.scaling_factors().b));
+    REQUIRE_THAT(core.report(), Catch::Contains("Lanczos procedure"));
+}
+
+TEST_CASE("KPM recurrence reconstruction", "[kpm]") {
+    auto const energy = ArrayXd::LinSpaced(150, -0.9, 0.9); // more than one block
+    auto const scale = kpm::Scale<>(-1.1, 1.1);
+    auto const moments = ArrayXXd::Random(200, 3).eval();
+    auto const E = scale(energy);
+    auto const ns = ArrayXd::LinSpaced(moments.rows(), 0, moments.rows() - 1);
+
+    // The same as the direct evaluation of `cos(n * acos(E))` and `exp(-i * n * acos(E))`
+    auto expected = ArrayXXd(energy.size(), moments.cols());
+    auto expected_greens = ArrayXcd(energy.size());
+    for (auto i = idx_t{0}; i < energy.size(); ++i) {
+        auto const k = 2 / (constant::pi * scale.a * std::sqrt(1 - E[i] * E[i]));
+        auto const cos_n = cos(ns * std::acos(E[i])).eval();
+        expected.row(i) = k * (moments.colwise() * cos_n).colwise().sum();
+        auto const angles = ArrayXcd((ns * std::acos(E[i])).cast<std::complex<double>>());
+        auto const phase = exp(angles * std::complex<double>{0, -1}).eval();
+        expected_greens[i] = -std::complex<double>{0, 2} / (scale.a * std::sqrt(1 - E[i] * E[i]))
+                             * (moments.col(0).cast<std::complex<double>>() * phase).sum();
+    }
+
+    for (auto num_threads : {1, 3}) {
+        INFO("num_threads: " << num_threads);
+        auto const density = kpm::SpectralDensity{energy, scale, num_threads};
+        REQUIRE(density(ArrayXX<double>(moments)).isApprox(expected, 1e-5));
+        REQUIRE(density(ArrayX<float>(moments.col(1).cast<float>())).isApprox(
+            expected.col(1), 1e-4
+        ));
+
+        auto const greens = kpm::GreensFunction{energy, scale, num_threads};
+        REQUIRE(greens(ArrayX<double>(moments.col(0))).isApprox(expected_greens, 1e-5));
+        auto const vector = std::vector<ArrayX<double>>(4, moments.col(0));
+        for (auto const& g : greens(vector)) {
+            REQUIRE(g.isApprox(expected_greens, 1e-5));
+        }
+    }
+}
+
+TEST_CASE("KPM fast reconstruction", "[kpm]") {
+    auto const model = make_test_model(/*is_double*/true);
+    auto const energy = ArrayXd::LinSpaced(30, -0.5, 0.5);
+    auto const indices = std::vector<idx_t>{0, 3, 5, 8, 13};
+
+    auto fast_config = kpm::Config{};
+    fast_config.fast_reconstruction = true;
+
+    auto exact = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1));
+    auto fast = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1), fast_config);
+
+    auto const precision = 1e-3;
+    for (auto broadening : {0.02, 0.1}) {
+        INFO("broadening: " << broadening);
+        auto const ldos = exact.ldos(indices, energy, broadening);
+        REQUIRE(fast.ldos(indices, energy, broadening).isApprox(ldos, precision));
+        auto const dos = exact.dos(energy, broadening, 2);
+        REQUIRE(fast.dos(energy, broadening, 2).isApprox(dos, precision));
+
+        auto const g = exact.greens_vector(0, {0, 3, 8}, energy, broadening);
+        auto const g_fast = fast.greens_vector(0, {0, 3, 8}, energy, broadening);
+        for (auto i = 0u; i < g.size(); ++i) {
+            REQUIRE(g_fast[i].isApprox(g[i], precision));
+        }
+    }
+}
+
+TEST_CASE("KPM stencil matrix", "[kpm]") {
+    auto const pristine = Model(graphene::monolayer(), Primitive(9, 7));
+    auto const disordered = Model(graphene::monolayer(), Primitive(9, 7), field::linear_onsite());
+    auto const pattern = kpm::stencil_pattern(pristine);
+    REQUIRE(pattern);
+    REQUIRE_FALSE(kpm::stencil_pattern(make_test_model())); // has a shape
+
+    // The matrix-free operator reproduces the sparse matrix, also for partial row ranges
+    auto const& csr = ham::get_reference<float>(pristine.hamiltonian());
+    auto const stencil = num::csr_to_stencil(csr, pattern);
+    REQUIRE(stencil);
+    REQUIRE(stencil.nonZeros() == csr.nonZeros() + csr.rows()); // + the (zero) onsite terms
+    auto const x = VectorXf::Random(csr.rows()).eval();
+    auto const y = VectorXf::Random(csr.rows()).eval();
+    auto const ranges = std::vector<std::pair<idx_t, idx_t>>{{0, 126}, {5, 13}, {60, 90}};
+    for (auto const& range : ranges) {
+        auto r_csr = y, r_stencil = y;
+        compute::kpm_spmv(range.first, range.second, csr, x, r_csr);
+        compute::kpm_spmv(range.first, range.second, stencil, x, r_stencil);
+        REQUIRE(r_stencil.isApprox(r_csr));
+    }
+    REQUIRE_FALSE(num::csr_to_stencil(ham::get_reference<float>(disordered.hamiltonian()),
+                                      pattern));
+
+    // Modifiers which break translational invariance fall back to ELLPACK
+    auto const scale = kpm::Bounds(pristine.hamiltonian(), 0.002f).scaling_factors();
+    auto oh = kpm::OptimizedHamiltonian(pristine.hamiltonian(), kpm::MatrixFormat::STENCIL,
+                                        /*reorder*/true, /*mixed_precision*/false, pattern);
+    oh.optimize_for({0, 0}, scale);
+    REQUIRE(oh.matrix().is<num::StencilMatrix<float>>());
+    auto oh_disordered = kpm::OptimizedHamiltonian(disordered.hamiltonian(),
+                                                   kpm::MatrixFormat::STENCIL, true, false,
+                                                   pattern);
+    oh_disordered.optimize_for({0, 0}, scale);
+    REQUIRE(oh_disordered.matrix().is<num::EllMatrix<float>>());
+
+    auto stencil_config = kpm::Config{};
+    stencil_config.matrix_format = kpm::MatrixFormat::STENCIL;
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+    for (auto const& model : {pristine, disordered}) {
+        auto ell = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1));
+        auto matrix_free = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1), stencil_config,
+                                     kpm::stencil_pattern(model));
+
+        REQUIRE(matrix_free.ldos({0, 40, 100}, energy, 0.1).isApprox(
+                ell.ldos({0, 40, 100}, energy, 0.1), precision));
+        REQUIRE(matrix_free.dos(energy, 0.1, 3).isApprox(ell.dos(energy, 0.1, 3), precision));
+        REQUIRE(matrix_free.greens(3, 50, energy, 0.1).isApprox(
+                ell.greens(3, 50, energy, 0.1), precision));
+    }
+}
+
+TEST_CASE("KPM block-sparse matrix", "[kpm]") {
+    auto lattice = Lattice({1, 0, 0}, {0, 1, 0});
+    auto onsite = MatrixXcd(3, 3);
+    onsite << 0.1, 0.2, 0.0,
+              0.2, -0.3, 0.1,
+              0.0, 0.1, 0.4;
+    auto hopping = MatrixXcd(3, 3);
+    hopping << -1.0, 0.2, 0.0,
+               0.3, -0.5, 0.1,
+               0.0, 0.4, -0.8;
+    lattice.add_sublattice("A", {0, 0, 0}, onsite);
+    lattice.register_hopping_energy("t", hopping);
+    lattice.add_hopping({1, 0, 0}, "A", "A", "t");
+    lattice.add_hopping({0, 1, 0}, "A", "A", "t");
+
+    auto const model = Model(lattice, shape::rectangle(6, 5));
+    REQUIRE(kpm::bsr_block_size(model) == 3);
+    REQUIRE(kpm::bsr_block_size(Model(lattice::square_multiorbital())) == 1);
+    REQUIRE(kpm::bsr_block_size(make_test_model()) == 1);
+
+    // Whole blocks are reordered: the orbitals of a site stay together in the slices
+    auto const scale = kpm::Bounds(model.hamiltonian(), 0.002f).scaling_factors();
+    auto oh = kpm::OptimizedHamiltonian(model.hamiltonian(), kpm::MatrixFormat::BSR,
+                                        /*reorder*/true, /*mixed_precision*/false, {},
+                                        /*num_threads*/1, /*cache_size*/0, /*block_size*/3);
+    oh.optimize_for({7, 7}, scale);
+    REQUIRE(oh.matrix().is<num::BsrMatrix<float>>());
+    REQUIRE(oh.idx().src[0] == 1);
+    for (auto const border : oh.map().get_data()) {
+        REQUIRE(border % 3 == 0);
+    }
+
+    // Block sizes which don't fit the Hamiltonian fall back to ELLPACK
+    auto oh_ell = kpm::OptimizedHamiltonian(model.hamiltonian(), kpm::MatrixFormat::BSR,
+                                            true, false, {}, 1, 0, /*block_size*/1);
+    oh_ell.optimize_for({7, 7}, scale);
+    REQUIRE(oh_ell.matrix().is<num::EllMatrix<float>>());
+
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+    auto ell = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1));
+    for (auto reorder : {false, true}) {
+        auto bsr_config = kpm::Config{};
+        bsr_config.matrix_format = kpm::MatrixFormat::BSR;
+        bsr_config.algorithm.optimal_size = reorder;
+        bsr_config.algorithm.interleaved = reorder;
+        auto bsr = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2), bsr_config, {},
+                             kpm::bsr_block_size(model));
+
+        REQUIRE(bsr.ldos({0, 7, 40}, energy, 0.1).isApprox(
+                ell.ldos({0, 7, 40}, energy, 0.1), precision));
+        REQUIRE(bsr.dos(energy, 0.1, 3).isApprox(ell.dos(energy, 0.1, 3), precision));
+        REQUIRE(bsr.greens(4, 50, energy, 0.1).isApprox(ell.greens(4, 50, energy, 0.1),
+                                                        precision));
+    }
+}
+
+TEST_CASE("KPM value table matrix", "[kpm]") {
+    auto const pristine = Model(graphene::monolayer(), shape::rectangle(3, 3));
+    auto const modified = Model(graphene::monolayer(), shape::rectangle(3, 3),
+                                field::linear_onsite(), field::linear_hopping());
+    auto const scale = kpm::Bounds(pristine.hamiltonian(), 0.002f).scaling_factors();
+
+    auto oh = kpm::OptimizedHamiltonian(pristine.hamiltonian(), kpm::MatrixFormat::ELL_TABLE,
+                                        /*reorder*/true);
+    oh.optimize_for({0, 0}, scale);
+    REQUIRE(oh.matrix().is<num::TableEllMatrix<float>>());
+    auto const& table_ell = oh.matrix().get<num::TableEllMatrix<float>>();
+    REQUIRE(table_ell.table.size() == 2); // zero and the single hopping energy
+    REQUIRE(table_ell.escaped.nonZeros() == 0);
+
+    // There are more distinct values but they're still only functions of the x position
+    auto oh_modified = kpm::OptimizedHamiltonian(modified.hamiltonian(),
+                                                 kpm::MatrixFormat::ELL_TABLE, true);
+    oh_modified.optimize_for({0, 0}, scale);
+    REQUIRE(oh_modified.matrix().is<num::TableEllMatrix<float>>());
+    REQUIRE(oh_modified.matrix().get<num::TableEllMatrix<float>>().table.size() > 2);
+
+    auto table_config = kpm::Config{};
+    table_config.matrix_format = kpm::MatrixFormat::ELL_TABLE;
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+    for (auto const& model : {pristine, modified, make_test_model(false, true)}) {
+        auto ell = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1));
+        auto compressed = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1), table_config);
+        REQUIRE(compressed.ldos({0, 10}, energy, 0.1).isApprox(ell.ldos({0, 10}, energy, 0.1),
+                                                                precision));
+        REQUIRE(compressed.dos(energy, 0.1, 3).isApprox(ell.dos(energy, 0.1, 3), precision));
+    }
+}
+
+TEST_CASE("KPM 16-bit column offset matrix", "[kpm]") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(3, 3));
+    auto const scale = kpm::Bounds(model.hamiltonian(), 0.002f).scaling_factors();
+
+    auto oh = kpm::OptimizedHamiltonian(model.hamiltonian(), kpm::MatrixFormat::ELL_DELTA,
+                                        /*reorder*/true);
+    oh.optimize_for({0, 0}, scale);
+    REQUIRE(oh.matrix().is<num::DeltaEllMatrix<float>>());
+    REQUIRE(oh.matrix().get<num::DeltaEllMatrix<float>>().escaped.nonZeros() == 0);
+
+    auto delta_config = kpm::Config{};
+    delta_config.matrix_format = kpm::MatrixFormat::ELL_DELTA;
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+    for (auto const& m : {model, make_test_model(false, true)}) {
+        auto ell = kpm::Core(m.hamiltonian(), kpm::DefaultCompute(1));
+        auto delta = kpm::Core(m.hamiltonian(), kpm::DefaultCompute(1), delta_config);
+        REQUIRE(delta.ldos({0, 10}, energy, 0.1).isApprox(ell.ldos({0, 10}, energy, 0.1),
+                                                          precision));
+        REQUIRE(delta.dos(energy, 0.1, 3).isApprox(ell.dos(energy, 0.1, 3), precision));
+    }
+}
+
+TEST_CASE("KPM split complex ELL matrix", "[kpm]") {
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+
+    auto const complex_model = make_test_model(false, true);
+    auto const scale = kpm::Bounds(complex_model.hamiltonian(), 0.002f).scaling_factors();
+    auto oh = kpm::OptimizedHamiltonian(complex_model.hamiltonian(), kpm::MatrixFormat::ELL_SPLIT,
+                                        /*reorder*/true);
+    oh.optimize_for({0, 0}, scale);
+    REQUIRE(oh.matrix().is<num::SplitEllMatrix<std::complex<float>>>());
+
+    // Real matrices don't need to be split
+    auto const real_model = Model(graphene::monolayer(), shape::rectangle(3, 3));
+    auto real_oh = kpm::OptimizedHamiltonian(real_model.hamiltonian(),
+                                             kpm::MatrixFormat::ELL_SPLIT, /*reorder*/true);
+    real_oh.optimize_for({0, 0}, scale);
+    REQUIRE(real_oh.matrix().is<num::EllMatrix<float>>());
+
+    auto split_config = kpm::Config{};
+    split_config.matrix_format = kpm::MatrixFormat::ELL_SPLIT;
+    for (auto const& m : {real_model, complex_model}) {
+        auto ell = kpm::Core(m.hamiltonian(), kpm::DefaultCompute(1));
+        auto split = kpm::Core(m.hamiltonian(), kpm::DefaultCompute(1), split_config);
+        REQUIRE(split.ldos({0, 10}, energy, 0.1).isApprox(ell.ldos({0, 10}, energy, 0.1),
+                                                          precision));
+        REQUIRE(split.dos(energy, 0.1, 3).isApprox(ell.dos(energy, 0.1, 3), precision));
+    }
+}
+
+TEST_CASE("KPM quantized ELL matrix", "[kpm]") {
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const model = Model(graphene::monolayer(), shape::rectangle(6, 6),
+                             field::linear_onsite(0.1f));
+    auto const scale = kpm::Bounds(model.hamiltonian(), 0.002f).scaling_factors();
+
+    using Format = std::pair<kpm::MatrixFormat, num::ValuePrecision>;
+    for (auto const& f : {Format{kpm::MatrixFormat::ELL_BF16, num::ValuePrecision::BF16},
+                          Format{kpm::MatrixFormat::ELL_INT8, num::ValuePrecision::INT8}}) {
+        INFO("format: " << static_cast<int>(f.first));
+        auto oh = kpm::OptimizedHamiltonian(model.hamiltonian(), f.first, /*reorder*/true);
+        oh.optimize_for({0, 0}, scale);
+        REQUIRE(oh.matrix().is<num::QuantizedEllMatrix<float>>());
+        REQUIRE(oh.matrix().get<num::QuantizedEllMatrix<float>>().precision == f.second);
+
+        // Complex values are not quantized
+        auto const complex_model = make_test_model(false, true);
+        auto complex_oh = kpm::OptimizedHamiltonian(complex_model.hamiltonian(), f.first,
+                                                    /*reorder*/true);
+        complex_oh.optimize_for({0, 0}, scale);
+        REQUIRE(complex_oh.matrix().is<num::EllMatrix<std::complex<float>>>());
+
+        auto config = kpm::Config{};
+        config.matrix_format = f.first;
+        auto ell = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1));
+        auto quantized = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1), config);
+        REQUIRE(quantized.dos(energy, 0.1, 3).isApprox(ell.dos(energy, 0.1, 3), 0.1));
+
+        // A few percent for bfloat16 (the hopping is rounded) and much less for the 8-bit
+        // codes because of the small range of values: but none of them are exact
+        auto const error = quantized.quantization_error(0.1, 2);
+        REQUIRE(error.matrix_format == oh.format_name());
+        REQUIRE(error.num_random == 2);
+        REQUIRE(error.num_moments == quantized.get_stats().num_moments);
+        REQUIRE(error.max_error > 0);
+        REQUIRE(error.max_error < 0.1);
+        REQUIRE(error.rms_error <= error.max_error);
+    }
+
+    // A full precision format is its own reference
+    auto ell = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1));
+    auto const error = ell.quantization_error(0.1);
+    REQUIRE(error.matrix_format == std::string("ELL"));
+    REQUIRE(error.max_error == 0);
+}
+
+TEST_CASE("KPM hybrid ELL matrix", "[kpm]") {
+    // A hub site which is connected to every 4th site would dominate the ELL padding
+    auto model = Model(graphene::monolayer(), shape::rectangle(3, 3));
+    model.add(HoppingGenerator("hub", 0.1, [](System const& s) {
+        auto const size = (s.num_sites() - 1) / 4;
+        auto r = HoppingGenerator::Result{ArrayXi::Zero(size), ArrayXi(size)};
+        for (auto n = 0; n < size; ++n) { r.to[n] = 4 * n + 1; }
+        return r;
+    }));
+    auto const scale = kpm::Bounds(model.hamiltonian(), 0.002f).scaling_factors();
+
+    auto oh = kpm::OptimizedHamiltonian(model.hamiltonian(), kpm::MatrixFormat::ELL,
+                                        /*reorder*/true);
+    oh.optimize_for({0, 0}, scale);
+    REQUIRE(oh.matrix().is<num::HybMatrix<float>>());
+    REQUIRE(oh.matrix().get<num::HybMatrix<float>>().overflow.nonZeros() > 0);
+    REQUIRE(oh.format_name() == std::string("HYB"));
+    REQUIRE(oh.padding() < 2);
+
+    auto csr_config = kpm::Config{};
+    csr_config.matrix_format = kpm::MatrixFormat::CSR;
+    auto hyb_config = kpm::Config{};
+    hyb_config.matrix_format = kpm::MatrixFormat::HYB;
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+    for (auto const& m : {model, make_test_model(false, true)}) {
+        auto csr = kpm::Core(m.hamiltonian(), kpm::DefaultCompute(1), csr_config);
+        auto ell = kpm::Core(m.hamiltonian(), kpm::DefaultCompute(1));
+        auto hyb = kpm::Core(m.hamiltonian(), kpm::DefaultCompute(1), hyb_config);
+        auto const expected = csr.ldos({0, 10}, energy, 0.1);
+        REQUIRE(ell.ldos({0, 10}, energy, 0.1).isApprox(expected, precision));
+        REQUIRE(hyb.ldos({0, 10}, energy, 0.1).isApprox(expected, precision));
+        REQUIRE(hyb.dos(energy, 0.1, 3).isApprox(csr.dos(energy, 0.1, 3), precision));
+        REQUIRE(hyb.get_stats().matrix_format == "HYB");
+    }
+}
+
+/// Test group where each process is a thread: `allreduce_sum` is a barrier
+class ThreadCommunicator : public kpm::Communicator {
+public:
+    struct Group {
+        idx_t size;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<double> sum, result;
+        idx_t arrived = 0;
+        idx_t generation = 0;
+
+        explicit Group(idx_t size) : size(size) {}
+    };
+
+    ThreadCommunicator(std::shared_ptr<Group> group, idx_t rank) : group(group), _rank(rank) {}
+
+    idx_t rank() const override { return _rank; }
+    idx_t size() const override { return group->size; }
+
+    void allreduce_sum(double* data, idx_t size) const override {
+        auto& g = *group;
+        auto lock = std::unique_lock<std::mutex>(g.mutex);
+        auto const generation = g.generation;
+        if (g.arrived == 0) {
+            g.sum.assign(data, data + size);
+        } else {
+            for (auto i = idx_t{0}; i < size; ++i) { g.sum[i] += data[i]; }
+        }
+
+        if (++g.arrived == g.size) {
+            g.result = g.sum;
+            g.arrived = 0;
+            ++g.generation;
+            g.cv.notify_all();
+        } else {
+            g.cv.wait(lock, [&]{ return g.generation != generation; });
+        }
+        std::copy(g.result.begin(), g.result.end(), data);
+    }
+
+private:
+    std::shared_ptr<Group> group;
+    idx_t _rank;
+};
+
+TEST_CASE("KPM counter-based random starter", "[kpm]") {
+    auto const model = make_test_model();
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+
+    auto oh = kpm::OptimizedHamiltonian(model.hamiltonian(), kpm::MatrixFormat::ELL, true);
+    auto bounds = kpm::Bounds(model.hamiltonian(), kpm::Config{}.lanczos_precision);
+    oh.optimize_for({0, 0}, bounds.scaling_factors());
+
+    // The vectors are a function of their index, independent of the calling order
+    auto const starter = kpm::random_starter(oh, {}, /*counter_based*/true);
+    REQUIRE(starter.is_concurrent);
+    auto const v3 = starter.make(var::tag<float>{}, 3).get<VectorXf>();
+    auto const v0 = starter.make(var::tag<float>{}, 0).get<VectorXf>();
+    REQUIRE((v3.array().abs() == 1).all());
+    REQUIRE_FALSE(v3.isApprox(v0));
+    REQUIRE(v3 == starter.make(var::tag<float>{}, 3).get<VectorXf>());
+
+    auto r0 = kpm::make_r0(starter, var::tag<MatrixXf>{}, 4);
+    REQUIRE(r0.col(0) == v0);
+    REQUIRE(r0.col(3) == v3);
+    auto index = idx_t{0};
+    kpm::make_r0(starter, var::tag<VectorXf>{}, 1, index);
+    REQUIRE(index == 4);
+
+    auto config = kpm::Config{};
+    config.counter_based_random = true;
+    auto const expected = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1), config)
+        .dos(energy, 0.1, 16);
+    for (auto num_threads : {2, 5}) {
+        INFO("num_threads: " << num_threads);
+        auto core = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(num_threads), config);
+        // the moments are summed in the order the threads finish: float rounding may differ
+        REQUIRE(core.dos(energy, 0.1, 16).isApprox(expected, 1e-5));
+    }
+
+    // The sequential generator is still the default
+    auto const sequential = kpm::random_starter(oh);
+    REQUIRE_FALSE(sequential.is_concurrent);
+    auto const s1 = sequential.make(var::tag<float>{}, 1).get<VectorXf>();
+    REQUIRE(s1 == sequential.make(var::tag<float>{}, 1).get<VectorXf>()); // starts over
+}
+
+TEST_CASE("KPM deterministic reductions", "[kpm]") {
+    auto config = kpm::Config{};
+    config.algorithm.deterministic = true;
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const chemical_potential = ArrayXd::LinSpaced(5, -0.5, 0.5);
+
+    // Large enough for the row blocks of a single vector to be split among threads
+    auto const large = Model(graphene::monolayer(), shape::rectangle(20, 20));
+    auto const small = make_test_model(/*is_double*/true, /*is_complex*/true);
+    auto const& p = small.system()->positions;
+    auto const sites = std::vector<idx_t>{0, 5, small.system()->num_sites() - 1};
+
+    auto serial_large = kpm::Core(large.hamiltonian(), kpm::DefaultCompute(1), config);
+    auto const dos_single = serial_large.dos(energy, 0.1, 1);
+    auto const dos = serial_large.dos(energy, 0.1, 11);
+    auto serial = kpm::Core(small.hamiltonian(), kpm::DefaultCompute(1), config);
+    auto const ldos = serial.stochastic_ldos(sites, energy, 0.1, 11);
+    auto const s_xx = serial.conductivity(p.x, p.x, chemical_potential, 0.5, 0, 5, 30);
+    auto const kubo_greenwood = serial.kubo_greenwood(p.x, chemical_potential, 0.5, 5);
+
+    // Bit-for-bit identical, not just approximately equal
+    for (auto num_threads : {2, 4, 8}) {
+        INFO("num_threads: " << num_threads);
+        auto parallel_large = kpm::Core(large.hamiltonian(), kpm::DefaultCompute(num_threads),
+                                        config);
+        REQUIRE((parallel_large.dos(energy, 0.1, 1) == dos_single).all());
+        REQUIRE((parallel_large.dos(energy, 0.1, 11) == dos).all());
+
+        auto parallel = kpm::Core(small.hamiltonian(), kpm::DefaultCompute(num_threads), config);
+        REQUIRE((parallel.stochastic_ldos(sites, energy, 0.1, 11) == ldos).all());
+        REQUIRE((parallel.conductivity(p.x, p.x, chemical_potential, 0.5, 0, 5, 30)
+                 == s_xx).all());
+        REQUIRE((parallel.kubo_greenwood(p.x, chemical_potential, 0.5, 5)
+                 == kubo_greenwood).all());
+    }
+}
+
+TEST_CASE("KPM vector pool", "[kpm]") {
+    auto const model = make_test_model(false, true);
+    auto oh = kpm::OptimizedHamiltonian(model.hamiltonian(), kpm::MatrixFormat::CSR, true);
+    auto bounds = kpm::Bounds(model.hamiltonian(), kpm::Config{}.lanczos_precision);
+    oh.optimize_for({0, 0}, bounds.scaling_factors());
+
+    // A released buffer is handed back for the next job of the same size
+    auto a = kpm::pool::acquire<MatrixXcf>(oh.size(), 2);
+    auto const data = a.data();
+    auto const allocations = kpm::pool::num_allocations();
+    kpm::pool::release(a);
+    REQUIRE(a.size() == 0);
+    auto b = kpm::pool::acquire<MatrixXcf>(oh.size(), 2);
+    REQUIRE(b.data() == data);
+    REQUIRE(kpm::pool::num_allocations() == allocations);
+    kpm::pool::release(b);
+
+    // The in-place starters give the same vectors as `make`
+    auto const require_same_fill = [&](kpm::Starter const& starter) {
+        REQUIRE(starter.fill);
+        auto r0 = MatrixXcf(oh.size(), 3);
+        auto index = idx_t{0};
+        kpm::make_r0(starter, r0, 3, index);
+        for (auto i = idx_t{0}; i < 3; ++i) {
+            REQUIRE(r0.col(i) == starter.make(var::tag<std::complex<float>>{}, index + i)
+                                        .get<VectorXcf>());
+        }
+    };
+    require_same_fill(kpm::unit_starter(oh));
+    require_same_fill(kpm::random_starter(oh, {}, /*counter_based*/true));
+
+    auto const& h2 = oh.matrix().get<SparseMatrixX<std::complex<float>>>();
+    auto const r0 = kpm::make_r0(kpm::unit_starter(oh), var::tag<VectorXcf>{}, 1);
+    auto r1 = VectorXcf(oh.size());
+    auto const r1_data = r1.data();
+    kpm::make_r1(h2, r0, r1);
+    REQUIRE(r1.data() == r1_data);
+    REQUIRE(r1 == kpm::make_r1(h2, r0));
+
+    // The steady state of the default compute doesn't need any new buffers
+    auto core = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1));
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    core.ldos({0}, energy, 0.1);
+    auto const steady = kpm::pool::num_allocations();
+    auto const ldos = core.ldos({1}, energy, 0.1);
+    REQUIRE(kpm::pool::num_allocations() == steady);
+    REQUIRE(ldos.isApprox(kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1))
+                              .ldos({1}, energy, 0.1)));
+}
+
+TEST_CASE("KPM adaptive stochastic DOS", "[kpm]") {
+    SECTION("StochasticAccumulator") {
+        auto accumulator = kpm::StochasticAccumulator(0.1, ArrayXd::Ones(2));
+        REQUIRE(std::isinf(accumulator.relative_error()));
+
+        auto result = kpm::BatchData();
+        auto const x = std::vector<ArrayXd>{ArrayXd::Constant(2, 1.0), ArrayXd::Constant(2, 3.0)};
+        accumulator(result, x[0], 0, 10);
+        accumulator(result, x[1], 1, 10);
+        REQUIRE(accumulator.count() == 2);
+        REQUIRE(result.get<ArrayXd>().isApprox(ArrayXd::Constant(2, 2.0)));
+        // variance 2 per moment, error of the mean sqrt(2 * 2 / 2) over a norm of sqrt(2 * 4)
+        REQUIRE(accumulator.relative_error() == Approx(0.5));
+        REQUIRE_FALSE(accumulator.is_converged()); // fewer than `min_vectors`
+
+        auto const copy = accumulator; // shared state
+        accumulator(result, ArrayXXd(ArrayXXd::Constant(2, 4, 2.0)), 2, 10);
+        REQUIRE(copy.count() == 6);
+    }
+
+    auto const model = Model(graphene::monolayer(), shape::rectangle(20, 20));
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto config = kpm::Config{};
+    config.counter_based_random = true;
+
+    auto core = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1), config);
+    auto const expected = core.dos(energy, 0.1, 64);
+    REQUIRE(core.get_stats().num_random == 64);
+    auto const full_error = core.get_stats().stochastic_error;
+    REQUIRE(full_error > 0);
+    REQUIRE(full_error < 1);
+
+    // An unreachable target uses all the vectors
+    REQUIRE(core.dos(energy, 0.1, 64, 1e-9).isApprox(expected));
+    REQUIRE(core.get_stats().num_random == 64);
+    REQUIRE(core.get_stats().stochastic_error == Approx(full_error));
+
+    // A loose target stops early and reports the achieved error
+    auto const target = 4 * full_error;
+    for (auto num_threads : {1, 3}) {
+        INFO("num_threads: " << num_threads);
+        auto adaptive = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(num_threads), config);
+        auto const dos = adaptive.dos(energy, 0.1, 64, target);
+        auto const& stats = adaptive.get_stats();
+        REQUIRE(stats.num_random >= kpm::StochasticAccumulator::min_vectors);
+        REQUIRE(stats.num_random < 64);
+        REQUIRE(stats.stochastic_error <= target);
+        REQUIRE(dos.isApprox(expected, 0.5));
+    }
+
+    auto const kpm = KPM(model);
+    REQUIRE_THROWS_WITH(kpm.calc_dos(energy, 0.1, 4, -1), Catch::Contains("invalid value"));
+}
+
+TEST_CASE("KPM stochastic LDOS", "[kpm]") {
+    auto const model = make_test_model();
+    auto const num_sites = model.system()->num_sites();
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto all_sites = std::vector<idx_t>(static_cast<size_t>(num_sites));
+    std::iota(all_sites.begin(), all_sites.end(), idx_t{0});
+
+    for (auto num_threads : {1, 3}) {
+        INFO("num_threads: " << num_threads);
+        auto core = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(num_threads));
+
+        // The local moments of all the sites add up to the DOS of the same random vectors
+        auto const ldos = core.stochastic_ldos(all_sites, energy, 0.1, 6);
+        REQUIRE(ldos.rows() == energy.size());
+        REQUIRE(ldos.cols() == num_sites);
+        REQUIRE(core.get_stats().num_random == 6);
+        auto const dos = core.dos(energy, 0.1, 6);
+        REQUIRE(ArrayXd(ldos.rowwise().sum()).isApprox(dos, 1e-3));
+
+        // Many random vectors approach the exact LDOS of each site: the error is about 7%
+        auto const sites = std::vector<idx_t>{0, 5, num_sites - 1};
+        auto const exact = core.ldos(sites, energy, 0.5);
+        auto const estimate = core.stochastic_ldos(sites, energy, 0.5, 4096);
+        auto const error = (estimate - exact).matrix().norm() / exact.matrix().norm();
+        REQUIRE(error < 0.25);
+    }
+}
+
+TEST_CASE("KPM projected DOS", "[kpm]") {
+    auto const model = make_test_model();
+    auto const num_sites = model.system()->num_sites();
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+
+    // Even and odd indices partition the system and a third projection overlaps both
+    auto projections = std::vector<std::vector<idx_t>>(3);
+    for (auto i = idx_t{0}; i < num_sites; ++i) {
+        projections[static_cast<size_t>(i % 2)].push_back(i);
+        if (i < num_sites / 2) { projections[2].push_back(i); }
+    }
+
+    for (auto num_threads : {1, 3}) {
+        INFO("num_threads: " << num_threads);
+        auto core = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(num_threads));
+
+        auto const projected = core.projected_dos(projections, energy, 0.1, 6);
+        REQUIRE(projected.rows() == energy.size());
+        REQUIRE(projected.cols() == 3);
+        REQUIRE(core.get_stats().num_random == 6);
+
+        // Same random vectors: each projection is the sum of its stochastic LDOS
+        auto const dos = core.dos(energy, 0.1, 6);
+        REQUIRE(ArrayXd(projected.col(0) + projected.col(1)).isApprox(dos, 1e-3));
+        auto const ldos = core.stochastic_ldos(projections[2], energy, 0.1, 6);
+        REQUIRE(ArrayXd(ldos.rowwise().sum()).isApprox(projected.col(2), 1e-3));
+    }
+
+    auto core = kpm::Core(model.hamiltonian());
+    REQUIRE_THROWS_WITH(core.projected_dos({{num_sites}}, energy, 0.1, 1),
+                        Catch::Contains("projection indices"));
+}
+
+TEST_CASE("KPM progress reporter", "[kpm]") {
+    struct Call { idx_t delta; idx_t total; std::thread::id thread; };
+    std::mutex mutex;
+    auto calls = std::vector<Call>();
+    auto const callback = [&](idx_t delta, idx_t total) {
+        std::lock_guard<std::mutex> lock(mutex);
+        calls.push_back({delta, total, std::this_thread::get_id()});
+    };
+
+    auto const model = make_test_model();
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const compute = kpm::DefaultCompute(3, callback);
+    auto core = kpm::Core(model.hamiltonian(), compute);
+    REQUIRE_FALSE(compute.progress().running);
+
+    auto const num_random = 64;
+    core.dos(energy, 0.01, num_random);
+    REQUIRE(calls.size() >= 2);
+    REQUIRE(calls.front().delta == -1);
+    REQUIRE(calls.back().delta == calls.back().total);
+    REQUIRE(calls.front().thread == std::this_thread::get_id());
+    REQUIRE(calls.back().thread == std::this_thread::get_id());
+
+    // The intermediate updates only come from the reporter thread, never from the workers
+    auto reported = idx_t{0};
+    for (auto it = calls.begin() + 1; it != calls.end() - 1; ++it) {
+        REQUIRE(it->thread == calls[1].thread);
+        REQUIRE(it->thread != std::this_thread::get_id());
+        reported += it->delta;
+    }
+    REQUIRE(reported < num_random);
+
+    auto const progress = core.get_compute()->progress();
+    REQUIRE_FALSE(progress.running);
+    REQUIRE(progress.done == progress.total);
+
+    SECTION("Interrupted by an exception") {
+        try {
+            auto const scope = compute.progress_scope(10);
+            compute.progress_update(3, 10);
+            REQUIRE(compute.progress().running);
+            throw std::runtime_error("stop");
+        } catch (std::runtime_error const&) {}
+        REQUIRE_FALSE(compute.progress().running);
+        REQUIRE(compute.progress().done == 3);
+    }
+}
+
+TEST_CASE("KPM probing LDOS", "[kpm]") {
+    auto const model = make_test_model();
+    auto const num_sites = model.system()->num_sites();
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto all_sites = std::vector<idx_t>(static_cast<size_t>(num_sites));
+    std::iota(all_sites.begin(), all_sites.end(), idx_t{0});
+
+    // Sites which are within the distance of each other never share a color
+    auto const& h = ham::get_reference<float>(model.hamiltonian());
+    auto const colors = num::distance_coloring(h, 2);
+    REQUIRE(colors.size() == static_cast<size_t>(num_sites));
+    for (auto i = idx_t{0}; i < h.rows(); ++i) {
+        for (auto n = h.outerIndexPtr()[i]; n < h.outerIndexPtr()[i + 1]; ++n) {
+            auto const j = h.innerIndexPtr()[n];
+            if (j != i) { REQUIRE(colors[i] != colors[j]); }
+            for (auto m = h.outerIndexPtr()[j]; m < h.outerIndexPtr()[j + 1]; ++m) {
+                auto const k = h.innerIndexPtr()[m];
+                if (k != i) { REQUIRE(colors[i] != colors[k]); }
+            }
+        }
+    }
+
+    for (auto num_threads : {1, 3}) {
+        INFO("num_threads: " << num_threads);
+        auto core = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(num_threads));
+        auto const exact = core.ldos(all_sites, energy, 0.1);
+
+        // Every site gets its own color when the distance spans the whole system
+        auto const full = core.probing_ldos(all_sites, energy, 0.1, num_sites);
+        REQUIRE(core.get_stats().multiplier == Approx(num_sites)); // one vector per color
+        REQUIRE(full.isApprox(exact, 1e-3));
+
+        // A shorter distance needs fewer vectors for the same sites
+        auto const sites = std::vector<idx_t>{0, 5, num_sites - 1};
+        auto const probing = core.probing_ldos(sites, energy, 0.1, 2);
+        REQUIRE(probing.cols() == 3);
+        REQUIRE(core.get_stats().multiplier <= 3);
+    }
+
+    auto core = kpm::Core(model.hamiltonian(), kpm::DefaultCompute());
+    REQUIRE_THROWS_WITH(core.probing_ldos(all_sites, energy, 0.1, 0),
+                        Catch::Contains("at least 1"));
+}
+
+TEST_CASE("KPM chunked LDOS", "[kpm]") {
+    auto const model = make_test_model();
+    auto const num_sites = model.system()->num_sites();
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto all_sites = std::vector<idx_t>(static_cast<size_t>(num_sites));
+    std::iota(all_sites.begin(), all_sites.end(), idx_t{0});
+
+    auto whole_config = kpm::Config{};
+    whole_config.ldos_chunk_size = 0;
+    auto whole = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2), whole_config);
+    auto const expected = whole.ldos(all_sites, energy, 0.1);
+    auto const whole_memory = whole.get_stats().moments_memory;
+
+    for (auto chunk_size : {1, 7, 16}) {
+        INFO("chunk_size: " << chunk_size);
+        auto config = kpm::Config{};
+        config.ldos_chunk_size = chunk_size;
+        auto chunked = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2), config);
+        auto const ldos = chunked.ldos(all_sites, energy, 0.1);
+        REQUIRE(ldos.isApprox(expected, Eigen::NumTraits<float>::dummy_precision()));
+        // Only a single chunk of moments is kept at a time
+        auto const memory = chunked.get_stats().moments_memory;
+        REQUIRE(memory * static_cast<size_t>(num_sites)
+                <= whole_memory * static_cast<size_t>(chunk_size));
+    }
+}
+
+TEST_CASE("KPM compact LDOS map", "[kpm]") {
+    auto values = ArrayXXdCM::Random(20, 6).eval();
+    values.col(3).setZero();
+    for (auto precision : {kpm::MapPrecision::Single, kpm::MapPrecision::Fixed16}) {
+        auto const is_fixed = precision == kpm::MapPrecision::Fixed16;
+        INFO("fixed: " << is_fixed);
+        auto map = kpm::CompactMap(20, 6, precision);
+        map.set(0, values.leftCols(4));
+        map.set(4, values.rightCols(2));
+        REQUIRE(map.rows() == 20);
+        REQUIRE(map.cols() == 6);
+        REQUIRE(map.memory() == static_cast<size_t>(is_fixed ? 20 * 6 * 2 + 6 * 4 : 20 * 6 * 4));
+
+        auto const error = (map.decompressed() - values).abs().eval();
+        REQUIRE(error.col(3).maxCoeff() == 0);
+        auto const tolerance = is_fixed ? 1.0 / 32767 : 1e-7;
+        for (auto j = 0; j < values.cols(); ++j) {
+            REQUIRE(error.col(j).maxCoeff() <= tolerance * values.col(j).abs().maxCoeff());
+        }
+    }
+
+    // The orbitals of a multi-orbital site may be split between two chunks
+    auto const model = Model(lattice::square_multiorbital(), shape::rectangle(3, 3));
+    auto const shape = shape::rectangle(2, 2);
+    auto const energy = ArrayXd::LinSpaced(10, -1, 1);
+    auto const expected = KPM(model).calc_spatial_ldos(energy, 0.2, shape);
+    auto config = kpm::Config{};
+    config.ldos_chunk_size = 5;
+    auto const chunked = KPM(model, kpm::DefaultCompute(2), config);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+    REQUIRE(chunked.calc_spatial_ldos(energy, 0.2, shape).isApprox(expected, precision));
+
+    auto const single = chunked.calc_compact_spatial_ldos(energy, 0.2, shape,
+                                                          kpm::MapPrecision::Single);
+    REQUIRE(single.decompressed().isApprox(expected, precision));
+    auto const fixed = chunked.calc_compact_spatial_ldos(energy, 0.2, shape,
+                                                         kpm::MapPrecision::Fixed16);
+    REQUIRE(fixed.memory() < single.memory());
+    auto const fixed_error = (fixed.decompressed() - expected).abs().maxCoeff();
+    REQUIRE(fixed_error <= 1e-4 * expected.abs().maxCoeff());
+}
+
+TEST_CASE("KPM symmetric spatial LDOS", "[kpm]") {
+    auto const energy = ArrayXd::LinSpaced(10, -1, 1);
+    auto const shape = shape::rectangle(3.5f, 2.5f);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+
+    // The potential breaks some of the symmetries of the square: they must be left out
+    auto const models = std::vector<Model>{
+        Model(lattice::square(), shape::rectangle(6.5f, 6.5f)),
+        Model(lattice::square(), shape::rectangle(6.5f, 6.5f), field::linear_onsite(0.1f)),
+        Model(lattice::square_multiorbital(), shape::rectangle(4.5f, 4.5f))
+    };
+    for (auto const& model : models) {
+        auto const kpm = KPM(model, kpm::DefaultCompute(2));
+        auto const expected = kpm.calc_spatial_ldos(energy, 0.2, shape);
+        REQUIRE(kpm.calc_symmetric_spatial_ldos(energy, 0.2, shape)
+                   .isApprox(expected, precision));
+    }
+
+    // Only the given operations: a mirror which isn't a symmetry is ignored
+    auto const model = Model(lattice::square(), shape::rectangle(6.5f, 6.5f),
+                             field::linear_onsite(0.1f));
+    auto const kpm = KPM(model);
+    auto const mirror_x = Eigen::Matrix3f(Eigen::Vector3f(-1, 1, 1).asDiagonal());
+    auto const mirror_y = Eigen::Matrix3f(Eigen::Vector3f(1, -1, 1).asDiagonal());
+    auto const expected = kpm.calc_spatial_ldos(energy, 0.2, shape, "A");
+    REQUIRE(kpm.calc_symmetric_spatial_ldos(energy, 0.2, shape, {mirror_x, mirror_y}, "A")
+               .isApprox(expected, precision));
+}
+
+TEST_CASE("KPM local charge", "[kpm]") {
+    auto const model = make_test_model(/*is_double*/true);
+    auto const& h = model.hamiltonian();
+    auto const eigen = Eigen::SelfAdjointEigenSolver<MatrixXd>(
+        MatrixXd(ham::get_reference<double>(h))
+    );
+
+    auto const chemical_potential = 1.2;
+    auto const temperature = 1000.0;
+    auto const kbt = constant::kb * temperature;
+    auto const occupation = (1 / (1 + ((eigen.eigenvalues().array() - chemical_potential)
+                                       / kbt).exp())).eval();
+    // rho_ii = sum_k( |psi_k(i)|^2 * f(E_k) )
+    auto const exact = ArrayXd(eigen.eigenvectors().array().abs2().matrix()
+                               * occupation.matrix());
+
+    auto all_sites = std::vector<idx_t>(static_cast<size_t>(h.rows()));
+    std::iota(all_sites.begin(), all_sites.end(), idx_t{0});
+
+    SECTION("Fermi-Dirac coefficients") {
+        auto const scale = kpm::Scale<>(-4, 6);
+        auto const c = kpm::fermi_coefficients(scale, chemical_potential, temperature, 2048);
+        for (auto const energy : {-2.0, 1.0, 1.15, 1.25, 3.0}) {
+            auto const x = (energy - scale.b) / scale.a;
+            auto const series = (c * cos(make_integer_range<double>(c.size()) * acos(x))).sum();
+            REQUIRE(series == Approx(1 / (1 + std::exp((energy - chemical_potential) / kbt)))
+                                  .margin(1e-6));
+        }
+
+        // At zero temperature, `c_0` is the fraction of the Chebyshev weight below the step
+        auto const step = kpm::fermi_coefficients(scale, 2, 0, 64);
+        auto const x_step = (2 - scale.b) / scale.a;
+        REQUIRE(step[0] == Approx(1 - std::acos(x_step) / constant::pi).margin(1e-2));
+    }
+
+    SECTION("Exact and stochastic") {
+        for (auto num_threads : {1, 3}) {
+            INFO("num_threads: " << num_threads);
+            auto core = kpm::Core(h, kpm::DefaultCompute(num_threads));
+            auto const charge = core.local_charge(all_sites, chemical_potential, temperature,
+                                                  0.01);
+            REQUIRE(charge.size() == h.rows());
+            REQUIRE(charge.isApprox(exact, 1e-2));
+
+            // The relative error of a site is about `1 / sqrt(num_random)`
+            auto const estimate = core.local_charge(all_sites, chemical_potential, temperature,
+                                                    0.01, 1024);
+            REQUIRE(core.get_stats().num_random == 1024);
+            auto const error = (estimate - exact).matrix().norm() / exact.matrix().norm();
+            REQUIRE(error < 0.1);
+        }
+    }
+
+    SECTION("Model sites") {
+        auto const kpm = KPM(model);
+        auto const charge = kpm.calc_local_charge(chemical_potential, temperature, 0.01);
+        REQUIRE(charge.size() == model.system()->num_sites());
+        REQUIRE(charge.isApprox(exact, 1e-2));
+        REQUIRE_THROWS_WITH(kpm.calc_local_charge(chemical_potential, -1, 0.01),
+                            Catch::Contains("invalid value for temperature"));
+    }
+}
+
+TEST_CASE("KPM Lanczos Green's function", "[kpm]") {
+    auto const energy = ArrayXd::LinSpaced(20, -2, 2);
+    auto const broadening = 0.1;
+    auto config = kpm::Config{};
+    config.algorithm.lanczos_greens = true;
+
+    auto const model = Model(graphene::monolayer(), shape::rectangle(3, 3),
+                             field::force_double_precision());
+    auto const& h = model.hamiltonian();
+    auto const eigen = Eigen::SelfAdjointEigenSolver<MatrixXd>(
+        MatrixXd(ham::get_reference<double>(h))
+    );
+    auto const exact = [&](idx_t i) {
+        auto const weights = eigen.eigenvectors().row(i).array().abs2().transpose().eval();
+        return transform<ArrayX>(energy, [&](double e) {
+            auto const z = std::complex<double>{e, broadening};
+            return (weights / (z - eigen.eigenvalues().array())).sum();
+        }).eval();
+    };
+
+    auto core = kpm::Core(h, kpm::DefaultCompute{}, config);
+    auto const max_steps = config.kernel.required_num_moments(
+        broadening / core.scaling_factors().a
+    );
+    for (auto const i : {idx_t{0}, h.rows() / 2}) {
+        INFO("i: " << i);
+        auto const g = core.greens(i, i, energy, broadening);
+        auto const expected = exact(i);
+        REQUIRE(g.size() == energy.size());
+        REQUIRE((g - expected).abs().maxCoeff() < 1e-3 * expected.abs().maxCoeff());
+        REQUIRE(core.get_stats().num_moments <= max_steps);
+        REQUIRE(core.get_stats().matrix_format == "CSR");
+    }
+
+    // The off-diagonal elements are still computed from the Chebyshev moments
+    auto kpm_core = kpm::Core(h, kpm::DefaultCompute{});
+    REQUIRE(core.greens(0, 5, energy, broadening).isApprox(
+        kpm_core.greens(0, 5, energy, broadening)));
+
+    // A small system exhausts the Krylov space long before the maximum number of steps
+    auto const small = make_test_model(/*is_double*/true);
+    auto small_core = kpm::Core(small.hamiltonian(), kpm::DefaultCompute{}, config);
+    small_core.greens(0, 0, energy, broadening);
+    REQUIRE(small_core.get_stats().num_moments <= small.hamiltonian().rows());
+}
+
+TEST_CASE("KPM time evolution", "[kpm]") {
+    auto const times = ArrayXd::LinSpaced(4, 0, 6);
+
+    for (auto is_complex : {false, true}) {
+        INFO("is_complex: " << is_complex);
+        auto const model = make_test_model(/*is_double*/true, is_complex);
+        auto const& h = model.hamiltonian();
+        auto const dense = is_complex ? MatrixXcd(ham::get_reference<std::complex<double>>(h))
+                                      : MatrixXcd(ham::get_reference<double>(h)
+                                                      .cast<std::complex<double>>());
+        auto const eigen = Eigen::SelfAdjointEigenSolver<MatrixXcd>(dense);
+
+        auto const psi0 = MatrixXcd::Random(h.rows(), 5).eval();
+        for (auto format : {kpm::MatrixFormat::CSR, kpm::MatrixFormat::ELL}) {
+            INFO("format: " << static_cast<int>(format));
+            auto config = kpm::Config{};
+            config.matrix_format = format;
+            auto core = kpm::Core(h, kpm::DefaultCompute{}, config);
+            auto const result = core.propagate(psi0, times);
+            REQUIRE(result.size() == static_cast<size_t>(times.size()));
+
+            for (auto i = idx_t{0}; i < times.size(); ++i) {
+                INFO("t = " << times[i]);
+                auto const phase = (std::complex<double>{0, -times[i]}
+                                    * eigen.eigenvalues().cast<std::complex<double>>()).array().exp();
+                MatrixXcd const expected = eigen.eigenvectors() * phase.matrix().asDiagonal()
+                                           * eigen.eigenvectors().adjoint() * psi0;
+                REQUIRE(result[i].isApprox(expected, 1e-8));
+                REQUIRE(result[i].colwise().norm().isApprox(psi0.colwise().norm()));
+            }
+        }
+    }
+
+    auto core = kpm::Core(make_test_model().hamiltonian(), kpm::DefaultCompute{});
+    REQUIRE_THROWS_WITH(core.propagate(MatrixXcd::Ones(3, 1), times),
+                        Catch::Contains("initial states"));
+}
+
+TEST_CASE("KPM batched off-diagonal moments", "[kpm]") {
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+
+    for (auto is_complex : {false, true}) {
+        for (auto format : {kpm::MatrixFormat::CSR, kpm::MatrixFormat::ELL}) {
+            INFO("complex: " << is_complex << ", format: " << static_cast<int>(format));
+            auto config = kpm::Config{};
+            config.matrix_format = format;
+
+            auto const model = make_test_model(/*is_double*/true, is_complex);
+            auto const n = model.system()->num_sites();
+            auto const rows = std::vector<idx_t>{0, n / 4, n / 3, n / 2, n - 1};
+            auto const cols = std::vector<idx_t>{0, 3, n / 2};
+
+            // A single thread: both the padded SIMD batches and the leftover singles are used
+            auto core = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1), config);
+            auto const block = core.greens_block(rows, cols, energy, 0.1);
+            REQUIRE(block.size() == rows.size() * cols.size());
+            for (auto r = size_t{0}; r < rows.size(); ++r) {
+                auto const expected = core.greens_vector(rows[r], cols, energy, 0.1);
+                for (auto c = size_t{0}; c < cols.size(); ++c) {
+                    REQUIRE(block[r * cols.size() + c].isApprox(expected[c], precision));
+                }
+            }
+
+            auto const alpha = MatrixXcd(model.hamiltonian().rows(), 5).setRandom().eval();
+            auto const beta = MatrixXcd(model.hamiltonian().rows(), 5).setRandom().eval();
+            auto const real_alpha = MatrixXcd(alpha.real().cast<std::complex<double>>());
+            auto const real_beta = MatrixXcd(beta.real().cast<std::complex<double>>());
+            auto const& a = is_complex ? alpha : real_alpha;
+            auto const& b = is_complex ? beta : real_beta;
+
+            auto const batch = core.batch_moments(30, a, b, {});
+            auto const batch_diagonal = core.batch_moments(30, a, {}, {});
+            REQUIRE(batch.rows() == 30);
+            REQUIRE(batch.cols() == 5);
+            for (auto j = idx_t{0}; j < a.cols(); ++j) {
+                INFO("j: " << j);
+                auto const expected = core.moments(30, a.col(j), b.col(j), {});
+                REQUIRE(ArrayXcd(batch.col(j)).isApprox(expected, precision));
+                auto const expected_diagonal = core.moments(30, a.col(j), a.col(j), {});
+                REQUIRE(ArrayXcd(batch_diagonal.col(j)).isApprox(expected_diagonal, precision));
+            }
+        }
+    }
+}
+
+TEST_CASE("KPM Green's function block", "[kpm]") {
+    auto const model = make_test_model(/*is_double*/true);
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const n = model.system()->num_sites();
+    auto const rows = std::vector<idx_t>{n / 2, n / 4, 0, 1, 2, 3, n - 1};
+    auto const cols = std::vector<idx_t>{n / 4, n / 2, 5};
+
+    // More threads than batches: the leftovers split the rows of the matrix-vector products
+    auto kpm = KPM(model, kpm::DefaultCompute(4));
+    auto const block = kpm.calc_greens_block(rows, cols, energy, 0.1);
+    REQUIRE(block.size() == rows.size());
+    for (auto i = size_t{0}; i < rows.size(); ++i) {
+        REQUIRE(block[i].rows() == static_cast<idx_t>(cols.size()));
+        REQUIRE(block[i].cols() == energy.size());
+        for (auto j = size_t{0}; j < cols.size(); ++j) {
+            auto const expected = kpm.calc_greens(rows[i], cols[j], energy, 0.1);
+            REQUIRE(ArrayXcd(block[i].row(j).transpose()).isApprox(expected, 1e-6));
+        }
+    }
+
+    REQUIRE_THROWS_WITH(kpm.calc_greens_block({0, -1}, {0}, energy, 0.1),
+                        Catch::Contains("invalid value"));
+    REQUIRE_THROWS_WITH(kpm.calc_greens_block({}, {0}, energy, 0.1),
+                        Catch::Contains("invalid value"));
+}
+
+TEST_CASE("KPM early convergence", "[kpm]") {
+    auto const model = make_test_model(/*is_double*/true);
+    auto const n = model.system()->num_sites();
+    auto const idx = std::vector<idx_t>{0, n / 2, n - 1};
+    auto const expected = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1))
+        .ldos_moments(idx, 0.1).data;
+
+    for (auto interleaved : {false, true}) {
+        INFO("interleaved: " << interleaved);
+        auto config = kpm::Config();
+        config.algorithm.interleaved = interleaved;
+
+        // Disabled by default and a tiny tolerance never converges
+        config.algorithm.convergence_tolerance = 1e-20f;
+        auto tiny = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2), config);
+        REQUIRE(tiny.ldos_moments(idx, 0.1).data.isApprox(expected));
+        REQUIRE(tiny.get_stats().skipped_moments == 0);
+
+        // `|mu_n| <= mu_0` so every recursion stops right after the first window
+        config.algorithm.convergence_tolerance = 10;
+        auto core = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2), config);
+        auto const moments = core.ldos_moments(idx, 0.1).data;
+        auto const computed = 2 * (kpm::Convergence::window + 1);
+        auto const num_moments = moments.rows();
+        REQUIRE(moments.topRows(computed).isApprox(expected.topRows(computed)));
+        REQUIRE(moments.bottomRows(num_moments - computed).isZero());
+        REQUIRE(core.get_stats().skipped_moments >= 3 * (num_moments - computed));
+    }
+}
+
+TEST_CASE("KPM expansion moments", "[kpm]") {
+    auto const model = make_test_model(/*is_double*/true);
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const n = model.system()->num_sites();
+    auto const kernel = kpm::jackson_kernel();
+    auto core = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2));
+
+    // The same results as the direct calculations
+    auto const idx = std::vector<idx_t>{0, n / 2};
+    auto const ldos_moments = core.ldos_moments(idx, 0.1);
+    REQUIRE(ldos_moments.num_results() == 2);
+    REQUIRE(ldos_moments.num_moments() == core.get_stats().num_moments);
+    REQUIRE(ldos_moments.spectral_density(energy, kernel).isApprox(core.ldos(idx, energy, 0.1)));
+
+    auto const dos_moments = core.dos_moments(0.1, 4);
+    REQUIRE(dos_moments.num_results() == 1);
+    REQUIRE(ArrayXd(dos_moments.spectral_density(energy, kernel)).isApprox(
+        core.dos(energy, 0.1, 4)
+    ));
+
+    auto const cols = std::vector<idx_t>{n / 2, 3};
+    auto const greens_moments = core.greens_moments(n / 2, cols, 0.1);
+    auto const greens = greens_moments.greens(energy, kernel);
+    auto const expected = core.greens_vector(n / 2, cols, energy, 0.1);
+    REQUIRE(greens.size() == expected.size());
+    for (auto i = size_t{0}; i < greens.size(); ++i) {
+        REQUIRE(greens[i].isApprox(expected[i]));
+    }
+
+    // A wider broadening only needs the first moments
+    auto const wide = ldos_moments.spectral_density(energy, kernel, 0.2);
+    REQUIRE(wide.isApprox(core.ldos(idx, energy, 0.2)));
+    REQUIRE(ldos_moments.truncated(kernel, 0.2).num_moments() == core.get_stats().num_moments);
+    REQUIRE_THROWS_WITH(ldos_moments.spectral_density(energy, kernel, 0.05),
+                        Catch::Contains("requires"));
+    REQUIRE_THROWS_WITH(ldos_moments.truncated(ldos_moments.num_moments() + 1),
+                        Catch::Contains("can't truncate"));
+}
+
+TEST_CASE("KPM checkpointed moments", "[kpm]") {
+    auto const model = make_test_model(/*is_double*/true);
+    auto const n = model.system()->num_sites();
+    auto const idx = std::vector<idx_t>{0, n / 2, n - 1};
+    auto core = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2));
+
+    // Extended moments are the same as a direct calculation with the final number of moments
+    auto const expected_ldos = core.ldos_moments(idx, 0.05);
+    auto const expected_dos = core.dos_moments(0.05, 3);
+    auto const num_moments = expected_ldos.num_moments();
+
+    auto checkpoint = kpm::Checkpoint();
+    auto ldos = core.ldos_moments(idx, 0.2, &checkpoint);
+    REQUIRE(checkpoint.num_moments == ldos.num_moments());
+    REQUIRE(checkpoint.memory_usage() > 0);
+    ldos = core.extend_moments(ldos, checkpoint, num_moments / 2);
+    ldos = core.extend_moments(ldos, checkpoint, num_moments);
+    REQUIRE(ldos.num_moments() == num_moments);
+    REQUIRE(ldos.data.isApprox(expected_ldos.data));
+
+    auto dos_checkpoint = kpm::Checkpoint();
+    auto dos = core.dos_moments(0.2, 3, 0, &dos_checkpoint);
+    dos = core.extend_moments(dos, dos_checkpoint, num_moments);
+    REQUIRE(dos.data.isApprox(expected_dos.data));
+
+    // Asking for fewer moments only truncates them
+    REQUIRE(core.extend_moments(dos, dos_checkpoint, 10).num_moments() == 10);
+    REQUIRE(dos_checkpoint.num_moments == num_moments);
+
+    // The checkpoint has moved on with the extended moments
+    REQUIRE_THROWS_WITH(core.extend_moments(expected_ldos.truncated(20), checkpoint, 2 * n),
+                        Catch::Contains("don't match"));
+    REQUIRE_THROWS_WITH(core.dos_moments(0.2, 3, 0.01, &dos_checkpoint),
+                        Catch::Contains("target_error"));
+}
+
+TEST_CASE("KPM k-point DOS", "[kpm]") {
+    auto model = Model(graphene::monolayer(), Primitive(5, 5), TranslationalSymmetry(1, 1));
+    auto const kpm = KPM(model, kpm::DefaultCompute(2));
+    auto const scale = KPM(model).get_core().scaling_factors();
+    auto const energy = ArrayXd::LinSpaced(200, scale.b - 0.95 * scale.a,
+                                           scale.b + 0.95 * scale.a);
+
+    // A single k-point is the same as a regular calculation at that wave vector
+    auto const k = Cartesian{0.5f, -1, 0};
+    model.set_wave_vector(k);
+    auto const expected = KPM(model, kpm::DefaultCompute(2)).calc_dos(energy, 0.3, 2);
+    REQUIRE(kpm.calc_dos_k(energy, 0.3, {k}, 2).isApprox(expected));
+
+    // The k-average still integrates to the number of states per unit cell
+    auto const k_points = std::vector<Cartesian>{{0, 0, 0}, k, {1, 2, 0}, {-2, 0.5f, 0}};
+    auto const dos = kpm.calc_dos_k(energy, 0.3, k_points, 2);
+    auto const num_states = dos.sum() * (energy[1] - energy[0]);
+    REQUIRE(num_states == Approx(model.system()->hamiltonian_size()).epsilon(0.05));
+
+    auto const finite = Model(graphene::monolayer(), shape::rectangle(1, 1));
+    REQUIRE_THROWS_WITH(KPM(finite).calc_dos_k(energy, 0.3, {k}, 1),
+                        Catch::Contains("periodic"));
+}
+
+TEST_CASE("KPM spectral function", "[kpm]") {
+    auto const real = Model(graphene::monolayer(), shape::rectangle(1.2f, 1.2f),
+                            field::force_double_precision());
+    auto const complex = Model(graphene::monolayer(), shape::rectangle(1.2f, 1.2f),
+                               field::force_double_precision(), field::force_complex_numbers());
+    auto const scale = KPM(real).get_core().scaling_factors();
+    auto const energy = ArrayXd::LinSpaced(200, scale.b - 0.95 * scale.a,
+                                           scale.b + 0.95 * scale.a);
+    auto const k_points = std::vector<Cartesian>{{0, 0, 0}, {3, -1, 0}, {10, 5, 0}};
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+
+    auto const a = KPM(real, kpm::DefaultCompute(1)).calc_spectral_function(k_points, energy,
+                                                                           0.2);
+    REQUIRE(a.rows() == energy.size());
+    REQUIRE(a.cols() == static_cast<idx_t>(k_points.size()));
+    // A normalized plane wave has a single state
+    for (auto k = idx_t{0}; k < a.cols(); ++k) {
+        INFO("k: " << k);
+        REQUIRE(a.col(k).sum() * (energy[1] - energy[0]) == Approx(1).epsilon(0.05));
+    }
+
+    // The cosine and sine parts of the real vectors add up to the complex plane wave,
+    // and the plane waves are split among the threads in SIMD batches
+    auto const b = KPM(complex, kpm::DefaultCompute(4)).calc_spectral_function(k_points, energy,
+                                                                              0.2);
+    REQUIRE(b.isApprox(a, precision));
+    auto const single = KPM(real, kpm::DefaultCompute(4)).calc_spectral_function({k_points[1]},
+                                                                                energy, 0.2);
+    REQUIRE(ArrayXd(single.col(0)).isApprox(ArrayXd(a.col(1)), precision));
+
+    REQUIRE_THROWS_WITH(KPM(real).calc_spectral_function({}, energy, 0.2),
+                        Catch::Contains("no k-points"));
+}
+
+TEST_CASE("KPM disorder ensemble", "[kpm]") {
+    auto const factory = [](idx_t n) {
+        return Model(graphene::monolayer(), shape::rectangle(1.2f, 1.2f),
+                     builtin::anderson_disorder(1.0, static_cast<std::uint64_t>(n)));
+    };
+    auto config = kpm::Config{};
+    config.min_energy = -9.0f;
+    config.max_energy = 9.0f;
+    auto const kpm = KPM(factory(0), kpm::DefaultCompute(2), config);
+
+    // The average of separate calculations with the same bounds
+    auto const num_realizations = 3;
+    auto const ensemble = kpm.ensemble_dos_moments(factory, num_realizations, 0.1, 2, 0);
+    auto expected = ArrayXXcd();
+    for (auto n = 0; n < num_realizations; ++n) {
+        auto const moments = KPM(factory(n), kpm::DefaultCompute(2), config)
+            .calc_dos_moments(0.1, 2);
+        if (n == 0) { expected = moments.data; } else { expected += moments.data; }
+    }
+    REQUIRE(ensemble.num_moments() == expected.rows());
+    REQUIRE(ensemble.data.isApprox(expected / num_realizations));
+    REQUIRE(ensemble.scale.a == Approx(kpm.get_core().scaling_factors().a));
+
+    config.min_energy = -1.0f;
+    config.max_energy = 1.0f;
+    auto const narrow = KPM(factory(0), kpm::DefaultCompute(2), config);
+    REQUIRE_THROWS_WITH(narrow.ensemble_dos_moments(factory, 2, 0.1, 1, 0),
+                        Catch::Contains("doesn't fit"));
+}
+
+TEST_CASE("KPM native parameter sweep", "[kpm]") {
+    auto const grid = make_sweep_grid({"v", "b"}, {ArrayXd::LinSpaced(3, 0, 0.2),
+                                                   ArrayXd::LinSpaced(2, 0, 10)});
+    REQUIRE(grid.size() == 6);
+    REQUIRE(grid.at(0) == SweepParameters({{"v", 0}, {"b", 0}}));
+    REQUIRE(grid.at(1) == SweepParameters({{"v", 0}, {"b", 10}}));
+    REQUIRE(grid.at(5) == SweepParameters({{"v", 0.2}, {"b", 10}}));
+
+    auto const model = Model(graphene::monolayer(), shape::rectangle(2, 2));
+    auto const modifiers = std::vector<SweepModifier>{
+        sweep::onsite_expression("v * x / w", {{"w", 2.0}}),
+        sweep::constant_magnetic_field("b")
+    };
+    auto calculation = SweepCalculation();
+    calculation.energy = ArrayXd::LinSpaced(10, -0.5, 0.5);
+    calculation.broadening = 0.1;
+    calculation.num_random = 2;
+
+    // Each point is the same as a separate calculation of its model
+    auto expect_points = [&](ArrayXXdCM const& result) {
+        REQUIRE(result.rows() == calculation.energy.size());
+        REQUIRE(result.cols() == grid.size());
+        for (auto n = idx_t{0}; n < grid.size(); ++n) {
+            auto const p = grid.at(n);
+            auto point = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                               builtin::onsite_expression("v * x / w", {{"v", p.at("v")},
+                                                                        {"w", 2.0}}),
+                               builtin::constant_magnetic_field(p.at("b")));
+            auto const kpm = KPM(point, kpm::DefaultCompute(1), calculation.config);
+            auto const expected = [&]() -> ArrayXd {
+                if (calculation.kind == SweepCalculation::Kind::DOS) {
+                    return kpm.calc_dos(calculation.energy, calculation.broadening,
+                                        calculation.num_random);
+                }
+                return kpm.calc_ldos(calculation.energy, calculation.broadening,
+                                     calculation.position).col(0);
+            }();
+            REQUIRE(result.col(n).isApprox(expected, 1e-4));
+        }
+    };
+
+    SECTION("DOS") {
+        expect_points(run_sweep(model, grid, modifiers, calculation, 3));
+    }
+
+    SECTION("LDOS") {
+        calculation.kind = SweepCalculation::Kind::LDOS;
+        calculation.position = Cartesian(0.1f, 0.1f, 0);
+        expect_points(run_sweep(model, grid, modifiers, calculation, 8)); // more threads
+    }
+
+    SECTION("Unknown parameter") {
+        auto const unknown = std::vector<SweepModifier>{sweep::anderson_disorder("W")};
+        REQUIRE_THROWS_WITH(run_sweep(model, grid, unknown, calculation, 2),
+                            Catch::Contains("no parameter named 'W'"));
+    }
+}
+
+TEST_CASE("KPM product identity off-diagonal moments", "[kpm]") {
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+
+    for (auto is_double : {false, true}) {
+        auto const model = make_test_model(is_double);
+        auto const n = model.system()->num_sites();
+        auto const row = n / 2;
+        // Includes the diagonal element and more destinations than fit in a single batch
+        auto const cols = std::vector<idx_t>{n / 4, row, 0, 1, 2, 3, 5, 8, 13, n - 1};
+
+        for (auto optimal_size : {false, true}) {
+            INFO("is_double: " << is_double << ", optimal_size: " << optimal_size);
+            auto config = kpm::Config{};
+            config.algorithm.optimal_size = optimal_size;
+            auto const expected = KPM(model, kpm::DefaultCompute(2), config)
+                .calc_greens_vector(row, cols, energy, 0.1);
+
+            config.algorithm.product_identity = true;
+            auto const kpm = KPM(model, kpm::DefaultCompute(4), config);
+            auto const result = kpm.calc_greens_vector(row, cols, energy, 0.1);
+            REQUIRE(result.size() == cols.size());
+            for (auto j = size_t{0}; j < cols.size(); ++j) {
+                REQUIRE(result[j].isApprox(expected[j], is_double ? 1e-6 : 1e-3));
+            }
+            REQUIRE(kpm.calc_greens(row, n / 4, energy, 0.1).isApprox(expected[0],
+                                                                       is_double ? 1e-6 : 1e-3));
+        }
+    }
+}
+
+TEST_CASE("KPM stats profile", "[kpm]") {
+    auto const model = make_test_model();
+    auto core = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2));
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+
+    auto const total_busy_time = [](kpm::ComputeProfile const& p) {
+        return std::accumulate(p.thread_busy_time.begin(), p.thread_busy_time.end(), 0.0);
+    };
+
+    core.dos(energy, 0.05, 3);
+    auto s = core.get_stats();
+    REQUIRE(s.profile.spmv_time > 0);
+    REQUIRE(s.profile.starter_time > 0);
+    REQUIRE(s.profile.collect_time >= 0);
+    REQUIRE_FALSE(s.profile.thread_busy_time.empty());
+    REQUIRE(s.profile.thread_busy_time.size() <= 2);
+    REQUIRE(total_busy_time(s.profile) == Approx(s.profile.starter_time + s.profile.spmv_time
+                                                 + s.profile.collect_time));
+    REQUIRE(s.thread_balance() > 0);
+    REQUIRE(s.thread_balance() <= 1);
+    REQUIRE(s.bytes_per_iteration() > static_cast<double>(s.vector_memory));
+    REQUIRE(s.bandwidth() > 0);
+    REQUIRE(s.reorder_timer.elapsed_seconds() <= s.hamiltonian_timer.elapsed_seconds());
+    REQUIRE(s.bounds_timer.elapsed_seconds() > 0);
+    REQUIRE(s.hamiltonian_memory == model.hamiltonian().memory_usage());
+    REQUIRE(s.moments_memory > 0);
+
+    auto const report = core.report(/*shortform*/false);
+    REQUIRE(report.find("Phase times") != std::string::npos);
+    REQUIRE(report.find("per iteration") != std::string::npos);
+    REQUIRE(report.find("Memory:") != std::string::npos);
+    REQUIRE(core.report(/*shortform*/true).find("Phase times") == std::string::npos);
+
+    // The nested right vectors of the conductivity are not counted twice
+    auto const& p = model.system()->positions;
+    core.conductivity(p.x, p.x, ArrayXd::LinSpaced(3, -0.1, 0.1), 0.5, 0, 2, 50);
+    s = core.get_stats();
+    REQUIRE(s.profile.spmv_time > 0);
+    REQUIRE(total_busy_time(s.profile) == Approx(s.profile.starter_time + s.profile.spmv_time
+                                                 + s.profile.collect_time));
+    REQUIRE(total_busy_time(s.profile) <= 2 * s.moments_timer.elapsed_seconds());
+    REQUIRE(s.reconstruct_timer.elapsed_seconds() > 0);
+}
+
+TEST_CASE("KPM auto-tuning", "[kpm]") {
+    auto const model = make_test_model(/*is_double*/true);
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const expected = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1))
+        .ldos({0}, energy, 0.1);
+
+    auto config = kpm::Config();
+    config.auto_tune = true;
+    config.matrix_format = kpm::MatrixFormat::CSR;
+    config.tuning_cache_file = "test_kpm_tuning_cache.txt";
+    std::remove(config.tuning_cache_file.c_str());
+    kpm::clear_tuning_cache();
+
+    auto core = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1), config);
+    REQUIRE(kpm::tuning_cache_size() == 1);
+    REQUIRE(core.get_config().matrix_format != kpm::MatrixFormat::STENCIL);
+    REQUIRE(core.ldos({0}, energy, 0.1).isApprox(expected, 1e-6));
+
+    // A cache hit gives the same choice without a new entry, also after reloading the file
+    auto const tuned = core.get_config();
+    kpm::clear_tuning_cache();
+    auto const reloaded = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(1), config);
+    REQUIRE(kpm::tuning_cache_size() == 1);
+    REQUIRE(reloaded.get_config().matrix_format == tuned.matrix_format);
+    REQUIRE(reloaded.get_config().algorithm.interleaved == tuned.algorithm.interleaved);
+
+    // A different matrix shape is tuned separately
+    core.set_hamiltonian(make_test_model(/*is_double*/true, /*is_complex*/true).hamiltonian());
+    REQUIRE(kpm::tuning_cache_size() == 2);
+
+    std::remove(config.tuning_cache_file.c_str());
+    kpm::clear_tuning_cache();
+}
+
+TEST_CASE("KPM compute thread affinity", "[kpm]") {
+    REQUIRE(parse_cpu_list("0-3,8,10-11") == (CpuList{0, 1, 2, 3, 8, 10, 11}));
+    REQUIRE(parse_cpu_list("").empty());
+
+    auto const& domains = numa_domains();
+    REQUIRE_FALSE(domains.empty());
+    REQUIRE_FALSE(domains.front().empty());
+    REQUIRE(numa_domain_of(domains.back().front()) == static_cast<int>(domains.size()) - 1);
+
+    auto const model = make_test_model(/*is_double*/true);
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const sites = std::vector<idx_t>{0, 1, 2, 3, 4, 5};
+    auto core = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(2));
+    auto const expected = core.ldos(sites, energy, 0.1);
+
+    auto pinned = kpm::Core(model.hamiltonian(),
+                            kpm::DefaultCompute(2, {}, kpm::DefaultCompute::numa_affinity()));
+    REQUIRE(pinned.ldos(sites, energy, 0.1).isApprox(expected));
+
+#ifdef __linux__
+    auto const cpu = domains.front().front();
+    std::thread([&] {
+        REQUIRE(set_thread_affinity({cpu}));
+        REQUIRE(current_cpu() == cpu);
+    }).join();
+#endif
+}
+
+TEST_CASE("KPM runtime dispatch", "[kpm]") {
+    auto const supported = kpm::dispatch::supported();
+    REQUIRE_FALSE(supported.empty());
+    REQUIRE(supported.front() == &kpm::dispatch::best());
+    REQUIRE(std::string(kpm::DefaultCompute().instruction_set())
+            == kpm::dispatch::best().instruction_set);
+
+    // Every build which the CPU can run must agree with the least advanced one
+    auto const model = make_test_model(/*is_double*/true);
+    auto const reference = supported.back()->minmax_eigenvalues(model.hamiltonian(), 0.001);
+    for (auto const kernels : supported) {
+        INFO(kernels->instruction_set);
+        auto const bounds = kernels->minmax_eigenvalues(model.hamiltonian(), 0.001);
+        REQUIRE(bounds.min == Approx(reference.min).epsilon(1e-4));
+        REQUIRE(bounds.max == Approx(reference.max).epsilon(1e-4));
+    }
+}
+
+TEST_CASE("KPM distributed compute", "[kpm]") {
+    auto const model = make_test_model(/*is_double*/true, /*is_complex*/true);
+    auto const h = model.hamiltonian();
+    auto const& p = model.system()->positions;
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const chemical_potential = ArrayXd::LinSpaced(5, -0.5, 0.5);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+
+    auto serial = kpm::Core(h, kpm::DefaultCompute(1));
+    auto const dos = serial.dos(energy, 0.1, 5);
+    auto const s_xy = serial.conductivity(p.x, p.y, chemical_potential, 0.5, 0, 5, 50);
+    auto const ldos = serial.ldos({0, 3}, energy, 0.1);
+    auto const local_ldos = serial.stochastic_ldos({0, 1, 3}, energy, 0.1, 5);
+
+    // More processes than random vectors means that some processes get no work at all
+    for (auto num_processes : {1, 2, 3, 7}) {
+        INFO("num_processes: " << num_processes);
+        auto group = std::make_shared<ThreadCommunicator::Group>(num_processes);
+        auto results_dos = std::vector<ArrayXd>(num_processes);
+        auto results_xy = std::vector<ArrayXcd>(num_processes);
+        auto results_ldos = std::vector<ArrayXXdCM>(num_processes);
+        auto results_local_ldos = std::vector<ArrayXXdCM>(num_processes);
+
+        auto threads = std::vector<std::thread>();
+        for (auto rank = 0; rank < num_processes; ++rank) {
+            threads.emplace_back([&, rank]{
+                auto comm = std::make_shared<ThreadCommunicator>(group, rank);
+                auto core = kpm::Core(h, kpm::DistributedCompute(kpm::DefaultCompute(1), comm));
+                results_dos[rank] = core.dos(energy, 0.1, 5);
+                results_xy[rank] = core.conductivity(p.x, p.y, chemical_potential,
+                                                     0.5, 0, 5, 50);
+                results_ldos[rank] = core.ldos({0, 3}, energy, 0.1);
+                results_local_ldos[rank] = core.stochastic_ldos({0, 1, 3}, energy, 0.1, 5);
+            });
+        }
+        for (auto& t : threads) { t.join(); }
+
+        for (auto rank = 0; rank < num_processes; ++rank) {
+            INFO("rank: " << rank);
+            REQUIRE(results_dos[rank].isApprox(dos, precision));
+            REQUIRE(results_xy[rank].isApprox(s_xy, precision));
+            REQUIRE(results_ldos[rank].isApprox(ldos, precision));
+            REQUIRE(results_local_ldos[rank].isApprox(local_ldos, precision));
+        }
+    }
+}
+
+TEST_CASE("KPM domain-decomposed compute", "[kpm]") {
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+
+    for (auto is_complex : {false, true}) {
+        INFO("complex: " << is_complex);
+        auto model = Model(graphene::monolayer(), shape::rectangle(6, 6),
+                           field::constant_potential(1));
+        if (is_complex) { model.add(field::constant_magnetic_field(1e4)); }
+        auto const h = model.hamiltonian();
+        auto const num_sites = model.system()->num_sites();
+        auto const i = num_sites / 2;
+
+        auto serial = kpm::Core(h, kpm::DefaultCompute(1));
+        auto const dos = serial.dos(energy, 0.1, 4);
+        auto const ldos = serial.ldos({0, i}, energy, 0.1);
+
+        for (auto num_processes : {1, 2, 3}) {
+            INFO("num_processes: " << num_processes);
+            auto group = std::make_shared<ThreadCommunicator::Group>(num_processes);
+
+            // The domains cover all the rows and only the surface rows are exchanged
+            auto oh = kpm::OptimizedHamiltonian(h, kpm::MatrixFormat::ELL, true);
+            oh.optimize_for(kpm::Indices::full_system(), serial.scaling_factors());
+            auto next_start = idx_t{0};
+            for (auto rank = 0; rank < num_processes; ++rank) {
+                auto const comm = std::make_shared<ThreadCommunicator>(group, rank);
+                auto const d = kpm::DomainCompute(comm).domain(oh);
+                REQUIRE(d->start == next_start);
+                next_start = d->end;
+
+                auto rows = idx_t{0};
+                for (auto const& r : d->surface) { rows += r.second - r.first; }
+                for (auto const& r : d->interior) { rows += r.second - r.first; }
+                REQUIRE(rows == d->end - d->start);
+                REQUIRE(d->halo.size() < static_cast<size_t>(num_sites / 2));
+                REQUIRE(d->halo.empty() == (num_processes == 1));
+            }
+            REQUIRE(next_start == num_sites);
+
+            auto results_dos = std::vector<ArrayXd>(num_processes);
+            auto results_ldos = std::vector<ArrayXXdCM>(num_processes);
+            auto threads = std::vector<std::thread>();
+            for (auto rank = 0; rank < num_processes; ++rank) {
+                threads.emplace_back([&, rank]{
+                    auto comm = std::make_shared<ThreadCommunicator>(group, rank);
+                    auto core = kpm::Core(h, kpm::DomainCompute(comm, 2));
+                    results_dos[rank] = core.dos(energy, 0.1, 4);
+                    results_ldos[rank] = core.ldos({0, i}, energy, 0.1);
+                });
+            }
+            for (auto& t : threads) { t.join(); }
+
+            for (auto rank = 0; rank < num_processes; ++rank) {
+                INFO("rank: " << rank);
+                REQUIRE(results_dos[rank].isApprox(dos, precision));
+                REQUIRE(results_ldos[rank].isApprox(ldos, precision));
+            }
+        }
+    }
+
+    auto const model = make_test_model();
+    auto const& p = model.system()->positions;
+    auto const group = std::make_shared<ThreadCommunicator::Group>(1);
+    auto core = kpm::Core(model.hamiltonian(),
+                          kpm::DomainCompute(std::make_shared<ThreadCommunicator>(group, 0)));
+    REQUIRE_THROWS_WITH(core.conductivity(p.x, p.y, energy, 0.1, 0, 1, 10),
+                        Catch::Contains("only the diagonal moments"));
+}
+
+struct TestGreensResult {
+    ArrayXcd g_ii, g_ij;
+
+    TestGreensResult() = default;
+};
+
+struct TestDosResult {
+    ArrayXd dos1, dos2, dos3, dos20;
+
+    TestDosResult() = default;
+};
+
+std::vector<TestGreensResult> test_kpm_core(kpm::Compute const& compute,
+                                            std::vector<kpm::Config> const& configs) {
+    constexpr auto pi = double{constant::pi};
+    auto results = std::vector<TestGreensResult>();
+
+    for (auto is_double_precision : {false, true}) {
+        for (auto is_complex : {false, true}) {
+            INFO("double: " << is_double_precision << ", complex: " << is_complex);
+            auto const model = make_test_model(is_double_precision, is_complex);
+
+            auto const num_sites = model.system()->num_sites();
+            auto const i = num_sites / 2;
+            auto const j = num_sites / 4;
+            auto const energy_range = ArrayXd::LinSpaced(10, -0.3, 0.3);
+            auto const broadening = 0.8;
+            auto const cols = std::vector<idx_t>{i, j, j+1, j+2};
+            auto const precision = Eigen::NumTraits<float>::dummy_precision();
+
+            auto unoptimized_greens = TestGreensResult();
+            auto unoptimized_dos = TestDosResult();
+
+            for (auto opt_level = size_t{0}; opt_level < configs.size(); ++opt_level) {
+                INFO("opt_level: " << opt_level);
+                auto core = kpm::Core(model.hamiltonian(), compute, configs[opt_level]);
+
+                auto const gs = core.greens_vector(i, cols, energy_range, broadening);
+                REQUIRE(gs.size() == cols.size());
+                REQUIRE_FALSE(gs[0].isApprox(gs[1], precision));
+                REQUIRE_FALSE(gs[1].isApprox(gs[2], precision));
+
+                core.set_hamiltonian(model.hamiltonian());
+                auto const g_ii = core.greens(i, i, energy_range, broadening);
+                REQUIRE(g_ii.isApprox(gs[0], precision));
+
+                auto const g_ij = core.greens(i, j, energy_range, broadening);
+                REQUIRE(g_ij.isApprox(gs[1], precision));
+
+                if (!is_complex) {
+                    auto const g_ji = core.greens(j, i, energy_range, broadening);
+                    REQUIRE(g_ij.isApprox(g_ji, precision));
+                }
+
+                auto const ldos0 = core.ldos({i}, energy_range, broadening);
+                auto const ldos1 = core.ldos({j}, energy_range, broadening);
+                REQUIRE(ldos0.isApprox(-1/pi * g_ii.imag(), precision));
+                REQUIRE_FALSE(ldos0.isApprox(ldos1, precision));
+
+                auto const ldos2 = core.ldos({i, j, i, j, i, j, i, j, i, j},
+                                             energy_range, broadening);
+                REQUIRE(ldos2.cols() == 10);
+                for (auto n = 0; n < 10; n += 2) {
+                    REQUIRE(ldos0.isApprox(ldos2.col(n + 0), precision));
+                    REQUIRE(ldos1.isApprox(ldos2.col(n + 1), precision));
+                }
+
+                if (opt_level == 0) {
+                    unoptimized_greens = {g_ii, g_ij};
+                } else {
+                    REQUIRE(g_ii.isApprox(unoptimized_greens.g_ii, precision));
+                    REQUIRE(g_ij.isApprox(unoptimized_greens.g_ij, precision));
+                }
+
+                auto const dos1 = core.dos(energy_range, broadening, 1);
+                auto const dos2 = core.dos(energy_range, broadening, 2);
+                auto const dos3 = core.dos(energy_range, broadening, 3);
+                auto const dos20 = core.dos(energy_range, broadening, 20);
+                REQUIRE_FALSE(dos1.isApprox(dos2, precision));
+                REQUIRE_FALSE(dos2.isApprox(dos3, precision));
+                REQUIRE_FALSE(dos3.isApprox(dos20, precision));
+                REQUIRE_FALSE(dos20.isApprox(dos1, precision));
+
+                if (opt_level == 0) {
+                    unoptimized_dos = {dos1, dos2, dos3, dos20};
+                } else {
+                    REQUIRE(dos1.isApprox(unoptimized_dos.dos1, precision));
+                    REQUIRE(dos2.isApprox(unoptimized_dos.dos2, precision));
+                    REQUIRE(dos3.isApprox(unoptimized_dos.dos3, precision));
+                    REQUIRE(dos20.isApprox(unoptimized_dos.dos20, precision));
+                }
+            } // for opt_level
+
+            results.push_back(unoptimized_greens);
+        } // for is_complex
+    } // for is_double_precision
+
+    return results;
+}
+
+TEST_CASE("KPM out-of-core", "[kpm]") {
+    auto const model = make_test_model();
+    auto const filename = std::string("test_kpm_out_of_core.pbbin");
+    binary::save(filename, *model.system(), model.hamiltonian());
+    auto const mapped = binary::map_hamiltonian(filename);
+    REQUIRE(mapped.is<num::MappedCsrMatrix<float>>());
+
+    // The Gershgorin bounds always contain the spectrum
+    auto const& h = mapped.get<num::MappedCsrMatrix<float>>();
+    REQUIRE(h.rows() == model.system()->num_sites());
+    REQUIRE(h.nonZeros() == model.hamiltonian().non_zeros());
+    auto const minmax = num::gershgorin_bounds(h);
+    auto lanczos = kpm::Bounds(model.hamiltonian(), kpm::Config{}.lanczos_precision);
+    REQUIRE(minmax.first <= lanczos.min_energy());
+    REQUIRE(minmax.second >= lanczos.max_energy());
+
+    auto config = kpm::Config{};
+    config.min_energy = static_cast<float>(minmax.first);
+    config.max_energy = static_cast<float>(minmax.second);
+    auto in_memory_config = config;
+    in_memory_config.matrix_format = kpm::MatrixFormat::CSR;
+    in_memory_config.algorithm = {/*optimal_size*/false, /*interleaved*/false, false, 0};
+
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+    for (auto num_threads : {1, 2}) {
+        INFO("num_threads: " << num_threads);
+        auto out_of_core = kpm::Core(mapped, kpm::DefaultCompute(num_threads), config);
+        auto in_memory = kpm::Core(model.hamiltonian(), kpm::DefaultCompute(num_threads),
+                                   in_memory_config);
+        REQUIRE(out_of_core.dos(energy, 0.1, 4).isApprox(in_memory.dos(energy, 0.1, 4),
+                                                         precision));
+        REQUIRE(out_of_core.dos_moments(0.1, 4).data.isApprox(
+            in_memory.dos_moments(0.1, 4).data, precision));
+        REQUIRE(out_of_core.get_stats().matrix_format == "MAPPED");
+    }
+
+    // Without an energy range the bounds come from the same single pass
+    auto automatic = kpm::Core(mapped, kpm::DefaultCompute(1));
+    auto manual = kpm::Core(mapped, kpm::DefaultCompute(1), config);
+    REQUIRE(automatic.scaling_factors().a == Approx(manual.scaling_factors().a));
+    REQUIRE(automatic.scaling_factors().b == Approx(manual.scaling_factors().b));
+    REQUIRE_THROWS_WITH(manual.conductivity(ArrayXf::Zero(1), ArrayXf::Zero(1), energy, 0.1,
+                                            0, 1, 1),
+                        Catch::Contains("in memory"));
+
+    std::remove(filename.c_str());
+    REQUIRE_THROWS_WITH(binary::map_hamiltonian(filename), Catch::Contains("Can't open"));
+}
+
+TEST_CASE("KPM node-shared Hamiltonian", "[kpm]") {
+    auto const filename = std::string("test_kpm_shared.pbbin");
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const reference = make_test_model();
+    auto const mapped = [&]{
+        binary::save(filename, *reference.system(), reference.hamiltonian());
+        auto const m = binary::map_hamiltonian(filename);
+        std::remove(filename.c_str());
+        return m;
+    }();
+    auto const expected = kpm::Core(mapped, kpm::DefaultCompute(1)).dos(energy, 0.1, 6);
+
+    auto const num_processes = 3;
+    auto group = std::make_shared<ThreadCommunicator::Group>(num_processes);
+    auto built = std::vector<char>(num_processes, 0); // each rank only writes its own
+    auto results = std::vector<ArrayXd>(num_processes);
+    auto threads = std::vector<std::thread>();
+    for (auto rank = 0; rank < num_processes; ++rank) {
+        threads.emplace_back([&, rank]{
+            auto model = make_test_model();
+            model.add(OnsiteModifier([&, rank](ComplexArrayRef, CartesianArrayConstRef,
+                                               string_view) { built[rank] = 1; }));
+            auto const node = std::make_shared<ThreadCommunicator>(group, rank);
+            auto const h = kpm::share_hamiltonian(model, filename, *node);
+            auto core = kpm::Core(h, kpm::DistributedCompute(kpm::DefaultCompute(1), node));
+            results[rank] = core.dos(energy, 0.1, 6);
+        });
+    }
+    for (auto& t : threads) { t.join(); }
+
+    REQUIRE(built == std::vector<char>{1, 0, 0}); // only the leader built the Hamiltonian
+    for (auto const& r : results) {
+        REQUIRE(r.isApprox(expected, Eigen::NumTraits<float>::dummy_precision()));
+    }
+    // The file is gone but the mappings of the cores remained valid until the end
+    REQUIRE_THROWS_WITH(binary::map_hamiltonian(filename), Catch::Contains("Can't open"));
+}
+
+TEST_CASE("KPM core", "[kpm]") {
+    auto make_config = [](kpm::MatrixFormat matrix_format, bool optimal_size, bool interleaved) {
+        auto config = kpm::Config{};
+        config.matrix_format = matrix_format;
+        config.algorithm.optimal_size = optimal_size;
+        config.algorithm.interleaved = interleaved;
+        return config;
+    };
+
+#ifndef CPB_USE_CUDA
+    test_kpm_core(kpm::DefaultCompute(), {
+        make_config(kpm::MatrixFormat::CSR, false, false),
+        make_config(kpm::MatrixFormat::CSR, true,  false),
+        make_config(kpm::MatrixFormat::CSR, false,  true),
+        make_config(kpm::MatrixFormat::CSR, true,  true),
+        make_config(kpm::MatrixFormat::ELL, false, false),
+        make_config(kpm::MatrixFormat::ELL, true,  false),
+        make_config(kpm::MatrixFormat::ELL, false,  true),
+        make_config(kpm::MatrixFormat::ELL, true,  true),
+        make_config(kpm::MatrixFormat::SELL, false, false),
+        make_config(kpm::MatrixFormat::SELL, true,  false),
+        make_config(kpm::MatrixFormat::SELL, false,  true),
+        make_config(kpm::MatrixFormat::SELL, true,  true),
+        make_config(kpm::MatrixFormat::HERMITIAN, false, false),
+        make_config(kpm::MatrixFormat::HERMITIAN, true,  true),
+        make_config(kpm::MatrixFormat::ELL_TABLE, true,  true),
+        make_config(kpm::MatrixFormat::ELL_DELTA, true,  true),
+        make_config(kpm::MatrixFormat::ELL_SPLIT, true,  true),
+    });
+#else
+    auto const cpu_results = test_kpm_strategy<kpm::DefaultStrategy>({
+        make_config(kpm::MatrixFormat::ELL, true,  true)
+    });
+    auto const cuda_results = test_kpm_strategy<kpm::CudaStrategy>({
+        make_config(kpm::MatrixFormat::ELL, false, false),
+        make_config(kpm::MatrixFormat::ELL, true,  false)
+    });
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+    for (auto i = 0u; i < cuda_results.size(); ++i) {
+        REQUIRE(cuda_results[i].g_ii.isApprox(cpu_results[0].g_ii, precision));
+        REQUIRE(cuda_results[i].g_ij.isApprox(cpu_results[0].g_ij, precision));
+    }
+#endif // CPB_USE_CUDA
+
+#ifdef CPB_USE_MKL
+    auto const builtin_results = test_kpm_core(kpm::DefaultCompute(), {
+        make_config(kpm::MatrixFormat::CSR, false, false)
+    });
+    auto const mkl_results = test_kpm_core(kpm::MklCompute(), {
+        make_config(kpm::MatrixFormat::CSR, false, false),
+        make_config(kpm::MatrixFormat::CSR, true,  false),
+        make_config(kpm::MatrixFormat::CSR, false,  true),
+        make_config(kpm::MatrixFormat::ELL, false, false),
+    });
+    auto const mkl_precision = Eigen::NumTraits<float>::dummy_precision();
+    for (auto i = 0u; i < mkl_results.size(); ++i) {
+        REQUIRE(mkl_results[i].g_ii.isApprox(builtin_results[i].g_ii, mkl_precision));
+        REQUIRE(mkl_results[i].g_ij.isApprox(builtin_results[i].g_ij, mkl_precision));
+    }
+#endif // CPB_USE_MKL
 }
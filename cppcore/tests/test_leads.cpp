@@ -1,6 +1,10 @@
 #include <catch.hpp>
 
 #include "fixtures.hpp"
+#include "leads/SelfEnergy.hpp"
+#include "leads/Transmission.hpp"
+
+#include <atomic>
 using namespace cpb;
 
 /// Return the data array of a Hamiltonian CSR matrix
@@ -38,3 +42,115 @@ TEST_CASE("Attach leads") {
         REQUIRE(h.maxCoeff() < h0.maxCoeff());
     }
 }
+
+TEST_CASE("Lead Hamiltonians are built lazily") {
+    auto model = Model(lattice::square(), shape::rectangle(2, 3));
+    model.attach_lead(-1, Line({0, -1.5f, 0}, {0, 1.5f, 0}));
+    model.attach_lead(+1, Line({0, -1.5f, 0}, {0, 1.5f, 0}));
+
+    auto num_calls = std::make_shared<std::atomic<int>>(0);
+    model.add(OnsiteModifier([num_calls](ComplexArrayRef, CartesianArrayConstRef, string_view) {
+        ++*num_calls; // once for the main system and once for each lead `h0`
+    }, /*is_complex*/false, /*is_double*/false, /*is_thread_safe*/true));
+
+    SECTION("One lead at a time") {
+        model.eval_hamiltonian();
+        REQUIRE(*num_calls == 1);
+        REQUIRE(model.lead(1).indices().size() == 3);
+        REQUIRE(*num_calls == 2);
+        model.lead(1);
+        REQUIRE(*num_calls == 2);
+        REQUIRE(model.leads().size() == 2);
+        REQUIRE(*num_calls == 3);
+        model.eval();
+        REQUIRE(*num_calls == 3);
+    }
+
+    SECTION("All leads concurrently") {
+        model.set_num_threads(2);
+        model.eval();
+        REQUIRE(*num_calls == 3);
+
+        auto sequential = Model(lattice::square(), shape::rectangle(2, 3));
+        sequential.attach_lead(-1, Line({0, -1.5f, 0}, {0, 1.5f, 0}));
+        sequential.attach_lead(+1, Line({0, -1.5f, 0}, {0, 1.5f, 0}));
+        for (auto i = size_t{0}; i < 2; ++i) {
+            REQUIRE(matrix_data<>(model.lead(i).h0()).isApprox(
+                matrix_data<>(sequential.lead(i).h0())));
+            REQUIRE(matrix_data<>(model.lead(i).h1()).isApprox(
+                matrix_data<>(sequential.lead(i).h1())));
+        }
+    }
+}
+
+TEST_CASE("Lead self-energy") {
+    auto model = Model(lattice::square(), shape::rectangle(2, 3));
+    model.attach_lead(-1, Line({0, -1.5f, 0}, {0, 1.5f, 0}));
+    model.attach_lead(+1, Line({0, -1.5f, 0}, {0, 1.5f, 0}));
+    model.add(field::linear_onsite());
+
+    auto const self_energy = leads::SelfEnergy(model.leads(), /*broadening*/1e-6);
+    REQUIRE(self_energy.size() == 2);
+    auto const energies = ArrayXd::LinSpaced(9, -4.5, 3.5);
+
+    auto const greens = self_energy.surface_greens(0, energies, 4);
+    REQUIRE(greens.size() == 9);
+    REQUIRE(self_energy.cache_size() == 9);
+
+    auto const h0 = MatrixXcd(ham::get_reference<float>(model.lead(0).h0())
+                                  .cast<std::complex<double>>());
+    auto const h1 = MatrixXcd(ham::get_reference<float>(model.lead(0).h1())
+                                  .cast<std::complex<double>>());
+    auto const size = h0.rows();
+    for (auto i = 0; i < energies.size(); ++i) {
+        // The surface Green's function must satisfy the Dyson equation of the semi-infinite lead
+        auto const& g = greens[i];
+        MatrixXcd const z = std::complex<double>{energies[i], 1e-6}
+                            * MatrixXcd::Identity(size, size);
+        MatrixXcd const expected = (z - h0 - h1.adjoint() * g * h1).inverse();
+        REQUIRE(g.isApprox(expected, 1e-4));
+        REQUIRE(g.diagonal().imag().maxCoeff() <= 0); // retarded
+    }
+
+    SECTION("Cached results") {
+        auto const sigma = self_energy.self_energy(0, energies.head(3), 1);
+        REQUIRE(self_energy.cache_size() == 9);
+        REQUIRE(sigma[2].isApprox(h1.adjoint() * greens[2] * h1));
+
+        self_energy.surface_greens(1, energies, 1);
+        REQUIRE(self_energy.cache_size() == 18);
+    }
+
+    SECTION("Invalid lead") {
+        REQUIRE_THROWS_AS(self_energy.surface_greens(2, energies), std::out_of_range);
+    }
+}
+
+TEST_CASE("Transmission") {
+    auto model = Model(lattice::square(), shape::rectangle(6, 3));
+    model.attach_lead(-1, Line({0, -1.5f, 0}, {0, 1.5f, 0}));
+    model.attach_lead(+1, Line({0, -1.5f, 0}, {0, 1.5f, 0}));
+
+    auto const self_energy = leads::SelfEnergy(model.leads());
+    auto const transmission = leads::Transmission(model.hamiltonian(), model.leads());
+    REQUIRE(transmission.num_slices() > 1);
+    REQUIRE(transmission.max_slice_width() == 3);
+
+    // A clean wire: the transmission is the number of open transverse channels
+    auto const energies = (ArrayXd(3) << -1.0, 1.0, 4.0).finished();
+    auto const t = transmission.calc(self_energy, energies, 2);
+    REQUIRE(t[0] == Approx(0).margin(1e-4));
+    REQUIRE(t[1] == Approx(1).epsilon(1e-4));
+    REQUIRE(t[2] == Approx(3).epsilon(1e-4));
+    REQUIRE(t.isApprox(transmission.calc(self_energy, energies, 1)));
+
+    SECTION("Reverse direction") {
+        auto const reverse = leads::Transmission(model.hamiltonian(), model.leads(), 1, 0);
+        REQUIRE(reverse.calc(self_energy, energies).isApprox(t, 1e-4));
+    }
+
+    SECTION("Invalid leads") {
+        REQUIRE_THROWS_AS(leads::Transmission(model.hamiltonian(), model.leads(), 0, 0),
+                          std::logic_error);
+    }
+}
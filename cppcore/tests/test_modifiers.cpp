@@ -1,6 +1,14 @@
 #include <catch.hpp>
 
 #include "fixtures.hpp"
+#include "hamiltonian/BuiltinModifiers.hpp"
+#include "numeric/random.hpp"
+#include "system/Foundation.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <numeric>
+#include <thread>
 using namespace cpb;
 
 TEST_CASE("SiteStateModifier") {
@@ -141,6 +149,57 @@ struct OnsiteEnergyOp {
     }
 };
 
+TEST_CASE("Structure modifiers are applied to foundation chunks") {
+    auto const lattice = graphene::monolayer();
+    auto const primitive = Primitive(40, 30);
+    auto const num_sites = idx_t{40 * 30 * 2};
+
+    auto const cut = [](Eigen::Ref<ArrayX<bool>> state, CartesianArrayConstRef position,
+                        string_view, idx_t) {
+        for (auto i = idx_t{0}; i < state.size(); ++i) {
+            if (std::abs(position.x()[i]) < 1.0f) { state[i] = false; }
+        }
+    };
+    auto const shift = [](CartesianArrayRef position, string_view sublattice) {
+        position.y() += (sublattice == "A") ? 0.1f : -0.1f;
+    };
+
+    auto reference = Foundation(lattice, primitive);
+    apply(SiteStateModifier(cut), reference);
+    REQUIRE_FALSE(reference.get_states().all());
+
+    SECTION("Sequential chunks") {
+        auto foundation = Foundation(lattice, primitive);
+        auto sizes = std::vector<idx_t>();
+        apply(SiteStateModifier([&](Eigen::Ref<ArrayX<bool>> state, CartesianArrayConstRef p,
+                                    string_view s, idx_t first_site) {
+            sizes.push_back(state.size());
+            auto const expected = foundation.sublattice_positions(first_site / (num_sites / 2));
+            REQUIRE(p.x()[0] == expected.x[first_site % (num_sites / 2)]);
+            cut(state, p, s, first_site);
+        }), foundation, 7);
+
+        REQUIRE(*std::max_element(sizes.begin(), sizes.end()) == 7);
+        REQUIRE(std::accumulate(sizes.begin(), sizes.end(), idx_t{0}) == num_sites);
+        REQUIRE((foundation.get_states() == reference.get_states()).all());
+        REQUIRE_FALSE(foundation.has_positions());
+    }
+
+    SECTION("Concurrent chunks of a thread-safe modifier") {
+        auto foundation = Foundation(lattice, primitive, 4);
+        apply(SiteStateModifier(cut, 0, /*is_thread_safe*/true), foundation, 64);
+        REQUIRE((foundation.get_states() == reference.get_states()).all());
+    }
+
+    SECTION("Positions") {
+        apply(PositionModifier(shift), reference);
+        auto foundation = Foundation(lattice, primitive, 4);
+        apply(PositionModifier(shift, /*is_thread_safe*/true), foundation, 50);
+        REQUIRE((foundation.get_positions().y == reference.get_positions().y).all());
+        REQUIRE((foundation.get_positions().x == reference.get_positions().x).all());
+    }
+}
+
 TEST_CASE("OnsiteEnergyModifier") {
     auto model = Model(lattice::square_2atom());
     auto const& h_init = model.hamiltonian();
@@ -177,6 +236,66 @@ TEST_CASE("HoppingEnergyModifier") {
     REQUIRE(h.non_zeros() == 0);
 }
 
+/// Same as `field::linear_hopping()` but the positions are looked up by index
+struct IndexedLinearHopping {
+    float k;
+    CooIndexRef rows;
+    CooIndexRef cols;
+    CartesianArrayConstRef positions;
+    Cartesian shift;
+
+    template<class Array>
+    void operator()(Array energy) const {
+        using scalar_t = typename Array::Scalar;
+        auto const& x = positions.x();
+        for (auto n = idx_t{0}; n < energy.size(); ++n) {
+            auto const x2 = x[cols[n]] - shift.x();
+            energy[n] = static_cast<scalar_t>(k * (0.5f * (x[rows[n]] + x2)));
+        }
+    }
+};
+
+TEST_CASE("Indexed HoppingModifier") {
+    auto const indexed = HoppingModifier([](ComplexArrayRef energy, CooIndexRef rows,
+                                            CooIndexRef cols, CartesianArrayConstRef positions,
+                                            Cartesian shift, string_view) {
+        num::match<ArrayX>(energy, IndexedLinearHopping{1.f, rows, cols, positions, shift});
+    });
+    REQUIRE(indexed.is_indexed());
+    REQUIRE_FALSE(field::linear_hopping().is_indexed());
+
+    SECTION("Same Hamiltonian as the positions") {
+        auto model = Model(graphene::monolayer(), Primitive(5, 5), TranslationalSymmetry(1, 1),
+                           indexed);
+        auto expected = Model(graphene::monolayer(), Primitive(5, 5), TranslationalSymmetry(1, 1),
+                              field::linear_hopping());
+        auto const k = Cartesian{0.5f, -1, 0}; // the periodic boundaries are shifted
+        model.set_wave_vector(k);
+        expected.set_wave_vector(k);
+
+        using scalar_t = std::complex<float>;
+        auto const& h = ham::get_reference<scalar_t>(model.hamiltonian());
+        auto const& h_expected = ham::get_reference<scalar_t>(expected.hamiltonian());
+        REQUIRE(h.nonZeros() == h_expected.nonZeros());
+        REQUIRE(h.isApprox(h_expected));
+    }
+
+    SECTION("Slice size") {
+        auto modifiers = HamiltonianModifiers();
+        modifiers.hopping.push_back(indexed);
+        auto const size = modifiers.hopping_slice_size();
+        REQUIRE(size >= HamiltonianModifiers::max_slice_size);
+        REQUIRE(size <= HamiltonianModifiers::max_indexed_slice_size);
+
+        modifiers.hopping.back().is_thread_safe = true; // concurrent slices are better
+        REQUIRE(modifiers.hopping_slice_size() == HamiltonianModifiers::max_slice_size);
+
+        modifiers.hopping.back().is_thread_safe = false;
+        modifiers.hopping.push_back(field::linear_hopping()); // needs position buffers
+        REQUIRE(modifiers.hopping_slice_size() == HamiltonianModifiers::max_slice_size);
+    }
+}
+
 TEST_CASE("SiteGenerator") {
     auto model = Model([]{
         auto lattice = Lattice({1, 0, 0}, {0, 1, 0});
@@ -292,3 +411,466 @@ TEST_CASE("HoppingGenerator") {
         REQUIRE(csr.coeff(1, 0) == 0);
     }
 }
+
+TEST_CASE("Generators build the Hamiltonian directly in CSR format") {
+    auto const noop = HoppingGenerator("t_noop", 1.0, [](System const&) {
+        return HoppingGenerator::Result{ArrayXi(), ArrayXi()};
+    });
+    auto const compare = [](Model const& model, Model const& expected) {
+        auto const& m = ham::get_reference<float>(model.hamiltonian());
+        auto const& m_expected = ham::get_reference<float>(expected.hamiltonian());
+        REQUIRE(m.isCompressed());
+        REQUIRE(m.nonZeros() == m_expected.nonZeros());
+        REQUIRE(m.isApprox(m_expected));
+    };
+
+    SECTION("Single orbital") {
+        auto onsite = field::linear_onsite();
+        compare(Model(graphene::monolayer(), shape::rectangle(3, 3), onsite, noop),
+                Model(graphene::monolayer(), shape::rectangle(3, 3), onsite));
+    }
+
+    SECTION("Multiple orbitals") {
+        compare(Model(lattice::square_multiorbital(), shape::rectangle(3, 3), noop),
+                Model(lattice::square_multiorbital(), shape::rectangle(3, 3)));
+    }
+
+    SECTION("Generated hoppings") {
+        auto model = Model(graphene::monolayer(), shape::rectangle(1, 1),
+                           HoppingGenerator("t2", 0.5, [](System const& s) {
+            auto r = HoppingGenerator::Result{ArrayXi(s.num_sites() - 1),
+                                              ArrayXi(s.num_sites() - 1)};
+            for (auto n = 0; n < r.from.size(); ++n) { r.from[n] = n; r.to[n] = n + 1; }
+            return r;
+        }));
+        auto const& system = *model.system();
+        auto const& h = ham::get_reference<float>(model.hamiltonian());
+        REQUIRE(h.isCompressed());
+        for (auto n = idx_t{0}; n < system.num_sites() - 1; ++n) {
+            REQUIRE(h.coeff(n, n + 1) != 0);
+            REQUIRE(h.coeff(n + 1, n) == h.coeff(n, n + 1));
+        }
+    }
+}
+
+TEST_CASE("Periodic boundaries are merged into the sparsity pattern") {
+    using scalar_t = std::complex<float>;
+    auto const k = Cartesian{0.3f, -0.7f, 0};
+    auto const modifiers = HamiltonianModifiers{};
+
+    for (auto const size : {1, 2, 6}) { // the small ones have boundary and main system overlap
+        auto const model = Model(graphene::monolayer(), Primitive(size, size),
+                                 TranslationalSymmetry(1, 1));
+        auto const& system = *model.system();
+        auto const& lattice = model.get_lattice();
+
+        auto main = SparseMatrixX<scalar_t>();
+        detail::build_main(main, system, lattice, modifiers, /*simple_build*/true);
+        MatrixXcf expected = main.toDense();
+        for (auto n = size_t{0}; n < system.boundaries.size(); ++n) {
+            auto const phase = std::polar(1.0f, k.dot(system.boundaries[n].shift));
+            modifiers.apply_to_hoppings<scalar_t>(system, n, [&](idx_t i, idx_t j, scalar_t t) {
+                expected(i, j) += t * phase;
+                expected(j, i) += std::conj(t * phase);
+            });
+        }
+
+        auto const h = ham::make<scalar_t>(system, lattice, modifiers, k, /*simple_build*/true);
+        auto const& m = ham::get_reference<scalar_t>(h);
+        REQUIRE(m.isCompressed());
+        for (auto row = 0; row < m.rows(); ++row) {
+            auto const first = m.innerIndexPtr() + m.outerIndexPtr()[row];
+            auto const last = m.innerIndexPtr() + m.outerIndexPtr()[row + 1];
+            REQUIRE(std::adjacent_find(first, last, std::greater_equal<int>()) == last);
+        }
+        REQUIRE(MatrixXcf(m.toDense()).isApprox(expected));
+
+        auto const cache = ham::make_bloch_cache<scalar_t>(system, lattice, modifiers, true);
+        auto const& bloch = ham::get_reference<scalar_t>(ham::make(*cache, k));
+        REQUIRE(bloch.nonZeros() == m.nonZeros());
+        REQUIRE(MatrixXcf(bloch.toDense()).isApprox(expected));
+    }
+}
+
+TEST_CASE("Wave vector update reuses the Hamiltonian") {
+    auto num_calls = 0;
+    auto const counter = HoppingModifier([&num_calls](ComplexArrayRef, CartesianArrayConstRef,
+                                                      CartesianArrayConstRef, string_view) {
+        ++num_calls;
+    });
+    auto model = Model(graphene::monolayer(), Primitive(5, 5), TranslationalSymmetry(1, 1),
+                       field::linear_hopping(), counter);
+    model.hamiltonian();
+    auto const calls_per_build = num_calls;
+    REQUIRE(calls_per_build > 0);
+
+    auto modifiers = HamiltonianModifiers();
+    modifiers.hopping.push_back(field::linear_hopping());
+    for (auto const& k : {Cartesian{0.5f, 0, 0}, Cartesian{1, -2, 0}, Cartesian{0, 0, 0}}) {
+        model.set_wave_vector(k);
+        REQUIRE(ham::is<std::complex<float>>(model.hamiltonian()));
+        auto const& h = ham::get_reference<std::complex<float>>(model.hamiltonian());
+        auto const expected = ham::make<std::complex<float>>(*model.system(), model.get_lattice(),
+                                                             modifiers, k, /*simple_build*/true);
+        REQUIRE(h.isApprox(ham::get_reference<std::complex<float>>(expected)));
+    }
+    REQUIRE(num_calls == calls_per_build); // the modifiers were not applied again
+
+    model.add(field::linear_onsite()); // invalidates the cache
+    model.hamiltonian();
+    REQUIRE(num_calls == 2 * calls_per_build);
+}
+
+TEST_CASE("Complex override is detected by a probe before the full build") {
+    auto real_calls = std::vector<idx_t>();
+    auto complex_calls = 0;
+    auto const to_complex = HoppingModifier([&](ComplexArrayRef energy, CartesianArrayConstRef,
+                                                CartesianArrayConstRef, string_view) {
+        if (energy.tag == num::Tag::f32) {
+            real_calls.push_back(energy.size());
+            throw ComplexOverride();
+        }
+        ++complex_calls;
+    });
+
+    auto model = Model(graphene::monolayer(), Primitive(300, 300), to_complex);
+    REQUIRE(ham::is<std::complex<float>>(model.hamiltonian()));
+    REQUIRE(model.is_complex());
+    REQUIRE(real_calls.size() == 1); // only the probe, the real build was skipped
+    REQUIRE(real_calls.front() <= 64);
+    auto const calls_per_build = complex_calls;
+    REQUIRE(calls_per_build > 1);
+
+    // The result is cached: the next builds go straight to complex
+    model.add(field::linear_onsite());
+    REQUIRE(ham::is<std::complex<float>>(model.hamiltonian()));
+    REQUIRE(real_calls.size() == 1);
+    REQUIRE(complex_calls == 2 * calls_per_build);
+}
+
+struct ScaleOp {
+    float factor;
+
+    template<class Array>
+    void operator()(Array energy) const {
+        using scalar_t = typename Array::Scalar;
+        energy *= static_cast<scalar_t>(factor);
+    }
+};
+
+/// Changes the values but never the sparsity pattern (unlike a zero crossing of a field)
+HoppingModifier scale_hoppings(float factor) {
+    return HoppingModifier([factor](ComplexArrayRef energy, CartesianArrayConstRef,
+                                    CartesianArrayConstRef, string_view) {
+        num::match<ArrayX>(energy, ScaleOp{factor});
+    });
+}
+
+TEST_CASE("Hamiltonian rebuild reuses the sparsity pattern") {
+    auto const compare = [](Model const& model, Model const& expected) {
+        auto const& h = ham::get_reference<float>(model.hamiltonian());
+        auto const& h_expected = ham::get_reference<float>(expected.hamiltonian());
+        REQUIRE(h.nonZeros() == h_expected.nonZeros());
+        REQUIRE(h.isApprox(h_expected));
+    };
+
+    SECTION("Finite system") {
+        auto model = Model(graphene::monolayer(), shape::rectangle(2, 2), field::linear_onsite());
+        auto const* before = &ham::get_reference<float>(model.hamiltonian());
+
+        model.add(scale_hoppings(2.f)); // same pattern, different values
+        REQUIRE(&ham::get_reference<float>(model.hamiltonian()) == before); // reused in place
+        compare(model, Model(graphene::monolayer(), shape::rectangle(2, 2),
+                             field::linear_onsite(), scale_hoppings(2.f)));
+
+        auto const h_in_use = model.hamiltonian();
+        model.add(field::linear_onsite(2.f));
+        auto const* in_use = &ham::get_reference<float>(h_in_use);
+        REQUIRE(&ham::get_reference<float>(model.hamiltonian()) != in_use);
+        compare(model, Model(graphene::monolayer(), shape::rectangle(2, 2), field::linear_onsite(),
+                             scale_hoppings(2.f), field::linear_onsite(2.f)));
+    }
+
+    SECTION("New elements") {
+        auto model = Model(graphene::monolayer(), shape::rectangle(2, 2));
+        auto const nnz = model.hamiltonian().non_zeros();
+        model.add(field::linear_onsite()); // adds the diagonal: full build
+        REQUIRE(model.hamiltonian().non_zeros() > nnz);
+        compare(model, Model(graphene::monolayer(), shape::rectangle(2, 2),
+                             field::linear_onsite()));
+    }
+
+    SECTION("Periodic system") {
+        auto model = Model(graphene::monolayer(), Primitive(5, 5), TranslationalSymmetry(1, 1),
+                           field::linear_onsite());
+        model.set_wave_vector({1, 2, 0});
+        model.hamiltonian();
+        model.add(scale_hoppings(2.f));
+        auto const& h = ham::get_reference<std::complex<float>>(model.hamiltonian());
+
+        auto expected = Model(graphene::monolayer(), Primitive(5, 5), TranslationalSymmetry(1, 1),
+                              field::linear_onsite(), scale_hoppings(2.f));
+        expected.set_wave_vector({1, 2, 0});
+        auto const& h_expected = ham::get_reference<std::complex<float>>(expected.hamiltonian());
+        REQUIRE(h.nonZeros() == h_expected.nonZeros());
+        REQUIRE(h.isApprox(h_expected));
+    }
+}
+
+TEST_CASE("Models with a shared system") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                             field::linear_onsite());
+    auto const& h = ham::get_reference<float>(model.hamiltonian());
+
+    auto derived = model.with_shared_system();
+    derived.add(scale_hoppings(2.f));
+    REQUIRE(derived.system() == model.system());
+    auto const& h_derived = ham::get_reference<float>(derived.hamiltonian());
+    REQUIRE(&h_derived != &h); // the original Hamiltonian is not reused in place
+    REQUIRE(h.isApprox(ham::get_reference<float>(model.hamiltonian())));
+    auto const expected = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                scale_hoppings(2.f));
+    REQUIRE(h_derived.isApprox(ham::get_reference<float>(expected.hamiltonian())));
+
+    auto const nnz = h_derived.nonZeros();
+    derived.add(field::constant_potential(1.f)); // follows the new modifiers only
+    REQUIRE(ham::get_reference<float>(derived.hamiltonian()).nonZeros() > nnz);
+
+    auto modified = model.with_shared_system();
+    modified.add(SiteStateModifier([](Eigen::Ref<ArrayX<bool>> state, CartesianArrayConstRef,
+                                      string_view s) {
+        if (s == "A" && state.size() != 0) { state[0] = false; }
+    }));
+    REQUIRE(modified.system() != model.system()); // copy-on-write
+    REQUIRE(modified.system()->num_sites() < model.system()->num_sites());
+}
+
+TEST_CASE("Multithreaded Hamiltonian build") {
+    auto const thread_safe = [](HoppingModifier m) { m.is_thread_safe = true; return m; };
+    auto const build = [](Model& model, idx_t num_threads) {
+        model.set_num_threads(num_threads);
+        return model.eval().hamiltonian();
+    };
+    auto const compare = [](Hamiltonian const& h, Hamiltonian const& expected) {
+        auto const& m = ham::get_reference<float>(h);
+        auto const& m_expected = ham::get_reference<float>(expected);
+        REQUIRE(m.nonZeros() == m_expected.nonZeros());
+        REQUIRE(m.isApprox(m_expected));
+    };
+
+    SECTION("Single orbital") {
+        auto onsite = field::linear_onsite();
+        onsite.is_thread_safe = true;
+        auto serial = Model(graphene::monolayer(), Primitive(300, 300), onsite,
+                            thread_safe(scale_hoppings(2.f)));
+        REQUIRE(serial.system()->hamiltonian_nnz() >= detail::min_parallel_build_nnz);
+        auto const expected = build(serial, 1);
+
+        // The sparsity pattern of the parallel build is also valid for a value-only rebuild
+        auto model = Model(graphene::monolayer(), Primitive(300, 300), onsite);
+        auto const* before = &ham::get_reference<float>(build(model, 4));
+        model.add(thread_safe(scale_hoppings(2.f)));
+        REQUIRE(&ham::get_reference<float>(build(model, 4)) == before);
+        compare(model.hamiltonian(), expected);
+
+        auto fresh = Model(graphene::monolayer(), Primitive(300, 300), onsite,
+                           thread_safe(scale_hoppings(2.f)));
+        compare(build(fresh, 4), expected);
+    }
+
+    SECTION("Multiple orbitals") {
+        auto model = Model(lattice::square_multiorbital(), Primitive(150, 150),
+                           thread_safe(scale_hoppings(0.5f)));
+        auto const expected = build(model, 1);
+        auto parallel = Model(lattice::square_multiorbital(), Primitive(150, 150),
+                              thread_safe(scale_hoppings(0.5f)));
+        compare(build(parallel, 3), expected);
+    }
+
+    SECTION("Thread-unsafe modifiers") {
+        auto const main_thread = std::this_thread::get_id();
+        auto same_thread = true;
+        auto const check = HoppingModifier([&](ComplexArrayRef, CartesianArrayConstRef,
+                                               CartesianArrayConstRef, string_view) {
+            same_thread = same_thread && std::this_thread::get_id() == main_thread;
+        });
+        auto model = Model(graphene::monolayer(), Primitive(300, 300), check);
+        build(model, 4);
+        REQUIRE(same_thread);
+    }
+
+    SECTION("Complex override") {
+        auto const to_complex = HoppingModifier([](ComplexArrayRef energy, CartesianArrayConstRef,
+                                                   CartesianArrayConstRef, string_view) {
+            if (energy.tag == num::Tag::f32) { throw ComplexOverride(); }
+        }, false, false, /*is_thread_safe*/true);
+        auto model = Model(graphene::monolayer(), Primitive(300, 300), to_complex);
+        REQUIRE(ham::is<std::complex<float>>(build(model, 4)));
+    }
+}
+
+struct ToComplexMatrix {
+    template<class scalar_t>
+    SparseMatrixXcf operator()(SparseMatrixRC<scalar_t> const& m) const {
+        return m->template cast<std::complex<float>>();
+    }
+};
+
+TEST_CASE("Builtin modifiers") {
+    auto const matrix = [](Model const& model) {
+        return var::apply_visitor(ToComplexMatrix{}, model.hamiltonian().get_variant());
+    };
+
+    SECTION("Magnetic field") {
+        auto const python_like = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                       field::constant_magnetic_field(5));
+        auto const builtin = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                   builtin::constant_magnetic_field(5));
+        REQUIRE(builtin.is_complex());
+        REQUIRE(matrix(builtin).isApprox(matrix(python_like), 1e-5f));
+    }
+
+    SECTION("Electric field") {
+        auto const python_like = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                       field::linear_onsite(0.5f));
+        auto const builtin = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                   builtin::constant_electric_field({0.5f, 0, 0}));
+        REQUIRE_FALSE(builtin.is_complex());
+        REQUIRE(matrix(builtin).isApprox(matrix(python_like)));
+    }
+
+    SECTION("Strained hopping") {
+        auto const pristine = Model(graphene::monolayer(), shape::rectangle(2, 2));
+        auto const unstrained = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                      builtin::strained_hopping(3.37, graphene::a_cc));
+        REQUIRE(matrix(unstrained).isApprox(matrix(pristine), 1e-4f)); // a_cc is rounded
+
+        auto const stretched = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                     builtin::strained_hopping(3.37, 2 * graphene::a_cc));
+        REQUIRE(matrix(stretched).isApprox(matrix(pristine) * std::exp(3.37f / 2), 1e-4f));
+    }
+
+    SECTION("Anderson disorder") {
+        auto const width = 2.0;
+        auto const pristine = Model(lattice::square_multiorbital(), shape::rectangle(6, 6));
+        auto const disorder = Model(lattice::square_multiorbital(), shape::rectangle(6, 6),
+                                    builtin::anderson_disorder(width, 42));
+        auto const h = matrix(disorder);
+        auto const diff = (h - matrix(pristine)).eval();
+
+        auto const& system = *disorder.system();
+        auto values = std::vector<float>();
+        for (auto const& sub : system.compressed_sublattices) {
+            auto site = sub.sys_start();
+            for (auto n = sub.ham_start(); n < sub.ham_end(); n += sub.num_orbitals(), ++site) {
+                // the same shift for all the orbitals of a site
+                for (auto orb = idx_t{0}; orb < sub.num_orbitals(); ++orb) {
+                    REQUIRE(diff.coeff(n + orb, n + orb) == diff.coeff(n, n));
+                }
+                values.push_back(diff.coeff(n, n).real());
+
+                // keyed by the site index
+                auto const expected = num::random_uniform<double>(num::Philox(42), 0, site);
+                REQUIRE(values.back() == Approx(width * (expected - 0.5)));
+            }
+        }
+        REQUIRE(static_cast<idx_t>(values.size()) == system.num_sites());
+        auto const minmax = std::minmax_element(values.begin(), values.end());
+        REQUIRE(*minmax.first >= -width / 2);
+        REQUIRE(*minmax.second < width / 2);
+        REQUIRE(*minmax.first != *minmax.second); // sites at the same position differ too
+
+        // Pure function of the seed and the sites
+        auto const same = Model(lattice::square_multiorbital(), shape::rectangle(6, 6),
+                                builtin::anderson_disorder(width, 42));
+        REQUIRE(matrix(same).isApprox(h));
+        auto const other = Model(lattice::square_multiorbital(), shape::rectangle(6, 6),
+                                 builtin::anderson_disorder(width, 43));
+        REQUIRE_FALSE(matrix(other).isApprox(h));
+    }
+
+    SECTION("Random vacancies") {
+        auto const make = [](std::uint64_t seed, idx_t num_threads) {
+            auto model = Model(graphene::monolayer(), Primitive(400, 400),
+                               builtin::random_vacancies(0.1, seed));
+            model.set_num_threads(num_threads);
+            return model;
+        };
+        auto const serial = make(1, 1);
+        auto const& s = *serial.system();
+        auto const removed = 1 - s.num_sites() / static_cast<double>(2 * 400 * 400);
+        REQUIRE(removed == Approx(0.1).epsilon(0.05));
+
+        auto const parallel = make(1, 4);
+        REQUIRE(parallel.system()->num_sites() == s.num_sites());
+        REQUIRE((parallel.system()->positions.x() == s.positions.x()).all());
+        REQUIRE(make(2, 1).system()->num_sites() != s.num_sites());
+    }
+
+    SECTION("Expressions") {
+        auto const field = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                 builtin::constant_electric_field({0.5f, 0, 0}));
+        auto const onsite = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                  builtin::onsite_expression("k * x", {{"k", 0.5}}));
+        REQUIRE(matrix(onsite).isApprox(matrix(field)));
+
+        auto const strained = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                    builtin::strained_hopping(3.37, 2 * graphene::a_cc));
+        auto const hopping = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                   builtin::hopping_expression(
+            "exp(-beta * (sqrt((x1 - x2)**2 + (y1 - y2)**2 + (z1 - z2)**2) / l0 - 1))",
+            {{"beta", 3.37}, {"l0", 2 * graphene::a_cc}}
+        ));
+        REQUIRE(matrix(hopping).isApprox(matrix(strained), 1e-5f));
+    }
+
+    SECTION("Parallel build") {
+        auto const make = [](idx_t num_threads) {
+            auto model = Model(graphene::monolayer(), Primitive(300, 300),
+                               builtin::anderson_disorder(0.5, 7),
+                               builtin::constant_electric_field({0, 0.1f, 0}),
+                               builtin::strained_hopping(3.37, graphene::a_cc),
+                               builtin::constant_magnetic_field(20),
+                               builtin::onsite_expression("0.1 * tanh(x / 5)"));
+            model.set_num_threads(num_threads);
+            return model;
+        };
+        auto const serial = make(1);
+        REQUIRE(serial.system()->hamiltonian_nnz() >= detail::min_parallel_build_nnz);
+        auto const parallel = make(4);
+        REQUIRE(matrix(parallel).isApprox(matrix(serial)));
+    }
+}
+
+TEST_CASE("Expression") {
+    auto const x = ArrayXf::LinSpaced(3000, -2, 2).eval(); // more than one evaluation block
+    auto const y = ArrayXf::Constant(x.size(), 0.5f).eval();
+    auto const eval = [&](std::string const& source, std::string const& label = "A") {
+        auto const e = Expression(source, {"x", "y"}, {"sub_id"}, {{"c", 3}});
+        return e.eval(x.size(), {x.data(), y.data()}, {label});
+    };
+    auto const xd = x.cast<double>().eval();
+
+    REQUIRE(eval("1 + 2 * 3 - 4 / 2")(0) == Approx(5));
+    REQUIRE(eval("2 ** 3 ** 2")(0) == Approx(512)); // right-associative
+    REQUIRE(eval("-2 ** 2")(0) == Approx(-4)); // like Python
+    REQUIRE(eval("2 ^ -1")(0) == Approx(0.5));
+    REQUIRE(eval("c * pi")(0) == Approx(3 * 3.14159265358979));
+    REQUIRE(eval("1e-3 + .5")(0) == Approx(0.501));
+    REQUIRE(eval("x * y + c").isApprox(xd * 0.5 + 3));
+    REQUIRE(eval("exp(-x**2) * cos(x)").isApprox((-xd.square()).exp() * xd.cos()));
+    REQUIRE(eval("where(x > 0, x, -x)").isApprox(xd.abs()));
+    REQUIRE(eval("max(x, y) - min(x, y)").isApprox((xd - 0.5).abs()));
+    REQUIRE(eval("atan2(y, 1)")(0) == Approx(std::atan2(0.5, 1)));
+    REQUIRE(eval("(x < 0) + (x >= 0)").isApproxToConstant(1));
+    REQUIRE(eval("sub_id == 'A'")(0) == 1);
+    REQUIRE(eval("sub_id == \"A\"", "B")(0) == 0);
+    REQUIRE(eval("sub_id != 'A'", "B")(0) == 1);
+
+    REQUIRE_THROWS_WITH(eval("x +"), Catch::Contains("unexpected end"));
+    REQUIRE_THROWS_WITH(eval("(x"), Catch::Contains("expected ')'"));
+    REQUIRE_THROWS_WITH(eval("x y"), Catch::Contains("unexpected 'y' at position 2"));
+    REQUIRE_THROWS_WITH(eval("z"), Catch::Contains("unknown name 'z'"));
+    REQUIRE_THROWS_WITH(eval("max(x)"), Catch::Contains("expected ','"));
+    REQUIRE_THROWS_WITH(eval("sub_id + 1"), Catch::Contains("can only be compared"));
+}
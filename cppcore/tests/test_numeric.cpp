@@ -1,6 +1,9 @@
 #include <catch.hpp>
 
 #include "numeric/dense.hpp"
+#include "numeric/bessel.hpp"
+#include "numeric/fft.hpp"
+#include "numeric/random.hpp"
 using namespace cpb;
 
 struct ArrayRefTestOp {
@@ -83,3 +86,72 @@ TEST_CASE("concat") {
     REQUIRE(result.y.isApprox(expected_y));
     REQUIRE(result.z.isApprox(expected_z));
 }
+
+TEST_CASE("fft") {
+    auto const size = 16;
+    auto x = ArrayXcd(size);
+    for (auto n = 0; n < size; ++n) {
+        x[n] = {std::cos(0.3 * n * n), std::sin(1.7 * n)};
+    }
+
+    for (auto sign : {-1, 1}) {
+        INFO("sign: " << sign);
+        auto expected = ArrayXcd(size);
+        for (auto k = 0; k < size; ++k) {
+            expected[k] = 0;
+            for (auto n = 0; n < size; ++n) {
+                expected[k] += x[n] * std::polar(1.0, sign * 2 * M_PI * n * k / size);
+            }
+        }
+
+        auto result = x;
+        num::fft(result, sign);
+        REQUIRE(result.isApprox(expected));
+    }
+
+    REQUIRE(num::next_pow2(1) == 1);
+    REQUIRE(num::next_pow2(17) == 32);
+    REQUIRE(num::next_pow2(64) == 64);
+}
+
+TEST_CASE("Philox") {
+    // Known answers from the reference implementation (Random123)
+    using Block = num::Philox::Block;
+    REQUIRE((num::Philox(0)({{0, 0, 0, 0}})
+             == Block{{0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8}}));
+    REQUIRE((num::Philox(~std::uint64_t{0})({{~0u, ~0u, ~0u, ~0u}})
+             == Block{{0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd}}));
+
+    // Each element only depends on the key, the stream and its position
+    auto const generator = num::Philox(42);
+    auto const a = num::make_random<ArrayXd>(101, generator, 7);
+    auto const b = num::make_random<ArrayXd>(50, generator, 7);
+    REQUIRE((a.head(50) == b).all());
+    for (auto start : {1, 50, 51}) {
+        auto const c = num::make_random<ArrayXd>(101 - start, generator, 7, start);
+        REQUIRE((a.tail(101 - start) == c).all());
+        REQUIRE(num::random_uniform<double>(generator, 7, start) == a[start]);
+    }
+    REQUIRE((a >= 0).all());
+    REQUIRE((a < 1).all());
+    REQUIRE(std::abs(a.mean() - 0.5) < 0.1);
+    REQUIRE((a != num::make_random<ArrayXd>(101, generator, 8)).all());
+    REQUIRE((a != num::make_random<ArrayXd>(101, num::Philox(43), 7)).all());
+
+    auto const f = num::make_random<ArrayXf>(101, generator, 7);
+    REQUIRE(((f >= 0) && (f < 1)).all());
+}
+
+TEST_CASE("Bessel") {
+    REQUIRE(num::bessel_j(3, 0).isApprox(VectorXd::Unit(4, 0).array()));
+
+    auto const j = num::bessel_j(5, 1);
+    REQUIRE(j[0] == Approx(0.7651976865579666));
+    REQUIRE(j[1] == Approx(0.4400505857449335));
+    REQUIRE(j[5] == Approx(2.497577302112344e-04));
+
+    auto const k = num::bessel_j(60, -25);
+    REQUIRE(k[0] == Approx(0.09626678327595811));
+    REQUIRE(k[1] == Approx(0.1253502495802899));
+    REQUIRE(k[60] == Approx(5.723515483722270e-18));
+}
@@ -51,3 +51,46 @@ TEST_CASE("Shape-imposed lattice offset") {
     REQUIRE(system.positions.x.minCoeff() > offset_system.positions.x.minCoeff());
     REQUIRE(system.num_sites() > offset_system.num_sites());
 }
+
+TEST_CASE("Polygon", "[shape]") {
+    // Star-shaped polygon with many vertices and a simple (per point) crossing number reference
+    auto vertices = Shape::Vertices();
+    auto const num_vertices = 300;
+    for (auto i = 0; i < num_vertices; ++i) {
+        auto const phi = 2 * 3.14159265f * static_cast<float>(i) / num_vertices;
+        auto const r = (i % 2 == 0) ? 10.f : 6.f + 3.f * std::sin(5 * phi);
+        vertices.push_back({r * std::cos(phi), r * std::sin(phi), 0});
+    }
+    auto const is_inside = [&](float x, float y) {
+        auto inside = false;
+        for (auto i = 0, j = num_vertices - 1; i < num_vertices; j = i++) {
+            auto const& a = vertices[i];
+            auto const& b = vertices[j];
+            if ((a.y() > y) != (b.y() > y)
+                && x < (b.x() - a.x()) * (y - a.y()) / (b.y() - a.y()) + a.x()) {
+                inside = !inside;
+            }
+        }
+        return inside;
+    };
+
+    auto const size = 120;
+    auto const num = size * size;
+    auto p = CartesianArray(num);
+    for (auto i = 0; i < num; ++i) { // rows of consecutive points, like a foundation
+        p[i] = Cartesian{-12.f + 24.1f * static_cast<float>(i % size) / size,
+                         -12.f + 24.3f * static_cast<float>(i / size) / size, 0};
+    }
+
+    auto const shape = Polygon(vertices);
+    auto const result = shape.contains(p);
+    REQUIRE(result.size() == num);
+    REQUIRE(result.count() > 0);
+    REQUIRE(result.count() < num);
+
+    auto mismatches = 0;
+    for (auto i = 0; i < num; ++i) {
+        if (result[i] != is_inside(p.x[i], p.y[i])) { ++mismatches; }
+    }
+    REQUIRE(mismatches == 0);
+}
@@ -0,0 +1,399 @@
+#include <catch.hpp>
+
+#include "fixtures.hpp"
+#include "solver/ChebyshevFilter.hpp"
+#include "solver/Dense.hpp"
+#include "solver/ShiftInvert.hpp"
+#include "solver/SlicedFEAST.hpp"
+#include "solver/Bands.hpp"
+
+#include <Eigen/Eigenvalues>
+using namespace cpb;
+
+namespace {
+
+template<class T>
+Eigen::Map<ArrayX<T> const> map_1d(num::ArrayConstRef const& ref) {
+    REQUIRE(ref.tag == num::detail::get_tag<T>());
+    return {static_cast<T const*>(ref.data), ref.shape[0]};
+}
+
+template<class T>
+Eigen::Map<ColMajorArrayXX<T> const> map_2d(num::ArrayConstRef const& ref) {
+    REQUIRE(ref.tag == num::detail::get_tag<T>());
+    return {static_cast<T const*>(ref.data), ref.shape[0], ref.shape[1]};
+}
+
+} // anonymous namespace
+
+TEST_CASE("ChebyshevFilter") {
+    auto test = [](Model const& model, ChebyshevFilterConfig const& config) {
+        using scalar_t = std::complex<double>;
+        auto const& h = model.hamiltonian();
+        auto const dense = ham::is<double>(h)
+                           ? MatrixXcd(ham::get_reference<double>(h).cast<scalar_t>())
+                           : MatrixXcd(ham::get_reference<scalar_t>(h));
+        auto const exact = Eigen::SelfAdjointEigenSolver<MatrixXcd>(dense).eigenvalues();
+        auto const in_window = (exact.array() >= config.energy_min)
+                               && (exact.array() <= config.energy_max);
+        auto expected = ArrayXd(in_window.count());
+        for (auto i = idx_t{0}, j = idx_t{0}; i < exact.size(); ++i) {
+            if (in_window[i]) { expected[j++] = exact[i]; }
+        }
+        REQUIRE(expected.size() > 0);
+
+        auto solver = Solver<ChebyshevFilter>(model, config);
+        auto const values = map_1d<double>(solver.eigenvalues()).eval();
+        REQUIRE(values.size() == expected.size());
+        REQUIRE(values.isApprox(expected, 1e-8));
+
+        auto const vectors = [&]{
+            auto const ref = solver.eigenvectors();
+            return ham::is<double>(h) ? map_2d<double>(ref).cast<scalar_t>().eval()
+                                      : map_2d<scalar_t>(ref).eval();
+        }();
+        REQUIRE(vectors.cols() == values.size());
+        MatrixXcd const residual = dense * vectors.matrix()
+                                   - vectors.matrix() * values.matrix().asDiagonal();
+        REQUIRE(residual.norm() < 1e-4);
+        REQUIRE(solver.report(true).find("Subspace") != std::string::npos);
+        return solver.report(true);
+    };
+
+    auto config = ChebyshevFilterConfig();
+    config.energy_min = -1.5;
+    config.energy_max = 1.0;
+
+    SECTION("Real") {
+        auto const model = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                 field::force_double_precision());
+        test(model, config);
+
+        config.matrix_format = kpm::MatrixFormat::CSR;
+        config.initial_size_guess = 1; // must grow to fit all the eigenvalues
+        auto const report = test(model, config);
+        REQUIRE(report.find("Resized subspace") != std::string::npos);
+    }
+
+    SECTION("Complex") {
+        auto const model = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                 field::force_double_precision(),
+                                 field::constant_magnetic_field(1e3));
+        test(model, config);
+    }
+
+    SECTION("Outside of the spectrum") {
+        auto const model = Model(graphene::monolayer(), shape::rectangle(1, 1),
+                                 field::force_double_precision());
+        config.energy_min = 20;
+        config.energy_max = 30;
+        auto solver = Solver<ChebyshevFilter>(model, config);
+        REQUIRE(solver.eigenvalues().size() == 0);
+    }
+}
+
+TEST_CASE("Band structure") {
+    auto const model = Model(graphene::monolayer(), Primitive(5, 5), TranslationalSymmetry(1, 1),
+                             field::force_double_precision());
+    auto const k_path = std::vector<Cartesian>{
+        {0, 0, 0}, {1, 0, 0}, {2, 1, 0}, {0.5f, -3, 0}, {4, 4, 0}, {-1, 2, 0}, {0, 7, 0}
+    };
+    auto const exact = [&](Cartesian const& k) {
+        auto copy = model;
+        copy.set_wave_vector(k);
+        auto const dense = MatrixXcd(ham::get_reference<std::complex<double>>(copy.hamiltonian()));
+        return Eigen::SelfAdjointEigenSolver<MatrixXcd>(dense).eigenvalues().array().eval();
+    };
+
+    SECTION("Dense") {
+        auto const bands = calc_bands(model, k_path, /*num_bands*/-1, /*num_threads*/3);
+        REQUIRE(bands.rows() == static_cast<idx_t>(k_path.size()));
+        REQUIRE(bands.cols() == model.hamiltonian().rows());
+        for (auto i = size_t{0}; i < k_path.size(); ++i) {
+            INFO("k-point: " << i);
+            REQUIRE(bands.row(i).transpose().isApprox(exact(k_path[i]), 1e-10));
+        }
+        REQUIRE(calc_bands(model, k_path, /*num_bands*/3).cols() == 3);
+    }
+
+    SECTION("Sparse strategy") {
+        auto config = ChebyshevFilterConfig();
+        config.energy_min = -1.5;
+        config.energy_max = 1.0;
+        config.num_threads = 1;
+        auto solver = Solver<ChebyshevFilter>(model, config);
+        for (auto const warm_start : {false, true}) {
+            solver.set_warm_start(warm_start);
+            auto const bands = solver.calc_bands(k_path, /*num_threads*/2);
+            for (auto i = size_t{0}; i < k_path.size(); ++i) {
+                INFO("warm start: " << warm_start << ", k-point: " << i);
+                auto const values = exact(k_path[i]);
+                auto const in_window = (values >= config.energy_min)
+                                       && (values <= config.energy_max);
+                auto const found = bands.row(i).isFinite().count();
+                REQUIRE(found == in_window.count());
+                auto expected = ArrayXd(found);
+                for (auto j = idx_t{0}, n = idx_t{0}; j < values.size(); ++j) {
+                    if (in_window[j]) { expected[n++] = values[j]; }
+                }
+                REQUIRE(bands.row(i).head(found).transpose().isApprox(expected, 1e-8));
+            }
+        }
+    }
+
+    SECTION("Lead") {
+        auto lead_model = Model(lattice::square(), shape::rectangle(2, 3));
+        lead_model.attach_lead(-1, Line({0, -1.5f, 0}, {0, 1.5f, 0}));
+        // A 3-site wide strip: E = E0 +/- 2 cos(k) + {-sqrt(2), 0, sqrt(2)}
+        auto const k_points = ArrayXd::LinSpaced(3, 0, 0.5 * constant::pi);
+        auto const bands = calc_bands(lead_model.lead(0), k_points);
+        REQUIRE(bands.rows() == 3);
+        REQUIRE(bands.cols() == 3);
+        auto const sqrt2 = std::sqrt(2.0);
+        auto const expected_spread = ArrayXd::LinSpaced(3, -sqrt2, sqrt2);
+        for (auto i = 0; i < 3; ++i) {
+            auto const row = bands.row(i).transpose().eval();
+            REQUIRE((row - row.mean()).isApprox(expected_spread, 1e-6));
+        }
+        REQUIRE(std::abs(bands.row(2).mean() - bands.row(0).mean()) == Approx(2));
+    }
+}
+
+TEST_CASE("Dense") {
+    auto test = [](Model const& model) {
+        using scalar_t = std::complex<double>;
+        auto const& h = model.hamiltonian();
+        auto const dense = ham::is<float>(h)
+                           ? MatrixXcd(ham::get_reference<float>(h).cast<scalar_t>())
+                           : MatrixXcd(ham::get_reference<std::complex<float>>(h)
+                                           .cast<scalar_t>());
+        auto const exact = Eigen::SelfAdjointEigenSolver<MatrixXcd>(dense).eigenvalues();
+
+        auto solver = Solver<Dense>(model);
+        auto const values = map_1d<float>(solver.eigenvalues()).cast<double>().eval();
+        REQUIRE(values.isApprox(exact.array(), 1e-5));
+
+        auto const vectors = [&]{
+            auto const v = solver.eigenvectors();
+            return ham::is<float>(h) ? map_2d<float>(v).cast<scalar_t>().eval()
+                                     : map_2d<std::complex<float>>(v).cast<scalar_t>().eval();
+        }();
+        MatrixXcd const residual = dense * vectors.matrix()
+                                   - vectors.matrix() * values.matrix().asDiagonal();
+        REQUIRE(residual.norm() < 1e-3);
+
+        auto config = DenseConfig();
+        config.eigenvalues_only = true;
+        auto values_only = Solver<Dense>(model, config);
+        REQUIRE(map_1d<float>(values_only.eigenvalues()).cast<double>().isApprox(values));
+        REQUIRE(values_only.eigenvectors().size() == 0);
+    };
+
+    SECTION("Real") {
+        test(Model(graphene::monolayer(), shape::rectangle(2, 2)));
+    }
+
+    SECTION("Complex") {
+        test(Model(graphene::monolayer(), shape::rectangle(2, 2),
+                   field::constant_magnetic_field(1e3)));
+    }
+}
+
+TEST_CASE("ShiftInvert") {
+    auto test = [](Solver<ShiftInvert>& solver, ShiftInvertConfig const& config) {
+        using scalar_t = std::complex<double>;
+        auto const& h = solver.get_model().hamiltonian();
+        auto const dense = ham::is<double>(h)
+                           ? MatrixXcd(ham::get_reference<double>(h).cast<scalar_t>())
+                           : MatrixXcd(ham::get_reference<scalar_t>(h));
+        auto exact = ArrayXd(Eigen::SelfAdjointEigenSolver<MatrixXcd>(dense).eigenvalues());
+        std::sort(exact.data(), exact.data() + exact.size(), [&](double a, double b) {
+            return std::abs(a - config.sigma) < std::abs(b - config.sigma);
+        });
+        auto expected = ArrayXd(exact.head(config.num_eigenvalues));
+        std::sort(expected.data(), expected.data() + expected.size());
+
+        auto const values = map_1d<double>(solver.eigenvalues()).eval();
+        REQUIRE(values.isApprox(expected, 1e-8));
+
+        auto const vectors = [&]{
+            auto const ref = solver.eigenvectors();
+            return ham::is<double>(h) ? map_2d<double>(ref).cast<scalar_t>().eval()
+                                      : map_2d<scalar_t>(ref).eval();
+        }();
+        REQUIRE(vectors.cols() == values.size());
+        MatrixXcd const residual = dense * vectors.matrix()
+                                   - vectors.matrix() * values.matrix().asDiagonal();
+        REQUIRE(residual.norm() < 1e-6);
+    };
+
+    auto config = ShiftInvertConfig();
+    config.sigma = 0.4;
+    config.num_eigenvalues = 6;
+    config.subspace_size = 14; // small enough to require restarts
+
+    SECTION("Real") {
+        auto solver = Solver<ShiftInvert>(Model(graphene::monolayer(), shape::rectangle(3, 3),
+                                                field::force_double_precision()), config);
+        test(solver, config);
+        REQUIRE(solver.report(false).find("Reused the column ordering: no") != std::string::npos);
+
+        config.sigma = -1.2;
+        config.num_eigenvalues = 1;
+        config.subspace_size = 0;
+        auto single = Solver<ShiftInvert>(solver.get_model(), config);
+        test(single, config);
+    }
+
+    SECTION("Complex") {
+        auto solver = Solver<ShiftInvert>(Model(graphene::monolayer(), shape::rectangle(3, 3),
+                                                field::force_double_precision(),
+                                                field::constant_magnetic_field(1e3)), config);
+        test(solver, config);
+
+        // Same sparsity pattern: only the numerical factorization is repeated
+        solver.set_model(Model(graphene::monolayer(), shape::rectangle(3, 3),
+                               field::force_double_precision(),
+                               field::constant_magnetic_field(2e3)));
+        test(solver, config);
+        REQUIRE(solver.report(false).find("Reused the column ordering: yes") != std::string::npos);
+    }
+
+    SECTION("Warm start") {
+        auto const make_model = [](float field) {
+            return Model(graphene::monolayer(), shape::rectangle(3, 3),
+                         field::force_double_precision(), field::constant_magnetic_field(field));
+        };
+        auto const num_restarts = [](Solver<ShiftInvert>& solver) {
+            solver.solve();
+            auto const report = solver.report(true);
+            return std::stoi(report.substr(report.find("Restarts(") + 9));
+        };
+
+        auto cold = Solver<ShiftInvert>(make_model(1e3), config);
+        auto warm = Solver<ShiftInvert>(make_model(1e3), config);
+        warm.set_warm_start(true);
+        REQUIRE(num_restarts(cold) == num_restarts(warm));
+
+        // A small step of the sweep: the previous eigenvectors are nearly converged
+        cold.set_model(make_model(1.01e3));
+        warm.set_model(make_model(1.01e3));
+        test(warm, config);
+        REQUIRE(num_restarts(warm) <= num_restarts(cold));
+    }
+
+    SECTION("Invalid number of eigenvalues") {
+        config.num_eigenvalues = 0;
+        auto solver = Solver<ShiftInvert>(Model(graphene::monolayer(), shape::rectangle(1, 1),
+                                                field::force_double_precision()), config);
+        REQUIRE_THROWS_WITH(solver.solve(), Catch::Contains("number of eigenvalues"));
+    }
+}
+
+TEST_CASE("Spectrum slicing") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(3, 3),
+                             field::force_double_precision());
+    auto const& h = model.hamiltonian();
+    auto const exact = ArrayXd(Eigen::SelfAdjointEigenSolver<MatrixXd>(
+        MatrixXd(ham::get_reference<double>(h))
+    ).eigenvalues());
+    auto const exact_count = [&](double min, double max) {
+        return static_cast<double>(((exact >= min) && (exact <= max)).count());
+    };
+
+    auto config = SpectrumSlicingConfig();
+    config.energy_min = -1.5;
+    config.energy_max = 1.0;
+    config.num_random = 32;
+    config.num_threads = 2;
+
+    SECTION("Fixed number of slices") {
+        config.num_slices = 4;
+        auto const slices = slice_spectrum(h, config);
+        REQUIRE(slices.counts.size() == 4);
+        REQUIRE(slices.borders.size() == 5);
+        REQUIRE(slices.borders.front() == config.energy_min);
+        REQUIRE(slices.borders.back() == config.energy_max);
+        REQUIRE(std::is_sorted(slices.borders.begin(), slices.borders.end()));
+
+        auto const expected = exact_count(config.energy_min, config.energy_max);
+        REQUIRE(slices.total_count() == Approx(expected).epsilon(0.1));
+        for (auto const count : slices.counts) { // about the same number in each slice
+            REQUIRE(count == Approx(slices.total_count() / 4).epsilon(0.1));
+        }
+        for (auto k = size_t{0}; k < slices.counts.size(); ++k) {
+            auto const found = exact_count(slices.borders[k], slices.borders[k + 1]);
+            REQUIRE(std::abs(slices.counts[k] - found) < 0.25 * found + 4);
+        }
+    }
+
+    SECTION("Slices from the target size") {
+        config.slice_size = 20;
+        auto const slices = slice_spectrum(h, config);
+        auto const num_slices = std::ceil(slices.total_count() / 20);
+        REQUIRE(static_cast<double>(slices.counts.size()) == num_slices);
+    }
+
+    SECTION("Empty range") {
+        config.energy_max = config.energy_min;
+        REQUIRE_THROWS_WITH(slice_spectrum(h, config), Catch::Contains("energy range"));
+    }
+
+#ifdef CPB_USE_FEAST
+    SECTION("SlicedFEAST") {
+        auto solver_config = SlicedFEASTConfig();
+        solver_config.slicing = config;
+        solver_config.slicing.num_slices = 3;
+        auto solver = Solver<SlicedFEAST>(model, solver_config);
+        auto const values = map_1d<double>(solver.eigenvalues()).eval();
+
+        auto expected = std::vector<double>();
+        for (auto i = idx_t{0}; i < exact.size(); ++i) {
+            if (exact[i] >= config.energy_min && exact[i] <= config.energy_max) {
+                expected.push_back(exact[i]);
+            }
+        }
+        REQUIRE(values.size() == static_cast<idx_t>(expected.size()));
+        REQUIRE(values.isApprox(Eigen::Map<ArrayXd const>(expected.data(), values.size()),
+                                1e-8));
+        REQUIRE(solver.report(true).find("Slices(3") != std::string::npos);
+    }
+#endif // CPB_USE_FEAST
+}
+
+TEST_CASE("Eigenvector selection") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                             field::force_double_precision());
+    auto solver = Solver<Dense>(model);
+    auto const psi = map_2d<double>(solver.eigenvectors()).eval();
+
+    auto const selected = solver.eigenvectors_at({3, 0}, {1, 5, 2});
+    auto const& vectors = selected.get<ColMajorArrayXX<double>>();
+    REQUIRE(vectors.rows() == 2);
+    REQUIRE(vectors.cols() == 3);
+    REQUIRE(vectors(0, 0) == psi(3, 1));
+    REQUIRE(vectors(1, 1) == psi(0, 5));
+    REQUIRE(vectors(1, 2) == psi(0, 2));
+
+    auto const probability = solver.probability_at({}, {4});
+    auto const& p = probability.get<ColMajorArrayXX<double>>();
+    REQUIRE(p.rows() == psi.rows());
+    REQUIRE(p.cols() == 1);
+    REQUIRE(p.col(0).isApprox(psi.col(4).abs2()));
+    REQUIRE(p.sum() == Approx(1));
+
+    REQUIRE_THROWS_WITH(solver.probability_at({}, {psi.cols()}), Catch::Contains("state"));
+    REQUIRE_THROWS_WITH(solver.eigenvectors_at({-1}, {}), Catch::Contains("site"));
+
+    SECTION("Single precision storage") {
+        auto const ldos = solver.calc_spatial_ldos(0.5f, 0.1f);
+        solver.set_single_precision_eigenvectors(true);
+        solver.set_model(model);
+        auto const values = map_1d<double>(solver.eigenvalues()).eval();
+        auto const compact = map_2d<float>(solver.eigenvectors()).cast<double>().eval();
+        REQUIRE(compact.isApprox(psi, 1e-5));
+        REQUIRE(solver.calc_spatial_ldos(0.5f, 0.1f).isApprox(ldos, 1e-4));
+        REQUIRE(solver.probability_at({0}, {}).is<ColMajorArrayXX<float>>());
+        REQUIRE(values.size() == psi.cols());
+    }
+}
@@ -1,6 +1,16 @@
 #include <catch.hpp>
 
 #include "fixtures.hpp"
+#include "BinaryFile.hpp"
+#include "hamiltonian/BuiltinModifiers.hpp"
+#include "system/CompressedHoppingBlocks.hpp"
+#include "system/Foundation.hpp"
+#include "system/PointSymmetry.hpp"
+#include "system/SpatialIndex.hpp"
+#include "support/format.hpp"
+
+#include <cstdio>
+#include <fstream>
 using namespace cpb;
 
 TEST_CASE("CompressedSublattices") {
@@ -46,6 +56,89 @@ TEST_CASE("HoppingBlocks") {
     REQUIRE(neighbor_counts.sum() == 2 * 4 + 3 * 12 + 4 * 8);
 }
 
+TEST_CASE("CompressedHoppingBlocks") {
+    auto const model = Model(graphene::monolayer(), Primitive(30, 20),
+                             TranslationalSymmetry(1, -1));
+    auto const& system = *model.system();
+    REQUIRE_FALSE(system.boundaries.empty());
+
+    auto const check = [](HoppingBlocks const& hb) {
+        auto const compressed = CompressedHoppingBlocks(hb, 2);
+        REQUIRE(compressed.nnz() == hb.nnz());
+
+        auto const restored = compressed.decompress(2);
+        REQUIRE(restored.get_num_sites() == hb.get_num_sites());
+        auto it = restored.begin();
+        for (auto const& block : hb) {
+            REQUIRE(it->coordinates() == block.coordinates());
+            ++it;
+        }
+
+        // Small chunks cover the blocks in order
+        auto n = idx_t{0};
+        compressed.for_each_chunk([&](HopID id, HoppingBlocks::Block const& chunk, idx_t start) {
+            auto const& expected = std::next(hb.begin(), id.value())->coordinates();
+            REQUIRE(chunk.size() <= 7);
+            REQUIRE(std::equal(chunk.begin(), chunk.end(), expected.begin() + start));
+            n += static_cast<idx_t>(chunk.size());
+        }, 7);
+        REQUIRE(n == hb.nnz());
+
+        auto const csr = compressed.tocsr();
+        auto const expected = hb.tocsr();
+        REQUIRE(csr.nonZeros() == expected.nonZeros());
+        REQUIRE(std::equal(csr.outerIndexPtr(), csr.outerIndexPtr() + csr.rows() + 1,
+                           expected.outerIndexPtr()));
+        REQUIRE(std::equal(csr.innerIndexPtr(), csr.innerIndexPtr() + csr.nonZeros(),
+                           expected.innerIndexPtr()));
+        REQUIRE(std::equal(csr.valuePtr(), csr.valuePtr() + csr.nonZeros(),
+                           expected.valuePtr()));
+    };
+
+    check(system.hopping_blocks);
+    auto const bytes = CompressedHoppingBlocks(system.hopping_blocks).memory_usage();
+    REQUIRE(bytes < static_cast<size_t>(system.hopping_blocks.nnz()) * sizeof(COO) / 2);
+    for (auto const& boundary : system.boundaries) {
+        check(boundary.hopping_blocks); // may be lower triangular
+    }
+
+    // Unsorted coordinates and large offsets still round-trip
+    auto hb = HoppingBlocks(1 << 20, {{"t", 0}});
+    hb.add(HopID{0}, 1000000, 1000001);
+    hb.add(HopID{0}, 3, (1 << 20) - 1);
+    hb.add(HopID{0}, 7, 2);
+    auto const restored = CompressedHoppingBlocks(hb).decompress();
+    REQUIRE(restored.begin()->coordinates() == hb.begin()->coordinates());
+}
+
+TEST_CASE("remove_invalid") {
+    auto const model = Model(lattice::square(), Primitive(7, 5));
+    auto s = *model.system();
+    auto const expected_positions = s.positions;
+    auto const expected_blocks = s.hopping_blocks.get_serialized_blocks();
+
+    s.is_valid = ArrayX<bool>::Constant(s.num_sites(), true);
+    s.is_valid[0] = false;
+    s.is_valid[17] = false;
+    detail::remove_invalid(s, 4);
+    REQUIRE(s.num_sites() == 33);
+    REQUIRE(s.compressed_sublattices.decompressed_size() == 33);
+    REQUIRE(s.hopping_blocks.get_num_sites() == 33);
+    REQUIRE(s.positions[0] == expected_positions[1]);
+    REQUIRE(s.positions[16] == expected_positions[18]);
+
+    // The remaining hoppings are renumbered: they connect the same positions as before
+    auto const blocks = s.hopping_blocks.get_serialized_blocks();
+    auto const& rows = blocks[0].first;
+    auto const& cols = blocks[0].second;
+    REQUIRE(rows.size() < expected_blocks[0].first.size());
+    for (auto n = 0; n < rows.size(); ++n) {
+        REQUIRE(rows[n] < cols[n]);
+        auto const d = (s.positions[cols[n]] - s.positions[rows[n]]).norm();
+        REQUIRE(d == Approx(1));
+    }
+}
+
 TEST_CASE("to_hamiltonian_indices") {
     auto vec = [](std::initializer_list<storage_idx_t> const& init) -> VectorXi {
         auto v = VectorXi(static_cast<idx_t>(init.size()));
@@ -125,3 +218,459 @@ TEST_CASE("expanded_positions") {
     REQUIRE(ep[6] == pos[3]);
     REQUIRE(ep[7] == pos[3]);
 }
+
+TEST_CASE("Multithreaded system build") {
+    auto const build = [](Model model, idx_t num_threads) {
+        model.set_num_threads(num_threads);
+        return model.system();
+    };
+    auto const compare = [](System const& s, System const& expected) {
+        REQUIRE(s.num_sites() == expected.num_sites());
+        REQUIRE((s.positions.x == expected.positions.x).all());
+        REQUIRE((s.positions.y == expected.positions.y).all());
+        REQUIRE((s.positions.z == expected.positions.z).all());
+
+        auto const& cs = s.compressed_sublattices;
+        auto const& cs_expected = expected.compressed_sublattices;
+        REQUIRE((cs.alias_ids() == cs_expected.alias_ids()).all());
+        REQUIRE((cs.site_counts() == cs_expected.site_counts()).all());
+
+        auto const blocks = s.hopping_blocks.get_serialized_blocks();
+        auto const blocks_expected = expected.hopping_blocks.get_serialized_blocks();
+        REQUIRE(blocks.size() == blocks_expected.size());
+        for (auto i = size_t{0}; i < blocks.size(); ++i) {
+            REQUIRE((blocks[i].first == blocks_expected[i].first).all());
+            REQUIRE((blocks[i].second == blocks_expected[i].second).all());
+        }
+    };
+
+    SECTION("Shape with dangling sites") {
+        auto const lattice = graphene::monolayer().with_min_neighbors(2);
+        auto const shape = shape::rectangle(60, 60);
+        REQUIRE(Foundation(lattice, shape, 4).tiles().size() > 1);
+
+        auto const model = Model(lattice, shape);
+        auto const expected = build(model, 1);
+        compare(*build(model, 4), *expected);
+        compare(*build(model, 3), *expected);
+    }
+
+    SECTION("Multiple orbitals") {
+        auto const model = Model(lattice::square_multiorbital(), Primitive(200, 200));
+        compare(*build(model, 4), *build(model, 1));
+    }
+
+    SECTION("Periodic boundaries") {
+        auto const model = Model(graphene::monolayer(), Primitive(300, 300),
+                                 TranslationalSymmetry(20, 20));
+        auto const expected = build(model, 1);
+        auto const s = build(model, 4);
+        compare(*s, *expected);
+
+        REQUIRE(s->boundaries.size() == expected->boundaries.size());
+        REQUIRE(s->boundaries.size() >= 2);
+        for (auto n = size_t{0}; n < s->boundaries.size(); ++n) {
+            auto const& b = s->boundaries[n];
+            auto const& b_expected = expected->boundaries[n];
+            REQUIRE(b.shift.isApprox(b_expected.shift));
+            REQUIRE(b.hopping_blocks.nnz() > 0);
+
+            auto const blocks = b.hopping_blocks.get_serialized_blocks();
+            auto const blocks_expected = b_expected.hopping_blocks.get_serialized_blocks();
+            REQUIRE(blocks.size() == blocks_expected.size());
+            for (auto i = size_t{0}; i < blocks.size(); ++i) {
+                REQUIRE((blocks[i].first == blocks_expected[i].first).all());
+                REQUIRE((blocks[i].second == blocks_expected[i].second).all());
+            }
+        }
+    }
+
+    SECTION("Long dangling cascades") {
+        // Heavy dilution: the removal of dangling sites propagates far from the vacancies
+        auto const model = Model(graphene::monolayer(), Primitive(300, 300),
+                                 builtin::random_vacancies(0.15, 3, /*min_neighbors*/2));
+        auto const expected = build(model, 1);
+        REQUIRE(expected->num_sites() < 0.8 * 2 * 300 * 300);
+        compare(*build(model, 4), *expected);
+
+        // Every remaining site has at least two neighbors (except at the foundation edges)
+        auto const counts = expected->hopping_blocks.count_neighbors();
+        REQUIRE((counts >= 1).all());
+    }
+}
+
+TEST_CASE("Foundation neighbor offsets") {
+    auto const check = [](Lattice const& lattice, Primitive const& primitive) {
+        auto foundation = Foundation(lattice, primitive);
+        auto const& unit_cell = foundation.get_optimized_unit_cell();
+        auto const size = foundation.get_spatial_size().array();
+        auto num_interior = 0;
+        auto const offsets = detail::make_neighbor_offsets(unit_cell,
+                                                           foundation.get_spatial_size());
+
+        for (auto const& site : foundation) {
+            auto expected = std::vector<idx_t>();
+            for (auto const& hopping : unit_cell[site.get_sub_idx()].hoppings) {
+                auto const index = Array3i(site.get_spatial_idx() + hopping.relative_index);
+                if ((index < 0).any() || (index >= size).any()) { continue; }
+                auto const neighbor = Site(&foundation, index, hopping.to_sub_idx);
+                expected.push_back(neighbor.get_flat_idx());
+            }
+
+            auto neighbors = std::vector<idx_t>();
+            site.for_each_neighbor([&](Site neighbor, Hopping) {
+                auto const recomputed = Site(&foundation, neighbor.get_spatial_idx(),
+                                             neighbor.get_sub_idx());
+                REQUIRE(recomputed.get_flat_idx() == neighbor.get_flat_idx());
+                neighbors.push_back(neighbor.get_flat_idx());
+            });
+            REQUIRE(neighbors == expected);
+
+            auto const& table = offsets[site.get_sub_idx()];
+            if (table.is_interior(site.get_spatial_idx())) {
+                ++num_interior;
+                REQUIRE(neighbors.size() == unit_cell[site.get_sub_idx()].hoppings.size());
+            }
+        }
+        return num_interior;
+    };
+
+    REQUIRE(check(graphene::monolayer(), Primitive(6, 5)) > 0);
+    REQUIRE(check(lattice::square_multiorbital(), Primitive(4, 4)) > 0);
+    REQUIRE(check(graphene::monolayer(), Primitive(1, 1)) == 0); // all the sites are at the edges
+}
+
+TEST_CASE("Implicit foundation positions") {
+    auto const lattice = graphene::monolayer();
+    auto foundation = Foundation(lattice, Primitive(5, 4));
+    REQUIRE_FALSE(foundation.has_positions());
+    auto const implicit_usage = foundation.memory_usage();
+
+    auto implicit = CartesianArray(foundation.size());
+    for (auto const& site : foundation) {
+        implicit[site.get_flat_idx()] = site.get_position();
+    }
+    auto const sublattice = foundation.sublattice_positions(1);
+    REQUIRE_FALSE(foundation.has_positions());
+
+    auto const& expected = foundation.get_positions();
+    REQUIRE(foundation.has_positions());
+    REQUIRE(foundation.memory_usage() == implicit_usage + expected.memory_usage());
+    REQUIRE((implicit.x == expected.x).all());
+    REQUIRE((implicit.y == expected.y).all());
+    REQUIRE((implicit.z == expected.z).all());
+    auto const block_size = foundation.get_spatial_size().prod();
+    REQUIRE((sublattice.x == expected.x.segment(block_size, block_size)).all());
+    REQUIRE((sublattice.y == expected.y.segment(block_size, block_size)).all());
+
+    // Once stored, the positions may be modified
+    foundation.get_positions().x += 1.f;
+    REQUIRE(foundation.begin()->get_position().x() == expected.x[0]);
+    REQUIRE(foundation.sublattice_positions(1).x[0] == expected.x[block_size]);
+
+    auto const shape = shape::rectangle(2, 2);
+    auto const keep_all = lattice.with_min_neighbors(0);
+    auto const shaped = Foundation(keep_all, shape);
+    auto const& positions = shaped.get_positions();
+    REQUIRE((shaped.get_states() == shape.contains(positions)).all());
+}
+
+TEST_CASE("Tiled system build without a foundation") {
+    auto const build = [](Lattice const& lattice, Shape const& shape, idx_t num_threads,
+                          idx_t max_tile_sites) {
+        auto const model = Model(lattice);
+        auto s = System(model.get_site_registry(), model.get_hopping_registry());
+        detail::populate_system(s, model.get_lattice(), shape, num_threads, max_tile_sites);
+        return s;
+    };
+    auto const build_expected = [](Lattice const& lattice, Shape const& shape) {
+        auto const model = Model(lattice);
+        auto s = System(model.get_site_registry(), model.get_hopping_registry());
+        detail::populate_system(s, Foundation(model.get_lattice(), shape));
+        return s;
+    };
+    auto const compare = [](System const& s, System const& expected) {
+        REQUIRE(s.num_sites() == expected.num_sites());
+        REQUIRE((s.positions.x == expected.positions.x).all());
+        REQUIRE((s.positions.y == expected.positions.y).all());
+        REQUIRE((s.positions.z == expected.positions.z).all());
+
+        auto const& cs = s.compressed_sublattices;
+        auto const& cs_expected = expected.compressed_sublattices;
+        REQUIRE((cs.alias_ids() == cs_expected.alias_ids()).all());
+        REQUIRE((cs.site_counts() == cs_expected.site_counts()).all());
+
+        auto const blocks = s.hopping_blocks.get_serialized_blocks();
+        auto const blocks_expected = expected.hopping_blocks.get_serialized_blocks();
+        REQUIRE(blocks.size() == blocks_expected.size());
+        for (auto i = size_t{0}; i < blocks.size(); ++i) {
+            REQUIRE((blocks[i].first == blocks_expected[i].first).all());
+            REQUIRE((blocks[i].second == blocks_expected[i].second).all());
+        }
+    };
+
+    SECTION("Polygon with dangling sites") {
+        auto const lattice = graphene::monolayer().with_min_neighbors(2);
+        auto const ribbon = Polygon({{0, 0, 0}, {1, 0, 0}, {21, 20, 0}, {20, 20, 0}});
+        auto const expected = build_expected(lattice, ribbon);
+        REQUIRE(expected.num_sites() > 0);
+        compare(build(lattice, ribbon, 1, 1 << 16), expected);
+        compare(build(lattice, ribbon, 1, 100), expected);
+        compare(build(lattice, ribbon, 4, 100), expected);
+    }
+
+    SECTION("Freeform ring") {
+        auto const ring = FreeformShape([](CartesianArrayConstRef p) -> ArrayX<bool> {
+            auto const r2 = (p.x().square() + p.y().square()).eval();
+            return (r2 < 25.f) && (r2 > 16.f);
+        }, {11, 11, 0});
+        auto const lattice = lattice::square_multiorbital();
+        auto const expected = build_expected(lattice, ring);
+        compare(build(lattice, ring, 1, 1 << 16), expected);
+        compare(build(lattice, ring, 3, 7), expected);
+    }
+}
+
+TEST_CASE("SpatialIndex") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(3, 2));
+    auto const& system = *model.system();
+    auto const range = system.sublattice_range("B");
+
+    auto const brute_force_distances = [&](Cartesian target) {
+        auto d = std::vector<std::pair<float, idx_t>>();
+        for (auto i = range.start; i < range.end; ++i) {
+            d.emplace_back((system.positions[i] - target).squaredNorm(), i);
+        }
+        std::sort(d.begin(), d.end());
+        return d;
+    };
+
+    auto targets = CartesianArray(50);
+    for (auto n = 0; n < targets.size(); ++n) {
+        // A few of the targets are outside of the system
+        targets[n] = Cartesian{-2.f + 0.083f * n, 1.5f - 0.061f * n, 0.01f * (n % 3)};
+    }
+
+    SECTION("Nearest") {
+        auto const nearest = system.find_nearest(targets, "B");
+        for (auto n = 0; n < targets.size(); ++n) {
+            auto const expected = brute_force_distances(targets[n]).front().second;
+            REQUIRE(system.find_nearest(targets[n], "B") == expected);
+            REQUIRE(nearest[n] == expected);
+        }
+    }
+
+    SECTION("k nearest") {
+        auto const index = system.spatial_index("B");
+        for (auto n = 0; n < targets.size(); ++n) {
+            auto const d = brute_force_distances(targets[n]);
+            auto const result = index->find_k_nearest(targets[n], 7);
+            REQUIRE(result.size() == 7);
+            for (auto k = size_t{0}; k < result.size(); ++k) {
+                REQUIRE(result[k] == d[k].second);
+            }
+        }
+    }
+
+    SECTION("Box and shape") {
+        auto const index = system.spatial_index();
+        auto const box = index->find_in_box({-0.5f, -0.3f, -1}, {0.7f, 0.4f, 1});
+        auto const circle = index->find_in_shape(FreeformShape([](CartesianArrayConstRef p) {
+            return ArrayX<bool>(p.x().square() + p.y().square() < 0.36f);
+        }, {1.2f, 1.2f, 0}));
+
+        auto expected_box = std::vector<idx_t>();
+        auto expected_circle = std::vector<idx_t>();
+        for (auto i = idx_t{0}; i < system.num_sites(); ++i) {
+            Cartesian const p = system.positions[i];
+            if (p.x() >= -0.5f && p.x() <= 0.7f && p.y() >= -0.3f && p.y() <= 0.4f) {
+                expected_box.push_back(i);
+            }
+            if (p.x() * p.x() + p.y() * p.y() < 0.36f) { expected_circle.push_back(i); }
+        }
+        REQUIRE(box == expected_box);
+        REQUIRE(circle == expected_circle);
+    }
+
+    SECTION("Reset after the positions change") {
+        auto s = system;
+        auto const i = s.find_nearest({0, 0, 0});
+        s.positions[i] = Cartesian{10, 10, 0};
+        s.reset_spatial_index();
+        REQUIRE(s.find_nearest({10, 10, 0}) == i);
+    }
+}
+
+TEST_CASE("Point symmetry") {
+    // A 5x5 square grid centered on the origin: the symmetry group is D4
+    auto const count_orbits = [](Model const& model) {
+        auto const& system = *model.system();
+        auto permutations = std::vector<ArrayXi>();
+        for (auto const& op : planar_point_operations({0, 0, 0})) {
+            auto const p = site_permutation(system, op);
+            if (p.size() != 0 && is_invariant(model.hamiltonian(),
+                                              hamiltonian_permutation(system, p))) {
+                permutations.push_back(p);
+            }
+        }
+        auto const representative = orbit_representatives(system.num_sites(), permutations);
+        auto count = idx_t{0};
+        for (auto i = idx_t{0}; i < representative.size(); ++i) {
+            REQUIRE(representative[i] <= i);
+            REQUIRE(representative[representative[i]] == representative[i]);
+            if (representative[i] == i) { ++count; }
+        }
+        return std::make_pair(static_cast<idx_t>(permutations.size()), count);
+    };
+
+    auto const model = Model(lattice::square(), shape::rectangle(4.5f, 4.5f));
+    REQUIRE(model.system()->num_sites() == 25);
+    auto const& system = *model.system();
+    auto const ops = planar_point_operations({0, 0, 0});
+    REQUIRE(ops.size() == 6);
+    REQUIRE(site_permutation(system, ops[0]).size() == 0); // no 60 degree rotation
+    auto const c4 = site_permutation(system, ops[1]);
+    REQUIRE(c4.size() == 25);
+    REQUIRE(system.positions[c4[system.find_nearest({2, 1, 0})]].isApprox(Cartesian{-1, 2, 0}));
+
+    // 90 and 180 degree rotations and two mirrors: 6 orbits
+    REQUIRE(count_orbits(model) == std::make_pair(idx_t{4}, idx_t{6}));
+
+    // The potential `x` only keeps the `y -> -y` mirror
+    auto const broken = Model(lattice::square(), shape::rectangle(4.5f, 4.5f),
+                              field::linear_onsite());
+    REQUIRE(count_orbits(broken) == std::make_pair(idx_t{1}, idx_t{15}));
+}
+
+TEST_CASE("Binary file") {
+    auto const model = Model(graphene::monolayer(), Primitive(6, 4),
+                             TranslationalSymmetry(1, -1), field::constant_potential(0.5));
+    auto const& system = *model.system();
+    auto const filename = std::string("test_system_binary.pbbin");
+
+    auto const compare_blocks = [](HoppingBlocks const& a, HoppingBlocks const& b) {
+        REQUIRE(a.get_num_sites() == b.get_num_sites());
+        auto const blocks = a.get_serialized_blocks();
+        auto const blocks_expected = b.get_serialized_blocks();
+        REQUIRE(blocks.size() == blocks_expected.size());
+        for (auto i = size_t{0}; i < blocks.size(); ++i) {
+            REQUIRE((blocks[i].first == blocks_expected[i].first).all());
+            REQUIRE((blocks[i].second == blocks_expected[i].second).all());
+        }
+    };
+
+    SECTION("System and Hamiltonian") {
+        binary::save(filename, system, model.hamiltonian());
+        auto const contents = binary::load(filename);
+        std::remove(filename.c_str());
+
+        auto const& s = *contents.system;
+        REQUIRE(s.site_registry.get_names() == system.site_registry.get_names());
+        REQUIRE(s.hopping_registry.get_names() == system.hopping_registry.get_names());
+        REQUIRE(s.hopping_registry.energy(HopID{0}).isApprox(
+            system.hopping_registry.energy(HopID{0})));
+        REQUIRE((s.positions.x == system.positions.x).all());
+        REQUIRE((s.positions.y == system.positions.y).all());
+        REQUIRE((s.positions.z == system.positions.z).all());
+        REQUIRE((s.compressed_sublattices.alias_ids()
+                 == system.compressed_sublattices.alias_ids()).all());
+        REQUIRE((s.compressed_sublattices.site_counts()
+                 == system.compressed_sublattices.site_counts()).all());
+        compare_blocks(s.hopping_blocks, system.hopping_blocks);
+
+        REQUIRE(s.boundaries.size() == system.boundaries.size());
+        for (auto n = size_t{0}; n < s.boundaries.size(); ++n) {
+            REQUIRE(s.boundaries[n].shift == system.boundaries[n].shift);
+            compare_blocks(s.boundaries[n].hopping_blocks, system.boundaries[n].hopping_blocks);
+        }
+
+        auto const& h = contents.hamiltonian;
+        auto const& h_expected = model.hamiltonian();
+        REQUIRE(ham::is<std::complex<float>>(h)); // periodic
+        REQUIRE(h.non_zeros() == h_expected.non_zeros());
+        auto const& m = ham::get_reference<std::complex<float>>(h);
+        auto const& m_expected = ham::get_reference<std::complex<float>>(h_expected);
+        REQUIRE(m.isApprox(m_expected));
+    }
+
+    SECTION("System only") {
+        binary::save(filename, system);
+        auto const contents = binary::load(filename);
+        std::remove(filename.c_str());
+        REQUIRE(contents.system->num_sites() == system.num_sites());
+        REQUIRE_FALSE(contents.hamiltonian);
+    }
+
+    SECTION("Invalid file") {
+        std::ofstream(filename) << "not a binary container";
+        REQUIRE_THROWS_WITH(binary::load(filename), Catch::Contains("not a valid"));
+        std::remove(filename.c_str());
+    }
+}
+
+TEST_CASE("System cache") {
+    auto const make_model = [](int size) {
+        auto model = Model(graphene::monolayer(), Primitive(size, 4),
+                           TranslationalSymmetry(1, -1));
+        model.set_system_cache(".");
+        return model;
+    };
+
+    auto const model = make_model(6);
+    REQUIRE(model.structure_hash() == make_model(6).structure_hash());
+    REQUIRE(model.structure_hash() != make_model(5).structure_hash());
+
+    auto keyed = make_model(6);
+    keyed.set_system_cache(".", "v2");
+    REQUIRE(keyed.structure_hash() != model.structure_hash());
+
+    auto const filename = fmt::format("./{:016x}.pbbin", model.structure_hash());
+    std::remove(filename.c_str());
+
+    SECTION("Miss and hit") {
+        auto const& built = *model.system();
+        REQUIRE(std::ifstream(filename).good());
+
+        auto const& cached = *make_model(6).system();
+        REQUIRE(cached.num_sites() == built.num_sites());
+        REQUIRE((cached.positions.x == built.positions.x).all());
+        REQUIRE(cached.hopping_blocks.nnz() == built.hopping_blocks.nnz());
+        REQUIRE(cached.boundaries.size() == built.boundaries.size());
+    }
+
+    SECTION("Corrupt entry is rebuilt") {
+        std::ofstream(filename) << "not a binary container";
+        auto const& system = *model.system();
+        REQUIRE(system.num_sites() == 48);
+        REQUIRE_NOTHROW(binary::load(filename));
+    }
+
+    std::remove(filename.c_str());
+}
+
+TEST_CASE("Memory accounting") {
+    auto const model = Model(graphene::monolayer(), Primitive(20, 20));
+    auto const estimate = model.estimate_memory();
+    REQUIRE(estimate.num_sites == 800);
+    REQUIRE(estimate.hamiltonian_size == 800);
+    REQUIRE(estimate.scalar_size == sizeof(float));
+    REQUIRE(estimate.peak() >= estimate.system + estimate.hamiltonian);
+
+    auto const& system = *model.system();
+    auto const& h = model.hamiltonian();
+    REQUIRE(system.memory_usage() >= 800 * (3 * sizeof(float) + sizeof(bool)));
+    REQUIRE(model.system_memory_usage().size == system.memory_usage());
+    REQUIRE(model.foundation_memory_usage().size > 0);
+
+    auto const nnz = static_cast<size_t>(h.non_zeros());
+    REQUIRE(h.memory_usage() == nnz * 2 * sizeof(float) + 801 * sizeof(storage_idx_t));
+    REQUIRE(model.hamiltonian_memory_usage().size == h.memory_usage());
+    REQUIRE(estimate.hamiltonian_nnz >= h.non_zeros());
+    REQUIRE(estimate.hamiltonian >= h.memory_usage());
+    REQUIRE(model.report().find("Memory: foundation") != std::string::npos);
+
+    auto const multiorbital = Model(lattice::square_multiorbital(), Primitive(4, 4));
+    auto const multiorbital_estimate = multiorbital.estimate_memory();
+    REQUIRE(multiorbital_estimate.hamiltonian_size == multiorbital.hamiltonian().rows());
+    REQUIRE(multiorbital_estimate.hamiltonian_nnz >= multiorbital.hamiltonian().non_zeros());
+}
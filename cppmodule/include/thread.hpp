@@ -2,6 +2,8 @@
 #include <pybind11/pybind11.h>
 #include "detail/thread.hpp"
 
+#include <utility>
+
 namespace py = pybind11;
 
 namespace cpb {
@@ -30,14 +32,35 @@ public:
         is_computed = true;
     }
 
-    py::object result() final { compute(); return py::cast(_result); }
+    /// The result is moved into its Python object on first access, e.g. an Eigen array becomes
+    /// a NumPy array which owns the same buffer: it's never copied
+    py::object result() final {
+        compute();
+        if (!_py_result) { _py_result = py::cast(std::move(_result)); }
+        return _py_result;
+    }
 
 private:
     py::object _solver;
     std::function<Result()> _compute;
     Result _result;
+    py::object _py_result;
 
     bool is_computed = false;
 };
 
+/**
+ Deferred calculation `f(solver)` for the C++ solver of type `T` held by the Python `self`
+
+ The model is evaluated right away because its modifiers may call into Python. After that,
+ `compute()` doesn't touch any Python objects so it can run without the GIL, e.g. on the worker
+ threads of `parallel_for()` while the next models are being built in Python.
+ */
+template<class T, class F>
+auto make_deferred(py::object self, F f) -> Deferred<decltype(f(std::declval<T&>()))> {
+    auto& solver = self.cast<T&>();
+    solver.get_model().eval();
+    return {std::move(self), [f, &solver] { return f(solver); }};
+}
+
 } // namespace cpb
@@ -14,6 +14,35 @@ using namespace py::literals;
 
 using release_gil = py::call_guard<py::gil_scoped_release>;
 
+namespace cpb { class Hamiltonian; }
+
+/// Stack equally shaped dense results into a single C-contiguous array with `shape == (n,) +
+/// element shape`. Returning a list of arrays which is stacked by `np.array()` in Python would
+/// briefly hold two copies: here, each element is freed right after it's copied.
+template<class T>
+py::array stack_results(std::vector<T>&& results) {
+    using Scalar = typename T::Scalar;
+    using RowMajor = Eigen::Array<Scalar, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+    auto const rows = results.empty() ? 0 : results.front().rows();
+    auto const cols = results.empty() ? 0 : results.front().cols();
+
+    auto shape = std::vector<py::ssize_t>{static_cast<py::ssize_t>(results.size()), rows};
+    if (T::ColsAtCompileTime != 1) { shape.push_back(cols); }
+    auto stacked = py::array_t<Scalar>(shape);
+
+    auto data = stacked.mutable_data();
+    for (auto& r : results) {
+        Eigen::Map<RowMajor>(data, rows, cols) = r.array();
+        data += rows * cols;
+        r = T();
+    }
+    return std::move(stacked);
+}
+
+/// The `scipy.sparse.csr_matrix` view of the Hamiltonian: its arrays keep the matrix alive
+/// without a copy. It's made once and then cached until the Hamiltonian is reset.
+py::object csr_view(cpb::Hamiltonian const& h);
+
 void wrap_greens(py::module& m);
 void wrap_lattice(py::module& m);
 void wrap_leads(py::module& m);
@@ -1,28 +1,87 @@
 #include "KPM.hpp"
+#include "BinaryFile.hpp"
+#ifdef CPB_USE_CUDA
+# include "kpm/cuda/Compute.hpp"
+#endif
+#ifdef CPB_USE_MKL
+# include "kpm/mkl/Compute.hpp"
+#endif
+#ifdef CPB_USE_MPI
+# include "kpm/distributed/MpiCommunicator.hpp"
+#endif
 #include "wrappers.hpp"
 #include "thread.hpp"
 using namespace cpb;
 
 namespace {
 
+#ifdef CPB_USE_MPI
+/// The default compute on each process of `MPI_COMM_WORLD`
+struct MpiCompute : kpm::DistributedCompute {
+    using ProgressCallback = kpm::DefaultCompute::ProgressCallback;
+
+    MpiCompute(idx_t num_threads, ProgressCallback progress_callback)
+        : kpm::DistributedCompute(kpm::DefaultCompute(num_threads, progress_callback),
+                                  std::make_shared<kpm::MpiCommunicator>()) {}
+};
+#endif
+
+template<class Compute>
 void wrap_kpm_strategy(py::module& m, char const* name) {
     auto const kpm_defaults = kpm::Config();
     m.def(
         name,
         [](Model const& model, std::pair<float, float> energy, kpm::Kernel const& kernel,
-           std::string matrix_format, bool optimal_size, bool interleaved, float lanczos,
-           idx_t num_threads, kpm::DefaultCompute::ProgressCallback progress_callback) {
+           std::string matrix_format, bool optimal_size, bool interleaved,
+           bool product_identity, idx_t matrix_powers, bool lanczos_greens,
+           float convergence_tolerance, bool deterministic, float lanczos,
+           float lanczos_coarse, std::string bounds_mode, float bounds_padding,
+           bool fast_reconstruction,
+           idx_t conductivity_block_size, idx_t ldos_chunk_size, bool mixed_precision,
+           idx_t moment_cache_size,
+           idx_t reorder_cache_size, bool counter_based_random, bool auto_tune,
+           std::string tuning_cache_file, idx_t num_threads,
+           typename Compute::ProgressCallback progress_callback) {
             kpm::Config config;
             config.min_energy = energy.first;
             config.max_energy = energy.second;
             config.kernel = kernel;
-            config.matrix_format = matrix_format == "ELL" ? kpm::MatrixFormat::ELL
-                                                          : kpm::MatrixFormat::CSR;
+            config.matrix_format = matrix_format == "ELL"       ? kpm::MatrixFormat::ELL
+                                 : matrix_format == "SELL"      ? kpm::MatrixFormat::SELL
+                                 : matrix_format == "STENCIL"   ? kpm::MatrixFormat::STENCIL
+                                 : matrix_format == "BSR"       ? kpm::MatrixFormat::BSR
+                                 : matrix_format == "HERMITIAN" ? kpm::MatrixFormat::HERMITIAN
+                                 : matrix_format == "ELL_TABLE" ? kpm::MatrixFormat::ELL_TABLE
+                                 : matrix_format == "ELL_DELTA" ? kpm::MatrixFormat::ELL_DELTA
+                                 : matrix_format == "HYB"       ? kpm::MatrixFormat::HYB
+                                 : matrix_format == "ELL_SPLIT" ? kpm::MatrixFormat::ELL_SPLIT
+                                 : matrix_format == "ELL_BF16"  ? kpm::MatrixFormat::ELL_BF16
+                                 : matrix_format == "ELL_INT8"  ? kpm::MatrixFormat::ELL_INT8
+                                                                : kpm::MatrixFormat::CSR;
             config.algorithm.optimal_size = optimal_size;
             config.algorithm.interleaved = interleaved;
+            config.algorithm.product_identity = product_identity;
+            config.algorithm.matrix_powers = matrix_powers;
+            config.algorithm.lanczos_greens = lanczos_greens;
+            config.algorithm.convergence_tolerance = convergence_tolerance;
+            config.algorithm.deterministic = deterministic;
             config.lanczos_precision = lanczos;
+            config.lanczos_coarse_precision = lanczos_coarse;
+            config.bounds_mode = bounds_mode == "gershgorin" ? kpm::BoundsMode::Gershgorin
+                               : bounds_mode == "warm"       ? kpm::BoundsMode::Warm
+                                                             : kpm::BoundsMode::Lanczos;
+            config.bounds_padding = bounds_padding;
+            config.fast_reconstruction = fast_reconstruction;
+            config.conductivity_block_size = conductivity_block_size;
+            config.ldos_chunk_size = ldos_chunk_size;
+            config.mixed_precision = mixed_precision;
+            config.moment_cache_size = moment_cache_size;
+            config.reorder_cache_size = reorder_cache_size;
+            config.counter_based_random = counter_based_random;
+            config.auto_tune = auto_tune;
+            config.tuning_cache_file = tuning_cache_file;
 
-            return KPM(model, kpm::DefaultCompute(num_threads, progress_callback), config);
+            return KPM(model, Compute(num_threads, progress_callback), config);
         },
         "model"_a,
         "energy_range"_a=py::make_tuple(kpm_defaults.min_energy, kpm_defaults.max_energy),
@@ -30,12 +89,33 @@ void wrap_kpm_strategy(py::module& m, char const* name) {
         "matrix_format"_a="ELL",
         "optimal_size"_a=true,
         "interleaved"_a=true,
+        "product_identity"_a=kpm_defaults.algorithm.product_identity,
+        "matrix_powers"_a=kpm_defaults.algorithm.matrix_powers,
+        "lanczos_greens"_a=kpm_defaults.algorithm.lanczos_greens,
+        "convergence_tolerance"_a=kpm_defaults.algorithm.convergence_tolerance,
+        "deterministic"_a=kpm_defaults.algorithm.deterministic,
         "lanczos_precision"_a=kpm_defaults.lanczos_precision,
-        "num_threads"_a=std::thread::hardware_concurrency(),
+        "lanczos_coarse_precision"_a=kpm_defaults.lanczos_coarse_precision,
+        "bounds_mode"_a="lanczos",
+        "bounds_padding"_a=kpm_defaults.bounds_padding,
+        "fast_reconstruction"_a=kpm_defaults.fast_reconstruction,
+        "conductivity_block_size"_a=kpm_defaults.conductivity_block_size,
+        "ldos_chunk_size"_a=kpm_defaults.ldos_chunk_size,
+        "mixed_precision"_a=kpm_defaults.mixed_precision,
+        "moment_cache_size"_a=kpm_defaults.moment_cache_size,
+        "reorder_cache_size"_a=kpm_defaults.reorder_cache_size,
+        "counter_based_random"_a=kpm_defaults.counter_based_random,
+        "auto_tune"_a=kpm_defaults.auto_tune,
+        "tuning_cache_file"_a=kpm_defaults.tuning_cache_file,
+        "num_threads"_a=-1,
         "progress_callback"_a=py::none()
     );
 }
 
+py::dict progress_dict(kpm::ComputeProgress const& p) {
+    return py::dict("done"_a=p.done, "total"_a=p.total, "running"_a=p.running);
+}
+
 struct ReturnMatrix {
     template<class T>
     ComplexCsrConstRef operator()(T) const { throw std::runtime_error("This will never happen"); }
@@ -54,8 +134,16 @@ void wrap_greens(py::module& m) {
         .def_readonly("opt_nnz", &kpm::Stats::opt_nnz)
         .def_readonly("vec", &kpm::Stats::vec)
         .def_readonly("opt_vec", &kpm::Stats::opt_vec)
+        .def_readonly("matrix_format", &kpm::Stats::matrix_format)
+        .def_readonly("padding", &kpm::Stats::padding)
         .def_readonly("matrix_memory", &kpm::Stats::matrix_memory)
         .def_readonly("vector_memory", &kpm::Stats::vector_memory)
+        .def_readonly("hamiltonian_memory", &kpm::Stats::hamiltonian_memory)
+        .def_readonly("moments_memory", &kpm::Stats::moments_memory)
+        .def_readonly("peak_memory", &kpm::Stats::peak_memory)
+        .def_readonly("num_random", &kpm::Stats::num_random)
+        .def_readonly("stochastic_error", &kpm::Stats::stochastic_error)
+        .def_readonly("skipped_moments", &kpm::Stats::skipped_moments)
         .def_property_readonly("eps", &kpm::Stats::eps)
         .def_property_readonly("ops", &kpm::Stats::ops)
         .def_property_readonly("hamiltonian_time", [](kpm::Stats const& s) {
@@ -63,45 +151,371 @@ void wrap_greens(py::module& m) {
         })
         .def_property_readonly("moments_time", [](kpm::Stats const& s) {
             return s.moments_timer.elapsed_seconds();
+        })
+        .def_property_readonly("reconstruct_time", [](kpm::Stats const& s) {
+            return s.reconstruct_timer.elapsed_seconds();
+        })
+        .def_property_readonly("bytes_per_iteration", &kpm::Stats::bytes_per_iteration)
+        .def_property_readonly("bandwidth", &kpm::Stats::bandwidth)
+        .def_property_readonly("thread_balance", &kpm::Stats::thread_balance)
+        .def("as_dict", [](kpm::Stats const& s) {
+            auto const& p = s.profile;
+            auto const time = py::dict(
+                "bounds"_a=s.bounds_timer.elapsed_seconds(),
+                "hamiltonian"_a=s.hamiltonian_timer.elapsed_seconds(),
+                "reorder"_a=s.reorder_timer.elapsed_seconds(),
+                "convert"_a=s.convert_timer.elapsed_seconds(),
+                "moments"_a=s.moments_timer.elapsed_seconds(),
+                "starter"_a=p.starter_time, "spmv"_a=p.spmv_time, "collect"_a=p.collect_time,
+                "reconstruct"_a=s.reconstruct_timer.elapsed_seconds()
+            );
+            return py::dict(
+                "num_moments"_a=s.num_moments, "uses_full_system"_a=s.uses_full_system,
+                "from_cache"_a=s.from_cache, "nnz"_a=s.nnz, "opt_nnz"_a=s.opt_nnz,
+                "vec"_a=s.vec, "opt_vec"_a=s.opt_vec, "matrix_format"_a=s.matrix_format,
+                "padding"_a=s.padding, "matrix_memory"_a=s.matrix_memory,
+                "vector_memory"_a=s.vector_memory, "hamiltonian_memory"_a=s.hamiltonian_memory,
+                "moments_memory"_a=s.moments_memory, "peak_memory"_a=s.peak_memory,
+                "num_random"_a=s.num_random,
+                "stochastic_error"_a=s.stochastic_error, "skipped_moments"_a=s.skipped_moments,
+                "eps"_a=s.eps(),
+                "bytes_per_iteration"_a=s.bytes_per_iteration(), "bandwidth"_a=s.bandwidth(),
+                "thread_busy_time"_a=p.thread_busy_time, "thread_balance"_a=s.thread_balance(),
+                "time"_a=time
+            );
         });
 
     py::class_<kpm::Kernel>(m, "KPMKernel")
         .def_readonly("damping_coefficients", &kpm::Kernel::damping_coefficients)
         .def_readonly("required_num_moments", &kpm::Kernel::required_num_moments);
 
+    m.def("kpm_estimate_memory", [](Model const& model, idx_t num_moments, idx_t num_results,
+                                    bool dense, idx_t num_threads) {
+        auto const e = kpm::estimate_memory(model, num_moments, num_results, dense, num_threads);
+        return py::dict("model"_a=e.model.peak(), "matrix"_a=e.matrix, "vectors"_a=e.vectors,
+                        "moments"_a=e.moments, "peak"_a=e.peak());
+    }, "model"_a, "num_moments"_a, "num_results"_a=1, "dense"_a=false, "num_threads"_a=-1);
+
     m.def("lorentz_kernel", &kpm::lorentz_kernel);
     m.def("jackson_kernel", &kpm::jackson_kernel);
     m.def("dirichlet_kernel", &kpm::dirichlet_kernel);
 
+    py::class_<kpm::ExpansionMoments>(m, "KPMMoments")
+        .def("__init__", [](kpm::ExpansionMoments& self, ArrayXXcd data, double a, double b) {
+            auto scale = kpm::Scale<>();
+            scale.a = a;
+            scale.b = b;
+            new (&self) kpm::ExpansionMoments(scale, std::move(data));
+        }, "data"_a, "a"_a, "b"_a)
+        .def_readonly("data", &kpm::ExpansionMoments::data)
+        .def_property_readonly("scaling_factors", [](kpm::ExpansionMoments const& self) {
+            return py::make_tuple(self.scale.a, self.scale.b);
+        })
+        .def_property_readonly("num_moments", &kpm::ExpansionMoments::num_moments)
+        .def("truncated", static_cast<kpm::ExpansionMoments (kpm::ExpansionMoments::*)(idx_t)
+                                      const>(&kpm::ExpansionMoments::truncated))
+        .def("truncated", static_cast<kpm::ExpansionMoments (kpm::ExpansionMoments::*)(
+                 kpm::Kernel const&, double) const>(&kpm::ExpansionMoments::truncated))
+        .def("spectral_density", &kpm::ExpansionMoments::spectral_density,
+             "energy"_a, "kernel"_a, "broadening"_a=0.0, release_gil())
+        .def("greens", [](kpm::ExpansionMoments const& self, ArrayXd const& energy,
+                          kpm::Kernel const& kernel, double broadening) {
+            auto result = [&]{
+                py::gil_scoped_release release;
+                return self.greens(energy, kernel, broadening);
+            }();
+            return stack_results(std::move(result));
+        }, "energy"_a, "kernel"_a, "broadening"_a=0.0)
+        .def("__getstate__", [](kpm::ExpansionMoments const& self) {
+            return py::make_tuple(self.data, self.scale.a, self.scale.b);
+        })
+        .def("__setstate__", [](kpm::ExpansionMoments& self, py::tuple t) {
+            auto scale = kpm::Scale<>();
+            scale.a = t[1].cast<double>();
+            scale.b = t[2].cast<double>();
+            new (&self) kpm::ExpansionMoments(scale, t[0].cast<ArrayXXcd>());
+        });
+
+    using State = kpm::Checkpoint::State;
+    py::class_<kpm::Checkpoint>(m, "KPMCheckpoint")
+        .def(py::init<>())
+        .def_readonly("num_moments", &kpm::Checkpoint::num_moments)
+        .def_readonly("num_vectors", &kpm::Checkpoint::num_vectors)
+        .def_property_readonly("memory_usage", &kpm::Checkpoint::memory_usage)
+        .def("__getstate__", [](kpm::Checkpoint const& c) {
+            auto states = py::list();
+            for (auto const& s : c.states) {
+                states.append(py::make_tuple(s.index, s.r0, s.r1, s.m0, s.m1));
+            }
+            return py::dict("src"_a=c.idx.src, "dest"_a=c.idx.dest, "a"_a=c.scale.a,
+                            "b"_a=c.scale.b, "num_moments"_a=c.num_moments,
+                            "num_vectors"_a=c.num_vectors, "map"_a=c.map, "states"_a=states);
+        })
+        .def("__setstate__", [](kpm::Checkpoint& c, py::dict d) {
+            new (&c) kpm::Checkpoint();
+            c.idx = {d["src"].cast<ArrayXi>(), d["dest"].cast<ArrayXi>()};
+            c.scale.a = d["a"].cast<double>();
+            c.scale.b = d["b"].cast<double>();
+            c.num_moments = d["num_moments"].cast<idx_t>();
+            c.num_vectors = d["num_vectors"].cast<idx_t>();
+            c.map = d["map"].cast<std::vector<storage_idx_t>>();
+            for (auto const& item : d["states"].cast<py::list>()) {
+                auto const t = item.cast<py::tuple>();
+                c.states.push_back(State{t[0].cast<idx_t>(), t[1].cast<var::complex<MatrixX>>(),
+                                         t[2].cast<var::complex<MatrixX>>(),
+                                         t[3].cast<var::complex<ArrayX>>(),
+                                         t[4].cast<var::complex<ArrayX>>()});
+            }
+        });
+
     py::class_<KPM>(m, "KPM")
-        .def("moments", &KPM::moments)
+        .def("moments", &KPM::moments, release_gil())
+        .def("batch_moments", &KPM::batch_moments, release_gil())
         .def("calc_greens", &KPM::calc_greens, release_gil())
-        .def("calc_greens", &KPM::calc_greens_vector, release_gil())
-        .def("calc_dos", &KPM::calc_dos, release_gil())
-        .def("calc_conductivity", &KPM::calc_conductivity, release_gil())
+        .def("calc_greens", [](KPM const& kpm, idx_t row, std::vector<idx_t> const& cols,
+                               ArrayXd const& energy, double broadening) {
+            auto result = [&]{
+                py::gil_scoped_release release;
+                return kpm.calc_greens_vector(row, cols, energy, broadening);
+            }();
+            return stack_results(std::move(result));
+        })
+        .def("calc_greens_block", [](KPM const& kpm, std::vector<idx_t> const& rows,
+                                     std::vector<idx_t> const& cols, ArrayXd const& energy,
+                                     double broadening) {
+            auto result = [&]{
+                py::gil_scoped_release release;
+                return kpm.calc_greens_block(rows, cols, energy, broadening);
+            }();
+            return stack_results(std::move(result));
+        })
+        .def("calc_dos", &KPM::calc_dos, "energy"_a, "broadening"_a, "num_random"_a,
+             "target_error"_a=0.0, release_gil())
+        .def("calc_dos_k", &KPM::calc_dos_k, "energy"_a, "broadening"_a, "k_points"_a,
+             "num_random"_a, release_gil())
+        .def("calc_projected_dos", &KPM::calc_projected_dos, "energy"_a, "broadening"_a,
+             "masks"_a, "num_random"_a, release_gil())
+        .def("calc_sublattice_dos", [](KPM const& kpm, ArrayXd const& energy,
+                                       double broadening, idx_t num_random, bool orbitals) {
+            auto result = [&]{
+                py::gil_scoped_release release;
+                return kpm.calc_sublattice_dos(energy, broadening, num_random, orbitals);
+            }();
+            return py::make_tuple(std::move(result.names), std::move(result.data));
+        }, "energy"_a, "broadening"_a, "num_random"_a, "orbitals"_a=false)
+        .def("calc_conductivity",
+             static_cast<ArrayXd (KPM::*)(ArrayXd const&, double, double, string_view, idx_t,
+                                          idx_t) const>(&KPM::calc_conductivity),
+             release_gil())
+        .def("calc_conductivity",
+             static_cast<std::vector<ArrayXd> (KPM::*)(ArrayXd const&, double, double,
+                                                       std::vector<std::string> const&, idx_t,
+                                                       idx_t) const>(&KPM::calc_conductivity),
+             release_gil())
+        .def("calc_spectral_function", &KPM::calc_spectral_function, "k_points"_a, "energy"_a,
+             "broadening"_a, release_gil())
+        .def("calc_kubo_greenwood", &KPM::calc_kubo_greenwood, "chemical_potential"_a,
+             "broadening"_a, "direction"_a, "num_random"_a, release_gil())
         .def("calc_ldos", &KPM::calc_ldos, release_gil())
+        .def("calc_ldos_moments", &KPM::calc_ldos_moments, "broadening"_a, "position"_a,
+             "sublattice"_a="", "checkpoint"_a=nullptr, release_gil())
+        .def("calc_dos_moments", &KPM::calc_dos_moments, "broadening"_a, "num_random"_a,
+             "target_error"_a=0.0, "checkpoint"_a=nullptr, release_gil())
+        .def("extend_moments", &KPM::extend_moments, release_gil())
+        .def("quantization_error", [](KPM const& kpm, double broadening, idx_t num_random) {
+            auto const e = [&]{
+                py::gil_scoped_release release;
+                return kpm.quantization_error(broadening, num_random);
+            }();
+            return py::dict("matrix_format"_a=e.matrix_format, "max_error"_a=e.max_error,
+                            "rms_error"_a=e.rms_error, "num_moments"_a=e.num_moments,
+                            "num_random"_a=e.num_random);
+        }, "broadening"_a, "num_random"_a=1)
+        .def("ensemble_dos_moments", [](KPM const& kpm, py::object factory,
+                                        idx_t num_realizations, double broadening,
+                                        idx_t num_random, double bounds_margin) {
+            // Called on the build thread of the ensemble which doesn't hold the GIL
+            auto const make = kpm::ModelFactory([factory](idx_t n) {
+                py::gil_scoped_acquire guard{};
+                return factory(n).cast<Model>();
+            });
+            py::gil_scoped_release release;
+            return kpm.ensemble_dos_moments(make, num_realizations, broadening, num_random,
+                                            bounds_margin);
+        }, "factory"_a, "num_realizations"_a, "broadening"_a, "num_random"_a,
+           "bounds_margin"_a=0.05)
+        .def("calc_greens_moments", &KPM::calc_greens_moments, release_gil())
         .def("calc_spatial_ldos", &KPM::calc_spatial_ldos, release_gil())
+        .def("calc_symmetric_spatial_ldos", &KPM::calc_symmetric_spatial_ldos, "energy"_a,
+             "broadening"_a, "shape"_a, "operations"_a, "sublattice"_a="", release_gil())
+        .def("calc_compact_spatial_ldos", [](KPM const& kpm, ArrayXd const& energy,
+                                             double broadening, Shape const& shape,
+                                             std::string const& precision,
+                                             std::string const& sublattice, idx_t num_random) {
+            if (precision != "single" && precision != "fixed16") {
+                throw std::invalid_argument("The map precision must be 'single' or 'fixed16'");
+            }
+            auto const p = precision == "single" ? kpm::MapPrecision::Single
+                                                 : kpm::MapPrecision::Fixed16;
+            auto result = [&]{
+                py::gil_scoped_release release;
+                return kpm.calc_compact_spatial_ldos(energy, broadening, shape, p, sublattice,
+                                                     num_random);
+            }();
+            // The values and the per-site scales (only for the fixed point values)
+            if (result.precision == kpm::MapPrecision::Single) {
+                return py::make_tuple(std::move(result.single), py::none());
+            }
+            return py::make_tuple(std::move(result.fixed), std::move(result.scales));
+        })
+        .def("calc_probing_ldos", &KPM::calc_probing_ldos, "energy"_a, "broadening"_a,
+             "distance"_a=4, release_gil())
+        .def("calc_local_charge", &KPM::calc_local_charge, "chemical_potential"_a,
+             "temperature"_a, "broadening"_a, "num_random"_a=0, release_gil())
+        .def("propagate", [](KPM const& kpm, MatrixXcd const& psi0, ArrayXd const& times) {
+            auto result = [&]{
+                py::gil_scoped_release release;
+                return kpm.propagate(psi0, times);
+            }();
+            return stack_results(std::move(result));
+        })
+        .def("deferred_moments", [](py::object self, idx_t num_moments, VectorXcd alpha,
+                                    VectorXcd beta, SparseMatrixXcd op) {
+            return make_deferred<KPM>(self, [=](KPM const& kpm) {
+                return kpm.moments(num_moments, alpha, beta, op);
+            });
+        })
         .def("deferred_ldos", [](py::object self, ArrayXd energy, double broadening,
                                  Cartesian position, std::string sublattice) {
-            auto& kpm = self.cast<KPM&>();
-            kpm.get_model().eval();
-            return Deferred<ArrayXXdCM>{
-                self, [=, &kpm] { return kpm.calc_ldos(energy, broadening, position, sublattice); }
-            };
+            return make_deferred<KPM>(self, [=](KPM const& kpm) {
+                return kpm.calc_ldos(energy, broadening, position, sublattice);
+            });
+        })
+        .def("deferred_spatial_ldos", [](py::object self, ArrayXd energy, double broadening,
+                                         Shape shape, std::string sublattice, idx_t num_random) {
+            return make_deferred<KPM>(self, [=](KPM const& kpm) {
+                return kpm.calc_spatial_ldos(energy, broadening, shape, sublattice, num_random);
+            });
         })
+        .def("deferred_dos", [](py::object self, ArrayXd energy, double broadening,
+                                idx_t num_random, double target_error) {
+            return make_deferred<KPM>(self, [=](KPM const& kpm) {
+                return kpm.calc_dos(energy, broadening, num_random, target_error);
+            });
+        }, "energy"_a, "broadening"_a, "num_random"_a, "target_error"_a=0.0)
+        .def("deferred_greens", [](py::object self, idx_t row, idx_t col, ArrayXd energy,
+                                   double broadening) {
+            return make_deferred<KPM>(self, [=](KPM const& kpm) {
+                return kpm.calc_greens(row, col, energy, broadening);
+            });
+        })
+        .def("deferred_conductivity", [](py::object self, ArrayXd chemical_potential,
+                                         double broadening, double temperature,
+                                         std::string direction, idx_t num_random,
+                                         idx_t num_points) {
+            return make_deferred<KPM>(self, [=](KPM const& kpm) {
+                return kpm.calc_conductivity(chemical_potential, broadening, temperature,
+                                             direction, num_random, num_points);
+            });
+        })
+        .def("deferred_local_charge", [](py::object self, double chemical_potential,
+                                         double temperature, double broadening,
+                                         idx_t num_random) {
+            return make_deferred<KPM>(self, [=](KPM const& kpm) {
+                return kpm.calc_local_charge(chemical_potential, temperature, broadening,
+                                             num_random);
+            });
+        }, "chemical_potential"_a, "temperature"_a, "broadening"_a, "num_random"_a=0)
         .def("report", &KPM::report, "shortform"_a=false)
         .def_property("model", &KPM::get_model, &KPM::set_model)
         .def_property_readonly("system", [](KPM const& kpm) { return kpm.get_model().system(); })
         .def_property_readonly("scaling_factors", [](KPM& kpm) {
-            auto const s = kpm.get_core().scaling_factors();
+            auto const s = [&]{ // the first call may run the Lanczos procedure
+                py::gil_scoped_release release;
+                return kpm.get_core().scaling_factors();
+            }();
             return py::make_tuple(s.a, s.b);
         })
         .def_property_readonly("kernel", [](KPM& kpm) {
             return kpm.get_core().get_config().kernel;
         })
-        .def_property_readonly("stats", [](KPM& kpm) { return kpm.get_core().get_stats(); });
+        .def_property_readonly("stats", [](KPM& kpm) { return kpm.get_core().get_stats(); })
+        .def_property_readonly("progress", [](KPM& kpm) {
+            return progress_dict(kpm.get_core().get_compute()->progress());
+        });
+
+    py::class_<kpm::Core>(m, "KPMOutOfCore")
+        .def("calc_dos", &kpm::Core::dos, "energy"_a, "broadening"_a, "num_random"_a,
+             "target_error"_a=0.0, release_gil())
+        .def("calc_dos_moments", &kpm::Core::dos_moments, "broadening"_a, "num_random"_a,
+             "target_error"_a=0.0, "checkpoint"_a=nullptr, release_gil())
+        .def("report", &kpm::Core::report, "shortform"_a=false)
+        .def_property_readonly("scaling_factors", [](kpm::Core& core) {
+            auto const s = [&]{
+                py::gil_scoped_release release;
+                return core.scaling_factors();
+            }();
+            return py::make_tuple(s.a, s.b);
+        })
+        .def_property_readonly("kernel", [](kpm::Core& core) {
+            return core.get_config().kernel;
+        })
+        .def_property_readonly("stats", &kpm::Core::get_stats)
+        .def_property_readonly("progress", [](kpm::Core& core) {
+            return progress_dict(core.get_compute()->progress());
+        });
+
+    auto const kpm_defaults = kpm::Config();
+    m.def("kpm_out_of_core", [](std::string const& filename, std::pair<float, float> energy,
+                                kpm::Kernel const& kernel, idx_t moment_cache_size,
+                                idx_t num_threads,
+                                kpm::DefaultCompute::ProgressCallback progress_callback) {
+        kpm::Config config;
+        config.min_energy = energy.first;
+        config.max_energy = energy.second;
+        config.kernel = kernel;
+        config.moment_cache_size = moment_cache_size;
+
+        py::gil_scoped_release release; // the Gershgorin bounds read the whole file
+        return kpm::Core(binary::map_hamiltonian(filename),
+                         kpm::DefaultCompute(num_threads, progress_callback), config);
+    }, "filename"_a,
+       "energy_range"_a=py::make_tuple(kpm_defaults.min_energy, kpm_defaults.max_energy),
+       "kernel"_a=kpm_defaults.kernel,
+       "moment_cache_size"_a=kpm_defaults.moment_cache_size,
+       "num_threads"_a=-1,
+       "progress_callback"_a=py::none());
+
+    wrap_kpm_strategy<kpm::DefaultCompute>(m, "kpm");
+#ifdef CPB_USE_CUDA
+    wrap_kpm_strategy<kpm::CudaCompute>(m, "kpm_cuda");
+#endif
+#ifdef CPB_USE_MKL
+    wrap_kpm_strategy<kpm::MklCompute>(m, "kpm_mkl");
+#endif
+#ifdef CPB_USE_MPI
+    wrap_kpm_strategy<MpiCompute>(m, "kpm_mpi");
+    m.def("kpm_mpi_shared", [](Model const& model, std::string const& path,
+                               std::pair<float, float> energy, kpm::Kernel const& kernel,
+                               idx_t moment_cache_size, idx_t num_threads,
+                               kpm::DefaultCompute::ProgressCallback progress_callback) {
+        kpm::Config config;
+        config.min_energy = energy.first;
+        config.max_energy = energy.second;
+        config.kernel = kernel;
+        config.moment_cache_size = moment_cache_size;
 
-    wrap_kpm_strategy(m, "kpm");
+        py::gil_scoped_release release; // the modifiers of the leader acquire it as needed
+        auto const node = kpm::MpiCommunicator::node();
+        return kpm::Core(kpm::share_hamiltonian(model, path, node),
+                         MpiCompute(num_threads, progress_callback), config);
+    }, "model"_a, "path"_a,
+       "energy_range"_a=py::make_tuple(kpm_defaults.min_energy, kpm_defaults.max_energy),
+       "kernel"_a=kpm_defaults.kernel,
+       "moment_cache_size"_a=kpm_defaults.moment_cache_size,
+       "num_threads"_a=-1,
+       "progress_callback"_a=py::none());
+#endif
 
     py::class_<kpm::OptimizedHamiltonian>(m, "OptimizedHamiltonian")
         .def("__init__", [](kpm::OptimizedHamiltonian& self, Hamiltonian const& h, int index) {
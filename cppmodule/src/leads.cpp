@@ -1,4 +1,6 @@
 #include "leads/Leads.hpp"
+#include "leads/SelfEnergy.hpp"
+#include "leads/Transmission.hpp"
 #include "wrappers.hpp"
 using namespace cpb;
 
@@ -13,12 +15,42 @@ void wrap_leads(py::module& m) {
         .def_property_readonly("spec", &Lead::spec)
         .def_property_readonly("indices", [](Lead const& l) { return arrayref(l.indices()); })
         .def_property_readonly("system", &Lead::system)
-        .def_property_readonly("h0", [](Lead const& l) { return l.h0().csrref(); })
-        .def_property_readonly("h1", [](Lead const& l) { return l.h1().csrref(); })
+        .def_property_readonly("h0", [](Lead const& l) { return csr_view(l.h0()); })
+        .def_property_readonly("h1", [](Lead const& l) { return csr_view(l.h1()); })
     ;
 
     py::class_<Leads>(m, "Leads")
         .def("__len__", &Leads::size)
         .def("__getitem__", &Leads::operator[])
     ;
+
+    py::class_<leads::SelfEnergy>(m, "SelfEnergy")
+        .def(py::init<Leads const&, double, double, int>(), "leads"_a, "broadening"_a=1e-8,
+             "tolerance"_a=1e-12, "max_iterations"_a=1000)
+        .def("__len__", &leads::SelfEnergy::size)
+        .def("surface_greens", [](leads::SelfEnergy const& self, idx_t lead,
+                                  ArrayXd const& energies, idx_t num_threads) {
+            py::gil_scoped_release release;
+            return self.surface_greens(lead, energies, num_threads);
+        }, "lead"_a, "energies"_a, "num_threads"_a=-1)
+        .def("self_energy", [](leads::SelfEnergy const& self, idx_t lead,
+                               ArrayXd const& energies, idx_t num_threads) {
+            py::gil_scoped_release release;
+            return self.self_energy(lead, energies, num_threads);
+        }, "lead"_a, "energies"_a, "num_threads"_a=-1)
+        .def_property_readonly("cache_size", &leads::SelfEnergy::cache_size)
+        .def("clear_cache", &leads::SelfEnergy::clear_cache)
+    ;
+
+    py::class_<leads::Transmission>(m, "Transmission")
+        .def(py::init<Hamiltonian const&, Leads const&, idx_t, idx_t>(),
+             "hamiltonian"_a, "leads"_a, "from_lead"_a=0, "to_lead"_a=1)
+        .def_property_readonly("num_slices", &leads::Transmission::num_slices)
+        .def_property_readonly("max_slice_width", &leads::Transmission::max_slice_width)
+        .def("calc", [](leads::Transmission const& self, leads::SelfEnergy const& self_energy,
+                        ArrayXd const& energies, idx_t num_threads) {
+            py::gil_scoped_release release;
+            return self.calc(self_energy, energies, num_threads);
+        }, "self_energy"_a, "energies"_a, "num_threads"_a=-1)
+    ;
 }
@@ -1,5 +1,8 @@
 #include "wrappers.hpp"
-#include "support/simd.hpp"
+#include "kpm/default/dispatch.hpp"
+#include "utils/Metrics.hpp"
+#include "utils/ThreadBudget.hpp"
+#include "utils/Trace.hpp"
 #ifdef CPB_USE_MKL
 # include <mkl.h>
 #endif
@@ -19,18 +22,32 @@ PYBIND11_MODULE(_pybinding, m) {
 
     wrapper_tests(m);
 
-    m.def("simd_info", []() -> std::string {
-#if SIMDPP_USE_AVX
-        auto const bits = std::to_string(simd::basic_traits::register_size_bytes * 8);
-        return (SIMDPP_USE_AVX2 ? "AVX2-" : "AVX-") + bits;
-#elif SIMDPP_USE_SSE3
-        return "SSE3";
-#elif SIMDPP_USE_SSE2
-        return "SSE2";
-#else
-        return "x87";
-#endif
-    });
+    m.def("simd_info", [] { return kpm::dispatch::best().instruction_set; });
+    m.def("available_cpus", &available_cpus,
+          "CPUs which the process may use: affinity mask, cgroup quota and CPB_NUM_THREADS");
+    m.def("set_thread_budget", &set_thread_budget, "budget"_a,
+          "Default number of threads of the solvers started by the calling thread");
+
+    m.def("trace_start", &trace::start, "Discard any previous events and start tracing");
+    m.def("trace_stop", &trace::stop, "Stop tracing: the events are kept");
+    m.def("trace_json", &trace::json, "The recorded events in the Chrome trace format");
+    m.def("trace_write", &trace::write, "filename"_a, "Write the events to a JSON file");
+
+    m.def("metrics_snapshot", [] {
+        auto values = py::dict();
+        for (auto const& sample : metrics::snapshot()) {
+            auto const key = sample.labels.empty() ? sample.name
+                                                   : sample.name + "{" + sample.labels + "}";
+            values[py::str(key)] = sample.value;
+        }
+        return values;
+    }, "The current values of the live metrics by name (followed by their labels, if any)");
+    m.def("metrics_text", &metrics::text, "The live metrics in the Prometheus text format");
+    m.def("metrics_write", &metrics::write, "filename"_a,
+          "Replace the file with the metrics in the Prometheus text format");
+    m.def("metrics_reset", &metrics::reset, "Zero the counters and the stage times");
+    m.def("metrics_collect_stages", &metrics::collect_stages, "enable"_a,
+          "Start or stop accumulating the times of the pipeline stages");
 
 #ifdef CPB_USE_MKL
     m.def("get_max_threads", MKL_Get_Max_Threads,
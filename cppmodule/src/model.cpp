@@ -2,9 +2,34 @@
 #include "wrappers.hpp"
 using namespace cpb;
 
+namespace {
+
+void delete_matrix(void* p) { delete static_cast<var::complex<SparseMatrixRC>*>(p); }
+
+void delete_view(void* p) {
+    if (!Py_IsInitialized()) { return; } // leaked at interpreter shutdown
+    py::gil_scoped_acquire guard{};
+    delete static_cast<py::object*>(p);
+}
+
+} // anonymous namespace
+
+py::object csr_view(Hamiltonian const& h) {
+    auto& cache = h.view_cache();
+    if (cache) { return *std::static_pointer_cast<py::object>(cache); }
+
+    // The arrays only own the matrix, not the cache which holds them, to avoid a cycle
+    auto const owner = py::capsule(new var::complex<SparseMatrixRC>(h.get_variant()),
+                                   &delete_matrix);
+    auto const view = py::cast(h.csrref(), py::return_value_policy::reference, owner);
+    cache = std::shared_ptr<void>(new py::object(view), &delete_view);
+    return view;
+}
+
 void wrap_model(py::module& m) {
     py::class_<Model>(m, "Model")
         .def(py::init<Lattice const&>())
+        .def(py::init<Model const&>())
         .def("add", &Model::add | resolve<Primitive>())
         .def("add", &Model::add | resolve<Shape const&>())
         .def("add", &Model::add | resolve<TranslationalSymmetry const&>())
@@ -23,17 +48,60 @@ void wrap_model(py::module& m) {
             k : array_like
                 Wave vector in reciprocal space.
         )")
+        .def("set_system_cache", &Model::set_system_cache, "directory"_a, "key"_a="", R"(
+            Reuse built systems from an on-disk cache
+
+            The cache file name is a hash of the lattice, shape, symmetry and the number and
+            kind of structure modifiers. The modifier callbacks themselves can't be hashed,
+            so `key` should change whenever their behavior does.
+
+            Parameters
+            ----------
+            directory : str
+                Existing directory where the cached systems are stored.
+            key : str
+                User-defined identifier which is added to the hash.
+        )")
+        .def_property_readonly("structure_hash", &Model::structure_hash)
         .def_property_readonly("lattice", &Model::get_lattice)
         .def_property_readonly("system", &Model::system)
         .def_property_readonly("raw_hamiltonian", &Model::hamiltonian)
         .def_property_readonly("hamiltonian", [](Model const& self) {
-            return self.hamiltonian().csrref();
+            return csr_view(self.hamiltonian());
         })
         .def_property_readonly("leads", &Model::leads)
+        .def("with_shared_system", &Model::with_shared_system)
         .def("eval", &Model::eval)
+        .def("eval_hamiltonian", &Model::eval_hamiltonian)
         .def("report", &Model::report, "Return a string with information about the last build")
         .def_property_readonly("system_build_seconds", &Model::system_build_seconds)
-        .def_property_readonly("hamiltonian_build_seconds", &Model::hamiltonian_build_seconds);
+        .def_property_readonly("hamiltonian_build_seconds", &Model::hamiltonian_build_seconds)
+        .def("estimate_memory", [](Model const& self) {
+            auto const e = self.estimate_memory();
+            return py::dict("num_sites"_a=e.num_sites, "hamiltonian_size"_a=e.hamiltonian_size,
+                            "hamiltonian_nnz"_a=e.hamiltonian_nnz, "foundation"_a=e.foundation,
+                            "system"_a=e.system, "hamiltonian"_a=e.hamiltonian,
+                            "hamiltonian_build"_a=e.hamiltonian_build, "peak"_a=e.peak());
+        }, R"(
+            Predict the memory needed to build the model (in bytes) without building it
+
+            The foundation covers the bounding box of the shape, so the numbers are upper
+            bounds. Site and hopping generators and leads are not included.
+
+            Returns
+            -------
+            dict
+                Sizes of the foundation, system, Hamiltonian and the temporary buffers of
+                its assembly, as well as the `peak` of what's alive at the same time.
+        )")
+        .def_property_readonly("memory_usage", [](Model const& self) {
+            auto const usage = [](MemoryUsage const& u) {
+                return py::dict("size"_a=u.size, "peak"_a=u.peak);
+            };
+            return py::dict("foundation"_a=usage(self.foundation_memory_usage()),
+                            "system"_a=usage(self.system_memory_usage()),
+                            "hamiltonian"_a=usage(self.hamiltonian_memory_usage()));
+        });
 
     py::class_<Hamiltonian>(m, "Hamiltonian")
         .def_property_readonly("csrref", &Hamiltonian::csrref);
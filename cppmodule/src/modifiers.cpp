@@ -1,5 +1,6 @@
 #include "system/StructureModifiers.hpp"
 #include "hamiltonian/HamiltonianModifiers.hpp"
+#include "hamiltonian/BuiltinModifiers.hpp"
 #include "wrappers.hpp"
 using namespace cpb;
 
@@ -37,6 +38,15 @@ void extract_modifier_result(T& v, py::object const& o) {
     ExtractModifierResult{o}(Eigen::Map<EigenType>(v.data(), v.size()));
 }
 
+/// Read-only view of the interleaved `COO` indices (no copy: only valid during the call)
+py::array_t<storage_idx_t> coo_index_array(CooIndexRef indices) {
+    auto const shape = std::vector<size_t>{static_cast<size_t>(indices.size())};
+    auto const strides = std::vector<size_t>{indices.innerStride() * sizeof(storage_idx_t)};
+    auto a = py::array_t<storage_idx_t>(shape, strides, indices.data(), py::none());
+    a.attr("setflags")("write"_a=false);
+    return a;
+}
+
 } // anonymous namespace
 
 template<class T>
@@ -122,7 +132,24 @@ void wrap_modifiers(py::module& m) {
 
     py::class_<HoppingModifier>(m, "HoppingModifier")
         .def("__init__", [](HoppingModifier& self, py::object apply,
-                            bool is_complex, bool is_double) {
+                            bool is_complex, bool is_double, bool indexed) {
+            if (indexed) {
+                new (&self) HoppingModifier(
+                    [apply](ComplexArrayRef energy, CooIndexRef rows, CooIndexRef cols,
+                            CartesianArrayConstRef p, Cartesian shift, string_view hopping_family) {
+                        py::gil_scoped_acquire guard{};
+                        auto result = apply(
+                            energy, coo_index_array(rows), coo_index_array(cols),
+                            arrayref(p.x()), arrayref(p.y()), arrayref(p.z()), shift,
+                            hopping_family
+                        );
+                        num::match<ArrayX>(energy, ExtractModifierResult{result});
+                    },
+                    is_complex, is_double
+                );
+                return;
+            }
+
             new (&self) HoppingModifier(
                 [apply](ComplexArrayRef energy, CartesianArrayConstRef p1,
                         CartesianArrayConstRef p2, string_view hopping_family) {
@@ -135,7 +162,18 @@ void wrap_modifiers(py::module& m) {
                 },
                 is_complex, is_double
             );
-        }, "apply"_a, "is_complex"_a=false, "is_double"_a=false)
+        }, "apply"_a, "is_complex"_a=false, "is_double"_a=false, "indexed"_a=false)
         .def_readwrite("is_complex", &HoppingModifier::is_complex)
         .def_readwrite("is_double", &HoppingModifier::is_double);
+
+    m.def("constant_magnetic_field", &builtin::constant_magnetic_field, "magnitude"_a);
+    m.def("constant_electric_field", &builtin::constant_electric_field, "field"_a);
+    m.def("anderson_disorder", &builtin::anderson_disorder, "width"_a, "seed"_a=0);
+    m.def("random_vacancies", &builtin::random_vacancies,
+          "probability"_a, "seed"_a=0, "min_neighbors"_a=0);
+    m.def("strained_hopping", &builtin::strained_hopping, "beta"_a, "reference_length"_a);
+    m.def("onsite_expression", &builtin::onsite_expression,
+          "expression"_a, "constants"_a=std::map<std::string, double>{});
+    m.def("hopping_expression", &builtin::hopping_expression,
+          "expression"_a, "constants"_a=std::map<std::string, double>{});
 }
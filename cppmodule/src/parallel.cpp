@@ -1,16 +1,39 @@
 #include "wrappers.hpp"
 #include "thread.hpp"
 #include "numeric/dense.hpp"
+#include "Sweep.hpp"
 using namespace cpb;
 
 void wrap_parallel(py::module& m) {
     py::class_<DeferredBase, std::shared_ptr<DeferredBase>>(m, "DeferredBase")
-        .def("compute", &DeferredBase::compute)
+        .def("compute", &DeferredBase::compute, release_gil())
         .def_property_readonly("solver", &DeferredBase::solver)
         .def_property_readonly("result", &DeferredBase::result);
 
+    // One class for each result type of the `deferred_*()` methods
     using DeferredXdCM = Deferred<ArrayXXdCM>;
     py::class_<DeferredXdCM, std::shared_ptr<DeferredXdCM>, DeferredBase>(m, "DeferredXd");
+    using DeferredArrayXd = Deferred<ArrayXd>;
+    py::class_<DeferredArrayXd, std::shared_ptr<DeferredArrayXd>, DeferredBase>(
+        m, "DeferredArrayXd");
+    using DeferredArrayXcd = Deferred<ArrayXcd>;
+    py::class_<DeferredArrayXcd, std::shared_ptr<DeferredArrayXcd>, DeferredBase>(
+        m, "DeferredArrayXcd");
+    using DeferredArrayXXd = Deferred<ArrayXXd>;
+    py::class_<DeferredArrayXXd, std::shared_ptr<DeferredArrayXXd>, DeferredBase>(
+        m, "DeferredArrayXXd");
+    using DeferredPython = Deferred<py::object>;
+    py::class_<DeferredPython, std::shared_ptr<DeferredPython>, DeferredBase>(
+        m, "DeferredPython");
+
+    // For solvers implemented in Python: the job takes the GIL so it's only pipelined with
+    // the other jobs, it doesn't run in parallel with Python code
+    m.def("deferred", [](py::object solver, py::function compute) {
+        return DeferredPython{std::move(solver), [compute]() -> py::object {
+            py::gil_scoped_acquire gil_acquire;
+            return compute();
+        }};
+    }, "solver"_a, "compute"_a);
 
     m.def("parallel_for", [](py::object sequence, py::object produce, py::object retire,
                              std::size_t num_threads, std::size_t queue_size) {
@@ -43,4 +66,42 @@ void wrap_parallel(py::module& m) {
             }
         );
     }, "sequence"_a, "produce"_a, "retire"_a, "num_threads"_a, "queue_size"_a);
+
+    py::class_<SweepModifier>(m, "SweepModifier");
+    m.def("sweep_onsite_expression", &sweep::onsite_expression,
+          "expression"_a, "constants"_a=SweepParameters{});
+    m.def("sweep_hopping_expression", &sweep::hopping_expression,
+          "expression"_a, "constants"_a=SweepParameters{});
+    m.def("sweep_constant_magnetic_field", &sweep::constant_magnetic_field, "magnitude"_a);
+    m.def("sweep_constant_electric_field", &sweep::constant_electric_field,
+          "magnitude"_a, "direction"_a);
+    m.def("sweep_anderson_disorder", &sweep::anderson_disorder, "width"_a, "seed"_a=0);
+    m.def("sweep_strained_hopping", &sweep::strained_hopping,
+          "beta"_a, "reference_length"_a);
+
+    // The whole sweep runs without the GIL: Python is only entered again to return the result
+    m.def("run_sweep", [](KPM& kpm, std::vector<std::string> const& names,
+                          std::vector<ArrayXd> const& values,
+                          std::vector<SweepModifier> const& modifiers, std::string const& kind,
+                          ArrayXd const& energy, double broadening, idx_t num_random,
+                          Cartesian position, std::string const& sublattice,
+                          idx_t num_threads) {
+        if (kind != "dos" && kind != "ldos") {
+            throw std::invalid_argument("The sweep calculation must be 'dos' or 'ldos'");
+        }
+        auto calculation = SweepCalculation();
+        calculation.kind = (kind == "dos") ? SweepCalculation::Kind::DOS
+                                           : SweepCalculation::Kind::LDOS;
+        calculation.energy = energy;
+        calculation.broadening = broadening;
+        calculation.num_random = num_random;
+        calculation.position = position;
+        calculation.sublattice = sublattice;
+        calculation.config = kpm.get_core().get_config();
+        auto const grid = make_sweep_grid(names, values);
+
+        py::gil_scoped_release release;
+        return run_sweep(kpm.get_model(), grid, modifiers, calculation, num_threads);
+    }, "kpm"_a, "names"_a, "values"_a, "modifiers"_a, "kind"_a, "energy"_a, "broadening"_a,
+       "num_random"_a, "position"_a, "sublattice"_a, "num_threads"_a);
 }
@@ -1,19 +1,128 @@
 #include "solver/Solver.hpp"
+#include "solver/Bands.hpp"
 #include "solver/FEAST.hpp"
+#include "solver/ChebyshevFilter.hpp"
+#include "solver/Dense.hpp"
+#include "solver/ShiftInvert.hpp"
+#include "solver/SlicedFEAST.hpp"
 #include "wrappers.hpp"
+#include "thread.hpp"
 using namespace cpb;
 
 void wrap_solver(py::module& m) {
     py::class_<BaseSolver>(m, "Solver")
-        .def("solve", &BaseSolver::solve)
+        .def("solve", &BaseSolver::solve, release_gil())
         .def("clear", &BaseSolver::clear)
         .def("report", &BaseSolver::report, "shortform"_a=false)
-        .def("calc_dos", &BaseSolver::calc_dos, "energies"_a, "broadening"_a)
-        .def("calc_spatial_ldos", &BaseSolver::calc_spatial_ldos, "energy"_a, "broadening"_a)
+        .def("calc_dos", &BaseSolver::calc_dos, "energies"_a, "broadening"_a,
+             "num_threads"_a=-1, release_gil())
+        .def("calc_spatial_ldos", &BaseSolver::calc_spatial_ldos, "energy"_a, "broadening"_a,
+             "num_threads"_a=-1, release_gil())
+        .def("calc_bands", [](BaseSolver const& self, std::vector<Cartesian> const& k_path,
+                              idx_t num_threads) {
+            self.get_model().eval(); // the modifiers may call into Python: keep the GIL here
+            py::gil_scoped_release release;
+            return self.calc_bands(k_path, num_threads);
+        }, "k_path"_a, "num_threads"_a=-1)
+        .def("deferred_dos", [](py::object self, ArrayXf energies, float broadening,
+                                idx_t num_threads) {
+            return make_deferred<BaseSolver>(self, [=](BaseSolver& solver) {
+                return solver.calc_dos(energies, broadening, num_threads);
+            });
+        }, "energies"_a, "broadening"_a, "num_threads"_a=-1)
+        .def("deferred_spatial_ldos", [](py::object self, float energy, float broadening,
+                                         idx_t num_threads) {
+            return make_deferred<BaseSolver>(self, [=](BaseSolver& solver) {
+                return solver.calc_spatial_ldos(energy, broadening, num_threads);
+            });
+        }, "energy"_a, "broadening"_a, "num_threads"_a=-1)
+        .def("deferred_bands", [](py::object self, std::vector<Cartesian> k_path,
+                                  idx_t num_threads) {
+            return make_deferred<BaseSolver>(self, [=](BaseSolver const& solver) {
+                return solver.calc_bands(k_path, num_threads);
+            });
+        }, "k_path"_a, "num_threads"_a=-1)
         .def_property("model", &BaseSolver::get_model, &BaseSolver::set_model)
+        .def_property("warm_start", &BaseSolver::get_warm_start, &BaseSolver::set_warm_start)
+        .def_property("single_precision_eigenvectors",
+                      &BaseSolver::get_single_precision_eigenvectors,
+                      &BaseSolver::set_single_precision_eigenvectors)
+        .def("eigenvectors_at", &BaseSolver::eigenvectors_at, "sites"_a, "states"_a,
+             release_gil())
+        .def("probability_at", &BaseSolver::probability_at, "sites"_a, "states"_a,
+             release_gil())
         .def_property_readonly("system", &BaseSolver::system)
-        .def_property_readonly("eigenvalues", &BaseSolver::eigenvalues)
-        .def_property_readonly("eigenvectors", &BaseSolver::eigenvectors);
+        .def_property_readonly("eigenvalues", py::cpp_function(&BaseSolver::eigenvalues,
+                                                               release_gil()))
+        .def_property_readonly("eigenvectors", py::cpp_function(&BaseSolver::eigenvectors,
+                                                                release_gil()));
+
+    m.def("calc_bands", [](Model const& model, std::vector<Cartesian> const& k_path,
+                           idx_t num_bands, idx_t num_threads) {
+        model.eval(); // the modifiers may call into Python: keep the GIL here
+        py::gil_scoped_release release;
+        return calc_bands(model, k_path, num_bands, num_threads);
+    }, "model"_a, "k_path"_a, "num_bands"_a=-1, "num_threads"_a=-1);
+    m.def("calc_bands", [](Lead const& lead, ArrayXd const& k_path, idx_t num_bands,
+                           idx_t num_threads) {
+        return calc_bands(lead, k_path, num_bands, num_threads);
+    }, "lead"_a, "k_path"_a, "num_bands"_a=-1, "num_threads"_a=-1, release_gil());
+
+    py::class_<Solver<Dense>, BaseSolver>(m, "DenseSolver")
+        .def("__init__", [](Solver<Dense>& self, Model const& model, bool eigenvalues_only) {
+                 DenseConfig config;
+                 config.eigenvalues_only = eigenvalues_only;
+
+                 new (&self) Solver<Dense>(model, config);
+             },
+             "model"_a, "eigenvalues_only"_a=DenseConfig().eigenvalues_only
+        );
+
+    auto const shift_invert_defaults = ShiftInvertConfig();
+    py::class_<Solver<ShiftInvert>, BaseSolver>(m, "ShiftInvert")
+        .def("__init__", [](Solver<ShiftInvert>& self, Model const& model, int num_eigenvalues,
+                            double sigma, int subspace_size, double tolerance, int max_restarts) {
+                 ShiftInvertConfig config;
+                 config.num_eigenvalues = num_eigenvalues;
+                 config.sigma = sigma;
+                 config.subspace_size = subspace_size;
+                 config.tolerance = tolerance;
+                 config.max_restarts = max_restarts;
+
+                 new (&self) Solver<ShiftInvert>(model, config);
+             },
+             "model"_a, "num_eigenvalues"_a, "sigma"_a=shift_invert_defaults.sigma,
+             "subspace_size"_a=shift_invert_defaults.subspace_size,
+             "tolerance"_a=shift_invert_defaults.tolerance,
+             "max_restarts"_a=shift_invert_defaults.max_restarts
+        );
+
+    auto const chebyshev_defaults = ChebyshevFilterConfig();
+    py::class_<Solver<ChebyshevFilter>, BaseSolver>(m, "ChebyshevFilter")
+        .def("__init__", [](Solver<ChebyshevFilter>& self, Model const& model,
+                            std::pair<double, double> energy, int size_guess, int degree,
+                            double tolerance, int max_iterations, bool recycle,
+                            idx_t num_threads) {
+                 ChebyshevFilterConfig config;
+                 config.energy_min = energy.first;
+                 config.energy_max = energy.second;
+                 config.initial_size_guess = size_guess;
+                 config.filter_degree = degree;
+                 config.tolerance = tolerance;
+                 config.max_iterations = max_iterations;
+                 config.recycle_subspace = recycle;
+                 config.num_threads = num_threads;
+
+                 new (&self) Solver<ChebyshevFilter>(model, config);
+             },
+             "model"_a, "energy_range"_a,
+             "initial_size_guess"_a=chebyshev_defaults.initial_size_guess,
+             "filter_degree"_a=chebyshev_defaults.filter_degree,
+             "tolerance"_a=chebyshev_defaults.tolerance,
+             "max_iterations"_a=chebyshev_defaults.max_iterations,
+             "recycle_subspace"_a=chebyshev_defaults.recycle_subspace,
+             "num_threads"_a=chebyshev_defaults.num_threads
+        );
 
 #ifdef CPB_USE_FEAST
     auto const feast_defaults = FEASTConfig();
@@ -35,5 +144,34 @@ void wrap_solver(py::module& m) {
              "recycle_subspace"_a=feast_defaults.recycle_subspace,
              "is_verbose"_a=feast_defaults.is_verbose
         );
+
+    auto const sliced_defaults = SlicedFEASTConfig();
+    py::class_<Solver<SlicedFEAST>, BaseSolver>(m, "SlicedFEAST")
+        .def("__init__", [](Solver<SlicedFEAST>& self, Model const& model,
+                            std::pair<double, double> energy, idx_t num_slices, idx_t slice_size,
+                            idx_t num_random, double broadening, idx_t threads_per_slice,
+                            idx_t num_threads, bool verbose) {
+                 SlicedFEASTConfig config;
+                 config.slicing.energy_min = energy.first;
+                 config.slicing.energy_max = energy.second;
+                 config.slicing.num_slices = num_slices;
+                 config.slicing.slice_size = slice_size;
+                 config.slicing.num_random = num_random;
+                 config.slicing.broadening = broadening;
+                 config.slicing.num_threads = num_threads;
+                 config.threads_per_slice = threads_per_slice;
+                 config.feast.is_verbose = verbose;
+
+                 new (&self) Solver<SlicedFEAST>(model, config);
+             },
+             "model"_a, "energy_range"_a,
+             "num_slices"_a=sliced_defaults.slicing.num_slices,
+             "slice_size"_a=sliced_defaults.slicing.slice_size,
+             "num_random"_a=sliced_defaults.slicing.num_random,
+             "broadening"_a=sliced_defaults.slicing.broadening,
+             "threads_per_slice"_a=sliced_defaults.threads_per_slice,
+             "num_threads"_a=sliced_defaults.slicing.num_threads,
+             "is_verbose"_a=sliced_defaults.feast.is_verbose
+        );
 #endif // CPB_USE_FEAST
 }
@@ -1,4 +1,6 @@
 #include "system/System.hpp"
+#include "system/CompressedHoppingBlocks.hpp"
+#include "BinaryFile.hpp"
 #include "wrappers.hpp"
 using namespace cpb;
 
@@ -61,13 +63,39 @@ void wrap_system(py::module& m) {
             );
         })
         .def("__getstate__", [](HoppingBlocks const& hb) {
-            return py::dict("num_sites"_a=hb.get_num_sites(), "data"_a=hb.get_serialized_blocks(),
+            // About 3 bytes per hopping instead of 8, see `CompressedHoppingBlocks`
+            auto const compressed = CompressedHoppingBlocks(hb);
+            auto blocks = py::list();
+            for (auto const& block : compressed.get_serialized_blocks()) {
+                auto const& bytes = block.first;
+                blocks.append(py::make_tuple(
+                    py::bytes(reinterpret_cast<char const*>(bytes.data()), bytes.size()),
+                    block.second
+                ));
+            }
+            return py::dict("num_sites"_a=hb.get_num_sites(), "compressed"_a=blocks,
                             "name_map"_a=hb.get_name_map());
         })
         .def("__setstate__", [](HoppingBlocks& hb, py::dict d) {
-            new (&hb) HoppingBlocks(d["num_sites"].cast<idx_t>(),
-                                    d["data"].cast<HoppingBlocks::SerializedBlocks>(),
-                                    d["name_map"].cast<NameMap>());
+            auto const num_sites = d["num_sites"].cast<idx_t>();
+            auto name_map = d["name_map"].cast<NameMap>();
+            if (!d.contains("compressed")) { // saved by an older version
+                new (&hb) HoppingBlocks(num_sites,
+                                        d["data"].cast<HoppingBlocks::SerializedBlocks>(),
+                                        std::move(name_map));
+                return;
+            }
+
+            auto blocks = CompressedHoppingBlocks::SerializedBlocks();
+            for (auto const& item : d["compressed"].cast<py::list>()) {
+                auto const block = item.cast<py::tuple>();
+                auto const bytes = block[0].cast<std::string>();
+                blocks.emplace_back(CompressedHoppingBlocks::Bytes(bytes.begin(), bytes.end()),
+                                    block[1].cast<idx_t>());
+            }
+            auto const compressed = CompressedHoppingBlocks(num_sites, std::move(blocks),
+                                                            std::move(name_map));
+            new (&hb) HoppingBlocks(compressed.decompress());
         });
 
     using Boundary = System::Boundary;
@@ -87,7 +115,14 @@ void wrap_system(py::module& m) {
         });
 
     py::class_<System, std::shared_ptr<System>>(m, "System")
-        .def("find_nearest", &System::find_nearest, "position"_a, "sublattice"_a="")
+        .def("find_nearest", [](System const& s, Cartesian position, string_view sublattice) {
+            return s.find_nearest(position, sublattice);
+        }, "position"_a, "sublattice"_a="")
+        .def("find_nearest_many", [](System const& s, Eigen::Ref<ArrayXf const> x,
+                                     Eigen::Ref<ArrayXf const> y, Eigen::Ref<ArrayXf const> z,
+                                     string_view sublattice) {
+            return s.find_nearest({x, y, z}, sublattice);
+        }, "x"_a, "y"_a, "z"_a, "sublattice"_a="")
         .def("to_hamiltonian_indices", &System::to_hamiltonian_indices)
         .def_readonly("site_registry", &System::site_registry)
         .def_readonly("hopping_registry", &System::hopping_registry)
@@ -119,4 +154,11 @@ void wrap_system(py::module& m) {
             s.hopping_blocks = d["hopping_blocks"].cast<decltype(s.hopping_blocks)>();
             s.boundaries = d["boundaries"].cast<decltype(s.boundaries)>();
         });
+
+    m.def("save_binary", &binary::save, "filename"_a, "system"_a, "hamiltonian"_a=Hamiltonian());
+    m.def("load_binary", [](std::string const& filename) {
+        auto contents = binary::load(filename);
+        auto hamiltonian = contents.hamiltonian ? py::cast(contents.hamiltonian) : py::none();
+        return py::make_tuple(contents.system, hamiltonian);
+    }, "filename"_a);
 }
@@ -0,0 +1,207 @@
+#! /usr/bin/env python3
+"""End-to-end performance regression suite on the bundled material models
+
+Usage:
+    python3 regression.py --save baseline.json   # measure and record a baseline
+    python3 regression.py --check baseline.json  # measure and compare with the baseline
+
+The optional `--scale` multiplies the linear size of all systems (the defaults are around
+10^5 to 10^6 sites) and `--tolerance` is the allowed relative slowdown (default: 0.25).
+The `--check` run exits with a non-zero status if any measurement is outside the tolerance:
+longer time, higher memory, lower throughput or different results. The baseline should be
+recorded on the same machine with the same number of threads.
+
+For each of the material models from `pybinding.repository` (graphene, phosphorene and
+MoS2 via `group6_tmd`), the benchmark builds a disordered rectangular flake and measures:
+  - the model build: system and Hamiltonian construction
+  - the KPM DOS, LDOS and conductivity with the throughput reported in `KPM.stats`
+  - the shift-invert eigenvalue solver (`arpack`) near the middle of the spectrum
+
+The disorder has a fixed seed and the KPM uses deterministic reductions, so the results are
+identical between runs and they are also compared with the baseline. Each measurement keeps
+the wall time, the peak resident memory of the process (not available on Windows) and, for
+KPM, the `eps` (Hamiltonian elements processed per second) and `bandwidth` statistics.
+"""
+
+import argparse
+import json
+import math
+import platform
+import sys
+
+import numpy as np
+
+import pybinding as pb
+from pybinding.repository import graphene, group6_tmd, phosphorene
+
+try:
+    import resource
+except ImportError:  # Windows
+    resource = None
+
+
+def peak_memory():
+    """Peak resident memory of this process in bytes (or `None` if it's not available)"""
+    if resource is None:
+        return None
+    peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    return peak if sys.platform == "darwin" else peak * 1024  # Linux reports KiB
+
+
+def anderson_disorder(width, seed):
+    """Uniform random onsite energies in [-width/2, width/2]
+
+    The modifier may be called in slices of the system, so instead of a random generator
+    the values are a hash of the site position and the `seed`: the same for every build.
+    """
+    @pb.onsite_energy_modifier
+    def modifier(energy, x, y):
+        h = np.sin(12.9898 * x + 78.233 * y + seed) * 43758.5453
+        disorder = width * (h - np.floor(h) - 0.5)
+        if energy.ndim == 1:
+            return energy + disorder
+        return energy + disorder[:, np.newaxis, np.newaxis] * np.eye(energy.shape[1])
+    return modifier
+
+
+def make_cases(scale):
+    """Material name -> (model factory, KPM energy points, broadening)"""
+    def flake(lattice, width, height):
+        return lambda: pb.Model(lattice, pb.rectangle(width * scale, height * scale),
+                                anderson_disorder(width=0.5, seed=42))
+
+    return {
+        "graphene": (flake(graphene.monolayer(), 150, 150), np.linspace(-1, 1, 41), 0.05),
+        "phosphorene": (flake(phosphorene.monolayer_4band(), 100, 100),
+                        np.linspace(-1.5, 1.5, 41), 0.05),
+        "mos2": (flake(group6_tmd.monolayer_3band("MoS2"), 80, 80),
+                 np.linspace(-1, 3, 41), 0.05),
+    }
+
+
+class Measurement:
+    """Times a code block and records its memory and results"""
+    def __init__(self, results, name):
+        self.results = results
+        self.name = name
+        self.entry = {}
+
+    def __enter__(self):
+        self.timer = pb.utils.timed().__enter__()
+        return self.entry
+
+    def __exit__(self, *_):
+        self.timer.__exit__()
+        self.entry["time"] = self.timer.elapsed
+        self.entry["peak_memory"] = peak_memory()
+        self.results[self.name] = self.entry
+        print("  {:<28} {}".format(self.name, self.timer))
+
+
+def kpm_stats(kpm):
+    s = kpm.stats
+    return {"eps": s["eps"], "bandwidth": s["bandwidth"]}
+
+
+def measure(scale, num_threads):
+    results = {}
+    for name, (make_model, energy, broadening) in make_cases(scale).items():
+        print(name + ":")
+        with Measurement(results, name + "/model") as entry:
+            model = make_model()
+            h = model.hamiltonian
+        entry.update(num_sites=h.shape[0], nnz=h.nnz)
+
+        kwargs = dict(silent=True, deterministic=True)
+        if num_threads != "auto":
+            kwargs["num_threads"] = num_threads
+        kpm = pb.kpm(model, **kwargs)
+
+        with Measurement(results, name + "/kpm_dos") as entry:
+            dos = kpm.calc_dos(energy, broadening, num_random=4)
+        entry.update(kpm_stats(kpm), values=dos.data.tolist())
+
+        with Measurement(results, name + "/kpm_ldos") as entry:
+            ldos = kpm.calc_ldos(energy, broadening, position=[0, 0])
+        entry.update(kpm_stats(kpm), values=ldos.data.tolist())
+
+        with Measurement(results, name + "/kpm_conductivity") as entry:
+            sigma = kpm.calc_conductivity(energy, broadening=4 * broadening, temperature=0,
+                                          num_random=1, num_points=200)
+        entry.update(kpm_stats(kpm), values=sigma.data.real.tolist())
+
+        with Measurement(results, name + "/arpack") as entry:
+            solver = pb.solver.arpack(model, k=20, sigma=float(energy.mean()))
+            eigenvalues = np.sort(solver.eigenvalues)
+        entry.update(values=eigenvalues.tolist())
+    return results
+
+
+def compare(results, baseline, tolerance):
+    """Return the list of regressions (empty if all measurements are within tolerance)"""
+    failures = []
+
+    def check(key, what, passed, value, reference):
+        if not passed:
+            failures.append("{}: {} {} vs. baseline {}".format(key, what, value, reference))
+
+    for key, ref in baseline.items():
+        if key not in results:
+            failures.append("{}: missing".format(key))
+            continue
+        new = results[key]
+        check(key, "time", new["time"] <= ref["time"] * (1 + tolerance),
+              new["time"], ref["time"])
+        if new["peak_memory"] is not None and ref["peak_memory"] is not None:
+            check(key, "peak_memory", new["peak_memory"] <= ref["peak_memory"] * (1 + tolerance),
+                  new["peak_memory"], ref["peak_memory"])
+        for stat in ("eps", "bandwidth"):
+            if stat in ref and ref[stat] and not math.isnan(ref[stat]):
+                check(key, stat, new[stat] >= ref[stat] * (1 - tolerance), new[stat], ref[stat])
+        for count in ("num_sites", "nnz"):
+            if count in ref:
+                check(key, count, new[count] == ref[count], new[count], ref[count])
+        if "values" in ref:
+            same = np.allclose(new["values"], ref["values"], rtol=1e-4, atol=1e-6)
+            check(key, "values", same, "differ", "")
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    group = parser.add_mutually_exclusive_group(required=True)
+    group.add_argument("--save", metavar="FILE", help="record a new baseline")
+    group.add_argument("--check", metavar="FILE", help="compare with a recorded baseline")
+    parser.add_argument("--scale", type=float, default=1.0, help="linear size factor")
+    parser.add_argument("--tolerance", type=float, default=0.25,
+                        help="allowed relative regression")
+    parser.add_argument("--num-threads", default="auto", help="KPM threads")
+    args = parser.parse_args()
+    num_threads = args.num_threads if args.num_threads == "auto" else int(args.num_threads)
+
+    if args.check:
+        with open(args.check) as file:
+            baseline = json.load(file)
+        if baseline["scale"] != args.scale or baseline["num_threads"] != num_threads:
+            sys.exit("The baseline was recorded with a different --scale or --num-threads")
+
+    results = measure(args.scale, num_threads)
+
+    if args.save:
+        with open(args.save, "w") as file:
+            json.dump({"pybinding": pb.__version__, "machine": platform.platform(),
+                       "processor": platform.processor(), "scale": args.scale,
+                       "num_threads": num_threads, "results": results}, file, indent=1)
+        print("\nDone! Baseline saved to file: {}".format(args.save))
+    else:
+        failures = compare(results, baseline["results"], args.tolerance)
+        print("\nBaseline: pybinding v{}, {}".format(baseline["pybinding"], baseline["machine"]))
+        for failure in failures:
+            print("REGRESSION " + failure)
+        if failures:
+            sys.exit(1)
+        print("Done! All {} measurements are within tolerance.".format(len(results)))
+
+
+if __name__ == '__main__':
+    main()
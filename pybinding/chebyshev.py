@@ -15,20 +15,24 @@ from .system import System
 from .utils.time import timed
 from .support.deprecated import LoudDeprecationWarning
 
-__all__ = ['KPM', 'kpm', 'kpm_cuda', 'SpatialLDOS',
-           'jackson_kernel', 'lorentz_kernel', 'dirichlet_kernel']
+__all__ = ['KPM', 'kpm', 'kpm_cuda', 'kpm_mkl', 'kpm_mpi', 'kpm_mpi_shared', 'kpm_out_of_core', 'OutOfCoreKPM',
+           'SpatialLDOS', 'KPMMoments', 'estimate_kpm_memory', 'jackson_kernel', 'lorentz_kernel',
+           'dirichlet_kernel']
 
 
 class SpatialLDOS:
     """Holds the results of :meth:`KPM.calc_spatial_ldos`
 
     It behaves like a product of a :class:`.Series` and a :class:`.StructureMap`.
+    The `data` may be stored in reduced precision: `float32` or `int16` fixed point values
+    which are multiplied by the per-site `scales`, see :meth:`KPM.calc_spatial_ldos`.
     """
 
-    def __init__(self, data, energy, structure):
+    def __init__(self, data, energy, structure, scales=None):
         self.data = data
         self.energy = energy
         self.structure = structure
+        self.scales = scales
 
     def structure_map(self, energy):
         """Return a :class:`.StructureMap` of the spatial LDOS at the given energy
@@ -43,7 +47,10 @@ class SpatialLDOS:
         :class:`.StructureMap`
         """
         idx = np.argmin(abs(self.energy - energy))
-        return self.structure.with_data(self.data[idx])
+        data = self.data[idx]
+        if self.scales is not None:
+            data = data * self.scales
+        return self.structure.with_data(data)
 
     def ldos(self, position, sublattice=""):
         """Return the LDOS as a function of energy at a specific position
@@ -58,10 +65,118 @@ class SpatialLDOS:
         :class:`.Series`
         """
         idx = self.structure.find_nearest(position, sublattice)
-        return results.Series(self.energy, self.data[:, idx],
+        data = self.data[:, idx]
+        if self.scales is not None:
+            data = data * self.scales[idx]
+        return results.Series(self.energy, data,
                               labels=dict(variable="E (eV)", data="LDOS", columns="orbitals"))
 
 
+class KPMMoments:
+    """Holds the undamped KPM moments of a DOS, LDOS or Green's function calculation
+
+    The moments are the expensive part of a KPM calculation. Keep them to reconstruct
+    the result later for any energy array, kernel or a wider broadening -- without
+    iterating over the Hamiltonian again. They can also be saved to disk, see :meth:`save`.
+    Returned by :meth:`KPM.calc_dos_moments`, :meth:`KPM.calc_ldos_moments` and
+    :meth:`KPM.calc_greens_moments`.
+
+    Attributes
+    ----------
+    kind : str
+        The calculation which produced the moments: "dos", "ldos" or "greens".
+    kernel : Kernel
+        The default kernel of :meth:`reconstruct`: the one used by the KPM calculation
+        or :func:`jackson_kernel` for loaded moments.
+    checkpoint : Optional[_cpp.KPMCheckpoint]
+        The recursion state needed by :meth:`KPM.extend_moments` to compute more moments,
+        if it was requested from :meth:`KPM.calc_dos_moments` or :meth:`KPM.calc_ldos_moments`.
+    """
+
+    kinds = ("dos", "ldos", "greens")
+
+    def __init__(self, impl, kind, kernel=None, checkpoint=None):
+        if kind not in self.kinds:
+            raise ValueError("Unknown kind of KPM moments: '{}'".format(kind))
+        self.impl = impl
+        self.kind = kind
+        self.kernel = kernel if kernel is not None else jackson_kernel()
+        self.checkpoint = checkpoint
+
+    def __getstate__(self):
+        """The kernel isn't pickled: loaded moments get the default, see :attr:`kernel`"""
+        return dict(impl=self.impl, kind=self.kind, checkpoint=self.checkpoint)
+
+    def __setstate__(self, state):
+        self.__init__(state["impl"], state["kind"], checkpoint=state["checkpoint"])
+
+    @property
+    def data(self) -> np.ndarray:
+        """Moments array with `shape == (num_moments, num_results)`"""
+        return self.impl.data
+
+    @property
+    def scaling_factors(self) -> tuple:
+        """A tuple of KPM scaling factors `a` and `b`"""
+        return self.impl.scaling_factors
+
+    @property
+    def num_moments(self) -> int:
+        return self.impl.num_moments
+
+    def truncated(self, num_moments):
+        """Return only the first `num_moments`, i.e. a result with a wider broadening"""
+        return KPMMoments(self.impl.truncated(num_moments), self.kind, self.kernel)
+
+    def reconstruct(self, energy, broadening=0.0, kernel=None):
+        """Reconstruct the function of the original calculation from the moments
+
+        Parameters
+        ----------
+        energy : ndarray
+            Energy value array.
+        broadening : float
+            The moments are truncated to the number needed by the kernel for this broadening.
+            It can't be narrower than the original calculation. By default, all the moments
+            are used.
+        kernel : Optional[Kernel]
+            Damping kernel, see :attr:`kernel` for the default.
+
+        Returns
+        -------
+        :class:`~pybinding.Series` or ndarray
+            A series for the DOS and LDOS (one column per orbital of the LDOS site, see
+            :meth:`KPM.calc_ldos`). For the Green's function, an array of the same size as
+            `energy` or with `shape == (len(j), energy.size)` for multiple columns `j`.
+        """
+        energy = np.asarray(energy, dtype=np.float64)
+        kernel = kernel if kernel is not None else self.kernel
+        if self.kind == "greens":
+            result = self.impl.greens(energy, kernel, broadening)
+            return result[0] if result.shape[0] == 1 else result
+
+        data = self.impl.spectral_density(energy, kernel, broadening)
+        label = "DOS" if self.kind == "dos" else "LDOS"
+        return results.Series(energy, data.squeeze(), labels=dict(variable="E (eV)", data=label,
+                                                                  columns="orbitals"))
+
+    def save(self, file):
+        """Save the moments to an `.npz` file, see :meth:`load`
+
+        The kernel isn't saved: it must be given again to :meth:`reconstruct` after loading.
+        Neither is the checkpoint: use :func:`pybinding.save` to keep the moments extendable.
+        """
+        a, b = self.scaling_factors
+        np.savez(file, data=self.data, a=a, b=b, kind=self.kind)
+
+    @staticmethod
+    def load(file, kernel=None):
+        """Load moments from a file created by :meth:`save`"""
+        with np.load(file) as f:
+            impl = _cpp.KPMMoments(f["data"], float(f["a"]), float(f["b"]))
+            return KPMMoments(impl, str(f["kind"]), kernel)
+
+
 class KPM:
     """The common interface for various KPM implementations
 
@@ -100,6 +215,29 @@ class KPM:
         """The damping kernel"""
         return self.impl.kernel
 
+    @property
+    def stats(self) -> dict:
+        """Performance breakdown of the last computation
+
+        Includes the time of each phase (bounds, reordering, format conversion,
+        starter vectors, matrix-vector products, collection and reconstruction),
+        the estimated memory traffic per KPM iteration, the achieved bandwidth
+        and the busy time of each worker thread. The stochastic DOS also gives
+        the number of random vectors and the estimated relative error.
+        """
+        stats = self.impl.stats
+        return stats.as_dict() if hasattr(stats, "as_dict") else dict(stats)
+
+    @property
+    def progress(self) -> dict:
+        """Progress of the running calculation: `done` of `total` units and `running`
+
+        This may be polled from another thread while a calculation is running, e.g. by a
+        service which doesn't show the progress messages (`silent=True`). The workers only
+        update a counter and the progress messages are printed at a fixed interval.
+        """
+        return getattr(self.impl, "progress", dict(done=0, total=0, running=False))
+
     def report(self, shortform=False):
         """Return a report of the last computation
 
@@ -127,9 +265,11 @@ class KPM:
         num_moments : int
             The number of moments to calculate.
         alpha : array_like
-            The starting state vector of the KPM iteration.
+            The starting state vector of the KPM iteration. A 2D array with one state
+            per column computes the moments of all the states together (SIMD batches).
         beta : Optional[array_like]
-            If not given, defaults to :math:`\beta = \alpha`.
+            If not given, defaults to :math:`\beta = \alpha`. Must have the same
+            shape as `alpha`: column `j` is paired with column `j` of `alpha`.
         op : Optional[csr_matrix]
             Operator in the form of a sparse matrix. If omitted, an identity matrix
             is assumed: :math:`\mu_n = <\beta|T_n(H)|\alpha>`.
@@ -137,15 +277,23 @@ class KPM:
         Returns
         -------
         ndarray
+            Array of `num_moments` values, or `shape == (num_moments, alpha.shape[1])`
+            for a 2D `alpha`.
         """
         from scipy.sparse import csr_matrix
 
-        if beta is None:
-            beta = []
         if op is None:
             op = csr_matrix([])
         else:
             op = op.tocsr()
+
+        if np.ndim(alpha) == 2:
+            alpha = np.asarray(alpha, dtype=np.complex128)
+            beta = np.empty((0, 0)) if beta is None else np.asarray(beta, dtype=np.complex128)
+            return self.impl.batch_moments(num_moments, alpha, beta, op)
+
+        if beta is None:
+            beta = []
         return self.impl.moments(num_moments, alpha, beta, op)
 
     def calc_greens(self, i, j, energy, broadening):
@@ -153,8 +301,37 @@ class KPM:
 
         Parameters
         ----------
-        i, j : int
-            Hamiltonian indices.
+        i, j : int or array_like
+            Hamiltonian indices. Multiple `i` rows are computed together in SIMD batches.
+        energy : ndarray
+            Energy value array.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+            Lower values result in longer calculation time.
+
+        Returns
+        -------
+        ndarray
+            Array of the same size as the input `energy`. For array `i` and `j`, the
+            shape is `(len(i), len(j), energy.size)`.
+        """
+        if np.ndim(i) == 0:
+            return self.impl.calc_greens(i, j, energy, broadening)
+
+        result = self.calc_greens_block(i, np.atleast_1d(j), energy, broadening)
+        return result if np.ndim(j) else result[:, 0, :]
+
+    def calc_greens_block(self, rows, cols, energy, broadening):
+        """Calculate a block of the Green's function matrix in a single KPM pass
+
+        The Hamiltonian is optimized only once for all of the indices and the rows
+        are computed together in parallel SIMD batches. This is much faster than
+        calling :meth:`calc_greens` once per row, e.g. for a lead-contact region.
+
+        Parameters
+        ----------
+        rows, cols : array_like
+            Hamiltonian indices of the block.
         energy : ndarray
             Energy value array.
         broadening : float
@@ -164,9 +341,42 @@ class KPM:
         Returns
         -------
         ndarray
-            Array of the same size as the input `energy`.
+            Array with `shape == (len(rows), len(cols), energy.size)`.
+        """
+        rows = np.atleast_1d(rows).tolist()
+        cols = np.atleast_1d(cols).tolist()
+        result = self.impl.calc_greens_block(rows, cols, energy, broadening)
+        return result.reshape(len(rows), len(cols), np.size(energy))
+
+    def propagate(self, psi0, times):
+        r"""Calculate the time evolution of one or more states
+
+        The evolution operator is expanded in Chebyshev polynomials of the Hamiltonian:
+
+        .. math::
+            \psi(t) = e^{-iHt} \psi_0
+
+        with :math:`\hbar = 1`, i.e. time is given in units of :math:`\hbar / E`.
+        All the `times` are computed with a single expansion so adding more of them
+        is cheap. The required number of terms grows linearly with the largest time.
+
+        Parameters
+        ----------
+        psi0 : array_like
+            The initial state vector or a 2D array with one initial state per column.
+        times : array_like
+            Values of time for which the states are calculated.
+
+        Returns
+        -------
+        ndarray
+            Array with `shape == (times.size,) + psi0.shape`.
         """
-        return self.impl.calc_greens(i, j, energy, broadening)
+        psi0 = np.asarray(psi0, dtype=np.complex128)
+        states = psi0.reshape(psi0.shape[0], -1)
+        times = np.atleast_1d(np.asarray(times, dtype=np.float64))
+        result = self.impl.propagate(states, times)
+        return result.reshape((times.size,) + psi0.shape)
 
     def calc_ldos(self, energy, broadening, position, sublattice="", reduce=True):
         """Calculate the local density of states as a function of energy
@@ -200,9 +410,14 @@ class KPM:
         return results.Series(energy, ldos.squeeze(), labels=dict(variable="E (eV)", data="LDOS",
                                                                   columns="orbitals"))
 
-    def calc_spatial_ldos(self, energy, broadening, shape, sublattice=""):
+    def calc_spatial_ldos(self, energy, broadening, shape, sublattice="", num_random=0,
+                          precision="double", symmetry=None):
         """Calculate the LDOS as a function of energy and space (in the area of the given shape)
 
+        The sites are computed together in batches of `ldos_chunk_size` (an option of
+        :func:`kpm`). For multi-orbital models, the LDOS of each site is summed over
+        its orbitals.
+
         Parameters
         ----------
         energy : ndarray
@@ -215,18 +430,119 @@ class KPM:
         sublattice : str
             Only look for sites of a specific sublattice, within the `shape`.
             The default value considers any sublattice.
+        num_random : int
+            If larger than zero, the LDOS is estimated stochastically from this many random
+            vectors instead of computing each site separately. The cost doesn't depend on
+            the number of sites, so this is the way to map large systems. The relative error
+            decreases as `1 / sqrt(num_random)`.
+        precision : str
+            Storage of the result: "double", "single" (`float32`, half the memory) or
+            "fixed16" (`int16` scaled per site, a quarter of the memory with about
+            4 significant digits relative to the peak of each site). The reduced precision
+            map is filled one chunk of sites at a time so the full map never exists in
+            double precision.
+        symmetry : Union[bool, List[array_like]]
+            Compute only one site of each set of symmetry-equivalent sites and copy its LDOS
+            to the others. `True` tries the rotations by 60, 90, 120 and 180 degrees and the
+            x and y mirrors. Alternatively, give a list of 2x2 or 3x3 rotation or reflection
+            matrices. They act about the centroid of the system and each one is only used if
+            it leaves the Hamiltonian unchanged. Only for the exact LDOS in double precision.
 
         Returns
         -------
         :class:`SpatialLDOS`
         """
-        ldos = self.impl.calc_spatial_ldos(energy, broadening, shape, sublattice)
+        if symmetry is not None and symmetry is not False:
+            if num_random > 0 or precision != "double":
+                raise ValueError("The symmetry reduction needs `num_random=0` and "
+                                 "`precision='double'`")
+            operations = []
+            if symmetry is not True:
+                for m in symmetry:
+                    m = np.atleast_2d(np.asarray(m, dtype=np.float32))
+                    if m.shape not in ((2, 2), (3, 3)):
+                        raise ValueError("The symmetry operations must be 2x2 or 3x3 matrices")
+                    full = np.identity(3, dtype=np.float32)
+                    full[:m.shape[0], :m.shape[1]] = m
+                    operations.append(full)
+            ldos = self.impl.calc_symmetric_spatial_ldos(energy, broadening, shape, operations,
+                                                         sublattice)
+            scales = None
+        elif precision == "double":
+            ldos = self.impl.calc_spatial_ldos(energy, broadening, shape, sublattice, num_random)
+            scales = None
+        elif precision in ("single", "fixed16"):
+            ldos, scales = self.impl.calc_compact_spatial_ldos(energy, broadening, shape,
+                                                               precision, sublattice, num_random)
+        else:
+            raise ValueError("Unknown precision '{}': use 'double', 'single' "
+                             "or 'fixed16'".format(precision))
+
         smap = self.system[shape.contains(*self.system.positions)]
         if sublattice:
             smap = smap[smap.sub == sublattice]
-        return SpatialLDOS(ldos, energy, smap)
+        return SpatialLDOS(ldos, energy, smap, scales)
+
+    def calc_probing_ldos(self, energy, broadening, distance=4):
+        """Calculate the LDOS of every site from probing vectors
+
+        The sites are colored so that any two within `distance` hoppings of each other get
+        different colors. Each color is computed as a single vector, the sum of its sites, so
+        the cost is the number of colors instead of the number of sites. The moments up to
+        `distance` are exact and the rest is approximated by ignoring the Green's function
+        between sites of the same color, which decays quickly with distance in large systems.
+        For multi-orbital models, the LDOS of each site is summed over its orbitals.
+
+        Parameters
+        ----------
+        energy : ndarray
+            Values for which the LDOS is calculated.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+            Lower values result in longer calculation time.
+        distance : int
+            Minimum number of hoppings between the sites of the same color. Larger values are
+            more accurate but need more colors. A value larger than the size of the system
+            gives the exact LDOS of every site.
+
+        Returns
+        -------
+        :class:`SpatialLDOS`
+        """
+        ldos = self.impl.calc_probing_ldos(energy, broadening, distance)
+        return SpatialLDOS(ldos, energy, self.system)
+
+    def calc_local_charge(self, chemical_potential, temperature, broadening, num_random=0):
+        """Calculate the local charge of every site at the given chemical potential
 
-    def calc_dos(self, energy, broadening, num_random=1):
+        The charge is the diagonal of the density matrix `f(H)`, where `f` is the Fermi-Dirac
+        distribution, from a single Chebyshev expansion of `f`. It's summed over the orbitals
+        of each site (the spin degeneracy is not included). This avoids a full
+        diagonalization and it's meant for self-consistent calculations.
+
+        Parameters
+        ----------
+        chemical_potential : float
+            Fermi energy of the distribution.
+        temperature : float
+            Temperature in Kelvin. At zero temperature, the distribution is a step.
+        broadening : float
+            Energy resolution of the expansion, like for the LDOS. Lower values result in
+            a sharper Fermi step and longer calculation time.
+        num_random : int
+            If larger than zero, the charge is estimated stochastically from this many random
+            vectors, see :meth:`calc_spatial_ldos`. Otherwise, each orbital is computed exactly
+            which scales quadratically with the system size.
+
+        Returns
+        -------
+        :class:`~pybinding.StructureMap`
+        """
+        charge = self.impl.calc_local_charge(chemical_potential, temperature, broadening,
+                                             num_random)
+        return self.system.with_data(charge)
+
+    def calc_dos(self, energy, broadening, num_random=1, target_error=0.0):
         """Calculate the density of states as a function of energy
 
         Parameters
@@ -242,14 +558,262 @@ class KPM:
             linearly. Fortunately, result quality also improves with system size, so the DOS of
             very large systems can be calculated accurately with only a small number of random
             vectors.
+        target_error : float
+            Stop adding random vectors once the estimated relative error of the result is
+            below this value. In that case, `num_random` is the upper bound. The achieved
+            error and number of vectors are given by :attr:`stats`. Disabled by default.
 
         Returns
         -------
         :class:`~pybinding.Series`
         """
-        dos = self.impl.calc_dos(energy, broadening, num_random)
+        dos = self.impl.calc_dos(energy, broadening, num_random, target_error)
         return results.Series(energy, dos, labels=dict(variable="E (eV)", data="DOS"))
 
+    def calc_dos_k(self, energy, broadening, k_points, num_random=1):
+        """Calculate the DOS of a periodic model averaged over the given k-points
+
+        All the Bloch Hamiltonians are computed in a single KPM calculation: they share
+        the energy bounds, the optimized matrix and the random vectors. This is much faster
+        than a separate :meth:`calc_dos` for each wave vector.
+
+        Parameters
+        ----------
+        energy : ndarray
+            Values for which the DOS is calculated.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+        k_points : array_like
+            Wave vectors with `shape == (num_k, ndim)`, e.g. a uniform grid
+            in the Brillouin zone. The DOS is their unweighted average.
+        num_random : int
+            The number of random vectors, see :meth:`calc_dos`. Each vector covers
+            all the k-points.
+
+        Returns
+        -------
+        :class:`~pybinding.Series`
+        """
+        k_points = np.atleast_2d(np.asarray(k_points, dtype=np.float32))
+        if k_points.shape[1] > 3:
+            raise ValueError("The k-points must have at most 3 components")
+        k_points = np.pad(k_points, ((0, 0), (0, 3 - k_points.shape[1])), "constant")
+        dos = self.impl.calc_dos_k(energy, broadening, list(k_points), num_random)
+        return results.Series(energy, dos, labels=dict(variable="E (eV)", data="DOS"))
+
+    def calc_projected_dos(self, energy, broadening, projections="sublattice", num_random=1):
+        """Calculate the DOS projected onto each sublattice, orbital or set of sites
+
+        All the projections are computed from the same random vectors in a single pass:
+        only the moments are split by projection, so the cost doesn't depend on their number.
+        The local moments need one matrix-vector product per moment, which is about twice
+        the work of :meth:`calc_dos`. Projections which cover the whole system once add up
+        to the DOS of the same random vectors.
+
+        Parameters
+        ----------
+        energy : ndarray
+            Values for which the DOS is calculated.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+        projections : Union[str, dict]
+            "sublattice" gives one DOS per sublattice and "orbital" one per orbital of each
+            sublattice, named like "A[0]". Otherwise, a dict of boolean masks: each one
+            selects sites (size `num_sites`) or Hamiltonian indices (`hamiltonian_size`).
+        num_random : int
+            The number of random vectors, see :meth:`calc_dos`.
+
+        Returns
+        -------
+        Dict[str, :class:`~pybinding.Series`]
+            The DOS of each projection by name.
+        """
+        if isinstance(projections, str):
+            if projections not in ("sublattice", "orbital"):
+                raise ValueError("Unknown projections '{}': use 'sublattice', 'orbital' "
+                                 "or a dict of masks".format(projections))
+            names, dos = self.impl.calc_sublattice_dos(energy, broadening, num_random,
+                                                       projections == "orbital")
+        else:
+            names = list(projections.keys())
+            masks = [np.asarray(projections[name], dtype=bool) for name in names]
+            dos = self.impl.calc_projected_dos(energy, broadening, masks, num_random)
+
+        labels = dict(variable="E (eV)", data="DOS")
+        return {name: results.Series(energy, dos[:, j], labels=dict(labels, title=name))
+                for j, name in enumerate(names)}
+
+    def calc_spectral_function(self, k_points, energy, broadening):
+        """Calculate the spectral function `A(k, E)` of plane waves on the site positions
+
+        The plane wave of each k-point `exp(i k.r) / sqrt(N)` uses the position of every site
+        (orbital) so the result is the spectral function unfolded onto the wave vectors, e.g.
+        the ARPES-like bands of a large supercell with disorder. Its energy integral is 1.
+        All the plane waves are generated and computed in a single parallel calculation.
+
+        Parameters
+        ----------
+        k_points : array_like
+            Wave vectors with `shape == (num_k, ndim)`, e.g. a path through the Brillouin zone.
+        energy : ndarray
+            Values for which the spectral function is calculated.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+
+        Returns
+        -------
+        :class:`~pybinding.Sweep`
+            With `x` as the index of the k-point and `y` as the energy.
+        """
+        k_points = np.atleast_2d(np.asarray(k_points, dtype=np.float32))
+        if k_points.shape[1] > 3:
+            raise ValueError("The k-points must have at most 3 components")
+        k_points = np.pad(k_points, ((0, 0), (0, 3 - k_points.shape[1])), "constant")
+        data = self.impl.calc_spectral_function(list(k_points), energy, broadening)
+        return results.Sweep(np.arange(len(k_points)), energy, np.transpose(data),
+                             labels=dict(x="k", y="E (eV)", data="A(k, E)"),
+                             tags=dict(k_points=k_points))
+
+    def calc_dos_moments(self, broadening, num_random=1, target_error=0.0, checkpoint=False):
+        """Calculate the moments of :meth:`calc_dos` to reconstruct the DOS later
+
+        Parameters are the same as :meth:`calc_dos` without the energy.
+
+        checkpoint : bool
+            Keep the state of the recursion so that :meth:`extend_moments` can compute
+            more moments later. It takes the memory of two vectors per random vector
+            and it can't be combined with a `target_error`.
+
+        Returns
+        -------
+        :class:`KPMMoments`
+        """
+        cp = _cpp.KPMCheckpoint() if checkpoint else None
+        impl = self.impl.calc_dos_moments(broadening, num_random, target_error, cp)
+        return KPMMoments(impl, "dos", self.kernel, cp)
+
+    def quantization_error(self, broadening, num_random=1):
+        """Compare the DOS moments of a lossy `matrix_format` with a full precision reference
+
+        The formats `"ELL_BF16"` and `"ELL_INT8"` store the values of a real Hamiltonian with
+        16 or 8 bits to save memory bandwidth. This computes the stochastic DOS moments with
+        the configured format and with `"ELL"` for the same random vectors. A small sample
+        is enough: the error comes from the matrix, not from the random vectors.
+
+        Parameters
+        ----------
+        broadening : float
+            Sets the number of moments, like :meth:`calc_dos`.
+        num_random : int
+            The number of random vectors.
+
+        Returns
+        -------
+        dict
+            The `matrix_format` which was compared, the `max_error` and `rms_error` of the
+            moments relative to the first one, `num_moments` and `num_random`.
+        """
+        return self.impl.quantization_error(broadening, num_random)
+
+    def calc_ldos_moments(self, broadening, position, sublattice="", checkpoint=False):
+        """Calculate the moments of :meth:`calc_ldos` to reconstruct the LDOS later
+
+        Parameters are the same as :meth:`calc_ldos` without the energy. There's one set
+        of moments per orbital of the site: :meth:`KPMMoments.reconstruct` gives one
+        column per orbital.
+
+        checkpoint : bool
+            Keep the state of the recursion so that :meth:`extend_moments` can compute
+            more moments later. It takes the memory of two vectors per orbital.
+
+        Returns
+        -------
+        :class:`KPMMoments`
+        """
+        cp = _cpp.KPMCheckpoint() if checkpoint else None
+        impl = self.impl.calc_ldos_moments(broadening, position, sublattice, cp)
+        return KPMMoments(impl, "ldos", self.kernel, cp)
+
+    def ensemble_dos_moments(self, factory, num_realizations, broadening, num_random=1,
+                             bounds_margin=0.05):
+        """Calculate the DOS moments averaged over an ensemble of disorder realizations
+
+        The Hamiltonian of the next realization is built while the moments of the current
+        one are being computed. All the realizations share the energy bounds and, as long as
+        the sparsity pattern doesn't change, the optimized matrix structure. Native modifiers
+        like :func:`~pybinding.anderson_disorder` are best suited: Python modifiers hold the GIL
+        while they are being applied.
+
+        Parameters
+        ----------
+        factory : Callable[[int], Model]
+            Returns the model of realization `n`, e.g. with `anderson_disorder(width, seed=n)`.
+        num_realizations : int
+            Number of models in the ensemble.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+        num_random : int
+            The number of random vectors per realization, see :meth:`calc_dos`.
+        bounds_margin : float
+            The shared energy bounds are the ones of this KPM's model widened by this
+            fraction. It's an error if the spectrum of any realization is wider.
+
+        Returns
+        -------
+        :class:`KPMMoments`
+        """
+        impl = self.impl.ensemble_dos_moments(factory, num_realizations, broadening,
+                                              num_random, bounds_margin)
+        return KPMMoments(impl, "dos", self.kernel)
+
+    def extend_moments(self, moments, num_moments):
+        """Continue the recursion of checkpointed moments up to `num_moments`
+
+        Only the new moments are computed: the result is the same as a calculation which
+        asked for `num_moments` from the start. The checkpoint may also come from moments
+        loaded with :func:`pybinding.load` to restart a long calculation, but it must
+        be extended using the same model.
+
+        Parameters
+        ----------
+        moments : KPMMoments
+            Returned by :meth:`calc_dos_moments` or :meth:`calc_ldos_moments`
+            with `checkpoint=True`.
+        num_moments : int
+            The new total number of moments. It's rounded up in the same way as
+            the moments of a broadening.
+
+        Returns
+        -------
+        :class:`KPMMoments`
+            The extended moments. They share the checkpoint which now points to the end
+            of the new recursion: extending the original `moments` again is an error.
+        """
+        if moments.checkpoint is None:
+            raise ValueError("The moments don't have a checkpoint: "
+                             "use `checkpoint=True` to make them extendable")
+        impl = self.impl.extend_moments(moments.impl, moments.checkpoint, num_moments)
+        return KPMMoments(impl, moments.kind, moments.kernel, moments.checkpoint)
+
+    def calc_greens_moments(self, i, j, broadening):
+        """Calculate the moments of :meth:`calc_greens` to reconstruct the Green's function later
+
+        Parameters
+        ----------
+        i : int
+            Hamiltonian row index.
+        j : int or array_like
+            Hamiltonian column indices.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+
+        Returns
+        -------
+        :class:`KPMMoments`
+        """
+        impl = self.impl.calc_greens_moments(i, np.atleast_1d(j), broadening)
+        return KPMMoments(impl, "greens", self.kernel)
+
     def deferred_ldos(self, energy, broadening, position, sublattice=""):
         """Same as :meth:`calc_ldos` but for parallel computation: see the :mod:`.parallel` module
 
@@ -274,6 +838,71 @@ class KPM:
         """
         return self.impl.deferred_ldos(energy, broadening, position, sublattice)
 
+    def deferred_moments(self, num_moments, alpha, beta=None, op=None):
+        """Same as :meth:`moments` for a single `alpha` vector but for parallel computation
+
+        Returns
+        -------
+        Deferred
+            The `result` is the array of moments.
+        """
+        from scipy.sparse import csr_matrix
+        op = csr_matrix([]) if op is None else op.tocsr()
+        return self.impl.deferred_moments(num_moments, alpha, [] if beta is None else beta, op)
+
+    def deferred_spatial_ldos(self, energy, broadening, shape, sublattice="", num_random=0):
+        """Same as :meth:`calc_spatial_ldos` but for parallel computation
+
+        Returns
+        -------
+        Deferred
+            The `result` is the raw LDOS array: one column per site.
+        """
+        return self.impl.deferred_spatial_ldos(energy, broadening, shape, sublattice, num_random)
+
+    def deferred_dos(self, energy, broadening, num_random=1, target_error=0.0):
+        """Same as :meth:`calc_dos` but for parallel computation
+
+        Returns
+        -------
+        Deferred
+            The `result` is the array of DOS values.
+        """
+        return self.impl.deferred_dos(energy, broadening, num_random, target_error)
+
+    def deferred_greens(self, i, j, energy, broadening):
+        """Same as :meth:`calc_greens` for a single `j` but for parallel computation
+
+        Returns
+        -------
+        Deferred
+            The `result` is the array of Green's function values.
+        """
+        return self.impl.deferred_greens(i, j, energy, broadening)
+
+    def deferred_conductivity(self, chemical_potential, broadening, temperature,
+                              direction="xx", num_random=1, num_points=1000):
+        """Same as :meth:`calc_conductivity` for a single `direction` but for parallel computation
+
+        Returns
+        -------
+        Deferred
+            The `result` is the array of conductivity values, not divided by the volume.
+        """
+        return self.impl.deferred_conductivity(chemical_potential, broadening, temperature,
+                                               direction, num_random, num_points)
+
+    def deferred_local_charge(self, chemical_potential, temperature, broadening, num_random=0):
+        """Same as :meth:`calc_local_charge` but for parallel computation
+
+        Returns
+        -------
+        Deferred
+            The `result` is the array of charges, one per site.
+        """
+        return self.impl.deferred_local_charge(chemical_potential, temperature, broadening,
+                                               num_random)
+
     def calc_conductivity(self, chemical_potential, broadening, temperature,
                           direction="xx", volume=1.0, num_random=1, num_points=1000):
         """Calculate Kubo-Bastin electrical conductivity as a function of chemical potential
@@ -292,8 +921,10 @@ class KPM:
             Lower values result in longer calculation time.
         temperature : float
             Value of temperature for the Fermi-Dirac distribution.
-        direction : Optional[str]
+        direction : Union[str, List[str]]
             Direction in which the conductivity is calculated. E.g., "xx", "xy", "zz", etc.
+            A list of directions, e.g. `["xx", "xy", "yy"]`, are all computed together from
+            the same random vectors which is faster than separate calls.
         volume : Optional[float]
             The volume of the system.
         num_random : int
@@ -307,16 +938,78 @@ class KPM:
 
         Returns
         -------
-        :class:`~pybinding.Series`
+        :class:`~pybinding.Series` or List[:class:`~pybinding.Series`]
+            A list of results (in the same order) if `direction` is a list.
         """
+        def make_series(data):
+            if volume != 1.0:
+                data /= volume
+            return results.Series(chemical_potential, data,
+                                  labels=dict(variable=r"$\mu$ (eV)", data="$\sigma (e^2/h)$"))
+
+        if isinstance(direction, str):
+            return make_series(self.impl.calc_conductivity(chemical_potential, broadening,
+                                                           temperature, direction, num_random,
+                                                           num_points))
         data = self.impl.calc_conductivity(chemical_potential, broadening, temperature,
-                                           direction, num_random, num_points)
+                                           list(direction), num_random, num_points)
+        return [make_series(d) for d in data]
+
+    def calc_greenwood_conductivity(self, chemical_potential, broadening, direction="xx",
+                                    volume=1.0, num_random=1):
+        """Calculate the Kubo-Greenwood DC conductivity as a function of chemical potential
+
+        The result is at zero temperature and in the same units as :meth:`calc_conductivity`.
+        The random vectors are projected onto each chemical potential during the Chebyshev
+        recursion, so the memory is linear in the system size and independent of the number
+        of moments. This makes it suitable for very large systems where the Kubo-Bastin
+        moment matrix would not fit. More chemical potentials than `conductivity_block_size`
+        (see :func:`kpm`) are computed in several passes.
+
+        Parameters
+        ----------
+        chemical_potential : array_like
+            Values (in eV) for which the conductivity is calculated.
+        broadening : float
+            Width (in eV) of the smallest detail which can be resolved in the chemical potential.
+        direction : str
+            A longitudinal direction: "xx", "yy" or "zz".
+        volume : Optional[float]
+            The volume of the system.
+        num_random : int
+            The number of random vectors to use for the stochastic trace.
+
+        Returns
+        -------
+        :class:`~pybinding.Series`
+        """
+        data = self.impl.calc_kubo_greenwood(chemical_potential, broadening, direction,
+                                             num_random)
         if volume != 1.0:
             data /= volume
         return results.Series(chemical_potential, data,
                               labels=dict(variable=r"$\mu$ (eV)", data="$\sigma (e^2/h)$"))
 
 
+class OutOfCoreKPM:
+    """KPM which streams the Hamiltonian from a file instead of keeping it in memory
+
+    It should not be created directly but via :func:`kpm_out_of_core`. Only the DOS
+    is available: the methods are the same as the corresponding ones of :class:`KPM`.
+    """
+
+    def __init__(self, impl):
+        self.impl = impl
+
+    scaling_factors = KPM.scaling_factors
+    kernel = KPM.kernel
+    stats = KPM.stats
+    progress = KPM.progress
+    report = KPM.report
+    calc_dos = KPM.calc_dos
+    calc_dos_moments = KPM.calc_dos_moments
+
+
 class _ComputeProgressReporter:
     def __init__(self):
         from .utils.progressbar import ProgressBar
@@ -378,11 +1071,75 @@ def kpm(model, energy_range=None, kernel="default", num_threads="auto", silent=F
     return KPM(_cpp.kpm(model, energy_range or (0, 0), **kwargs))
 
 
+def kpm_out_of_core(filename, energy_range=None, kernel="default", num_threads="auto",
+                    silent=False, **kwargs):
+    """Same as :func:`kpm` for a Hamiltonian which is read from a file made by :func:`.save_binary`
+
+    The matrix is never loaded into memory: every KPM iteration streams it from the file
+    (memory-mapped), so the Hamiltonian may be larger than the available RAM. The rows are
+    read in blocks and the next block is prefetched while the current one is computed.
+    All the random vectors of a thread share each pass over the file so :meth:`KPM.calc_dos`
+    gets cheaper per vector as `num_random` increases.
+
+    Parameters
+    ----------
+    filename : str
+        A file made by :func:`.save_binary` which includes the Hamiltonian.
+    energy_range : Optional[Tuple[float, float]]
+        By default, the bounds are estimated from the Gershgorin circles in a single pass
+        over the file. They are never too narrow but they may be a bit wider than the
+        spectrum. Give the range explicitly to skip the extra pass.
+    kernel : Kernel
+    num_threads : int
+    silent : bool
+
+    Returns
+    -------
+    :class:`~pybinding.chebyshev.OutOfCoreKPM`
+    """
+    if kernel != "default":
+        kwargs["kernel"] = kernel
+    if num_threads != "auto":
+        kwargs["num_threads"] = num_threads
+    if "progress_callback" not in kwargs:
+        kwargs["progress_callback"] = _ComputeProgressReporter()
+    if silent:
+        del kwargs["progress_callback"]
+    return OutOfCoreKPM(_cpp.kpm_out_of_core(filename, energy_range or (0, 0), **kwargs))
+
+
+def estimate_kpm_memory(model, num_moments, num_results=1, dense=False, num_threads=-1):
+    """Predict the memory of a KPM calculation (in bytes) before the model is built
+
+    Parameters
+    ----------
+    model : Model
+    num_moments : int
+        Number of moments of each result, e.g. see :meth:`KPM.moments`.
+    num_results : int
+        Number of starting vectors: LDOS indices, Green's function columns or random vectors.
+    dense : bool
+        The conductivity keeps all the Chebyshev vectors of each recursion.
+    num_threads : int
+        Number of concurrent jobs. By default, all the CPU cores.
+
+    Returns
+    -------
+    dict
+        The `peak` of building the `model`, the optimized `matrix`, the KPM `vectors`
+        of all the jobs and the collected `moments`. The `peak` total is the largest
+        of the model build and the calculation (which keeps the model).
+    """
+    return _cpp.kpm_estimate_memory(model, num_moments, num_results, dense, num_threads)
+
+
 def kpm_cuda(model, energy_range=None, kernel="default", **kwargs):
     """Same as :func:`kpm` except that it's executed on the GPU using CUDA (if supported)
 
     See :func:`kpm` for detailed parameter documentation.
     This method is only available if the C++ extension module was compiled with CUDA.
+    The GPU computes diagonal moments: LDOS, DOS and diagonal Green's function elements.
+    The Hamiltonian must use the default `matrix_format="ELL"`.
 
     Parameters
     ----------
@@ -404,6 +1161,129 @@ def kpm_cuda(model, energy_range=None, kernel="default", **kwargs):
                         "Use a different KPM implementation or recompile the module with CUDA.")
 
 
+def kpm_mkl(model, energy_range=None, kernel="default", num_threads="auto", silent=False,
+            **kwargs):
+    """Same as :func:`kpm` except that the sparse matrix products are done by Intel's MKL
+
+    See :func:`kpm` for detailed parameter documentation. This method is only available if
+    the C++ extension module was compiled with MKL (`PB_MKL`). The Hamiltonian is stored as
+    `matrix_format="CSR"` (the default here) and it's tuned once by MKL's inspector-executor
+    routines for all the following calculations. Other formats use the built-in kernels. It's
+    a vendor baseline to compare against and it may be faster on Intel CPUs. The `interleaved`
+    and `matrix_powers` options don't apply.
+
+    Parameters
+    ----------
+    model : Model
+    energy_range : Optional[Tuple[float, float]]
+    kernel : Kernel
+    num_threads : int
+    silent : bool
+
+    Returns
+    -------
+    :class:`~pybinding.chebyshev.KPM`
+    """
+    if kernel != "default":
+        kwargs["kernel"] = kernel
+    if num_threads != "auto":
+        kwargs["num_threads"] = num_threads
+    if "progress_callback" not in kwargs:
+        kwargs["progress_callback"] = _ComputeProgressReporter()
+    if silent:
+        del kwargs["progress_callback"]
+    kwargs.setdefault("matrix_format", "CSR")
+    try:
+        # noinspection PyUnresolvedReferences
+        cpp_kpm_mkl = _cpp.kpm_mkl
+    except AttributeError:
+        raise Exception("The module was compiled without MKL support.\n"
+                        "Use a different KPM implementation or recompile the module with MKL.")
+    return KPM(cpp_kpm_mkl(model, energy_range or (0, 0), **kwargs))
+
+
+def kpm_mpi(model, energy_range=None, kernel="default", silent=False, **kwargs):
+    """Same as :func:`kpm` except that the stochastic calculations are distributed using MPI
+
+    See :func:`kpm` for detailed parameter documentation.
+    This method is only available if the C++ extension module was compiled with `PB_MPI`.
+    The script must be launched on all processes, e.g. `mpirun -n 16 python script.py`.
+    The random vectors of :meth:`KPM.calc_dos` and :meth:`KPM.calc_conductivity` are split
+    between the MPI processes and every process receives the full result. All other methods
+    are computed independently on each process. The `num_threads` parameter applies per process.
+
+    Parameters
+    ----------
+    model : Model
+    energy_range : Optional[Tuple[float, float]]
+    kernel : Kernel
+    silent : bool
+
+    Returns
+    -------
+    :class:`~pybinding.chebyshev.KPM`
+    """
+    if kernel != "default":
+        kwargs["kernel"] = kernel
+    if "progress_callback" not in kwargs:
+        kwargs["progress_callback"] = _ComputeProgressReporter()
+    if silent:
+        del kwargs["progress_callback"]
+    try:
+        # noinspection PyUnresolvedReferences
+        cpp_kpm_mpi = _cpp.kpm_mpi
+    except AttributeError:
+        raise Exception("The module was compiled without MPI support.\n"
+                        "Use a different KPM implementation or recompile the module with MPI.")
+    return KPM(cpp_kpm_mpi(model, energy_range or (0, 0), **kwargs))
+
+
+def kpm_mpi_shared(model, path, energy_range=None, kernel="default", num_threads="auto",
+                   silent=False, **kwargs):
+    """Same as :func:`kpm_mpi` with a single copy of the Hamiltonian on each node
+
+    Only the first MPI process of each node builds the `model`: it saves the Hamiltonian to
+    `path` in node-local shared memory (e.g. `/dev/shm/...` on Linux) and the other processes
+    on the node map it read-only. That's one copy of the matrix per node instead of one per
+    process, so every core may run a process without running out of memory. The file is
+    removed as soon as all the processes have mapped it. The `path` must be the same on all
+    processes but it should be unique for each job running on the node.
+
+    The shared matrix is used like :func:`kpm_out_of_core`, i.e. directly without any
+    reordering or format conversion: only the DOS is available. The random vectors are
+    split between all the MPI processes like :func:`kpm_mpi`.
+
+    Parameters
+    ----------
+    model : Model
+    path : str
+        File in node-local shared memory for the Hamiltonian.
+    energy_range : Optional[Tuple[float, float]]
+    kernel : Kernel
+    num_threads : int
+    silent : bool
+
+    Returns
+    -------
+    :class:`~pybinding.chebyshev.OutOfCoreKPM`
+    """
+    if kernel != "default":
+        kwargs["kernel"] = kernel
+    if num_threads != "auto":
+        kwargs["num_threads"] = num_threads
+    if "progress_callback" not in kwargs:
+        kwargs["progress_callback"] = _ComputeProgressReporter()
+    if silent:
+        del kwargs["progress_callback"]
+    try:
+        # noinspection PyUnresolvedReferences
+        cpp_kpm_mpi_shared = _cpp.kpm_mpi_shared
+    except AttributeError:
+        raise Exception("The module was compiled without MPI support.\n"
+                        "Use a different KPM implementation or recompile the module with MPI.")
+    return OutOfCoreKPM(cpp_kpm_mpi_shared(model, path, energy_range or (0, 0), **kwargs))
+
+
 def jackson_kernel():
     """The Jackson kernel -- a good general-purpose kernel, appropriate for most applications
 
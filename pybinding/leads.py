@@ -70,19 +70,8 @@ class Lead:
         -------
         :class:`~pybinding.results.Bands`
         """
-        from scipy.linalg import eigh
-
-        h0 = self.h0.todense()
-        h1 = self.h1.todense()
-        h1t = np.conj(h1.T)
-
-        def eigenvalues(k):
-            h = h0 + h1 * np.exp(1j * k) + h1t * np.exp(-1j * k)
-            return eigh(h, eigvals_only=True)
-
         k_path = results.make_path(start, end, step=step).flatten()
-        bands = [eigenvalues(k) for k in k_path]
-        return results.Bands(k_path, np.vstack(bands))
+        return results.Bands(k_path, _cpp.calc_bands(self.impl, k_path))
 
     def plot(self, lead_length=6, **kwargs):
         """Plot the sites, hoppings and periodic boundaries of the lead
@@ -193,3 +182,26 @@ class Leads:
 
     def __len__(self):
         return len(self.impl)
+
+    def self_energy(self, broadening=1e-8, tolerance=1e-12, max_iterations=1000):
+        """Create a self-energy calculator for all leads
+
+        The returned object computes surface Green's functions using Sancho-Rubio decimation
+        with `surface_greens(lead, energies)` and self-energies with `self_energy(lead, energies)`.
+        Energies are computed in parallel and cached per (lead, energy) so the same object should
+        be reused for all calculations on the same model.
+
+        Parameters
+        ----------
+        broadening : float
+            Imaginary part added to the energy.
+        tolerance : float
+            Decimation stops once the remaining couplings are smaller than this.
+        max_iterations : int
+            Raise an error if decimation doesn't converge after this many iterations.
+
+        Returns
+        -------
+        :class:`._cpp.SelfEnergy`
+        """
+        return _cpp.SelfEnergy(self.impl, broadening, tolerance, max_iterations)
@@ -59,6 +59,30 @@ class Model(_cpp.Model):
                 if isinstance(arg, _cpp.Shape):
                     self._shape = arg
 
+    def with_modifiers(self, *args):
+        """Return a new model with the same structure and different Hamiltonian modifiers
+
+        The new model shares the :class:`.System` of this one instead of building it again,
+        so a parameter sweep over many models keeps only a single copy of the structure in
+        memory. None of the Hamiltonian modifiers of this model are carried over.
+
+        Parameters
+        ----------
+        *args
+            Usually onsite and hopping modifiers. Any structural parameters are also accepted,
+            but they will build a new system for the new model (this one is never changed).
+
+        Returns
+        -------
+        :class:`.Model`
+        """
+        model = self.__class__.__new__(self.__class__)
+        _cpp.Model.__init__(model, super().with_shared_system())
+        model._lattice = self._lattice
+        model._shape = self._shape
+        model.add(*args)
+        return model
+
     def attach_lead(self, direction, contact):
         """Attach a lead to the main system
 
@@ -78,6 +102,31 @@ class Model(_cpp.Model):
         """
         super().attach_lead(direction, contact)
 
+    def transmission(self, energies, from_lead=0, to_lead=1, self_energy=None, num_threads=-1):
+        """Calculate the transmission between two leads using recursive Green's functions
+
+        Parameters
+        ----------
+        energies : array_like
+            Energy values for which the transmission is calculated.
+        from_lead, to_lead : int
+            Indices of the leads in :attr:`.Model.leads`.
+        self_energy : Optional[:class:`._cpp.SelfEnergy`]
+            Lead self-energies made by :meth:`.Leads.self_energy`. Passing the same object to
+            multiple calls reuses its cached values. A new one is created if not given.
+        num_threads : int
+            Number of threads used for the energies: -1 -> all cores.
+
+        Returns
+        -------
+        np.ndarray
+        """
+        if self_energy is None:
+            self_energy = self.leads.self_energy()
+        transmission = _cpp.Transmission(self.raw_hamiltonian, super().leads, from_lead, to_lead)
+        return transmission.calc(self_energy, np.atleast_1d(energies).astype(np.float64),
+                                 num_threads)
+
     def structure_map(self, data):
         """Return a :class:`.StructureMap` of the model system mapped to the specified `data`
 
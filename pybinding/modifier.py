@@ -16,9 +16,11 @@ from .support.alias import AliasIndex, SplitName
 from .support.deprecated import LoudDeprecationWarning
 from .utils.misc import decorator_decorator
 
-__all__ = ['constant_potential', 'force_double_precision', 'force_complex_numbers',
+__all__ = ['anderson_disorder', 'constant_electric_field', 'constant_magnetic_field',
+           'constant_potential', 'force_double_precision', 'force_complex_numbers',
            'hopping_energy_modifier', 'hopping_generator', 'onsite_energy_modifier',
-           'site_generator', 'site_position_modifier', 'site_state_modifier']
+           'random_vacancies', 'site_generator', 'site_position_modifier', 'site_state_modifier', 'strained_hopping',
+           'onsite_expression', 'hopping_expression']
 
 
 def _process_modifier_args(args, keywords, requested_argnames):
@@ -122,7 +124,21 @@ def _sanitize_modifier_result(result, args, expected_num_return, can_be_complex)
     return result[0] if expected_num_return == 1 else result
 
 
-def _make_modifier(func, kind, init, keywords, has_sites=True, num_return=1, can_be_complex=False):
+def _gather_hopping_positions(args, requested_argnames):
+    """Indexed hopping modifiers get site indices and the positions of all sites from C++
+
+    Only the positions which the modifier function requested are gathered.
+    """
+    energy, row, col, x, y, z, shift, hop_id = args
+    source, destination = [], []
+    for axis, (name, pos) in enumerate(zip("xyz", (x, y, z))):
+        source.append(pos[row] if name + "1" in requested_argnames else None)
+        destination.append(pos[col] - shift[axis] if name + "2" in requested_argnames else None)
+    return [energy] + source + destination + [hop_id, row, col]
+
+
+def _make_modifier(func, kind, init, keywords, has_sites=True, num_return=1, can_be_complex=False,
+                   prepare_args=None):
     """Turn a regular function into a modifier of the desired kind
 
     Parameters
@@ -141,6 +157,8 @@ def _make_modifier(func, kind, init, keywords, has_sites=True, num_return=1, can
         Expected number of return values.
     can_be_complex : bool
         The modifier may return a complex result even if the input is real.
+    prepare_args : Optional[callable]
+        Turns the arguments from C++ into the `keywords` arguments: `f(args, requested_argnames)`.
 
     Returns
     -------
@@ -151,6 +169,8 @@ def _make_modifier(func, kind, init, keywords, has_sites=True, num_return=1, can
     requested_argnames = tuple(inspect.signature(func).parameters.keys())
 
     def apply_func(*args):
+        if prepare_args:
+            args = prepare_args(args, requested_argnames)
         requested_kwargs = _process_modifier_args(args, keywords, requested_argnames)
         result = func(**requested_kwargs)
         return _sanitize_modifier_result(result, args, num_return, can_be_complex)
@@ -208,6 +228,9 @@ def site_state_modifier(min_neighbors=0):
     ndarray
         A modified `state` argument or an `ndarray` of the same dtype and shape.
 
+    Large systems are passed to the function in parts of about a million sites at a time,
+    so it shouldn't depend on seeing all sites in a single call.
+
     Examples
     --------
     ::
@@ -254,6 +277,9 @@ def site_position_modifier(*_):
     tuple of ndarray
         Modified 'x, y, z' arguments or 3 `ndarray` objects of the same dtype and shape.
 
+    Large systems are passed to the function in parts of about a million sites at a time,
+    so it shouldn't depend on seeing all sites in a single call.
+
     Examples
     --------
     ::
@@ -329,7 +355,7 @@ def onsite_energy_modifier(is_double=False, **kwargs):
 
 
 @decorator_decorator
-def hopping_energy_modifier(is_double=False, is_complex=False, **kwargs):
+def hopping_energy_modifier(is_double=False, is_complex=False, indexed=False, **kwargs):
     """Modify the hopping energy, e.g.\  to apply a magnetic field
 
     Parameters
@@ -343,6 +369,11 @@ def hopping_energy_modifier(is_double=False, is_complex=False, **kwargs):
         modifier has returned complex numbers for real input. Manually setting this
         argument to `True` will speed up model build time slightly, but it's not
         necessary for correct operation.
+    indexed : bool
+        The modifier is given the indices of the sites (`row` and `col`) and only the
+        positions which it requests are gathered from them. This saves memory, so the
+        modifier is called fewer times with larger arrays (sized by the available memory).
+        It's much faster for large models if the function doesn't need all the positions.
 
     Notes
     -----
@@ -356,6 +387,8 @@ def hopping_energy_modifier(is_double=False, is_complex=False, **kwargs):
         Hopping identifier: can be checked for equality with hopping names specified
         in :class:`.Lattice`. For example, `energy[hop_id == 't_nn'] *= 1.1` will only
         modify the energy of the hopping family named `t_nn`.
+    row, col : ndarray of int
+        Only with `indexed=True`: read-only system indices of the two sites.
 
     The function must return:
 
@@ -382,10 +415,13 @@ def hopping_energy_modifier(is_double=False, is_complex=False, **kwargs):
     if "double" in kwargs:
         warnings.warn("Use `is_double` parameter name instead of `double`", LoudDeprecationWarning)
         is_double = kwargs["double"]
+    keywords = "energy, x1, y1, z1, x2, y2, z2, hop_id"
     return functools.partial(_make_modifier, kind=_cpp.HoppingModifier,
-                             init=dict(is_double=is_double, is_complex=is_complex),
+                             init=dict(is_double=is_double, is_complex=is_complex,
+                                       indexed=indexed),
                              can_be_complex=True, has_sites=False,
-                             keywords="energy, x1, y1, z1, x2, y2, z2, hop_id")
+                             keywords=keywords + (", row, col" if indexed else ""),
+                             prepare_args=_gather_hopping_positions if indexed else None)
 
 
 def constant_potential(magnitude):
@@ -402,6 +438,120 @@ def constant_potential(magnitude):
     return f
 
 
+def constant_magnetic_field(magnitude):
+    """Constant magnetic field in the z-direction (native modifier)
+
+    Implemented in C++ so it's much faster than an equivalent Python modifier
+    and it doesn't prevent a multithreaded Hamiltonian build.
+
+    Parameters
+    ----------
+    magnitude : float
+        In units of Tesla.
+    """
+    return _cpp.constant_magnetic_field(magnitude)
+
+
+def constant_electric_field(field):
+    """Constant electric field: adds the potential energy `field . r` to each site (native)
+
+    Parameters
+    ----------
+    field : array_like
+        Field vector in units of V/nm.
+    """
+    return _cpp.constant_electric_field(field)
+
+
+def anderson_disorder(width, seed=0):
+    """Random onsite energy uniformly distributed in `[-width/2, width/2)` (native)
+
+    The value at each site is a function of only the `seed` and the index of the
+    site. It's regenerated on demand by a counter-based random generator, so it's
+    reproducible regardless of the number of threads or the build order.
+
+    Parameters
+    ----------
+    width : float
+        Disorder strength in units of eV.
+    seed : int
+        Different seeds give different disorder realizations.
+    """
+    return _cpp.anderson_disorder(width, seed)
+
+
+def random_vacancies(probability, seed=0, min_neighbors=0):
+    """Remove each lattice site with the given `probability` (native)
+
+    Like :func:`anderson_disorder`, the result is a function of only the `seed`
+    and the index of each site, so it's the same for any number of threads.
+
+    Parameters
+    ----------
+    probability : float
+        Fraction of sites to remove, between 0 and 1.
+    seed : int
+        Different seeds give different vacancy realizations.
+    min_neighbors : int
+        After modification, remove dangling sites with less than this number of neighbors.
+    """
+    return _cpp.random_vacancies(probability, seed, min_neighbors)
+
+
+def strained_hopping(beta, reference_length):
+    """Scale hoppings with length: `t = t0 * exp(-beta * (l / reference_length - 1))` (native)
+
+    Parameters
+    ----------
+    beta : float
+        Decay rate of the hopping energy with distance [unitless].
+    reference_length : float
+        Hopping length without strain in units of nm.
+    """
+    return _cpp.strained_hopping(beta, reference_length)
+
+
+def onsite_expression(expression, **constants):
+    """Add a formula of the site positions to the onsite energy (native)
+
+    The formula is compiled when the modifier is created and it's evaluated in C++,
+    so it doesn't need the GIL and it doesn't prevent a multithreaded Hamiltonian build.
+
+    Parameters
+    ----------
+    expression : str
+        Python-like syntax: numbers, `pi`, `+ - * / **`, comparisons (1 or 0),
+        `exp log sqrt abs sin cos tan sinh cosh tanh min max atan2 pow` and
+        `where(condition, a, b)`. The variables are the site positions `x, y, z`
+        and `sub_id` may be compared with a sublattice name, e.g. `sub_id == 'A'`.
+    **constants
+        Named parameters of the expression.
+
+    Examples
+    --------
+    ::
+
+        gate = pb.onsite_expression("V * exp(-(x**2 + y**2) / (2 * w**2))", V=0.1, w=5)
+    """
+    return _cpp.onsite_expression(expression, constants)
+
+
+def hopping_expression(expression, **constants):
+    """Multiply the hopping energy by a formula of the positions of the two sites (native)
+
+    Same syntax as :func:`onsite_expression`. The variables are `x1, y1, z1, x2, y2, z2`
+    and `hop_id` may be compared with a hopping name, e.g. `hop_id == 't_nn'`.
+
+    Parameters
+    ----------
+    expression : str
+        The factor of the hopping energy.
+    **constants
+        Named parameters of the expression.
+    """
+    return _cpp.hopping_expression(expression, constants)
+
+
 def force_double_precision():
     """Forces the model to use double precision even if that's not require by any modifier"""
     @onsite_energy_modifier(is_double=True)
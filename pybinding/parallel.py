@@ -2,6 +2,7 @@
 import sys
 import inspect
 import itertools
+import multiprocessing
 from copy import copy
 from functools import partial
 
@@ -13,9 +14,11 @@ from . import _cpp
 from .utils import cpuinfo, progressbar, decorator_decorator
 from .results import Sweep, NDSweep
 
-__all__ = ['num_cores', 'parallel_for', 'parallelize', 'sweep', 'ndsweep']
+__all__ = ['num_cores', 'parallel_for', 'parallelize', 'sweep', 'ndsweep', 'native_sweep',
+           'sweep_onsite', 'sweep_hopping', 'sweep_magnetic_field', 'sweep_electric_field',
+           'sweep_anderson_disorder', 'sweep_strained_hopping']
 
-num_cores = cpuinfo.physical_core_count()
+num_cores = cpuinfo.available_core_count()
 
 
 def _sequential_for(sequence, produce, retire):
@@ -70,6 +73,106 @@ def _parallel_for(sequence, produce, retire, num_threads=num_cores, queue_size=n
     _cpp.parallel_for(sequence, produce, retire, num_threads, queue_size)
 
 
+class _RemoteSolver:
+    """Stands in for the solver of a job computed in a worker process: only the report"""
+    def __init__(self, solver):
+        self.reports = {s: solver.report(shortform=s) for s in (True, False)}
+
+    def report(self, shortform=False):
+        return self.reports[shortform]
+
+
+class _RemoteJob:
+    """The part of a `Deferred` job which is sent back from a worker process"""
+    def __init__(self, deferred):
+        self.solver = _RemoteSolver(deferred.solver)
+        self.result = _SharedArray.wrap(deferred.result)
+
+    def unwrap(self):
+        if isinstance(self.result, _SharedArray):
+            self.result = self.result.unwrap()
+        return self
+
+
+class _SharedArray:
+    """An array result passed through shared memory instead of being pickled
+
+    The worker process copies the array into a new shared memory block and only its name
+    is sent back. The main process copies it out and releases the block. This needs
+    Python >= 3.8 (`multiprocessing.shared_memory`): older versions pickle the arrays.
+    """
+    def __init__(self, array):
+        from multiprocessing import shared_memory
+        self.shape, self.dtype = array.shape, array.dtype
+        block = shared_memory.SharedMemory(create=True, size=array.nbytes)
+        np.ndarray(self.shape, self.dtype, buffer=block.buf)[...] = array
+        self.name = block.name
+        block.close()
+
+    @classmethod
+    def wrap(cls, result):
+        try:
+            if isinstance(result, np.ndarray) and result.nbytes > 0:
+                return cls(result)
+        except ImportError:
+            pass
+        return result
+
+    def unwrap(self):
+        from multiprocessing import shared_memory
+        block = shared_memory.SharedMemory(name=self.name)
+        array = np.ndarray(self.shape, self.dtype, buffer=block.buf).copy()
+        block.close()
+        block.unlink()
+        return array
+
+
+# Set by `_process_for` before the workers are forked: they inherit it instead of pickling
+_process_state = {}
+
+
+def _process_job(idx):
+    """Produce and compute a job in a worker process"""
+    deferred = _process_state["produce"](_process_state["sequence"][idx])
+    deferred.compute()
+    return idx, _RemoteJob(deferred)
+
+
+def _process_init(thread_budget):
+    """Limit the threads of the C++ solvers in a worker process"""
+    _cpp.set_thread_budget(thread_budget)
+
+
+def _process_for(sequence, produce, retire, num_processes=num_cores):
+    """Multi-process for loop
+
+    Same as `_parallel_for` but each job is produced and computed in one of `num_processes`
+    worker processes. Each process has its own GIL so Python modifiers and solvers (which
+    take the GIL in `_parallel_for`) run in parallel. The workers are forked from the main
+    process: anything created before the loop, e.g. a model or system passed to the factory
+    as a fixture, is shared by all the workers (copy-on-write) instead of being copied.
+    The `retire` function is called in the main process with a stand-in for the `Deferred`
+    object which has the `result` and the `solver.report()`. Results are returned through
+    shared memory.
+
+    Each worker gets an equal share of the available cores as its thread budget, so the
+    solvers with the default `num_threads` don't oversubscribe the cores.
+    """
+    if "fork" not in multiprocessing.get_all_start_methods():
+        raise RuntimeError("The process backend requires the 'fork' start method "
+                           "which is not available on this platform")
+
+    _process_state.update(produce=produce, sequence=sequence)
+    try:
+        budget = max(num_cores // num_processes, 1)
+        context = multiprocessing.get_context("fork")
+        with context.Pool(num_processes, _process_init, (budget,)) as pool:
+            for idx, job in pool.imap_unordered(_process_job, range(len(sequence))):
+                retire(job.unwrap(), idx)
+    finally:
+        _process_state.clear()
+
+
 class Hooks:
     """Holds functions which hook into `ParallelFor`
 
@@ -104,15 +207,20 @@ class Config:
         with '.png', progress log with '.log', etc.
     num_threads, queue_size : int
         Forwarded to `_parallel_for`.
+    backend : {'threads', 'processes'}
+        Run the jobs with `_parallel_for` or `_process_for` (`num_threads` processes).
     save_every : float
         A 0 to 100 percentage points interval to save and plot the data.
     pbar_fd : {sys.stdout, sys.stderr, None}
         Output stream. The progress bar is always the last line of output.
     """
-    def __init__(self, callsig, num_threads, queue_size):
+    def __init__(self, callsig, num_threads, queue_size, backend="threads"):
+        if backend not in ("threads", "processes"):
+            raise ValueError("Unknown backend '{}': use 'threads' or 'processes'".format(backend))
         self.callsig = callsig
         self.num_threads = num_threads
         self.queue_size = queue_size
+        self.backend = backend
 
         self.filename = self.make_filename(callsig)
         self.save_every = 10.0
@@ -207,8 +315,11 @@ class ParallelFor:
         logname = self.config.filename + ".log" if self.config.filename else ""
         self.pbar = progressbar.ProgressBar(size, stream=self.config.pbar_fd, filename=logname)
 
+        self.is_remote = self.config.num_threads != 1 and self.config.backend == "processes"
         if self.config.num_threads == 1:
             self.loop = _sequential_for
+        elif self.is_remote:
+            self.loop = partial(_process_for, num_processes=self.config.num_threads)
         else:
             self.loop = partial(_parallel_for, num_threads=self.config.num_threads,
                                 queue_size=self.config.queue_size)
@@ -221,8 +332,11 @@ class ParallelFor:
     def _make_result(data):
         return data
 
+    def _make_job(self, var):
+        return self.factory.produce(*var, **self.factory.fixtures)
+
     def _produce(self, var):
-        deferred = self.factory.produce(*var, **self.factory.fixtures)
+        deferred = self._make_job(var)
 
         if not self.called_first:
             self._first(deferred)
@@ -235,6 +349,13 @@ class ParallelFor:
         for f in self.hooks.first:
             f(deferred)
 
+    def _retire_remote(self, job, idx):
+        # The jobs are produced in the worker processes: the first result stands in for them
+        if not self.called_first:
+            self._first(job)
+            self.called_first = True
+        self._retire(job, idx)
+
     def _retire(self, deferred, idx):
         self.data[idx] = copy(deferred.result)
 
@@ -275,7 +396,10 @@ class ParallelFor:
     def __call__(self):
         self.called_first = False
         with self.pbar:
-            self.loop(self.factory.sequence, self._produce, self._retire)
+            if self.is_remote:
+                self.loop(self.factory.sequence, self._make_job, self._retire_remote)
+            else:
+                self.loop(self.factory.sequence, self._produce, self._retire)
         return self.result
 
 
@@ -311,8 +435,8 @@ def parallel_for(factory, make_result=None):
 
 
 @decorator_decorator
-def parallelize(num_threads=num_cores, queue_size=num_cores, **kwargs):
-    """parallelize(num_threads=num_cores, queue_size=num_cores, **kwargs)
+def parallelize(num_threads=num_cores, queue_size=num_cores, backend="threads", **kwargs):
+    """parallelize(num_threads=num_cores, queue_size=num_cores, backend="threads", **kwargs)
 
     A decorator which creates factory functions for :func:`parallel_for`
 
@@ -327,6 +451,12 @@ def parallelize(num_threads=num_cores, queue_size=num_cores, **kwargs):
         Number of `Deferred` jobs to be queued up for consumption by the worker
         threads. The maximum number of jobs that will be kept in memory at any
         one time will be `queue_size` + `num_threads`.
+    backend : str
+        "threads" computes the jobs on C++ threads of this process: Python modifiers
+        and solvers take the GIL so they don't run in parallel. "processes" runs the
+        whole job (model, modifiers and compute) in `num_threads` worker processes which
+        share, copy-on-write, everything created before the loop (e.g. a base model
+        passed as a fixture). Requires the 'fork' start method (not on Windows).
     **kwargs
         Variables which will be iterated over in :func:`parallel_for`
         and passed to the decorated function. See example.
@@ -354,7 +484,7 @@ def parallelize(num_threads=num_cores, queue_size=num_cores, **kwargs):
         fixtures = {k: v.default for k, v in params.items() if k not in kwargs}
 
         return Factory(variables, fixtures, produce_func,
-                       Config(callsig, num_threads, queue_size))
+                       Config(callsig, num_threads, queue_size, backend))
 
     return decorator
 
@@ -425,3 +555,94 @@ def ndsweep(factory, plot=None, labels=None, tags=None, silent=False):
         factory.hooks.plot.append(plot)
 
     return parallel_for(factory, make_result)
+
+
+def sweep_onsite(expression, **constants):
+    """Onsite energy expression for :func:`native_sweep`, see :func:`.onsite_expression`
+
+    The sweep parameters are named constants of the `expression`, e.g. `"V * tanh(x / w)"`
+    with `parameters=dict(V=...)` and the fixed constant `w=5`.
+    """
+    return _cpp.sweep_onsite_expression(expression, constants)
+
+
+def sweep_hopping(expression, **constants):
+    """Hopping factor expression for :func:`native_sweep`, see :func:`.hopping_expression`"""
+    return _cpp.sweep_hopping_expression(expression, constants)
+
+
+def sweep_magnetic_field(magnitude):
+    """Constant magnetic field [T] for :func:`native_sweep`: `magnitude` is a parameter name"""
+    return _cpp.sweep_constant_magnetic_field(magnitude)
+
+
+def sweep_electric_field(magnitude, direction=(1, 0, 0)):
+    """Constant electric field [V/nm] along the unit vector `direction` for
+    :func:`native_sweep`: `magnitude` is a parameter name"""
+    return _cpp.sweep_constant_electric_field(magnitude, direction)
+
+
+def sweep_anderson_disorder(width, seed=0):
+    """Anderson disorder for :func:`native_sweep`: `width` is a parameter name"""
+    return _cpp.sweep_anderson_disorder(width, seed)
+
+
+def sweep_strained_hopping(beta, reference_length):
+    """Strained hoppings for :func:`native_sweep`: `beta` is a parameter name"""
+    return _cpp.sweep_strained_hopping(beta, reference_length)
+
+
+def native_sweep(kpm, parameters, modifiers, energy, broadening, num_random=1, position=None,
+                 sublattice="", num_threads=num_cores, labels=None, tags=None):
+    """Parameter sweep which is built and computed natively, without Python in the loop
+
+    Unlike :func:`sweep`, there's no Python producer which makes each job: every point is
+    a copy of the model of `kpm` with the native `modifiers` for its parameters. The copies
+    share the system, so only the Hamiltonian is built for each point, followed by the KPM
+    DOS or LDOS. The points are computed on a thread pool and Python is only entered once
+    to return the result. Python modifiers of the base model still work, but they are
+    serialized by the GIL.
+
+    Parameters
+    ----------
+    kpm : :class:`~pybinding.chebyshev.KPM`
+        Provides the base model and the KPM configuration of every point.
+    parameters : dict
+        Parameter names and their 1D arrays of values. Every combination is computed,
+        in the order of :func:`itertools.product`.
+    modifiers : list
+        Made by :func:`sweep_onsite`, :func:`sweep_hopping`, :func:`sweep_magnetic_field`,
+        :func:`sweep_electric_field`, :func:`sweep_anderson_disorder` and
+        :func:`sweep_strained_hopping`.
+    energy : array_like
+        Values for which the DOS or LDOS is calculated.
+    broadening : float
+        Width, in energy, of the smallest detail which can be resolved.
+    num_random : int
+        Number of random vectors of the stochastic DOS.
+    position : array_like, optional
+        Compute the LDOS at this position instead of the DOS.
+    sublattice : str
+        Only look for the LDOS sites of this sublattice.
+    num_threads : int
+        Total number of threads.
+    labels, tags : dict
+        Forwarded to the result.
+
+    Returns
+    -------
+    :class:`~pybinding.Sweep` or :class:`~pybinding.NDSweep`
+        A :class:`.Sweep` of the parameter and `energy` for a single parameter, or
+        an :class:`.NDSweep` over all the parameters and `energy`.
+    """
+    names = list(parameters)
+    values = [np.atleast_1d(np.asarray(parameters[n], dtype=np.float64)) for n in names]
+    energy = np.atleast_1d(np.asarray(energy, dtype=np.float64))
+    kind = "dos" if position is None else "ldos"
+    position = (0, 0, 0) if position is None else position
+
+    data = _cpp.run_sweep(kpm.impl, names, values, modifiers, kind, energy, broadening,
+                          num_random, position, sublattice, num_threads).T
+    if len(values) == 1:
+        return Sweep(values[0], energy, data, labels, tags)
+    return NDSweep(tuple(values) + (energy,), data, labels, tags)
@@ -4,9 +4,11 @@ The :class:`.Solver` class is the main interface for dealing with eigenvalue pro
 is made to work specifically with pybinding's :class:`.Model` objects, but it may use any
 eigensolver algorithm under the hood.
 
-A few different algorithms are provided out of the box: the :func:`.lapack`, :func:`.arpack`
-and :func:`.feast` functions return concrete :class:`.Solver` implementation using the LAPACK,
-ARPACK and FEAST algorithms, respectively.
+A few different algorithms are provided out of the box: the :func:`.lapack`, :func:`.arpack`,
+:func:`.feast` and :func:`.chebyshev_filter` functions return concrete :class:`.Solver`
+implementation using the LAPACK, ARPACK, FEAST and Chebyshev filtered subspace iteration
+algorithms, respectively. For many interior eigenstates, :func:`.sliced_feast` splits a wide
+energy range into FEAST slices which are solved concurrently.
 
 The :class:`.Solver` may easily be extended with new eigensolver algorithms. All that is
 required is a function which takes a Hamiltonian matrix and returns the computed
@@ -22,7 +24,7 @@ from . import results
 from .model import Model
 from .system import System
 
-__all__ = ['Solver', 'arpack', 'feast', 'lapack']
+__all__ = ['Solver', 'arpack', 'chebyshev_filter', 'feast', 'lapack', 'sliced_feast']
 
 
 class Solver:
@@ -45,6 +47,37 @@ class Solver:
     def model(self, model):
         self.impl.model = model
 
+    @property
+    def warm_start(self) -> bool:
+        """Start from the previous eigenvectors when the model changes or in :meth:`calc_bands`
+
+        For parameter sweeps and band structures where the results change gradually, the
+        eigenvectors of the previous point are a good starting subspace for the next one
+        and the iterative solvers (:func:`.arpack` and :func:`.chebyshev_filter`) converge
+        in fewer steps. It has no effect on the dense and the Python implementations.
+        """
+        return getattr(self.impl, "warm_start", False)
+
+    @warm_start.setter
+    def warm_start(self, enabled):
+        if hasattr(self.impl, "warm_start"):
+            self.impl.warm_start = enabled
+
+    @property
+    def single_precision_eigenvectors(self) -> bool:
+        """Keep only a single precision copy of the eigenvectors of a double precision model
+
+        Halves the memory of the solved eigenvectors, e.g. to keep many solved models around
+        for interactive analysis. The eigenvalues keep their full precision. It has no effect
+        on single precision models and the Python implementations.
+        """
+        return getattr(self.impl, "single_precision_eigenvectors", False)
+
+    @single_precision_eigenvectors.setter
+    def single_precision_eigenvectors(self, enabled):
+        if hasattr(self.impl, "single_precision_eigenvectors"):
+            self.impl.single_precision_eigenvectors = enabled
+
     @property
     def system(self) -> System:
         """The tight-binding system attached to this solver (shortcut for Solver.model.system)"""
@@ -63,6 +96,54 @@ class Solver:
         """
         return self.impl.eigenvectors
 
+    def _select(self, name, sites, states):
+        """Native selection if the implementation has one, otherwise slice the eigenvectors"""
+        sites = [] if sites is None else np.atleast_1d(sites).tolist()
+        states = [] if states is None else np.atleast_1d(states).tolist()
+        if hasattr(self.impl, name):
+            return getattr(self.impl, name)(sites, states)
+
+        psi = self.eigenvectors
+        if sites:
+            rows = np.concatenate([self.system.impl.to_hamiltonian_indices(s) for s in sites])
+            psi = psi[rows]
+        if states:
+            psi = psi[:, states]
+        return abs(psi)**2 if name == "probability_at" else psi
+
+    def eigenvectors_at(self, sites=None, states=None) -> np.ndarray:
+        """A copy of only some rows and columns of :attr:`eigenvectors`
+
+        The full eigenvectors array is not copied: only the selection is.
+
+        Parameters
+        ----------
+        sites : array_like of int, optional
+            Indices of the system sites, e.g. from :meth:`.System.find_nearest`. Each site
+            selects the rows of all of its orbitals. All the sites by default.
+        states : array_like of int, optional
+            Indices of the eigenstates (columns). All of them by default.
+
+        Returns
+        -------
+        np.ndarray
+            `shape == (num_orbitals_of_the_sites, len(states))`
+        """
+        return self._select("eigenvectors_at", sites, states)
+
+    def probability_at(self, sites=None, states=None) -> np.ndarray:
+        r"""The probability density :math:`|\Psi_n(r)|^2` of some of the eigenstates and sites
+
+        Same selection as :meth:`eigenvectors_at` but it's computed natively without
+        copying the complex eigenvectors.
+
+        Returns
+        -------
+        np.ndarray
+            `shape == (num_orbitals_of_the_sites, len(states))`
+        """
+        return self._select("probability_at", sites, states)
+
     def solve(self):
         """Explicitly solve the eigenvalue problem right now
 
@@ -155,9 +236,11 @@ class Solver:
         if reduce and np.isscalar(n):
             n = np.flatnonzero(abs(self.eigenvalues[n] - self.eigenvalues) < reduce)
 
-        probability = abs(self.eigenvectors[:, n]) ** 2
-        if probability.ndim > 1:
+        probability = self.probability_at(states=n)
+        if not np.isscalar(n):
             probability = np.sum(probability, axis=1)
+        else:
+            probability = probability[:, 0]
         return self.system.with_data(probability)
 
     def calc_dos(self, energies, broadening):
@@ -296,6 +379,10 @@ class Solver:
         k_points = [np.atleast_1d(k) for k in (k0, k1) + ks]
         k_path = results.make_path(*k_points, step=step)
 
+        if hasattr(self.impl, 'calc_bands'):
+            # All the k-points are diagonalized in parallel without changing the model
+            return results.Bands(k_path, self.impl.calc_bands(k_path))
+
         bands = []
         for k in k_path:
             self.set_wave_vector(k)
@@ -303,6 +390,50 @@ class Solver:
 
         return results.Bands(k_path, np.vstack(bands))
 
+    def _deferred(self, name, compute, *args):
+        """A native deferred job if the implementation has one, otherwise a Python job"""
+        if hasattr(self.impl, name):
+            return getattr(self.impl, name)(*args)
+        self.model.eval_hamiltonian()
+        return _cpp.deferred(self, compute)
+
+    def deferred_dos(self, energies, broadening):
+        """Same as :meth:`calc_dos` but for parallel computation: see the :mod:`.parallel` module
+
+        Returns
+        -------
+        Deferred
+            The `result` is the array of DOS values.
+        """
+        return self._deferred("deferred_dos", lambda: self.calc_dos(energies, broadening).data,
+                              energies, broadening)
+
+    def deferred_spatial_ldos(self, energy, broadening):
+        """Same as :meth:`calc_spatial_ldos` but for parallel computation
+
+        Returns
+        -------
+        Deferred
+            The `result` is the array of LDOS values, one per site.
+        """
+        return self._deferred("deferred_spatial_ldos",
+                              lambda: self.calc_spatial_ldos(energy, broadening).data,
+                              energy, broadening)
+
+    def deferred_bands(self, k0, k1, *ks, step=0.1):
+        """Same as :meth:`calc_bands` but for parallel computation
+
+        Returns
+        -------
+        Deferred
+            The `result` is the 2D array of energies: one row per point of the path.
+        """
+        k_points = [np.atleast_1d(k) for k in (k0, k1) + ks]
+        k_path = results.make_path(*k_points, step=step)
+        return self._deferred("deferred_bands",
+                              lambda: self.calc_bands(k0, k1, *ks, step=step).energy,
+                              k_path)
+
     @staticmethod
     def find_degenerate_states(energies, abs_tolerance=1e-5):
         """Return groups of indices which belong to degenerate states
@@ -393,25 +524,35 @@ class _SolverPythonImpl:
         return "Converged in " + pretty_duration(self.compute_time)
 
 
-def lapack(model, **kwargs):
+def lapack(model, eigenvalues_only=False, **kwargs):
     """LAPACK :class:`.Solver` implementation for dense matrices
 
     This solver is intended for small models which are best represented by
-    dense matrices. Always solves for all the eigenvalues and eigenvectors.
-    Internally this solver uses the :func:`scipy.linalg.eigh` function for
-    dense Hermitian matrices.
+    dense matrices. Always solves for all the eigenvalues and, by default, the eigenvectors.
+    The dense diagonalization is native (the same as :func:`scipy.linalg.eigh`) so it
+    doesn't hold the GIL, e.g. for sweeps of small models with :func:`.parallel_for`.
 
     Parameters
     ----------
     model : Model
         Model which will provide the Hamiltonian matrix.
+    eigenvalues_only : bool
+        Skip the eigenvectors: faster and less memory, but the methods which need
+        the eigenvectors (e.g. :meth:`.Solver.calc_spatial_ldos`) are not available.
     **kwargs
-        Advanced arguments: forwarded to :func:`scipy.linalg.eigh`.
+        Advanced arguments: forwarded to :func:`scipy.linalg.eigh`. The solver falls
+        back to the Python implementation in that case.
 
     Returns
     -------
     :class:`~pybinding.solver.Solver`
     """
+    if not kwargs:
+        return Solver(_cpp.DenseSolver(model, eigenvalues_only))
+    if eigenvalues_only:
+        raise ValueError("`eigenvalues_only` can't be combined with the `scipy.linalg.eigh()` "
+                         "arguments")
+
     def solver_func(hamiltonian, **kw):
         from scipy.linalg import eigh
         return eigh(hamiltonian.toarray(), **kw)
@@ -420,12 +561,14 @@ def lapack(model, **kwargs):
 
 
 def arpack(model, k, sigma=0, **kwargs):
-    """ARPACK :class:`.Solver` implementation for sparse matrices
+    """Shift-invert Lanczos :class:`.Solver` implementation for sparse matrices
 
     This solver is intended for large models with sparse Hamiltonian matrices.
-    It only computes a small targeted subset of eigenvalues and eigenvectors.
-    Internally this solver uses the :func:`scipy.sparse.linalg.eigsh` function
-    for sparse Hermitian matrices.
+    It only computes a small targeted subset of eigenvalues and eigenvectors: the ones
+    nearest to `sigma`. It's the same method as :func:`scipy.sparse.linalg.eigsh` with
+    `sigma`, i.e. ARPACK's shift-invert mode, but the implementation is native so it doesn't
+    hold the GIL. The sparse factorization of `H - sigma` reuses its fill-reducing ordering
+    when the Hamiltonian changes but keeps its sparsity pattern, e.g. for band structures.
 
     Parameters
     ----------
@@ -438,16 +581,20 @@ def arpack(model, k, sigma=0, **kwargs):
     sigma : float, optional
         Look for eigenvalues near `sigma`.
     **kwargs
-        Advanced arguments: forwarded to :func:`scipy.sparse.linalg.eigsh`.
+        Advanced arguments: forwarded to :func:`scipy.sparse.linalg.eigsh`. The solver
+        falls back to the Python implementation in that case.
 
     Returns
     -------
     :class:`~pybinding.solver.Solver`
     """
-    from scipy.sparse.linalg import eigsh
     if sigma == 0:
-        # eigsh can cause problems when sigma is exactly zero
+        # a shift of exactly zero is singular for the common case of particle-hole symmetry
         sigma = np.finfo(model.hamiltonian.dtype).eps
+    if not kwargs:
+        return Solver(_cpp.ShiftInvert(model, k, sigma))
+
+    from scipy.sparse.linalg import eigsh
     return Solver(_SolverPythonImpl(eigsh, model, k=k, sigma=sigma, **kwargs))
 
 
@@ -486,3 +633,95 @@ def feast(model, energy_range, initial_size_guess, recycle_subspace=False, is_ve
     except AttributeError:
         raise Exception("The module was compiled without the FEAST solver.\n"
                         "Use a different solver or recompile the module with FEAST.")
+
+
+def sliced_feast(model, energy_range, num_slices=0, slice_size=500, num_random=4,
+                 broadening=0, threads_per_slice=0, num_threads=-1, is_verbose=False):
+    """Spectrum slicing :class:`.Solver`: FEAST on many sub-intervals of a wide energy range
+
+    Meant for thousands of interior eigenstates where a single :func:`.feast` window scales
+    poorly. The `energy_range` is split into slices with about the same number of eigenvalues.
+    The counts are estimated from a cheap stochastic KPM density of states, so each slice also
+    gets an accurate FEAST subspace size: there's no `initial_size_guess`. The slices are
+    solved concurrently and the results are merged in order of energy. A state right at the
+    border of two slices is only kept once.
+
+    This solver is only available if the C++ extension module was compiled with FEAST.
+
+    Parameters
+    ----------
+    model : Model
+        Model which will provide the Hamiltonian matrix.
+    energy_range : tuple of float
+        The lowest and highest eigenvalue between which to compute the solutions.
+    num_slices : int, optional
+        Number of sub-intervals. The default (0) picks it from `slice_size`.
+    slice_size : int, optional
+        Target number of eigenvalues per slice if `num_slices` is not given.
+    num_random : int, optional
+        Number of random vectors of the KPM eigenvalue counts.
+    broadening : float, optional
+        Energy resolution of the KPM eigenvalue counts. The default (0) is 1/64 of the
+        `energy_range`.
+    threads_per_slice : int, optional
+        Threads for each slice (including MKL PARDISO). The default (0) splits the threads
+        evenly among the slices.
+    num_threads : int, optional
+        Total number of threads. The default (-1) uses all the cores.
+    is_verbose : bool, optional
+        Show the raw output from the FEAST routine.
+
+    Returns
+    -------
+    :class:`~pybinding.solver.Solver`
+    """
+    try:
+        # noinspection PyUnresolvedReferences
+        return Solver(_cpp.SlicedFEAST(model, energy_range, num_slices, slice_size, num_random,
+                                       broadening, threads_per_slice, num_threads, is_verbose))
+    except AttributeError:
+        raise Exception("The module was compiled without the FEAST solver.\n"
+                        "Use a different solver or recompile the module with FEAST.")
+
+
+def chebyshev_filter(model, energy_range, initial_size_guess=0, filter_degree=0, tolerance=1e-6,
+                     max_iterations=30, recycle_subspace=False, num_threads=-1):
+    """Chebyshev filtered subspace iteration :class:`.Solver` for sparse matrices
+
+    Computes the eigenvalues in the given `energy_range` and their eigenvectors. A polynomial
+    filter amplifies the part of the subspace within the energy window and the eigenpairs are
+    extracted with the Rayleigh-Ritz procedure. Nearly all of the work is done by sparse
+    matrix-vector products which are shared with the KPM implementation, so it scales well
+    with the number of threads and it's suitable for interior eigenvalues of large systems.
+
+    Parameters
+    ----------
+    model : Model
+        Model which will provide the Hamiltonian matrix.
+    energy_range : tuple of float
+        The lowest and highest eigenvalue between which to compute the solutions.
+    initial_size_guess : int, optional
+        Initial guess for the subspace size. It should be about 1.5 times the number of
+        eigenvalues in `energy_range`, but the solver auto-corrects as needed. By default
+        the number of eigenvalues is estimated stochastically.
+    filter_degree : int, optional
+        Degree of the Chebyshev filter polynomial. A higher degree improves the convergence
+        per iteration at the cost of more matrix-vector products. By default it's determined
+        from the width of the `energy_range` relative to the full spectrum.
+    tolerance : float, optional
+        Residual norm stopping criteria (relative to the spectrum width).
+    max_iterations : int, optional
+        Raise an error if the solution hasn't converged within this many iterations.
+    recycle_subspace : bool, optional
+        Reuse previously computed eigenvectors as a starting point for the next computation,
+        e.g. for band structure calculations where the results change gradually.
+    num_threads : int, optional
+        The number of CPU threads to use for the matrix-vector products. By default all
+        available cores are used.
+
+    Returns
+    -------
+    :class:`~pybinding.solver.Solver`
+    """
+    return Solver(_cpp.ChebyshevFilter(model, energy_range, initial_size_guess, filter_degree,
+                                       tolerance, max_iterations, recycle_subspace, num_threads))
@@ -15,8 +15,8 @@ from .support.fuzzy_set import FuzzySet
 from .support.structure import AbstractSites, Sites
 from .results import Structure, StructureMap
 
-__all__ = ['Sites', 'System', 'plot_hoppings', 'plot_periodic_boundaries', 'plot_sites',
-           'structure_plot_properties']
+__all__ = ['Sites', 'System', 'load_binary', 'plot_hoppings', 'plot_periodic_boundaries',
+           'plot_sites', 'save_binary', 'structure_plot_properties']
 
 
 class _CppSites(AbstractSites):
@@ -90,14 +90,21 @@ class System(Structure):
         Parameters
         ----------
         position : array_like
-            Where to look.
+            Where to look. May also be a 2D array of shape (N, 2) or (N, 3) in order to
+            look up N positions at once.
         sublattice : Optional[str]
             Look for a specific sublattice site. By default any will do.
 
         Returns
         -------
-        int
+        int or np.ndarray
+            A single index or an array of N indices for 2D `position` input.
         """
+        if np.ndim(position) == 2:
+            position = np.asarray(position, dtype=np.float32)
+            x, y, z = (np.ascontiguousarray(position[:, i]) if i < position.shape[1]
+                       else np.zeros(position.shape[0], dtype=np.float32) for i in range(3))
+            return self.impl.find_nearest_many(x, y, z, sublattice)
         return self.impl.find_nearest(position, sublattice)
 
     def count_neighbors(self):
@@ -156,6 +163,41 @@ class System(Structure):
         return np.concatenate(reduced_data)
 
 
+def save_binary(filename, model_or_system):
+    """Save a system in the native binary format
+
+    Unlike pickling, the data is written directly from the C++ structures without making any
+    copies and it's loaded by mapping the file into memory. Use this for large systems.
+
+    Parameters
+    ----------
+    filename : str
+    model_or_system : Union[Model, System]
+        If a :class:`.Model` is given, its Hamiltonian matrix is saved together with the system.
+    """
+    if isinstance(model_or_system, System):
+        _cpp.save_binary(filename, model_or_system.impl)
+    else:
+        model = model_or_system.impl
+        _cpp.save_binary(filename, model.system, model.raw_hamiltonian)
+
+
+def load_binary(filename):
+    """Load a file made by :func:`save_binary`
+
+    Parameters
+    ----------
+    filename : str
+
+    Returns
+    -------
+    Tuple[System, Optional[scipy.sparse.csr_matrix]]
+        The system and the Hamiltonian matrix (`None` if only the system was saved).
+    """
+    impl, hamiltonian = _cpp.load_binary(filename)
+    return System(impl), hamiltonian.csrref if hamiltonian is not None else None
+
+
 def structure_plot_properties(axes='xyz', site=None, hopping=None, boundary=None, **kwargs):
     """Process structure plot properties
 
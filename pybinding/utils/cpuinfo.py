@@ -36,6 +36,19 @@ def physical_core_count():
         return os.cpu_count()
 
 
+def available_core_count():
+    """Return the number of cores this process may actually use
+
+    This respects the CPU affinity of the process (e.g. `taskset` or a batch scheduler),
+    the CPU quota of a container (cgroup) and the `CPB_NUM_THREADS` environment variable.
+    It's the default thread budget of all the multi-threaded parts of pybinding.
+    """
+    try:
+        return min(physical_core_count(), _cpp.available_cpus())
+    except AttributeError:
+        return physical_core_count()
+
+
 def virtual_core_count():
     """Return the number of threads the CPU can process simultaniously"""
     return os.cpu_count()
@@ -44,8 +57,9 @@ def virtual_core_count():
 def summary():
     """Return a short description of the host CPU
 
-    The returned SIMD instruction set is the one that the extension module was
-    compiled with, not the highest one supported by the CPU.
+    The returned SIMD instruction set is the one used by the KPM kernels: the one
+    that the extension module was compiled with or, if it was built with
+    `PB_CPU_DISPATCH`, the best build for this CPU.
     """
     info = cpu_info()
     if not info:
@@ -0,0 +1,110 @@
+"""Live metrics of the running calculations, e.g. to monitor long cluster jobs
+
+The counters and gauges are updated by the C++ core as the calculations run: moments and
+matrix-vector product times of the KPM jobs, busy and queued threads, memory. They may be read
+from another Python thread while a calculation is running or exported to a file periodically.
+"""
+import threading
+
+from .. import _cpp
+
+__all__ = ['snapshot', 'text', 'reset', 'collect_stages', 'export']
+
+
+def snapshot():
+    """Return the current values of the live metrics
+
+    The counters (names ending in `_total`) only go up, e.g. `cpb_kpm_moments_total` and
+    `cpb_kpm_spmv_seconds_total` whose rates give the KPM throughput. The gauges are the
+    current levels, e.g. `cpb_active_threads`, `cpb_queued_tasks` and
+    `cpb_resident_memory_bytes`.
+
+    Returns
+    -------
+    dict
+        Value of each metric by name. The metrics with labels, e.g. the stage times,
+        are named like `cpb_stage_seconds_total{stage="job",category="kpm"}`.
+    """
+    return _cpp.metrics_snapshot()
+
+
+def text():
+    """Return the live metrics in the Prometheus text exposition format"""
+    return _cpp.metrics_text()
+
+
+def reset():
+    """Zero the counters and the stage times (the gauges follow the running work)"""
+    _cpp.metrics_reset()
+
+
+def collect_stages(enable=True):
+    """Start or stop accumulating the time and number of calls of each pipeline stage
+
+    The stages are the same as the spans of :func:`.traced`: the system build, Hamiltonian
+    assembly, KPM bounds, reordering, each KPM job and the reconstruction of the results.
+    """
+    _cpp.metrics_collect_stages(enable)
+
+
+class _Exporter:
+    def __init__(self, filename, interval, stages):
+        self.filename = filename
+        self.interval = interval
+        self.stages = stages
+        self._stopped = threading.Event()
+        self._thread = threading.Thread(target=self._run, daemon=True)
+
+    def _run(self):
+        while not self._stopped.wait(self.interval):
+            _cpp.metrics_write(self.filename)
+
+    def start(self):
+        if self.stages:
+            collect_stages(True)
+        _cpp.metrics_write(self.filename)
+        self._thread.start()
+        return self
+
+    def stop(self):
+        """Stop the exporter: the file is written one last time"""
+        if self._stopped.is_set():
+            return
+        self._stopped.set()
+        self._thread.join()
+        _cpp.metrics_write(self.filename)
+        if self.stages:
+            collect_stages(False)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *_):
+        self.stop()
+
+
+def export(filename, interval=15, stages=True):
+    """Write the live metrics to a file every `interval` seconds in the background
+
+    The file uses the Prometheus text format, e.g. for the textfile collector of the node
+    exporter. Each write replaces the whole file at once so a reader never sees a partial
+    one. The exporter is a context manager or it may be stopped explicitly::
+
+        with pb.utils.metrics.export("/var/lib/node_exporter/pybinding.prom"):
+            kpm.calc_dos(energy, broadening=0.01, num_random=64)
+
+    Parameters
+    ----------
+    filename : str
+        The file is written right away, every `interval` and when the exporter stops.
+    interval : float
+        Time between writes in seconds.
+    stages : bool
+        Also collect the times of the pipeline stages while the exporter runs,
+        see :func:`collect_stages`.
+
+    Returns
+    -------
+    The running exporter: call its `stop()` method to stop it.
+    """
+    return _Exporter(filename, interval, stages).start()
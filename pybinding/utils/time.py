@@ -1,6 +1,8 @@
 import time
 
-__all__ = ['tic', 'toc', 'timed', 'pretty_duration']
+from .. import _cpp
+
+__all__ = ['tic', 'toc', 'timed', 'traced', 'pretty_duration']
 
 _tic_times = []
 
@@ -55,6 +57,38 @@ def timed(message=""):
     return _Timed(message)
 
 
+class _Traced:
+    def __init__(self, filename):
+        self.filename = filename
+
+    def __enter__(self):
+        _cpp.trace_start()
+        return self
+
+    def __exit__(self, *_):
+        _cpp.trace_stop()
+        self.json = _cpp.trace_json()
+        if self.filename:
+            with open(self.filename, "w") as file:
+                file.write(self.json)
+
+
+def traced(filename=""):
+    """Context manager which records a trace of the calculations in its code block
+
+    The model build, Hamiltonian assembly and KPM stages are recorded as nested spans
+    for each thread. The result uses the Chrome trace event format: open the file in
+    `chrome://tracing` or https://ui.perfetto.dev.
+
+    Parameters
+    ----------
+    filename : str
+        Write the trace to this JSON file on block exit. The trace is also available
+        as the `json` attribute of the context manager.
+    """
+    return _Traced(filename)
+
+
 def pretty_duration(seconds):
     """Return a pretty duration string
 
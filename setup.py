@@ -44,8 +44,10 @@ class CMakeBuild(build_ext):
         cmake_args += ["-DPB_WERROR=" + os.environ.get("PB_WERROR", "OFF"),
                        "-DPB_TESTS=" + os.environ.get("PB_TESTS", "OFF"),
                        "-DPB_NATIVE_SIMD=" + os.environ.get("PB_NATIVE_SIMD", "ON"),
+                       "-DPB_CPU_DISPATCH=" + os.environ.get("PB_CPU_DISPATCH", "OFF"),
                        "-DPB_MKL=" + os.environ.get("PB_MKL", "OFF"),
-                       "-DPB_CUDA=" + os.environ.get("PB_CUDA", "OFF")]
+                       "-DPB_CUDA=" + os.environ.get("PB_CUDA", "OFF"),
+                       "-DPB_64BIT_INDICES=" + os.environ.get("PB_64BIT_INDICES", "OFF")]
 
         cfg = os.environ.get("PB_BUILD_TYPE", "Release")
         build_args = ["--config", cfg]
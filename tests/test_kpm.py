@@ -1,5 +1,6 @@
 import pytest
 import numpy as np
+from scipy import sparse
 
 import pybinding as pb
 from pybinding.repository import graphene, group6_tmd
@@ -29,6 +30,18 @@ def test_ldos(params, baseline, plot_if_fails):
         {'matrix_format': "CSR", 'optimal_size': True, 'interleaved': False},
         {'matrix_format': "CSR", 'optimal_size': False, 'interleaved': True},
         {'matrix_format': "ELL", 'optimal_size': True, 'interleaved': True},
+        {'matrix_format': "ELL", 'optimal_size': True, 'interleaved': True,
+         'conductivity_block_size': 64},
+        {'matrix_format': "SELL", 'optimal_size': True, 'interleaved': True},
+        {'matrix_format': "STENCIL", 'optimal_size': True, 'interleaved': True},
+        {'matrix_format': "BSR", 'optimal_size': True, 'interleaved': True},
+        {'matrix_format': "HERMITIAN", 'optimal_size': True, 'interleaved': True},
+        {'matrix_format': "ELL_TABLE", 'optimal_size': True, 'interleaved': True},
+        {'matrix_format': "ELL_DELTA", 'optimal_size': True, 'interleaved': True},
+        {'matrix_format': "ELL_SPLIT", 'optimal_size': True, 'interleaved': True},
+        {'matrix_format': "HYB", 'optimal_size': True, 'interleaved': True},
+        {'matrix_format': "ELL", 'optimal_size': True, 'interleaved': True,
+         'mixed_precision': True},
     ]
     model = pb.Model(*params)
 
@@ -100,6 +113,64 @@ def test_kpm_multiple_indices(model):
     g = kpm.calc_greens(j, i, energy, broadening)
     assert pytest.fuzzy_equal(gs[0], g)
 
+    rows = [i, j, j + 3]
+    block = kpm.calc_greens_block(rows, cols, energy, broadening)
+    assert block.shape == (len(rows), len(cols), energy.size)
+    for r, row in enumerate(rows):
+        assert pytest.fuzzy_equal(block[r], kpm.calc_greens(row, cols, energy, broadening))
+    assert pytest.fuzzy_equal(kpm.calc_greens(rows, cols, energy, broadening), block)
+
+
+def test_kpm_product_identity(model):
+    """The product identity algorithm gives the same Green's function elements"""
+    num_sites = model.system.num_sites
+    i, j = num_sites // 2, num_sites // 4
+    energy = np.linspace(-0.3, 0.3, 10)
+    cols = [j, i, j + 1]
+
+    expected = pb.kpm(model, silent=True).calc_greens(i, cols, energy, broadening=0.8)
+    kpm = pb.kpm(model, product_identity=True, silent=True)
+    for g, e in zip(kpm.calc_greens(i, cols, energy, broadening=0.8), expected):
+        assert pytest.fuzzy_equal(g, e, rtol=1e-3, atol=1e-6)
+
+
+def test_batch_moments(model):
+    """A 2D `alpha` computes the moments of all of its columns together"""
+    kpm = pb.kpm(model, silent=True)
+
+    size = model.hamiltonian.shape[0]
+    alpha = np.random.rand(size, 3)
+    beta = np.random.rand(size, 3)
+    moments = kpm.moments(20, alpha, beta)
+    assert moments.shape == (20, 3)
+    for j in range(3):
+        assert pytest.fuzzy_equal(moments[:, j], kpm.moments(20, alpha[:, j], beta[:, j]))
+
+    # Without `beta`, the columns take the diagonal recursion -- more than one SIMD batch
+    alpha = np.random.rand(size, 19)
+    moments = kpm.moments(20, alpha)
+    assert moments.shape == (20, 19)
+    for j in range(19):
+        assert pytest.fuzzy_equal(moments[:, j], kpm.moments(20, alpha[:, j]))
+
+
+def test_moments_operator(model):
+    """The operator moments `<beta|op|r_n>` are the plain moments of `op^dagger beta`"""
+    kpm = pb.kpm(model, silent=True)
+
+    size = model.hamiltonian.shape[0]
+    alpha = np.random.rand(size)
+    beta = np.random.rand(size)
+    op = sparse.random(size, size, density=0.05, format="csr", random_state=1)
+    moments = kpm.moments(20, alpha, beta, op)
+    assert pytest.fuzzy_equal(moments, kpm.moments(20, alpha, op.T.conj() @ beta), rtol=1e-4)
+
+    alphas, betas = np.random.rand(size, 3), np.random.rand(size, 3)
+    moments = kpm.moments(20, alphas, betas, op)
+    for j in range(3):
+        expected = kpm.moments(20, alphas[:, j], op.T.conj() @ betas[:, j])
+        assert pytest.fuzzy_equal(moments[:, j], expected, rtol=1e-4)
+
 
 def test_kpm_reuse():
     """KPM should return the same result when a single object is used for multiple calculations"""
@@ -114,6 +185,73 @@ def test_kpm_reuse():
         assert pytest.fuzzy_equal(actual, expected, rtol=1e-3, atol=1e-6)
 
 
+def test_bounds_modes():
+    """The cheap bounds modes give almost the same results as the full Lanczos procedure"""
+    def make_model(potential):
+        return pb.Model(graphene.monolayer(), graphene.hexagon_ac(10),
+                        pb.constant_potential(potential))
+
+    energy = np.linspace(-2, 2, 20)
+    expected = pb.kpm(make_model(0.1), silent=True).calc_ldos(energy, 0.1, [0, 0])
+    gershgorin = pb.kpm(make_model(0.1), bounds_mode="gershgorin", silent=True)
+    result = gershgorin.calc_ldos(energy, 0.1, [0, 0])
+    assert "Gershgorin" in gershgorin.report()
+    assert pytest.fuzzy_equal(result, expected, rtol=0.05, atol=1e-3)
+
+    warm = pb.kpm(make_model(0), bounds_mode="warm", silent=True)
+    warm.calc_ldos(energy, 0.1, [0, 0])
+    warm.model = make_model(0.1)
+    result = warm.calc_ldos(energy, 0.1, [0, 0])
+    assert "perturbation 0.100" in warm.report()
+    assert pytest.fuzzy_equal(result, expected, rtol=0.05, atol=1e-3)
+
+
+def test_kpm_stats(model):
+    """The stats have a per-phase time breakdown and memory traffic estimates"""
+    kpm = pb.kpm(model, silent=True)
+    kpm.calc_dos(np.linspace(-1, 1, 10), broadening=0.1, num_random=2)
+
+    stats = kpm.stats
+    assert stats["num_moments"] > 0
+    assert stats["bytes_per_iteration"] > stats["vector_memory"]
+    assert stats["time"]["spmv"] > 0
+    assert set(stats["time"]) >= {"bounds", "reorder", "convert", "starter", "spmv",
+                                  "collect", "reconstruct"}
+    assert len(stats["thread_busy_time"]) > 0
+    assert 0 < stats["thread_balance"] <= 1
+    assert "Phase times" in kpm.report()
+
+
+def test_dos_target_error():
+    """The stochastic DOS stops adding random vectors once the target error is reached"""
+    model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(10))
+    kpm = pb.kpm(model, silent=True)
+    energy = np.linspace(-1, 1, 10)
+
+    expected = kpm.calc_dos(energy, broadening=0.1, num_random=64)
+    assert kpm.stats["num_random"] == 64
+    full_error = kpm.stats["stochastic_error"]
+
+    dos = kpm.calc_dos(energy, broadening=0.1, num_random=64, target_error=4 * full_error)
+    assert kpm.stats["num_random"] < 64
+    assert kpm.stats["stochastic_error"] <= 4 * full_error
+    assert pytest.fuzzy_equal(dos, expected, rtol=0.5, atol=0.1)
+    assert "Stochastic error" in kpm.report()
+
+
+def test_kpm_auto_tune(model, tmpdir):
+    """The auto-tuned matrix format and algorithm don't change the results"""
+    energy = np.linspace(-1, 1, 10)
+    expected = pb.kpm(model, silent=True).calc_ldos(energy, 0.1, [0, 0])
+
+    cache_file = str(tmpdir.join("tuning.txt"))
+    for _ in range(2):  # the second run is served from the cache
+        kpm = pb.kpm(model, auto_tune=True, tuning_cache_file=cache_file, silent=True)
+        ldos = kpm.calc_ldos(energy, 0.1, [0, 0])
+        assert pytest.fuzzy_equal(ldos.data, expected.data, rtol=1e-3, atol=1e-6)
+    assert tmpdir.join("tuning.txt").check()
+
+
 def test_ldos_sublattice():
     """LDOS for A and B sublattices should be antisymmetric for graphene with a mass term"""
     model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(10), graphene.mass_term(1))
@@ -123,6 +261,348 @@ def test_ldos_sublattice():
     assert pytest.fuzzy_equal(a.data, b.data[::-1], rtol=1e-3, atol=1e-6)
 
 
+def test_spatial_ldos_multiorbital():
+    """The spatial LDOS of a multi-orbital site is the LDOS summed over its orbitals"""
+    model = pb.Model(group6_tmd.monolayer_3band("MoS2"), pb.rectangle(3))
+    kpm = pb.kpm(model, silent=True)
+    energy = np.linspace(-1, 1, 10)
+    broadening = 0.2
+
+    spatial_ldos = kpm.calc_spatial_ldos(energy, broadening, pb.circle(0.5))
+    assert spatial_ldos.data.shape[0] == energy.size
+    assert spatial_ldos.data.shape[1] == spatial_ldos.structure.num_sites
+    assert spatial_ldos.data.shape[1] > 1
+    for position in spatial_ldos.structure.xyz[:3]:
+        expected = kpm.calc_ldos(energy, broadening, position, reduce=True)
+        assert pytest.fuzzy_equal(spatial_ldos.ldos(position).data, expected.data,
+                                  rtol=1e-3, atol=1e-6)
+
+
+def test_spatial_ldos_symmetry():
+    """Copying the LDOS of symmetry-equivalent sites doesn't change the result"""
+    model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(1))
+    kpm = pb.kpm(model, silent=True)
+    energy = np.linspace(-1, 1, 10)
+    shape = pb.circle(0.6)
+
+    expected = kpm.calc_spatial_ldos(energy, 0.2, shape)
+    for symmetry in [True, [[[-1, 0], [0, 1]]]]:
+        result = kpm.calc_spatial_ldos(energy, 0.2, shape, symmetry=symmetry)
+        assert pytest.fuzzy_equal(result.data, expected.data, rtol=1e-3, atol=1e-6)
+
+    with pytest.raises(ValueError):
+        kpm.calc_spatial_ldos(energy, 0.2, shape, num_random=1, symmetry=True)
+
+
+def test_spatial_ldos_precision():
+    """The reduced precision maps are close to the double precision one"""
+    model = pb.Model(group6_tmd.monolayer_3band("MoS2"), pb.rectangle(3))
+    kpm = pb.kpm(model, ldos_chunk_size=5, silent=True)  # chunks split the 3-orbital sites
+    energy = np.linspace(-1, 1, 10)
+    shape = pb.circle(0.5)
+
+    expected = kpm.calc_spatial_ldos(energy, 0.2, shape)
+    single = kpm.calc_spatial_ldos(energy, 0.2, shape, precision="single")
+    fixed = kpm.calc_spatial_ldos(energy, 0.2, shape, precision="fixed16")
+    assert single.data.dtype == np.float32
+    assert fixed.data.dtype == np.int16
+    assert fixed.scales.size == expected.structure.num_sites
+
+    peak = abs(expected.data).max()
+    for result in (single, fixed):
+        assert result.data.shape == expected.data.shape
+        smap, expected_smap = result.structure_map(0.5), expected.structure_map(0.5)
+        assert np.allclose(smap.data, expected_smap.data, rtol=0, atol=1e-4 * peak)
+        position = expected.structure.xyz[0]
+        ldos, expected_ldos = result.ldos(position), expected.ldos(position)
+        assert np.allclose(ldos.data, expected_ldos.data, rtol=0, atol=1e-4 * peak)
+
+    with pytest.raises(ValueError):
+        kpm.calc_spatial_ldos(energy, 0.2, shape, precision="half")
+
+
+def test_spatial_ldos_stochastic():
+    """The stochastic spatial LDOS adds up to the DOS of all the sites"""
+    model = pb.Model(graphene.monolayer(), pb.rectangle(3))
+    kpm = pb.kpm(model, silent=True)
+    energy = np.linspace(-2, 2, 20)
+    shape = pb.rectangle(3)
+
+    exact = kpm.calc_spatial_ldos(energy, 0.3, shape)
+    stochastic = kpm.calc_spatial_ldos(energy, 0.3, shape, num_random=16)
+    assert stochastic.data.shape == exact.data.shape
+    total, expected = stochastic.data.sum(axis=1), exact.data.sum(axis=1)
+    assert np.linalg.norm(total - expected) < 0.1 * np.linalg.norm(expected)
+
+
+def test_projected_dos():
+    """The projections share the random vectors: together they add up to the DOS"""
+    model = pb.Model(group6_tmd.monolayer_3band("MoS2"), pb.rectangle(3))
+    kpm = pb.kpm(model, silent=True)
+    energy = np.linspace(-1, 1, 10)
+    dos = kpm.calc_dos(energy, 0.2, num_random=4)
+
+    sublattices = kpm.calc_projected_dos(energy, 0.2, num_random=4)
+    assert list(sublattices) == ["Mo"]  # the 3-band model has only the metal sites
+    assert np.allclose(sublattices["Mo"].data, dos.data, rtol=1e-3, atol=1e-5)
+
+    orbitals = kpm.calc_projected_dos(energy, 0.2, "orbital", num_random=4)
+    assert sorted(orbitals) == ["Mo[0]", "Mo[1]", "Mo[2]"]
+    assert np.allclose(sum(o.data for o in orbitals.values()), sublattices["Mo"].data,
+                       rtol=1e-3, atol=1e-5)
+
+    x = model.system.x
+    halves = kpm.calc_projected_dos(energy, 0.2, dict(left=x < 0, right=x >= 0), num_random=4)
+    assert np.allclose(halves["left"].data + halves["right"].data, dos.data,
+                       rtol=1e-3, atol=1e-5)
+
+    with pytest.raises(ValueError):
+        kpm.calc_projected_dos(energy, 0.2, "spin")
+
+
+def test_probing_ldos():
+    """Probing colors far apart enough give the exact LDOS of every site"""
+    model = pb.Model(graphene.monolayer(), pb.rectangle(1))
+    kpm = pb.kpm(model, silent=True)
+    energy = np.linspace(-2, 2, 20)
+
+    exact = kpm.calc_spatial_ldos(energy, 0.3, pb.rectangle(1))
+    probing = kpm.calc_probing_ldos(energy, 0.3, distance=model.system.num_sites)
+    assert probing.data.shape == exact.data.shape
+    assert np.allclose(probing.data.sum(axis=1), exact.data.sum(axis=1), rtol=1e-3, atol=1e-5)
+
+    approximate = kpm.calc_probing_ldos(energy, 0.3, distance=2)
+    assert approximate.data.shape == exact.data.shape
+
+
+def test_local_charge():
+    """The diagonal of the KPM density matrix matches the exact diagonalization"""
+    model = pb.Model(graphene.monolayer(), pb.rectangle(1.2))
+    kpm = pb.kpm(model, silent=True)
+    temperature, mu = 1000, 0.5
+
+    charge = kpm.calc_local_charge(mu, temperature, broadening=0.01)
+    assert charge.data.shape == (model.system.num_sites,)
+
+    eigenvalues, eigenvectors = np.linalg.eigh(model.hamiltonian.toarray())
+    occupation = 1 / (1 + np.exp((eigenvalues - mu) / (8.6173303e-5 * temperature)))
+    expected = np.abs(eigenvectors) ** 2 @ occupation
+    assert pytest.fuzzy_equal(charge.data, expected, rtol=1e-2, atol=1e-3)
+
+    stochastic = kpm.calc_local_charge(mu, temperature, broadening=0.01, num_random=256)
+    assert np.linalg.norm(stochastic.data - expected) < 0.2 * np.linalg.norm(expected)
+
+
+def test_concurrent_calls():
+    """Several Python threads share a single KPM object and its Hamiltonian"""
+    from concurrent.futures import ThreadPoolExecutor
+
+    model = pb.Model(graphene.monolayer(), pb.rectangle(6))
+    kpm = pb.kpm(model, silent=True)
+    energy = np.linspace(-1, 1, 20)
+    positions = [[0, 0], [0.5, 0], [0, 0.5], [0, 0]]
+
+    expected = [kpm.calc_ldos(energy, 0.1, p).data for p in positions]
+    with ThreadPoolExecutor(max_workers=4) as executor:
+        results = list(executor.map(lambda p: kpm.calc_ldos(energy, 0.1, p).data, positions))
+    for r, e in zip(results, expected):
+        assert pytest.fuzzy_equal(r, e)
+
+
+def test_result_buffers():
+    """Results and the Hamiltonian are handed to NumPy without copies"""
+    model = pb.Model(graphene.monolayer(), pb.rectangle(1.2))
+    assert np.shares_memory(model.hamiltonian.data, model.hamiltonian.data)
+
+    kpm = pb.kpm(model, silent=True)
+    energy = np.linspace(0, 0.5, 10)
+    deferred = kpm.deferred_dos(energy, broadening=0.15)
+    deferred.compute()
+    assert np.shares_memory(deferred.result, deferred.result)
+
+    block = kpm.calc_greens_block([0, 1], [0, 1, 2], energy, broadening=0.15)
+    assert block.shape == (2, 3, 10) and block.flags.c_contiguous
+    assert pytest.fuzzy_equal(block[1], kpm.calc_greens(1, [0, 1, 2], energy, broadening=0.15))
+
+
+def test_kpm_moments(tmpdir):
+    """Saved moments reconstruct the same results without a new KPM calculation"""
+    model = pb.Model(graphene.monolayer(), pb.rectangle(2))
+    kpm = pb.kpm(model, silent=True)
+    energy = np.linspace(0, 0.5, 10)
+
+    moments = kpm.calc_dos_moments(broadening=0.15, num_random=4)
+    assert moments.kind == "dos" and moments.data.shape == (moments.num_moments, 1)
+    assert moments.scaling_factors == kpm.scaling_factors
+    dos = kpm.calc_dos(energy, broadening=0.15, num_random=4)
+    assert pytest.fuzzy_equal(moments.reconstruct(energy), dos)
+
+    filename = str(tmpdir.join("moments.npz"))
+    moments.save(filename)
+    loaded = pb.chebyshev.KPMMoments.load(filename)
+    assert loaded.kind == "dos" and np.array_equal(loaded.data, moments.data)
+    assert pytest.fuzzy_equal(loaded.reconstruct(energy), dos)
+
+    # A wider broadening only needs the first moments
+    moments = kpm.calc_ldos_moments(broadening=0.15, position=[0, 0])
+    ldos = kpm.calc_ldos(energy, broadening=0.3, position=[0, 0])
+    assert pytest.fuzzy_equal(moments.reconstruct(energy, broadening=0.3), ldos)
+    assert moments.truncated(10).num_moments == 10
+    with pytest.raises(ValueError) as excinfo:
+        moments.reconstruct(energy, broadening=0.01)
+    assert "requires" in str(excinfo.value)
+
+    moments = kpm.calc_greens_moments(0, [0, 1], broadening=0.15)
+    greens = kpm.calc_greens(0, [0, 1], energy, broadening=0.15)
+    assert pytest.fuzzy_equal(moments.reconstruct(energy), greens)
+
+
+def test_kpm_dos_k():
+    """The k-point DOS integrates to the number of states per unit cell"""
+    model = pb.Model(graphene.monolayer(), pb.primitive(4, 4), pb.translational_symmetry())
+    kpm = pb.kpm(model, silent=True)
+    a, b = kpm.scaling_factors
+    energy = np.linspace(b - 0.95 * a, b + 0.95 * a, 200)
+
+    k_points = [[0, 0], [0.5, -1], [1, 2]]
+    dos = kpm.calc_dos_k(energy, broadening=0.3, k_points=k_points, num_random=2)
+    assert dos.data.shape == energy.shape
+    num_states = dos.data.sum() * (energy[1] - energy[0])
+    assert abs(num_states - model.system.num_sites) < 0.05 * model.system.num_sites
+
+    single = kpm.calc_dos_k(energy, broadening=0.3, k_points=[0.5, -1], num_random=2)
+    model.set_wave_vector([0.5, -1, 0])
+    expected = pb.kpm(model, silent=True).calc_dos(energy, broadening=0.3, num_random=2)
+    assert pytest.fuzzy_equal(single, expected)
+
+
+def test_kpm_spectral_function():
+    """Each normalized plane wave integrates to a single state"""
+    model = pb.Model(graphene.monolayer(), pb.rectangle(1.2))
+    kpm = pb.kpm(model, silent=True)
+    a, b = kpm.scaling_factors
+    energy = np.linspace(b - 0.95 * a, b + 0.95 * a, 200)
+
+    k_points = [[0, 0], [3, -1], [10, 5]]
+    spectral = kpm.calc_spectral_function(k_points, energy, broadening=0.2)
+    assert spectral.data.shape == (len(k_points), energy.size)
+    num_states = spectral.data.sum(axis=1) * (energy[1] - energy[0])
+    assert num_states == pytest.approx(1, rel=0.05)
+
+    single = kpm.calc_spectral_function([3, -1], energy, broadening=0.2)
+    assert pytest.fuzzy_equal(single.data[0], spectral.data[1], rtol=1e-3, atol=1e-6)
+
+
+def test_kpm_deterministic():
+    """The stochastic moments don't depend on the number of threads"""
+    model = pb.Model(graphene.monolayer(), pb.rectangle(1.2))
+    energy = np.linspace(-2, 2, 50)
+    dos = [pb.kpm(model, energy_range=(-9, 9), num_threads=n, deterministic=True, silent=True)
+           .calc_dos(energy, broadening=0.1, num_random=11).data for n in (1, 3)]
+    assert np.array_equal(dos[0], dos[1])
+
+
+def test_kpm_ensemble():
+    """The ensemble moments are the average of separate disorder realizations"""
+    def factory(n):
+        return pb.Model(graphene.monolayer(), pb.rectangle(1.2), pb.anderson_disorder(1, seed=n))
+
+    kpm = pb.kpm(factory(0), energy_range=(-9, 9), silent=True)
+    ensemble = kpm.ensemble_dos_moments(factory, 3, broadening=0.1, num_random=2,
+                                        bounds_margin=0)
+    expected = np.mean([pb.kpm(factory(n), energy_range=(-9, 9), silent=True)
+                        .calc_dos_moments(broadening=0.1, num_random=2).data
+                        for n in range(3)], axis=0)
+    assert ensemble.kind == "dos"
+    assert pytest.fuzzy_equal(ensemble.data, expected)
+
+    with pytest.raises(RuntimeError) as excinfo:
+        pb.kpm(factory(0), energy_range=(-1, 1), silent=True).ensemble_dos_moments(
+            factory, 2, broadening=0.1, bounds_margin=0)
+    assert "doesn't fit" in str(excinfo.value)
+
+
+def test_kpm_checkpoint(tmpdir):
+    """Checkpointed moments can be extended, also after a restart"""
+    model = pb.Model(graphene.monolayer(), pb.rectangle(2))
+    kpm = pb.kpm(model, silent=True)
+    expected = kpm.calc_ldos_moments(broadening=0.05, position=[0, 0])
+
+    moments = kpm.calc_ldos_moments(broadening=0.2, position=[0, 0], checkpoint=True)
+    assert moments.checkpoint.num_moments == moments.num_moments
+    with pytest.raises(ValueError) as excinfo:
+        kpm.extend_moments(expected, expected.num_moments)
+    assert "checkpoint" in str(excinfo.value)
+
+    filename = str(tmpdir.join("moments.pbz"))
+    pb.save(moments, filename)
+    loaded = pb.load(filename)
+    extended = kpm.extend_moments(loaded, expected.num_moments)
+    assert extended.kind == "ldos" and extended.num_moments == expected.num_moments
+    assert pytest.fuzzy_equal(extended.data, expected.data)
+
+    moments = kpm.calc_dos_moments(broadening=0.2, num_random=2, checkpoint=True)
+    extended = kpm.extend_moments(moments, expected.num_moments)
+    expected = kpm.calc_dos_moments(broadening=0.05, num_random=2)
+    assert pytest.fuzzy_equal(extended.data, expected.data)
+
+
+def test_kpm_quantized():
+    """The lossy formats are compared with a full precision reference on a small sample"""
+    model = pb.Model(graphene.monolayer(), pb.rectangle(3))
+    for matrix_format in ["ELL_BF16", "ELL_INT8"]:
+        kpm = pb.kpm(model, matrix_format=matrix_format, silent=True)
+        error = kpm.quantization_error(broadening=0.15, num_random=2)
+        assert error["matrix_format"] == matrix_format
+        assert error["num_random"] == 2 and error["num_moments"] > 0
+        assert 0 <= error["rms_error"] <= error["max_error"] < 0.25
+
+
+def test_traced(tmpdir):
+    """The stages of a KPM calculation are recorded in a Chrome trace"""
+    import json
+
+    filename = str(tmpdir.join("trace.json"))
+    with pb.utils.traced(filename) as trace:
+        model = pb.Model(graphene.monolayer(), pb.rectangle(2))
+        kpm = pb.kpm(model, silent=True)
+        kpm.calc_dos(np.linspace(0, 0.5, 10), broadening=0.15)
+
+    with open(filename) as file:
+        events = json.load(file)["traceEvents"]
+    assert events == json.loads(trace.json)["traceEvents"]
+    names = {e["name"] for e in events}
+    assert {"system", "hamiltonian", "bounds", "moments", "reconstruct"} <= names
+    assert all(e["ph"] == "X" and e["dur"] >= 0 for e in events)
+
+
+def test_metrics(tmpdir):
+    """The live metrics are updated by the KPM calculations and exported in the Prometheus format"""
+    metrics = pb.utils.metrics
+    metrics.reset()
+
+    filename = str(tmpdir.join("metrics.prom"))
+    with metrics.export(filename, interval=0.05):
+        model = pb.Model(graphene.monolayer(), pb.rectangle(2))
+        kpm = pb.kpm(model, silent=True)
+        kpm.calc_dos(np.linspace(0, 0.5, 10), broadening=0.15, num_random=2)
+
+    values = metrics.snapshot()
+    assert values["cpb_kpm_jobs_total"] >= 1
+    assert values["cpb_kpm_moments_total"] > 0
+    assert values["cpb_active_threads"] == 0
+    assert values['cpb_stage_calls_total{stage="job",category="kpm"}'] >= 1
+
+    with open(filename) as file:
+        exported = file.read()
+    assert "# TYPE cpb_kpm_moments_total counter" in exported
+    assert 'cpb_stage_seconds_total{stage="moments",category="kpm"}' in exported
+    assert exported.startswith("# HELP") and metrics.text().startswith("# HELP")
+
+    metrics.reset()
+    assert metrics.snapshot()["cpb_kpm_moments_total"] == 0
+
+
 def test_optimized_hamiltonian():
     """Currently available only in internal interface"""
     from pybinding import _cpp
@@ -178,6 +658,7 @@ def test_conductivity(params, baseline, plot_if_fails):
     configurations = [
         {'matrix_format': "ELL", 'optimal_size': False, 'interleaved': False},
         {'matrix_format': "ELL", 'optimal_size': True, 'interleaved': True},
+        {'matrix_format': "SELL", 'optimal_size': True, 'interleaved': True},
     ]
     model = pb.Model(*params)
 
@@ -195,3 +676,52 @@ def test_conductivity(params, baseline, plot_if_fails):
 
     for result in results:
         assert pytest.fuzzy_equal(result, expected, rtol=1e-2, atol=1e-5)
+
+
+def test_conductivity_directions():
+    """Several directions computed together must match separate calls"""
+    model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(1))
+    kpm = pb.kpm(model, energy_range=[-9, 9], kernel=pb.lorentz_kernel(), silent=True)
+    energy = np.linspace(-2, 2, 5)
+
+    combined = kpm.calc_conductivity(energy, broadening=0.5, temperature=0,
+                                     direction=["xx", "xy"], num_random=1, num_points=50)
+    assert len(combined) == 2
+    for result, direction in zip(combined, ["xx", "xy"]):
+        separate = kpm.calc_conductivity(energy, broadening=0.5, temperature=0,
+                                         direction=direction, num_random=1, num_points=50)
+        assert pytest.fuzzy_equal(result, separate, rtol=1e-3, atol=1e-6)
+
+
+def test_greenwood_conductivity():
+    """Fewer chemical potentials per pass must not change the result"""
+    model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(1))
+    energy = np.linspace(-2, 2, 5)
+    results = [pb.kpm(model, energy_range=[-9, 9], kernel=pb.lorentz_kernel(), silent=True,
+                      conductivity_block_size=block_size)
+               .calc_greenwood_conductivity(energy, broadening=0.5, num_random=1)
+               for block_size in [0, 2]]
+    assert results[0].data.shape == energy.shape
+    assert pytest.fuzzy_equal(results[1], results[0], rtol=1e-3, atol=1e-6)
+
+    with pytest.raises(RuntimeError) as excinfo:
+        pb.kpm(model, silent=True).calc_greenwood_conductivity(energy, 0.5, direction="xy")
+    assert "Invalid direction" in str(excinfo.value)
+
+
+def test_out_of_core(tmpdir):
+    """Streaming the Hamiltonian from a file must match the in-memory calculation"""
+    model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(1))
+    filename = str(tmpdir.join("hamiltonian.pbbin"))
+    pb.system.save_binary(filename, model)
+
+    energy = np.linspace(-2, 2, 25)
+    out_of_core = pb.kpm_out_of_core(filename, energy_range=[-9, 9], silent=True)
+    in_memory = pb.kpm(model, energy_range=[-9, 9], matrix_format="CSR", optimal_size=False,
+                       interleaved=False, silent=True)
+    assert out_of_core.scaling_factors == pytest.approx(in_memory.scaling_factors)
+
+    dos = out_of_core.calc_dos(energy, broadening=0.5, num_random=4)
+    expected = in_memory.calc_dos(energy, broadening=0.5, num_random=4)
+    assert out_of_core.stats["matrix_format"] == "MAPPED"
+    assert pytest.fuzzy_equal(dos, expected, rtol=1e-3, atol=1e-6)
@@ -105,3 +105,35 @@ def test_attach():
     model.add(linear_onsite())
     assert model.leads[0].h0.diagonal().max() < model.hamiltonian.diagonal().min()
     assert model.hamiltonian.diagonal().max() < model.leads[1].h0.diagonal().min()
+
+
+def test_self_energy(square_model):
+    square_model.attach_lead(-1, pb.line([0, -1.5], [0, 1.5]))
+    lead = square_model.leads[0]
+    engine = square_model.leads.self_energy(broadening=1e-6)
+    assert len(engine) == 1
+
+    energies = np.linspace(-3, 3, 7)
+    greens = engine.surface_greens(0, energies)
+    assert len(greens) == 7 and engine.cache_size == 7
+
+    h0, h1 = lead.h0.toarray(), lead.h1.toarray()
+    for energy, g in zip(energies, greens):
+        z = (energy + 1e-6j) * np.eye(h0.shape[0])
+        assert np.allclose(g, np.linalg.inv(z - h0 - h1.conj().T @ g @ h1), atol=1e-4)
+
+    sigma = engine.self_energy(0, energies[:2])
+    assert engine.cache_size == 7
+    assert np.allclose(sigma[1], h1.conj().T @ greens[1] @ h1)
+
+
+def test_transmission(square_model):
+    square_model.attach_lead(-1, pb.line([0, -1.5], [0, 1.5]))
+    square_model.attach_lead(+1, pb.line([0, -1.5], [0, 1.5]))
+
+    # A clean wire: the transmission is the number of open transverse channels
+    self_energy = square_model.leads.self_energy()
+    energies = [-3, 0, 3.2, 3.5]
+    t = square_model.transmission(energies, self_energy=self_energy)
+    assert np.allclose(t, [1, 3, 1, 0], atol=1e-4)
+    assert np.allclose(square_model.transmission(energies, 1, 0, self_energy), t, atol=1e-4)
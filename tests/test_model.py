@@ -37,6 +37,23 @@ def test_report(model):
     report = model.report()
     assert "2 lattice sites" in report
     assert "2 non-zero values" in report
+    assert "Memory:" in report
+
+
+def test_memory_estimate():
+    model = pb.Model(graphene.monolayer(), pb.primitive(10, 10))
+    estimate = model.estimate_memory()
+    assert estimate["num_sites"] == 200
+    assert estimate["peak"] >= estimate["system"] + estimate["hamiltonian"]
+
+    assert model.hamiltonian.nnz <= estimate["hamiltonian_nnz"]
+    usage = model.memory_usage
+    assert 0 < usage["hamiltonian"]["size"] <= estimate["hamiltonian"]
+    assert usage["system"]["size"] > 0
+
+    kpm_estimate = pb.chebyshev.estimate_kpm_memory(model, num_moments=100, num_results=4)
+    assert kpm_estimate["moments"] == 100 * 4 * model.hamiltonian.dtype.itemsize
+    assert kpm_estimate["peak"] >= kpm_estimate["matrix"] + kpm_estimate["vectors"]
 
 
 def test_hamiltonian(model):
@@ -57,10 +74,49 @@ def test_hamiltonian(model):
     assert "read-only" in str(excinfo.value)
 
     h2 = model.hamiltonian
-    assert h2.data is not h.data
+    assert h2 is h
     assert point_to_same_memory(h2.data, h.data)
 
 
+def test_hamiltonian_view_cache():
+    """The scipy view is reused until the Hamiltonian is rebuilt and outlives the model"""
+    model = pb.Model(graphene.monolayer(), pb.translational_symmetry())
+    h = model.hamiltonian
+    assert model.hamiltonian is h
+    expected = h.toarray()
+
+    model.set_wave_vector([0.1, 0.2])
+    h_k = model.hamiltonian
+    assert h_k is not h
+    assert model.hamiltonian is h_k
+    assert pytest.fuzzy_equal(h.toarray(), expected)
+
+    del model
+    assert pytest.fuzzy_equal(h.toarray(), expected)
+    assert h_k.nnz > 0
+
+
+def test_with_modifiers():
+    @pb.onsite_energy_modifier
+    def potential(energy):
+        return energy + 1
+
+    model = pb.Model(graphene.monolayer(), pb.rectangle(1))
+    derived = model.with_modifiers(potential)
+    assert point_to_same_memory(derived.system.x, model.system.x)
+    assert derived.lattice is model.lattice and derived.shape is model.shape
+    assert pytest.fuzzy_equal(derived.hamiltonian.diagonal(), 1)
+    assert model.hamiltonian.diagonal().sum() == 0
+
+    @pb.site_state_modifier
+    def remove_first(state):
+        state[0] = False
+        return state
+
+    modified = model.with_modifiers(remove_first)
+    assert modified.system.num_sites < model.system.num_sites
+
+
 def test_multiorbital_hamiltonian():
     """For multi-orbital lattices the Hamiltonian size is larger than the number of sites"""
     def lattice():
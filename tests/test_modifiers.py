@@ -295,6 +295,31 @@ def test_hopping_energy():
     assert model.hamiltonian.dtype == np.complex128
 
 
+def test_indexed_hopping_energy():
+    """Indexed modifiers gather the positions from the site indices: same result"""
+    def linear(energy, x1, x2):
+        return energy * (1 + 0.1 * (x1 + x2))
+
+    model = pb.Model(graphene.monolayer(), pb.rectangle(2, 2), pb.translational_symmetry(a1=True),
+                     pb.hopping_energy_modifier(linear))
+    expected = model.hamiltonian.toarray()
+    model = pb.Model(graphene.monolayer(), pb.rectangle(2, 2), pb.translational_symmetry(a1=True),
+                     pb.hopping_energy_modifier(indexed=True)(linear))
+    assert pytest.fuzzy_equal(model.hamiltonian.toarray(), expected)
+
+    capture = {}
+
+    @pb.hopping_energy_modifier(indexed=True)
+    def check_args(energy, row, col, hop_id):
+        capture[hop_id] = row.copy(), col.copy(), row.flags.writeable
+        return energy
+
+    model = build_model(check_args)
+    row, col, writeable = capture["t"]
+    assert not writeable
+    assert np.allclose(model.hamiltonian.toarray()[row, col], graphene.t)
+
+
 def test_site_generator():
     """Generated some disordered sites"""
     @pb.site_generator("New", energy=0.4)
@@ -660,3 +685,68 @@ def test_hopping_buffer():
     assert energies[0].shape == (6250, 4, 4)
     for energy in energies:
         assert np.argwhere(energy == 99).size == 0
+
+
+def test_native_modifiers():
+    """Native modifiers should match the equivalent Python modifiers"""
+    def make_model(*params):
+        return pb.Model(graphene.monolayer(), pb.rectangle(2), *params)
+
+    def assert_same(native, python):
+        h1, h2 = make_model(native).hamiltonian, make_model(python).hamiltonian
+        assert h1.dtype == h2.dtype
+        assert pytest.fuzzy_equal(h1.toarray(), h2.toarray(), rtol=1e-4, atol=1e-6)
+
+    assert_same(pb.constant_magnetic_field(10), graphene.constant_magnetic_field(10))
+    assert_same(pb.strained_hopping(graphene.beta, graphene.a_cc),
+                graphene.modifiers.strained_hopping)
+
+    @pb.onsite_energy_modifier
+    def electric_field(energy, x, y):
+        return energy + 0.1 * x - 0.2 * y
+    assert_same(pb.constant_electric_field([0.1, -0.2, 0]), electric_field)
+
+    disorder = make_model(pb.anderson_disorder(width=2, seed=1)).hamiltonian.diagonal()
+    assert np.all(disorder >= -1) and np.all(disorder < 1)
+    assert np.unique(disorder).size == disorder.size
+    same = make_model(pb.anderson_disorder(width=2, seed=1)).hamiltonian.diagonal()
+    assert np.array_equal(disorder, same)
+    other = make_model(pb.anderson_disorder(width=2, seed=2)).hamiltonian.diagonal()
+    assert not np.array_equal(disorder, other)
+
+
+def test_expression_modifiers():
+    """Compiled expressions should match the equivalent Python modifiers"""
+    def make_model(*params):
+        return pb.Model(graphene.monolayer(), pb.rectangle(2), *params)
+
+    def assert_same(native, python):
+        h1, h2 = make_model(native).hamiltonian, make_model(python).hamiltonian
+        assert h1.dtype == h2.dtype
+        assert pytest.fuzzy_equal(h1.toarray(), h2.toarray(), rtol=1e-4, atol=1e-6)
+
+    @pb.onsite_energy_modifier
+    def gaussian(energy, x, y, sub_id):
+        return energy + 0.2 * np.exp(-(x**2 + y**2) / 2) * (sub_id == "A")
+    assert_same(pb.onsite_expression("V * exp(-(x**2 + y**2) / 2) * (sub_id == 'A')", V=0.2),
+                gaussian)
+
+    @pb.hopping_energy_modifier
+    def linear(energy, x1, x2):
+        return energy * (1 + 0.1 * abs(x1 - x2))
+    assert_same(pb.hopping_expression("1 + k * abs(x1 - x2)", k=0.1), linear)
+
+    with pytest.raises(ValueError) as excinfo:
+        pb.onsite_expression("energy * 2")
+    assert "unknown name 'energy'" in str(excinfo.value)
+
+
+def test_random_vacancies():
+    def make_model(seed):
+        return pb.Model(graphene.monolayer(), pb.rectangle(20), pb.random_vacancies(0.2, seed))
+
+    pristine = pb.Model(graphene.monolayer(), pb.rectangle(20))
+    vacancies = make_model(seed=1)
+    assert 0.7 < vacancies.system.num_sites / pristine.system.num_sites < 0.9
+    assert np.array_equal(vacancies.system.x, make_model(seed=1).system.x)
+    assert vacancies.system.num_sites != make_model(seed=2).system.num_sites
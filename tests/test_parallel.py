@@ -1,3 +1,4 @@
+import sys
 import pytest
 
 import numpy as np
@@ -50,3 +51,89 @@ def test_ndsweep(baseline):
 
     expected = baseline(result)
     assert pytest.fuzzy_equal(result, expected, rtol=1e-3, atol=1e-6)
+
+
+def test_deferred_kpm():
+    model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(side_width=10))
+    kpm = pb.kpm(model, kernel=pb.lorentz_kernel())
+    energy = np.linspace(0, 0.5, 10)
+
+    deferred = kpm.deferred_dos(energy, broadening=0.15, num_random=4)
+    deferred.compute()
+    assert deferred.result.shape == energy.shape
+    assert np.all(deferred.result > 0)
+
+    deferred = kpm.deferred_greens(0, 0, energy, broadening=0.15)
+    deferred.compute()
+    expected = kpm.calc_greens(0, 0, energy, broadening=0.15)
+    assert pytest.fuzzy_equal(deferred.result, expected, rtol=1e-4, atol=1e-6)
+
+
+def test_deferred_solver():
+    model = pb.Model(graphene.monolayer(), pb.rectangle(1.2))
+    solver = pb.solver.lapack(model)
+    energy = np.linspace(-1, 1, 10)
+
+    deferred = solver.deferred_dos(energy, broadening=0.1)
+    deferred.compute()
+    expected = solver.calc_dos(energy, broadening=0.1)
+    assert pytest.fuzzy_equal(deferred.result, expected.data)
+
+
+@pytest.mark.skipif(sys.platform == "win32", reason="requires the 'fork' start method")
+def test_process_backend():
+    """The process backend gives the same results as the threads, also for Python modifiers"""
+    def make_factory(backend):
+        @pb.parallelize(v=np.linspace(0, 0.1, 4), num_threads=2, backend=backend)
+        def factory(v, energy=np.linspace(0, 0.1, 10)):
+            @pb.onsite_energy_modifier
+            def potential(energy, x):
+                return energy + v * x
+
+            model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(side_width=5), potential)
+            kpm = pb.kpm(model, kernel=pb.lorentz_kernel(), num_threads=1, silent=True)
+            return kpm.deferred_ldos(energy, broadening=0.15, position=[0, 0])
+
+        silence_parallel_output(factory)
+        return factory
+
+    threads = pb.parallel.ndsweep(make_factory("threads"))
+    processes = pb.parallel.ndsweep(make_factory("processes"))
+    assert pytest.fuzzy_equal(processes, threads, rtol=1e-4, atol=1e-6)
+
+    with pytest.raises(ValueError):
+        pb.parallelize(v=[0], backend="mpi")(lambda v: None)
+
+
+def test_native_sweep():
+    """The native engine matches a calculation of each point in Python"""
+    energy = np.linspace(0, 0.1, 10)
+    potentials = np.linspace(0, 0.1, 4)
+
+    def make_model(*params):
+        return pb.Model(graphene.monolayer(), graphene.hexagon_ac(side_width=5), *params)
+
+    kpm = pb.kpm(make_model(), kernel=pb.lorentz_kernel())
+    result = pb.parallel.native_sweep(kpm, dict(v=potentials), [pb.parallel.sweep_onsite("v")],
+                                      energy, broadening=0.15, position=[0, 0], sublattice="B",
+                                      num_threads=2)
+    assert isinstance(result, pb.results.Sweep)
+    assert result.data.shape == (potentials.size, energy.size)
+
+    for v, data in zip(potentials, result.data):
+        point = pb.kpm(make_model(pb.onsite_expression("v", v=v)), kernel=pb.lorentz_kernel())
+        expected = point.calc_ldos(energy, broadening=0.15, position=[0, 0], sublattice="B")
+        assert pytest.fuzzy_equal(data, expected.data, rtol=1e-4, atol=1e-6)
+
+    fields = [0, 10, 20]
+    nd = pb.parallel.native_sweep(kpm, dict(v=potentials, b=fields),
+                                  [pb.parallel.sweep_onsite("v"),
+                                   pb.parallel.sweep_magnetic_field("b")],
+                                  energy, broadening=0.15, num_random=2, num_threads=2)
+    assert isinstance(nd, pb.results.NDSweep)
+    assert nd.data.shape == (potentials.size, len(fields), energy.size)
+
+    with pytest.raises(ValueError) as excinfo:
+        pb.parallel.native_sweep(kpm, dict(v=potentials), [pb.parallel.sweep_magnetic_field("b")],
+                                 energy, broadening=0.15)
+    assert "no parameter named 'b'" in str(excinfo.value)
@@ -74,6 +74,24 @@ def test_spatial_ldos(solver, baseline, plot_if_fails):
     assert pytest.fuzzy_equal(ldos_map, expected, rtol=1e-2, atol=1e-5)
 
 
+def test_windowed_dos(solver):
+    """The native DOS and spatial LDOS skip distant states: compare with the full sums"""
+    broadening = 0.01
+    scale = 1 / (broadening * np.sqrt(2 * np.pi))
+    eigenvalues, psi2 = solver.eigenvalues, np.abs(solver.eigenvectors)**2
+
+    energies = np.linspace(-0.1, 0.1, 41)
+    delta = eigenvalues[:, np.newaxis] - energies
+    expected = scale * np.sum(np.exp(-0.5 * delta**2 / broadening**2), axis=0)
+    assert np.allclose(solver.impl.calc_dos(energies, broadening, num_threads=2), expected)
+    assert np.allclose(solver.impl.calc_dos(energies, broadening, num_threads=1), expected)
+
+    gaussian = np.exp(-0.5 * (eigenvalues - 0.05)**2 / broadening**2)
+    expected = scale * np.sum(psi2 * gaussian, axis=1)
+    assert np.allclose(solver.impl.calc_spatial_ldos(0.05, broadening, num_threads=2), expected,
+                       rtol=1e-4, atol=1e-6)
+
+
 def test_lapack(baseline, plot_if_fails):
     model = pb.Model(graphene.monolayer(), pb.translational_symmetry())
     solver = pb.solver.lapack(model)
@@ -89,3 +107,120 @@ def test_lapack(baseline, plot_if_fails):
     expected = baseline(bands)
     plot_if_fails(bands, expected, 'plot')
     assert pytest.fuzzy_equal(bands, expected, 2.e-2, 1.e-6)
+
+
+def test_lapack_native():
+    """The native dense solver matches `scipy.linalg.eigh()`"""
+    from scipy.linalg import eigh
+
+    model = pb.Model(graphene.monolayer(), pb.rectangle(1.5), pb.force_double_precision(),
+                     pb.constant_magnetic_field(1e3))
+    expected = eigh(model.hamiltonian.toarray(), eigvals_only=True)
+
+    solver = pb.solver.lapack(model)
+    assert isinstance(solver.impl, pb._cpp.DenseSolver)
+    assert pytest.fuzzy_equal(solver.eigenvalues, expected, 1e-8, 1e-8)
+    h = model.hamiltonian.toarray()
+    psi = solver.eigenvectors
+    assert np.allclose(h.dot(psi), psi * solver.eigenvalues, atol=1e-8)
+
+    values_only = pb.solver.lapack(model, eigenvalues_only=True)
+    assert pytest.fuzzy_equal(values_only.eigenvalues, expected, 1e-8, 1e-8)
+    assert values_only.eigenvectors.size == 0
+
+    python = pb.solver.lapack(model, check_finite=False)
+    assert pytest.fuzzy_equal(python.eigenvalues, expected, 1e-8, 1e-8)
+
+
+def test_arpack_native():
+    """The native shift-invert solver matches `scipy.sparse.linalg.eigsh()`"""
+    from scipy.sparse.linalg import eigsh
+
+    model = pb.Model(graphene.monolayer(), pb.rectangle(3), pb.force_double_precision(),
+                     pb.constant_magnetic_field(1e3))
+    k, sigma = 8, 0.3
+    expected = np.sort(eigsh(model.hamiltonian, k=k, sigma=sigma, return_eigenvectors=False))
+
+    solver = pb.solver.arpack(model, k=k, sigma=sigma)
+    assert isinstance(solver.impl, pb._cpp.ShiftInvert)
+    assert pytest.fuzzy_equal(solver.eigenvalues, expected, 1e-8, 1e-8)
+    h = model.hamiltonian
+    psi = solver.eigenvectors
+    assert np.allclose(h.dot(psi), psi * solver.eigenvalues, atol=1e-6)
+
+    python = pb.solver.arpack(model, k=k, sigma=sigma, tol=1e-10)
+    assert pytest.fuzzy_equal(python.eigenvalues, expected, 1e-8, 1e-8)
+
+
+def test_warm_start():
+    """A warm start changes the starting subspace but not the results"""
+    def make_model(field):
+        return pb.Model(graphene.monolayer(), pb.rectangle(3), pb.force_double_precision(),
+                        pb.constant_magnetic_field(field))
+
+    solver = pb.solver.arpack(make_model(1e3), k=6, sigma=0.4)
+    assert not solver.warm_start
+    solver.warm_start = True
+    assert solver.warm_start
+    solver.solve()
+
+    solver.model = make_model(1.01e3)
+    expected = pb.solver.lapack(make_model(1.01e3)).eigenvalues
+    expected = np.sort(expected[np.argsort(abs(expected - 0.4))[:6]])
+    assert pytest.fuzzy_equal(solver.eigenvalues, expected, 1e-8, 1e-8)
+
+    python = pb.solver.arpack(make_model(1e3), k=6, sigma=0.4, tol=1e-10)
+    python.warm_start = True
+    assert not python.warm_start
+
+
+def test_eigenvector_selection():
+    model = pb.Model(graphene.monolayer(), pb.rectangle(1.5), pb.force_double_precision())
+    solver = pb.solver.lapack(model)
+    psi = solver.eigenvectors
+
+    selected = solver.eigenvectors_at(sites=[2, 0], states=[1, 3])
+    assert np.array_equal(selected, psi[[2, 0]][:, [1, 3]])
+    assert np.allclose(solver.probability_at(states=5)[:, 0], abs(psi[:, 5])**2)
+    assert solver.probability_at(sites=[1]).shape == (1, psi.shape[1])
+
+    python = pb.solver.lapack(model, check_finite=False)
+    assert np.allclose(python.probability_at(sites=[2, 0], states=[1, 3]),
+                       abs(python.eigenvectors[[2, 0]][:, [1, 3]])**2)
+
+    solver.single_precision_eigenvectors = True
+    solver.model = model
+    assert solver.eigenvectors.dtype == np.float32
+    assert solver.eigenvalues.dtype == np.float64
+    assert np.allclose(abs(solver.eigenvectors), abs(psi), atol=1e-6)
+
+
+def test_chebyshev_filter():
+    model = pb.Model(graphene.monolayer(), pb.rectangle(2), pb.force_double_precision())
+    energy_range = (-1.5, 1)
+    solver = pb.solver.chebyshev_filter(model, energy_range)
+
+    exact = pb.solver.lapack(model).eigenvalues
+    expected = exact[(exact >= energy_range[0]) & (exact <= energy_range[1])]
+    assert pytest.fuzzy_equal(solver.eigenvalues, expected, 1e-8, 1e-8)
+
+    h = model.hamiltonian.toarray()
+    psi = solver.eigenvectors
+    assert np.allclose(h.dot(psi), psi * solver.eigenvalues, atol=1e-5)
+
+
+@pytest.mark.skipif(not hasattr(pb._cpp, 'SlicedFEAST'), reason="compiled without FEAST")
+def test_sliced_feast():
+    """The slices together find every eigenvalue of the range exactly once"""
+    model = pb.Model(graphene.monolayer(), pb.rectangle(3), pb.force_double_precision())
+    energy_range = (-1.5, 1)
+    solver = pb.solver.sliced_feast(model, energy_range, num_slices=4, num_random=16)
+
+    exact = pb.solver.lapack(model).eigenvalues
+    expected = exact[(exact >= energy_range[0]) & (exact <= energy_range[1])]
+    assert pytest.fuzzy_equal(solver.eigenvalues, expected, 1e-8, 1e-8)
+    assert "Slices(4" in solver.report(True)
+
+    h = model.hamiltonian.toarray()
+    psi = solver.eigenvectors
+    assert np.allclose(h.dot(psi), psi * solver.eigenvalues, atol=1e-5)
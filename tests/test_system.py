@@ -32,6 +32,19 @@ def test_pickle_round_trip(model):
     assert pytest.fuzzy_equal(model.system, unpickled)
 
 
+def test_binary_round_trip(model, tmpdir):
+    filename = str(tmpdir.join("system.pbbin"))
+    pb.system.save_binary(filename, model)
+    system, hamiltonian = pb.system.load_binary(filename)
+    assert pytest.fuzzy_equal(model.system, system)
+    assert (hamiltonian != model.hamiltonian).nnz == 0
+
+    pb.system.save_binary(filename, model.system)
+    system, hamiltonian = pb.system.load_binary(filename)
+    assert pytest.fuzzy_equal(model.system, system)
+    assert hamiltonian is None
+
+
 def test_expected(model, baseline, plot_if_fails):
     system = model.system
     expected = baseline(system)
@@ -48,6 +61,10 @@ def test_api():
     assert idx == system.find_nearest(system.xyz[idx], 'B')
     assert system.find_nearest([0, 0], 'A') != system.find_nearest([0, 0], 'B')
 
+    targets = np.column_stack([system.x[::7] + 0.01, system.y[::7] - 0.01])
+    expected = [system.find_nearest(t, 'B') for t in targets]
+    assert np.array_equal(system.find_nearest(targets, 'B'), expected)
+
     with pytest.raises(IndexError) as excinfo:
         system.find_nearest([0, 0], 'invalid_sublattice')
     assert "There is no Site named" in str(excinfo.value)